@@ -32,6 +32,8 @@ bool operator<(const BinaryBasicBlock &LHS, const BinaryBasicBlock &RHS) {
 }
 
 void BinaryBasicBlock::adjustNumPseudos(const MCInst &Inst, int Sign) {
+  // Called for every instruction added to or removed from the block.
+  Hash = 0;
   auto &BC = Function->getBinaryContext();
   if (BC.MII->get(Inst.getOpcode()).isPseudo())
     NumPseudos += Sign;
@@ -431,14 +433,20 @@ void BinaryBasicBlock::addBranchInstruction(const BinaryBasicBlock *Successor) {
   assert(isSuccessor(Successor));
   auto &BC = Function->getBinaryContext();
   MCInst NewInst;
-  BC.MIB->createUncondBranch(NewInst, Successor->getLabel(), BC.Ctx.get());
+  {
+    std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+    BC.MIB->createUncondBranch(NewInst, Successor->getLabel(), BC.Ctx.get());
+  }
   Instructions.emplace_back(std::move(NewInst));
 }
 
 void BinaryBasicBlock::addTailCallInstruction(const MCSymbol *Target) {
   auto &BC = Function->getBinaryContext();
   MCInst NewInst;
-  BC.MIB->createTailCall(NewInst, Target, BC.Ctx.get());
+  {
+    std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+    BC.MIB->createTailCall(NewInst, Target, BC.Ctx.get());
+  }
   Instructions.emplace_back(std::move(NewInst));
 }
 
@@ -513,6 +521,18 @@ void BinaryBasicBlock::dump() const {
   outs() << "\n";
 }
 
+double BinaryBasicBlock::getAverageCycles() const {
+  uint64_t Cycles = 0;
+  uint64_t Count = 0;
+  for (const auto &BI : branch_info()) {
+    if (!BI.Cycles || BI.Count == COUNT_NO_PROFILE)
+      continue;
+    Cycles += BI.Cycles;
+    Count += BI.Count;
+  }
+  return Count ? static_cast<double>(Cycles) / Count : 0.0;
+}
+
 uint64_t BinaryBasicBlock::estimateSize() const {
   return Function->getBinaryContext().computeCodeSize(begin(), end());
 }
@@ -49,6 +49,9 @@ public:
   struct BinaryBranchInfo {
     uint64_t Count;
     uint64_t MispredictedCount; /// number of branches mispredicted
+    /// Cycles recorded by LBR from the previous taken branch to the branch,
+    /// summed over the taken executions of the branch. 0 if not recorded.
+    uint64_t Cycles;
   };
 
   static constexpr uint32_t INVALID_OFFSET =
@@ -79,6 +82,9 @@ private:
   /// Original offset range of the basic block in the function.
   std::pair<uint32_t, uint32_t> InputRange{INVALID_OFFSET, INVALID_OFFSET};
 
+  /// Original offset of the last instruction of the basic block.
+  uint32_t InputBranchOffset{INVALID_OFFSET};
+
   /// Alignment requirements for the block.
   uint32_t Alignment{1};
 
@@ -99,6 +105,10 @@ private:
   /// Number of pseudo instructions in this block.
   uint32_t NumPseudos{0};
 
+  /// Hash of the instructions of the block computed by
+  /// BinaryFunction::hashBlock(), or 0 if it has to be recomputed.
+  mutable uint64_t Hash{0};
+
   /// CFI state at the entry to this basic block.
   int32_t CFIState{-1};
 
@@ -381,6 +391,10 @@ public:
     BI.MispredictedCount = MispredictedCount;
   }
 
+  /// Return the average number of cycles from the previous taken branch to
+  /// the taken branches out of this block, or 0 if no cycles were recorded.
+  double getAverageCycles() const;
+
   /// Try to compute the taken and misprediction frequencies for the given
   /// successor.  The result is an error if no information can be found.
   ErrorOr<std::pair<double, double>>
@@ -655,6 +669,7 @@ public:
 
   /// Erase non-pseudo instruction at a given iterator \p II.
   iterator eraseInstruction(iterator II) {
+    Hash = 0;
     return Instructions.erase(II);
   }
 
@@ -670,6 +685,7 @@ public:
   void clear() {
     Instructions.clear();
     NumPseudos = 0;
+    Hash = 0;
   }
 
   /// Retrieve iterator for \p Inst or return end iterator if instruction is not
@@ -748,6 +764,13 @@ public:
     return SplitInst;
   }
 
+  /// Return the cached hash of the block, or 0 if there is none. The hash is
+  /// dropped when instructions are added or removed, but not when they are
+  /// modified in place.
+  uint64_t getHash() const { return Hash; }
+
+  void setHash(uint64_t Value) const { Hash = Value; }
+
   /// Sets address of the basic block in the output.
   void setOutputStartAddress(uint64_t Address) {
     OutputAddressRange.first = Address;
@@ -818,6 +841,16 @@ public:
     return InputRange.second;
   }
 
+  /// Return offset of the last instruction of the basic block on input, or
+  /// INVALID_OFFSET if it was not recorded.
+  uint32_t getInputBranchOffset() const {
+    return InputBranchOffset;
+  }
+
+  void setInputBranchOffset(uint32_t Offset) {
+    InputBranchOffset = Offset;
+  }
+
   /// Return size of the basic block on input.
   uint32_t getOriginalSize() const {
     return InputRange.second - InputRange.first;
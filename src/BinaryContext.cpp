@@ -20,6 +20,7 @@
 #include "llvm/MC/MCStreamer.h"
 #include "llvm/MC/MCSymbol.h"
 #include "llvm/Support/CommandLine.h"
+#include <algorithm>
 #include <iterator>
 
 using namespace llvm;
@@ -178,15 +179,26 @@ MCSymbol *BinaryContext::getOrCreateGlobalSymbol(uint64_t Address,
                                                  uint16_t Alignment,
                                                  Twine Prefix,
                                                  unsigned Flags) {
-  auto Itr = BinaryDataMap.find(Address);
-  if (Itr != BinaryDataMap.end()) {
-    assert(Itr->second->getSize() == Size || !Size);
-    return Itr->second->getSymbol();
+  {
+    sys::ScopedReader Lock(BinaryDataMutex);
+    auto Itr = BinaryDataMap.find(Address);
+    if (Itr != BinaryDataMap.end()) {
+      assert(Itr->second->getSize() == Size || !Size);
+      return Itr->second->getSymbol();
+    }
   }
 
   std::string Name = (Prefix + "0x" + Twine::utohexstr(Address)).str();
+
+  sys::ScopedWriter Lock(BinaryDataMutex);
+  // The symbol could have been registered by another thread after we released
+  // the shared lock.
+  auto Itr = BinaryDataMap.find(Address);
+  if (Itr != BinaryDataMap.end())
+    return Itr->second->getSymbol();
+
   assert(!GlobalSymbols.count(Name) && "created name is not unique");
-  return registerNameAtAddress(Name, Address, Size, Alignment, Flags);
+  return registerNameAtAddressImpl(Name, Address, Size, Alignment, Flags);
 }
 
 MCSymbol *BinaryContext::registerNameAtAddress(StringRef Name,
@@ -194,6 +206,22 @@ MCSymbol *BinaryContext::registerNameAtAddress(StringRef Name,
                                                uint64_t Size,
                                                uint16_t Alignment,
                                                unsigned Flags) {
+  sys::ScopedWriter Lock(BinaryDataMutex);
+  return registerNameAtAddressImpl(Name, Address, Size, Alignment, Flags);
+}
+
+MCSymbol *BinaryContext::registerNameAtAddress(StringRef Name,
+                                               uint64_t Address,
+                                               BinaryData *BD) {
+  sys::ScopedWriter Lock(BinaryDataMutex);
+  return registerNameAtAddressImpl(Name, Address, BD);
+}
+
+MCSymbol *BinaryContext::registerNameAtAddressImpl(StringRef Name,
+                                                   uint64_t Address,
+                                                   uint64_t Size,
+                                                   uint16_t Alignment,
+                                                   unsigned Flags) {
   auto SectionOrErr = getSectionForAddress(Address);
   auto &Section = SectionOrErr ? SectionOrErr.get() : absoluteSection();
   auto GAI = BinaryDataMap.find(Address);
@@ -208,12 +236,14 @@ MCSymbol *BinaryContext::registerNameAtAddress(StringRef Name,
   } else {
     BD = GAI->second;
   }
-  return registerNameAtAddress(Name, Address, BD);
+  return registerNameAtAddressImpl(Name, Address, BD);
 }
 
-MCSymbol *BinaryContext::registerNameAtAddress(StringRef Name,
-                                               uint64_t Address,
-                                               BinaryData *BD) {
+MCSymbol *BinaryContext::registerNameAtAddressImpl(StringRef Name,
+                                                   uint64_t Address,
+                                                   BinaryData *BD) {
+  clearBinaryDataIndex();
+
   auto GAI = BinaryDataMap.find(Address);
   if (GAI != BinaryDataMap.end()) {
     if (BD != GAI->second) {
@@ -241,7 +271,11 @@ MCSymbol *BinaryContext::registerNameAtAddress(StringRef Name,
   }
 
   // Register the name with MCContext.
-  auto *Symbol = Ctx->getOrCreateSymbol(Name);
+  MCSymbol *Symbol;
+  {
+    std::lock_guard<std::mutex> Lock(CtxMutex);
+    Symbol = Ctx->getOrCreateSymbol(Name);
+  }
   if (BD) {
     BD->Symbols.push_back(Symbol);
     assert(BD->Symbols.size() == BD->Names.size() &&
@@ -254,6 +288,10 @@ const BinaryData *
 BinaryContext::getBinaryDataContainingAddressImpl(uint64_t Address,
                                                   bool IncludeEnd,
                                                   bool BestFit) const {
+  if (hasBinaryDataIndex())
+    return getBinaryDataContainingAddressInIndex(Address, IncludeEnd, BestFit);
+
+  sys::ScopedReader Lock(BinaryDataMutex);
   auto NI = BinaryDataMap.lower_bound(Address);
   auto End = BinaryDataMap.end();
   if ((NI != End && Address == NI->first && !IncludeEnd) ||
@@ -281,7 +319,86 @@ BinaryContext::getBinaryDataContainingAddressImpl(uint64_t Address,
   return nullptr;
 }
 
+const BinaryData *
+BinaryContext::getBinaryDataContainingAddressInIndex(uint64_t Address,
+                                                     bool IncludeEnd,
+                                                     bool BestFit) const {
+  const auto N = DataIndexAddresses.size();
+  auto I = getDataIndexLowerBound(Address);
+  if (!(I != N && Address == DataIndexAddresses[I] && !IncludeEnd)) {
+    if (I == 0)
+      return nullptr;
+    --I;
+  }
+
+  auto coversAddress = [&](const BinaryData *BD) {
+    return BD->containsAddress(Address) ||
+           (IncludeEnd && BD->getEndAddress() == Address);
+  };
+
+  const auto *BD = DataIndexObjects[I];
+  if (coversAddress(BD)) {
+    while (BestFit && I + 1 != N && coversAddress(DataIndexObjects[I + 1]))
+      ++I;
+    return DataIndexObjects[I];
+  }
+
+  // If this is a sub-symbol, see if a parent data contains the address.
+  for (auto *Parent = BD->getParent(); Parent; Parent = Parent->getParent()) {
+    if (Parent->containsAddress(Address) ||
+        (IncludeEnd && BD->getEndAddress() == Address))
+      return Parent;
+  }
+  return nullptr;
+}
+
+size_t BinaryContext::getDataIndexLowerBound(uint64_t Address) const {
+  auto Begin = DataIndexAddresses.begin();
+  auto End = DataIndexAddresses.end();
+  if (!DataIndexPages.empty()) {
+    if (Address < DataIndexBase)
+      return 0;
+    const auto Page = (Address - DataIndexBase) >> DataIndexPageBits;
+    if (Page + 1 >= DataIndexPages.size())
+      return DataIndexAddresses.size();
+    End = DataIndexAddresses.begin() + DataIndexPages[Page + 1];
+    Begin = DataIndexAddresses.begin() + DataIndexPages[Page];
+  }
+  return std::lower_bound(Begin, End, Address) - DataIndexAddresses.begin();
+}
+
+void BinaryContext::buildBinaryDataIndex() {
+  sys::ScopedReader Lock(BinaryDataMutex);
+  clearBinaryDataIndex();
+  DataIndexAddresses.reserve(BinaryDataMap.size());
+  DataIndexObjects.reserve(BinaryDataMap.size());
+  for (auto &Entry : BinaryDataMap) {
+    DataIndexAddresses.push_back(Entry.first);
+    DataIndexObjects.push_back(Entry.second);
+  }
+  if (DataIndexAddresses.empty())
+    return;
+
+  // Only add the page index if it is no larger than a few entries per
+  // object. Binaries with data far apart would need too many pages.
+  DataIndexBase = DataIndexAddresses.front();
+  const auto NumPages =
+    ((DataIndexAddresses.back() - DataIndexBase) >> DataIndexPageBits) + 1;
+  if (NumPages > 4 * DataIndexAddresses.size() ||
+      DataIndexAddresses.size() > std::numeric_limits<uint32_t>::max())
+    return;
+  DataIndexPages.resize(NumPages + 1);
+  size_t I = 0;
+  for (uint64_t Page = 0; Page <= NumPages; ++Page) {
+    const auto PageStart = DataIndexBase + (Page << DataIndexPageBits);
+    while (I < DataIndexAddresses.size() && DataIndexAddresses[I] < PageStart)
+      ++I;
+    DataIndexPages[Page] = I;
+  }
+}
+
 bool BinaryContext::setBinaryDataSize(uint64_t Address, uint64_t Size) {
+  sys::ScopedWriter Lock(BinaryDataMutex);
   auto NI = BinaryDataMap.find(Address);
   assert(NI != BinaryDataMap.end());
   if (NI == BinaryDataMap.end())
@@ -395,6 +512,10 @@ void BinaryContext::postProcessSymbolTable() {
   assert(Valid);
   assignMemData();
   generateSymbolHashes();
+
+  // The symbol table is final. Passes look up data by address from many
+  // threads at once.
+  buildBinaryDataIndex();
 }
 
 void BinaryContext::foldFunction(BinaryFunction &ChildBF,
@@ -433,6 +554,48 @@ void BinaryContext::foldFunction(BinaryFunction &ChildBF,
   }
 }
 
+BinaryFunction *
+BinaryContext::createFunctionClone(BinaryFunction &BF,
+                                   std::map<uint64_t, BinaryFunction> &BFs) {
+  assert(HasRelocations && "functions can only be cloned in relocation mode");
+
+  // The input could have a symbol with the same name.
+  std::string Name;
+  auto CloneNum = BF.getClones().size();
+  do {
+    Name = (BF.getNames()[0] + ".clone." + Twine(CloneNum++)).str();
+  } while (Ctx->lookupSymbol(Name));
+
+  const auto Address = NextCloneAddress++;
+  auto Result = BFs.emplace(
+      Address, BinaryFunction(Name, BF.getSection(), Address, BF.getSize(),
+                              *this, /*IsSimple=*/true));
+  assert(Result.second && "unexpected duplicate function");
+  auto *Clone = &Result.first->second;
+  Clone->cloneFrom(BF);
+  setSymbolToFunctionMap(Clone->getSymbol(), Clone);
+  clearFunctionIndex();
+  return Clone;
+}
+
+void BinaryContext::removeFunction(BinaryFunction &BF,
+                                   std::map<uint64_t, BinaryFunction> &BFs) {
+  assert(HasRelocations && "functions can only be removed in relocation mode");
+
+  for (auto I = SymbolToFunctionMap.begin(); I != SymbolToFunctionMap.end(); ) {
+    if (I->second == &BF)
+      I = SymbolToFunctionMap.erase(I);
+    else
+      ++I;
+  }
+  clearFunctionIndex();
+
+  auto FI = BFs.find(BF.getAddress());
+  assert(FI != BFs.end() && "function not found");
+  assert(&BF == &FI->second && "function mismatch");
+  BFs.erase(FI);
+}
+
 void BinaryContext::fixBinaryDataHoles() {
   assert(validateObjectNesting() && "object nesting inconsitency detected");
 
@@ -526,6 +689,35 @@ void BinaryContext::printGlobalSymbols(raw_ostream& OS) const {
   }
 }
 
+void BinaryContext::buildFunctionIndex(
+    std::map<uint64_t, BinaryFunction> &BinaryFunctions) {
+  clearFunctionIndex();
+  FunctionIndexAddresses.reserve(BinaryFunctions.size());
+  FunctionIndexFunctions.reserve(BinaryFunctions.size());
+  for (auto &BFI : BinaryFunctions) {
+    FunctionIndexAddresses.push_back(BFI.first);
+    FunctionIndexFunctions.push_back(&BFI.second);
+  }
+}
+
+BinaryFunction *
+BinaryContext::getBinaryFunctionContainingAddress(uint64_t Address,
+                                                  bool CheckPastEnd,
+                                                  bool UseMaxSize) const {
+  auto AI = std::upper_bound(FunctionIndexAddresses.begin(),
+                             FunctionIndexAddresses.end(),
+                             Address);
+  if (AI == FunctionIndexAddresses.begin())
+    return nullptr;
+  --AI;
+
+  auto *BF = FunctionIndexFunctions[AI - FunctionIndexAddresses.begin()];
+  const auto UsedSize = UseMaxSize ? BF->getMaxSize() : BF->getSize();
+  if (Address >= *AI + UsedSize + (CheckPastEnd ? 1 : 0))
+    return nullptr;
+  return BF;
+}
+
 void BinaryContext::assignMemData() {
   auto getAddress = [&](const MemInfo &MI) {
     if (!MI.Addr.IsSymbol)
@@ -650,8 +842,11 @@ std::vector<BinaryFunction *> BinaryContext::getSortedFunctions(
                    [](const BinaryFunction *A, const BinaryFunction *B) {
                      if (A->hasValidIndex() && B->hasValidIndex()) {
                        return A->getIndex() < B->getIndex();
-                     } else {
+                     } else if (A->hasValidIndex() || B->hasValidIndex()) {
                        return A->hasValidIndex();
+                     } else {
+                       // Unreferenced functions go last.
+                       return !A->isUnreferenced() && B->isUnreferenced();
                      }
                    });
   return SortedFunctions;
@@ -1044,6 +1239,7 @@ void BinaryContext::addRelocation(uint64_t Address,
 bool BinaryContext::removeRelocationAt(uint64_t Address) {
   auto Section = getSectionForAddress(Address);
   assert(Section && "cannot find section for address");
+  std::lock_guard<std::mutex> Lock(DisassemblyMutex);
   return Section->removeRelocationAt(Address - Section->getAddress());
 }
 
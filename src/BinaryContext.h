@@ -36,10 +36,12 @@
 #include "llvm/MC/MCSymbol.h"
 #include "llvm/Object/ObjectFile.h"
 #include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/RWMutex.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetRegistry.h"
 #include <functional>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <system_error>
@@ -164,6 +166,10 @@ public:
   std::unordered_map<const MCSymbol *,
                      BinaryFunction *> SymbolToFunctionMap;
 
+  /// Key of the next clone of a function in the map of functions. Clones
+  /// have no input address, and get keys above any address in the input.
+  uint64_t NextCloneAddress{1ULL << 63};
+
   /// Look up the symbol entry that contains the given \p Address (based on
   /// the start address and size for each symbol).  Returns a pointer to
   /// the BinaryData for that symbol.  If no data is found, nullptr is returned.
@@ -171,10 +177,42 @@ public:
                                                        bool IncludeEnd,
                                                        bool BestFit) const;
 
+  /// Same as getBinaryDataContainingAddressImpl() using the data index.
+  const BinaryData *getBinaryDataContainingAddressInIndex(uint64_t Address,
+                                                          bool IncludeEnd,
+                                                          bool BestFit) const;
+
+  /// Start addresses of all BinaryData objects in ascending order, and the
+  /// objects themselves at the same indices. Built by buildBinaryDataIndex().
+  std::vector<uint64_t> DataIndexAddresses;
+  std::vector<BinaryData *> DataIndexObjects;
+
+  /// Page-level index into DataIndexAddresses: entry P is the position of
+  /// the first object at or above DataIndexBase + P * 4KB. Empty if the
+  /// objects are spread too thinly for it to pay off.
+  static constexpr unsigned DataIndexPageBits = 12;
+  uint64_t DataIndexBase{0};
+  std::vector<uint32_t> DataIndexPages;
+
+  /// Return the position of the first object in the data index starting at
+  /// or above \p Address.
+  size_t getDataIndexLowerBound(uint64_t Address) const;
+
   /// Update the Parent fields in BinaryDatas after adding a new entry into
   /// \p BinaryDataMap.
   void updateObjectNesting(BinaryDataMapType::iterator GAI);
 
+  /// Implementations of registerNameAtAddress(). The caller has to hold
+  /// BinaryDataMutex in exclusive mode.
+  MCSymbol *registerNameAtAddressImpl(StringRef Name,
+                                      uint64_t Address,
+                                      BinaryData *BD);
+  MCSymbol *registerNameAtAddressImpl(StringRef Name,
+                                      uint64_t Address,
+                                      uint64_t Size,
+                                      uint16_t Alignment,
+                                      unsigned Flags);
+
   /// Validate that if object address ranges overlap that the object with
   /// the larger range is a parent of the object with the smaller range.
   bool validateObjectNesting() const;
@@ -202,13 +240,64 @@ public:
   /// Map address to a constant island owner (constant data in code section)
   std::map<uint64_t, BinaryFunction *> AddressToConstantIslandMap;
 
+  /// Start addresses of all functions in ascending order, and the functions
+  /// themselves at the same indices. Built by buildFunctionIndex().
+  std::vector<uint64_t> FunctionIndexAddresses;
+  std::vector<BinaryFunction *> FunctionIndexFunctions;
+
+  /// Index all functions in \p BinaryFunctions for fast lookups with
+  /// getBinaryFunctionContainingAddress(). The index has to be cleared with
+  /// clearFunctionIndex() whenever a function is added or removed.
+  void buildFunctionIndex(std::map<uint64_t, BinaryFunction> &BinaryFunctions);
+
+  void clearFunctionIndex() {
+    FunctionIndexAddresses.clear();
+    FunctionIndexFunctions.clear();
+  }
+
+  bool hasFunctionIndex() const { return !FunctionIndexAddresses.empty(); }
+
+  /// Return the function containing \p Address using the function index, or
+  /// nullptr if there is none. If \p CheckPastEnd is set, the address right
+  /// past the end of a function is considered to belong to it. If
+  /// \p UseMaxSize is set, the maximum size of the function is used instead
+  /// of its size.
+  BinaryFunction *getBinaryFunctionContainingAddress(uint64_t Address,
+                                                     bool CheckPastEnd = false,
+                                                     bool UseMaxSize = false)
+    const;
+
   /// Set of addresses in the code that are not a function start, and are
   /// referenced from outside of containing function. E.g. this could happen
   /// when a function has more than a single entry point.
   std::set<uint64_t> InterproceduralReferences;
 
+  /// Protects InterproceduralReferences, TrappedFunctions and relocations
+  /// owned by sections, which are updated while functions are being
+  /// disassembled in parallel.
+  std::mutex DisassemblyMutex;
+
+  /// Protects BinaryDataMap and GlobalSymbols. Readers take the lock in shared
+  /// mode, symbol registration takes it in exclusive mode.
+  mutable sys::RWMutex BinaryDataMutex;
+
+  /// Constant island bookkeeping may update functions other than the one
+  /// being disassembled. Serialize it with this lock.
+  std::recursive_mutex IslandMutex;
+
+  /// Record a reference to \p Address located outside of the referencing
+  /// function.
+  void addInterproceduralReference(uint64_t Address) {
+    std::lock_guard<std::mutex> Lock(DisassemblyMutex);
+    InterproceduralReferences.insert(Address);
+  }
+
   std::unique_ptr<MCContext> Ctx;
 
+  /// MCContext is not thread-safe. The lock has to be held while creating
+  /// symbols or expressions when functions are processed concurrently.
+  std::mutex CtxMutex;
+
   std::unique_ptr<DWARFContext> DwCtx;
 
   std::unique_ptr<Triple> TheTriple;
@@ -244,6 +333,11 @@ public:
   /// Indicates if relocations are availabe for usage.
   bool HasRelocations{false};
 
+  /// False for shared objects and position-independent executables, which
+  /// are loaded at an arbitrary base address. Absolute code addresses in
+  /// their data are then set by dynamic relocations at startup.
+  bool HasFixedLoadAddress{true};
+
   /// Sum of execution count of all functions
   uint64_t SumExecutionCount{0};
 
@@ -253,6 +347,23 @@ public:
   /// Total hotness score according to profiling data for this binary.
   uint64_t TotalScore{0};
 
+  /// Profiles of the workloads given with -profile-variants. Layouts are
+  /// evaluated against each of them besides the profile used for the
+  /// optimizations.
+  struct ProfileVariant {
+    std::string Name;
+    double Weight;
+
+    /// Sum of the block counts of all functions, for comparing the counts
+    /// with the ones of the other profiles.
+    uint64_t TotalBlockCount{0};
+  };
+  std::vector<ProfileVariant> ProfileVariants;
+
+  /// Sum of the block counts of all functions in the profile used for the
+  /// optimizations.
+  uint64_t TotalBlockCount{0};
+
   /// Binary-wide stats for macro-fusion.
   uint64_t MissedMacroFusionPairs{0};
   uint64_t MissedMacroFusionExecCount{0};
@@ -270,6 +381,14 @@ public:
   /// True if the binary requires immediate relocation processing.
   bool RequiresZNow{false};
 
+  /// Address execution of the binary starts at.
+  uint64_t ProgramEntryAddress{0};
+
+  /// Start and size in bytes of the instrumentation counters. They are
+  /// allocated by the Instrumentation pass and emitted after the code.
+  MCSymbol *InstrCounters{nullptr};
+  uint64_t InstrCountersSize{0};
+
   /// List of functions that always trap.
   std::vector<const BinaryFunction *> TrappedFunctions;
 
@@ -365,8 +484,23 @@ public:
   /// Iterate over all the sub-symbols of /p BD (if any).
   iterator_range<binary_data_iterator> getSubBinaryData(BinaryData *BD);
 
+  /// Index all BinaryData objects for lookups by address that do not take
+  /// BinaryDataMutex. Build the index once the symbol table is final. Any
+  /// registration drops the index, and so must not run in parallel with
+  /// lookups while the index exists.
+  void buildBinaryDataIndex();
+
+  void clearBinaryDataIndex() {
+    DataIndexAddresses.clear();
+    DataIndexObjects.clear();
+    DataIndexPages.clear();
+  }
+
+  bool hasBinaryDataIndex() const { return !DataIndexAddresses.empty(); }
+
   /// Clear the global symbol address -> name(s) map.
   void clearBinaryData() {
+    clearBinaryDataIndex();
     GlobalSymbols.clear();
     for (auto &Entry : BinaryDataMap) {
       delete Entry.second;
@@ -401,13 +535,19 @@ public:
   /// Return BinaryData registered at a given \p Address or nullptr if no
   /// global symbol was registered at the location.
   const BinaryData *getBinaryDataAtAddress(uint64_t Address) const {
+    if (hasBinaryDataIndex()) {
+      const auto I = getDataIndexLowerBound(Address);
+      return I != DataIndexAddresses.size() && DataIndexAddresses[I] == Address
+        ? DataIndexObjects[I] : nullptr;
+    }
+    sys::ScopedReader Lock(BinaryDataMutex);
     auto NI = BinaryDataMap.find(Address);
     return NI != BinaryDataMap.end() ? NI->second : nullptr;
   }
 
   BinaryData *getBinaryDataAtAddress(uint64_t Address) {
-    auto NI = BinaryDataMap.find(Address);
-    return NI != BinaryDataMap.end() ? NI->second : nullptr;
+    const auto *Self = this;
+    return const_cast<BinaryData *>(Self->getBinaryDataAtAddress(Address));
   }
 
   /// Look up the symbol entry that contains the given \p Address (based on
@@ -430,11 +570,13 @@ public:
   /// Return BinaryData for the given \p Name or nullptr if no
   /// global symbol with that name exists.
   const BinaryData *getBinaryDataByName(StringRef Name) const {
+    sys::ScopedReader Lock(BinaryDataMutex);
     auto Itr = GlobalSymbols.find(Name);
     return Itr != GlobalSymbols.end() ? Itr->second : nullptr;
   }
 
   BinaryData *getBinaryDataByName(StringRef Name) {
+    sys::ScopedReader Lock(BinaryDataMutex);
     auto Itr = GlobalSymbols.find(Name);
     return Itr != GlobalSymbols.end() ? Itr->second : nullptr;
   }
@@ -629,6 +771,17 @@ public:
     SymbolToFunctionMap[Sym] = BF;
   }
 
+  /// Create a copy of \p BF named after it with the same CFG and profile,
+  /// and add it to \p BFs. The copy is emitted as a separate function, and
+  /// has no address in the input. Only valid in relocation mode.
+  BinaryFunction *createFunctionClone(BinaryFunction &BF,
+                                      std::map<uint64_t, BinaryFunction> &BFs);
+
+  /// Remove \p BF, which nothing refers to, from \p BFs and from the lookup
+  /// tables. Only valid in relocation mode.
+  void removeFunction(BinaryFunction &BF,
+                      std::map<uint64_t, BinaryFunction> &BFs);
+
   /// Populate some internal data structures with debug info.
   void preprocessDebugInfo(
       std::map<uint64_t, BinaryFunction> &BinaryFunctions);
@@ -649,16 +802,19 @@ public:
   template <typename Itr>
   uint64_t computeCodeSize(Itr Beg, Itr End) const {
     uint64_t Size = 0;
-    while (Beg != End) {
+    for (; Beg != End; ++Beg) {
+      if (MIB->isCFI(*Beg) || MIB->isEHLabel(*Beg))
+        continue;
+      if (auto KnownSize = MIB->getKnownInstructionSize(*Beg)) {
+        Size += *KnownSize;
+        continue;
+      }
       // Calculate the size of the instruction.
       SmallString<256> Code;
       SmallVector<MCFixup, 4> Fixups;
       raw_svector_ostream VecOS(Code);
-      if (MIB->isCFI(*Beg) || MIB->isEHLabel(*Beg)) {
-        ++Beg;
-        continue;
-      }
-      MCE->encodeInstruction(*Beg++, VecOS, Fixups, *STI);
+      MCE->encodeInstruction(*Beg, VecOS, Fixups, *STI);
+      MIB->recordInstructionSize(*Beg, Code.size());
       Size += Code.size();
     }
     return Size;
@@ -36,6 +36,10 @@ bool BinaryData::isAbsolute() const {
   return Flags & SymbolRef::SF_Absolute;
 }
 
+bool BinaryData::isGlobal() const {
+  return Flags & SymbolRef::SF_Global;
+}
+
 bool BinaryData::isMoveable() const {
   return (!isAbsolute() &&
           (IsMoveable &&
@@ -141,6 +141,7 @@ public:
   }
 
   bool isAbsolute() const;
+  bool isGlobal() const;
   bool isMoveable() const;
 
   uint64_t getAddress() const { return Address; }
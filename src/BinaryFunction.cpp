@@ -14,6 +14,7 @@
 #include "BinaryFunction.h"
 #include "DataReader.h"
 #include "MCPlusBuilder.h"
+#include "ParallelUtilities.h"
 #include "llvm/ADT/edit_distance.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/DebugInfo/DWARF/DWARFContext.h"
@@ -29,11 +30,14 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/GraphWriter.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Regex.h"
+#include <cmath>
 #include <cxxabi.h>
 #include <limits>
+#include <mutex>
 #include <queue>
 #include <string>
 #include <functional>
@@ -52,6 +56,8 @@ extern cl::OptionCategory BoltRelocCategory;
 
 extern bool shouldProcess(const BinaryFunction &);
 
+extern cl::opt<bool> Instrument;
+extern cl::opt<bool> UpdateDebugLineRows;
 extern cl::opt<bool> UpdateDebugSections;
 extern cl::opt<unsigned> Verbosity;
 
@@ -152,6 +158,24 @@ PrintOnlyRegex("print-only-regex",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+ProfileBranchPolarity("profile-branch-polarity",
+  cl::desc("when neither successor of a conditional branch follows it in the "
+           "layout, make the hotter one the branch target so that the "
+           "colder path executes the extra unconditional branch"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+ReuseInputEncodings("reuse-input-encodings",
+  cl::desc("emit unmodified position-independent instructions by copying "
+           "their input bytes instead of encoding them"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 TimeBuild("time-build",
   cl::desc("print time spent constructing binary functions"),
@@ -204,6 +228,31 @@ bool emptyRange(const R &Range) {
   return Range.begin() == Range.end();
 }
 
+/// Primes and steps of xxHash64, used to hash the instructions of functions
+/// without building a string of their encodings first. The result has to be
+/// stable across runs as it is recorded in profiles.
+constexpr uint64_t HashPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t HashPrime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t HashPrime3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t HashSeed = 0x27D4EB2F165667C5ULL;
+
+/// Mix \p Value into \p Hash.
+inline uint64_t hashRound(uint64_t Hash, uint64_t Value) {
+  Hash += Value * HashPrime2;
+  Hash = (Hash << 31) | (Hash >> 33);
+  return Hash * HashPrime1;
+}
+
+/// Spread every bit of \p Hash over the whole result.
+inline uint64_t hashAvalanche(uint64_t Hash) {
+  Hash ^= Hash >> 33;
+  Hash *= HashPrime2;
+  Hash ^= Hash >> 29;
+  Hash *= HashPrime3;
+  Hash ^= Hash >> 32;
+  return Hash;
+}
+
 /// Gets debug line information for the instruction located at the given
 /// address in the original binary. The SMLoc's pointer is used
 /// to point to this information, which is represented by a
@@ -730,14 +779,20 @@ IndirectBranchType BinaryFunction::processIndirectBranch(MCInst &Instruction,
       }
     }
     assert(InstrAddr != 0 && "instruction not found");
+
+    // Tables are bounded by the range check of their index.
+    MCPlusBuilder::ScaledJumpTable Jump;
+    if (BC.MIB->analyzeScaledJumpTable(Instruction, Begin, End, Jump) &&
+        Jump.PCRelBase == PCRelBaseInstr &&
+        processScaledJumpTable(Instruction, Offset, PCRelAddr, Jump))
+      return IndirectBranchType::POSSIBLE_PIC_JUMP_TABLE;
+
     // We do this to avoid spurious references to code locations outside this
     // function (for example, if the indirect jump lives in the last basic
     // block of the function, it will create a reference to the next function).
     // This replaces a symbol reference with an immediate.
     BC.MIB->replaceMemOperandDisp(*PCRelBaseInstr,
                                   MCOperand::createImm(PCRelAddr - InstrAddr));
-    // FIXME: Disable full jump table processing for AArch64 until we have a
-    // proper way of determining the jump table limits.
     return IndirectBranchType::UNKNOWN;
   }
 
@@ -798,8 +853,11 @@ IndirectBranchType BinaryFunction::processIndirectBranch(MCInst &Instruction,
         LI = Result.first;
       }
 
-      BC.MIB->replaceMemOperandDisp(const_cast<MCInst &>(*MemLocInstr),
-                                    LI->second, BC.Ctx.get());
+      {
+        std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+        BC.MIB->replaceMemOperandDisp(const_cast<MCInst &>(*MemLocInstr),
+                                      LI->second, BC.Ctx.get());
+      }
       BC.MIB->setJumpTable(Instruction, ArrayStart, IndexRegNum);
 
       JTSites.emplace_back(Offset, ArrayStart);
@@ -875,7 +933,11 @@ IndirectBranchType BinaryFunction::processIndirectBranch(MCInst &Instruction,
         ? JumpTable::JTT_NORMAL
         : JumpTable::JTT_PIC;
 
-    auto *JTStartLabel = BC.Ctx->getOrCreateSymbol(JumpTableName);
+    MCSymbol *JTStartLabel;
+    {
+      std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+      JTStartLabel = BC.Ctx->getOrCreateSymbol(JumpTableName);
+    }
 
     auto JT = llvm::make_unique<JumpTable>(JumpTableName,
                                            ArrayStart,
@@ -895,8 +957,11 @@ IndirectBranchType BinaryFunction::processIndirectBranch(MCInst &Instruction,
                  << " in function " << *this << " with "
                  << JTOffsetCandidates.size() << " entries.\n");
     JumpTables.emplace(ArrayStart, JT.release());
-    BC.MIB->replaceMemOperandDisp(const_cast<MCInst &>(*MemLocInstr),
-                                  JTStartLabel, BC.Ctx.get());
+    {
+      std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+      BC.MIB->replaceMemOperandDisp(const_cast<MCInst &>(*MemLocInstr),
+                                    JTStartLabel, BC.Ctx.get());
+    }
     BC.MIB->setJumpTable(Instruction, ArrayStart, IndexRegNum);
 
     JTSites.emplace_back(Offset, ArrayStart);
@@ -904,10 +969,81 @@ IndirectBranchType BinaryFunction::processIndirectBranch(MCInst &Instruction,
     return Type;
   }
   assert(!Value || BC.getSectionForAddress(Value));
-  BC.InterproceduralReferences.insert(Value);
+  BC.addInterproceduralReference(Value);
   return IndirectBranchType::POSSIBLE_TAIL_CALL;
 }
 
+bool BinaryFunction::processScaledJumpTable(
+    MCInst &Instruction, uint64_t Offset, uint64_t PCRelAddr,
+    const MCPlusBuilder::ScaledJumpTable &Jump) {
+  // The new entries are offsets from the function start resolved by the
+  // assembler, so the table is always emitted anew. ADR reaches 1MB.
+  if (!BC.HasRelocations || opts::JumpTables == JTS_NONE ||
+      getSize() >= (1ULL << 20))
+    return false;
+
+  const MCSymbol *TableSym;
+  uint64_t TableOffset;
+  std::tie(TableSym, TableOffset) = BC.MIB->getTargetSymbolInfo(Jump.TableExpr);
+  if (!TableSym)
+    return false;
+  const auto *BD = BC.getBinaryDataByName(TableSym->getName());
+  if (!BD)
+    return false;
+  const auto ArrayStart = BD->getAddress() + TableOffset;
+  if (getJumpTableContainingAddress(ArrayStart))
+    return false;
+
+  auto Section = BC.getSectionForAddress(ArrayStart);
+  if (!Section || Section->isVirtual() ||
+      ArrayStart + Jump.NumEntries * Jump.EntrySize > Section->getEndAddress())
+    return false;
+
+  DataExtractor DE(Section->getContents(), BC.AsmInfo->isLittleEndian(),
+                   Jump.EntrySize);
+  auto ValueOffset = static_cast<uint32_t>(ArrayStart - Section->getAddress());
+  std::vector<uint64_t> OffsetEntries;
+  OffsetEntries.reserve(Jump.NumEntries);
+  for (uint64_t I = 0; I < Jump.NumEntries; ++I) {
+    const uint64_t Value =
+      PCRelAddr + DE.getSigned(&ValueOffset, Jump.EntrySize) * 4;
+    if (!containsAddress(Value) || Value == getAddress())
+      return false;
+    OffsetEntries.push_back(Value - getAddress());
+  }
+
+  auto JumpTableName = generateJumpTableName(ArrayStart);
+  MCSymbol *JTStartLabel;
+  {
+    std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+    JTStartLabel = BC.Ctx->getOrCreateSymbol(JumpTableName);
+    BC.MIB->rewriteScaledJumpTable(Jump, JTStartLabel, getSymbol(),
+                                   BC.Ctx.get());
+  }
+
+  auto JT = llvm::make_unique<JumpTable>(
+      JumpTableName, ArrayStart, Jump.EntrySize, JumpTable::JTT_PIC,
+      std::move(OffsetEntries), JumpTable::LabelMapType{{0, JTStartLabel}},
+      *Section);
+  JT->OutputEntrySize = 4;
+  JT->EntryBase = getSymbol();
+  JT->EntryShift = 2;
+
+  auto *JTLabel = BC.registerNameAtAddress(JumpTableName,
+                                           ArrayStart,
+                                           JT.get());
+  assert(JTLabel == JTStartLabel);
+  (void)JTLabel;
+
+  DEBUG(dbgs() << "BOLT-DEBUG: creating scaled jump table "
+               << JTStartLabel->getName() << " in function " << *this
+               << " with " << Jump.NumEntries << " entries.\n");
+  JumpTables.emplace(ArrayStart, JT.release());
+  BC.MIB->setJumpTable(Instruction, ArrayStart, 0);
+  JTSites.emplace_back(Offset, ArrayStart);
+  return true;
+}
+
 MCSymbol *BinaryFunction::getOrCreateLocalLabel(uint64_t Address,
                                                 bool CreatePastEnd) {
   // Check if there's already a registered label.
@@ -930,15 +1066,32 @@ MCSymbol *BinaryFunction::getOrCreateLocalLabel(uint64_t Address,
     return LI->second;
 
   // For AArch64, check if this address is part of a constant island.
-  if (MCSymbol *IslandSym = getOrCreateIslandAccess(Address).first) {
-    return IslandSym;
+  {
+    std::lock_guard<std::recursive_mutex> IslandLock(BC.IslandMutex);
+    if (MCSymbol *IslandSym = getOrCreateIslandAccess(Address).first) {
+      return IslandSym;
+    }
   }
 
-  MCSymbol *Result = BC.Ctx->createTempSymbol();
+  auto *Result = createLocalTempSymbol();
   Labels[Offset] = Result;
   return Result;
 }
 
+MCSymbol *BinaryFunction::createLocalTempSymbol(StringRef Prefix,
+                                                bool AlwaysAddSuffix) {
+  std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+  if (!ParallelUtilities::isDeterministic())
+    return BC.Ctx->createTempSymbol(Prefix, AlwaysAddSuffix);
+
+  // Suffixes handed out by the context depend on the order in which threads
+  // create labels.
+  return BC.Ctx->createTempSymbol(Prefix + Twine("_F") +
+                                    Twine::utohexstr(getFunctionNumber()) +
+                                    "_" + Twine(NumLocalLabels++),
+                                  /*AlwaysAddSuffix=*/false);
+}
+
 void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
   NamedRegionTimer T("disassemble", "Disassemble function", TimerGroupName,
                      TimerGroupDesc, opts::TimeBuild);
@@ -951,17 +1104,16 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
 
   DWARFUnitLineTable ULT = getDWARFUnitLineTable();
 
-  matchProfileMemData();
-
   // Insert a label at the beginning of the function. This will be our first
   // basic block.
-  Labels[0] = Ctx->createTempSymbol("BB0", false);
+  Labels[0] = createLocalTempSymbol("BB0", false);
   addEntryPointAtOffset(0);
 
   auto getOrCreateSymbolForAddress = [&](const MCInst &Instruction,
                                          uint64_t TargetAddress,
                                          uint64_t &SymbolAddend) {
     if (BC.isAArch64()) {
+      std::lock_guard<std::recursive_mutex> IslandLock(BC.IslandMutex);
       // Check if this is an access to a constant island and create bookkeeping
       // to keep track of it and emit it later as part of this function
       if (MCSymbol *IslandSym = getOrCreateIslandAccess(TargetAddress).first) {
@@ -1002,7 +1154,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
           return addEntryPointAtOffset(TargetAddress - getAddress());
         }
       } else {
-        BC.InterproceduralReferences.insert(TargetAddress);
+        BC.addInterproceduralReference(TargetAddress);
       }
     }
 
@@ -1046,6 +1198,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
     TargetSymbol =
         getOrCreateSymbolForAddress(Instruction, TargetAddress, TargetOffset);
 
+    std::lock_guard<std::mutex> Lock(BC.CtxMutex);
     const MCExpr *Expr = MCSymbolRefExpr::create(TargetSymbol,
                                                  MCSymbolRefExpr::VK_None,
                                                  *BC.Ctx);
@@ -1069,6 +1222,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
     int64_t Val;
     MCSymbol *TargetSymbol;
     TargetSymbol = getOrCreateSymbolForAddress(LoadLowBits, Target, Addend);
+    std::lock_guard<std::mutex> Lock(BC.CtxMutex);
     MIB->replaceImmWithSymbol(LoadHiBits, TargetSymbol, Addend, Ctx.get(),
                               Val, ELF::R_AARCH64_ADR_PREL_PG_HI21);
     MIB->replaceImmWithSymbol(LoadLowBits, TargetSymbol, Addend, Ctx.get(), Val,
@@ -1116,6 +1270,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
         if (BC.HasRelocations && opts::TrapOnAVX512 &&
             BC.TheTriple->getArch() == llvm::Triple::x86_64) {
           setTrapOnEntry();
+          std::lock_guard<std::mutex> Lock(BC.DisassemblyMutex);
           BC.TrappedFunctions.push_back(this);
         } else {
           IsSimple = false;
@@ -1135,6 +1290,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
 
       if (BC.HasRelocations && opts::TrapOnAVX512) {
         setTrapOnEntry();
+        std::lock_guard<std::mutex> Lock(BC.DisassemblyMutex);
         BC.TrappedFunctions.push_back(this);
       } else {
         IsSimple = false;
@@ -1158,12 +1314,14 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
             << " for instruction at offset 0x"
             << Twine::utohexstr(Offset) << '\n');
       int64_t Value = Relocation.Value;
+      std::unique_lock<std::mutex> Lock(BC.CtxMutex);
       const auto Result = BC.MIB->replaceImmWithSymbol(Instruction,
                                                        Relocation.Symbol,
                                                        Relocation.Addend,
                                                        Ctx.get(),
                                                        Value,
                                                        Relocation.Type);
+      Lock.unlock();
       (void)Result;
       assert(Result && "cannot replace immediate with relocation");
       // For aarch, if we replaced an immediate with a symbol from a
@@ -1185,7 +1343,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
 
     // Convert instruction to a shorter version that could be relaxed if
     // needed.
-    MIB->shortenInstruction(Instruction);
+    const bool IsShortened = MIB->shortenInstruction(Instruction);
 
     if (MIB->isBranch(Instruction) || MIB->isCall(Instruction)) {
       uint64_t TargetAddress = 0;
@@ -1232,7 +1390,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
               }
               goto add_instruction;
             }
-            BC.InterproceduralReferences.insert(TargetAddress);
+            BC.addInterproceduralReference(TargetAddress);
             if (opts::Verbosity >= 2 && !IsCall && Size == 2 &&
                 !BC.HasRelocations) {
               errs() << "BOLT-WARNING: relaxed tail call detected at 0x"
@@ -1247,7 +1405,11 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
             // Assign proper opcode for tail calls, so that they could be
             // treated as calls.
             if (!IsCall) {
-              if (!MIB->convertJmpToTailCall(Instruction, BC.Ctx.get())) {
+              std::unique_lock<std::mutex> Lock(BC.CtxMutex);
+              const auto Converted =
+                MIB->convertJmpToTailCall(Instruction, BC.Ctx.get());
+              Lock.unlock();
+              if (!Converted) {
                 assert(IsCondBranch && "unknown tail call instruction");
                 if (opts::Verbosity >= 2) {
                   errs() << "BOLT-WARNING: conditional tail call detected in "
@@ -1305,7 +1467,10 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
           // Add taken branch info.
           TakenBranches.emplace_back(Offset, TargetAddress - getAddress());
         }
-        BC.MIB->replaceBranchTarget(Instruction, TargetSymbol, &*Ctx);
+        {
+          std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+          BC.MIB->replaceBranchTarget(Instruction, TargetSymbol, &*Ctx);
+        }
 
         // Mark CTC.
         if (IsCondBranch && IsCall) {
@@ -1320,6 +1485,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
           default:
             llvm_unreachable("unexpected result");
           case IndirectBranchType::POSSIBLE_TAIL_CALL: {
+            std::lock_guard<std::mutex> Lock(BC.CtxMutex);
             auto Result = MIB->convertJmpToTailCall(Instruction, BC.Ctx.get());
             (void)Result;
             assert(Result);
@@ -1371,7 +1537,7 @@ void BinaryFunction::disassemble(ArrayRef<uint8_t> FunctionData) {
     }
 
 add_instruction:
-    if (ULT.first && ULT.second) {
+    if (ULT.first && ULT.second && !opts::UpdateDebugLineRows) {
       Instruction.setLoc(
           findDebugLineInformationForInstructionAt(AbsoluteInstrAddr, ULT));
     }
@@ -1385,6 +1551,13 @@ add_instruction:
       MIB->addAnnotation(Instruction, "MemDataOffset", Offset);
     }
 
+    // AArch64 streamers mark data with mapping symbols, so raw bytes have to
+    // go through the encoder there. Shortened instructions no longer match
+    // their input bytes.
+    if (opts::ReuseInputEncodings && IsSimple && !IsShortened &&
+        !BC.isAArch64())
+      recordInputEncoding(Instruction, Offset, Size);
+
     addInstruction(Offset, std::move(Instruction));
   }
 
@@ -1469,6 +1642,11 @@ bool BinaryFunction::postProcessIndirectBranches() {
         return true;
       }
 
+      // AArch64 jump table jumps were matched in full and made independent
+      // of their position when the table was recovered.
+      if (BC.isAArch64() && BC.MIB->getJumpTable(Instr))
+        continue;
+
       // Validate the tail call or jump table assumptions.
       if (BC.MIB->isTailCall(Instr) || BC.MIB->getJumpTable(Instr)) {
         if (BC.MIB->getMemoryOperandNo(Instr) != -1) {
@@ -1578,6 +1756,76 @@ void BinaryFunction::recomputeLandingPads() {
   }
 }
 
+void BinaryFunction::cloneFrom(BinaryFunction &Function) {
+  assert(Function.hasCFG() && !Function.hasEHRanges() &&
+         !Function.hasJumpTables() && !Function.hasConstantIsland() &&
+         "cannot clone function");
+  assert(BasicBlocks.empty() && "clone should be empty");
+
+  CloneOf = &Function;
+  Function.Clones.push_back(this);
+
+  CurrentState = Function.CurrentState;
+  Alignment = Function.Alignment;
+  MaxAlignmentBytes = Function.MaxAlignmentBytes;
+  MaxColdAlignmentBytes = Function.MaxColdAlignmentBytes;
+  PersonalityFunction = Function.PersonalityFunction;
+  PersonalityEncoding = Function.PersonalityEncoding;
+  PreserveNops = Function.PreserveNops;
+  ExecutionCount = Function.ExecutionCount;
+  FirstExecutionTime = Function.FirstExecutionTime;
+  ProfileMatchRatio = Function.ProfileMatchRatio;
+  ProfileFlags = Function.ProfileFlags;
+  UnitLineTable = Function.UnitLineTable;
+  FrameInstructions = Function.FrameInstructions;
+  CIEFrameInstructions = Function.CIEFrameInstructions;
+
+  // CFI pseudo instructions refer to FrameInstructions by index, which stays
+  // the same.
+  std::unordered_map<const BinaryBasicBlock *, BinaryBasicBlock *> BBMap;
+  for (auto *BB : Function.BasicBlocks) {
+    auto *NewBB = createBasicBlock(BB->getOffset()).release();
+    NewBB->InputRange = BB->InputRange;
+    NewBB->InputBranchOffset = BB->InputBranchOffset;
+    NewBB->Alignment = BB->Alignment;
+    NewBB->AlignmentMaxBytes = BB->AlignmentMaxBytes;
+    NewBB->ExecutionCount = BB->ExecutionCount;
+    NewBB->CFIState = BB->CFIState;
+    NewBB->IsEntryPoint = BB->IsEntryPoint;
+    NewBB->IsCold = BB->IsCold;
+    NewBB->CanOutline = BB->CanOutline;
+    for (const auto &Inst : *BB) {
+      auto NewInst = MCPlus::copyWithoutAnnotations(Inst);
+      if (auto CTCDest = BC.MIB->getConditionalTailCall(Inst))
+        BC.MIB->setConditionalTailCall(NewInst, *CTCDest);
+      NewBB->addInstruction(std::move(NewInst));
+    }
+    NewBB->setIndex(BasicBlocks.size());
+    BasicBlocks.push_back(NewBB);
+    BBMap[BB] = NewBB;
+  }
+
+  for (auto *BB : Function.BasicBlocks) {
+    auto *NewBB = BBMap[BB];
+    auto BI = BB->branch_info_begin();
+    for (auto *Succ : BB->successors()) {
+      NewBB->addSuccessor(BBMap[Succ], *BI);
+      NewBB->BranchInfo.back().Cycles = BI->Cycles;
+      ++BI;
+    }
+  }
+
+  for (const auto &BBOffset : Function.BasicBlockOffsets)
+    BasicBlockOffsets.emplace_back(BBOffset.first, BBMap[BBOffset.second]);
+
+  for (auto *BB : Function.BasicBlocksLayout)
+    BasicBlocksLayout.push_back(BBMap[BB]);
+  updateLayoutIndices();
+
+  // Branches still point to the blocks of the original function.
+  fixBranches();
+}
+
 bool BinaryFunction::buildCFG() {
   NamedRegionTimer T("buildcfg", "Build CFG", TimerGroupName, TimerGroupDesc,
                      opts::TimeBuild);
@@ -1669,8 +1917,8 @@ bool BinaryFunction::buildCFG() {
         // Temporarily restore inserter basic block.
         InsertBB = PrevBB;
       } else {
-        InsertBB = addBasicBlock(Offset,
-                                 BC.Ctx->createTempSymbol("FT", true),
+        auto *Label = createLocalTempSymbol("FT");
+        InsertBB = addBasicBlock(Offset, Label,
                                  opts::PreserveBlocksAlignment &&
                                    IsLastInstrNop);
         updateOffset(LastInstrOffset);
@@ -1820,6 +2068,12 @@ void BinaryFunction::postProcessCFG() {
       // optimizing it.
       setSimple(false);
     } else {
+      // Profiles of other workloads refer to the input offsets the same way
+      // as the profile, which are only known until the end of this function.
+      if (!VariantBranchData.empty() && hasValidProfile() &&
+          (getProfileFlags() & PF_LBR))
+        attachVariantProfiles();
+
       postProcessProfile();
 
       // Eliminate inconsistencies between branch instructions and CFG.
@@ -1833,15 +2087,56 @@ void BinaryFunction::postProcessCFG() {
   clearList(IgnoredBranches);
   clearList(EntryOffsets);
 
-  // Remove "Offset" annotations.
-  for (auto *BB : layout())
-    for (auto &Inst : *BB)
-      BC.MIB->removeAnnotation(Inst, "Offset");
+  // Remember where the blocks ended on input for the address translation
+  // table, which is written after the annotations are gone.
+  for (auto *BB : layout()) {
+    if (const auto *LastInstr = BB->getLastNonPseudoInstr()) {
+      if (auto Offset =
+            BC.MIB->tryGetAnnotationAs<uint64_t>(*LastInstr, "Offset"))
+        BB->setInputBranchOffset(*Offset);
+    }
+  }
+
+  // Remove "Offset" annotations. Instrumentation uses them to describe
+  // branches in terms of input offsets.
+  if (!opts::Instrument) {
+    for (auto *BB : layout())
+      for (auto &Inst : *BB)
+        BC.MIB->removeAnnotation(Inst, "Offset");
+  }
+
+  // Blocks were filled one instruction at a time while building the CFG.
+  // Release the capacity they do not use.
+  for (auto *BB : BasicBlocks)
+    BB->Instructions.shrink_to_fit();
 
   assert((!isSimple() || validateCFG()) &&
          "invalid CFG detected after post-processing");
 }
 
+void BinaryFunction::clearDisasmState() {
+  clearList(Instructions);
+  clearList(OffsetToCFI);
+  clearList(TakenBranches);
+  clearList(IgnoredBranches);
+}
+
+void BinaryFunction::releaseEmittedState() {
+  clearDisasmState();
+  for (auto *BB : BasicBlocks) {
+    clearList(BB->Instructions);
+    clearList(BB->Predecessors);
+    clearList(BB->Successors);
+    clearList(BB->Throwers);
+    clearList(BB->LandingPads);
+    clearList(BB->BranchInfo);
+    BB->NumPseudos = 0;
+  }
+  for (auto *BB : DeletedBasicBlocks)
+    delete BB;
+  clearList(DeletedBasicBlocks);
+}
+
 void BinaryFunction::calculateMacroOpFusionStats() {
   if (!getBinaryContext().isX86())
     return;
@@ -1972,7 +2267,7 @@ void BinaryFunction::removeConditionalTailCalls() {
     MCInst TailCallInstr;
     BC.MIB->createTailCall(TailCallInstr, CTCTargetLabel, BC.Ctx.get());
     auto TailCallBB = createBasicBlock(BinaryBasicBlock::INVALID_OFFSET,
-                                       BC.Ctx->createTempSymbol("TC", true));
+                                       createLocalTempSymbol("TC"));
     TailCallBB->addInstruction(TailCallInstr);
     TailCallBB->setCFIState(CFIStateBeforeCTC);
 
@@ -2125,9 +2420,29 @@ bool BinaryFunction::fixCFIState() {
     return true;
   };
 
+  // Return the difference between the numbers of RememberState and
+  // RestoreState CFIs in [Begin, End).
+  auto getStackOffset = [this](BinaryBasicBlock::const_iterator Begin,
+                               BinaryBasicBlock::const_iterator End) {
+    int Offset = 0;
+    for (; Begin != End; ++Begin) {
+      if (auto *CFI = getCFIFor(*Begin)) {
+        if (CFI->getOperation() == MCCFIInstruction::OpRememberState)
+          ++Offset;
+        if (CFI->getOperation() == MCCFIInstruction::OpRestoreState)
+          --Offset;
+      }
+    }
+    return Offset;
+  };
+
   int32_t State = 0;
   auto *FDEStartBB = BasicBlocksLayout[0];
   bool SeenCold = false;
+  // State stack depth at the end of the blocks processed so far, kept up to
+  // date instead of rescanning the preceding blocks for every block that
+  // needs its state restored.
+  int PrevStackOffset = 0;
   auto Sep = "";
   (void)Sep;
   for (auto *BB : BasicBlocksLayout) {
@@ -2158,6 +2473,7 @@ bool BinaryFunction::fixCFIState() {
       addCFIPseudo(FDEStartBB, InsertIt, FrameInstructions.size());
       FrameInstructions.emplace_back(
           MCCFIInstruction::createRememberState(nullptr));
+      ++PrevStackOffset;
       // Restore state
       InsertIt = addCFIPseudo(BB, BB->begin(), FrameInstructions.size());
       ++InsertIt;
@@ -2166,28 +2482,11 @@ bool BinaryFunction::fixCFIState() {
       if (!replayCFIInstrs(0, OldState, BB, InsertIt))
         return false;
       // Check if we messed up the stack in this process
-      int StackOffset = 0;
-      for (BinaryBasicBlock *CurBB : BasicBlocksLayout) {
-        if (CurBB == BB)
-          break;
-        for (auto &Instr : *CurBB) {
-          if (auto *CFI = getCFIFor(Instr)) {
-            if (CFI->getOperation() == MCCFIInstruction::OpRememberState)
-              ++StackOffset;
-            if (CFI->getOperation() == MCCFIInstruction::OpRestoreState)
-              --StackOffset;
-          }
-        }
-      }
       auto Pos = BB->begin();
-      while (Pos != BB->end() && BC.MIB->isCFI(*Pos)) {
-        auto CFI = getCFIFor(*Pos);
-        if (CFI->getOperation() == MCCFIInstruction::OpRememberState)
-          ++StackOffset;
-        if (CFI->getOperation() == MCCFIInstruction::OpRestoreState)
-          --StackOffset;
+      while (Pos != BB->end() && BC.MIB->isCFI(*Pos))
         ++Pos;
-      }
+      const auto StackOffset =
+        PrevStackOffset + getStackOffset(BB->begin(), Pos);
 
       if (StackOffset != 0) {
         errs() << "BOLT-WARNING: not possible to remember/recover state"
@@ -2205,6 +2504,7 @@ bool BinaryFunction::fixCFIState() {
     }
 
     State = CFIStateAtExit;
+    PrevStackOffset += getStackOffset(BB->begin(), BB->end());
     DEBUG(dbgs() << Sep << State; Sep = ", ");
   }
   DEBUG(dbgs() << "\n");
@@ -2219,22 +2519,192 @@ uint64_t BinaryFunction::getInstructionCount() const {
   return Count;
 }
 
+double BinaryFunction::getAverageCycles() const {
+  uint64_t Cycles = 0;
+  uint64_t Count = 0;
+  for (const auto &BB : BasicBlocks) {
+    for (const auto &BI : BB->branch_info()) {
+      if (!BI.Cycles || BI.Count == COUNT_NO_PROFILE)
+        continue;
+      Cycles += BI.Cycles;
+      Count += BI.Count;
+    }
+  }
+  return Count ? static_cast<double>(Cycles) / Count : 0.0;
+}
+
+uint32_t BinaryFunction::getOrCreateInstructionId(MCInst &Inst) {
+  if (auto Id = BC.MIB->getInstructionId(Inst))
+    return *Id;
+  const auto Id = NumInstructionIds++;
+  BC.MIB->setInstructionId(Inst, Id);
+  return Id;
+}
+
 bool BinaryFunction::hasLayoutChanged() const {
   return ModifiedLayout;
 }
 
 uint64_t BinaryFunction::getEditDistance() const {
-  return ComputeEditDistance<BinaryBasicBlock *>(BasicBlocksPreviousLayout,
-                                                 BasicBlocksLayout);
+  ArrayRef<BinaryBasicBlock *> From(BasicBlocksPreviousLayout);
+  ArrayRef<BinaryBasicBlock *> To(BasicBlocksLayout);
+
+  // Blocks at both ends of the layout often stay in place.
+  while (!From.empty() && !To.empty() && From.front() == To.front()) {
+    From = From.drop_front();
+    To = To.drop_front();
+  }
+  while (!From.empty() && !To.empty() && From.back() == To.back()) {
+    From = From.drop_back();
+    To = To.drop_back();
+  }
+
+  // The exact distance takes time and memory proportional to the product of
+  // the lengths.
+  const uint64_t MaxExactCells = 1 << 22;
+  if (static_cast<uint64_t>(From.size()) * To.size() <= MaxExactCells)
+    return ComputeEditDistance(From, To);
+
+  // Otherwise align the longest common subsequence of the layouts, which is
+  // the longest increasing subsequence of the old positions of the blocks in
+  // the new layout since every block appears once, and count the edits
+  // between the aligned blocks. The result is an upper bound of the exact
+  // distance.
+  DenseMap<const BinaryBasicBlock *, uint32_t> FromIndex;
+  for (uint32_t I = 0; I < From.size(); ++I)
+    FromIndex[From[I]] = I;
+
+  // Index in To of the last block of the best subsequence of each length,
+  // and of the block before each block in its best subsequence.
+  std::vector<uint32_t> Tails;
+  std::vector<int64_t> Prev(To.size(), -1);
+  for (uint32_t I = 0; I < To.size(); ++I) {
+    auto FI = FromIndex.find(To[I]);
+    if (FI == FromIndex.end())
+      continue;
+    const auto Pos = FI->second;
+    auto TI = std::lower_bound(Tails.begin(), Tails.end(), Pos,
+                               [&](uint32_t Tail, uint32_t Value) {
+                                 return FromIndex.lookup(To[Tail]) < Value;
+                               });
+    if (TI != Tails.begin())
+      Prev[I] = *std::prev(TI);
+    if (TI == Tails.end())
+      Tails.push_back(I);
+    else
+      *TI = I;
+  }
+
+  // Walk the alignment backwards, replacing blocks between aligned ones and
+  // inserting or deleting the rest.
+  uint64_t Distance = 0;
+  int64_t ToEnd = To.size();
+  int64_t FromEnd = From.size();
+  for (int64_t I = Tails.empty() ? -1 : Tails.back(); I >= 0; I = Prev[I]) {
+    const int64_t Pos = FromIndex[To[I]];
+    Distance += std::max(ToEnd - I - 1, FromEnd - Pos - 1);
+    ToEnd = I;
+    FromEnd = Pos;
+  }
+  Distance += std::max(ToEnd, FromEnd);
+
+  return Distance;
+}
+
+void BinaryFunction::recordInputEncoding(MCInst &Inst, uint64_t Offset,
+                                         uint64_t Size) {
+  if (BC.MIB->isBranch(Inst) || BC.MIB->isCall(Inst) ||
+      BC.MIB->hasPCRelOperand(Inst))
+    return;
+
+  const auto NumOperands = MCPlus::getNumPrimeOperands(Inst);
+  if (NumOperands > 64)
+    return;
+
+  // Symbolic operands are resolved at emission time.
+  uint64_t RegMask = 0;
+  for (unsigned I = 0; I < NumOperands; ++I) {
+    const auto &Op = Inst.getOperand(I);
+    if (Op.isReg())
+      RegMask |= 1ULL << I;
+    else if (!Op.isImm())
+      return;
+  }
+
+  const auto Record = InputEncodings.size();
+  InputEncodings.push_back(Offset);
+  InputEncodings.push_back(Size);
+  InputEncodings.push_back(Inst.getOpcode());
+  InputEncodings.push_back(Inst.getFlags());
+  InputEncodings.push_back(NumOperands);
+  InputEncodings.push_back(RegMask);
+  for (unsigned I = 0; I < NumOperands; ++I) {
+    const auto &Op = Inst.getOperand(I);
+    InputEncodings.push_back(Op.isReg() ? Op.getReg() : Op.getImm());
+  }
+  BC.MIB->setInputEncoding(Inst, Record);
+}
+
+void BinaryFunction::captureInputEncodings() {
+  LayoutInputEncodings.clear();
+  if (InputEncodings.empty())
+    return;
+
+  for (auto *BB : layout()) {
+    for (auto &Inst : *BB) {
+      if (BC.MIB->isCFI(Inst) || BC.MIB->isEHLabel(Inst))
+        continue;
+      auto Record = BC.MIB->getInputEncoding(Inst);
+      LayoutInputEncodings.push_back(Record ? *Record : NoInputEncoding);
+    }
+  }
+}
+
+Optional<StringRef>
+BinaryFunction::getInputEncoding(const MCInst &Inst, uint32_t Ordinal) const {
+  if (Ordinal >= LayoutInputEncodings.size())
+    return NoneType();
+  const auto Record = LayoutInputEncodings[Ordinal];
+  if (Record == NoInputEncoding)
+    return NoneType();
+
+  // Passes modify instructions in place, so compare the instruction with
+  // the one the bytes were decoded into.
+  const auto *R = &InputEncodings[Record];
+  const auto NumOperands = MCPlus::getNumPrimeOperands(Inst);
+  if (R[2] != Inst.getOpcode() || R[3] != Inst.getFlags() ||
+      R[4] != NumOperands)
+    return NoneType();
+  const auto RegMask = static_cast<uint64_t>(R[5]);
+  for (unsigned I = 0; I < NumOperands; ++I) {
+    const auto &Op = Inst.getOperand(I);
+    if (RegMask & (1ULL << I)) {
+      if (!Op.isReg() || Op.getReg() != R[6 + I])
+        return NoneType();
+    } else if (!Op.isImm() || Op.getImm() != R[6 + I]) {
+      return NoneType();
+    }
+  }
+
+  return Section.getContents().substr(
+      getAddress() - Section.getAddress() + R[0], R[1]);
 }
 
 void BinaryFunction::emitBody(MCStreamer &Streamer, bool EmitColdPart) {
   if (EmitColdPart && hasConstantIsland())
     duplicateConstantIslands();
 
+  // Position of the next non-pseudo instruction in the layout.
+  uint32_t Ordinal = 0;
   for (auto BB : layout()) {
-    if (EmitColdPart != BB->isCold())
+    if (EmitColdPart != BB->isCold()) {
+      if (!LayoutInputEncodings.empty()) {
+        for (const auto &Instr : *BB)
+          if (!BC.MIB->isCFI(Instr) && !BC.MIB->isEHLabel(Instr))
+            ++Ordinal;
+      }
       continue;
+    }
 
     if ((opts::AlignBlocks || opts::PreserveBlocksAlignment)
         && BB->getAlignment() > 1) {
@@ -2243,6 +2713,10 @@ void BinaryFunction::emitBody(MCStreamer &Streamer, bool EmitColdPart) {
     }
     Streamer.EmitLabel(BB->getLabel());
 
+    const bool EmitLineInfo = opts::UpdateDebugSections && UnitLineTable.first;
+    if (EmitLineInfo && opts::UpdateDebugLineRows)
+      emitBlockLineInfo(Streamer, *BB);
+
     // Check if special alignment for macro-fusion is needed.
     bool MayNeedMacroFusionAlignment =
       (opts::AlignMacroOpFusion == MFT_ALL) ||
@@ -2284,16 +2758,28 @@ void BinaryFunction::emitBody(MCStreamer &Streamer, bool EmitColdPart) {
         Streamer.EmitNeverAlignCodeAtEnd(/*Alignment to avoid=*/64);
       }
 
-      if (opts::UpdateDebugSections && UnitLineTable.first) {
+      if (EmitLineInfo && !opts::UpdateDebugLineRows) {
         LastLocSeen = emitLineInfo(Instr.getLoc(), LastLocSeen);
       }
 
-      Streamer.EmitInstruction(Instr, *BC.STI);
+      // Copy the input bytes of unmodified instructions. The first
+      // instruction of a macro-fusion pair has to start a new fragment.
+      Optional<StringRef> InputBytes;
+      if (!LayoutInputEncodings.empty() &&
+          !(MayNeedMacroFusionAlignment && I == MacroFusionPair))
+        InputBytes = getInputEncoding(Instr, Ordinal);
+      ++Ordinal;
+
+      if (InputBytes)
+        Streamer.EmitBytes(*InputBytes);
+      else
+        Streamer.EmitInstruction(Instr, *BC.STI);
       LastIsPrefix = BC.MIB->isPrefix(Instr);
     }
   }
 
-  emitConstantIslands(Streamer, EmitColdPart);
+  if (EmitColdPart || !hasMovedConstantIslands())
+    emitConstantIslands(Streamer, EmitColdPart);
 }
 
 void BinaryFunction::emitBodyRaw(MCStreamer *Streamer) {
@@ -2824,9 +3310,31 @@ void BinaryFunction::fixBranches() {
       if (NextBB && NextBB == TSuccessor &&
           !BC.MIB->hasAnnotation(*CondBranch, "DoNotChangeTarget")) {
         std::swap(TSuccessor, FSuccessor);
-        MIB->reverseBranchCondition(*CondBranch, TSuccessor->getLabel(), Ctx);
+        {
+          std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+          MIB->reverseBranchCondition(*CondBranch, TSuccessor->getLabel(),
+                                      Ctx);
+        }
+        BB->swapConditionalSuccessors();
+      } else if (opts::ProfileBranchPolarity &&
+                 NextBB != FSuccessor && TSuccessor != FSuccessor &&
+                 BB->getBranchInfo(false).Count !=
+                   BinaryBasicBlock::COUNT_NO_PROFILE &&
+                 BB->getBranchInfo(false).Count >
+                   BB->getBranchInfo(true).Count &&
+                 !BC.MIB->hasAnnotation(*CondBranch, "DoNotChangeTarget")) {
+        // Both successors need a branch. Taking the conditional branch to
+        // the hotter one costs the same number of taken branches, but leaves
+        // the unconditional branch on the colder path.
+        std::swap(TSuccessor, FSuccessor);
+        {
+          std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+          MIB->reverseBranchCondition(*CondBranch, TSuccessor->getLabel(),
+                                      Ctx);
+        }
         BB->swapConditionalSuccessors();
       } else {
+        std::lock_guard<std::mutex> Lock(BC.CtxMutex);
         MIB->replaceBranchTarget(*CondBranch, TSuccessor->getLabel(), Ctx);
       }
       if (TSuccessor == FSuccessor) {
@@ -3038,36 +3546,49 @@ std::size_t BinaryFunction::hash(bool Recompute, bool UseDFS) const {
 
   const auto &Order = UseDFS ? dfs() : BasicBlocksLayout;
 
-  // The hash is computed by creating a string of all the opcodes
-  // in the function and hashing that string with std::hash.
-  std::string Opcodes;
+  // Block hashes are combined in order, so that the same blocks laid out
+  // differently produce a different hash.
+  uint64_t Result = HashSeed;
   for (const auto *BB : Order) {
-    for (const auto &Inst : *BB) {
-      unsigned Opcode = Inst.getOpcode();
+    BB->setHash(computeBlockHash(*BB));
+    Result = hashRound(Result, BB->getHash());
+  }
 
-      if (BC.MII->get(Opcode).isPseudo())
-        continue;
+  return Hash = hashAvalanche(Result);
+}
 
-      // Ignore unconditional jumps since we check CFG consistency by processing
-      // basic blocks in order and do not rely on branches to be in-sync with
-      // CFG. Note that we still use condition code of conditional jumps.
-      if (BC.MIB->isUnconditionalBranch(Inst))
-        continue;
+std::size_t BinaryFunction::hashBlock(const BinaryBasicBlock &BB) const {
+  if (!BB.getHash())
+    BB.setHash(computeBlockHash(BB));
+  return BB.getHash();
+}
 
-      if (Opcode == 0) {
-        Opcodes.push_back(0);
-        continue;
-      }
+uint64_t BinaryFunction::computeBlockHash(const BinaryBasicBlock &BB) const {
+  uint64_t Result = HashSeed;
+  for (const auto &Inst : BB) {
+    const auto Opcode = Inst.getOpcode();
 
-      while (Opcode) {
-        uint8_t LSB = Opcode & 0xff;
-        Opcodes.push_back(LSB);
-        Opcode = Opcode >> 8;
-      }
+    if (BC.MII->get(Opcode).isPseudo())
+      continue;
+
+    // Ignore unconditional jumps since we check CFG consistency by processing
+    // basic blocks in order and do not rely on branches to be in-sync with
+    // CFG. Note that we still use condition code of conditional jumps.
+    if (BC.MIB->isUnconditionalBranch(Inst))
+      continue;
+
+    // Registers are the same in congruent functions, unlike immediates and
+    // symbolic operands that may reference different but equivalent objects.
+    Result = hashRound(Result, Opcode);
+    for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I) {
+      const auto &Operand = Inst.getOperand(I);
+      if (Operand.isReg())
+        Result = hashRound(Result, Operand.getReg());
     }
   }
 
-  return Hash = std::hash<std::string>{}(Opcodes);
+  // Zero marks a block without a cached hash.
+  return std::max<uint64_t>(hashAvalanche(Result), 1);
 }
 
 void BinaryFunction::insertBasicBlocks(
@@ -3176,7 +3697,7 @@ bool BinaryFunction::replaceJumpTableEntryIn(BinaryBasicBlock *BB,
 BinaryBasicBlock *BinaryFunction::splitEdge(BinaryBasicBlock *From,
                                             BinaryBasicBlock *To) {
   // Create intermediate BB
-  MCSymbol *Tmp = BC.Ctx->createTempSymbol("SplitEdge", true);
+  auto *Tmp = createLocalTempSymbol("SplitEdge");
   auto NewBB = createBasicBlock(0, Tmp);
   auto NewBBPtr = NewBB.get();
 
@@ -3299,6 +3820,60 @@ SMLoc BinaryFunction::emitLineInfo(SMLoc NewLoc, SMLoc PrevLoc) const {
   return NewLoc;
 }
 
+void BinaryFunction::emitBlockLineInfo(MCStreamer &Streamer,
+                                       BinaryBasicBlock &BB) const {
+  const auto *LineTable = UnitLineTable.second;
+  if (!LineTable || BB.getInputOffset() == BinaryBasicBlock::INVALID_OFFSET)
+    return;
+
+  // Rows at or past the last instruction of the block are dropped, since
+  // the branch there is the instruction most likely to change its size.
+  auto Size = BB.getOriginalSize();
+  if (BB.getInputBranchOffset() != BinaryBasicBlock::INVALID_OFFSET &&
+      BB.getInputBranchOffset() > BB.getInputOffset())
+    Size = BB.getInputBranchOffset() - BB.getInputOffset();
+
+  const auto BlockAddress = getAddress() + BB.getInputOffset();
+  std::vector<uint32_t> Rows;
+  if (!LineTable->lookupAddressRange(BlockAddress, Size, Rows))
+    return;
+
+  auto &OutputLineTable =
+    BC.Ctx->getMCDwarfLineTable(UnitLineTable.first->getOffset())
+      .getMCLineSections();
+  auto *Section = Streamer.getCurrentSectionOnly();
+  for (const auto RowIndex : Rows) {
+    const auto &Row = LineTable->Rows[RowIndex];
+    if (Row.EndSequence)
+      continue;
+
+    // The row covering the start of the block starts at its label.
+    MCSymbol *Label = BB.getLabel();
+    if (Row.Address > BlockAddress) {
+      Label = BC.Ctx->createTempSymbol("line", true);
+      Label->setVariableValue(
+        MCBinaryExpr::createAdd(
+          MCSymbolRefExpr::create(BB.getLabel(), *BC.Ctx),
+          MCConstantExpr::create(Row.Address - BlockAddress, *BC.Ctx),
+          *BC.Ctx));
+    }
+
+    BC.Ctx->setCurrentDwarfLoc(
+      Row.File,
+      Row.Line,
+      Row.Column,
+      (DWARF2_FLAG_IS_STMT * Row.IsStmt) |
+      (DWARF2_FLAG_BASIC_BLOCK * Row.BasicBlock) |
+      (DWARF2_FLAG_PROLOGUE_END * Row.PrologueEnd) |
+      (DWARF2_FLAG_EPILOGUE_BEGIN * Row.EpilogueBegin),
+      Row.Isa,
+      Row.Discriminator);
+    auto Loc = BC.Ctx->getCurrentDwarfLoc();
+    BC.Ctx->clearDwarfLocSeen();
+    OutputLineTable.addLineEntry(MCDwarfLineEntry{Label, Loc}, Section);
+  }
+}
+
 BinaryFunction::~BinaryFunction() {
   for (auto BB : BasicBlocks) {
     delete BB;
@@ -3314,37 +3889,42 @@ void BinaryFunction::emitJumpTables(MCStreamer *Streamer) {
   if (opts::PrintJumpTables) {
     outs() << "BOLT-INFO: jump tables for function " << *this << ":\n";
   }
-  for (auto &JTI : JumpTables) {
-    auto &JT = *JTI.second;
-    if (opts::PrintJumpTables)
-      JT.print(outs());
-    if (opts::JumpTables == JTS_BASIC && BC.HasRelocations) {
-      JT.updateOriginal();
+  for (auto &JTI : JumpTables)
+    emitJumpTable(Streamer, *JTI.second);
+}
+
+void BinaryFunction::emitJumpTable(MCStreamer *Streamer, JumpTable &JT) {
+  if (opts::PrintJumpTables)
+    JT.print(outs());
+  // Tables with entries relative to code cannot be updated in place.
+  const bool InPlace = opts::JumpTables == JTS_BASIC && !JT.EntryBase;
+  if (InPlace && BC.HasRelocations) {
+    JT.updateOriginal();
+    return;
+  }
+
+  MCSection *HotSection, *ColdSection;
+  if (InPlace) {
+    std::string Name = ".local." + JT.Labels[0]->getName().str();
+    std::replace(Name.begin(), Name.end(), '/', '.');
+    JT.setOutputSection(BC.registerOrUpdateSection(Name,
+                                                   ELF::SHT_PROGBITS,
+                                                   ELF::SHF_ALLOC));
+    HotSection = BC.Ctx->getELFSection(Name,
+                                       ELF::SHT_PROGBITS,
+                                       ELF::SHF_ALLOC);
+    ColdSection = HotSection;
+  } else {
+    if (isSimple()) {
+      HotSection = BC.MOFI->getReadOnlySection();
+      ColdSection = BC.MOFI->getReadOnlyColdSection();
     } else {
-      MCSection *HotSection, *ColdSection;
-      if (opts::JumpTables == JTS_BASIC) {
-        std::string Name = ".local." + JT.Labels[0]->getName().str();
-        std::replace(Name.begin(), Name.end(), '/', '.');
-        JT.setOutputSection(BC.registerOrUpdateSection(Name,
-                                                       ELF::SHT_PROGBITS,
-                                                       ELF::SHF_ALLOC));
-        HotSection = BC.Ctx->getELFSection(Name,
-                                           ELF::SHT_PROGBITS,
-                                           ELF::SHF_ALLOC);
-        ColdSection = HotSection;
-      } else {
-        if (isSimple()) {
-          HotSection = BC.MOFI->getReadOnlySection();
-          ColdSection = BC.MOFI->getReadOnlyColdSection();
-        } else {
-          HotSection = hasProfile() ? BC.MOFI->getReadOnlySection()
-                                    : BC.MOFI->getReadOnlyColdSection();
-          ColdSection = HotSection;
-        }
-      }
-      JT.emit(Streamer, HotSection, ColdSection);
+      HotSection = hasProfile() ? BC.MOFI->getReadOnlySection()
+                                : BC.MOFI->getReadOnlyColdSection();
+      ColdSection = HotSection;
     }
   }
+  JT.emit(Streamer, HotSection, ColdSection);
 }
 
 void BinaryFunction::calculateLoopInfo() {
@@ -3434,7 +4014,7 @@ DWARFAddressRangesVector BinaryFunction::getOutputAddressRanges() const {
 
 uint64_t BinaryFunction::translateInputToOutputAddress(uint64_t Address) const {
   // If the function hasn't changed return the same address.
-  if (!isEmitted() && !BC.HasRelocations)
+  if (!isEmitted() && (!BC.HasRelocations || isPatchedInPlace()))
     return Address;
 
   if (Address < getAddress())
@@ -3459,7 +4039,7 @@ uint64_t BinaryFunction::translateInputToOutputAddress(uint64_t Address) const {
 DWARFAddressRangesVector BinaryFunction::translateInputToOutputRanges(
     const DWARFAddressRangesVector &InputRanges) const {
   // If the function hasn't changed return the same ranges.
-  if (!isEmitted() && !BC.HasRelocations)
+  if (!isEmitted() && (!BC.HasRelocations || isPatchedInPlace()))
     return InputRanges;
 
   // Even though we will merge ranges in a post-processing pass, we attempt to
@@ -3580,7 +4160,7 @@ DWARFDebugLoc::LocationList BinaryFunction::translateInputToOutputLocationList(
       BaseAddress BaseAddr) const {
   uint64_t BAddr = BaseAddr.Address;
   // If the function wasn't changed - there's nothing to update.
-  if (!isEmitted() && !BC.HasRelocations) {
+  if (!isEmitted() && (!BC.HasRelocations || isPatchedInPlace())) {
     if (!BAddr) {
       return InputLL;
     } else {
@@ -3723,7 +4303,49 @@ void BinaryFunction::printLoopInfo(raw_ostream &OS) const {
   OS << "Maximum nested loop depth: " << BLI->MaximumDepth << "\n\n";
 }
 
+uint64_t BinaryFunction::computeDynoStatsFingerprint() const {
+  hash_code Hash = hash_combine(isSimple(), hasValidProfile(), isFolded(),
+                                layout_size());
+  for (const auto *BB : layout()) {
+    Hash = hash_combine(Hash, BB, BB->getKnownExecutionCount(), BB->size(),
+                        DoubleToBits(BB->getAverageCycles()));
+    for (const auto &BI : BB->branch_info())
+      Hash = hash_combine(Hash, BI.Count, BI.MispredictedCount);
+    // Annotations, e.g. the counts of conditional tail calls, are kept as
+    // operands, so adding one changes the number of operands.
+    for (const auto &Inst : *BB)
+      Hash = hash_combine(Hash, Inst.getOpcode(), Inst.getNumOperands());
+  }
+  return std::max<uint64_t>(Hash, 1);
+}
+
 DynoStats BinaryFunction::getDynoStats() const {
+  const auto Fingerprint = computeDynoStatsFingerprint();
+  if (Fingerprint != DynoStatsFingerprint) {
+    CachedDynoStats = computeDynoStats();
+    DynoStatsFingerprint = Fingerprint;
+  }
+  return CachedDynoStats;
+}
+
+DynoStats getDynoStats(std::map<uint64_t, BinaryFunction> &BFs) {
+  // Sums do not depend on the order in which functions are added, so the
+  // result is the same regardless of the scheduling.
+  DynoStats Stats;
+  std::mutex StatsMutex;
+  ParallelUtilities::runOnEachFunction(
+      BFs, ParallelUtilities::SP_INST_LINEAR,
+      [&](BinaryFunction &BF) {
+        const auto FunctionStats = BF.getDynoStats();
+        std::lock_guard<std::mutex> Lock(StatsMutex);
+        Stats += FunctionStats;
+      },
+      [](const BinaryFunction &BF) { return !BF.isSimple(); },
+      "getDynoStats");
+  return Stats;
+}
+
+DynoStats BinaryFunction::computeDynoStats() const {
   DynoStats Stats;
 
   // Return empty-stats about the function we don't completely understand.
@@ -3820,9 +4442,17 @@ DynoStats BinaryFunction::getDynoStats() const {
       continue;
     }
 
+    // Taken branches weighted by the cycles recorded for the path ending in
+    // the block, so that the stat drops when slow paths become fall-throughs.
+    const auto BBCycles = BB->getAverageCycles();
+    auto addWeightedCycles = [&](uint64_t TakenCount) {
+      Stats[DynoStats::WEIGHTED_CYCLES] += std::llround(TakenCount * BBCycles);
+    };
+
     // Simple unconditional branch.
     if (!CondBranch) {
       Stats[DynoStats::UNCOND_BRANCHES] += BBExecutionCount;
+      addWeightedCycles(BBExecutionCount);
       continue;
     }
 
@@ -3830,9 +4460,26 @@ DynoStats BinaryFunction::getDynoStats() const {
     if (BC.MIB->getConditionalTailCall(*CondBranch)) {
       if (BB->branch_info_begin() != BB->branch_info_end())
         Stats[DynoStats::UNCOND_BRANCHES] += BB->branch_info_begin()->Count;
+      // The edge to the callee is gone from the CFG and its mispredictions
+      // are kept in an annotation.
+      Stats[DynoStats::COND_BRANCH_MISPREDICTS] +=
+        BC.MIB->getAnnotationWithDefault<uint64_t>(*CondBranch,
+                                                   "CTCMispredCount");
+      for (const auto &BI : BB->branch_info()) {
+        if (BI.Count != COUNT_NO_PROFILE)
+          Stats[DynoStats::COND_BRANCH_MISPREDICTS] += BI.MispredictedCount;
+      }
       continue;
     }
 
+    if (BB->getMacroOpFusionPair() != BB->end())
+      Stats[DynoStats::MACRO_FUSED_BRANCHES] += BBExecutionCount;
+
+    for (const auto &BI : BB->branch_info()) {
+      if (BI.Count != COUNT_NO_PROFILE)
+        Stats[DynoStats::COND_BRANCH_MISPREDICTS] += BI.MispredictedCount;
+    }
+
     // Conditional branch that could be followed by an unconditional branch.
     uint64_t TakenCount = BB->getBranchInfo(true).Count;
     if (TakenCount == COUNT_NO_PROFILE)
@@ -3842,6 +4489,7 @@ DynoStats BinaryFunction::getDynoStats() const {
     if (NonTakenCount == COUNT_NO_PROFILE)
       NonTakenCount = 0;
 
+    addWeightedCycles(TakenCount);
     if (isForwardBranch(BB, BB->getConditionalSuccessor(true))) {
       Stats[DynoStats::FORWARD_COND_BRANCHES] += BBExecutionCount;
       Stats[DynoStats::FORWARD_COND_BRANCHES_TAKEN] += TakenCount;
@@ -3852,6 +4500,7 @@ DynoStats BinaryFunction::getDynoStats() const {
 
     if (UncondBranch) {
       Stats[DynoStats::UNCOND_BRANCHES] += NonTakenCount;
+      addWeightedCycles(NonTakenCount);
     }
   }
 
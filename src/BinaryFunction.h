@@ -70,6 +70,10 @@ class DynoStats {
   D(LOADS,                        "executed load instructions", Fn)\
   D(STORES,                       "executed store instructions", Fn)\
   D(JUMP_TABLE_BRANCHES,          "taken jump table branches", Fn)\
+  D(MACRO_FUSED_BRANCHES,         "executed macro-fusible conditional branches",\
+      Fn)\
+  D(COND_BRANCH_MISPREDICTS,      "conditional branch mispredictions", Fn)\
+  D(WEIGHTED_CYCLES,              "weighted cycles of taken branches", Fn)\
   D(ALL_BRANCHES,                 "total branches",\
       Fadd(ALL_CONDITIONAL, UNCOND_BRANCHES))\
   D(ALL_TAKEN,                    "taken branches",\
@@ -121,6 +125,11 @@ public:
     DYNO_STATS
 #undef Fn
 #undef D
+#undef Fadd
+#undef Fsub
+#undef F
+#undef Radd
+#undef Rsub
     default:
       llvm_unreachable("index out of bounds");
     }
@@ -246,6 +255,37 @@ public:
 
   using BasicBlockOrderType = std::vector<BinaryBasicBlock *>;
 
+  /// Profile of the function in the calls from one caller, collected from
+  /// LBR samples that recorded the call together with the branches taken
+  /// after it.
+  struct CallerProfile {
+    /// Number of recorded calls from the caller.
+    uint64_t EntryCount{0};
+
+    /// Counts of the CFG edges taken in the recorded calls.
+    std::map<std::pair<const BinaryBasicBlock *, const BinaryBasicBlock *>,
+             BinaryBasicBlock::BinaryBranchInfo> Edges;
+
+    /// Targets of indirect calls made in the recorded calls, indexed by the
+    /// block of the call and the position of the call in the block.
+    std::map<std::pair<const BinaryBasicBlock *, unsigned>,
+             IndirectCallSiteProfile> CallSites;
+  };
+
+  /// Profile of the function in one of the workloads given with
+  /// -profile-variants, attached and inferred the same way as the profile
+  /// used for the optimizations.
+  struct VariantProfile {
+    /// Number of times the function was executed in the workload.
+    uint64_t ExecutionCount{0};
+
+    /// Counts of the blocks and of the CFG edges. Blocks created after the
+    /// profile was attached are missing, see getVariantCount().
+    std::map<const BinaryBasicBlock *, uint64_t> BlockCounts;
+    std::map<std::pair<const BinaryBasicBlock *, const BinaryBasicBlock *>,
+             uint64_t> EdgeCounts;
+  };
+
 private:
 
   /// Current state of the function.
@@ -314,9 +354,46 @@ private:
   /// for ICF optimization without relocations.
   bool IsFolded{false};
 
+  /// Indicate that nothing in the binary refers to the function. Such
+  /// functions are emitted after all others in relocation mode.
+  bool IsUnreferenced{false};
+
+  /// Indicate that the function is not emitted in relocation mode and stays
+  /// at its input address, with its references to code and data that moved
+  /// patched in the output file.
+  bool IsPatchedInPlace{false};
+
   /// Execution halts whenever this function is entered.
   bool TrapsOnEntry{false};
 
+  /// Number of dense instruction ids handed out by getOrCreateInstructionId().
+  uint32_t NumInstructionIds{0};
+
+  /// Number of labels created by createLocalTempSymbol().
+  uint32_t NumLocalLabels{0};
+
+  /// Input encodings of instructions that could be emitted by copying their
+  /// bytes. A record holds the offset and the size of the bytes followed by
+  /// the opcode, the flags, the number of operands, a mask of register
+  /// operands and the operands of the instruction as it was disassembled.
+  std::vector<int64_t> InputEncodings;
+
+  /// Input encoding records of the instructions in layout order, captured
+  /// before annotations are removed. Pseudo instructions are not counted.
+  std::vector<uint32_t> LayoutInputEncodings;
+
+  static constexpr uint32_t NoInputEncoding = ~0U;
+
+  /// Record the bytes of \p Inst at \p Offset as its input encoding if the
+  /// instruction does not depend on its address.
+  void recordInputEncoding(MCInst &Inst, uint64_t Offset, uint64_t Size);
+
+  /// Return the input bytes of \p Inst, the \p Ordinal-th non-pseudo
+  /// instruction in the layout, if the instruction did not change since it
+  /// was disassembled.
+  Optional<StringRef> getInputEncoding(const MCInst &Inst,
+                                       uint32_t Ordinal) const;
+
   /// The address for the code for this function in codegen memory.
   uint64_t ImageAddress{0};
 
@@ -332,6 +409,10 @@ private:
   /// The profile data for the number of times the function was executed.
   uint64_t ExecutionCount{COUNT_NO_PROFILE};
 
+  /// Time of the first profile sample in the function in nanoseconds, or -1
+  /// if the profile has no sample times.
+  uint64_t FirstExecutionTime{-1ULL};
+
   /// Profile data for branches.
   FuncBranchData *BranchData{nullptr};
 
@@ -349,6 +430,23 @@ private:
   /// specific call sites).
   IndirectCallSiteProfile AllCallSites;
 
+  /// Profiles of the function in the calls from its callers.
+  std::map<const BinaryFunction *, CallerProfile> CallerProfiles;
+
+  /// Branch profiles of the function in the workloads given with
+  /// -profile-variants, nullptr for workloads that did not execute it.
+  /// Released once the profiles are attached.
+  std::vector<const FuncBranchData *> VariantBranchData;
+
+  /// Profiles of the function in the workloads given with -profile-variants.
+  std::vector<VariantProfile> VariantProfiles;
+
+  /// Function this function is a clone of, or null.
+  BinaryFunction *CloneOf{nullptr};
+
+  /// Clones of this function specialized for some of its callers.
+  std::vector<BinaryFunction *> Clones;
+
   /// Score of the function (estimated number of instructions executed,
   /// according to profile data). -1 if the score has not been calculated yet.
   mutable int64_t FunctionScore{-1};
@@ -369,6 +467,11 @@ private:
   /// Last computed hash value.
   mutable uint64_t Hash{0};
 
+  /// Dynostats from the last call to getDynoStats() and the fingerprint of
+  /// the function they were computed for. 0 if not computed yet.
+  mutable DynoStats CachedDynoStats;
+  mutable uint64_t DynoStatsFingerprint{0};
+
   /// For PLT functions it contains a symbol associated with a function
   /// reference. It is nullptr for non-PLT functions.
   const MCSymbol *PLTSymbol{nullptr};
@@ -376,6 +479,14 @@ private:
   /// Function order for streaming into the destination binary.
   uint32_t Index{-1U};
 
+  /// In relocation mode, emit the pending cold fragments of the preceding
+  /// split functions right before this function.
+  bool ColdFragmentsBefore{false};
+
+  /// In relocation mode, the constant islands of the hot part are emitted
+  /// after the hot code instead of after the function body.
+  bool MovedConstantIslands{false};
+
   /// Get basic block index assuming it belongs to this function.
   unsigned getIndex(const BinaryBasicBlock *BB) const {
     assert(BB->getIndex() < BasicBlocks.size());
@@ -427,6 +538,11 @@ private:
   /// Recompute landing pad information for the function and all its blocks.
   void recomputeLandingPads();
 
+  /// Make this function a copy of \p Function with the same CFG, layout
+  /// and frame information, and the same profile. Used by
+  /// BinaryContext::createFunctionClone().
+  void cloneFrom(BinaryFunction &Function);
+
   /// Temporary holder of offsets that are potentially entry points.
   std::unordered_set<uint64_t> EntryOffsets;
 
@@ -619,6 +735,13 @@ private:
   /// of the function.
   MCSymbol *getOrCreateLocalLabel(uint64_t Address, bool CreatePastEnd = false);
 
+  /// Create a new temporary label with \p Prefix for code in the function.
+  /// Safe to call while other functions are processed in parallel. With
+  /// -deterministic the name only depends on the function and the labels it
+  /// created before, and not on the labels created by other threads.
+  MCSymbol *createLocalTempSymbol(StringRef Prefix = "tmp",
+                                  bool AlwaysAddSuffix = true);
+
   /// Register an entry point at a given \p Offset into the function.
   void markDataAtOffset(uint64_t Offset) {
     DataOffsets.emplace(Offset);
@@ -656,6 +779,13 @@ private:
                                            unsigned Size,
                                            uint64_t Offset);
 
+  /// Register the jump table of the AArch64 jump \p Instruction at \p Offset
+  /// matched as \p Jump, whose input entries are relative to \p PCRelAddr.
+  /// Return false if the table cannot be recovered in full.
+  bool processScaledJumpTable(MCInst &Instruction, uint64_t Offset,
+                              uint64_t PCRelAddr,
+                              const MCPlusBuilder::ScaledJumpTable &Jump);
+
   DenseMap<const MCInst *, SmallVector<MCInst *, 4>>
   computeLocalUDChain(const MCInst *CurInstr);
 
@@ -665,6 +795,25 @@ private:
   /// Return new current location which is either \p NewLoc or \p PrevLoc.
   SMLoc emitLineInfo(SMLoc NewLoc, SMLoc PrevLoc) const;
 
+  /// Add the rows of the input line table covering \p BB to the output line
+  /// table, at the same offsets from the start of the block. Used instead of
+  /// emitLineInfo() with -update-debug-line-rows. Must be called after the
+  /// label of the block is emitted into the current section.
+  void emitBlockLineInfo(MCStreamer &Streamer,
+                         BinaryBasicBlock &BB) const;
+
+  /// Compute the hash of the instructions of \p BB that contribute to the
+  /// function hash.
+  uint64_t computeBlockHash(const BinaryBasicBlock &BB) const;
+
+  /// Return a value that changes whenever anything getDynoStats() depends on
+  /// does: the layout, the opcodes of the instructions, and the profile.
+  /// Cheaper to compute than the stats themselves.
+  uint64_t computeDynoStatsFingerprint() const;
+
+  /// Compute dynostats for the function without using the cache.
+  DynoStats computeDynoStats() const;
+
   BinaryFunction& operator=(const BinaryFunction &) = delete;
   BinaryFunction(const BinaryFunction &) = delete;
 
@@ -855,7 +1004,8 @@ public:
   ///
   /// The function relies on branch instructions being in-sync with CFG for
   /// branch instructions stats. Thus it is better to call it after
-  /// fixBranches().
+  /// fixBranches(). The stats are cached, and recomputed only when the
+  /// instructions, the layout, or the profile of the function change.
   DynoStats getDynoStats() const;
 
   BinaryBasicBlock *getBasicBlockForLabel(const MCSymbol *Label) {
@@ -999,6 +1149,16 @@ public:
     return Index != -1U;
   }
 
+  /// Return relocations from the function to other code or data.
+  const std::map<uint64_t, Relocation> &getRelocations() const {
+    return Relocations;
+  }
+
+  /// Return relocations used for moving the function body as it is.
+  const std::map<uint64_t, Relocation> &getMoveRelocations() const {
+    return MoveRelocations;
+  }
+
   /// Get the streaming order index for this function.
   uint32_t getIndex() const {
     return Index;
@@ -1010,6 +1170,32 @@ public:
     Index = Idx;
   }
 
+  /// Return true if the cold fragments of the preceding split functions that
+  /// were not emitted yet go right before this function.
+  bool hasColdFragmentsBefore() const {
+    return ColdFragmentsBefore;
+  }
+
+  void setColdFragmentsBefore(bool Value = true) {
+    ColdFragmentsBefore = Value;
+  }
+
+  /// Return true if the constant islands of the hot part do not follow the
+  /// function body and are emitted with emitMovedConstantIslands().
+  bool hasMovedConstantIslands() const {
+    return MovedConstantIslands;
+  }
+
+  void setMovedConstantIslands(bool Value = true) {
+    MovedConstantIslands = Value;
+  }
+
+  /// Emit the constant islands of the hot part separately from the body.
+  void emitMovedConstantIslands(MCStreamer &Streamer) {
+    assert(hasMovedConstantIslands() && "constant islands were not moved");
+    emitConstantIslands(Streamer, /*EmitColdPart=*/false);
+  }
+
   /// Get the original address for the given basic block within this function.
   uint64_t getBasicBlockOriginalAddress(const BinaryBasicBlock *BB) const {
     return Address + BB->getOffset();
@@ -1062,6 +1248,7 @@ public:
     if (ColdSymbol)
       return ColdSymbol;
 
+    std::lock_guard<std::mutex> Lock(BC.CtxMutex);
     ColdSymbol = BC.Ctx->getOrCreateSymbol(
         Twine(getSymbol()->getName()).concat(".cold"));
 
@@ -1237,6 +1424,29 @@ public:
     return IsFolded;
   }
 
+  /// Return true if the function was created by BOLT as a copy of another.
+  bool isClone() const {
+    return CloneOf != nullptr;
+  }
+
+  /// Return the function this function is a clone of, or null.
+  BinaryFunction *getCloneOf() const {
+    return CloneOf;
+  }
+
+  /// Return the clones of this function.
+  const std::vector<BinaryFunction *> &getClones() const {
+    return Clones;
+  }
+
+  bool isUnreferenced() const {
+    return IsUnreferenced;
+  }
+
+  bool isPatchedInPlace() const {
+    return IsPatchedInPlace;
+  }
+
   /// Return true if the function uses jump tables.
   bool hasJumpTables() const {
     return !JumpTables.empty();
@@ -1295,6 +1505,7 @@ public:
                    bool DeriveAlignment = false) {
     assert(BC.Ctx && "cannot be called with empty context");
     if (!Label) {
+      std::lock_guard<std::mutex> Lock(BC.CtxMutex);
       Label = BC.Ctx->createTempSymbol("BB", true);
     }
     auto BB = std::unique_ptr<BinaryBasicBlock>(
@@ -1452,6 +1663,11 @@ public:
            ProfileMatchRatio == 1.0f;
   }
 
+  /// Return the fraction of profile records that matched the function.
+  float getProfileMatchRatio() const {
+    return ProfileMatchRatio;
+  }
+
   /// Mark this function as having a valid profile.
   void markProfiled(uint16_t Flags) {
     if (ExecutionCount == COUNT_NO_PROFILE)
@@ -1573,6 +1789,16 @@ public:
     return *this;
   }
 
+  BinaryFunction &setUnreferenced(bool Unreferenced = true) {
+    IsUnreferenced = Unreferenced;
+    return *this;
+  }
+
+  BinaryFunction &setPatchedInPlace(bool PatchedInPlace = true) {
+    IsPatchedInPlace = PatchedInPlace;
+    return *this;
+  }
+
   BinaryFunction &setPersonalityFunction(uint64_t Addr) {
     assert(!PersonalityFunction && "can't set personality function twice");
     PersonalityFunction = BC.getOrCreateGlobalSymbol(Addr, 0, 0, "FUNCat");
@@ -1663,6 +1889,21 @@ public:
     return ExecutionCount == COUNT_NO_PROFILE ? 0 : ExecutionCount;
   }
 
+  /// Return the time of the first profile sample in the function, or -1 if
+  /// not known.
+  uint64_t getFirstExecutionTime() const {
+    return FirstExecutionTime;
+  }
+
+  /// Record a profile sample in the function taken at \p Time.
+  void recordExecutionTime(uint64_t Time) {
+    FirstExecutionTime = std::min(FirstExecutionTime, Time);
+  }
+
+  /// Return the average number of cycles recorded by LBR from a taken branch
+  /// to the next one within the function, or 0 if none were recorded.
+  double getAverageCycles() const;
+
   /// Return original LSDA address for the function or NULL.
   uint64_t getLSDAAddress() const {
     return LSDAAddress;
@@ -1738,6 +1979,7 @@ public:
       IslandSymbols[Offset] = Symbol;
     }
     if (!ColdIslandSymbols.count(Symbol)) {
+      std::lock_guard<std::mutex> Lock(BC.CtxMutex);
       ColdSymbol = BC.Ctx->getOrCreateSymbol(Symbol->getName() + ".cold");
       ColdIslandSymbols[Symbol] = ColdSymbol;
     } else {
@@ -1758,6 +2000,7 @@ public:
 
     MCSymbol *ProxyHot, *ProxyCold;
     if (!IslandProxies[Referrer].count(HotColdSymbols.first)) {
+      std::lock_guard<std::mutex> Lock(BC.CtxMutex);
       ProxyHot =
           BC.Ctx->getOrCreateSymbol(HotColdSymbols.first->getName() +
                                     ".proxy.for." + Referrer->getPrintName());
@@ -1850,7 +2093,11 @@ public:
   /// \p FunctionData is the set bytes representing the function body.
   ///
   /// The Function should be properly initialized before this function
-  /// is called. I.e. function address and size should be set.
+  /// is called. I.e. function address and size should be set, and the
+  /// memory profile should be matched with matchProfileMemData().
+  ///
+  /// Different functions could be disassembled concurrently. Updates to the
+  /// state shared via BinaryContext are synchronized.
   ///
   /// Returns true on successful disassembly, and updates the current
   /// state to State:Disassembled.
@@ -1872,11 +2119,32 @@ public:
   bool buildCFG();
 
   /// Read any kind of profile information available for the function.
+  /// Same as calling evaluateAssignedProfile(), matchProfileData() and
+  /// attachProfile() in sequence.
   void readProfile();
 
+  /// Check how well the branch profile preliminarily assigned to the function
+  /// matches it. Only accesses the function itself, so it could run on
+  /// multiple functions in parallel.
+  void evaluateAssignedProfile();
+
+  /// Attribute the matched profile to basic blocks, edges and call sites.
+  /// Only accesses the function itself, so it could run on multiple functions
+  /// in parallel.
+  void attachProfile();
+
   /// Perform post-processing of the CFG.
   void postProcessCFG();
 
+  /// Release instructions and other intermediate state of disassembly. Used
+  /// for functions without CFG that are left untouched by the rewrite.
+  void clearDisasmState();
+
+  /// Release instructions, CFG edges and profile of the function once its
+  /// code was emitted and its output addresses were recorded. Basic blocks
+  /// are kept with their input and output ranges for updating debug info.
+  void releaseEmittedState();
+
   /// Verify that any assumptions we've made about indirect branches were
   /// correct and also make any necessary changes to unknown indirect branches.
   ///
@@ -1898,7 +2166,9 @@ public:
   bool fetchProfileForOtherEntryPoints();
 
   /// Find the best matching profile for a function after the creation of basic
-  /// blocks.
+  /// blocks, starting from the evaluation done by evaluateAssignedProfile().
+  /// Could look up and claim profiles of other functions, so it has to run
+  /// serially.
   void matchProfileData();
 
   /// Find the best matching memory data profile for a function before the
@@ -1989,12 +2259,32 @@ public:
   bool hasLayoutChanged() const;
 
   /// Get the edit distance of the new layout with respect to the previous
-  /// layout after basic block reordering.
+  /// layout after basic block reordering. For layouts that differ in many
+  /// blocks, the distance is approximated from above in O(N log N) time.
   uint64_t getEditDistance() const;
 
   /// Get the number of instructions within this function.
   uint64_t getInstructionCount() const;
 
+  /// Return the dense id of \p Inst, assigning the next free one if the
+  /// instruction has none. Ids index MCPlus::AnnotationTable side tables and
+  /// stay with the instruction until its annotations are removed.
+  uint32_t getOrCreateInstructionId(MCInst &Inst);
+
+  /// Return an upper bound of the instruction ids assigned in this function.
+  uint32_t getNumInstructionIds() const {
+    return NumInstructionIds;
+  }
+
+  /// Forget all instruction ids. Called once annotations are removed.
+  void clearInstructionIds() {
+    NumInstructionIds = 0;
+  }
+
+  /// Remember the input encoding records of the instructions in the current
+  /// layout, so that emitBody() can find them once annotations are gone.
+  void captureInputEncodings();
+
   const CFIInstrMapType &getFDEProgram() const {
     return FrameInstructions;
   }
@@ -2038,9 +2328,21 @@ public:
   /// Emit exception handling ranges for the function.
   void emitLSDA(MCStreamer *Streamer, bool EmitColdPart);
 
+  /// Emit the LSDA of a function that is not split for \p Sites with
+  /// uleb128-encoded call site entries relative to \p StartSymbol.
+  void emitCompactLSDA(MCStreamer *Streamer, const std::vector<CallSite> &Sites,
+                       const MCSymbol *StartSymbol);
+
+  /// Emit action, type and type index tables of the LSDA. If \p TTBaseLabel
+  /// is set, the type table is aligned and the label is emitted at its end.
+  void emitLSDATables(MCStreamer *Streamer, const MCSymbol *TTBaseLabel);
+
   /// Emit jump tables for the function.
   void emitJumpTables(MCStreamer *Streamer);
 
+  /// Emit the jump table \p JT of the function.
+  void emitJumpTable(MCStreamer *Streamer, JumpTable &JT);
+
   /// Emit function code. The caller is responsible for emitting function
   /// symbol(s) and setting the section to emit the code to.
   void emitBody(MCStreamer &Streamer, bool EmitColdPart);
@@ -2069,10 +2371,19 @@ public:
   /// functions (functions with different symbolic references but identical
   /// otherwise) are required to have identical hashes.
   ///
+  /// The hash combines the hashes of the blocks, which are recomputed and
+  /// cached in the blocks when \p Recompute is set, as instructions could
+  /// have been modified in place since they were last computed.
+  ///
   /// If \p UseDFS is set, then process blocks in DFS order that we recompute.
   /// Otherwise use the existing layout order.
   std::size_t hash(bool Recompute = true, bool UseDFS = false) const;
 
+  /// Returns a hash of the opcodes and registers of \p BB, the same one that
+  /// is combined into the hash of the whole function. The hash cached in the
+  /// block is used if there is one. Used to match blocks of a stale profile.
+  std::size_t hashBlock(const BinaryBasicBlock &BB) const;
+
   /// Sets the associated .debug_info entry.
   void addSubprogramDIE(const DWARFDie DIE) {
     SubprogramDIEs.emplace_back(DIE);
@@ -2111,7 +2422,7 @@ public:
   ///
   /// Return true if the branch is valid, false otherwise.
   bool recordBranch(uint64_t From, uint64_t To, uint64_t Count = 1,
-                    uint64_t Mispreds = 0);
+                    uint64_t Mispreds = 0, uint64_t Cycles = 0);
 
   /// Record external entry into the function.
   ///
@@ -2123,13 +2434,76 @@ public:
   /// Return true if the exit point is valid, false otherwise.
   bool recordExit(uint64_t From, bool Mispred, uint64_t Count = 1);
 
+  /// Record \p Count calls into the function from \p Caller.
+  void recordCallerEntry(const BinaryFunction &Caller, uint64_t Count);
+
+  /// Record a branch or a fall-through from offset \p From to offset \p To
+  /// taken \p Count times in calls from \p Caller.
+  ///
+  /// Return true if it matches an edge of the CFG, false otherwise.
+  bool recordCallerBranch(const BinaryFunction &Caller, uint64_t From,
+                          uint64_t To, uint64_t Count, uint64_t Mispreds);
+
+  /// Record a call from offset \p From to offset \p ToOffset in \p Target
+  /// made \p Count times in calls from \p Caller. Only indirect calls are
+  /// recorded, the targets of direct calls are known.
+  ///
+  /// Return true if the call was recorded, false otherwise.
+  bool recordCallerCall(const BinaryFunction &Caller, uint64_t From,
+                        const BinaryFunction &Target, uint64_t ToOffset,
+                        uint64_t Count, uint64_t Mispreds);
+
+  /// Return the profiles of the function in the calls from its callers.
+  const std::map<const BinaryFunction *, CallerProfile> &
+  getCallerProfiles() const {
+    return CallerProfiles;
+  }
+
+  /// Release the profiles of the calls from the callers.
+  void clearCallerProfiles() {
+    std::map<const BinaryFunction *, CallerProfile>().swap(CallerProfiles);
+  }
+
+  /// Set the branch profiles of the function in the workloads given with
+  /// -profile-variants. They are attached together with the profile of the
+  /// function.
+  void setVariantBranchData(std::vector<const FuncBranchData *> &&Data) {
+    VariantBranchData = std::move(Data);
+  }
+
+  /// Return the profiles of the function in the workloads given with
+  /// -profile-variants, or an empty vector if they were not attached.
+  const std::vector<VariantProfile> &getVariantProfiles() const {
+    return VariantProfiles;
+  }
+
+  /// Return the count of the edge from \p BB to \p Succ, or of \p BB if
+  /// \p Succ is nullptr, in profile variant \p Variant. \p Count is the
+  /// count in the profile used for the optimizations. Blocks and edges
+  /// created by optimizations get \p Count scaled by the ratio of the
+  /// execution counts of the function in the two profiles.
+  uint64_t getVariantCount(unsigned Variant, const BinaryBasicBlock &BB,
+                           const BinaryBasicBlock *Succ,
+                           uint64_t Count) const;
+
   /// Finalize profile for the function.
   void postProcessProfile();
 
+  /// Compute block counts from the entry counts and the counts of taken
+  /// branches, and infer the counts of fall-throughs. Counts of calls
+  /// recorded in the instructions are only used if \p UseCallCounts is set.
+  void inferBlockCounts(bool UseCallCounts = true);
+
+  /// Attach the branch profiles set with setVariantBranchData() in place of
+  /// the profile of the function, one at a time, and keep their counts in
+  /// VariantProfiles. The profile of the function is restored.
+  void attachVariantProfiles();
+
   /// Return a vector of offsets corresponding to a trace in a function
-  /// (see recordTrace() above).
+  /// (see recordTrace() above). The trace is recorded \p Count times.
   Optional<SmallVector<std::pair<uint64_t, uint64_t>, 16>>
-  getFallthroughsInTrace(const LBREntry &First, const LBREntry &Second);
+  getFallthroughsInTrace(const LBREntry &First, const LBREntry &Second,
+                         uint64_t Count = 1);
 
   /// Returns an estimate of the function's hot part after splitting.
   /// This is a very rough estimate, as with C++ exceptions there are
@@ -2227,24 +2601,15 @@ public:
   const FragmentInfo &cold() const { return ColdFragment; }
 };
 
-/// Return program-wide dynostats.
-template <typename FuncsType>
-inline DynoStats getDynoStats(const FuncsType &Funcs) {
-  DynoStats dynoStats;
-  for (auto &BFI : Funcs) {
-    auto &BF = BFI.second;
-    if (BF.isSimple()) {
-      dynoStats += BF.getDynoStats();
-    }
-  }
-  return dynoStats;
-}
+/// Return program-wide dynostats. Stats of the functions are computed in
+/// parallel, and only for the functions modified since the last call.
+DynoStats getDynoStats(std::map<uint64_t, BinaryFunction> &BFs);
 
 /// Call a function with optional before and after dynostats printing.
 template <typename FnType, typename FuncsType>
 inline void
 callWithDynoStats(FnType &&Func,
-                  const FuncsType &Funcs,
+                  FuncsType &Funcs,
                   StringRef Phase,
                   const bool Flag) {
   DynoStats DynoStatsBefore;
@@ -17,6 +17,8 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
+#include <cmath>
+#include <mutex>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-prof"
@@ -166,7 +168,8 @@ bool BinaryFunction::recordTrace(
 }
 
 bool BinaryFunction::recordBranch(uint64_t From, uint64_t To,
-                                  uint64_t Count, uint64_t Mispreds) {
+                                  uint64_t Count, uint64_t Mispreds,
+                                  uint64_t Cycles) {
   auto *FromBB = getBasicBlockContainingOffset(From);
   auto *ToBB = getBasicBlockContainingOffset(To);
 
@@ -255,6 +258,7 @@ bool BinaryFunction::recordBranch(uint64_t From, uint64_t To,
   // Only update mispredicted count if it the count was real.
   if (Count) {
     BI.MispredictedCount += Mispreds;
+    BI.Cycles += Cycles;
   }
 
   return true;
@@ -293,6 +297,68 @@ bool BinaryFunction::recordExit(uint64_t From, bool Mispred, uint64_t Count) {
   return true;
 }
 
+void BinaryFunction::recordCallerEntry(const BinaryFunction &Caller,
+                                       uint64_t Count) {
+  CallerProfiles[&Caller].EntryCount += Count;
+}
+
+bool BinaryFunction::recordCallerBranch(const BinaryFunction &Caller,
+                                        uint64_t From, uint64_t To,
+                                        uint64_t Count, uint64_t Mispreds) {
+  if (!isSimple() || CurrentState != State::CFG)
+    return false;
+
+  auto *FromBB = getBasicBlockContainingOffset(From);
+  auto *ToBB = getBasicBlockAtOffset(To);
+  if (!FromBB || !ToBB || !FromBB->getSuccessor(ToBB->getLabel()))
+    return false;
+
+  auto &BI = CallerProfiles[&Caller].Edges[std::make_pair(FromBB, ToBB)];
+  BI.Count += Count;
+  BI.MispredictedCount += Mispreds;
+  return true;
+}
+
+bool BinaryFunction::recordCallerCall(const BinaryFunction &Caller,
+                                      uint64_t From,
+                                      const BinaryFunction &Target,
+                                      uint64_t ToOffset, uint64_t Count,
+                                      uint64_t Mispreds) {
+  if (!isSimple() || CurrentState != State::CFG)
+    return false;
+
+  auto *BB = getBasicBlockContainingOffset(From);
+  if (!BB)
+    return false;
+
+  // Instructions only keep their input offsets in annotations.
+  unsigned Index = 0;
+  for (const auto &Inst : *BB) {
+    if (BC.MIB->getAnnotationWithDefault<uint64_t>(Inst, "Offset", -1ULL) ==
+        From) {
+      if (!BC.MIB->isIndirectCall(Inst) && !BC.MIB->isIndirectBranch(Inst))
+        return false;
+      auto &CSP = CallerProfiles[&Caller].CallSites[std::make_pair(BB, Index)];
+      auto CI = std::find_if(CSP.begin(), CSP.end(),
+                             [&](const IndirectCallProfile &Profile) {
+                               return Profile.Name == Target.getNames()[0] &&
+                                      Profile.Offset == ToOffset;
+                             });
+      if (CI == CSP.end()) {
+        CSP.emplace_back(/*IsFunction=*/true, Target.getNames()[0], Count,
+                         Mispreds, ToOffset);
+      } else {
+        CI->Count += Count;
+        CI->Mispreds += Mispreds;
+      }
+      return true;
+    }
+    ++Index;
+  }
+
+  return false;
+}
+
 void BinaryFunction::postProcessProfile() {
   if (!hasValidProfile()) {
     clearProfile();
@@ -319,6 +385,53 @@ void BinaryFunction::postProcessProfile() {
     ExecutionCount = 1;
   }
 
+  inferBlockCounts();
+
+  // Update profile information for jump tables based on CFG branch data.
+  for (auto *BB : BasicBlocks) {
+    const auto *LastInstr = BB->getLastNonPseudoInstr();
+    if (!LastInstr)
+      continue;
+    const auto JTAddress = BC.MIB->getJumpTable(*LastInstr);
+    if (!JTAddress)
+      continue;
+    auto *JT = getJumpTableContainingAddress(JTAddress);
+    if (!JT)
+      continue;
+
+    uint64_t TotalBranchCount = 0;
+    for (const auto &BranchInfo : BB->branch_info()) {
+      TotalBranchCount += BranchInfo.Count;
+    }
+    JT->Count += TotalBranchCount;
+
+    if (opts::IndirectCallPromotion < ICP_JUMP_TABLES &&
+        opts::JumpTables < JTS_AGGRESSIVE)
+      continue;
+
+    if (JT->Counts.empty())
+      JT->Counts.resize(JT->Entries.size());
+    auto EI = JT->Entries.begin();
+    auto Delta = (JTAddress - JT->getAddress()) / JT->EntrySize;
+    EI += Delta;
+    while (EI != JT->Entries.end()) {
+      const auto *TargetBB = getBasicBlockForLabel(*EI);
+      if (TargetBB) {
+        const auto &BranchInfo = BB->getBranchInfo(*TargetBB);
+        assert(Delta < JT->Counts.size());
+        JT->Counts[Delta].Count += BranchInfo.Count;
+        JT->Counts[Delta].Mispreds += BranchInfo.MispredictedCount;
+      }
+      ++Delta;
+      ++EI;
+      // A label marks the start of another jump table.
+      if (JT->Labels.count(Delta * JT->EntrySize))
+        break;
+    }
+  }
+}
+
+void BinaryFunction::inferBlockCounts(bool UseCallCounts) {
   // Compute preliminary execution count for each basic block.
   for (auto *BB : BasicBlocks) {
     if ((!BB->isEntryPoint() && !BB->isLandingPad()) ||
@@ -352,6 +465,8 @@ void BinaryFunction::postProcessProfile() {
       }
       // Make sure that execution count of a block is at least the number of
       // function calls from the block.
+      if (!UseCallCounts)
+        continue;
       for (auto &Inst : *BB) {
         // Ignore non-call instruction
         if (!BC.MIA->isCall(Inst))
@@ -367,63 +482,119 @@ void BinaryFunction::postProcessProfile() {
 
   if (opts::InferFallThroughs)
     inferFallThroughCounts();
+}
 
-  // Update profile information for jump tables based on CFG branch data.
+void BinaryFunction::attachVariantProfiles() {
+  std::vector<uint64_t> SavedBlockCounts;
+  std::vector<BinaryBasicBlock::BinaryBranchInfo> SavedBranchInfo;
   for (auto *BB : BasicBlocks) {
-    const auto *LastInstr = BB->getLastNonPseudoInstr();
-    if (!LastInstr)
-      continue;
-    const auto JTAddress = BC.MIB->getJumpTable(*LastInstr);
-    if (!JTAddress)
-      continue;
-    auto *JT = getJumpTableContainingAddress(JTAddress);
-    if (!JT)
+    SavedBlockCounts.push_back(BB->ExecutionCount);
+    for (const auto &BI : BB->branch_info())
+      SavedBranchInfo.push_back(BI);
+  }
+  const auto SavedExecutionCount = ExecutionCount;
+
+  VariantProfiles.clear();
+  VariantProfiles.resize(VariantBranchData.size());
+  for (unsigned I = 0; I < VariantBranchData.size(); ++I) {
+    const auto *Data = VariantBranchData[I];
+    if (!Data)
       continue;
 
-    uint64_t TotalBranchCount = 0;
-    for (const auto &BranchInfo : BB->branch_info()) {
-      TotalBranchCount += BranchInfo.Count;
+    // Attach the variant the same way as the profile, see attachProfile().
+    ExecutionCount = Data->ExecutionCount;
+    for (auto *BB : BasicBlocks) {
+      BB->ExecutionCount = 0;
+      for (auto &BI : BB->branch_info())
+        BI = BinaryBasicBlock::BinaryBranchInfo{0, 0, 0};
+    }
+    for (const auto &BI : Data->EntryData) {
+      auto *BB = getBasicBlockAtOffset(BI.To.Offset);
+      if (BB && (BB->isEntryPoint() || BB->isLandingPad()))
+        BB->ExecutionCount += BI.Branches;
+    }
+    for (const auto &BI : Data->Data) {
+      if (BI.From.Name == BI.To.Name)
+        recordBranch(BI.From.Offset, BI.To.Offset, BI.Branches);
     }
-    JT->Count += TotalBranchCount;
-
-    if (opts::IndirectCallPromotion < ICP_JUMP_TABLES &&
-        opts::JumpTables < JTS_AGGRESSIVE)
-      continue;
 
-    if (JT->Counts.empty())
-      JT->Counts.resize(JT->Entries.size());
-    auto EI = JT->Entries.begin();
-    auto Delta = (JTAddress - JT->getAddress()) / JT->EntrySize;
-    EI += Delta;
-    while (EI != JT->Entries.end()) {
-      const auto *TargetBB = getBasicBlockForLabel(*EI);
-      if (TargetBB) {
-        const auto &BranchInfo = BB->getBranchInfo(*TargetBB);
-        assert(Delta < JT->Counts.size());
-        JT->Counts[Delta].Count += BranchInfo.Count;
-        JT->Counts[Delta].Mispreds += BranchInfo.MispredictedCount;
+    // Counts of calls recorded in the instructions come from the profile.
+    inferBlockCounts(/*UseCallCounts=*/false);
+
+    auto &Variant = VariantProfiles[I];
+    Variant.ExecutionCount = ExecutionCount;
+    for (const auto *BB : BasicBlocks) {
+      Variant.BlockCounts[BB] = BB->getKnownExecutionCount();
+      auto BI = BB->branch_info_begin();
+      for (const auto *Succ : BB->successors()) {
+        Variant.EdgeCounts[std::make_pair(BB, Succ)] = BI->Count;
+        ++BI;
       }
-      ++Delta;
-      ++EI;
-      // A label marks the start of another jump table.
-      if (JT->Labels.count(Delta * JT->EntrySize))
-        break;
     }
   }
+
+  auto BlockCount = SavedBlockCounts.begin();
+  auto BranchInfo = SavedBranchInfo.begin();
+  for (auto *BB : BasicBlocks) {
+    BB->ExecutionCount = *BlockCount++;
+    for (auto &BI : BB->branch_info())
+      BI = *BranchInfo++;
+  }
+  ExecutionCount = SavedExecutionCount;
+
+  std::vector<const FuncBranchData *>().swap(VariantBranchData);
+}
+
+uint64_t BinaryFunction::getVariantCount(unsigned Variant,
+                                         const BinaryBasicBlock &BB,
+                                         const BinaryBasicBlock *Succ,
+                                         uint64_t Count) const {
+  if (Variant >= VariantProfiles.size())
+    return 0;
+  const auto &Profile = VariantProfiles[Variant];
+
+  if (Succ) {
+    auto EI = Profile.EdgeCounts.find(std::make_pair(&BB, Succ));
+    if (EI != Profile.EdgeCounts.end())
+      return EI->second;
+  } else {
+    auto BI = Profile.BlockCounts.find(&BB);
+    if (BI != Profile.BlockCounts.end())
+      return BI->second;
+  }
+
+  if (Count == BinaryBasicBlock::COUNT_NO_PROFILE || !getKnownExecutionCount())
+    return 0;
+  return std::llround(static_cast<double>(Count) * Profile.ExecutionCount /
+                      getKnownExecutionCount());
 }
 
 Optional<SmallVector<std::pair<uint64_t, uint64_t>, 16>>
 BinaryFunction::getFallthroughsInTrace(const LBREntry &FirstLBR,
-                                       const LBREntry &SecondLBR) {
+                                       const LBREntry &SecondLBR,
+                                       uint64_t Count) {
   SmallVector<std::pair<uint64_t, uint64_t>, 16> Res;
 
-  if (!recordTrace(FirstLBR, SecondLBR, 1, &Res))
+  if (!recordTrace(FirstLBR, SecondLBR, Count, &Res))
     return NoneType();
 
   return Res;
 }
 
 void BinaryFunction::readProfile() {
+  evaluateAssignedProfile();
+  matchProfileData();
+  attachProfile();
+}
+
+void BinaryFunction::evaluateAssignedProfile() {
+  if (empty() || !BC.DR.hasLBR() || !BranchData)
+    return;
+
+  ProfileMatchRatio = evaluateProfileData(*BranchData);
+}
+
+void BinaryFunction::attachProfile() {
   if (empty())
     return;
 
@@ -435,9 +606,6 @@ void BinaryFunction::readProfile() {
 
   ProfileFlags = PF_LBR;
 
-  // Possibly assign/re-assign branch profile data.
-  matchProfileData();
-
   if (!BranchData)
     return;
 
@@ -465,7 +633,7 @@ void BinaryFunction::readProfile() {
     }
 
     if (!recordBranch(BI.From.Offset, BI.To.Offset,
-                      BI.Branches, BI.Mispreds)) {
+                      BI.Branches, BI.Mispreds, BI.Cycles)) {
       DEBUG(dbgs() << "bad branch : " << BI.From.Offset << " -> "
                    << BI.To.Offset << '\n');
       ++MismatchedBranches;
@@ -601,8 +769,8 @@ void BinaryFunction::readSampleData() {
   bool NormalizeByInsnCount =
       BC.DR.usesEvent("cycles") || BC.DR.usesEvent("instructions");
   bool NormalizeByCalls = BC.DR.usesEvent("branches");
-  static bool NagUser{true};
-  if (NagUser) {
+  static std::once_flag NagUser;
+  std::call_once(NagUser, [&]() {
     outs()
         << "BOLT-INFO: operating with basic samples profiling data (no LBR).\n";
     if (NormalizeByInsnCount) {
@@ -610,8 +778,7 @@ void BinaryFunction::readSampleData() {
     } else if (NormalizeByCalls) {
       outs() << "BOLT-INFO: normalizing samples by branches.\n";
     }
-    NagUser = false;
-  }
+  });
   uint64_t LastOffset = getSize();
   uint64_t TotalEntryCount{0};
   for (auto I = BasicBlockOffsets.rbegin(), E = BasicBlockOffsets.rend();
@@ -762,11 +929,10 @@ void BinaryFunction::matchProfileData() {
   // This functionality is available for LBR-mode only
   // TODO: Implement evaluateProfileData() for samples, checking whether
   // sample addresses match instruction addresses in the function
-  if (!BC.DR.hasLBR())
+  if (empty() || !BC.DR.hasLBR())
     return;
 
   if (BranchData) {
-    ProfileMatchRatio = evaluateProfileData(*BranchData);
     if (ProfileMatchRatio == 1.0f) {
       if (fetchProfileForOtherEntryPoints()) {
         ProfileMatchRatio = evaluateProfileData(*BranchData);
@@ -796,6 +962,14 @@ void BinaryFunction::matchProfileData() {
     if (NewBranchData->Used)
       continue;
 
+    // LTO names could be shared by many functions. Reject profiles with
+    // branches outside of the function before the costly evaluation.
+    if (std::any_of(NewBranchData->Data.begin(), NewBranchData->Data.end(),
+                    [&](const BranchInfo &BI) {
+                      return BI.From.Offset >= getSize();
+                    }))
+      continue;
+
     if (evaluateProfileData(*NewBranchData) != 1.0f)
       continue;
 
@@ -10,19 +10,32 @@
 //===----------------------------------------------------------------------===//
 
 #include "BinaryPassManager.h"
+#include "ParallelUtilities.h"
+#include "PhaseStats.h"
 #include "Passes/Aligner.h"
 #include "Passes/AllocCombiner.h"
+#include "Passes/CMOVConversion.h"
+#include "Passes/DataflowInfoManager.h"
 #include "Passes/FrameOptimizer.h"
+#include "Passes/FunctionCloning.h"
 #include "Passes/IdenticalCodeFolding.h"
+#include "Passes/IdenticalDataFolding.h"
 #include "Passes/IndirectCallPromotion.h"
 #include "Passes/Inliner.h"
+#include "Passes/Instrumentation.h"
 #include "Passes/LongJmp.h"
 #include "Passes/JTFootprintReduction.h"
+#include "Passes/JTLowering.h"
 #include "Passes/PLTCall.h"
+#include "Passes/PrefetchInsertion.h"
 #include "Passes/RegReAssign.h"
 #include "Passes/ReorderFunctions.h"
 #include "Passes/ReorderData.h"
 #include "Passes/StokeInfo.h"
+#include "Passes/StructFieldHotness.h"
+#include "Passes/TailDuplication.h"
+#include "Passes/UnreferencedFunctions.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include <numeric>
@@ -39,6 +52,8 @@ extern cl::opt<bool> PrintAll;
 extern cl::opt<bool> PrintDynoStats;
 extern cl::opt<bool> DumpDotAll;
 extern cl::opt<bolt::PLTCall::OptType> PLT;
+extern cl::opt<bool> Instrument;
+extern cl::opt<unsigned> TimeBudget;
 
 static cl::opt<bool>
 DynoStatsAll("dyno-stats-all",
@@ -60,12 +75,27 @@ ICF("icf",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+ICFData("icf-data",
+  cl::desc("make references to identical objects in read-only data sections "
+           "use a single copy (relocation mode only). Breaks code comparing "
+           "addresses of distinct objects"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 InlineSmallFunctions("inline-small-functions",
   cl::desc("inline functions with a single basic block"),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<bool>
+InlineHotCalls("inline-hot-calls",
+  cl::desc("inline hot call sites of small functions that do not use the "
+           "stack, including functions with multiple basic blocks"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 JTFootprintReductionFlag("jt-footprint-reduction",
   cl::desc("make jump tables size smaller at the cost of using more "
@@ -73,12 +103,41 @@ JTFootprintReductionFlag("jt-footprint-reduction",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+JTLoweringFlag("jt-lowering",
+  cl::desc("replace indirect jumps through jump tables with compares and bit "
+           "tests for the hot targets, based on profile"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+LayoutOnly("layout-only",
+  cl::desc("only reorder and split basic blocks and reorder functions, "
+           "skipping all other optimizations"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+PassConfig("pass-config",
+  cl::desc("file restricting passes to tiers of functions ranked by "
+           "execution count, e.g. to run the expensive passes on hot "
+           "functions only"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintJTFootprintReduction("print-after-jt-footprint-reduction",
   cl::desc("print function after jt-footprint-reduction pass"),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PrintJTLowering("print-after-jt-lowering",
+  cl::desc("print function after jt-lowering pass"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<bool>
 NeverPrint("never-print",
   cl::desc("never print"),
@@ -105,6 +164,14 @@ PrintAfterLowering("print-after-lowering",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PrintCMOVConversion("print-cmov-conversion",
+  cl::desc("print functions after conversion of branches to conditional "
+           "moves"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintFOP("print-fop",
   cl::desc("print functions after frame optimizer pass"),
@@ -112,6 +179,13 @@ PrintFOP("print-fop",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PrintFunctionCloning("print-function-cloning",
+  cl::desc("print functions after cloning functions for hot callers"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintFinalized("print-finalized",
   cl::desc("print function after CFG is finalized"),
@@ -160,6 +234,13 @@ PrintOptimizeBodyless("print-optimize-bodyless",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PrintInstrumentation("print-instrumentation",
+  cl::desc("print functions after instrumentation"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintPLT("print-plt",
   cl::desc("print functions after PLT optimization"),
@@ -202,6 +283,20 @@ PrintSimplifyROLoads("print-simplify-rodata-loads",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PrintPrefetchInsertion("print-prefetch-insertion",
+  cl::desc("print functions after prefetch insertion"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+PrintTailDuplication("print-tail-duplication",
+  cl::desc("print functions after tail duplication"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintUCE("print-uce",
   cl::desc("print functions after unreachable code elimination"),
@@ -209,6 +304,13 @@ PrintUCE("print-uce",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PrintUnreferencedFunctions("print-unreferenced-functions",
+  cl::desc("print functions after elimination of unreferenced functions"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 SimplifyConditionalTailCalls("simplify-conditional-tail-calls",
   cl::desc("simplify conditional tail calls by removing unnecessary jumps"),
@@ -232,7 +334,7 @@ RegReAssign("reg-reassign",
 
 static cl::opt<bool>
 StringOps("inline-memcpy",
-  cl::desc("inline memcpy using 'rep movsb' instruction (X86-only)"),
+  cl::desc("inline memcpy, memset and memcmp calls (X86-only)"),
   cl::init(false),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
@@ -285,28 +387,180 @@ const char BinaryFunctionPassManager::TimerGroupName[] =
 const char BinaryFunctionPassManager::TimerGroupDesc[] =
     "Binary Function Pass Manager";
 
+void BinaryFunctionPassManager::registerOptionalPass(
+    std::unique_ptr<BinaryFunctionPass> Pass, const bool Run) {
+  // In the layout-only mode, only the passes that change the order of blocks
+  // and functions run, together with the ones required to emit the code.
+  Passes.push_back({Run && !opts::LayoutOnly, /*Optional=*/true,
+                    std::move(Pass)});
+}
+
+void BinaryFunctionPassManager::applyPassConfig() {
+  auto MB = MemoryBuffer::getFile(opts::PassConfig);
+  if (!MB) {
+    errs() << "BOLT-ERROR: cannot read pass configuration " << opts::PassConfig
+           << '\n';
+    exit(1);
+  }
+
+  auto reportError = [&](unsigned LineNo, const Twine &Message) {
+    errs() << "BOLT-ERROR: " << opts::PassConfig << ':' << LineNo << ": "
+           << Message << '\n';
+    exit(1);
+  };
+
+  std::vector<double> TierPercents;
+  SmallVector<StringRef, 0> Lines;
+  (*MB)->getBuffer().split(Lines, '\n');
+  for (unsigned LineNo = 1; LineNo <= Lines.size(); ++LineNo) {
+    SmallVector<StringRef, 4> Fields;
+    Lines[LineNo - 1].split('#').first.split(Fields, ' ', -1,
+                                             /*KeepEmpty=*/false);
+    if (Fields.empty())
+      continue;
+
+    if (Fields[0] == "tier") {
+      double Percent;
+      if (Fields.size() != 3 || Fields[2].getAsDouble(Percent))
+        reportError(LineNo, "expected \"tier <name> <percent>\"");
+      if (Fields[1] == "other" || Fields[1] == "all" || Fields[1] == "none" ||
+          std::find(TierNames.begin(), TierNames.end(), Fields[1]) !=
+            TierNames.end())
+        reportError(LineNo, "tier name " + Fields[1] + " is already used");
+      if (Percent > 100.0 ||
+          (!TierPercents.empty() && Percent < TierPercents.back()))
+        reportError(LineNo, "tiers must be listed hottest first with "
+                            "percentages up to 100");
+      if (TierNames.size() == 63)
+        reportError(LineNo, "too many tiers");
+      TierNames.push_back(Fields[1].str());
+      TierPercents.push_back(Percent);
+      continue;
+    }
+
+    if (Fields[0] != "pass" || Fields.size() != 3)
+      reportError(LineNo, "expected \"tier <name> <percent>\" or "
+                          "\"pass <pass-name> <tier>[,<tier>...]\"");
+
+    // Bit I of the mask is set for tier I, the last one being "other".
+    const uint64_t AllTiers = (2ULL << TierNames.size()) - 1;
+    uint64_t Mask = 0;
+    SmallVector<StringRef, 4> Tiers;
+    Fields[2].split(Tiers, ',', -1, /*KeepEmpty=*/false);
+    for (auto Tier : Tiers) {
+      if (Tier == "all") {
+        Mask = AllTiers;
+      } else if (Tier == "other") {
+        Mask |= 1ULL << TierNames.size();
+      } else if (Tier != "none") {
+        auto TI = std::find(TierNames.begin(), TierNames.end(), Tier);
+        if (TI == TierNames.end())
+          reportError(LineNo, "unknown tier " + Tier);
+        Mask |= 1ULL << (TI - TierNames.begin());
+      }
+    }
+
+    bool Found = false;
+    for (auto &Entry : Passes) {
+      auto &Pass = Entry.Pass;
+      if (Fields[1] != Pass->getName())
+        continue;
+      Found = true;
+      if (!Entry.Optional && !Pass->supportsFunctionFilter())
+        reportError(LineNo, "pass " + Fields[1] + " is required to emit the "
+                            "code and runs on all functions");
+      if (!Mask) {
+        Entry.Run = false;
+      } else if (Mask != AllTiers) {
+        const auto OtherTier = TierNames.size();
+        Pass->setFunctionFilter([this, Mask, OtherTier](
+                                    const BinaryFunction &BF) {
+          auto FTI = FunctionTiers.find(&BF);
+          const auto Tier =
+            FTI != FunctionTiers.end() ? FTI->second : OtherTier;
+          return (Mask & (1ULL << Tier)) != 0;
+        });
+      }
+    }
+    if (!Found)
+      reportError(LineNo, "unknown pass " + Fields[1]);
+  }
+
+  std::vector<const BinaryFunction *> Ranked;
+  for (const auto &BFI : BFs) {
+    if (BFI.second.getKnownExecutionCount())
+      Ranked.push_back(&BFI.second);
+  }
+  std::stable_sort(Ranked.begin(), Ranked.end(),
+                   [](const BinaryFunction *A, const BinaryFunction *B) {
+                     return A->getKnownExecutionCount() >
+                            B->getKnownExecutionCount();
+                   });
+
+  std::vector<uint64_t> NumFunctions(TierNames.size() + 1);
+  unsigned Tier = 0;
+  for (size_t I = 0; I < Ranked.size(); ++I) {
+    while (Tier < TierNames.size() &&
+           I >= TierPercents[Tier] * Ranked.size() / 100)
+      ++Tier;
+    if (Tier == TierNames.size())
+      break;
+    FunctionTiers[Ranked[I]] = Tier;
+    ++NumFunctions[Tier];
+  }
+  NumFunctions.back() = BFs.size() - FunctionTiers.size();
+
+  outs() << "BOLT-INFO: pass configuration " << opts::PassConfig
+         << " ranks functions into tiers:";
+  for (unsigned I = 0; I < TierNames.size(); ++I)
+    outs() << ' ' << TierNames[I] << " = " << NumFunctions[I] << ',';
+  outs() << " other = " << NumFunctions.back() << '\n';
+}
+
 void BinaryFunctionPassManager::runPasses() {
-  for (const auto &OptPassPair : Passes) {
-    if (!OptPassPair.first)
+  if (!opts::PassConfig.empty())
+    applyPassConfig();
+
+  uint64_t NumSkippedPasses = 0;
+  for (const auto &Entry : Passes) {
+    if (!Entry.Run)
       continue;
 
-    auto &Pass = OptPassPair.second;
+    auto &Pass = Entry.Pass;
+
+    // Once the time budget is spent, only the passes required to emit the
+    // code run.
+    if (Entry.Optional && ParallelUtilities::isOverTimeBudget()) {
+      if (opts::Verbosity > 0)
+        outs() << "BOLT-INFO: Skipping pass: " << Pass->getName() << "\n";
+      ++NumSkippedPasses;
+      continue;
+    }
 
     if (opts::Verbosity > 0) {
-      outs() << "BOLT-INFO: Starting pass: " << Pass->getName() << "\n";
+      outs() << "BOLT-INFO: Starting pass: " << Pass->getName();
+      if (Pass->isFunctionLocal() && ParallelUtilities::isParallel())
+        outs() << " (using " << ParallelUtilities::getThreadCount()
+               << " threads)";
+      outs() << "\n";
     }
 
     NamedRegionTimer T(Pass->getName(), Pass->getName(), TimerGroupName,
                        TimerGroupDesc, TimeOpts);
 
-    callWithDynoStats(
-      [this,&Pass] {
-        Pass->runOnFunctions(BC, BFs, LargeFunctions);
-      },
-      BFs,
-      Pass->getName(),
-      opts::DynoStatsAll
-    );
+    {
+      PhaseStats::Scope Stats(Pass->getName(), &BFs);
+      callWithDynoStats(
+        [this,&Pass] {
+          Pass->runOnFunctions(BC, BFs, LargeFunctions);
+        },
+        BFs,
+        Pass->getName(),
+        opts::DynoStatsAll
+      );
+    }
+
+    DataflowInfoCache::finishPass(Pass->preservesDataflowInfo());
 
     if (opts::VerifyCFG &&
         !std::accumulate(
@@ -342,6 +596,13 @@ void BinaryFunctionPassManager::runPasses() {
         Function.dumpGraphForPass(Pass->getName());
     }
   }
+
+  if (NumSkippedPasses)
+    outs() << "BOLT-INFO: time budget of " << opts::TimeBudget
+           << " seconds exceeded, skipped " << NumSkippedPasses
+           << " optional passes\n";
+
+  DataflowInfoCache::clear();
 }
 
 void BinaryFunctionPassManager::runAllPasses(
@@ -359,45 +620,97 @@ void BinaryFunctionPassManager::runAllPasses(
   // Run this pass first to use stats for the original functions.
   Manager.registerPass(llvm::make_unique<PrintProgramStats>(NeverPrint));
 
-  Manager.registerPass(llvm::make_unique<StripRepRet>(NeverPrint),
-                       opts::StripRepRet);
+  // Attribute memory accesses to struct fields while the instructions and
+  // their profile still match the input binary.
+  Manager.registerPass(llvm::make_unique<StructFieldHotness>(NeverPrint));
+
+  Manager.registerOptionalPass(
+    llvm::make_unique<StripRepRet>(NeverPrint),
+    opts::StripRepRet);
 
-  Manager.registerPass(llvm::make_unique<IdenticalCodeFolding>(PrintICF),
-                       opts::ICF);
+  // Clone functions before the other optimizations so that the clones get
+  // all of them with the profile of their caller. ICF leaves the clones
+  // alone, and the clones are placed next to their callers by the function
+  // reordering since the calls were redirected to them.
+  Manager.registerPass(
+    llvm::make_unique<FunctionCloning>(PrintFunctionCloning));
 
-  Manager.registerPass(llvm::make_unique<InlineMemcpy>(NeverPrint),
-                       opts::StringOps);
+  Manager.registerOptionalPass(
+    llvm::make_unique<IdenticalCodeFolding>(PrintICF),
+    opts::ICF);
 
-  Manager.registerPass(llvm::make_unique<IndirectCallPromotion>(PrintICP));
+  Manager.registerOptionalPass(
+    llvm::make_unique<InlineMemcpy>(NeverPrint),
+    opts::StringOps);
 
-  Manager.registerPass(llvm::make_unique<Peepholes>(PrintPeepholes));
+  Manager.registerOptionalPass(
+    llvm::make_unique<IndirectCallPromotion>(PrintICP));
 
-  Manager.registerPass(
-      llvm::make_unique<JTFootprintReduction>(PrintJTFootprintReduction),
-      opts::JTFootprintReductionFlag);
+  Manager.registerOptionalPass(llvm::make_unique<Peepholes>(PrintPeepholes));
 
-  Manager.registerPass(llvm::make_unique<InlineSmallFunctions>(PrintInline),
-                       opts::InlineSmallFunctions);
+  Manager.registerOptionalPass(
+    llvm::make_unique<JTLowering>(PrintJTLowering),
+    opts::JTLoweringFlag);
 
-  Manager.registerPass(
+  Manager.registerOptionalPass(
+    llvm::make_unique<JTFootprintReduction>(PrintJTFootprintReduction),
+    opts::JTFootprintReductionFlag);
+
+  Manager.registerOptionalPass(
+    llvm::make_unique<InlineSmallFunctions>(PrintInline),
+    opts::InlineSmallFunctions || opts::InlineHotCalls);
+
+  Manager.registerOptionalPass(
     llvm::make_unique<OptimizeBodylessFunctions>(PrintOptimizeBodyless),
     opts::OptimizeBodylessFunctions);
 
-  Manager.registerPass(
+  Manager.registerOptionalPass(
     llvm::make_unique<SimplifyRODataLoads>(PrintSimplifyROLoads),
     opts::SimplifyRODataLoads);
 
-  Manager.registerPass(llvm::make_unique<RegReAssign>(PrintRegReAssign),
-                       opts::RegReAssign);
+  Manager.registerOptionalPass(
+    llvm::make_unique<RegReAssign>(PrintRegReAssign),
+    opts::RegReAssign);
+
+  Manager.registerOptionalPass(
+    llvm::make_unique<IdenticalCodeFolding>(PrintICF),
+    opts::ICF);
+
+  // Objects referencing functions are compared after the functions are
+  // folded.
+  Manager.registerOptionalPass(
+    llvm::make_unique<IdenticalDataFolding>(NeverPrint),
+    opts::ICFData);
+
+  Manager.registerOptionalPass(llvm::make_unique<PLTCall>(PrintPLT));
 
-  Manager.registerPass(llvm::make_unique<IdenticalCodeFolding>(PrintICF),
-                       opts::ICF);
+  Manager.registerOptionalPass(
+    llvm::make_unique<EliminateUnreferencedFunctions>(
+      PrintUnreferencedFunctions));
 
-  Manager.registerPass(llvm::make_unique<PLTCall>(PrintPLT));
+  // Branches are removed before tail duplication copies the join blocks of
+  // the hammocks into their sides.
+  Manager.registerOptionalPass(
+    llvm::make_unique<CMOVConversion>(PrintCMOVConversion));
+
+  // Duplicate merge blocks before the layout is decided, so that block
+  // reordering can make the copies fall-throughs.
+  Manager.registerOptionalPass(
+    llvm::make_unique<TailDuplication>(PrintTailDuplication));
+
+  // Loops are found on the final CFG, before blocks are reordered.
+  Manager.registerOptionalPass(
+    llvm::make_unique<PrefetchInsertion>(PrintPrefetchInsertion));
+
+  // Insert counters before the blocks are reordered and split, so that the
+  // blocks added for edge counters are laid out with the rest of the code.
+  Manager.registerPass(
+    llvm::make_unique<Instrumentation>(PrintInstrumentation),
+    opts::Instrument);
 
   Manager.registerPass(llvm::make_unique<ReorderBasicBlocks>(PrintReordered));
 
-  Manager.registerPass(llvm::make_unique<Peepholes>(PrintPeepholes));
+  Manager.registerOptionalPass(llvm::make_unique<Peepholes>(PrintPeepholes));
 
   Manager.registerPass(
     llvm::make_unique<EliminateUnreachableBlocks>(PrintUCE),
@@ -408,6 +721,9 @@ void BinaryFunctionPassManager::runAllPasses(
   // fix branches consistency internally.
   Manager.registerPass(llvm::make_unique<FixupBranches>(PrintAfterBranchFixup));
 
+  // Instructions are only moved within blocks, so branches stay in sync.
+  Manager.registerOptionalPass(llvm::make_unique<MacroFusionFixup>(NeverPrint));
+
   // This pass should come close to last since it uses the estimated hot
   // size of a function to determine the order.  It should definitely
   // also happen after any changes to the call graph are made, e.g. inlining.
@@ -422,7 +738,9 @@ void BinaryFunctionPassManager::runAllPasses(
 
   // Add the StokeInfo pass, which extract functions for stoke optimization and
   // get the liveness information for them
-  Manager.registerPass(llvm::make_unique<StokeInfo>(PrintStoke), opts::Stoke);
+  Manager.registerOptionalPass(
+    llvm::make_unique<StokeInfo>(PrintStoke),
+    opts::Stoke);
 
   // This pass introduces conditional jumps into external functions.
   // Between extending CFG to support this and isolating this pass we chose
@@ -433,15 +751,15 @@ void BinaryFunctionPassManager::runAllPasses(
   // modifies branches/control flow.  This pass is run after function
   // reordering so that it can tell whether calls are forward/backward
   // accurately.
-  Manager.registerPass(
-      llvm::make_unique<SimplifyConditionalTailCalls>(PrintSCTC),
-      opts::SimplifyConditionalTailCalls);
+  Manager.registerOptionalPass(
+    llvm::make_unique<SimplifyConditionalTailCalls>(PrintSCTC),
+    opts::SimplifyConditionalTailCalls);
 
   Manager.registerPass(llvm::make_unique<AlignerPass>());
 
   // Perform reordering on data contained in one or more sections using
   // memory profiling data.
-  Manager.registerPass(llvm::make_unique<ReorderData>());
+  Manager.registerOptionalPass(llvm::make_unique<ReorderData>());
 
   // This pass should always run last.*
   Manager.registerPass(llvm::make_unique<FinalizeFunctions>(PrintFinalized));
@@ -450,9 +768,9 @@ void BinaryFunctionPassManager::runAllPasses(
   // FrameOptimizer move values around and needs to update CFIs. To do this, it
   // must read CFI, interpret it and rewrite it, so CFIs need to be correctly
   // placed according to the final layout.
-  Manager.registerPass(llvm::make_unique<FrameOptimizerPass>(PrintFOP));
+  Manager.registerOptionalPass(llvm::make_unique<FrameOptimizerPass>(PrintFOP));
 
-  Manager.registerPass(llvm::make_unique<AllocCombinerPass>(PrintFOP));
+  Manager.registerOptionalPass(llvm::make_unique<AllocCombinerPass>(PrintFOP));
 
   // Thighten branches according to offset differences between branch and
   // targets. No extra instructions after this pass, otherwise we may have
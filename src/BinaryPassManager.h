@@ -18,6 +18,8 @@
 #include "Passes/BinaryPasses.h"
 #include <map>
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace llvm {
@@ -29,8 +31,42 @@ private:
   BinaryContext &BC;
   std::map<uint64_t, BinaryFunction> &BFs;
   std::set<uint64_t> &LargeFunctions;
-  std::vector<std::pair<const bool,
-                        std::unique_ptr<BinaryFunctionPass>>> Passes;
+
+  struct PassEntry {
+    /// Run the pass. Set from the command-line options at registration.
+    bool Run;
+
+    /// The pass only improves the code and is skipped in the layout-only mode
+    /// and once the time budget is spent.
+    bool Optional;
+
+    std::unique_ptr<BinaryFunctionPass> Pass;
+  };
+  std::vector<PassEntry> Passes;
+
+  /// Tiers of functions defined with -pass-config, and the index of the tier
+  /// of every function ranked into one. Other functions are in the implicit
+  /// last tier.
+  std::vector<std::string> TierNames;
+  std::unordered_map<const BinaryFunction *, unsigned> FunctionTiers;
+
+  /// Read the file given with -pass-config, rank the functions into its
+  /// tiers, and restrict the passes it lists to the functions of the given
+  /// tiers. Every line of the file is one of:
+  ///
+  ///   tier <name> <percent>
+  ///     Functions with profile ranked by execution count, from the end of
+  ///     the previous tier up to the top <percent> of them, are in tier
+  ///     <name>. Tiers are listed hottest first. The remaining functions are
+  ///     in the tier "other".
+  ///
+  ///   pass <pass-name> <tier>[,<tier>...]
+  ///     Run the pass only on the functions in the given tiers. "all" and
+  ///     "none" stand for all and no tiers.
+  ///
+  /// Passes that are not listed run on all functions. Text after '#' is a
+  /// comment.
+  void applyPassConfig();
 
  public:
   static const char TimerGroupName[];
@@ -45,14 +81,19 @@ private:
   /// command-line option.
   void registerPass(std::unique_ptr<BinaryFunctionPass> Pass,
                     const bool Run) {
-    Passes.emplace_back(Run, std::move(Pass));
+    Passes.push_back({Run, /*Optional=*/false, std::move(Pass)});
   }
 
   /// Adds an unconditionally run pass to this manager.
   void registerPass(std::unique_ptr<BinaryFunctionPass> Pass) {
-    Passes.emplace_back(true, std::move(Pass));
+    Passes.push_back({true, /*Optional=*/false, std::move(Pass)});
   }
 
+  /// Adds a pass that is not required to emit the code. It runs if \p Run is
+  /// set, unless in the layout-only mode or once the time budget is spent.
+  void registerOptionalPass(std::unique_ptr<BinaryFunctionPass> Pass,
+                            const bool Run = true);
+
   /// Run all registered passes in the order they were added.
   void runPasses();
 
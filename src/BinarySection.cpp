@@ -34,8 +34,11 @@ BinarySection::hash(const BinaryData &BD,
 
   auto Offset = BD.getAddress() - getAddress();
   const auto EndOffset = BD.getEndAddress() - getAddress();
-  auto Begin = Relocations.lower_bound(Relocation{Offset, 0, 0, 0, 0});
-  auto End = Relocations.upper_bound(Relocation{EndOffset, 0, 0, 0, 0});
+  sortRelocations(Relocations, RelocationsSorted);
+  auto Begin = std::lower_bound(Relocations.begin(), Relocations.end(),
+                                Relocation{Offset, 0, 0, 0, 0});
+  auto End = std::upper_bound(Relocations.begin(), Relocations.end(),
+                              Relocation{EndOffset, 0, 0, 0, 0});
   const auto Contents = getContents();
 
   hash_code Hash = hash_combine(hash_value(BD.getSize()),
@@ -45,7 +48,7 @@ BinarySection::hash(const BinaryData &BD,
     const auto &Rel = *Begin++;
     Hash = hash_combine(
       Hash,
-      hash_value(Contents.substr(Offset, Begin->Offset - Offset)));
+      hash_value(Contents.substr(Offset, Rel.Offset - Offset)));
     if (auto *RelBD = BC.getBinaryDataByName(Rel.Symbol->getName())) {
       Hash = hash_combine(Hash, hash(*RelBD, Cache));
     }
@@ -98,10 +101,29 @@ void BinarySection::print(raw_ostream &OS) const {
   }
 }
 
-std::set<Relocation> BinarySection::reorderRelocations(bool Inplace) const {
+void BinarySection::sortRelocations(RelocationSetType &Relocs,
+                                    std::atomic<bool> &Sorted) const {
+  if (Sorted.load(std::memory_order_acquire))
+    return;
+
+  std::lock_guard<std::mutex> Lock(RelocationsMutex);
+  if (Sorted.load(std::memory_order_relaxed))
+    return;
+
+  std::stable_sort(Relocs.begin(), Relocs.end());
+  Relocs.erase(std::unique(Relocs.begin(), Relocs.end(),
+                           [](const Relocation &A, const Relocation &B) {
+                             return A.Offset == B.Offset;
+                           }),
+               Relocs.end());
+  Sorted.store(true, std::memory_order_release);
+}
+
+BinarySection::RelocationSetType
+BinarySection::reorderRelocations(bool Inplace) const {
   assert(PendingRelocations.empty() &&
          "reodering pending relocations not supported");
-  std::set<Relocation> NewRelocations;
+  RelocationSetType NewRelocations;
   for (const auto &Rel : relocations()) {
     auto RelAddr = Rel.Offset + getAddress();
     auto *BD = BC.getBinaryDataContainingAddress(RelAddr);
@@ -116,10 +138,14 @@ std::set<Relocation> BinarySection::reorderRelocations(bool Inplace) const {
     NewRel.Offset = BD->getOutputOffset() + RelOffset;
     assert(NewRel.Offset < getSize());
     DEBUG(dbgs() << "BOLT-DEBUG: moving " << Rel << " -> " << NewRel << "\n");
-    auto Res = NewRelocations.emplace(std::move(NewRel));
-    (void)Res;
-    assert(Res.second && "Can't overwrite existing relocation");
+    NewRelocations.emplace_back(std::move(NewRel));
   }
+  std::sort(NewRelocations.begin(), NewRelocations.end());
+  assert(std::adjacent_find(NewRelocations.begin(), NewRelocations.end(),
+                            [](const Relocation &A, const Relocation &B) {
+                              return A.Offset == B.Offset;
+                            }) == NewRelocations.end() &&
+         "Can't overwrite existing relocation");
   return NewRelocations;
 }
 
@@ -128,6 +154,7 @@ void BinarySection::reorderContents(const std::vector<BinaryData *> &Order,
   IsReordered = true;
 
   Relocations = reorderRelocations(Inplace);
+  RelocationsSorted = true;
 
   std::string Str;
   raw_string_ostream OS(Str);
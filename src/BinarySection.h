@@ -21,8 +21,11 @@
 #include "llvm/Object/ObjectFile.h"
 #include "llvm/Support/ErrorOr.h"
 #include "llvm/Support/raw_ostream.h"
-#include <set>
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <vector>
 
 namespace llvm {
 
@@ -49,13 +52,20 @@ class BinarySection {
   bool IsLocal;               // Is this a local section?
 
   // Relocations associated with this section.  Relocation offsets are
-  // wrt. to the original section address and size.
-  using RelocationSetType = std::set<Relocation>;
-  RelocationSetType Relocations;
+  // wrt. to the original section address and size.  New relocations are
+  // appended and the vector is sorted by offset on the first lookup
+  // following an out-of-order insertion.
+  using RelocationSetType = std::vector<Relocation>;
+  mutable RelocationSetType Relocations;
+  mutable std::atomic<bool> RelocationsSorted{true};
 
   // Pending relocations for this section.  For the moment, just used by
   // the .debug_info section.  TODO: it would be nice to get rid of this.
-  RelocationSetType PendingRelocations;
+  mutable RelocationSetType PendingRelocations;
+  mutable std::atomic<bool> PendingRelocationsSorted{true};
+
+  // Protects lazy sorting of relocations from concurrent readers.
+  mutable std::mutex RelocationsMutex;
 
   // Output info
   bool IsFinalized{false};         // Has this section had output information
@@ -99,7 +109,22 @@ class BinarySection {
   /// Get the set of relocations refering to data in this section that
   /// has been reordered.  The relocation offsets will be modified to
   /// reflect the new data locations.
-  std::set<Relocation> reorderRelocations(bool Inplace) const;
+  RelocationSetType reorderRelocations(bool Inplace) const;
+
+  /// Sort \p Relocs by offset unless \p Sorted indicates they already are.
+  /// Only the first relocation added at any given offset is kept.
+  void sortRelocations(RelocationSetType &Relocs,
+                       std::atomic<bool> &Sorted) const;
+
+  /// Return iterator to the relocation at \p Offset or end() if none.
+  RelocationSetType::iterator findRelocation(uint64_t Offset) const {
+    sortRelocations(Relocations, RelocationsSorted);
+    auto Itr = std::lower_bound(Relocations.begin(), Relocations.end(),
+                                Relocation{Offset, 0, 0, 0, 0});
+    if (Itr != Relocations.end() && Itr->Offset != Offset)
+      return Relocations.end();
+    return Itr;
+  }
 
   /// Set output info for this section.
   void update(uint8_t *NewData,
@@ -135,7 +160,9 @@ public:
       ELFFlags(Section.getELFFlags()),
       IsLocal(IsLocal || StringRef(Name).startswith(".local.")),
       Relocations(Section.Relocations),
+      RelocationsSorted(Section.RelocationsSorted.load()),
       PendingRelocations(Section.PendingRelocations),
+      PendingRelocationsSorted(Section.PendingRelocationsSorted.load()),
       OutputName(Name) {
   }
 
@@ -287,12 +314,14 @@ public:
 
   /// Iterate over all non-pending relocations for this section.
   iterator_range<RelocationSetType::iterator> relocations() {
+    sortRelocations(Relocations, RelocationsSorted);
     return make_range(Relocations.begin(), Relocations.end());
   }
 
   /// Iterate over all non-pending relocations for this section.
   iterator_range<RelocationSetType::const_iterator> relocations() const {
-    return make_range(Relocations.begin(), Relocations.end());
+    sortRelocations(Relocations, RelocationsSorted);
+    return make_range(Relocations.cbegin(), Relocations.cend());
   }
 
   /// Does this section have any non-pending relocations?
@@ -302,7 +331,8 @@ public:
 
   /// Iterate over all pending relocations in this section.
   iterator_range<RelocationSetType::const_iterator> pendingRelocations() const {
-    return make_range(PendingRelocations.begin(), PendingRelocations.end());
+    sortRelocations(PendingRelocations, PendingRelocationsSorted);
+    return make_range(PendingRelocations.cbegin(), PendingRelocations.cend());
   }
 
   /// Does this section have any pending relocations?
@@ -312,8 +342,7 @@ public:
 
   /// Remove non-pending relocation with the given /p Offset.
   bool removeRelocationAt(uint64_t Offset) {
-    Relocation Key{Offset, 0, 0, 0, 0};
-    auto Itr = Relocations.find(Key);
+    auto Itr = findRelocation(Offset);
     if (Itr != Relocations.end()) {
       Relocations.erase(Itr);
       return true;
@@ -330,17 +359,16 @@ public:
                      uint64_t Value = 0,
                      bool Pending = false) {
     assert(Offset < getSize() && "offset not within section bounds");
-    if (!Pending) {
-      Relocations.emplace(Relocation{Offset, Symbol, Type, Addend, Value});
-    } else {
-      PendingRelocations.emplace(Relocation{Offset, Symbol, Type, Addend, Value});
-    }
+    auto &Relocs = Pending ? PendingRelocations : Relocations;
+    auto &Sorted = Pending ? PendingRelocationsSorted : RelocationsSorted;
+    if (!Relocs.empty() && Relocs.back().Offset >= Offset)
+      Sorted = false;
+    Relocs.emplace_back(Relocation{Offset, Symbol, Type, Addend, Value});
   }
 
   /// Lookup the relocation (if any) at the given /p Offset.
   const Relocation *getRelocationAt(uint64_t Offset) const {
-    Relocation Key{Offset, 0, 0, 0, 0};
-    auto Itr = Relocations.find(Key);
+    auto Itr = findRelocation(Offset);
     return Itr != Relocations.end() ? &*Itr : nullptr;
   }
 
@@ -0,0 +1,199 @@
+//===--- BoltAddressTranslation.cpp - Output to input address map ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "BoltAddressTranslation.h"
+#include "BinaryFunction.h"
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/LEB128.h"
+
+#define DEBUG_TYPE "bolt-bat"
+
+using namespace llvm;
+using namespace bolt;
+
+const char *BoltAddressTranslation::SectionName = ".bolt.bat";
+
+void BoltAddressTranslation::build(
+    const std::map<uint64_t, BinaryFunction> &BFs) {
+  for (auto &BFI : BFs) {
+    const auto &Function = BFI.second;
+    if (!Function.isEmitted() || !Function.getOutputAddress())
+      continue;
+
+    // Code of a clone is attributed to the function it was cloned from,
+    // which has the same input offsets.
+    auto HotAddress = Function.getOutputAddress();
+    if (const auto *Original = Function.getCloneOf()) {
+      if (!Original->isEmitted() || !Original->getOutputAddress())
+        continue;
+      HotAddress = Original->getOutputAddress();
+    }
+    auto &Hot = Fragments[Function.getOutputAddress()];
+    Hot.Size = Function.getOutputSize();
+    Hot.HotAddress = HotAddress;
+
+    // Functions without a CFG are emitted as they were on input.
+    if (!Function.isSimple() ||
+        Function.layout_begin() == Function.layout_end()) {
+      Hot.Entries[0] = {0, static_cast<uint32_t>(Function.getSize())};
+      continue;
+    }
+
+    Fragment *Cold = nullptr;
+    if (Function.isSplit()) {
+      Cold = &Fragments[Function.cold().getAddress()];
+      Cold->Size = Function.cold().getImageSize();
+      Cold->HotAddress = HotAddress;
+    }
+
+    for (const auto *BB : Function.layout()) {
+      // Blocks created by BOLT have no input range and belong to the
+      // preceding entry.
+      if (BB->getEndOffset() == BinaryBasicBlock::INVALID_OFFSET ||
+          !BB->getOutputSize())
+        continue;
+
+      auto &Frag = BB->isCold() ? *Cold : Hot;
+      const auto Start = BB->isCold() ? Function.cold().getAddress()
+                                      : Function.getOutputAddress();
+      const uint32_t OutputOffset = BB->getOutputAddressRange().first - Start;
+      auto BranchOffset = BB->getInputBranchOffset();
+      if (BranchOffset == BinaryBasicBlock::INVALID_OFFSET)
+        BranchOffset = BB->getInputOffset();
+      Frag.Entries.emplace(OutputOffset,
+                           Entry{BB->getInputOffset(), BranchOffset});
+    }
+  }
+
+  DEBUG(dbgs() << "BOLT-DEBUG: address translation table has "
+               << Fragments.size() << " fragments\n");
+}
+
+void BoltAddressTranslation::write(raw_ostream &OS) const {
+  encodeULEB128(Fragments.size(), OS);
+  uint64_t PrevAddress = 0;
+  for (auto &FI : Fragments) {
+    const auto Address = FI.first;
+    const auto &Frag = FI.second;
+    encodeULEB128(Address - PrevAddress, OS);
+    encodeULEB128(Frag.Size, OS);
+    encodeULEB128(Address - Frag.HotAddress, OS);
+    encodeULEB128(Frag.Entries.size(), OS);
+    uint32_t PrevOutputOffset = 0;
+    int64_t PrevInputOffset = 0;
+    for (auto &EI : Frag.Entries) {
+      const auto &E = EI.second;
+      encodeULEB128(EI.first - PrevOutputOffset, OS);
+      encodeSLEB128(static_cast<int64_t>(E.InputOffset) - PrevInputOffset, OS);
+      encodeULEB128(E.BranchOffset - E.InputOffset, OS);
+      PrevOutputOffset = EI.first;
+      PrevInputOffset = E.InputOffset;
+    }
+    PrevAddress = Address;
+  }
+}
+
+std::error_code BoltAddressTranslation::parse(StringRef Buf) {
+  DataExtractor DE(Buf, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+  uint32_t Offset = 0;
+  auto isValid = [&]() { return Offset <= Buf.size(); };
+
+  Fragments.clear();
+  const auto NumFragments = DE.getULEB128(&Offset);
+  uint64_t Address = 0;
+  for (uint64_t I = 0; I < NumFragments && isValid(); ++I) {
+    Address += DE.getULEB128(&Offset);
+    auto &Frag = Fragments[Address];
+    Frag.Size = DE.getULEB128(&Offset);
+    Frag.HotAddress = Address - DE.getULEB128(&Offset);
+    const auto NumEntries = DE.getULEB128(&Offset);
+    uint32_t OutputOffset = 0;
+    int64_t InputOffset = 0;
+    for (uint64_t J = 0; J < NumEntries && isValid(); ++J) {
+      OutputOffset += DE.getULEB128(&Offset);
+      InputOffset += DE.getSLEB128(&Offset);
+      const auto BranchOffset = InputOffset + DE.getULEB128(&Offset);
+      Frag.Entries.emplace(OutputOffset,
+                           Entry{static_cast<uint32_t>(InputOffset),
+                                 static_cast<uint32_t>(BranchOffset)});
+    }
+  }
+
+  if (!isValid() || Fragments.size() != NumFragments) {
+    Fragments.clear();
+    return make_error_code(llvm::errc::io_error);
+  }
+
+  return std::error_code();
+}
+
+const BoltAddressTranslation::Fragment *
+BoltAddressTranslation::getFragment(uint64_t Address, uint64_t &Start) const {
+  auto FI = Fragments.upper_bound(Address);
+  if (FI == Fragments.begin())
+    return nullptr;
+  --FI;
+  if (Address >= FI->first + FI->second.Size)
+    return nullptr;
+  Start = FI->first;
+  return &FI->second;
+}
+
+Optional<uint64_t>
+BoltAddressTranslation::translate(uint64_t Address, bool IsBranchSrc,
+                                  uint64_t &HotAddress) const {
+  uint64_t Start;
+  const auto *Frag = getFragment(Address, Start);
+  if (!Frag)
+    return NoneType();
+
+  const auto Offset = Address - Start;
+  auto EI = Frag->Entries.upper_bound(Offset);
+  if (EI == Frag->Entries.begin())
+    return NoneType();
+  --EI;
+
+  // Blocks keep their instructions, so the offset into the block is the
+  // same on input, unless BOLT has added code to the block.
+  uint64_t InputOffset = EI->second.InputOffset + (Offset - EI->first);
+  if (IsBranchSrc)
+    InputOffset = std::min<uint64_t>(InputOffset, EI->second.BranchOffset);
+
+  HotAddress = Frag->HotAddress;
+  return InputOffset;
+}
+
+Optional<BoltAddressTranslation::FallthroughListTy>
+BoltAddressTranslation::getFallthroughsInTrace(uint64_t From,
+                                               uint64_t To) const {
+  uint64_t Start;
+  const auto *Frag = getFragment(From, Start);
+  if (!Frag || To < From || To >= Start + Frag->Size)
+    return NoneType();
+
+  const auto FromOffset = From - Start;
+  const auto ToOffset = To - Start;
+  auto EI = Frag->Entries.upper_bound(FromOffset);
+  if (EI == Frag->Entries.begin())
+    return NoneType();
+
+  // Every input block starting within the trace was reached by falling
+  // through from the block before it.
+  FallthroughListTy Res;
+  auto Prev = std::prev(EI);
+  for (; EI != Frag->Entries.end() && EI->first <= ToOffset; ++EI) {
+    Res.emplace_back(Prev->second.BranchOffset, EI->second.InputOffset);
+    Prev = EI;
+  }
+
+  return Res;
+}
@@ -0,0 +1,121 @@
+//===--- BoltAddressTranslation.h - Output to input address map -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// With -enable-bat, BOLT records in the output binary where the code of every
+// emitted function came from. A profile collected on the optimized binary can
+// then be attributed to the functions and blocks of the input binary by
+// perf2bolt, so that the input can be optimized again with fresh data.
+//
+// The table has an entry per fragment (a function or its cold part) in the
+// output, and per fragment the output offsets of its basic blocks together
+// with the input offsets of the same blocks. Blocks created by BOLT have no
+// entry and are covered by the entry before them. Fragments of a clone of a
+// function refer to the hot fragment of the function it was cloned from, so
+// the difference of output addresses in the table wraps around when the
+// clone is placed first.
+//
+// The section is a sequence of LEB128 numbers:
+//
+//   NumFragments
+//   for each fragment, by increasing output address:
+//     OutputAddress - OutputAddress of the previous fragment
+//     Size
+//     OutputAddress - OutputAddress of the hot fragment of the function
+//     NumEntries
+//     for each entry, by increasing output offset:
+//       OutputOffset - OutputOffset of the previous entry
+//       InputOffset - InputOffset of the previous entry   (signed)
+//       BranchOffset - InputOffset
+//
+// where BranchOffset is the input offset of the last instruction of the block.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_BOLT_ADDRESS_TRANSLATION_H
+#define LLVM_TOOLS_LLVM_BOLT_BOLT_ADDRESS_TRANSLATION_H
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <map>
+#include <system_error>
+
+namespace llvm {
+namespace bolt {
+
+class BinaryFunction;
+
+class BoltAddressTranslation {
+public:
+  /// Name of the section holding the table in the output binary.
+  static const char *SectionName;
+
+  struct Entry {
+    /// Offset of the block in the input function.
+    uint32_t InputOffset;
+
+    /// Input offset of the last instruction of the block.
+    uint32_t BranchOffset;
+  };
+
+  struct Fragment {
+    uint64_t Size{0};
+
+    /// Output address of the hot fragment of the same function.
+    uint64_t HotAddress{0};
+
+    /// Entries indexed by output offset from the start of the fragment.
+    std::map<uint32_t, Entry> Entries;
+  };
+
+  using FallthroughListTy = SmallVector<std::pair<uint64_t, uint64_t>, 16>;
+
+  /// Record the layout of the emitted functions in \p BFs.
+  void build(const std::map<uint64_t, BinaryFunction> &BFs);
+
+  /// Write the table in the format described above.
+  void write(raw_ostream &OS) const;
+
+  /// Read the table from the contents of its section.
+  std::error_code parse(StringRef Buf);
+
+  /// Translate \p Address in the output binary into an offset in the input
+  /// function. The output address of the hot fragment of the function is
+  /// returned in \p HotAddress. If \p IsBranchSrc is set, the address is the
+  /// source of a branch, which is attributed to the last instruction of its
+  /// input block. Return None if the address is not in a known fragment.
+  Optional<uint64_t> translate(uint64_t Address, bool IsBranchSrc,
+                               uint64_t &HotAddress) const;
+
+  /// For a trace of execution from \p From to \p To in the output binary
+  /// without taken branches, return the fall-throughs between input blocks
+  /// it goes through as pairs of input offsets. Return None if the trace is
+  /// not within a single fragment.
+  Optional<FallthroughListTy> getFallthroughsInTrace(uint64_t From,
+                                                     uint64_t To) const;
+
+  bool empty() const { return Fragments.empty(); }
+
+  size_t getNumFragments() const { return Fragments.size(); }
+
+private:
+  /// Return the fragment containing \p Address and set \p Start to the
+  /// output address of the fragment.
+  const Fragment *getFragment(uint64_t Address, uint64_t &Start) const;
+
+  /// Fragments indexed by output address.
+  std::map<uint64_t, Fragment> Fragments;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
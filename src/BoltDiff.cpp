@@ -13,8 +13,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "RewriteInstance.h"
+#include "CacheMetrics.h"
+#include "ParallelUtilities.h"
 #include "Passes/IdenticalCodeFolding.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "boltdiff"
@@ -27,6 +30,7 @@ namespace opts {
 extern cl::OptionCategory BoltDiffCategory;
 extern cl::opt<bool> NeverPrint;
 extern cl::opt<bool> ICF;
+extern cl::opt<double> FallthroughWeight;
 
 static cl::opt<bool>
 IgnoreLTOSuffix("ignore-lto-suffix",
@@ -91,6 +95,14 @@ NormalizeByBin1("normalize-by-bin1",
   cl::ZeroOrMore,
   cl::cat(BoltDiffCategory));
 
+static cl::opt<std::string>
+DiffReport("diff-report",
+  cl::desc("write a CSV ranking of the functions of binary 2 that regressed "
+           "the most in hotness or layout score with respect to binary 1"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltDiffCategory));
+
 } // end namespace opts
 
 namespace llvm {
@@ -126,6 +138,31 @@ void setRegularColor() {
     outs().resetColor();
 }
 
+/// Return the Ext-TSP score of the input layout of \p BF as a fraction of
+/// the score the function would have if every jump was a fall-through.
+double getLayoutScore(const BinaryFunction &BF) {
+  if (!BF.hasValidProfile())
+    return 0.0;
+
+  double Score{0.0};
+  double MaxScore{0.0};
+  for (const auto *SrcBB : BF.layout()) {
+    auto BI = SrcBB->branch_info_begin();
+    for (const auto *DstBB : SrcBB->successors()) {
+      if (DstBB != SrcBB && BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE) {
+        Score += CacheMetrics::extTSPScore(
+            BF.getAddress() + SrcBB->getInputOffset(),
+            SrcBB->getOriginalSize(),
+            BF.getAddress() + DstBB->getInputOffset(),
+            BI->Count);
+        MaxScore += opts::FallthroughWeight * BI->Count;
+      }
+      ++BI;
+    }
+  }
+  return MaxScore > 0.0 ? Score / MaxScore : 1.0;
+}
+
 } // end anonymous namespace
 
 /// Perform the comparison between two binaries with profiling information
@@ -175,6 +212,35 @@ class RewriteInstanceDiff {
   // Map scores in bin2 and 1 keyed by a binary 2 function - post-matching
   DenseMap<const BinaryFunction *, std::pair<double, double>> ScoreMap;
 
+  // Per-function data of both binaries, computed in parallel before matching
+  struct FunctionInfo {
+    std::size_t Hash{0};
+    double LayoutScore{0.0};
+  };
+  DenseMap<const BinaryFunction *, FunctionInfo> FuncInfo;
+
+  /// Compute the hash, layout score and function score of every function in
+  /// \p RI. The function score is cached by the function itself.
+  void computeFunctionInfo(RewriteInstance &RI) {
+    for (const auto &BFI : RI.BinaryFunctions)
+      FuncInfo[&BFI.second];
+
+    ParallelUtilities::runOnEachFunction(
+        RI.BinaryFunctions, ParallelUtilities::SP_INST_LINEAR,
+        [&](BinaryFunction &BF) {
+          auto &Info = FuncInfo.find(&BF)->second;
+          Info.Hash = BF.hash(true, true);
+          Info.LayoutScore = getLayoutScore(BF);
+          BF.getFunctionScore();
+        },
+        [](const BinaryFunction &BF) { return !BF.hasCFG(); },
+        "computeDiffInfo");
+  }
+
+  std::size_t getHash(const BinaryFunction &Function) const {
+    return FuncInfo.lookup(&Function).Hash;
+  }
+
   double getNormalizedScore(const BinaryFunction &Function,
                             const RewriteInstance &Ctx) {
     if (!opts::NormalizeByBin1)
@@ -215,7 +281,7 @@ class RewriteInstanceDiff {
         NameLookup[Name] = &Function;
       }
       if (opts::MatchByHash && Function.hasCFG())
-        HashLookup[Function.hash(true, true)] = &Function;
+        HashLookup[getHash(Function)] = &Function;
       if (opts::IgnoreLTOSuffix && !LTOName.empty()) {
         if (!LTONameLookup1.count(LTOName))
           LTONameLookup1[LTOName] = &Function;
@@ -263,7 +329,7 @@ class RewriteInstanceDiff {
       }
       if (Match || !Function2.hasCFG())
         continue;
-      auto Iter = HashLookup.find(Function2.hash(true, true));
+      auto Iter = HashLookup.find(getHash(Function2));
       if (Iter != HashLookup.end()) {
         FuncMap.insert(std::make_pair<>(&Function2, Iter->second));
         Bin1MappedFuncs.insert(Iter->second);
@@ -518,7 +584,7 @@ class RewriteInstanceDiff {
     for (auto I = LargestDiffs.rbegin(), E = LargestDiffs.rend(); I != E; ++I) {
       const auto &MapEntry = I->second;
       if (opts::IgnoreUnchanged &&
-          MapEntry.second->hash(true, true) == MapEntry.first->hash(true, true))
+          getHash(*MapEntry.second) == getHash(*MapEntry.first))
         continue;
       const auto &Scores = ScoreMap[MapEntry.first];
       outs() << "Function " << MapEntry.first->getDemangledName();
@@ -530,8 +596,7 @@ class RewriteInstanceDiff {
              << "%\t(Difference: ";
       printColoredPercentage((Scores.second - Scores.first) * 100.0);
       outs() << ")";
-      if (MapEntry.second->hash(true, true) !=
-          MapEntry.first->hash(true, true)) {
+      if (getHash(*MapEntry.second) != getHash(*MapEntry.first)) {
         outs() << "\t[Functions have different contents]";
         if (opts::PrintDiffCFG) {
           outs() << "\n *** CFG for function in binary 1:\n";
@@ -588,6 +653,61 @@ class RewriteInstanceDiff {
     }
   }
 
+  /// Write the functions of binary 2 matched to a function in binary 1 to the
+  /// file given with -diff-report, from the largest regression to the largest
+  /// improvement. The regression of a function is the increase of its share
+  /// of execution plus the decrease of its layout score weighted by its share
+  /// of execution in binary 2.
+  void writeRegressionReport() {
+    struct RegressionTy {
+      const BinaryFunction *Func1;
+      const BinaryFunction *Func2;
+      double Score1;
+      double Score2;
+      double Layout1;
+      double Layout2;
+      double Regression;
+    };
+    std::vector<RegressionTy> Regressions;
+    for (const auto &MapEntry : FuncMap) {
+      const auto *Func1 = MapEntry.second;
+      const auto *Func2 = MapEntry.first;
+      const auto Score1 = getNormalizedScore(*Func1, RI1);
+      const auto Score2 = getNormalizedScore(*Func2, RI2);
+      if (Score1 == 0.0 && Score2 == 0.0)
+        continue;
+      const auto Layout1 = FuncInfo.lookup(Func1).LayoutScore;
+      const auto Layout2 = FuncInfo.lookup(Func2).LayoutScore;
+      const auto Regression = (Score2 - Score1) + (Layout1 - Layout2) * Score2;
+      Regressions.push_back(
+          {Func1, Func2, Score1, Score2, Layout1, Layout2, Regression});
+    }
+    std::stable_sort(Regressions.begin(), Regressions.end(),
+                     [](const RegressionTy &A, const RegressionTy &B) {
+                       return A.Regression > B.Regression;
+                     });
+
+    std::error_code EC;
+    raw_fd_ostream OS(opts::DiffReport, EC, sys::fs::F_None);
+    if (EC) {
+      errs() << "BOLT-DIFF: cannot open " << opts::DiffReport << ": "
+             << EC.message() << "\n";
+      return;
+    }
+    OS << "function2,function1,score1,score2,layout1,layout2,changed,"
+          "regression\n";
+    for (const auto &R : Regressions) {
+      OS << '"' << R.Func2->getPrintName() << "\","
+         << '"' << R.Func1->getPrintName() << "\","
+         << format("%.6f,%.6f,", R.Score1, R.Score2)
+         << format("%.4f,%.4f,", R.Layout1, R.Layout2)
+         << (getHash(*R.Func1) != getHash(*R.Func2)) << ','
+         << format("%.6f", R.Regression) << '\n';
+    }
+    outs() << "BOLT-DIFF: wrote regression report for " << Regressions.size()
+           << " functions to " << opts::DiffReport << '\n';
+  }
+
   /// Print functions in binary 2 that did not match anything in binary 1.
   /// Unfortunately, in an LTO build, even a small change can lead to several
   /// LTO variants being unmapped, corresponding to local functions that never
@@ -606,10 +726,14 @@ class RewriteInstanceDiff {
 public:
   /// Main entry point: coordinate all tasks necessary to compare two binaries
   void compareAndReport() {
+    computeFunctionInfo(RI1);
+    computeFunctionInfo(RI2);
     buildLookupMaps();
     matchFunctions();
     if (opts::IgnoreLTOSuffix)
       computeAggregatedLTOScore();
+    if (!opts::DiffReport.empty())
+      writeRegressionReport();
     matchBasicBlocks();
     reportHottestFuncDiffs();
     reportHottestBBDiffs();
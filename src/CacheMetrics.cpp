@@ -8,7 +8,15 @@
 //===----------------------------------------------------------------------===//
 
 #include "CacheMetrics.h"
+#include "CompactCFG.h"
+#include "ParallelUtilities.h"
+#include "ProfileVariants.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/Options.h"
+#include "llvm/Support/ThreadPool.h"
+#include <array>
+#include <map>
+#include <random>
 
 using namespace llvm;
 using namespace bolt;
@@ -66,6 +74,78 @@ ITLBEntries("itlb-entries",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned long long>
+CacheSimEvents("cache-sim-events",
+  cl::desc("The number of basic block executions to replay in the "
+           "trace-driven i-cache and i-tlb simulation (0 = disable)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimLineSize("cache-sim-line-size",
+  cl::desc("The size of a cache line in the cache simulation"),
+  cl::init(64),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimL1ISize("cache-sim-l1i-size",
+  cl::desc("The size of L1 i-cache in the cache simulation"),
+  cl::init(32 << 10),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimL1IAssoc("cache-sim-l1i-assoc",
+  cl::desc("The associativity of L1 i-cache in the cache simulation"),
+  cl::init(8),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimL2Size("cache-sim-l2-size",
+  cl::desc("The size of L2 cache in the cache simulation"),
+  cl::init(1 << 20),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimL2Assoc("cache-sim-l2-assoc",
+  cl::desc("The associativity of L2 cache in the cache simulation"),
+  cl::init(16),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimITLBEntries("cache-sim-itlb-entries",
+  cl::desc("The number of i-tlb entries for 4K pages in the cache simulation"),
+  cl::init(64),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimITLB2MEntries("cache-sim-itlb-2m-entries",
+  cl::desc("The number of i-tlb entries for 2M pages in the cache simulation"),
+  cl::init(8),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimITLBAssoc("cache-sim-itlb-assoc",
+  cl::desc("The associativity of i-tlb in the cache simulation"),
+  cl::init(4),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace {
@@ -101,16 +181,26 @@ double calcTSPScore(
   const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
 
   double Score = 0;
+  std::vector<uint64_t> Addr;
+  std::vector<uint64_t> End;
   for (auto BF : BinaryFunctions) {
     if (!BF->hasProfile())
       continue;
-    for (auto SrcBB : BF->layout()) {
-      auto BI = SrcBB->branch_info_begin();
-      for (auto DstBB : SrcBB->successors()) {
-        if (SrcBB != DstBB && BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
-            BBAddr.at(SrcBB) + BBSize.at(SrcBB) == BBAddr.at(DstBB))
-          Score += BI->Count;
-        ++BI;
+    const CompactCFG CFG(*BF);
+    Addr.resize(CFG.size());
+    End.resize(CFG.size());
+    for (uint32_t I = 0; I < CFG.size(); ++I) {
+      Addr[I] = BBAddr.at(CFG.getBlock(I));
+      End[I] = Addr[I] + BBSize.at(CFG.getBlock(I));
+    }
+    for (uint32_t Src = 0; Src < CFG.size(); ++Src) {
+      const auto Succs = CFG.successors(Src);
+      const auto Counts = CFG.successorCounts(Src);
+      for (unsigned K = 0; K < Succs.size(); ++K) {
+        if (Src != Succs[K] &&
+            Counts[K] != BinaryBasicBlock::COUNT_NO_PROFILE &&
+            End[Src] == Addr[Succs[K]])
+          Score += Counts[K];
       }
     }
   }
@@ -125,19 +215,28 @@ double calcExtTSPScore(
   const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
 
   double Score = 0.0;
+  std::vector<uint64_t> Addr;
+  std::vector<uint64_t> Size;
   for (auto BF : BinaryFunctions) {
     if (!BF->hasProfile())
       continue;
-    for (auto SrcBB : BF->layout()) {
-      auto BI = SrcBB->branch_info_begin();
-      for (auto DstBB : SrcBB->successors()) {
-        if (DstBB != SrcBB) {
-          Score += CacheMetrics::extTSPScore(BBAddr.at(SrcBB),
-                                             BBSize.at(SrcBB),
-                                             BBAddr.at(DstBB),
-                                             BI->Count);
+    const CompactCFG CFG(*BF);
+    Addr.resize(CFG.size());
+    Size.resize(CFG.size());
+    for (uint32_t I = 0; I < CFG.size(); ++I) {
+      Addr[I] = BBAddr.at(CFG.getBlock(I));
+      Size[I] = BBSize.at(CFG.getBlock(I));
+    }
+    for (uint32_t Src = 0; Src < CFG.size(); ++Src) {
+      const auto Succs = CFG.successors(Src);
+      const auto Counts = CFG.successorCounts(Src);
+      for (unsigned K = 0; K < Succs.size(); ++K) {
+        if (Succs[K] != Src) {
+          Score += CacheMetrics::extTSPScore(Addr[Src],
+                                             Size[Src],
+                                             Addr[Succs[K]],
+                                             Counts[K]);
         }
-        ++BI;
       }
     }
   }
@@ -254,6 +353,327 @@ double expectedCacheHitRatio(
   return 100.0 * (1.0 - Misses / TotalSamples);
 }
 
+/// Set-associative cache with LRU replacement. Only tags are tracked.
+class CacheModel {
+  static constexpr uint64_t InvalidTag = ~0ULL;
+
+  unsigned LineBits;
+  uint64_t NumSets;
+  unsigned Ways;
+
+  /// Tags of every set, from the most to the least recently used.
+  std::vector<uint64_t> Tags;
+
+public:
+  uint64_t Accesses{0};
+  uint64_t Misses{0};
+
+  CacheModel(uint64_t Size, unsigned Assoc, uint64_t LineSize)
+    : LineBits(Log2_64(LineSize)),
+      Ways(std::max(1u, Assoc)) {
+    assert(isPowerOf2_64(LineSize) && "line size must be a power of 2");
+    NumSets = std::max<uint64_t>(1, Size / (LineSize * Ways));
+    Tags.resize(NumSets * Ways, InvalidTag);
+  }
+
+  /// Access the line containing \p Addr. Return true on a hit.
+  bool access(uint64_t Addr) {
+    ++Accesses;
+    const auto Line = Addr >> LineBits;
+    auto *Set = &Tags[(Line % NumSets) * Ways];
+    for (unsigned I = 0; I < Ways; ++I) {
+      if (Set[I] == Line) {
+        std::rotate(Set, Set + I, Set + I + 1);
+        return true;
+      }
+    }
+    ++Misses;
+    std::move_backward(Set, Set + Ways - 1, Set + Ways);
+    Set[0] = Line;
+    return false;
+  }
+
+  /// Access every line overlapping [\p Addr, \p Addr + \p Size).
+  void accessRange(uint64_t Addr, uint64_t Size) {
+    const auto End = Addr + std::max<uint64_t>(Size, 1);
+    for (auto Line = Addr >> LineBits; Line <= (End - 1) >> LineBits; ++Line)
+      access(Line << LineBits);
+  }
+};
+
+/// Profiled CFGs and calls of all functions flattened into arrays, from
+/// which block traces are generated by a random walk: successors are chosen
+/// proportionally to edge counts, every call of a block is entered before
+/// leaving the block, and a new function is started proportionally to its
+/// samples that are not explained by calls once the call stack is empty.
+struct TraceGraph {
+  struct Node {
+    uint64_t Addr;
+    uint64_t Size;
+    /// Ranges of successors and callees in the arrays below.
+    uint32_t SuccBegin, SuccEnd;
+    uint32_t CalleeBegin, CalleeEnd;
+  };
+  std::vector<Node> Nodes;
+
+  /// Successor nodes, and cumulative edge counts within each node.
+  std::vector<uint32_t> Succs;
+  std::vector<uint64_t> SuccCounts;
+
+  /// Entry nodes of called functions.
+  std::vector<uint32_t> Callees;
+
+  /// Entry nodes of functions, and cumulative weights of starting a walk.
+  std::vector<uint32_t> Roots;
+  std::vector<uint64_t> RootWeights;
+
+  TraceGraph(const std::vector<BinaryFunction *> &BinaryFunctions,
+             const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+             const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+    std::vector<BinaryFunction *> Functions;
+    std::unordered_map<const BinaryBasicBlock *, uint32_t> BBToNode;
+    for (auto BF : BinaryFunctions) {
+      if (!BF->hasProfile() || BF->layout_empty())
+        continue;
+      Functions.push_back(BF);
+      for (auto BB : BF->layout()) {
+        BBToNode[BB] = Nodes.size();
+        Nodes.push_back({BBAddr.at(BB), BBSize.at(BB), 0, 0, 0, 0});
+      }
+    }
+
+    std::unordered_map<const BinaryFunction *, uint64_t> CallCounts;
+    for (auto BF : Functions) {
+      const auto &BC = BF->getBinaryContext();
+      for (auto BB : BF->layout()) {
+        auto &N = Nodes[BBToNode[BB]];
+
+        N.SuccBegin = Succs.size();
+        uint64_t TotalCount = 0;
+        auto BI = BB->branch_info_begin();
+        for (auto Succ : BB->successors()) {
+          if (BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE && BI->Count) {
+            TotalCount += BI->Count;
+            Succs.push_back(BBToNode[Succ]);
+            SuccCounts.push_back(TotalCount);
+          }
+          ++BI;
+        }
+        N.SuccEnd = Succs.size();
+
+        N.CalleeBegin = Callees.size();
+        const auto Count = BB->getKnownExecutionCount();
+        for (auto &Inst : *BB) {
+          if (!BC.MIB->isCall(Inst))
+            continue;
+          const auto *DstSym = BC.MIB->getTargetSymbol(Inst);
+          const auto *DstFunction =
+              DstSym ? BC.getFunctionForSymbol(DstSym) : nullptr;
+          if (!DstFunction || DstFunction == BF)
+            continue;
+          auto NodeI = BBToNode.find(DstFunction->layout_front());
+          if (NodeI == BBToNode.end())
+            continue;
+          Callees.push_back(NodeI->second);
+          CallCounts[DstFunction] += Count;
+        }
+        N.CalleeEnd = Callees.size();
+      }
+    }
+
+    // Start walks in functions proportionally to their samples that are not
+    // attributed to calls, or to all of their samples if calls explain
+    // everything.
+    for (bool IgnoreCalls : {false, true}) {
+      uint64_t TotalWeight = 0;
+      for (auto BF : Functions) {
+        uint64_t Weight = BF->getKnownExecutionCount();
+        const auto CallCount = CallCounts[BF];
+        if (!IgnoreCalls)
+          Weight = Weight > CallCount ? Weight - CallCount : 0;
+        if (!Weight)
+          continue;
+        TotalWeight += Weight;
+        Roots.push_back(BBToNode[BF->layout_front()]);
+        RootWeights.push_back(TotalWeight);
+      }
+      if (TotalWeight)
+        break;
+    }
+  }
+};
+
+/// Miss statistics of all simulated caches.
+struct CacheStats {
+  uint64_t Events{0};
+  uint64_t L1IAccesses{0};
+  uint64_t L1IMisses{0};
+  uint64_t L2Accesses{0};
+  uint64_t L2Misses{0};
+  uint64_t ITLBAccesses{0};
+  uint64_t ITLBMisses{0};
+  uint64_t ITLB2MAccesses{0};
+  uint64_t ITLB2MMisses{0};
+
+  void add(const CacheStats &Other) {
+    Events += Other.Events;
+    L1IAccesses += Other.L1IAccesses;
+    L1IMisses += Other.L1IMisses;
+    L2Accesses += Other.L2Accesses;
+    L2Misses += Other.L2Misses;
+    ITLBAccesses += Other.ITLBAccesses;
+    ITLBMisses += Other.ITLBMisses;
+    ITLB2MAccesses += Other.ITLB2MAccesses;
+    ITLB2MMisses += Other.ITLB2MMisses;
+  }
+};
+
+/// Replay a trace of \p NumEvents block executions generated from \p Graph
+/// with random seed \p Seed against a fresh set of caches.
+CacheStats simulateTrace(const TraceGraph &Graph, uint64_t NumEvents,
+                         uint64_t Seed) {
+  // Limit the depth of calls to handle recursion.
+  constexpr size_t MaxCallDepth = 256;
+  const uint64_t LineSize = opts::CacheSimLineSize;
+
+  CacheModel L1I(opts::CacheSimL1ISize, opts::CacheSimL1IAssoc, LineSize);
+  CacheModel L2(opts::CacheSimL2Size, opts::CacheSimL2Assoc, LineSize);
+  CacheModel ITLB(uint64_t(opts::CacheSimITLBEntries) << 12,
+                  opts::CacheSimITLBAssoc, 1 << 12);
+  CacheModel ITLB2M(uint64_t(opts::CacheSimITLB2MEntries) << 21,
+                    opts::CacheSimITLBAssoc, 1 << 21);
+
+  std::mt19937_64 Rand(Seed);
+  auto pick = [&](const uint64_t *Cumulative, size_t Size) {
+    std::uniform_int_distribution<uint64_t> Dist(0, Cumulative[Size - 1] - 1);
+    return std::upper_bound(Cumulative, Cumulative + Size, Dist(Rand)) -
+           Cumulative;
+  };
+
+  CacheStats Stats;
+  auto visit = [&](uint32_t NodeIndex) {
+    const auto &N = Graph.Nodes[NodeIndex];
+    const auto End = N.Addr + std::max<uint64_t>(N.Size, 1);
+    for (auto Addr = N.Addr & ~(LineSize - 1); Addr < End; Addr += LineSize) {
+      if (!L1I.access(Addr))
+        L2.access(Addr);
+    }
+    ITLB.accessRange(N.Addr, N.Size);
+    ITLB2M.accessRange(N.Addr, N.Size);
+    ++Stats.Events;
+  };
+
+  auto startWalk = [&]() {
+    const auto Root =
+        Graph.Roots[pick(Graph.RootWeights.data(), Graph.RootWeights.size())];
+    visit(Root);
+    return Root;
+  };
+
+  std::vector<std::pair<uint32_t, uint32_t>> CallStack;
+  uint32_t Cur = startWalk();
+  uint32_t NextCallee = Graph.Nodes[Cur].CalleeBegin;
+  while (Stats.Events < NumEvents) {
+    const auto &N = Graph.Nodes[Cur];
+    if (NextCallee < N.CalleeEnd && CallStack.size() < MaxCallDepth) {
+      CallStack.emplace_back(Cur, NextCallee + 1);
+      Cur = Graph.Callees[NextCallee];
+    } else if (N.SuccBegin != N.SuccEnd) {
+      const auto Succ = N.SuccBegin + pick(&Graph.SuccCounts[N.SuccBegin],
+                                           N.SuccEnd - N.SuccBegin);
+      Cur = Graph.Succs[Succ];
+    } else if (!CallStack.empty()) {
+      // Return to the caller without accessing its block again.
+      std::tie(Cur, NextCallee) = CallStack.back();
+      CallStack.pop_back();
+      continue;
+    } else {
+      Cur = startWalk();
+      NextCallee = Graph.Nodes[Cur].CalleeBegin;
+      continue;
+    }
+    visit(Cur);
+    NextCallee = Graph.Nodes[Cur].CalleeBegin;
+  }
+
+  Stats.L1IAccesses = L1I.Accesses;
+  Stats.L1IMisses = L1I.Misses;
+  Stats.L2Accesses = L2.Accesses;
+  Stats.L2Misses = L2.Misses;
+  Stats.ITLBAccesses = ITLB.Accesses;
+  Stats.ITLBMisses = ITLB.Misses;
+  Stats.ITLB2MAccesses = ITLB2M.Accesses;
+  Stats.ITLB2MMisses = ITLB2M.Misses;
+  return Stats;
+}
+
+/// Simulate the caches on traces generated from the profile and print miss
+/// rates. Each thread replays an independent trace with its own caches.
+void printCacheSimulation(
+  const std::vector<BinaryFunction *> &BinaryFunctions,
+  const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+  const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+
+  TraceGraph Graph(BinaryFunctions, BBAddr, BBSize);
+  if (Graph.Roots.empty())
+    return;
+
+  const unsigned NumThreads = ParallelUtilities::getThreadCount();
+  const uint64_t NumEvents = opts::CacheSimEvents;
+  std::vector<CacheStats> ThreadStats(NumThreads);
+  auto &ThPool = ParallelUtilities::getThreadPool();
+  for (unsigned I = 0; I < NumThreads; ++I) {
+    const auto Events = NumEvents / NumThreads + (I < NumEvents % NumThreads);
+    if (!Events)
+      continue;
+    ThPool.async([&, I, Events]() {
+      ThreadStats[I] = simulateTrace(Graph, Events, I);
+    });
+  }
+  ThPool.wait();
+
+  CacheStats Stats;
+  for (const auto &TS : ThreadStats)
+    Stats.add(TS);
+
+  auto printStats = [&](StringRef Name, uint64_t Accesses, uint64_t Misses) {
+    outs() << format("    %-8s %llu misses, %.2lf%% of %llu accesses, "
+                     "%.2lf per 1000 blocks\n",
+                     Name.str().c_str(), (unsigned long long)Misses,
+                     Accesses ? 100.0 * Misses / Accesses : 0.0,
+                     (unsigned long long)Accesses,
+                     1000.0 * Misses / Stats.Events);
+  };
+  outs() << "  Cache simulation of " << Stats.Events
+         << " block executions on " << NumThreads << " threads:\n";
+  printStats("L1i:", Stats.L1IAccesses, Stats.L1IMisses);
+  printStats("L2:", Stats.L2Accesses, Stats.L2Misses);
+  printStats("iTLB-4K:", Stats.ITLBAccesses, Stats.ITLBMisses);
+  printStats("iTLB-2M:", Stats.ITLB2MAccesses, Stats.ITLB2MMisses);
+}
+
+/// Kinds of bytes in a page of hot text.
+enum PageBytesKind : unsigned {
+  PB_CODE = 0,
+  PB_COLD,
+  PB_ISLAND,
+  PB_PADDING,
+  PB_NUM
+};
+
+using PageBytesTy = std::array<uint64_t, PB_NUM>;
+
+/// Add the bytes in [Start, End) to the pages of \p PageSize they cover.
+void addPageBytes(std::map<uint64_t, PageBytesTy> &Pages, uint64_t PageSize,
+                  uint64_t Start, uint64_t End, unsigned Kind) {
+  while (Start < End) {
+    const auto Page = alignDown(Start, PageSize);
+    const auto Next = std::min(End, Page + PageSize);
+    Pages[Page][Kind] += Next - Start;
+    Start = Next;
+  }
+}
+
 } // end namespace anonymous
 
 double CacheMetrics::extTSPScore(uint64_t SrcAddr,
@@ -348,4 +768,120 @@ void CacheMetrics::printAll(const std::vector<BinaryFunction *> &BFs) {
 
   outs() << "  ExtTSP score: "
          << format("%.0lf\n", calcExtTSPScore(BFs, BBAddr, BBSize));
+
+  // Scores of the layout under the workloads given with -profile-variants.
+  if (!BFs.empty()) {
+    const auto &BC = BFs.front()->getBinaryContext();
+    for (unsigned I = 0; I < BC.ProfileVariants.size(); ++I) {
+      std::vector<std::unique_ptr<VariantCounts>> Counts;
+      for (auto *BF : BFs) {
+        if (BF->hasProfile())
+          Counts.emplace_back(llvm::make_unique<VariantCounts>(*BF, I));
+      }
+      outs() << "  ExtTSP score for " << BC.ProfileVariants[I].Name << ": "
+             << format("%.0lf\n", calcExtTSPScore(BFs, BBAddr, BBSize));
+    }
+  }
+
+  if (opts::CacheSimEvents)
+    printCacheSimulation(BFs, BBAddr, BBSize);
+}
+
+void CacheMetrics::printPageUsage(const std::vector<BinaryFunction *> &BFs,
+                                  raw_ostream *OS) {
+  struct Range {
+    uint64_t Start;
+    uint64_t End;
+    unsigned Kind;
+  };
+  std::vector<Range> Ranges;
+
+  // Constant islands are emitted at the end of the fragment they belong to.
+  auto addFragment = [&](uint64_t Start, uint64_t End, uint64_t DataStart,
+                         bool IsCold) {
+    if (!DataStart || DataStart > End)
+      DataStart = End;
+    Ranges.push_back({Start, DataStart, IsCold ? PB_COLD : PB_CODE});
+    Ranges.push_back({DataStart, End, PB_ISLAND});
+  };
+
+  // The hot text spans the hot parts of the functions with a valid index.
+  uint64_t HotStart = std::numeric_limits<uint64_t>::max();
+  uint64_t HotEnd = 0;
+  for (auto *BF : BFs) {
+    if (!BF->isEmitted())
+      continue;
+    const auto Start = BF->getOutputAddress();
+    const auto End = Start + BF->getOutputSize();
+    addFragment(Start, End,
+                BF->hasConstantIsland() ? BF->getOutputDataAddress() : 0,
+                !BF->hasValidIndex());
+    if (BF->hasValidIndex() && Start < End) {
+      HotStart = std::min(HotStart, Start);
+      HotEnd = std::max(HotEnd, End);
+    }
+    if (BF->isSplit()) {
+      const auto ColdStart = BF->cold().getAddress();
+      addFragment(ColdStart, ColdStart + BF->cold().getImageSize(),
+                  BF->hasConstantIsland() ? BF->getOutputColdDataAddress() : 0,
+                  /*IsCold=*/true);
+    }
+  }
+  if (HotStart >= HotEnd)
+    return;
+
+  std::sort(Ranges.begin(), Ranges.end(),
+            [](const Range &A, const Range &B) { return A.Start < B.Start; });
+
+  constexpr uint64_t SmallPageSize = 4096;
+  constexpr uint64_t HugePageSize = 2 << 20;
+  std::map<uint64_t, PageBytesTy> SmallPages;
+  std::map<uint64_t, PageBytesTy> HugePages;
+  auto addBytes = [&](uint64_t Start, uint64_t End, unsigned Kind) {
+    addPageBytes(SmallPages, SmallPageSize, Start, End, Kind);
+    addPageBytes(HugePages, HugePageSize, Start, End, Kind);
+  };
+
+  // Whatever is not covered by a function is padding.
+  uint64_t Dot = HotStart;
+  for (const auto &R : Ranges) {
+    const auto Start = std::max(R.Start, Dot);
+    const auto End = std::min(R.End, HotEnd);
+    if (Start >= End)
+      continue;
+    if (R.Start > Dot)
+      addBytes(Dot, R.Start, PB_PADDING);
+    addBytes(Start, End, R.Kind);
+    Dot = End;
+  }
+  if (Dot < HotEnd)
+    addBytes(Dot, HotEnd, PB_PADDING);
+
+  PageBytesTy Total{};
+  for (const auto &Page : HugePages) {
+    for (unsigned Kind = 0; Kind < PB_NUM; ++Kind)
+      Total[Kind] += Page.second[Kind];
+  }
+  outs() << "BOLT-INFO: hot text spans " << SmallPages.size()
+         << " 4KB pages and " << HugePages.size() << " 2MB pages with "
+         << Total[PB_CODE] << " bytes of hot code, " << Total[PB_COLD]
+         << " bytes of cold code, " << Total[PB_ISLAND]
+         << " bytes of constant islands and " << Total[PB_PADDING]
+         << " bytes of padding\n";
+
+  if (!OS)
+    return;
+  *OS << "# page size, page address, hot code, cold code, constant islands, "
+         "padding\n";
+  auto printPages = [&](StringRef Name,
+                        const std::map<uint64_t, PageBytesTy> &Pages) {
+    for (const auto &Page : Pages) {
+      *OS << Name << " 0x" << Twine::utohexstr(Page.first);
+      for (unsigned Kind = 0; Kind < PB_NUM; ++Kind)
+        *OS << ' ' << Page.second[Kind];
+      *OS << '\n';
+    }
+  };
+  printPages("2M", HugePages);
+  printPages("4K", SmallPages);
 }
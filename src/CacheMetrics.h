@@ -20,6 +20,12 @@ namespace CacheMetrics {
 /// Calculate various metrics related to instruction cache performance.
 void printAll(const std::vector<BinaryFunction *> &BinaryFunctions);
 
+/// Print how the bytes of the pages covered by hot text are used by hot
+/// code, cold code, constant islands and padding. The totals go to outs(),
+/// and the numbers for every 4KB and 2MB page go to \p OS if it is set.
+void printPageUsage(const std::vector<BinaryFunction *> &BinaryFunctions,
+                    raw_ostream *OS);
+
 /// Calculate Extended-TSP metric, which quantifies the expected number of
 /// i-cache misses for a given pair of basic blocks. The parameters are:
 /// - SrcAddr is the address of the source block;
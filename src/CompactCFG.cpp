@@ -0,0 +1,76 @@
+//===--- CompactCFG.cpp - Index-based snapshot of a function CFG ----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "CompactCFG.h"
+#include "BinaryFunction.h"
+
+using namespace llvm;
+using namespace bolt;
+
+CompactCFG::CompactCFG(const BinaryFunction &BF, bool UseLayout) {
+  if (UseLayout) {
+    Blocks.assign(BF.layout_begin(), BF.layout_end());
+  } else {
+    Blocks.reserve(BF.size());
+    for (auto &BB : BF)
+      Blocks.push_back(&BB);
+  }
+
+  const uint32_t N = Blocks.size();
+  BlockIndex.reserve(N);
+  for (uint32_t I = 0; I < N; ++I)
+    BlockIndex[Blocks[I]] = I;
+
+  // Successors and edge counts.
+  SuccBegin.reserve(N + 1);
+  LPBegin.reserve(N + 1);
+  ThrowerBegin.reserve(N + 1);
+  std::vector<uint32_t> NumPreds(N + 1, 0);
+  for (auto *BB : Blocks) {
+    SuccBegin.push_back(Succs.size());
+    auto BI = BB->branch_info_begin();
+    for (auto *Succ : BB->successors()) {
+      const auto SuccIndex = getIndex(Succ);
+      Succs.push_back(SuccIndex);
+      EdgeCounts.push_back(BI->Count);
+      EdgeMispreds.push_back(BI->MispredictedCount);
+      ++NumPreds[SuccIndex + 1];
+      ++BI;
+    }
+
+    LPBegin.push_back(LandingPads.size());
+    for (auto *LP : BB->landing_pads())
+      LandingPads.push_back(getIndex(LP));
+
+    ThrowerBegin.push_back(Throwers.size());
+    for (auto *Thrower : BB->throwers())
+      Throwers.push_back(getIndex(Thrower));
+  }
+  SuccBegin.push_back(Succs.size());
+  LPBegin.push_back(LandingPads.size());
+  ThrowerBegin.push_back(Throwers.size());
+
+  // Predecessors are bucketed by destination from the successor lists, so
+  // that each predecessor knows the edge it comes through.
+  PredBegin.resize(N + 1);
+  for (uint32_t I = 0; I < N; ++I)
+    PredBegin[I + 1] = PredBegin[I] + NumPreds[I + 1];
+  Preds.resize(Succs.size());
+  PredEdges.resize(Succs.size());
+  std::vector<uint32_t> Next(PredBegin.begin(), PredBegin.end() - 1);
+  for (uint32_t I = 0; I < N; ++I) {
+    for (auto Edge = SuccBegin[I]; Edge < SuccBegin[I + 1]; ++Edge) {
+      const auto Pos = Next[Succs[Edge]]++;
+      Preds[Pos] = I;
+      PredEdges[Pos] = Edge;
+    }
+  }
+}
@@ -0,0 +1,134 @@
+//===--- CompactCFG.h - Index-based snapshot of a function CFG ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Basic blocks keep their edges in small per-block vectors of pointers. For
+// algorithms that walk every edge of a function many times, CompactCFG keeps
+// the same edges in compressed sparse row form: blocks are numbered densely
+// and the edges of all blocks are stored back to back in a few arrays, with
+// the profile counts of the edges out of line.
+//
+// The snapshot is not updated when the CFG changes and has to be rebuilt.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_COMPACT_CFG_H
+#define LLVM_TOOLS_LLVM_BOLT_COMPACT_CFG_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include <cstdint>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+class BinaryBasicBlock;
+class BinaryFunction;
+
+class CompactCFG {
+  /// Blocks in the order of their indices.
+  std::vector<BinaryBasicBlock *> Blocks;
+
+  /// Index of each block in Blocks.
+  DenseMap<const BinaryBasicBlock *, uint32_t> BlockIndex;
+
+  /// Successors of block I are Succs[SuccBegin[I] .. SuccBegin[I + 1]). An
+  /// edge is identified by its position in Succs.
+  std::vector<uint32_t> SuccBegin;
+  std::vector<uint32_t> Succs;
+
+  /// Profile counts of the edges, indexed by edge.
+  std::vector<uint64_t> EdgeCounts;
+  std::vector<uint64_t> EdgeMispreds;
+
+  /// Predecessors of block I and the edges they come through.
+  std::vector<uint32_t> PredBegin;
+  std::vector<uint32_t> Preds;
+  std::vector<uint32_t> PredEdges;
+
+  /// Landing pads and throwers of block I.
+  std::vector<uint32_t> LPBegin;
+  std::vector<uint32_t> LandingPads;
+  std::vector<uint32_t> ThrowerBegin;
+  std::vector<uint32_t> Throwers;
+
+  template <typename T>
+  static ArrayRef<T> getRange(const std::vector<T> &Values,
+                              const std::vector<uint32_t> &Begin,
+                              uint32_t I) {
+    return makeArrayRef(Values.data() + Begin[I], Begin[I + 1] - Begin[I]);
+  }
+
+public:
+  CompactCFG() = default;
+
+  /// Build the snapshot for \p BF. Blocks are numbered in layout order if
+  /// \p UseLayout is set, and in the original order otherwise.
+  explicit CompactCFG(const BinaryFunction &BF, bool UseLayout = true);
+
+  /// Number of blocks.
+  uint32_t size() const { return Blocks.size(); }
+  bool empty() const { return Blocks.empty(); }
+
+  /// Number of edges.
+  uint32_t getNumEdges() const { return Succs.size(); }
+
+  BinaryBasicBlock *getBlock(uint32_t I) const { return Blocks[I]; }
+
+  /// Return the index of \p BB, which must belong to the snapshot.
+  uint32_t getIndex(const BinaryBasicBlock *BB) const {
+    auto Itr = BlockIndex.find(BB);
+    assert(Itr != BlockIndex.end() && "block is not part of the snapshot");
+    return Itr->second;
+  }
+
+  /// Successors of block \p I, in the same order as in the block.
+  ArrayRef<uint32_t> successors(uint32_t I) const {
+    return getRange(Succs, SuccBegin, I);
+  }
+
+  /// Counts of the edges to the successors of block \p I.
+  ArrayRef<uint64_t> successorCounts(uint32_t I) const {
+    return getRange(EdgeCounts, SuccBegin, I);
+  }
+
+  /// Id of the first edge out of block \p I. Edges out of the block are
+  /// numbered consecutively in the order of successors(I).
+  uint32_t getFirstEdge(uint32_t I) const { return SuccBegin[I]; }
+
+  /// Predecessors of block \p I.
+  ArrayRef<uint32_t> predecessors(uint32_t I) const {
+    return getRange(Preds, PredBegin, I);
+  }
+
+  /// Ids of the edges from predecessors(I) into block \p I.
+  ArrayRef<uint32_t> predecessorEdges(uint32_t I) const {
+    return getRange(PredEdges, PredBegin, I);
+  }
+
+  ArrayRef<uint32_t> landingPads(uint32_t I) const {
+    return getRange(LandingPads, LPBegin, I);
+  }
+
+  ArrayRef<uint32_t> throwers(uint32_t I) const {
+    return getRange(Throwers, ThrowerBegin, I);
+  }
+
+  /// Profile count of \p Edge. Could be COUNT_NO_PROFILE.
+  uint64_t getEdgeCount(uint32_t Edge) const { return EdgeCounts[Edge]; }
+
+  uint64_t getEdgeMispredictedCount(uint32_t Edge) const {
+    return EdgeMispreds[Edge];
+  }
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,131 @@
+//===--- ConcurrentCountMap.h - Hash table of counters for many threads ---===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A fixed-capacity open-addressing hash table of execution, misprediction
+// and cycle counters. Counters are bumped from multiple threads without
+// locks: a slot is claimed with a compare-and-swap on its state and counts
+// are added with atomic increments. Keys are never removed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_CONCURRENT_COUNT_MAP_H
+#define LLVM_TOOLS_LLVM_BOLT_CONCURRENT_COUNT_MAP_H
+
+#include "llvm/ADT/DenseMapInfo.h"
+#include "llvm/Support/MathExtras.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace llvm {
+namespace bolt {
+
+template <typename KeyT, typename KeyInfoT = DenseMapInfo<KeyT>>
+class ConcurrentCountMap {
+  enum : uint8_t {
+    SLOT_EMPTY = 0,
+    SLOT_WRITING,  /// A thread is storing the key of the slot.
+    SLOT_READY,
+  };
+
+  struct Slot {
+    std::atomic<uint8_t> State;
+    KeyT Key;
+    std::atomic<uint64_t> Count;
+    std::atomic<uint64_t> Mispreds;
+    std::atomic<uint64_t> Cycles;
+
+    Slot() : State(SLOT_EMPTY), Count(0), Mispreds(0), Cycles(0) {}
+  };
+
+  std::unique_ptr<Slot[]> Slots;
+  size_t Capacity;
+
+  /// Maximum number of keys in the table, keeping probe sequences short.
+  size_t MaxKeys;
+  std::atomic<size_t> NumKeys{0};
+
+public:
+  /// Create a table with room for at least \p MinKeys keys.
+  explicit ConcurrentCountMap(size_t MinKeys)
+    : Capacity(NextPowerOf2(MinKeys + MinKeys / 3)),
+      MaxKeys(Capacity - Capacity / 4) {
+    Slots.reset(new Slot[Capacity]);
+  }
+
+  ConcurrentCountMap(const ConcurrentCountMap &) = delete;
+  ConcurrentCountMap &operator=(const ConcurrentCountMap &) = delete;
+
+  /// Add \p Count, \p Mispreds and \p Cycles to the counters of \p Key. May
+  /// be called from multiple threads at once. Return false if the key is not
+  /// in the table and the table is full, in which case nothing is recorded.
+  bool bump(const KeyT &Key, uint64_t Count, uint64_t Mispreds = 0,
+            uint64_t Cycles = 0) {
+    const size_t Mask = Capacity - 1;
+    size_t Idx = KeyInfoT::getHashValue(Key) & Mask;
+    for (size_t Probe = 0; Probe < Capacity; ++Probe, Idx = (Idx + 1) & Mask) {
+      auto &S = Slots[Idx];
+      auto State = S.State.load(std::memory_order_acquire);
+      if (State == SLOT_EMPTY) {
+        // Linear probing without removal: the key is not in the table.
+        if (NumKeys.fetch_add(1, std::memory_order_relaxed) >= MaxKeys) {
+          NumKeys.fetch_sub(1, std::memory_order_relaxed);
+          return false;
+        }
+        if (S.State.compare_exchange_strong(State, SLOT_WRITING,
+                                            std::memory_order_acquire)) {
+          S.Key = Key;
+          S.State.store(SLOT_READY, std::memory_order_release);
+          add(S, Count, Mispreds, Cycles);
+          return true;
+        }
+        // Another thread claimed the slot first.
+        NumKeys.fetch_sub(1, std::memory_order_relaxed);
+      }
+      while (State == SLOT_WRITING)
+        State = S.State.load(std::memory_order_acquire);
+
+      if (KeyInfoT::isEqual(S.Key, Key)) {
+        add(S, Count, Mispreds, Cycles);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Call \p Func(Key, Count, Mispreds, Cycles) for every key in the table.
+  /// Must not run concurrently with bump().
+  template <typename FuncTy> void forEach(FuncTy Func) const {
+    for (size_t Idx = 0; Idx < Capacity; ++Idx) {
+      const auto &S = Slots[Idx];
+      if (S.State.load(std::memory_order_acquire) != SLOT_READY)
+        continue;
+      Func(S.Key, S.Count.load(std::memory_order_relaxed),
+           S.Mispreds.load(std::memory_order_relaxed),
+           S.Cycles.load(std::memory_order_relaxed));
+    }
+  }
+
+  size_t size() const { return NumKeys.load(std::memory_order_relaxed); }
+
+private:
+  static void add(Slot &S, uint64_t Count, uint64_t Mispreds,
+                  uint64_t Cycles) {
+    S.Count.fetch_add(Count, std::memory_order_relaxed);
+    if (Mispreds)
+      S.Mispreds.fetch_add(Mispreds, std::memory_order_relaxed);
+    if (Cycles)
+      S.Cycles.fetch_add(Cycles, std::memory_order_relaxed);
+  }
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -13,7 +13,9 @@
 #include "BinaryBasicBlock.h"
 #include "BinaryContext.h"
 #include "BinaryFunction.h"
+#include "ParallelUtilities.h"
 #include "RewriteInstance.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/BinaryFormat/Dwarf.h"
 #include "llvm/DebugInfo/DWARF/DWARFContext.h"
@@ -30,10 +32,12 @@
 #include "llvm/Object/ObjectFile.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DataExtractor.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/Endian.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 #include <algorithm>
 
@@ -63,12 +67,76 @@ void RewriteInstance::updateDebugInfo() {
   SectionPatchers[".debug_abbrev"] = llvm::make_unique<DebugAbbrevPatcher>();
   SectionPatchers[".debug_info"]  = llvm::make_unique<SimpleBinaryPatcher>();
 
-  RangesSectionsWriter = llvm::make_unique<DebugRangesSectionsWriter>(BC.get());
+  // Parse all units upfront since DWARFContext does not support concurrent
+  // parsing.
+  std::vector<DWARFUnit *> Units;
+  for (auto &CU : BC->DwCtx->compile_units()) {
+    CU->getUnitDIE(false);
+    Units.push_back(CU.get());
+  }
+
+  const auto PreservedRanges = updateSplitDebugInfo(Units);
+  RangesSectionsWriter =
+      llvm::make_unique<DebugRangesSectionsWriter>(BC.get(), PreservedRanges);
   LocationListWriter = llvm::make_unique<DebugLocWriter>(BC.get());
 
-  for (auto &CU : BC->DwCtx->compile_units()) {
-    updateUnitDebugInfo(CU->getUnitDIE(false),
-                        std::vector<const BinaryFunction *>{});
+  // Consecutive units are grouped and every group is updated by a single
+  // task. Appending the groups in order produces the same sections as
+  // updating all units serially.
+  size_t GroupSize = std::max<size_t>(1, Units.size());
+  if (ParallelUtilities::isParallel()) {
+    GroupSize = std::max<size_t>(
+        1, Units.size() / (ParallelUtilities::getThreadCount() * 20));
+  }
+  std::vector<std::unique_ptr<DebugInfoUpdate>> Groups;
+  for (size_t Begin = 0; Begin < Units.size(); Begin += GroupSize)
+    Groups.emplace_back(llvm::make_unique<DebugInfoUpdate>(BC.get()));
+
+  auto updateGroup = [&](size_t GroupIndex) {
+    const auto Begin = GroupIndex * GroupSize;
+    const auto End = std::min(Units.size(), Begin + GroupSize);
+    for (auto I = Begin; I < End; ++I) {
+      updateUnitDebugInfo(Units[I]->getUnitDIE(false),
+                          std::vector<const BinaryFunction *>{},
+                          *Groups[GroupIndex]);
+    }
+  };
+
+  if (Groups.size() > 1) {
+    auto &ThPool = ParallelUtilities::getThreadPool();
+    for (size_t I = 0; I < Groups.size(); ++I)
+      ThPool.async(updateGroup, I);
+    ThPool.wait();
+  } else if (!Groups.empty()) {
+    updateGroup(0);
+  }
+
+  auto &DebugInfoPatcher =
+      static_cast<SimpleBinaryPatcher &>(*SectionPatchers[".debug_info"]);
+  auto &AbbrevPatcher =
+      static_cast<DebugAbbrevPatcher &>(*SectionPatchers[".debug_abbrev"]);
+  for (auto &Update : Groups) {
+    const auto RangesDelta = RangesSectionsWriter->append(Update->RangesWriter);
+    for (const auto &Ref : Update->RangesRefs) {
+      auto Offset = Ref.second;
+      if (Offset == Update->RangesWriter.getEmptyRangesOffset())
+        Offset = RangesSectionsWriter->getEmptyRangesOffset();
+      else
+        Offset += RangesDelta;
+      DebugInfoPatcher.addLE32Patch(Ref.first, Offset);
+    }
+
+    const auto LocDelta = LocationListWriter->append(Update->LocWriter);
+    for (const auto &Ref : Update->LocRefs) {
+      auto Offset = Ref.second;
+      if (Offset != Update->LocWriter.getEmptyListOffset())
+        Offset += LocDelta;
+      DebugInfoPatcher.addLE32Patch(Ref.first, Offset);
+    }
+
+    DebugInfoPatcher.append(std::move(Update->InfoPatcher));
+    AbbrevPatcher.append(std::move(Update->AbbrevPatcher));
+    Update.reset();
   }
 
   finalizeDebugSections();
@@ -76,9 +144,154 @@ void RewriteInstance::updateDebugInfo() {
   updateGdbIndexSection();
 }
 
+std::string
+RewriteInstance::updateSplitDebugInfo(const std::vector<DWARFUnit *> &Units) {
+  // The .debug_ranges contribution of a split unit and the base address of
+  // its entries in the input and in the output.
+  struct SplitUnitRanges {
+    uint64_t Offset;
+    uint64_t InputBase;
+    uint64_t OutputBase;
+  };
+  std::vector<SplitUnitRanges> UnitRanges;
+  uint64_t NumSplitUnits = 0;
+  bool HasAddrHeaders = false;
+  for (auto *Unit : Units) {
+    const auto DIE = Unit->getUnitDIE();
+    if (!DIE.find(dwarf::DW_AT_GNU_dwo_name) &&
+        !DIE.find(dwarf::DW_AT_dwo_name))
+      continue;
+    ++NumSplitUnits;
+    if (Unit->getVersion() >= 5)
+      HasAddrHeaders = true;
+
+    const auto RangesBase =
+        dwarf::toSectionOffset(DIE.find(dwarf::DW_AT_GNU_ranges_base));
+    if (!RangesBase)
+      continue;
+    const auto InputBase = dwarf::toAddress(DIE.find(dwarf::DW_AT_low_pc), 0);
+    // A skeleton unit with low and high pc gets DW_AT_ranges and a zero base
+    // address in updateDWARFObjectAddressRanges().
+    const auto *Abbrev = DIE.getAbbreviationDeclarationPtr();
+    const auto OutputBase =
+        Abbrev && Abbrev->findAttributeIndex(dwarf::DW_AT_high_pc) &&
+        !Abbrev->findAttributeIndex(dwarf::DW_AT_ranges) ? 0 : InputBase;
+    UnitRanges.push_back({*RangesBase, InputBase, OutputBase});
+  }
+
+  if (!NumSplitUnits)
+    return std::string();
+
+  auto translateAddress = [&](uint64_t Address) -> uint64_t {
+    const auto *Function =
+        getBinaryFunctionContainingAddress(Address, /*CheckPastEnd=*/true);
+    if (!Function || Function->isFolded())
+      return 0;
+    return Function->translateInputToOutputAddress(Address);
+  };
+
+  // Address indices of the .dwo units refer to .debug_addr. Entries have the
+  // same size in the output, so they are updated in place.
+  uint64_t NumAddrUpdates = 0;
+  if (auto AddrSection = BC->getUniqueSectionByName(".debug_addr")) {
+    auto Patcher = llvm::make_unique<SimpleBinaryPatcher>();
+    const auto Contents = AddrSection->getContents();
+    DataExtractor DE(Contents, BC->AsmInfo->isLittleEndian(), 8);
+    uint32_t Offset = 0;
+    while (Offset < Contents.size()) {
+      uint32_t End = Contents.size();
+      if (HasAddrHeaders) {
+        // DWARF v5 contribution header: length, version, address size and
+        // segment selector size.
+        const auto Length = DE.getU32(&Offset);
+        End = std::min<uint64_t>(End, Offset + Length);
+        Offset += 4;
+      }
+      while (Offset + 8 <= End) {
+        const auto EntryOffset = Offset;
+        const auto Address = DE.getU64(&Offset);
+        const auto NewAddress = translateAddress(Address);
+        if (NewAddress && NewAddress != Address) {
+          Patcher->addLE64Patch(EntryOffset, NewAddress);
+          ++NumAddrUpdates;
+        }
+      }
+      Offset = End;
+    }
+    SectionPatchers[".debug_addr"] = std::move(Patcher);
+  }
+
+  // Range lists of the .dwo units are referenced relative to the
+  // DW_AT_GNU_ranges_base of their skeleton units. They are kept at their
+  // offsets with translated addresses. A list cannot grow, so a range that
+  // got split in the output is replaced by a range covering all its parts.
+  std::string PreservedRanges;
+  auto RangesSection = BC->getUniqueSectionByName(".debug_ranges");
+  if (!UnitRanges.empty() && RangesSection) {
+    PreservedRanges = RangesSection->getContents().str();
+    std::sort(UnitRanges.begin(), UnitRanges.end(),
+              [](const SplitUnitRanges &A, const SplitUnitRanges &B) {
+                return A.Offset < B.Offset;
+              });
+    for (size_t I = 0; I < UnitRanges.size(); ++I) {
+      const auto &UR = UnitRanges[I];
+      const auto End = I + 1 < UnitRanges.size() ? UnitRanges[I + 1].Offset
+                                                 : PreservedRanges.size();
+      auto InputBase = UR.InputBase;
+      auto OutputBase = UR.OutputBase;
+      for (auto Offset = UR.Offset; Offset + 16 <= End; Offset += 16) {
+        auto *Entry = &PreservedRanges[Offset];
+        const auto Begin = read64le(Entry);
+        const auto EndAddress = read64le(Entry + 8);
+        if (!Begin && !EndAddress) {
+          // End of list.
+          InputBase = UR.InputBase;
+          OutputBase = UR.OutputBase;
+          continue;
+        }
+        if (Begin == -1ULL) {
+          // Base address selection entry.
+          InputBase = EndAddress;
+          const auto NewBase = translateAddress(EndAddress);
+          OutputBase = NewBase ? NewBase : EndAddress;
+          write64le(Entry + 8, OutputBase);
+          continue;
+        }
+
+        const auto *Function =
+            getBinaryFunctionContainingAddress(InputBase + Begin);
+        if (!Function || Function->isFolded())
+          continue;
+        DWARFAddressRangesVector InputRanges;
+        InputRanges.emplace_back(InputBase + Begin, InputBase + EndAddress);
+        const auto OutputRanges =
+            Function->translateInputToOutputRanges(InputRanges);
+        if (OutputRanges.empty())
+          continue;
+        auto LowPC = OutputRanges.front().LowPC;
+        auto HighPC = OutputRanges.front().HighPC;
+        for (const auto &Range : OutputRanges) {
+          LowPC = std::min(LowPC, Range.LowPC);
+          HighPC = std::max(HighPC, Range.HighPC);
+        }
+        if (LowPC < OutputBase)
+          continue;
+        write64le(Entry, LowPC - OutputBase);
+        write64le(Entry + 8, HighPC - OutputBase);
+      }
+    }
+  }
+
+  outs() << "BOLT-INFO: updated " << NumAddrUpdates << " .debug_addr entries "
+         << "for " << NumSplitUnits << " split DWARF units\n";
+
+  return PreservedRanges;
+}
+
 void RewriteInstance::updateUnitDebugInfo(
     const DWARFDie DIE,
-    std::vector<const BinaryFunction *> FunctionStack) {
+    std::vector<const BinaryFunction *> FunctionStack,
+    DebugInfoUpdate &Update) {
 
   bool IsFunctionDef = false;
   switch (DIE.getTag()) {
@@ -87,9 +300,9 @@ void RewriteInstance::updateUnitDebugInfo(
       const auto ModuleRanges = DIE.getAddressRanges();
       auto OutputRanges = translateModuleAddressRanges(ModuleRanges);
       const auto RangesSectionOffset =
-        RangesSectionsWriter->addCURanges(DIE.getDwarfUnit()->getOffset(),
-                                          std::move(OutputRanges));
-      updateDWARFObjectAddressRanges(DIE, RangesSectionOffset);
+        Update.RangesWriter.addCURanges(DIE.getDwarfUnit()->getOffset(),
+                                        std::move(OutputRanges));
+      updateDWARFObjectAddressRanges(DIE, RangesSectionOffset, Update);
     }
     break;
 
@@ -104,15 +317,13 @@ void RewriteInstance::updateUnitDebugInfo(
           Function = nullptr;
         }
         FunctionStack.push_back(Function);
-        auto RangesSectionOffset =
-          RangesSectionsWriter->getEmptyRangesOffset();
+        auto RangesSectionOffset = Update.RangesWriter.getEmptyRangesOffset();
         if (Function) {
           auto FunctionRanges = Function->getOutputAddressRanges();
           RangesSectionOffset =
-            RangesSectionsWriter->addRanges(Function,
-                                            std::move(FunctionRanges));
+            Update.RangesWriter.addRanges(Function, std::move(FunctionRanges));
         }
-        updateDWARFObjectAddressRanges(DIE, RangesSectionOffset);
+        updateDWARFObjectAddressRanges(DIE, RangesSectionOffset, Update);
       }
     }
     break;
@@ -122,8 +333,7 @@ void RewriteInstance::updateUnitDebugInfo(
   case dwarf::DW_TAG_try_block:
   case dwarf::DW_TAG_catch_block:
     {
-      auto RangesSectionOffset =
-        RangesSectionsWriter->getEmptyRangesOffset();
+      auto RangesSectionOffset = Update.RangesWriter.getEmptyRangesOffset();
       const BinaryFunction *Function =
         FunctionStack.empty() ? nullptr : FunctionStack.back();
       if (Function) {
@@ -137,9 +347,9 @@ void RewriteInstance::updateUnitDebugInfo(
           }
         );
         RangesSectionOffset =
-          RangesSectionsWriter->addRanges(Function, std::move(OutputRanges));
+          Update.RangesWriter.addRanges(Function, std::move(OutputRanges));
       }
-      updateDWARFObjectAddressRanges(DIE, RangesSectionOffset);
+      updateDWARFObjectAddressRanges(DIE, RangesSectionOffset, Update);
     }
     break;
 
@@ -154,7 +364,7 @@ void RewriteInstance::updateUnitDebugInfo(
         Value = *V;
         if (Value.isFormClass(DWARFFormValue::FC_Constant) ||
             Value.isFormClass(DWARFFormValue::FC_SectionOffset)) {
-          auto LocListSectionOffset = LocationListWriter->getEmptyListOffset();
+          auto LocListSectionOffset = Update.LocWriter.getEmptyListOffset();
           if (Function) {
             // Limit parsing to a single list to save memory.
             DWARFDebugLoc::LocationList LL;
@@ -182,14 +392,11 @@ void RewriteInstance::updateUnitDebugInfo(
                        << Twine::utohexstr(DIE.getDwarfUnit()->getOffset())
                        << '\n';
               });
-              LocListSectionOffset = LocationListWriter->addList(OutputLL);
+              LocListSectionOffset = Update.LocWriter.addList(OutputLL);
             }
           }
 
-          auto DebugInfoPatcher =
-              static_cast<SimpleBinaryPatcher *>(
-                  SectionPatchers[".debug_info"].get());
-          DebugInfoPatcher->addLE32Patch(AttrOffset, LocListSectionOffset);
+          Update.LocRefs.emplace_back(AttrOffset, LocListSectionOffset);
         } else {
           assert((Value.isFormClass(DWARFFormValue::FC_Exprloc) ||
                   Value.isFormClass(DWARFFormValue::FC_Block)) &&
@@ -208,10 +415,7 @@ void RewriteInstance::updateUnitDebugInfo(
                          << " for DIE with tag " << DIE.getTag()
                          << " to 0x" << Twine::utohexstr(NewAddress) << '\n');
           }
-          auto DebugInfoPatcher =
-              static_cast<SimpleBinaryPatcher *>(
-                  SectionPatchers[".debug_info"].get());
-          DebugInfoPatcher->addLE64Patch(AttrOffset, NewAddress);
+          Update.InfoPatcher.addLE64Patch(AttrOffset, NewAddress);
         } else if (opts::Verbosity >= 1) {
           errs() << "BOLT-WARNING: unexpected form value for attribute at 0x"
                  << Twine::utohexstr(AttrOffset);
@@ -222,7 +426,7 @@ void RewriteInstance::updateUnitDebugInfo(
 
   // Recursively update each child.
   for (auto Child = DIE.getFirstChild(); Child; Child = Child.getSibling()) {
-    updateUnitDebugInfo(Child, FunctionStack);
+    updateUnitDebugInfo(Child, FunctionStack, Update);
   }
 
   if (IsFunctionDef)
@@ -230,7 +434,7 @@ void RewriteInstance::updateUnitDebugInfo(
 }
 
 void RewriteInstance::updateDWARFObjectAddressRanges(
-    const DWARFDie DIE, uint64_t DebugRangesOffset) {
+    const DWARFDie DIE, uint64_t DebugRangesOffset, DebugInfoUpdate &Update) {
 
   // Some objects don't have an associated DIE and cannot be updated (such as
   // compiler-generated functions).
@@ -243,13 +447,6 @@ void RewriteInstance::updateDWARFObjectAddressRanges(
            << Twine::utohexstr(DIE.getOffset()) << '\n';
   }
 
-  auto DebugInfoPatcher =
-      static_cast<SimpleBinaryPatcher *>(SectionPatchers[".debug_info"].get());
-  auto AbbrevPatcher =
-      static_cast<DebugAbbrevPatcher*>(SectionPatchers[".debug_abbrev"].get());
-
-  assert(DebugInfoPatcher && AbbrevPatcher && "Patchers not initialized.");
-
   const auto *AbbreviationDecl = DIE.getAbbreviationDeclarationPtr();
   if (!AbbreviationDecl) {
     if (opts::Verbosity >= 1) {
@@ -268,7 +465,7 @@ void RewriteInstance::updateDWARFObjectAddressRanges(
     uint32_t AttrOffset = -1U;
     DIE.find(dwarf::DW_AT_ranges, &AttrOffset);
     assert(AttrOffset != -1U &&  "failed to locate DWARF attribute");
-    DebugInfoPatcher->addLE32Patch(AttrOffset, DebugRangesOffset);
+    Update.RangesRefs.emplace_back(AttrOffset, DebugRangesOffset);
   } else {
     // Case 2: The object has both DW_AT_low_pc and DW_AT_high_pc emitted back
     // to back. We replace the attributes with DW_AT_ranges and DW_AT_low_pc.
@@ -307,16 +504,16 @@ void RewriteInstance::updateDWARFObjectAddressRanges(
         return;
       }
 
-      AbbrevPatcher->addAttributePatch(DIE.getDwarfUnit(),
-                                       AbbrevCode,
-                                       dwarf::DW_AT_low_pc,
-                                       dwarf::DW_AT_ranges,
-                                       dwarf::DW_FORM_sec_offset);
-      AbbrevPatcher->addAttributePatch(DIE.getDwarfUnit(),
-                                       AbbrevCode,
-                                       dwarf::DW_AT_high_pc,
-                                       dwarf::DW_AT_low_pc,
-                                       dwarf::DW_FORM_udata);
+      Update.AbbrevPatcher.addAttributePatch(DIE.getDwarfUnit(),
+                                             AbbrevCode,
+                                             dwarf::DW_AT_low_pc,
+                                             dwarf::DW_AT_ranges,
+                                             dwarf::DW_FORM_sec_offset);
+      Update.AbbrevPatcher.addAttributePatch(DIE.getDwarfUnit(),
+                                             AbbrevCode,
+                                             dwarf::DW_AT_high_pc,
+                                             dwarf::DW_AT_low_pc,
+                                             dwarf::DW_FORM_udata);
       unsigned LowPCSize = 0;
       if (HighPCFormValue.getForm() == dwarf::DW_FORM_addr ||
           HighPCFormValue.getForm() == dwarf::DW_FORM_data8) {
@@ -326,8 +523,8 @@ void RewriteInstance::updateDWARFObjectAddressRanges(
       } else {
         llvm_unreachable("unexpected form");
       }
-      DebugInfoPatcher->addLE32Patch(LowPCOffset, DebugRangesOffset);
-      DebugInfoPatcher->addUDataPatch(LowPCOffset + 4, 0, LowPCSize);
+      Update.RangesRefs.emplace_back(LowPCOffset, DebugRangesOffset);
+      Update.InfoPatcher.addUDataPatch(LowPCOffset + 4, 0, LowPCSize);
     } else {
       if (opts::Verbosity >= 1) {
         errs() << "BOLT-WARNING: Cannot update ranges for DIE at offset 0x"
@@ -521,7 +718,7 @@ void RewriteInstance::updateGdbIndexSection() {
   Data += 24;
 
   // Map CUs offsets to indices and verify existing index table.
-  std::map<uint32_t, uint32_t> OffsetToIndexMap;
+  DenseMap<uint32_t, uint32_t> OffsetToIndexMap;
   const auto CUListSize = CUTypesOffset - CUListOffset;
   const auto NumCUs = BC->DwCtx->getNumCompileUnits();
   if (CUListSize != NumCUs * 16) {
@@ -544,12 +741,24 @@ void RewriteInstance::updateGdbIndexSection() {
   // Move Data to the beginning of symbol table.
   Data += SymbolTableOffset - CUTypesOffset;
 
-  // Calculate the size of the new address table.
-  uint32_t NewAddressTableSize = 0;
+  // The CU ranges were translated while updating the units. Collect them for
+  // the new address table ordered by address.
+  struct AddressTableEntry {
+    uint64_t LowPC;
+    uint64_t HighPC;
+    uint32_t CUIndex;
+  };
+  std::vector<AddressTableEntry> AddressTable;
   for (const auto &CURangesPair : RangesSectionsWriter->getCUAddressRanges()) {
-    const auto &Ranges = CURangesPair.second;
-    NewAddressTableSize += Ranges.size() * 20;
+    const auto CUIndex = OffsetToIndexMap[CURangesPair.first];
+    for (const auto &Range : CURangesPair.second)
+      AddressTable.push_back({Range.LowPC, Range.HighPC, CUIndex});
   }
+  std::stable_sort(AddressTable.begin(), AddressTable.end(),
+                   [](const AddressTableEntry &A, const AddressTableEntry &B) {
+                     return A.LowPC < B.LowPC;
+                   });
+  const uint32_t NewAddressTableSize = AddressTable.size() * 20;
 
   // Difference between old and new table (and section) sizes.
   // Could be negative.
@@ -575,15 +784,11 @@ void RewriteInstance::updateGdbIndexSection() {
   Buffer += AddressTableOffset - CUListOffset;
 
   // Generate new address table.
-  for (const auto &CURangesPair : RangesSectionsWriter->getCUAddressRanges()) {
-    const auto CUIndex = OffsetToIndexMap[CURangesPair.first];
-    const auto &Ranges = CURangesPair.second;
-    for (const auto &Range : Ranges) {
-      write64le(Buffer, Range.LowPC);
-      write64le(Buffer + 8, Range.HighPC);
-      write32le(Buffer + 16, CUIndex);
-      Buffer += 20;
-    }
+  for (const auto &Entry : AddressTable) {
+    write64le(Buffer, Entry.LowPC);
+    write64le(Buffer + 8, Entry.HighPC);
+    write32le(Buffer + 16, Entry.CUIndex);
+    Buffer += 20;
   }
 
   const auto TrailingSize =
@@ -15,15 +15,28 @@
 #include "BinaryContext.h"
 #include "BinaryFunction.h"
 #include "DataAggregator.h"
+#include "ParallelUtilities.h"
+#include "Passes/ReorderFunctions.h"
+#include "TextScanner.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Support/Compression.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Options.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/Process.h"
 #include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Regex.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 
+#include <cmath>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define DEBUG_TYPE "aggregator"
@@ -35,6 +48,10 @@ namespace opts {
 
 extern cl::OptionCategory AggregatorCategory;
 
+extern cl::opt<bool> AggregateOnly;
+extern cl::opt<bool> CloneFunctions;
+extern cl::opt<bolt::ReorderFunctions::ReorderType> ReorderFunctions;
+
 static cl::opt<bool>
 BasicAggregation("nl",
   cl::desc("aggregate basic samples (without LBR info)"),
@@ -42,12 +59,154 @@ BasicAggregation("nl",
   cl::ZeroOrMore,
   cl::cat(AggregatorCategory));
 
+static cl::opt<bool>
+BinaryFData("binary-fdata",
+  cl::desc("write aggregated profile in binary fdata format"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+CompressedFData("compressed-fdata",
+  cl::desc("write aggregated profile in binary fdata format, sorted by "
+           "function and compressed in blocks that are read separately"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+PruneMinCount("prune-min-count",
+  cl::desc("remove functions, and branches from instructions, with a total "
+           "count below the given value from the written profile"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<double>
+PruneRatio("prune-ratio",
+  cl::desc("remove branches from instructions with a total count below the "
+           "given fraction of the count of their function from the written "
+           "profile"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+CompressedFDataBlockRecords("compressed-fdata-block-records",
+  cl::desc("number of records in a block of compressed fdata"),
+  cl::init(fdata::CompressedFDataBlockRecords),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+AggregationTableSize("aggregation-table-size",
+  cl::desc("number of distinct branches and traces that threads aggregating "
+           "perf script output count in shared tables (the rest are counted "
+           "per chunk)"),
+  cl::init(1 << 18),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+Downsample("downsample",
+  cl::desc("aggregate only one of every N LBR samples and scale the counts "
+           "back up"),
+  cl::value_desc("N"),
+  cl::init(1),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+DownsampleAdaptive("downsample-adaptive",
+  cl::desc("stop reading LBR samples once shares of the hottest branches stop "
+           "changing, and scale the counts to the whole input (ignored with "
+           "-parallel-aggregation and -stream-perf-script)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<double>
+DownsampleTolerance("downsample-tolerance",
+  cl::desc("distance between distributions of the hottest branches below "
+           "which -downsample-adaptive considers them converged"),
+  cl::init(0.01),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<bool>
 IgnoreBuildID("ignore-build-id",
   cl::desc("continue even if build-ids in input binary and perf.data mismatch"),
   cl::init(false),
   cl::cat(AggregatorCategory));
 
+static cl::opt<bool>
+NativePerfReader("native-perf-reader",
+  cl::desc("read samples and task events straight from perf.data instead of "
+           "running perf script and parsing its output"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+ParallelAggregation("parallel-aggregation",
+  cl::desc("parse and aggregate perf script output on multiple threads"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+SelectedThreadWeight("selected-thread-weight",
+  cl::desc("keep LBR samples of threads not selected with -tid or "
+           "-thread-comm and count samples of selected threads N times "
+           "(0 - only aggregate samples of selected threads)"),
+  cl::value_desc("N"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+StreamPerfScript("stream-perf-script",
+  cl::desc("read branch events through a pipe while perf script is running "
+           "instead of waiting for it to finish (implies chunked "
+           "aggregation, ignored with -nl)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<std::string>
+ThreadComm("thread-comm",
+  cl::desc("select threads with a name matching the regular expression, "
+           "e.g. threads serving requests (see -selected-thread-weight)"),
+  cl::value_desc("regex"),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::list<int64_t>
+ThreadIDs("tid",
+  cl::CommaSeparated,
+  cl::desc("select threads with the given ids (see -selected-thread-weight)"),
+  cl::value_desc("tid1,tid2,tid3,..."),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+TemporalProfile("temporal-profile",
+  cl::desc("record in the profile the times of the first and the last sample "
+           "of every function and a histogram of its samples over time"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+TemporalBucketSize("temporal-bucket-size",
+  cl::desc("seconds per bucket of the histograms of -temporal-profile"),
+  cl::init(60),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<bool>
 TimeAggregator("time-aggr",
   cl::desc("time BOLT aggregator"),
@@ -55,6 +214,22 @@ TimeAggregator("time-aggr",
   cl::ZeroOrMore,
   cl::cat(AggregatorCategory));
 
+static cl::opt<std::string>
+WatchDir("watch-dir",
+  cl::desc("after aggregating the input profile keep running and add "
+           "perf.data files moved into <dir> to the aggregate, writing the "
+           "profile on SIGUSR1 and before exiting on SIGTERM"),
+  cl::value_desc("dir"),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+WatchInterval("watch-interval",
+  cl::desc("seconds between scans of the -watch-dir directory"),
+  cl::init(5),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
 }
 
 namespace {
@@ -62,6 +237,90 @@ namespace {
 const char TimerGroupName[] = "aggregator";
 const char TimerGroupDesc[] = "Aggregator";
 
+/// Set from signal handlers while watching for new perf data.
+volatile sig_atomic_t SnapshotRequested = 0;
+volatile sig_atomic_t StopRequested = 0;
+
+void onSnapshotSignal(int) { SnapshotRequested = 1; }
+void onStopSignal(int) { StopRequested = 1; }
+
+/// Number of aggregated LBR samples between convergence checks with
+/// -downsample-adaptive.
+const uint64_t ConvergenceCheckInterval = 1 << 16;
+
+/// Maximum depth of nested calls followed in an LBR sample for call contexts.
+const unsigned MaxCallContextDepth = 8;
+
+/// Return true if LBR sample number \p Index should be aggregated. Taking
+/// every N-th sample keeps the choice deterministic and spreads it evenly
+/// over the whole capture.
+bool isSampleSelected(uint64_t Index) {
+  return opts::Downsample <= 1 || Index % opts::Downsample == 0;
+}
+
+/// Return true if the times of samples are read, either to write them to the
+/// profile or to order functions by their first execution.
+bool needsSampleTime() {
+  return opts::TemporalProfile ||
+         (opts::ReorderFunctions == ReorderFunctions::RT_STARTUP &&
+          !opts::AggregateOnly);
+}
+
+/// Return the size of time buckets in nanoseconds.
+uint64_t getTemporalBucketSize() {
+  return std::max(1u, opts::TemporalBucketSize.getValue()) * 1000000000ULL;
+}
+
+/// Detects when shares of the hottest branches stop changing as more samples
+/// are aggregated.
+class BranchDistributionTracker {
+  /// Number of hottest branches compared between checks.
+  static constexpr size_t NumHotBranches = 256;
+
+  using KeyTy = std::pair<uint64_t, uint64_t>;
+
+  /// Shares of the hottest branches at the previous check.
+  DenseMap<KeyTy, double> LastShares;
+
+public:
+  /// Return true if the total variation distance between the distributions
+  /// of the hottest branches of \p Aggregate and of the aggregate seen by the
+  /// previous call is below -downsample-tolerance.
+  bool hasConverged(const LBRAggregate &Aggregate) {
+    std::vector<std::pair<uint64_t, KeyTy>> Hot;
+    Hot.reserve(Aggregate.Branches.size());
+    uint64_t Total{0};
+    for (const auto &BI : Aggregate.Branches) {
+      Hot.emplace_back(BI.second.Count, BI.first);
+      Total += BI.second.Count;
+    }
+    if (Hot.size() > NumHotBranches) {
+      std::nth_element(Hot.begin(), Hot.begin() + NumHotBranches, Hot.end(),
+                       std::greater<std::pair<uint64_t, KeyTy>>());
+      Hot.resize(NumHotBranches);
+    }
+
+    DenseMap<KeyTy, double> Shares;
+    double Distance{0.0};
+    for (const auto &HotBranch : Hot) {
+      const double Share = static_cast<double>(HotBranch.first) / Total;
+      Shares[HotBranch.second] = Share;
+      auto LastI = LastShares.find(HotBranch.second);
+      Distance += std::abs(Share -
+                           (LastI == LastShares.end() ? 0.0 : LastI->second));
+    }
+    for (const auto &LastShare : LastShares) {
+      if (!Shares.count(LastShare.first))
+        Distance += LastShare.second;
+    }
+
+    const bool Converged =
+      !LastShares.empty() && Distance / 2 < opts::DownsampleTolerance;
+    LastShares = std::move(Shares);
+    return Converged;
+  }
+};
+
 }
 
 void DataAggregator::findPerfExecutable() {
@@ -78,13 +337,46 @@ void DataAggregator::start(StringRef PerfDataFilename) {
   this->PerfDataFilename = PerfDataFilename;
   outs() << "PERF2BOLT: Starting data aggregation job for " << PerfDataFilename
          << "\n";
+  std::string RegexError;
+  if (!opts::ThreadComm.empty() &&
+      !Regex(opts::ThreadComm).isValid(RegexError)) {
+    errs() << "PERF2BOLT-ERROR: invalid -thread-comm expression: "
+           << RegexError << "\n";
+    exit(1);
+  }
+  for (auto TID : opts::ThreadIDs)
+    SelectedTIDs.insert(TID);
+  if (opts::NativePerfReader) {
+    auto ReaderOrErr = PerfDataReader::create(PerfDataFilename);
+    if (std::error_code EC = ReaderOrErr.getError()) {
+      errs() << "PERF2BOLT-ERROR: cannot read " << PerfDataFilename << ": "
+             << EC.message() << "\n";
+      exit(1);
+    }
+    PerfReader = std::move(*ReaderOrErr);
+    return;
+  }
   findPerfExecutable();
   launchPerfBranchEventsNoWait();
   launchPerfMemEventsNoWait();
   launchPerfTasksNoWait();
 }
 
+void DataAggregator::startBatch(StringRef PerfDataFilename,
+                                const PerfBatch &Batch, unsigned Index) {
+  Enabled = true;
+  this->PerfDataFilename = PerfDataFilename;
+  this->Batch = &Batch;
+  BatchIndex = Index;
+  if (hasThreadSelection())
+    errs() << "PERF2BOLT-WARNING: thread selection is ignored when "
+              "aggregating profiles of several binaries\n";
+}
+
 void DataAggregator::abort() {
+  if (PerfReader || Batch)
+    return;
+
   std::string Error;
 
   // Kill subprocesses in case they are not finished
@@ -106,10 +398,15 @@ bool DataAggregator::launchPerfBranchEventsNoWait() {
   Argv.push_back(PerfPath.data());
   Argv.push_back("script");
   Argv.push_back("-F");
+  const bool Time = needsSampleTime();
   if (opts::BasicAggregation)
-    Argv.push_back("pid,event,ip");
+    Argv.push_back(hasThreadSelection()
+                     ? (Time ? "pid,tid,time,event,ip" : "pid,tid,event,ip")
+                     : (Time ? "pid,time,event,ip" : "pid,event,ip"));
   else
-    Argv.push_back("pid,brstack");
+    Argv.push_back(hasThreadSelection()
+                     ? (Time ? "pid,tid,time,brstack" : "pid,tid,brstack")
+                     : (Time ? "pid,time,brstack" : "pid,brstack"));
   Argv.push_back("-i");
   Argv.push_back(PerfDataFilename.data());
   Argv.push_back(nullptr);
@@ -129,6 +426,23 @@ bool DataAggregator::launchPerfBranchEventsNoWait() {
            << "\n";
     exit(1);
   }
+
+  if (opts::StreamPerfScript && !opts::BasicAggregation) {
+    // Replace the output file with a named pipe and open its read end before
+    // perf does, so that opening the write end in the child does not block.
+    // The pipe is switched back to blocking mode once perf is launched.
+    deleteTempFile(PerfBranchEventsOutputPath.data());
+    if (::mkfifo(PerfBranchEventsOutputPath.data(), 0600) == -1 ||
+        (BranchEventsFD = ::open(PerfBranchEventsOutputPath.data(),
+                                 O_RDONLY | O_NONBLOCK)) == -1) {
+      outs() << "PERF2BOLT: Failed to create named pipe "
+             << PerfBranchEventsOutputPath << " with error "
+             << std::error_code(errno, std::generic_category()).message()
+             << "\n";
+      exit(1);
+    }
+  }
+
   Optional<StringRef> Redirects[] = {
       llvm::None,                                   // Stdin
       StringRef(PerfBranchEventsOutputPath.data()), // Stdout
@@ -141,6 +455,10 @@ bool DataAggregator::launchPerfBranchEventsNoWait() {
   BranchEventsPI = sys::ExecuteNoWait(PerfPath.data(), Argv.data(),
                                       /*envp*/ nullptr, Redirects);
 
+  if (BranchEventsFD != -1)
+    ::fcntl(BranchEventsFD, F_SETFL,
+            ::fcntl(BranchEventsFD, F_GETFL) & ~O_NONBLOCK);
+
   return true;
 }
 
@@ -151,7 +469,8 @@ bool DataAggregator::launchPerfMemEventsNoWait() {
   Argv.push_back(PerfPath.data());
   Argv.push_back("script");
   Argv.push_back("-F");
-  Argv.push_back("pid,event,addr,ip");
+  Argv.push_back(hasThreadSelection() ? "pid,tid,event,addr,ip"
+                                      : "pid,event,addr,ip");
   Argv.push_back("-i");
   Argv.push_back(PerfDataFilename.data());
   Argv.push_back(nullptr);
@@ -226,6 +545,26 @@ bool DataAggregator::launchPerfTasksNoWait() {
 }
 
 void DataAggregator::processFileBuildID(StringRef FileBuildID) {
+  BinaryBuildID = FileBuildID;
+  const auto *Reader = Batch ? Batch->Reader.get() : PerfReader.get();
+  if (Reader) {
+    const auto &BuildIDs = Reader->getBuildIDs();
+    if (BuildIDs.empty()) {
+      errs() << "PERF2BOLT-WARNING: build-id will not be checked because perf "
+                "data was recorded without it\n";
+      return;
+    }
+    Optional<StringRef> FileName;
+    for (const auto &NameBuildID : BuildIDs) {
+      if (NameBuildID.second == FileBuildID) {
+        FileName = sys::path::filename(NameBuildID.first);
+        break;
+      }
+    }
+    checkFileNameForBuildID(FileName);
+    return;
+  }
+
   SmallVector<const char *, 4> Argv;
   SmallVector<char, 256> OutputPath;
   SmallVector<char, 256> ErrPath;
@@ -297,14 +636,18 @@ void DataAggregator::processFileBuildID(StringRef FileBuildID) {
   Col = 0;
   Line = 1;
   auto FileName = getFileNameForBuildID(FileBuildID);
+  deleteTempFile(ErrPath.data());
+  deleteTempFile(OutputPath.data());
+  checkFileNameForBuildID(FileName);
+}
+
+void DataAggregator::checkFileNameForBuildID(Optional<StringRef> FileName) {
   if (!FileName) {
     errs() << "PERF2BOLT-ERROR: failed to match build-id from perf output. "
               "This indicates the input binary supplied for data aggregation "
               "is not the same recorded by perf when collecting profiling "
               "data. Use -ignore-build-id option to override.\n";
     if (!opts::IgnoreBuildID) {
-      deleteTempFile(ErrPath.data());
-      deleteTempFile(OutputPath.data());
       abort();
       exit(1);
     }
@@ -315,10 +658,6 @@ void DataAggregator::processFileBuildID(StringRef FileBuildID) {
   } else {
     outs() << "PERF2BOLT: matched build-id and file name\n";
   }
-
-  deleteTempFile(ErrPath.data());
-  deleteTempFile(OutputPath.data());
-  return;
 }
 
 bool DataAggregator::checkPerfDataMagic(StringRef FileName) {
@@ -362,6 +701,46 @@ bool DataAggregator::aggregate(BinaryContext &BC,
 
   this->BC = &BC;
   this->BFs = &BFs;
+  if (opts::TemporalProfile)
+    TemporalBucketSize = getTemporalBucketSize();
+
+  if (auto Section =
+        BC.getUniqueSectionByName(BoltAddressTranslation::SectionName)) {
+    BAT = llvm::make_unique<BoltAddressTranslation>();
+    if (auto EC = BAT->parse(Section->getContents())) {
+      errs() << "PERF2BOLT-WARNING: cannot read address translation table: "
+             << EC.message() << '\n';
+      BAT.reset();
+    } else {
+      outs() << "PERF2BOLT: using address translation table of the binary "
+                "to attribute samples to its input\n";
+    }
+  }
+
+  // Calls into functions are recognized by their start addresses. Samples
+  // of a binary rewritten by BOLT are not in the address space of its input.
+  if (opts::CloneFunctions && !opts::AggregateOnly && !BAT) {
+    FunctionRanges.reserve(BFs.size());
+    for (const auto &BFI : BFs) {
+      const auto &Function = BFI.second;
+      if (Function.getSize())
+        FunctionRanges.emplace_back(Function.getAddress(),
+                                    Function.getAddress() + Function.getSize());
+    }
+  }
+
+  if (Batch) {
+    processBatchSamples();
+    return true;
+  }
+
+  if (PerfReader) {
+    if (std::error_code EC = parsePerfData()) {
+      outs() << "PERF2BOLT: Failed to read " << PerfDataFilename << ": "
+             << EC.message() << "\n";
+    }
+    return true;
+  }
 
   outs() << "PERF2BOLT: Waiting for perf tasks collection to finish...\n";
   auto PI1 = sys::Wait(TasksPI, 0, true, &Error);
@@ -400,55 +779,66 @@ bool DataAggregator::aggregate(BinaryContext &BC,
     outs() << "PERF2BOLT: Failed to parse tasks\n";
   }
 
-  outs()
-      << "PERF2BOLT: Waiting for perf events collection to finish...\n";
-  auto PI2 = sys::Wait(BranchEventsPI, 0, true, &Error);
+  auto waitForBranchEvents = [&]() {
+    auto PI2 = sys::Wait(BranchEventsPI, 0, true, &Error);
 
-  if (!Error.empty()) {
-    errs() << "PERF-ERROR: " << Error << "\n";
-    deleteTempFiles();
-    exit(1);
-  }
+    if (!Error.empty()) {
+      errs() << "PERF-ERROR: " << Error << "\n";
+      deleteTempFiles();
+      exit(1);
+    }
 
-  if (PI2.ReturnCode != 0) {
-    ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
-      MemoryBuffer::getFileOrSTDIN(PerfBranchEventsErrPath.data());
-    StringRef ErrBuf = (*MB)->getBuffer();
+    if (PI2.ReturnCode != 0) {
+      ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+        MemoryBuffer::getFileOrSTDIN(PerfBranchEventsErrPath.data());
+      StringRef ErrBuf = (*MB)->getBuffer();
 
-    errs() << "PERF-ERROR: Return code " << PI2.ReturnCode << "\n";
-    errs() << ErrBuf;
-    deleteTempFiles();
-    exit(1);
-  }
-
-  ErrorOr<std::unique_ptr<MemoryBuffer>> MB2 =
-    MemoryBuffer::getFileOrSTDIN(PerfBranchEventsOutputPath.data());
-  if (std::error_code EC = MB2.getError()) {
-    errs() << "Cannot open " << PerfBranchEventsOutputPath.data() << ": "
-           << EC.message() << "\n";
-    deleteTempFiles();
-    exit(1);
-  }
+      errs() << "PERF-ERROR: Return code " << PI2.ReturnCode << "\n";
+      errs() << ErrBuf;
+      deleteTempFiles();
+      exit(1);
+    }
+  };
 
-  FileBuf.reset(MB2->release());
-  ParsingBuf = FileBuf->getBuffer();
-  Col = 0;
-  Line = 1;
-  if ((!opts::BasicAggregation && parseBranchEvents()) ||
-      (opts::BasicAggregation && parseBasicEvents())) {
-    outs() << "PERF2BOLT: Failed to parse samples\n";
-  }
+  NoLBRMode = opts::BasicAggregation;
+  if (BranchEventsFD != -1) {
+    // Samples are parsed while perf is still producing them.
+    outs() << "PERF2BOLT: Reading perf events while they are collected...\n";
+    ParsingBuf = StringRef();
+    Col = 0;
+    Line = 1;
+    auto EC = parseBranchEvents(BranchEventsFD);
+    ::close(BranchEventsFD);
+    BranchEventsFD = -1;
+    waitForBranchEvents();
+    if (EC)
+      outs() << "PERF2BOLT: Failed to parse samples\n";
+  } else {
+    outs()
+        << "PERF2BOLT: Waiting for perf events collection to finish...\n";
+    waitForBranchEvents();
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> MB2 =
+      MemoryBuffer::getFileOrSTDIN(PerfBranchEventsOutputPath.data());
+    if (std::error_code EC = MB2.getError()) {
+      errs() << "Cannot open " << PerfBranchEventsOutputPath.data() << ": "
+             << EC.message() << "\n";
+      deleteTempFiles();
+      exit(1);
+    }
 
-  // Mark all functions with registered events as having a valid profile.
-  for (auto &BFI : BFs) {
-    auto &BF = BFI.second;
-    if (BF.getBranchData()) {
-      const auto Flags = opts::BasicAggregation ? BinaryFunction::PF_SAMPLE
-                                                : BinaryFunction::PF_LBR;
-      BF.markProfiled(Flags);
+    FileBuf.reset(MB2->release());
+    ParsingBuf = FileBuf->getBuffer();
+    Col = 0;
+    Line = 1;
+    if ((!opts::BasicAggregation && parseBranchEvents()) ||
+        (opts::BasicAggregation && parseBasicEvents())) {
+      outs() << "PERF2BOLT: Failed to parse samples\n";
     }
   }
 
+  markProfiledFunctions();
+
   auto PI3 = sys::Wait(MemEventsPI, 0, true, &Error);
   if (PI3.ReturnCode != 0) {
     ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
@@ -490,8 +880,390 @@ bool DataAggregator::aggregate(BinaryContext &BC,
   return true;
 }
 
+void DataAggregator::markProfiledFunctions() {
+  // Mark all functions with registered events as having a valid profile.
+  for (auto &BFI : *BFs) {
+    auto &BF = BFI.second;
+    if (BF.getBranchData()) {
+      const auto Flags = opts::BasicAggregation ? BinaryFunction::PF_SAMPLE
+                                                : BinaryFunction::PF_LBR;
+      BF.markProfiled(Flags);
+    }
+  }
+}
+
+std::error_code DataAggregator::parsePerfData() {
+  NoLBRMode = opts::BasicAggregation;
+
+  {
+    outs() << "PERF2BOLT: Reading tasks from " << PerfDataFilename << "\n";
+    NamedRegionTimer T("parseTasks", "Tasks parsing", TimerGroupName,
+                       TimerGroupDesc, opts::TimeAggregator);
+    auto EC = PerfReader->forEachTaskEvent(
+        [&](int64_t PID, int64_t TID, StringRef Comm) {
+          if (Comm == StringRef(BinaryName).substr(0, 15))
+            PIDs.insert(PID);
+          selectThreadByComm(TID, Comm);
+        },
+        [&](const PerfDataReader::MMapEvent &Event) {
+          if (sys::path::filename(Event.FileName) == BinaryName)
+            PIDs.insert(Event.PID);
+        });
+    if (EC)
+      return EC;
+    reportPIDs();
+    reportThreads();
+  }
+
+  auto isBinarySample = [&](const PerfDataReader::Sample &S) {
+    return (PIDs.empty() || PIDs.count(S.PID)) && getThreadWeight(S.TID);
+  };
+
+  if (opts::BasicAggregation) {
+    outs() << "PERF2BOLT: Aggregating basic events (without LBR)...\n";
+    NamedRegionTimer T("parseBasic", "Perf samples parsing", TimerGroupName,
+                       TimerGroupDesc, opts::TimeAggregator);
+    uint64_t NumSamples{0};
+    uint64_t OutOfRangeSamples{0};
+    auto EC = PerfReader->forEachSample([&](const PerfDataReader::Sample &S) {
+      if (!isBinarySample(S) || !S.IP)
+        return;
+      ++NumSamples;
+      const auto Time = needsSampleTime() ? S.Time : 0;
+      if (!processBasicSample(PerfBasicSample{S.EventName, S.IP, Time}))
+        ++OutOfRangeSamples;
+    });
+    if (EC)
+      return EC;
+    printBasicStats(NumSamples, OutOfRangeSamples);
+  } else {
+    outs() << "PERF2BOLT: Aggregating branch events...\n";
+    NamedRegionTimer T("parseBranch", "Branch samples parsing", TimerGroupName,
+                       TimerGroupDesc, opts::TimeAggregator);
+    LBRAggregate Aggregate;
+    if (!FunctionRanges.empty())
+      Aggregate.FunctionRanges = &FunctionRanges;
+    BranchDistributionTracker Tracker;
+    PerfBranchSample Sample;
+    uint64_t Index{0};
+    bool Converged{false};
+    auto EC = PerfReader->forEachSample([&](const PerfDataReader::Sample &S) {
+      if (!isBinarySample(S) || S.Branches.empty())
+        return;
+      // Skipped samples are still counted to scale the aggregate.
+      if (!isSampleSelected(Index++) || Converged)
+        return;
+      Sample.LBR.clear();
+      for (const auto &Entry : S.Branches)
+        Sample.LBR.push_back({Entry.From, Entry.To, Entry.isMispredicted(),
+                              Entry.getCycles()});
+      Sample.Weight = getThreadWeight(S.TID);
+      Sample.Time = needsSampleTime() ? S.Time : 0;
+      Aggregate.addSample(Sample);
+      if (opts::DownsampleAdaptive &&
+          Aggregate.NumSamples % ConvergenceCheckInterval == 0 &&
+          Tracker.hasConverged(Aggregate)) {
+        outs() << "PERF2BOLT: Branch distribution converged after "
+               << Aggregate.NumSamples << " samples, skipping the rest\n";
+        Converged = true;
+      }
+    });
+    if (EC)
+      return EC;
+    const double Scale = Aggregate.NumSamples
+      ? static_cast<double>(Index) / Aggregate.NumSamples
+      : 1.0;
+    Aggregate.scale(Scale);
+    processLBRAggregate(Aggregate);
+    printBranchStats(Aggregate.NumSamples, Aggregate.NumEntries,
+                     Aggregate.NumTraces);
+    printDownsamplingStats(Scale);
+  }
+
+  markProfiledFunctions();
+
+  outs() << "PERF2BOLT: Aggregating memory events...\n";
+  NamedRegionTimer T("memevents", "Mem samples parsing", TimerGroupName,
+                     TimerGroupDesc, opts::TimeAggregator);
+  return PerfReader->forEachSample([&](const PerfDataReader::Sample &S) {
+    if (!isBinarySample(S) || S.EventName.find("mem-loads") == StringRef::npos)
+      return;
+    processMemSample(PerfMemSample{S.IP, S.Addr});
+  });
+}
+
+void DataAggregator::processBatchSamples() {
+  const auto &Samples = Batch->Binaries[BatchIndex];
+  if (opts::BasicAggregation) {
+    outs() << "PERF2BOLT: Aggregating basic events (without LBR)...\n";
+    uint64_t OutOfRangeSamples{0};
+    for (const auto &Sample : Samples.BasicSamples) {
+      if (!processBasicSample(Sample))
+        ++OutOfRangeSamples;
+    }
+    printBasicStats(Samples.BasicSamples.size(), OutOfRangeSamples);
+  } else {
+    outs() << "PERF2BOLT: Aggregating branch events...\n";
+    processLBRAggregate(Samples.Branches);
+    printBranchStats(Samples.Branches.NumSamples, Samples.Branches.NumEntries,
+                     Samples.Branches.NumTraces);
+  }
+
+  markProfiledFunctions();
+
+  outs() << "PERF2BOLT: Aggregating memory events...\n";
+  for (const auto &Sample : Samples.MemSamples)
+    processMemSample(Sample);
+}
+
+ErrorOr<std::unique_ptr<PerfBatch>>
+PerfBatch::create(StringRef PerfDataFilename,
+                  ArrayRef<std::string> BinaryFilenames) {
+  auto ReaderOrErr = PerfDataReader::create(PerfDataFilename);
+  if (std::error_code EC = ReaderOrErr.getError())
+    return EC;
+  auto Batch = llvm::make_unique<PerfBatch>();
+  Batch->Reader = std::move(*ReaderOrErr);
+  Batch->Binaries.resize(BinaryFilenames.size());
+
+  // Loadable segments of the binaries map file offsets of the mappings to
+  // virtual addresses.
+  struct Segment {
+    uint64_t Offset;
+    uint64_t FileSize;
+    uint64_t VAddr;
+  };
+  std::vector<std::vector<Segment>> Segments(BinaryFilenames.size());
+  std::vector<std::pair<uint64_t, uint64_t>> ImageRanges;
+  StringMap<unsigned> BinaryIndex;
+  for (unsigned I = 0; I < BinaryFilenames.size(); ++I) {
+    auto BinaryOrErr = object::createBinary(BinaryFilenames[I]);
+    if (auto E = BinaryOrErr.takeError())
+      return errorToErrorCode(std::move(E));
+    auto *ELFObj =
+      dyn_cast<object::ELF64LEObjectFile>(BinaryOrErr->getBinary());
+    if (!ELFObj)
+      return object::object_error::invalid_file_type;
+    uint64_t ImageStart = std::numeric_limits<uint64_t>::max();
+    uint64_t ImageEnd = 0;
+    for (const auto &Phdr :
+         cantFail(ELFObj->getELFFile()->program_headers())) {
+      if (Phdr.p_type != ELF::PT_LOAD)
+        continue;
+      Segments[I].push_back({Phdr.p_offset, Phdr.p_filesz, Phdr.p_vaddr});
+      ImageStart = std::min<uint64_t>(ImageStart, Phdr.p_vaddr);
+      ImageEnd = std::max<uint64_t>(ImageEnd, Phdr.p_vaddr + Phdr.p_memsz);
+    }
+    ImageRanges.emplace_back(ImageStart, ImageEnd);
+    BinaryIndex[sys::path::filename(BinaryFilenames[I])] = I;
+  }
+
+  // Executable mappings of the binaries in each process. An address A in
+  // a mapping is at the virtual address A - Bias of the binary. Mappings are
+  // not ordered by time, so a process that replaced one of the binaries at
+  // the same address while it was recorded cannot be told apart.
+  struct Mapping {
+    uint64_t Start;
+    uint64_t End;
+    uint64_t Bias;
+    unsigned Binary;
+  };
+  DenseMap<int64_t, std::vector<Mapping>> Mappings;
+  auto EC = Batch->Reader->forEachTaskEvent(
+      [](int64_t, int64_t, StringRef) {},
+      [&](const PerfDataReader::MMapEvent &Event) {
+        auto Itr = BinaryIndex.find(sys::path::filename(Event.FileName));
+        if (Itr == BinaryIndex.end())
+          return;
+        for (const auto &Seg : Segments[Itr->second]) {
+          if (Event.PgOff < Seg.Offset ||
+              Event.PgOff >= Seg.Offset + Seg.FileSize)
+            continue;
+          Mappings[Event.PID].push_back(
+              {Event.Start, Event.Start + Event.Len,
+               Event.Start - Event.PgOff + Seg.Offset - Seg.VAddr,
+               Itr->second});
+          break;
+        }
+      });
+  if (EC)
+    return EC;
+
+  auto findMapping = [](const std::vector<Mapping> &Maps,
+                        uint64_t Address) -> const Mapping * {
+    for (const auto &M : Maps) {
+      if (Address >= M.Start && Address < M.End)
+        return &M;
+    }
+    return nullptr;
+  };
+
+  // A branch stack goes to every binary it has an entry in. The addresses
+  // outside of the binary become 0, an unknown location, and keep their
+  // place so that the traces between the entries are preserved.
+  PerfBranchSample Sample;
+  SmallVector<std::pair<const Mapping *, const Mapping *>, 32> EntryMaps;
+  SmallVector<unsigned, 4> Touched;
+  EC = Batch->Reader->forEachSample([&](const PerfDataReader::Sample &S) {
+    auto Itr = Mappings.find(S.PID);
+    if (Itr == Mappings.end())
+      return;
+    const auto &Maps = Itr->second;
+
+    if (const auto *M = S.IP ? findMapping(Maps, S.IP) : nullptr) {
+      auto &Samples = Batch->Binaries[M->Binary];
+      if (opts::BasicAggregation)
+        Samples.BasicSamples.push_back({S.EventName, S.IP - M->Bias});
+      if (S.EventName.find("mem-loads") != StringRef::npos) {
+        // Data addresses are only converted if they fall into the image.
+        const auto &Image = ImageRanges[M->Binary];
+        auto Addr = S.Addr - M->Bias;
+        if (Addr < Image.first || Addr >= Image.second)
+          Addr = S.Addr;
+        Samples.MemSamples.push_back({S.IP - M->Bias, Addr});
+      }
+    }
+
+    if (opts::BasicAggregation || S.Branches.empty())
+      return;
+
+    EntryMaps.clear();
+    Touched.clear();
+    for (const auto &Entry : S.Branches) {
+      const auto *From = findMapping(Maps, Entry.From);
+      const auto *To = findMapping(Maps, Entry.To);
+      EntryMaps.emplace_back(From, To);
+      for (const auto *M : {From, To}) {
+        if (M && !is_contained(Touched, M->Binary))
+          Touched.push_back(M->Binary);
+      }
+    }
+    for (auto Binary : Touched) {
+      auto translate = [&](const Mapping *M, uint64_t Address) -> uint64_t {
+        return M && M->Binary == Binary ? Address - M->Bias : 0;
+      };
+      Sample.LBR.clear();
+      for (unsigned I = 0; I < S.Branches.size(); ++I) {
+        const auto &Entry = S.Branches[I];
+        Sample.LBR.push_back({translate(EntryMaps[I].first, Entry.From),
+                              translate(EntryMaps[I].second, Entry.To),
+                              Entry.isMispredicted(), Entry.getCycles()});
+      }
+      Batch->Binaries[Binary].Branches.addSample(Sample);
+    }
+  });
+  if (EC)
+    return EC;
+
+  return std::move(Batch);
+}
+
+std::error_code DataAggregator::aggregatePerfDataFile(StringRef FileName) {
+  auto ReaderOrErr = PerfDataReader::create(FileName);
+  if (std::error_code EC = ReaderOrErr.getError())
+    return EC;
+  auto Reader = std::move(*ReaderOrErr);
+
+  // Chunks may come from hosts running other builds of the binary. Skip
+  // those instead of attributing their samples to the wrong code.
+  const auto &BuildIDs = Reader->getBuildIDs();
+  if (!BinaryBuildID.empty() && !BuildIDs.empty() &&
+      std::none_of(BuildIDs.begin(), BuildIDs.end(),
+                   [&](const std::pair<StringRef, std::string> &NameBuildID) {
+                     return NameBuildID.second == BinaryBuildID;
+                   })) {
+    errs() << "PERF2BOLT-WARNING: skipping " << FileName
+           << " as it has no samples for build-id " << BinaryBuildID << "\n";
+    return std::error_code();
+  }
+
+  // Process ids are only meaningful within a single recording.
+  PIDs.clear();
+  std::swap(PerfReader, Reader);
+  const auto SavedFilename = PerfDataFilename;
+  PerfDataFilename = FileName;
+  auto EC = parsePerfData();
+  PerfDataFilename = SavedFilename;
+  std::swap(PerfReader, Reader);
+  return EC;
+}
+
+std::error_code DataAggregator::writeSnapshot() const {
+  // Write to a temporary file first so that consumers of the profile never
+  // see it partially written.
+  const auto TempName = OutputFDataName.str() + ".tmp";
+  if (std::error_code EC = writeAggregatedFile(TempName))
+    return EC;
+  return sys::fs::rename(TempName, OutputFDataName);
+}
+
+void DataAggregator::watchForPerfData() {
+  if (opts::WatchDir.empty())
+    return;
+
+  ::signal(SIGUSR1, onSnapshotSignal);
+  ::signal(SIGTERM, onStopSignal);
+
+  outs() << "PERF2BOLT: Watching " << opts::WatchDir
+         << " for perf.data files (pid " << ::getpid() << ")\n";
+
+  while (!StopRequested) {
+    std::vector<std::string> FileNames;
+    std::error_code EC;
+    for (sys::fs::directory_iterator I(opts::WatchDir, EC), E;
+         I != E && !EC; I.increment(EC)) {
+      if (StringRef(I->path()).endswith(".data"))
+        FileNames.push_back(I->path());
+    }
+    if (EC) {
+      errs() << "PERF2BOLT-ERROR: cannot read directory " << opts::WatchDir
+             << ": " << EC.message() << "\n";
+      break;
+    }
+
+    // Process chunks in name order, so that collectors naming them with
+    // timestamps get them aggregated in the order they were recorded.
+    std::sort(FileNames.begin(), FileNames.end());
+    for (const auto &FileName : FileNames) {
+      if (StopRequested)
+        break;
+      if (std::error_code EC = aggregatePerfDataFile(FileName)) {
+        errs() << "PERF2BOLT-WARNING: failed to read " << FileName << ": "
+               << EC.message() << "\n";
+      }
+      // Keep the processed file around but make sure it is not read again.
+      if (std::error_code EC = sys::fs::rename(FileName, FileName + ".done")) {
+        errs() << "PERF2BOLT-ERROR: cannot rename " << FileName << ": "
+               << EC.message() << "\n";
+        StopRequested = 1;
+      }
+    }
+
+    if (SnapshotRequested) {
+      SnapshotRequested = 0;
+      if (std::error_code EC = writeSnapshot()) {
+        errs() << "PERF2BOLT-ERROR: cannot write " << OutputFDataName << ": "
+               << EC.message() << "\n";
+      }
+    }
+
+    if (FileNames.empty() && !StopRequested)
+      ::sleep(opts::WatchInterval);
+  }
+
+  if (std::error_code EC = writeSnapshot()) {
+    errs() << "PERF2BOLT-ERROR: cannot write " << OutputFDataName << ": "
+           << EC.message() << "\n";
+  }
+}
+
 BinaryFunction *
 DataAggregator::getBinaryFunctionContainingAddress(uint64_t Address) {
+  if (BC->hasFunctionIndex())
+    return BC->getBinaryFunctionContainingAddress(Address,
+                                                  /*CheckPastEnd=*/false,
+                                                  /*UseMaxSize=*/true);
+
   auto FI = BFs->upper_bound(Address);
   if (FI == BFs->begin())
     return nullptr;
@@ -503,6 +1275,26 @@ DataAggregator::getBinaryFunctionContainingAddress(uint64_t Address) {
   return &FI->second;
 }
 
+BinaryFunction *
+DataAggregator::getInputFunctionContainingAddress(uint64_t &Address,
+                                                  bool IsBranchSrc) {
+  if (!BAT)
+    return getBinaryFunctionContainingAddress(Address);
+
+  // Code without an entry in the table was not moved by BOLT.
+  uint64_t HotAddress;
+  const auto Offset = BAT->translate(Address, IsBranchSrc, HotAddress);
+  if (!Offset)
+    return getBinaryFunctionContainingAddress(Address);
+
+  // Cold fragments are attributed to their parent function.
+  auto *Func = getBinaryFunctionContainingAddress(HotAddress);
+  if (!Func)
+    return nullptr;
+  Address = Func->getAddress() + *Offset;
+  return Func;
+}
+
 bool
 DataAggregator::doSample(BinaryFunction &Func, uint64_t Address) {
   auto I = FuncsToSamples.find(Func.getNames()[0]);
@@ -517,8 +1309,9 @@ DataAggregator::doSample(BinaryFunction &Func, uint64_t Address) {
   return true;
 }
 
-bool
-DataAggregator::doIntraBranch(BinaryFunction &Func, const LBREntry &Branch) {
+bool DataAggregator::doIntraBranch(BinaryFunction &Func, uint64_t From,
+                                   uint64_t To, uint64_t Count,
+                                   uint64_t Mispreds, uint64_t Cycles) {
   FuncBranchData *AggrData = Func.getBranchData();
   if (!AggrData) {
     AggrData = &FuncsToBranches[Func.getNames()[0]];
@@ -526,21 +1319,19 @@ DataAggregator::doIntraBranch(BinaryFunction &Func, const LBREntry &Branch) {
     Func.setBranchData(AggrData);
   }
 
-  AggrData->bumpBranchCount(Branch.From - Func.getAddress(),
-                            Branch.To - Func.getAddress(),
-                            Branch.Mispred);
+  AggrData->bumpBranchCount(From - Func.getAddress(), To - Func.getAddress(),
+                            Count, Mispreds, Cycles);
   return true;
 }
 
 bool DataAggregator::doInterBranch(BinaryFunction *FromFunc,
-                                   BinaryFunction *ToFunc,
-                                   const LBREntry &Branch) {
+                                   BinaryFunction *ToFunc, uint64_t From,
+                                   uint64_t To, uint64_t Count,
+                                   uint64_t Mispreds) {
   FuncBranchData *FromAggrData{nullptr};
   FuncBranchData *ToAggrData{nullptr};
   StringRef SrcFunc;
   StringRef DstFunc;
-  auto From = Branch.From;
-  auto To = Branch.To;
   if (FromFunc) {
     SrcFunc = FromFunc->getNames()[0];
     FromAggrData = FromFunc->getBranchData();
@@ -551,7 +1342,7 @@ bool DataAggregator::doInterBranch(BinaryFunction *FromFunc,
     }
     From -= FromFunc->getAddress();
 
-    FromFunc->recordExit(From, Branch.Mispred);
+    FromFunc->recordExit(From, Mispreds, Count);
   }
   if (ToFunc) {
     DstFunc = ToFunc->getNames()[0];
@@ -563,64 +1354,78 @@ bool DataAggregator::doInterBranch(BinaryFunction *FromFunc,
     }
     To -= ToFunc->getAddress();
 
-    ToFunc->recordEntry(To, Branch.Mispred);
+    ToFunc->recordEntry(To, Mispreds, Count);
   }
 
   if (FromAggrData)
     FromAggrData->bumpCallCount(From, Location(!DstFunc.empty(), DstFunc, To),
-                                Branch.Mispred);
+                                Count, Mispreds);
   if (ToAggrData)
     ToAggrData->bumpEntryCount(Location(!SrcFunc.empty(), SrcFunc, From), To,
-                               Branch.Mispred);
+                               Count, Mispreds);
   return true;
 }
 
-bool DataAggregator::doBranch(const LBREntry &Branch) {
-  auto *FromFunc = getBinaryFunctionContainingAddress(Branch.From);
-  auto *ToFunc = getBinaryFunctionContainingAddress(Branch.To);
+bool DataAggregator::doBranch(uint64_t From, uint64_t To, uint64_t Count,
+                              uint64_t Mispreds, uint64_t Cycles) {
+  auto *FromFunc = getInputFunctionContainingAddress(From,
+                                                     /*IsBranchSrc=*/true);
+  auto *ToFunc = getInputFunctionContainingAddress(To, /*IsBranchSrc=*/false);
   if (!FromFunc && !ToFunc)
     return false;
 
   if (FromFunc == ToFunc) {
-    FromFunc->recordBranch(Branch.From - FromFunc->getAddress(),
-                           Branch.To - FromFunc->getAddress(),
-                           1,
-                           Branch.Mispred);
-    return doIntraBranch(*FromFunc, Branch);
+    // With address translation the offsets are not in the CFG of this binary.
+    if (!BAT) {
+      FromFunc->recordBranch(From - FromFunc->getAddress(),
+                             To - FromFunc->getAddress(),
+                             Count,
+                             Mispreds,
+                             Cycles);
+    }
+    return doIntraBranch(*FromFunc, From, To, Count, Mispreds, Cycles);
   }
 
-  return doInterBranch(FromFunc, ToFunc, Branch);
+  return doInterBranch(FromFunc, ToFunc, From, To, Count, Mispreds);
 }
 
-bool DataAggregator::doTrace(const LBREntry &First, const LBREntry &Second) {
-  auto *FromFunc = getBinaryFunctionContainingAddress(First.To);
-  auto *ToFunc = getBinaryFunctionContainingAddress(Second.From);
+bool DataAggregator::doTrace(const LBREntry &First, const LBREntry &Second,
+                             uint64_t Count) {
+  auto From = First.To;
+  auto To = Second.From;
+  auto *FromFunc = getInputFunctionContainingAddress(From,
+                                                     /*IsBranchSrc=*/false);
+  auto *ToFunc = getInputFunctionContainingAddress(To, /*IsBranchSrc=*/true);
   if (!FromFunc || !ToFunc) {
-    ++NumLongRangeTraces;
+    NumLongRangeTraces += Count;
     return false;
   }
   if (FromFunc != ToFunc) {
-    ++NumInvalidTraces;
+    NumInvalidTraces += Count;
     DEBUG(dbgs() << "Trace starting in " << FromFunc->getPrintName() << " @ "
-                 << Twine::utohexstr(First.To - FromFunc->getAddress())
+                 << Twine::utohexstr(From - FromFunc->getAddress())
                  << " and ending in " << ToFunc->getPrintName() << " @ "
                  << ToFunc->getPrintName() << " @ "
-                 << Twine::utohexstr(Second.From - ToFunc->getAddress())
+                 << Twine::utohexstr(To - ToFunc->getAddress())
                  << '\n');
     return false;
   }
 
-  auto FTs = FromFunc->getFallthroughsInTrace(First, Second);
+  // Traces in code moved by BOLT are followed in the address translation
+  // table, as the CFG of this binary does not match the input offsets.
+  Optional<SmallVector<std::pair<uint64_t, uint64_t>, 16>> FTs;
+  if (BAT)
+    FTs = BAT->getFallthroughsInTrace(First.To, Second.From);
+  if (!FTs)
+    FTs = FromFunc->getFallthroughsInTrace(First, Second, Count);
   if (!FTs) {
-    ++NumInvalidTraces;
+    NumInvalidTraces += Count;
     return false;
   }
 
   for (const auto &Pair : *FTs) {
-    doIntraBranch(*FromFunc,
-                  LBREntry{Pair.first + FromFunc->getAddress(),
-                           Pair.second + FromFunc->getAddress(),
-                           false});
+    doIntraBranch(*FromFunc, Pair.first + FromFunc->getAddress(),
+                  Pair.second + FromFunc->getAddress(), Count, 0);
   }
 
   return true;
@@ -632,7 +1437,7 @@ ErrorOr<LBREntry> DataAggregator::parseLBREntry() {
   if (std::error_code EC = FromStrRes.getError())
     return EC;
   StringRef OffsetStr = FromStrRes.get();
-  if (OffsetStr.getAsInteger(0, Res.From)) {
+  if (TextScanner::parseAddress(OffsetStr, Res.From)) {
     reportError("expected hexadecimal number with From address");
     Diag << "Found: " << OffsetStr << "\n";
     return make_error_code(llvm::errc::io_error);
@@ -642,7 +1447,7 @@ ErrorOr<LBREntry> DataAggregator::parseLBREntry() {
   if (std::error_code EC = ToStrRes.getError())
     return EC;
   OffsetStr = ToStrRes.get();
-  if (OffsetStr.getAsInteger(0, Res.To)) {
+  if (TextScanner::parseAddress(OffsetStr, Res.To)) {
     reportError("expected hexadecimal number with To address");
     Diag << "Found: " << OffsetStr << "\n";
     return make_error_code(llvm::errc::io_error);
@@ -668,6 +1473,15 @@ ErrorOr<LBREntry> DataAggregator::parseLBREntry() {
     Diag << "Found: " << OffsetStr << "\n";
     return make_error_code(llvm::errc::io_error);
   }
+
+  // The rest is in_tx/abort/cycles, possibly followed by more fields. Cycles
+  // are "0" or "-" when not recorded.
+  SmallVector<StringRef, 4> RestFields;
+  Rest.get().split(RestFields, '/');
+  unsigned Cycles;
+  Res.Cycles = 0;
+  if (RestFields.size() > 2 && !RestFields[2].getAsInteger(10, Cycles))
+    Res.Cycles = std::min(Cycles, 0xffffu);
   return Res;
 }
 
@@ -693,18 +1507,72 @@ void DataAggregator::consumeRestOfLine() {
   Line += 1;
 }
 
-ErrorOr<PerfBranchSample> DataAggregator::parseBranchSample() {
-  PerfBranchSample Res;
+ErrorOr<uint64_t> DataAggregator::parseSampleWeight() {
+  while (checkAndConsumeFS()) {}
 
+  if (!hasThreadSelection()) {
+    auto PIDRes = parseNumberField(FieldSeparator, true);
+    if (std::error_code EC = PIDRes.getError())
+      return EC;
+    return PIDs.empty() || PIDs.count(PIDRes.get()) ? 1 : 0;
+  }
+
+  // perf script prints the ids as PID/TID.
+  auto IDsRes = parseString(FieldSeparator, true);
+  if (std::error_code EC = IDsRes.getError())
+    return EC;
+  StringRef PIDStr, TIDStr;
+  std::tie(PIDStr, TIDStr) = IDsRes.get().split('/');
+  int64_t PID, TID;
+  if (PIDStr.getAsInteger(10, PID) || TIDStr.getAsInteger(10, TID)) {
+    reportError("expected PID/TID");
+    Diag << "Found: " << IDsRes.get() << "\n";
+    return make_error_code(llvm::errc::io_error);
+  }
+  if (!PIDs.empty() && !PIDs.count(PID))
+    return 0;
+  return getThreadWeight(TID);
+}
+
+ErrorOr<uint64_t> DataAggregator::parseSampleTime() {
   while (checkAndConsumeFS()) {}
 
-  auto PIDRes = parseNumberField(FieldSeparator, true);
-  if (std::error_code EC = PIDRes.getError())
+  auto TimeRes = parseString(FieldSeparator);
+  if (std::error_code EC = TimeRes.getError())
+    return EC;
+  StringRef TimeStr = TimeRes.get();
+  StringRef SecStr, FracStr;
+  std::tie(SecStr, FracStr) = TimeStr.split('.');
+  uint64_t Sec, Frac;
+  if (!FracStr.consume_back(":") || FracStr.size() > 9 ||
+      SecStr.getAsInteger(10, Sec) || FracStr.getAsInteger(10, Frac)) {
+    reportError("expected sample time");
+    Diag << "Found: " << TimeStr << "\n";
+    return make_error_code(llvm::errc::io_error);
+  }
+  for (auto I = FracStr.size(); I < 9; ++I)
+    Frac *= 10;
+  return Sec * 1000000000ULL + Frac;
+}
+
+ErrorOr<PerfBranchSample> DataAggregator::parseBranchSample() {
+  PerfBranchSample Res;
+
+  auto WeightRes = parseSampleWeight();
+  if (std::error_code EC = WeightRes.getError())
     return EC;
-  if (!PIDs.empty() && !PIDs.count(PIDRes.get())) {
+  if (!WeightRes.get()) {
     consumeRestOfLine();
     return Res;
   }
+  Res.Weight = WeightRes.get();
+
+  if (needsSampleTime()) {
+    auto TimeRes = parseSampleTime();
+    if (std::error_code EC = TimeRes.getError())
+      return EC;
+    Res.Time = TimeRes.get();
+  }
 
   while (!checkAndConsumeNewLine()) {
     checkAndConsumeFS();
@@ -719,16 +1587,22 @@ ErrorOr<PerfBranchSample> DataAggregator::parseBranchSample() {
 }
 
 ErrorOr<PerfBasicSample> DataAggregator::parseBasicSample() {
-  while (checkAndConsumeFS()) {}
-
-  auto PIDRes = parseNumberField(FieldSeparator, true);
-  if (std::error_code EC = PIDRes.getError())
+  auto WeightRes = parseSampleWeight();
+  if (std::error_code EC = WeightRes.getError())
     return EC;
-  if (!PIDs.empty() && !PIDs.count(PIDRes.get())) {
+  if (!WeightRes.get()) {
     consumeRestOfLine();
     return PerfBasicSample{StringRef(), 0};
   }
 
+  uint64_t Time{0};
+  if (needsSampleTime()) {
+    auto TimeRes = parseSampleTime();
+    if (std::error_code EC = TimeRes.getError())
+      return EC;
+    Time = TimeRes.get();
+  }
+
   while (checkAndConsumeFS()) {}
 
   auto Event = parseString(FieldSeparator);
@@ -747,18 +1621,16 @@ ErrorOr<PerfBasicSample> DataAggregator::parseBasicSample() {
     return make_error_code(llvm::errc::io_error);
   }
 
-  return PerfBasicSample{Event.get(), AddrRes.get()};
+  return PerfBasicSample{Event.get(), AddrRes.get(), Time};
 }
 
 ErrorOr<PerfMemSample> DataAggregator::parseMemSample() {
   PerfMemSample Res{0,0};
 
-  while (checkAndConsumeFS()) {}
-
-  auto PIDRes = parseNumberField(FieldSeparator, true);
-  if (std::error_code EC = PIDRes.getError())
+  auto WeightRes = parseSampleWeight();
+  if (std::error_code EC = WeightRes.getError())
     return EC;
-  if (!PIDs.empty() && !PIDs.count(PIDRes.get())) {
+  if (!WeightRes.get()) {
     consumeRestOfLine();
     return Res;
   }
@@ -803,15 +1675,211 @@ bool DataAggregator::hasData() {
   return true;
 }
 
-std::error_code DataAggregator::parseBranchEvents() {
-  outs() << "PERF2BOLT: Aggregating branch events...\n";
-  NamedRegionTimer T("parseBranch", "Branch samples parsing", TimerGroupName,
-                     TimerGroupDesc, opts::TimeAggregator);
-  uint64_t NumEntries{0};
-  uint64_t NumSamples{0};
-  uint64_t NumTraces{0};
-  while (hasData()) {
-    auto SampleRes = parseBranchSample();
+void LBRAggregate::addSample(const PerfBranchSample &Sample) {
+  ++NumSamples;
+  NumEntries += Sample.LBR.size();
+
+  // LBRs are stored in reverse execution order. NextLBR refers to the next
+  // executed branch record.
+  const LBREntry *NextLBR{nullptr};
+  for (const auto &LBR : Sample.LBR) {
+    if (NextLBR) {
+      Traces[std::make_pair(LBR.From, std::make_pair(LBR.To, NextLBR->From))] +=
+        Sample.Weight;
+      ++NumTraces;
+    }
+    auto &Count = Branches[std::make_pair(LBR.From, LBR.To)];
+    Count.Count += Sample.Weight;
+    if (LBR.Mispred)
+      Count.Mispreds += Sample.Weight;
+    Count.Cycles += LBR.Cycles * Sample.Weight;
+    NextLBR = &LBR;
+  }
+
+  if (FunctionRanges)
+    addCallContexts(Sample);
+  if (Sample.Time)
+    addSampleTime(Sample);
+}
+
+void LBRAggregate::addSampleTime(const PerfBranchSample &Sample) {
+  const auto Bucket = Sample.Time / getTemporalBucketSize();
+  for (const auto &LBR : Sample.LBR) {
+    auto Result = TouchTimes.insert(
+        std::make_pair(LBR.To, std::make_pair(Sample.Time, Sample.Time)));
+    if (!Result.second) {
+      auto &Times = Result.first->second;
+      Times.first = std::min(Times.first, Sample.Time);
+      Times.second = std::max(Times.second, Sample.Time);
+    }
+    TouchBuckets[std::make_pair(LBR.To, Bucket)] += Sample.Weight;
+  }
+}
+
+void LBRAggregate::addCallContexts(const PerfBranchSample &Sample) {
+  // Return the range of the function containing Address, or null.
+  auto findFunction =
+    [&](uint64_t Address) -> const std::pair<uint64_t, uint64_t> * {
+      auto FI = std::upper_bound(
+          FunctionRanges->begin(), FunctionRanges->end(), Address,
+          [](uint64_t Address, const std::pair<uint64_t, uint64_t> &Range) {
+            return Address < Range.first;
+          });
+      if (FI == FunctionRanges->begin())
+        return nullptr;
+      --FI;
+      return Address < FI->second ? &*FI : nullptr;
+    };
+
+  /// A function entered by a call, suspended while it calls other functions.
+  struct Context {
+    uint64_t CallSite;
+    uint64_t Start;
+    uint64_t End;
+    /// Destination of the last branch taken into the function.
+    uint64_t LastTo;
+    bool Active;
+
+    bool contains(uint64_t Address) const {
+      return Address >= Start && Address < End;
+    }
+  };
+  SmallVector<Context, MaxCallContextDepth> Stack;
+
+  auto bumpBranch = [&](uint64_t CallSite, const LBREntry &LBR) {
+    auto &Count =
+      ContextBranches[std::make_pair(CallSite,
+                                     std::make_pair(LBR.From, LBR.To))];
+    Count.Count += Sample.Weight;
+    if (LBR.Mispred)
+      Count.Mispreds += Sample.Weight;
+  };
+
+  // LBRs are stored in reverse execution order.
+  for (auto I = Sample.LBR.rbegin(), E = Sample.LBR.rend(); I != E; ++I) {
+    const auto &LBR = *I;
+    if (!Stack.empty() && Stack.back().Active) {
+      auto &Top = Stack.back();
+      if (!Top.contains(LBR.From)) {
+        // Execution left the function without a recorded branch.
+        Stack.clear();
+      } else {
+        ContextTraces[std::make_pair(Top.CallSite,
+                                     std::make_pair(Top.LastTo, LBR.From))] +=
+          Sample.Weight;
+        if (Top.contains(LBR.To) && LBR.To != Top.Start) {
+          bumpBranch(Top.CallSite, LBR);
+          Top.LastTo = LBR.To;
+          continue;
+        }
+        Top.Active = false;
+      }
+    }
+
+    const auto *Callee = findFunction(LBR.To);
+    if (!Callee) {
+      // Code outside of the binary, e.g. a shared library, returns to the
+      // function that called it.
+      continue;
+    }
+
+    if (LBR.To == Callee->first &&
+        !(LBR.From >= Callee->first && LBR.From < Callee->second)) {
+      if (!Stack.empty() && Stack.back().contains(LBR.From))
+        bumpBranch(Stack.back().CallSite, LBR);
+      if (Stack.size() == MaxCallContextDepth)
+        Stack.erase(Stack.begin());
+      Stack.push_back({LBR.From, Callee->first, Callee->second, LBR.To, true});
+      bumpBranch(LBR.From, LBR);
+      continue;
+    }
+
+    // A return resumes the function it returns into and ends the functions
+    // called from it.
+    auto CI = std::find_if(Stack.rbegin(), Stack.rend(),
+                           [&](const Context &C) {
+                             return C.contains(LBR.To);
+                           });
+    if (CI == Stack.rend()) {
+      Stack.clear();
+      continue;
+    }
+    Stack.erase(CI.base(), Stack.end());
+    Stack.back().Active = true;
+    Stack.back().LastTo = LBR.To;
+  }
+}
+
+void LBRAggregate::scale(double Factor) {
+  for (auto &BI : Branches) {
+    BI.second.Count = std::llround(BI.second.Count * Factor);
+    BI.second.Mispreds = std::llround(BI.second.Mispreds * Factor);
+    BI.second.Cycles = std::llround(BI.second.Cycles * Factor);
+  }
+  for (auto &TI : Traces)
+    TI.second = std::llround(TI.second * Factor);
+  for (auto &BI : ContextBranches) {
+    BI.second.Count = std::llround(BI.second.Count * Factor);
+    BI.second.Mispreds = std::llround(BI.second.Mispreds * Factor);
+  }
+  for (auto &TI : ContextTraces)
+    TI.second = std::llround(TI.second * Factor);
+  for (auto &BI : TouchBuckets)
+    BI.second = std::llround(BI.second * Factor);
+}
+
+void LBRAggregate::merge(const LBRAggregate &Other) {
+  for (const auto &BI : Other.Branches) {
+    auto &Count = Branches[BI.first];
+    Count.Count += BI.second.Count;
+    Count.Mispreds += BI.second.Mispreds;
+    Count.Cycles += BI.second.Cycles;
+  }
+  for (const auto &TI : Other.Traces)
+    Traces[TI.first] += TI.second;
+  for (const auto &BI : Other.ContextBranches) {
+    auto &Count = ContextBranches[BI.first];
+    Count.Count += BI.second.Count;
+    Count.Mispreds += BI.second.Mispreds;
+  }
+  for (const auto &TI : Other.ContextTraces)
+    ContextTraces[TI.first] += TI.second;
+  for (const auto &TI : Other.TouchTimes) {
+    auto Result = TouchTimes.insert(TI);
+    if (!Result.second) {
+      auto &Times = Result.first->second;
+      Times.first = std::min(Times.first, TI.second.first);
+      Times.second = std::max(Times.second, TI.second.second);
+    }
+  }
+  for (const auto &BI : Other.TouchBuckets)
+    TouchBuckets[BI.first] += BI.second;
+  NumSamples += Other.NumSamples;
+  NumEntries += Other.NumEntries;
+  NumTraces += Other.NumTraces;
+}
+
+std::error_code
+DataAggregator::parseBranchEventsChunk(StringRef Chunk,
+                                       SharedLBRAggregate &Shared,
+                                       LBRAggregate &Aggregate) const {
+  // Use a separate parser so that the state of this aggregator is untouched.
+  // Line numbers reported on errors are relative to the start of the chunk.
+  DataAggregator Parser(Diag, BinaryName);
+  Parser.PIDs = PIDs;
+  Parser.SelectedTIDs = SelectedTIDs;
+  Parser.ParsingBuf = Chunk;
+  Parser.Col = 0;
+  Parser.Line = 1;
+  uint64_t Index{0};
+  while (Parser.hasData()) {
+    // perf script prints a sample per line.
+    if (!isSampleSelected(Index++)) {
+      Parser.consumeRestOfLine();
+      continue;
+    }
+
+    auto SampleRes = Parser.parseBranchSample();
     if (std::error_code EC = SampleRes.getError())
       return EC;
 
@@ -819,21 +1887,358 @@ std::error_code DataAggregator::parseBranchEvents() {
     if (Sample.LBR.empty())
       continue;
 
-    ++NumSamples;
-    NumEntries += Sample.LBR.size();
+    ++Aggregate.NumSamples;
+    Aggregate.NumEntries += Sample.LBR.size();
 
-    // LBRs are stored in reverse execution order. NextLBR refers to the next
-    // executed branch record.
+    const auto Weight = Sample.Weight;
     const LBREntry *NextLBR{nullptr};
     for (const auto &LBR : Sample.LBR) {
       if (NextLBR) {
-        doTrace(LBR, *NextLBR);
-        ++NumTraces;
+        const auto TraceKey =
+          std::make_pair(LBR.From, std::make_pair(LBR.To, NextLBR->From));
+        if (!Shared.Traces.bump(TraceKey, Weight))
+          Aggregate.Traces[TraceKey] += Weight;
+        ++Aggregate.NumTraces;
+      }
+      const auto BranchKey = std::make_pair(LBR.From, LBR.To);
+      const uint64_t Mispreds = LBR.Mispred ? Weight : 0;
+      const uint64_t Cycles = LBR.Cycles * Weight;
+      if (!Shared.Branches.bump(BranchKey, Weight, Mispreds, Cycles)) {
+        auto &Count = Aggregate.Branches[BranchKey];
+        Count.Count += Weight;
+        Count.Mispreds += Mispreds;
+        Count.Cycles += Cycles;
       }
-      doBranch(LBR);
       NextLBR = &LBR;
     }
+
+    if (Aggregate.FunctionRanges)
+      Aggregate.addCallContexts(Sample);
+    if (Sample.Time)
+      Aggregate.addSampleTime(Sample);
+  }
+  return std::error_code();
+}
+
+std::error_code DataAggregator::parseBranchEventsInChunks(
+    int FD, SharedLBRAggregate &Shared, LBRAggregate &Aggregate) {
+  // Size of a chunk of perf script output processed by a single task.
+  const size_t ChunkSize = 16 << 20;
+  // Number of chunks kept in memory at once.
+  const unsigned ChunksPerWave = 2 * ParallelUtilities::getThreadCount();
+
+  auto &ThPool = ParallelUtilities::getThreadPool();
+  std::error_code Result;
+  bool ReachedEnd = false;
+  std::string Remainder;
+  while (!ReachedEnd && !Result) {
+    // Chunks read from FD are owned by Buffers, otherwise they point into the
+    // parsing buffer.
+    std::vector<std::string> Buffers;
+    std::vector<StringRef> Chunks;
+    while (Chunks.size() < ChunksPerWave && !ReachedEnd) {
+      if (FD == -1) {
+        if (ParsingBuf.empty()) {
+          ReachedEnd = true;
+          break;
+        }
+        auto ChunkEnd = ParsingBuf.size();
+        if (ChunkEnd > ChunkSize) {
+          ChunkEnd = ParsingBuf.find('\n', ChunkSize);
+          ChunkEnd = ChunkEnd == StringRef::npos ? ParsingBuf.size()
+                                                 : ChunkEnd + 1;
+        }
+        Chunks.push_back(ParsingBuf.substr(0, ChunkEnd));
+        ParsingBuf = ParsingBuf.drop_front(ChunkEnd);
+        continue;
+      }
+
+      std::string Buffer;
+      Buffer.swap(Remainder);
+      const auto Offset = Buffer.size();
+      Buffer.resize(Offset + ChunkSize);
+      size_t Size = Offset;
+      while (Size < Buffer.size()) {
+        auto BytesRead = ::read(FD, &Buffer[Size], Buffer.size() - Size);
+        if (BytesRead == -1 && errno == EINTR)
+          continue;
+        if (BytesRead == -1) {
+          Result = std::error_code(errno, std::generic_category());
+          ReachedEnd = true;
+          break;
+        }
+        if (BytesRead == 0) {
+          ReachedEnd = true;
+          break;
+        }
+        Size += BytesRead;
+      }
+      Buffer.resize(Size);
+      if (!ReachedEnd) {
+        // Move the incomplete last line to the next chunk.
+        auto LineEnd = Buffer.rfind('\n');
+        if (LineEnd != std::string::npos) {
+          Remainder = Buffer.substr(LineEnd + 1);
+          Buffer.resize(LineEnd + 1);
+        }
+      }
+      if (Buffer.empty())
+        continue;
+      Buffers.emplace_back(std::move(Buffer));
+    }
+    for (const auto &Buffer : Buffers)
+      Chunks.push_back(Buffer);
+
+    std::vector<LBRAggregate> ChunkAggregates(Chunks.size());
+    std::vector<std::error_code> ChunkErrors(Chunks.size());
+    for (unsigned I = 0; I < Chunks.size(); ++I) {
+      ChunkAggregates[I].FunctionRanges = Aggregate.FunctionRanges;
+      ThPool.async([&, I] {
+        ChunkErrors[I] =
+          parseBranchEventsChunk(Chunks[I], Shared, ChunkAggregates[I]);
+      });
+    }
+    ThPool.wait();
+
+    for (unsigned I = 0; I < Chunks.size(); ++I) {
+      if (ChunkErrors[I] && !Result)
+        Result = ChunkErrors[I];
+      Aggregate.merge(ChunkAggregates[I]);
+    }
+  }
+
+  return Result;
+}
+
+void DataAggregator::processLBRAggregate(const LBRAggregate &Aggregate,
+                                         const SharedLBRAggregate *Shared) {
+  processCallContexts(Aggregate);
+  processTemporalData(Aggregate);
+
+  // The order of keys in hash tables depends on the order they were
+  // inserted in, and with a shared table on the scheduling of threads.
+  // Processing order decides the order of records in the output, so merge
+  // the counts and process them by address.
+  if (ParallelUtilities::isDeterministic()) {
+    std::map<std::pair<uint64_t, std::pair<uint64_t, uint64_t>>, uint64_t>
+      Traces;
+    std::map<std::pair<uint64_t, uint64_t>, LBRAggregate::BranchCount>
+      Branches;
+    for (const auto &TI : Aggregate.Traces)
+      Traces[TI.first] += TI.second;
+    for (const auto &BI : Aggregate.Branches) {
+      auto &Counts = Branches[BI.first];
+      Counts.Count += BI.second.Count;
+      Counts.Mispreds += BI.second.Mispreds;
+      Counts.Cycles += BI.second.Cycles;
+    }
+    if (Shared) {
+      Shared->Traces.forEach(
+          [&](const std::pair<uint64_t, std::pair<uint64_t, uint64_t>> &Key,
+              uint64_t Count, uint64_t, uint64_t) { Traces[Key] += Count; });
+      Shared->Branches.forEach(
+          [&](const std::pair<uint64_t, uint64_t> &Key, uint64_t Count,
+              uint64_t Mispreds, uint64_t Cycles) {
+            auto &Counts = Branches[Key];
+            Counts.Count += Count;
+            Counts.Mispreds += Mispreds;
+            Counts.Cycles += Cycles;
+          });
+    }
+
+    for (const auto &TI : Traces) {
+      LBREntry First{TI.first.first, TI.first.second.first, false};
+      LBREntry Second{TI.first.second.second, 0, false};
+      doTrace(First, Second, TI.second);
+    }
+    for (const auto &BI : Branches) {
+      doBranch(BI.first.first, BI.first.second, BI.second.Count,
+               BI.second.Mispreds, BI.second.Cycles);
+    }
+    return;
+  }
+
+  // Process traces before branches for the counts of invalid traces to be
+  // reported consistently. Attribution of counts is additive, so keys present
+  // in both aggregates are processed twice.
+  if (Shared) {
+    Shared->Traces.forEach(
+        [&](const std::pair<uint64_t, std::pair<uint64_t, uint64_t>> &Key,
+            uint64_t Count, uint64_t, uint64_t) {
+          LBREntry First{Key.first, Key.second.first, false};
+          LBREntry Second{Key.second.second, 0, false};
+          doTrace(First, Second, Count);
+        });
+  }
+  for (const auto &TI : Aggregate.Traces) {
+    LBREntry First{TI.first.first, TI.first.second.first, false};
+    LBREntry Second{TI.first.second.second, 0, false};
+    doTrace(First, Second, TI.second);
+  }
+  if (Shared) {
+    Shared->Branches.forEach(
+        [&](const std::pair<uint64_t, uint64_t> &Key, uint64_t Count,
+            uint64_t Mispreds, uint64_t Cycles) {
+          doBranch(Key.first, Key.second, Count, Mispreds, Cycles);
+        });
+  }
+  for (const auto &BI : Aggregate.Branches) {
+    doBranch(BI.first.first, BI.first.second, BI.second.Count,
+             BI.second.Mispreds, BI.second.Cycles);
   }
+}
+
+void DataAggregator::processCallContexts(const LBRAggregate &Aggregate) {
+  for (const auto &BI : Aggregate.ContextBranches) {
+    const auto CallSite = BI.first.first;
+    const auto From = BI.first.second.first;
+    const auto To = BI.first.second.second;
+    const auto &Count = BI.second;
+    auto *Caller = getBinaryFunctionContainingAddress(CallSite);
+    if (!Caller)
+      continue;
+
+    if (From == CallSite) {
+      if (auto *Callee = getBinaryFunctionContainingAddress(To))
+        Callee->recordCallerEntry(*Caller, Count.Count);
+      continue;
+    }
+
+    auto *Callee = getBinaryFunctionContainingAddress(From);
+    auto *Target = getBinaryFunctionContainingAddress(To);
+    if (!Callee || !Target || Callee == Caller)
+      continue;
+
+    if (Target == Callee) {
+      Callee->recordCallerBranch(*Caller, From - Callee->getAddress(),
+                                 To - Callee->getAddress(), Count.Count,
+                                 Count.Mispreds);
+    } else {
+      Callee->recordCallerCall(*Caller, From - Callee->getAddress(), *Target,
+                               To - Target->getAddress(), Count.Count,
+                               Count.Mispreds);
+    }
+  }
+
+  for (const auto &TI : Aggregate.ContextTraces) {
+    auto *Caller = getBinaryFunctionContainingAddress(TI.first.first);
+    auto *Callee = getBinaryFunctionContainingAddress(TI.first.second.first);
+    if (!Caller || !Callee || Callee == Caller)
+      continue;
+
+    // The source of the first branch only matters for returns into the
+    // function, take the trace as starting after a branch within it. Zero
+    // count leaves the profile of the function, which already has the trace,
+    // unchanged.
+    LBREntry First{TI.first.second.first, TI.first.second.first, false};
+    LBREntry Second{TI.first.second.second, 0, false};
+    auto FTs = Callee->getFallthroughsInTrace(First, Second, /*Count=*/0);
+    if (!FTs)
+      continue;
+    for (const auto &Pair : *FTs) {
+      Callee->recordCallerBranch(*Caller, Pair.first, Pair.second, TI.second,
+                                 0);
+    }
+  }
+}
+
+void DataAggregator::processTemporalData(const LBRAggregate &Aggregate) {
+  // Times are kept per branch target while parsing, and combined per
+  // function here, once every address is looked up.
+  DenseMap<BinaryFunction *, FuncTemporalData> Data;
+  for (const auto &TI : Aggregate.TouchTimes) {
+    auto Address = TI.first;
+    auto *Func = getInputFunctionContainingAddress(Address,
+                                                   /*IsBranchSrc=*/false);
+    if (!Func)
+      continue;
+    auto &FuncData = Data[Func];
+    FuncData.FirstTime = std::min(FuncData.FirstTime, TI.second.first);
+    FuncData.LastTime = std::max(FuncData.LastTime, TI.second.second);
+  }
+  for (const auto &BI : Aggregate.TouchBuckets) {
+    auto Address = BI.first.first;
+    auto *Func = getInputFunctionContainingAddress(Address,
+                                                   /*IsBranchSrc=*/false);
+    if (Func)
+      Data[Func].Buckets[BI.first.second] += BI.second;
+  }
+
+  for (auto &FI : Data)
+    recordTemporalData(*FI.first, FI.second);
+}
+
+void DataAggregator::recordTemporalData(BinaryFunction &Func,
+                                        const FuncTemporalData &Data) {
+  Func.recordExecutionTime(Data.FirstTime);
+  if (opts::TemporalProfile)
+    FuncsToTemporal[Func.getNames()[0]].merge(Data);
+}
+
+std::error_code DataAggregator::parseBranchEvents(int FD) {
+  outs() << "PERF2BOLT: Aggregating branch events...\n";
+  NamedRegionTimer T("parseBranch", "Branch samples parsing", TimerGroupName,
+                     TimerGroupDesc, opts::TimeAggregator);
+  // Hot branches and traces repeat in many samples. Count unique ones first,
+  // so that each is looked up in the disassembled functions only once.
+  LBRAggregate Aggregate;
+  if (!FunctionRanges.empty())
+    Aggregate.FunctionRanges = &FunctionRanges;
+  double Scale = std::max(1u, opts::Downsample.getValue());
+  if (FD != -1 || opts::ParallelAggregation) {
+    SharedLBRAggregate Shared(opts::AggregationTableSize);
+    if (std::error_code EC = parseBranchEventsInChunks(FD, Shared, Aggregate))
+      return EC;
+    if (Scale != 1.0) {
+      errs() << "PERF2BOLT-WARNING: counts are not scaled with "
+                "-parallel-aggregation or -stream-perf-script\n";
+      Scale = 1.0;
+    }
+    processLBRAggregate(Aggregate, &Shared);
+  } else {
+    BranchDistributionTracker Tracker;
+    const auto InputSize = ParsingBuf.size();
+    uint64_t Index{0};
+    while (hasData()) {
+      // perf script prints a sample per line.
+      if (!isSampleSelected(Index++)) {
+        consumeRestOfLine();
+        continue;
+      }
+
+      auto SampleRes = parseBranchSample();
+      if (std::error_code EC = SampleRes.getError())
+        return EC;
+
+      auto &Sample = SampleRes.get();
+      if (Sample.LBR.empty())
+        continue;
+
+      Aggregate.addSample(Sample);
+      if (opts::DownsampleAdaptive &&
+          Aggregate.NumSamples % ConvergenceCheckInterval == 0 &&
+          Tracker.hasConverged(Aggregate)) {
+        // Assume the rest of the input is sampled at the same density.
+        Scale *= static_cast<double>(InputSize) /
+                 (InputSize - ParsingBuf.size());
+        outs() << "PERF2BOLT: Branch distribution converged after "
+               << Aggregate.NumSamples << " samples, skipping the rest\n";
+        ParsingBuf = StringRef();
+        break;
+      }
+    }
+    Aggregate.scale(Scale);
+    processLBRAggregate(Aggregate);
+  }
+  printBranchStats(Aggregate.NumSamples, Aggregate.NumEntries,
+                   Aggregate.NumTraces);
+  printDownsamplingStats(Scale);
+
+  return std::error_code();
+}
+
+void DataAggregator::printBranchStats(uint64_t NumSamples, uint64_t NumEntries,
+                                      uint64_t NumTraces) const {
   outs() << "PERF2BOLT: Read " << NumSamples << " samples and "
          << NumEntries << " LBR entries\n";
   outs() << "PERF2BOLT: Traces mismatching disassembled function contents: "
@@ -870,8 +2275,38 @@ std::error_code DataAggregator::parseBranchEvents() {
     outs() << format(" (%.1f%%)", NumLongRangeTraces * 100.0f / NumTraces);
   }
   outs() << "\n";
+}
 
-  return std::error_code();
+void DataAggregator::printDownsamplingStats(double Scale) const {
+  if (Scale == 1.0)
+    return;
+
+  outs() << "PERF2BOLT: Branch counts were scaled by "
+         << format("%.2f", Scale) << " to account for skipped samples\n";
+
+  // Counts of a function are estimated from a random-like subset of its
+  // branches, so their relative error is about 1/sqrt(n) for n aggregated
+  // branches.
+  std::vector<std::pair<uint64_t, StringRef>> Hottest;
+  for (const auto &FBD : FuncsToBranches) {
+    uint64_t Count{0};
+    for (const auto &BI : FBD.getValue().Data)
+      Count += BI.Branches;
+    Hottest.emplace_back(Count, FBD.getKey());
+  }
+  const size_t NumHottest = std::min<size_t>(10, Hottest.size());
+  std::partial_sort(Hottest.begin(), Hottest.begin() + NumHottest,
+                    Hottest.end(),
+                    std::greater<std::pair<uint64_t, StringRef>>());
+  outs() << "PERF2BOLT: Estimated relative error of branch counts of the "
+            "hottest functions:\n";
+  for (size_t I = 0; I < NumHottest; ++I) {
+    const double Aggregated = Hottest[I].first / Scale;
+    const double Error = Aggregated >= 1.0 ? 100.0 / std::sqrt(Aggregated)
+                                           : 100.0;
+    outs() << "  " << Hottest[I].second << ": " << Hottest[I].first
+           << " branches, +/- " << format("%.1f", Error) << "%\n";
+  }
 }
 
 std::error_code DataAggregator::parseBasicEvents() {
@@ -890,15 +2325,32 @@ std::error_code DataAggregator::parseBasicEvents() {
       continue;
 
     ++NumSamples;
-    auto *Func = getBinaryFunctionContainingAddress(Sample.PC);
-    if (!Func) {
+    if (!processBasicSample(Sample))
       ++OutOfRangeSamples;
-      continue;
-    }
+  }
+  printBasicStats(NumSamples, OutOfRangeSamples);
+
+  return std::error_code();
+}
 
-    doSample(*Func, Sample.PC);
-    EventNames.insert(Sample.EventName);
+bool DataAggregator::processBasicSample(const PerfBasicSample &Sample) {
+  auto PC = Sample.PC;
+  auto *Func = getInputFunctionContainingAddress(PC, /*IsBranchSrc=*/false);
+  if (!Func)
+    return false;
+
+  doSample(*Func, PC);
+  if (Sample.Time) {
+    FuncTemporalData Data;
+    Data.addSample(Sample.Time, 1, getTemporalBucketSize());
+    recordTemporalData(*Func, Data);
   }
+  EventNames.insert(Sample.EventName);
+  return true;
+}
+
+void DataAggregator::printBasicStats(uint64_t NumSamples,
+                                     uint64_t OutOfRangeSamples) const {
   outs() << "PERF2BOLT: Read " << NumSamples << " samples\n";
 
   outs() << "PERF2BOLT: Out of range samples recorded in unknown regions: "
@@ -928,8 +2380,6 @@ std::error_code DataAggregator::parseBasicEvents() {
               "collection. The generated data may be ineffective for improving "
               "performance.\n\n";
   }
-
-  return std::error_code();
 }
 
 std::error_code DataAggregator::parseMemEvents() {
@@ -942,47 +2392,51 @@ std::error_code DataAggregator::parseMemEvents() {
     if (std::error_code EC = SampleRes.getError())
       return EC;
 
-    auto PC = SampleRes.get().PC;
-    auto Addr = SampleRes.get().Addr;
-    StringRef FuncName;
-    StringRef MemName;
+    processMemSample(SampleRes.get());
+  }
 
-    // Try to resolve symbol for PC
-    auto *Func = getBinaryFunctionContainingAddress(PC);
-    if (Func) {
-      FuncName = Func->getNames()[0];
-      PC -= Func->getAddress();
-    }
+  return std::error_code();
+}
 
-    // Try to resolve symbol for memory load
-    auto *MemFunc = getBinaryFunctionContainingAddress(Addr);
-    if (MemFunc) {
-      MemName = MemFunc->getNames()[0];
-      Addr -= MemFunc->getAddress();
-    } else if (Addr) {  // TODO: filter heap/stack/nulls here?
-      if (auto *BD = BC->getBinaryDataContainingAddress(Addr)) {
-        MemName = BD->getName();
-        Addr -= BD->getAddress();
-      }
+void DataAggregator::processMemSample(const PerfMemSample &Sample) {
+  auto PC = Sample.PC;
+  auto Addr = Sample.Addr;
+  StringRef FuncName;
+  StringRef MemName;
+
+  // Try to resolve symbol for PC
+  auto *Func = getInputFunctionContainingAddress(PC, /*IsBranchSrc=*/false);
+  if (Func) {
+    FuncName = Func->getNames()[0];
+    PC -= Func->getAddress();
+  }
+
+  // Try to resolve symbol for memory load
+  auto *MemFunc = getBinaryFunctionContainingAddress(Addr);
+  if (MemFunc) {
+    MemName = MemFunc->getNames()[0];
+    Addr -= MemFunc->getAddress();
+  } else if (Addr) {  // TODO: filter heap/stack/nulls here?
+    if (auto *BD = BC->getBinaryDataContainingAddress(Addr)) {
+      MemName = BD->getName();
+      Addr -= BD->getAddress();
     }
+  }
 
-    const Location FuncLoc(!FuncName.empty(), FuncName, PC);
-    const Location AddrLoc(!MemName.empty(), MemName, Addr);
+  const Location FuncLoc(!FuncName.empty(), FuncName, PC);
+  const Location AddrLoc(!MemName.empty(), MemName, Addr);
 
-    // TODO what does it mean when PC is 0 (or not a known function)?
-    DEBUG(if (!Func && PC != 0) {
-      dbgs() << "Skipped mem event: " << FuncLoc << " = " << AddrLoc << "\n";
-    });
+  // TODO what does it mean when PC is 0 (or not a known function)?
+  DEBUG(if (!Func && PC != 0) {
+    dbgs() << "Skipped mem event: " << FuncLoc << " = " << AddrLoc << "\n";
+  });
 
-    if (Func) {
-      auto *MemData = &FuncsToMemEvents[FuncName];
-      Func->setMemData(MemData);
-      MemData->update(FuncLoc, AddrLoc);
-      DEBUG(dbgs() << "Mem event: " << FuncLoc << " = " << AddrLoc << "\n");
-    }
+  if (Func) {
+    auto *MemData = &FuncsToMemEvents[FuncName];
+    Func->setMemData(MemData);
+    MemData->update(FuncLoc, AddrLoc);
+    DEBUG(dbgs() << "Mem event: " << FuncLoc << " = " << AddrLoc << "\n");
   }
-
-  return std::error_code();
 }
 
 ErrorOr<int64_t> DataAggregator::parseTaskPID() {
@@ -1026,6 +2480,9 @@ std::error_code DataAggregator::parseTasks() {
                      TimerGroupDesc, opts::TimeAggregator);
 
   while (hasData()) {
+    if (!opts::ThreadComm.empty())
+      selectThreadByComm(ParsingBuf.substr(0, ParsingBuf.find('\n')));
+
     auto PIDRes = parseTaskPID();
     if (std::error_code EC = PIDRes.getError())
       return EC;
@@ -1037,6 +2494,13 @@ std::error_code DataAggregator::parseTasks() {
 
     PIDs.insert(PID);
   }
+  reportPIDs();
+  reportThreads();
+
+  return std::error_code();
+}
+
+void DataAggregator::reportPIDs() const {
   if (!PIDs.empty()) {
     outs() << "PERF2BOLT: Input binary is associated with " << PIDs.size()
            << " PID(s)\n";
@@ -1050,8 +2514,57 @@ std::error_code DataAggregator::parseTasks() {
     if (errs().has_colors())
       errs().resetColor();
   }
+}
 
-  return std::error_code();
+bool DataAggregator::hasThreadSelection() {
+  return !opts::ThreadIDs.empty() || !opts::ThreadComm.empty();
+}
+
+void DataAggregator::selectThreadByComm(int64_t TID, StringRef Comm) {
+  // Threads usually start with the name of the process and get renamed, so
+  // any of the names of a thread can select it.
+  if (!opts::ThreadComm.empty() && Regex(opts::ThreadComm).match(Comm))
+    SelectedTIDs.insert(TID);
+}
+
+void DataAggregator::selectThreadByComm(StringRef Line) {
+  // The event is printed as "PERF_RECORD_COMM[ exec]: <comm>:<pid>/<tid>".
+  const auto Pos = Line.find("PERF_RECORD_COMM");
+  if (Pos == StringRef::npos)
+    return;
+  const auto CommPos = Line.find(": ", Pos);
+  if (CommPos == StringRef::npos)
+    return;
+  StringRef Comm, IDs;
+  std::tie(Comm, IDs) = Line.substr(CommPos + 2).rsplit(':');
+  int64_t TID;
+  if (IDs.split('/').second.trim().getAsInteger(10, TID))
+    return;
+  selectThreadByComm(TID, Comm);
+}
+
+uint64_t DataAggregator::getThreadWeight(int64_t TID) const {
+  if (!hasThreadSelection())
+    return 1;
+  if (SelectedTIDs.count(TID))
+    return std::max(1u, opts::SelectedThreadWeight.getValue());
+  return opts::SelectedThreadWeight ? 1 : 0;
+}
+
+void DataAggregator::reportThreads() const {
+  if (!hasThreadSelection())
+    return;
+  if (SelectedTIDs.empty()) {
+    errs() << "PERF2BOLT-WARNING: no threads matched -tid or -thread-comm\n";
+    return;
+  }
+  outs() << "PERF2BOLT: Selected " << SelectedTIDs.size() << " thread(s)";
+  if (opts::SelectedThreadWeight)
+    outs() << ", their samples are counted " << opts::SelectedThreadWeight
+           << " times";
+  else
+    outs() << ", samples of other threads are skipped";
+  outs() << "\n";
 }
 
 Optional<std::pair<StringRef, StringRef>>
@@ -1084,73 +2597,56 @@ DataAggregator::getFileNameForBuildID(StringRef FileBuildID) {
 }
 
 std::error_code DataAggregator::writeAggregatedFile() const {
+  return writeAggregatedFile(OutputFDataName);
+}
+
+std::error_code
+DataAggregator::writeAggregatedFile(StringRef OutputFileName) const {
+  if (opts::CompressedFData && !zlib::isAvailable()) {
+    errs() << "PERF2BOLT-ERROR: zlib is required for -compressed-fdata\n";
+    return make_error_code(llvm::errc::not_supported);
+  }
+
   std::error_code EC;
-  raw_fd_ostream OutFile(OutputFDataName, EC, sys::fs::OpenFlags::F_None);
+  raw_fd_ostream OutFile(OutputFileName, EC, sys::fs::OpenFlags::F_None);
   if (EC)
     return EC;
 
-  bool WriteMemLocs = false;
-
-  auto writeLocation = [&OutFile,&WriteMemLocs](const Location &Loc) {
-    if (WriteMemLocs)
-      OutFile << (Loc.IsSymbol ? "4 " : "3 ");
-    else
-      OutFile << (Loc.IsSymbol ? "1 " : "0 ");
-    OutFile << (Loc.Name.empty() ? "[unknown]" : Loc.Name)  << " "
-            << Twine::utohexstr(Loc.Offset)
-            << FieldSeparator;
-  };
-
-  uint64_t BranchValues{0};
-  uint64_t MemValues{0};
-
-  if (opts::BasicAggregation) {
-    OutFile << "no_lbr";
-    for (const auto &Entry : EventNames) {
-      OutFile << " " << Entry.getKey();
-    }
-    OutFile << "\n";
-
-    for (const auto &Func : FuncsToSamples) {
-      for (const auto &SI : Func.getValue().Data) {
-        writeLocation(SI.Loc);
-        OutFile << SI.Hits << "\n";
-        ++BranchValues;
-      }
-    }
+  if ((opts::BinaryFData || opts::CompressedFData) &&
+      !FuncsToTemporal.empty())
+    errs() << "PERF2BOLT-WARNING: times of samples are not written to "
+              "binary fdata\n";
+
+  // Aggregation continues after a snapshot is written, so a pruned copy of
+  // the profile is written instead.
+  const DataReader *Profile = this;
+  std::unique_ptr<DataReader> PrunedProfile;
+  if (opts::PruneMinCount || opts::PruneRatio > 0) {
+    PrunedProfile = llvm::make_unique<DataReader>(Diag);
+    PrunedProfile->mergeProfile(*this);
+    uint64_t NumRecords;
+    uint64_t NumFunctions;
+    std::tie(NumRecords, NumFunctions) =
+      PrunedProfile->pruneProfile(opts::PruneMinCount, opts::PruneRatio);
+    outs() << "PERF2BOLT: pruned " << NumRecords << " records and "
+           << NumFunctions << " functions\n";
+    Profile = PrunedProfile.get();
+  }
+
+  uint64_t BranchValues;
+  uint64_t MemValues;
+  if (opts::CompressedFData) {
+    std::tie(BranchValues, MemValues) =
+      Profile->writeCompressedProfile(OutFile,
+                                      opts::CompressedFDataBlockRecords);
   } else {
-    for (const auto &Func : FuncsToBranches) {
-      for (const auto &BI : Func.getValue().Data) {
-        writeLocation(BI.From);
-        writeLocation(BI.To);
-        OutFile << BI.Mispreds << " " << BI.Branches << "\n";
-        ++BranchValues;
-      }
-      for (const auto &BI : Func.getValue().EntryData) {
-        // Do not output if source is a known symbol, since this was already
-        // accounted for in the source function
-        if (BI.From.IsSymbol)
-          continue;
-        writeLocation(BI.From);
-        writeLocation(BI.To);
-        OutFile << BI.Mispreds << " " << BI.Branches << "\n";
-        ++BranchValues;
-      }
-    }
-
-    WriteMemLocs = true;
-    for (const auto &Func : FuncsToMemEvents) {
-      for (const auto &MemEvent : Func.getValue().Data) {
-        writeLocation(MemEvent.Offset);
-        writeLocation(MemEvent.Addr);
-        OutFile << MemEvent.Count << "\n";
-        ++MemValues;
-      }
-    }
+    std::tie(BranchValues, MemValues) = opts::BinaryFData
+      ? Profile->writeBinaryProfile(OutFile)
+      : Profile->writeProfile(OutFile);
   }
 
   outs() << "PERF2BOLT: Wrote " << BranchValues << " objects and "
-         << MemValues << " memory objects to " << OutputFDataName << "\n";
+         << MemValues << " memory objects to " << OutputFileName << "\n";
 
   return std::error_code();
 }
@@ -15,12 +15,17 @@
 #ifndef LLVM_TOOLS_LLVM_BOLT_DATA_AGGREGATOR_H
 #define LLVM_TOOLS_LLVM_BOLT_DATA_AGGREGATOR_H
 
+#include "BoltAddressTranslation.h"
+#include "ConcurrentCountMap.h"
 #include "DataReader.h"
+#include "PerfDataReader.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/Program.h"
 #include <map>
+#include <vector>
 
 namespace llvm {
 namespace bolt {
@@ -30,11 +35,20 @@ class BinaryContext;
 
 struct PerfBranchSample {
   SmallVector<LBREntry, 16> LBR;
+
+  /// Number of times the branches of the sample are counted.
+  uint64_t Weight{1};
+
+  /// Time of the sample in nanoseconds, 0 if not recorded.
+  uint64_t Time{0};
 };
 
 struct PerfBasicSample {
   StringRef EventName;
   uint64_t PC;
+
+  /// Time of the sample in nanoseconds, 0 if not recorded.
+  uint64_t Time{0};
 };
 
 struct PerfMemSample {
@@ -42,6 +56,109 @@ struct PerfMemSample {
   uint64_t Addr;
 };
 
+/// Branches and traces collected from LBR samples before they are attributed
+/// to functions. Used to aggregate parts of perf script output independently.
+struct LBRAggregate {
+  struct BranchCount {
+    uint64_t Count{0};
+    uint64_t Mispreds{0};
+    uint64_t Cycles{0};
+  };
+
+  /// Branch counts indexed by (From, To) addresses.
+  DenseMap<std::pair<uint64_t, uint64_t>, BranchCount> Branches;
+
+  /// Counts of fall-through traces between two consecutive LBR entries First
+  /// and Second, indexed by (First.From, (First.To, Second.From)).
+  DenseMap<std::pair<uint64_t, std::pair<uint64_t, uint64_t>>, uint64_t>
+    Traces;
+
+  /// Address ranges [Start, End) of the functions of the binary, sorted by
+  /// address. Call contexts are only collected when the ranges are set.
+  const std::vector<std::pair<uint64_t, uint64_t>> *FunctionRanges{nullptr};
+
+  /// Counts of branches taken in a function after a call into it, indexed
+  /// by (CallSite, (From, To)). Calls into the function are counted with
+  /// From equal to CallSite, calls out of it with To outside the function.
+  DenseMap<std::pair<uint64_t, std::pair<uint64_t, uint64_t>>, BranchCount>
+    ContextBranches;
+
+  /// Counts of fall-through traces in a function after a call into it,
+  /// indexed by (CallSite, (First.To, Second.From)).
+  DenseMap<std::pair<uint64_t, std::pair<uint64_t, uint64_t>>, uint64_t>
+    ContextTraces;
+
+  /// Times of the first and the last sample with a branch to an address,
+  /// indexed by the address. Only collected from samples with a time.
+  DenseMap<uint64_t, std::pair<uint64_t, uint64_t>> TouchTimes;
+
+  /// Counts of branches to an address per time bucket, indexed by
+  /// (Address, Bucket).
+  DenseMap<std::pair<uint64_t, uint64_t>, uint64_t> TouchBuckets;
+
+  uint64_t NumSamples{0};
+  uint64_t NumEntries{0};
+  uint64_t NumTraces{0};
+
+  /// Count all branches and traces of LBR \p Sample, each as many times as
+  /// the weight of the sample.
+  void addSample(const PerfBranchSample &Sample);
+
+  /// Count the branches and traces of \p Sample taken in functions entered
+  /// by a call recorded in the same sample, together with the call site.
+  /// Requires FunctionRanges.
+  void addCallContexts(const PerfBranchSample &Sample);
+
+  /// Record the time of \p Sample for the targets of its branches.
+  void addSampleTime(const PerfBranchSample &Sample);
+
+  /// Multiply all counts by \p Factor.
+  void scale(double Factor);
+
+  /// Add all counts of \p Other to this aggregate.
+  void merge(const LBRAggregate &Other);
+};
+
+/// Branch and trace counts shared by all threads parsing perf script output.
+/// Counts are bumped in place, so no per-thread copies need to be merged.
+/// Only the keys that do not fit into the tables go to per-chunk
+/// LBRAggregate instances.
+struct SharedLBRAggregate {
+  /// Branch counts indexed by (From, To) addresses.
+  ConcurrentCountMap<std::pair<uint64_t, uint64_t>> Branches;
+
+  /// Counts of fall-through traces indexed as in LBRAggregate::Traces.
+  ConcurrentCountMap<std::pair<uint64_t, std::pair<uint64_t, uint64_t>>>
+    Traces;
+
+  explicit SharedLBRAggregate(size_t MaxKeys)
+    : Branches(MaxKeys), Traces(MaxKeys) {}
+};
+
+/// Samples of a perf.data file split between the binaries they were taken
+/// in, so that the profiles of several binaries, e.g. an executable and its
+/// shared libraries, are aggregated from a single pass over the file.
+/// Addresses are converted to virtual addresses of the binary they fall in,
+/// using the executable mappings recorded in the file.
+struct PerfBatch {
+  struct BinarySamples {
+    LBRAggregate Branches;
+    std::vector<PerfBasicSample> BasicSamples;
+    std::vector<PerfMemSample> MemSamples;
+  };
+
+  /// Reader of the file, which owns the event names of the samples.
+  std::unique_ptr<PerfDataReader> Reader;
+
+  /// Samples of each binary, in the order the binaries were given.
+  std::vector<BinarySamples> Binaries;
+
+  /// Read \p PerfDataFilename and split its samples between the binaries in
+  /// \p BinaryFilenames, matched to mappings by file name.
+  static ErrorOr<std::unique_ptr<PerfBatch>>
+  create(StringRef PerfDataFilename, ArrayRef<std::string> BinaryFilenames);
+};
+
 /// DataAggregator inherits all parsing logic from DataReader as well as
 /// its data structures used to represent aggregated profile data in memory.
 ///
@@ -49,6 +166,8 @@ struct PerfMemSample {
 /// read perf samples and perf task annotations. Later, we read the output
 /// files to extract information about which PID was used for this binary.
 /// With the PID, we filter the samples and extract all LBR entries.
+/// Alternatively, with -native-perf-reader the same information is decoded
+/// from perf.data by PerfDataReader without running perf.
 ///
 /// To aggregate LBR entries, we rely on a BinaryFunction map to locate the
 /// original function where the event happened. Then, we convert a raw address
@@ -75,6 +194,19 @@ class DataAggregator : public DataReader {
   SmallVector<char, 256> PerfTasksOutputPath;
   SmallVector<char, 256> PerfTasksErrPath;
 
+  /// Read end of the named pipe perf script writes branch events to when
+  /// they are streamed, or -1.
+  int BranchEventsFD{-1};
+
+  /// Reader of perf.data used instead of perf script subprocesses when the
+  /// file is read natively.
+  std::unique_ptr<PerfDataReader> PerfReader;
+
+  /// Samples of this binary when they were read together with the samples of
+  /// other binaries.
+  const PerfBatch *Batch{nullptr};
+  unsigned BatchIndex{0};
+
   /// Whether aggregator was scheduled to run
   bool Enabled{false};
 
@@ -87,12 +219,26 @@ class DataAggregator : public DataReader {
   /// Our sampled binary name to look for in perf.data
   std::string BinaryName;
 
+  /// Build-id of the input binary, if it has one
+  std::string BinaryBuildID;
+
   DenseSet<int64_t> PIDs;
 
+  /// Threads selected with -tid and -thread-comm.
+  DenseSet<int64_t> SelectedTIDs;
+
   /// References to core BOLT data structures
   BinaryContext *BC{nullptr};
   std::map<uint64_t, BinaryFunction> *BFs{nullptr};
 
+  /// Address translation table of a binary rewritten by BOLT with
+  /// -enable-bat. Samples are attributed to the input of that run.
+  std::unique_ptr<BoltAddressTranslation> BAT;
+
+  /// Address ranges of all functions, for LBRAggregate::FunctionRanges.
+  /// Empty unless call contexts are needed to clone functions.
+  std::vector<std::pair<uint64_t, uint64_t>> FunctionRanges;
+
   /// Aggregation statistics
   uint64_t NumInvalidTraces{0};
   uint64_t NumLongRangeTraces{0};
@@ -123,29 +269,54 @@ class DataAggregator : public DataReader {
   /// disassembled BinaryFunctions
   BinaryFunction *getBinaryFunctionContainingAddress(uint64_t Address);
 
+  /// Same as getBinaryFunctionContainingAddress(), but with an address
+  /// translation table map \p Address to the input of the BOLT run first:
+  /// return the function the code came from and set \p Address to the
+  /// input offset of the code plus the address of the function. If
+  /// \p IsBranchSrc is set, the address is the source of a branch.
+  BinaryFunction *getInputFunctionContainingAddress(uint64_t &Address,
+                                                    bool IsBranchSrc);
+
   /// Semantic actions - parser hooks to interpret parsed perf samples
   /// Register a sample (non-LBR mode), i.e. a new hit at \p Address
   bool doSample(BinaryFunction &Func, const uint64_t Address);
 
-  /// Register an intraprocedural branch \p Branch.
-  bool doIntraBranch(BinaryFunction &Func, const LBREntry &Branch);
+  /// Register an intraprocedural branch from address \p From to address \p To
+  /// taken \p Count times and mispredicted \p Mispreds times, with \p Cycles
+  /// cycles in total recorded by LBR since the previous taken branches.
+  bool doIntraBranch(BinaryFunction &Func, uint64_t From, uint64_t To,
+                     uint64_t Count, uint64_t Mispreds, uint64_t Cycles = 0);
 
   /// Register an interprocedural branch from \p FromFunc to \p ToFunc with
-  /// offsets \p From and \p To, respectively.
+  /// addresses \p From and \p To, respectively.
   bool doInterBranch(BinaryFunction *FromFunc, BinaryFunction *ToFunc,
-                     const LBREntry &Branch);
+                     uint64_t From, uint64_t To, uint64_t Count,
+                     uint64_t Mispreds);
 
-  /// Register a \p Branch.
-  bool doBranch(const LBREntry &Branch);
+  /// Register a branch from \p From to \p To taken \p Count times. Cycles
+  /// are only kept for branches within a function.
+  bool doBranch(uint64_t From, uint64_t To, uint64_t Count, uint64_t Mispreds,
+                uint64_t Cycles = 0);
 
-  /// Register a trace between two LBR entries supplied in execution order.
-  bool doTrace(const LBREntry &First, const LBREntry &Second);
+  /// Register a trace between two LBR entries supplied in execution order
+  /// that was observed \p Count times.
+  bool doTrace(const LBREntry &First, const LBREntry &Second,
+               uint64_t Count = 1);
 
   /// Parser helpers
   /// Return false if we exhausted our parser buffer and finished parsing
   /// everything
   bool hasData();
 
+  /// Parse the PID field at the start of a sample, followed by the TID when
+  /// threads are selected, and return the weight of the sample. Samples of
+  /// other binaries and of threads that are not selected have weight 0.
+  ErrorOr<uint64_t> parseSampleWeight();
+
+  /// Parse the time field of a sample, printed by perf script in seconds
+  /// followed by a colon, and return it in nanoseconds.
+  ErrorOr<uint64_t> parseSampleTime();
+
   /// Parse a single perf sample containing a PID associated with a sequence of
   /// LBR entries
   ErrorOr<PerfBranchSample> parseBranchSample();
@@ -169,7 +340,84 @@ class DataAggregator : public DataReader {
   ErrorOr<LBREntry> parseLBREntry();
 
   /// Parse the full output generated by perf script to report LBR samples.
-  std::error_code parseBranchEvents();
+  /// If \p FD is not -1, the output is read from the file descriptor instead
+  /// of the parsing buffer.
+  std::error_code parseBranchEvents(int FD = -1);
+
+  /// Parse LBR samples in \p Chunk of perf script output and add them to
+  /// \p Shared. Counts that do not fit into \p Shared, and the numbers of
+  /// samples, entries and traces, are added to \p Aggregate. Does not modify
+  /// the state of the aggregator, and could be called from multiple threads.
+  std::error_code parseBranchEventsChunk(StringRef Chunk,
+                                         SharedLBRAggregate &Shared,
+                                         LBRAggregate &Aggregate) const;
+
+  /// Split perf script output into line-aligned chunks and aggregate them on
+  /// the thread pool. The output is read from the file descriptor \p FD if
+  /// it is not -1, or taken from the parsing buffer otherwise. Return the
+  /// aggregated counts in \p Shared and \p Aggregate.
+  std::error_code parseBranchEventsInChunks(int FD, SharedLBRAggregate &Shared,
+                                            LBRAggregate &Aggregate);
+
+  /// Attribute counts of \p Aggregate, and of \p Shared if given, to
+  /// functions. Every unique branch and trace is processed once.
+  void processLBRAggregate(const LBRAggregate &Aggregate,
+                           const SharedLBRAggregate *Shared = nullptr);
+
+  /// Attribute the call contexts of \p Aggregate to the profiles of the
+  /// called functions for each of their callers.
+  void processCallContexts(const LBRAggregate &Aggregate);
+
+  /// Attribute the times of samples in \p Aggregate to functions.
+  void processTemporalData(const LBRAggregate &Aggregate);
+
+  /// Add the times of samples in \p Data to the profile of \p Func.
+  void recordTemporalData(BinaryFunction &Func, const FuncTemporalData &Data);
+
+  /// Print statistics of aggregated LBR samples.
+  void printBranchStats(uint64_t NumSamples, uint64_t NumEntries,
+                        uint64_t NumTraces) const;
+
+  /// Report that branch counts were multiplied by \p Scale to make up for
+  /// skipped samples, and the expected error of counts of hot functions.
+  void printDownsamplingStats(double Scale) const;
+
+  /// Register non-LBR \p Sample. Return false if it is outside of known
+  /// functions.
+  bool processBasicSample(const PerfBasicSample &Sample);
+
+  /// Print statistics of aggregated non-LBR samples.
+  void printBasicStats(uint64_t NumSamples, uint64_t OutOfRangeSamples) const;
+
+  /// Register memory event \p Sample.
+  void processMemSample(const PerfMemSample &Sample);
+
+  /// Report the PIDs associated with the input binary.
+  void reportPIDs() const;
+
+  /// Return true if samples are filtered or weighted by thread.
+  static bool hasThreadSelection();
+
+  /// Select thread \p TID if \p Comm matches -thread-comm.
+  void selectThreadByComm(int64_t TID, StringRef Comm);
+
+  /// Look for a thread name in a PERF_RECORD_COMM \p Line of perf script
+  /// output.
+  void selectThreadByComm(StringRef Line);
+
+  /// Return the number of times samples of thread \p TID are counted, 0 if
+  /// they are skipped.
+  uint64_t getThreadWeight(int64_t TID) const;
+
+  /// Report the threads selected to aggregate samples from.
+  void reportThreads() const;
+
+  /// Mark functions with registered events as having a valid profile.
+  void markProfiledFunctions();
+
+  /// Read tasks, samples and memory events straight from perf.data with
+  /// PerfReader and aggregate them.
+  std::error_code parsePerfData();
 
   /// Parse the full output generated by perf script to report non-LBR samples.
   std::error_code parseBasicEvents();
@@ -193,6 +441,24 @@ class DataAggregator : public DataReader {
   /// and return a file name matching a given \p FileBuildID.
   Optional<StringRef> getFileNameForBuildID(StringRef FileBuildID);
 
+  /// Check \p FileName found in perf data for the build-id of the input
+  /// binary, and use it as the binary name if it differs. Exit if there is no
+  /// match unless -ignore-build-id is specified.
+  void checkFileNameForBuildID(Optional<StringRef> FileName);
+
+  /// Aggregate the samples of this binary taken from Batch.
+  void processBatchSamples();
+
+  /// Add samples from perf.data file \p FileName to the aggregated profile
+  /// unless the file was recorded for a different build of the binary.
+  std::error_code aggregatePerfDataFile(StringRef FileName);
+
+  /// Dump aggregated data into \p OutputFileName
+  std::error_code writeAggregatedFile(StringRef OutputFileName) const;
+
+  /// Atomically replace the output file with the current aggregated data
+  std::error_code writeSnapshot() const;
+
 public:
   DataAggregator(raw_ostream &Diag, StringRef BinaryName)
       : DataReader(Diag), BinaryName(llvm::sys::path::filename(BinaryName)) {}
@@ -204,6 +470,11 @@ public:
   /// with a list of disassembled functions.
   void start(StringRef PerfDataFilename);
 
+  /// Aggregate the samples of binary \p Index of \p Batch, which was read
+  /// from \p PerfDataFilename, instead of reading the file again.
+  void startBatch(StringRef PerfDataFilename, const PerfBatch &Batch,
+                  unsigned Index);
+
   /// True if DataAggregator has asynchronously been started and an aggregation
   /// job is in progress
   bool started() const { return Enabled; }
@@ -214,6 +485,12 @@ public:
   /// Dump data structures into a file readable by llvm-bolt
   std::error_code writeAggregatedFile() const;
 
+  /// If -watch-dir is specified, keep aggregating perf.data files that
+  /// appear in the directory on top of the data already aggregated, writing
+  /// the profile on request, until the process is asked to stop. Must be
+  /// called after "aggregate".
+  void watchForPerfData();
+
   /// Join child subprocesses and finalize aggregation populating data
   /// structures
   bool aggregate(BinaryContext &BC, std::map<uint64_t, BinaryFunction> &BFs);
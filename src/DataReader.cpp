@@ -14,7 +14,16 @@
 
 
 #include "DataReader.h"
+#include "TextScanner.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/Compression.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include <map>
 
 namespace llvm {
@@ -39,6 +48,11 @@ StringRef normalizeName(StringRef Name) {
   return Name.startswith("PG.") ? Name.substr(2) : Name;
 }
 
+/// Return the name of a function as written to a binary profile.
+StringRef getWrittenName(StringRef Name) {
+  return Name.empty() ? StringRef("[unknown]") : Name;
+}
+
 } // anonymous namespace
 
 raw_ostream &operator<<(raw_ostream &OS, const Location &Loc) {
@@ -129,52 +143,67 @@ void FuncSampleData::bumpCount(uint64_t Offset) {
   ++SI.Hits;
 }
 
+void FuncTemporalData::addSample(uint64_t Time, uint64_t Count,
+                                 uint64_t BucketSize) {
+  FirstTime = std::min(FirstTime, Time);
+  LastTime = std::max(LastTime, Time);
+  Buckets[BucketSize ? Time / BucketSize : 0] += Count;
+}
+
+void FuncTemporalData::merge(const FuncTemporalData &Other) {
+  FirstTime = std::min(FirstTime, Other.FirstTime);
+  LastTime = std::max(LastTime, Other.LastTime);
+  for (const auto &Bucket : Other.Buckets)
+    Buckets[Bucket.first] += Bucket.second;
+}
+
 void FuncBranchData::bumpBranchCount(uint64_t OffsetFrom, uint64_t OffsetTo,
-                                     bool Mispred) {
-  auto Iter = IntraIndex[OffsetFrom].find(OffsetTo);
-  if (Iter == IntraIndex[OffsetFrom].end()) {
+                                     uint64_t Count, uint64_t Mispreds,
+                                     uint64_t Cycles) {
+  auto Res = IntraIndex.insert(
+      std::make_pair(std::make_pair(OffsetFrom, OffsetTo), Data.size()));
+  if (Res.second) {
     Data.emplace_back(Location(true, Name, OffsetFrom),
-                      Location(true, Name, OffsetTo), Mispred, 1);
-    IntraIndex[OffsetFrom][OffsetTo] = Data.size() - 1;
+                      Location(true, Name, OffsetTo), Mispreds, Count, Cycles);
     return;
   }
-  auto &BI = Data[Iter->second];
-  ++BI.Branches;
-  if (Mispred)
-    ++BI.Mispreds;
+  auto &BI = Data[Res.first->second];
+  BI.Branches += Count;
+  BI.Mispreds += Mispreds;
+  BI.Cycles += Cycles;
 }
 
 void FuncBranchData::bumpCallCount(uint64_t OffsetFrom, const Location &To,
-                                   bool Mispred) {
-  auto Iter = InterIndex[OffsetFrom].find(To);
-  if (Iter == InterIndex[OffsetFrom].end()) {
-    Data.emplace_back(Location(true, Name, OffsetFrom), To, Mispred, 1);
-    InterIndex[OffsetFrom][To] = Data.size() - 1;
+                                   uint64_t Count, uint64_t Mispreds) {
+  auto Res = InterIndex.insert(
+      std::make_pair(std::make_pair(OffsetFrom, To), Data.size()));
+  if (Res.second) {
+    Data.emplace_back(Location(true, Name, OffsetFrom), To, Mispreds, Count);
     return;
   }
-  auto &BI = Data[Iter->second];
-  ++BI.Branches;
-  if (Mispred)
-    ++BI.Mispreds;
+  auto &BI = Data[Res.first->second];
+  BI.Branches += Count;
+  BI.Mispreds += Mispreds;
 }
 
 void FuncBranchData::bumpEntryCount(const Location &From, uint64_t OffsetTo,
-                                    bool Mispred) {
-  auto Iter = EntryIndex[OffsetTo].find(From);
-  if (Iter == EntryIndex[OffsetTo].end()) {
-    EntryData.emplace_back(From, Location(true, Name, OffsetTo), Mispred, 1);
-    EntryIndex[OffsetTo][From] = EntryData.size() - 1;
+                                    uint64_t Count, uint64_t Mispreds) {
+  auto Res = EntryIndex.insert(
+      std::make_pair(std::make_pair(OffsetTo, From), EntryData.size()));
+  if (Res.second) {
+    EntryData.emplace_back(From, Location(true, Name, OffsetTo), Mispreds,
+                           Count);
     return;
   }
-  auto &BI = EntryData[Iter->second];
-  ++BI.Branches;
-  if (Mispred)
-    ++BI.Mispreds;
+  auto &BI = EntryData[Res.first->second];
+  BI.Branches += Count;
+  BI.Mispreds += Mispreds;
 }
 
 void BranchInfo::mergeWith(const BranchInfo &BI) {
   Branches += BI.Branches;
   Mispreds += BI.Mispreds;
+  Cycles += BI.Cycles;
 }
 
 void BranchInfo::print(raw_ostream &OS) const {
@@ -182,7 +211,10 @@ void BranchInfo::print(raw_ostream &OS) const {
      << Twine::utohexstr(From.Offset) << " "
      << To.IsSymbol << " " << To.Name << " "
      << Twine::utohexstr(To.Offset) << " "
-     << Mispreds << " " << Branches << '\n';
+     << Mispreds << " " << Branches;
+  if (Cycles)
+    OS << " " << Cycles;
+  OS << '\n';
 }
 
 ErrorOr<const BranchInfo &> FuncBranchData::getBranch(uint64_t From,
@@ -293,10 +325,8 @@ bool DataReader::checkAndConsumeNewLine() {
 }
 
 ErrorOr<StringRef> DataReader::parseString(char EndChar, bool EndNl) {
-  std::string EndChars(1, EndChar);
-  if (EndNl)
-    EndChars.push_back('\n');
-  auto StringEnd = ParsingBuf.find_first_of(EndChars);
+  auto StringEnd =
+    TextScanner::findFirstOf(ParsingBuf, EndChar, EndNl ? '\n' : EndChar);
   if (StringEnd == StringRef::npos || StringEnd == 0) {
     reportError("malformed field");
     return make_error_code(llvm::errc::io_error);
@@ -326,7 +356,7 @@ ErrorOr<int64_t> DataReader::parseNumberField(char EndChar, bool EndNl) {
     return EC;
   StringRef NumStr = NumStrRes.get();
   int64_t Num;
-  if (NumStr.getAsInteger(10, Num)) {
+  if (TextScanner::parseDecimal(NumStr, Num)) {
     reportError("expected decimal number");
     Diag << "Found: " << NumStr << "\n";
     return make_error_code(llvm::errc::io_error);
@@ -340,7 +370,7 @@ ErrorOr<uint64_t> DataReader::parseHexField(char EndChar, bool EndNl) {
     return EC;
   StringRef NumStr = NumStrRes.get();
   uint64_t Num;
-  if (NumStr.getAsInteger(16, Num)) {
+  if (TextScanner::parseHex(NumStr, Num)) {
     reportError("expected hexidecimal number");
     Diag << "Found: " << NumStr << "\n";
     return make_error_code(llvm::errc::io_error);
@@ -412,12 +442,23 @@ ErrorOr<BranchInfo> DataReader::parseBranchInfo() {
     return EC;
   int64_t NumBranches = BRes.get();
 
+  // Cycles are only present in profiles aggregated with LBR timing info. The
+  // separator before them has been consumed with the branch count.
+  int64_t NumCycles = 0;
+  if (!ParsingBuf.empty() && ParsingBuf[0] != '\n') {
+    auto CRes = parseNumberField(FieldSeparator, /* EndNl = */ true);
+    if (std::error_code EC = CRes.getError())
+      return EC;
+    NumCycles = CRes.get();
+  }
+
   if (!checkAndConsumeNewLine()) {
     reportError("expected end of line");
     return make_error_code(llvm::errc::io_error);
   }
 
-  return BranchInfo(std::move(From), std::move(To), NumMispreds, NumBranches);
+  return BranchInfo(std::move(From), std::move(To), NumMispreds, NumBranches,
+                    NumCycles);
 }
 
 ErrorOr<MemInfo> DataReader::parseMemInfo() {
@@ -503,43 +544,66 @@ bool DataReader::hasMemData() {
   return false;
 }
 
-std::error_code DataReader::parseInNoLBRMode() {
-  auto GetOrCreateFuncEntry = [&](StringRef Name) {
-    auto I = FuncsToSamples.find(Name);
-    if (I == FuncsToSamples.end()) {
-      bool success;
-      std::tie(I, success) = FuncsToSamples.insert(std::make_pair(
-          Name, FuncSampleData(Name, FuncSampleData::ContainerTy())));
+std::error_code DataReader::parseTemporalData() {
+  if (!ParsingBuf.startswith("temporal "))
+    return std::error_code();
+  ParsingBuf = ParsingBuf.drop_front(9);
+  Col += 9;
 
-      assert(success && "unexpected result of insert");
+  auto BucketSizeRes = parseNumberField(FieldSeparator, true);
+  if (std::error_code EC = BucketSizeRes.getError())
+    return EC;
+  TemporalBucketSize = BucketSizeRes.get();
+  if (!checkAndConsumeNewLine()) {
+    reportError("malformed temporal line");
+    return make_error_code(llvm::errc::io_error);
+  }
+
+  // Times are stored relative to the first sample of the profile, which is
+  // kept at zero here as only the differences between times are meaningful.
+  while (ParsingBuf.startswith("t ")) {
+    ParsingBuf = ParsingBuf.drop_front(2);
+    Col += 2;
+
+    auto NameRes = parseString(FieldSeparator);
+    if (std::error_code EC = NameRes.getError())
+      return EC;
+    auto FirstRes = parseNumberField(FieldSeparator);
+    if (std::error_code EC = FirstRes.getError())
+      return EC;
+    auto LastRes = parseNumberField(FieldSeparator, true);
+    if (std::error_code EC = LastRes.getError())
+      return EC;
+
+    auto &Data = FuncsToTemporal[NameRes.get()];
+    Data.FirstTime = std::min<uint64_t>(Data.FirstTime, FirstRes.get());
+    Data.LastTime = std::max<uint64_t>(Data.LastTime, LastRes.get());
+    while (ParsingBuf.size() > 0 && ParsingBuf[0] != '\n') {
+      auto BucketRes = parseNumberField(':');
+      if (std::error_code EC = BucketRes.getError())
+        return EC;
+      auto CountRes = parseNumberField(FieldSeparator, true);
+      if (std::error_code EC = CountRes.getError())
+        return EC;
+      Data.Buckets[BucketRes.get()] += CountRes.get();
     }
-    return I;
-  };
 
-  auto GetOrCreateFuncMemEntry = [&](StringRef Name) {
-    auto I = FuncsToMemEvents.find(Name);
-    if (I == FuncsToMemEvents.end()) {
-      bool success;
-      std::tie(I, success) = FuncsToMemEvents.insert(
-          std::make_pair(Name, FuncMemData(Name, FuncMemData::ContainerTy())));
-      assert(success && "unexpected result of insert");
+    if (!checkAndConsumeNewLine()) {
+      reportError("expected end of line");
+      return make_error_code(llvm::errc::io_error);
     }
-    return I;
-  };
+  }
 
+  return std::error_code();
+}
+
+std::error_code DataReader::parseInNoLBRMode() {
   while (hasBranchData()) {
     auto Res = parseSampleInfo();
     if (std::error_code EC = Res.getError())
       return EC;
 
-    SampleInfo SI = Res.get();
-
-    // Ignore samples not involving known locations
-    if (!SI.Loc.IsSymbol)
-      continue;
-
-    auto I = GetOrCreateFuncEntry(SI.Loc.Name);
-    I->getValue().Data.emplace_back(std::move(SI));
+    addSampleRecord(Res.get());
   }
 
   while (hasMemData()) {
@@ -547,53 +611,22 @@ std::error_code DataReader::parseInNoLBRMode() {
     if (std::error_code EC = Res.getError())
       return EC;
 
-    MemInfo MI = Res.get();
-
-    // Ignore memory events not involving known pc.
-    if (!MI.Offset.IsSymbol)
-      continue;
-
-    auto I = GetOrCreateFuncMemEntry(MI.Offset.Name);
-    I->getValue().Data.emplace_back(std::move(MI));
+    addMemRecord(Res.get());
   }
 
-  for (auto &FuncSamples : FuncsToSamples) {
-    std::stable_sort(FuncSamples.second.Data.begin(),
-                     FuncSamples.second.Data.end());
-  }
+  if (std::error_code EC = parseTemporalData())
+    return EC;
 
-  for (auto &MemEvents : FuncsToMemEvents) {
-    std::stable_sort(MemEvents.second.Data.begin(),
-                     MemEvents.second.Data.end());
-  }
+  sortRecords();
 
   return std::error_code();
 }
 
 std::error_code DataReader::parse() {
-  auto GetOrCreateFuncEntry = [&](StringRef Name) {
-    auto I = FuncsToBranches.find(Name);
-    if (I == FuncsToBranches.end()) {
-      bool success;
-      std::tie(I, success) = FuncsToBranches.insert(
-          std::make_pair(Name, FuncBranchData(Name,
-                                              FuncBranchData::ContainerTy(),
-                                              FuncBranchData::ContainerTy())));
-      assert(success && "unexpected result of insert");
-    }
-    return I;
-  };
-
-  auto GetOrCreateFuncMemEntry = [&](StringRef Name) {
-    auto I = FuncsToMemEvents.find(Name);
-    if (I == FuncsToMemEvents.end()) {
-      bool success;
-      std::tie(I, success) = FuncsToMemEvents.insert(
-          std::make_pair(Name, FuncMemData(Name, FuncMemData::ContainerTy())));
-      assert(success && "unexpected result of insert");
-    }
-    return I;
-  };
+  if (isBinaryProfile(ParsingBuf))
+    return parseBinary();
+  if (isCompressedProfile(ParsingBuf))
+    return parseCompressed();
 
   Col = 0;
   Line = 1;
@@ -609,60 +642,1005 @@ std::error_code DataReader::parse() {
     if (std::error_code EC = Res.getError())
       return EC;
 
-    BranchInfo BI = Res.get();
+    addBranchRecord(Res.get());
+  }
 
-    // Ignore branches not involving known location.
-    if (!BI.From.IsSymbol && !BI.To.IsSymbol)
-      continue;
+  while (hasMemData()) {
+    auto Res = parseMemInfo();
+    if (std::error_code EC = Res.getError())
+      return EC;
 
-    auto I = GetOrCreateFuncEntry(BI.From.Name);
-    I->getValue().Data.emplace_back(std::move(BI));
+    addMemRecord(Res.get());
+  }
 
-    // Add entry data for branches to another function or branches
-    // to entry points (including recursive calls)
-    if (BI.To.IsSymbol &&
-        (!BI.From.Name.equals(BI.To.Name) || BI.To.Offset == 0)) {
-      I = GetOrCreateFuncEntry(BI.To.Name);
-      I->getValue().EntryData.emplace_back(std::move(BI));
-    }
+  if (std::error_code EC = parseTemporalData())
+    return EC;
+
+  sortRecords();
 
-    // If destination is the function start - update execution count.
-    // NB: the data is skewed since we cannot tell tail recursion from
-    //     branches to the function start.
-    if (BI.To.IsSymbol && BI.To.Offset == 0) {
-      I = GetOrCreateFuncEntry(BI.To.Name);
-      I->getValue().ExecutionCount += BI.Branches;
+  return std::error_code();
+}
+
+void DataReader::setFunctionFilter(std::vector<std::string> FuncNames) {
+  FunctionFilter = std::move(FuncNames);
+  std::sort(FunctionFilter.begin(), FunctionFilter.end());
+}
+
+bool DataReader::isFunctionSelected(StringRef Name) const {
+  return FunctionFilter.empty() ||
+         std::binary_search(FunctionFilter.begin(), FunctionFilter.end(),
+                            getWrittenName(Name));
+}
+
+void DataReader::addBranchRecord(const BranchInfo &BI, bool AddToSource,
+                                 bool AddToTarget) {
+  auto GetOrCreateFuncEntry = [&](StringRef Name) {
+    auto I = FuncsToBranches.find(Name);
+    if (I == FuncsToBranches.end()) {
+      bool success;
+      std::tie(I, success) = FuncsToBranches.insert(
+          std::make_pair(Name, FuncBranchData(Name,
+                                              FuncBranchData::ContainerTy(),
+                                              FuncBranchData::ContainerTy())));
+      assert(success && "unexpected result of insert");
     }
+    return I;
+  };
+
+  // Ignore branches not involving known location.
+  if (!BI.From.IsSymbol && !BI.To.IsSymbol)
+    return;
+
+  if (AddToSource && isFunctionSelected(BI.From.Name)) {
+    auto I = GetOrCreateFuncEntry(BI.From.Name);
+    I->getValue().Data.emplace_back(BI);
   }
 
-  while (hasMemData()) {
-    auto Res = parseMemInfo();
-    if (std::error_code EC = Res.getError())
-      return EC;
+  if (!AddToTarget || !isFunctionSelected(BI.To.Name))
+    return;
 
-    MemInfo MI = Res.get();
+  // Add entry data for branches to another function or branches
+  // to entry points (including recursive calls)
+  if (BI.To.IsSymbol &&
+      (!BI.From.Name.equals(BI.To.Name) || BI.To.Offset == 0)) {
+    auto I = GetOrCreateFuncEntry(BI.To.Name);
+    I->getValue().EntryData.emplace_back(BI);
+  }
 
-    // Ignore memory events not involving known pc.
-    if (!MI.Offset.IsSymbol)
-      continue;
+  // If destination is the function start - update execution count.
+  // NB: the data is skewed since we cannot tell tail recursion from
+  //     branches to the function start.
+  if (BI.To.IsSymbol && BI.To.Offset == 0) {
+    auto I = GetOrCreateFuncEntry(BI.To.Name);
+    I->getValue().ExecutionCount += BI.Branches;
+  }
+}
+
+void DataReader::addMemRecord(const MemInfo &MI) {
+  // Ignore memory events not involving known pc.
+  if (!MI.Offset.IsSymbol || !isFunctionSelected(MI.Offset.Name))
+    return;
 
-    auto I = GetOrCreateFuncMemEntry(MI.Offset.Name);
-    I->getValue().Data.emplace_back(std::move(MI));
+  auto I = FuncsToMemEvents.find(MI.Offset.Name);
+  if (I == FuncsToMemEvents.end()) {
+    bool success;
+    std::tie(I, success) = FuncsToMemEvents.insert(
+        std::make_pair(MI.Offset.Name,
+                       FuncMemData(MI.Offset.Name,
+                                   FuncMemData::ContainerTy())));
+    assert(success && "unexpected result of insert");
   }
+  I->getValue().Data.emplace_back(MI);
+}
+
+void DataReader::addSampleRecord(const SampleInfo &SI) {
+  // Ignore samples not involving known locations
+  if (!SI.Loc.IsSymbol || !isFunctionSelected(SI.Loc.Name))
+    return;
+
+  auto I = FuncsToSamples.find(SI.Loc.Name);
+  if (I == FuncsToSamples.end()) {
+    bool success;
+    std::tie(I, success) = FuncsToSamples.insert(
+        std::make_pair(SI.Loc.Name,
+                       FuncSampleData(SI.Loc.Name,
+                                      FuncSampleData::ContainerTy())));
+    assert(success && "unexpected result of insert");
+  }
+  I->getValue().Data.emplace_back(SI);
+}
 
+void DataReader::sortRecords() {
   for (auto &FuncBranches : FuncsToBranches) {
     std::stable_sort(FuncBranches.second.Data.begin(),
                      FuncBranches.second.Data.end());
   }
 
+  for (auto &FuncSamples : FuncsToSamples) {
+    std::stable_sort(FuncSamples.second.Data.begin(),
+                     FuncSamples.second.Data.end());
+  }
+
   for (auto &MemEvents : FuncsToMemEvents) {
     std::stable_sort(MemEvents.second.Data.begin(),
                      MemEvents.second.Data.end());
   }
+}
+
+bool DataReader::isBinaryProfile(StringRef Buffer) {
+  return Buffer.startswith(
+      StringRef(fdata::BinaryFDataMagic, sizeof(fdata::BinaryFDataMagic)));
+}
+
+bool DataReader::isCompressedProfile(StringRef Buffer) {
+  return Buffer.startswith(StringRef(fdata::CompressedFDataMagic,
+                                     sizeof(fdata::CompressedFDataMagic)));
+}
+
+namespace {
+
+/// Return a pointer to an array of \p NumElements objects of type T located
+/// at \p Pos in the buffer and advance \p Pos past the array. Return nullptr
+/// if the buffer is too small.
+template <typename T>
+const T *getArray(const uint8_t *BufStart, uint64_t BufSize, uint64_t &Pos,
+                  uint64_t NumElements) {
+  if (Pos > BufSize || NumElements > (BufSize - Pos) / sizeof(T))
+    return nullptr;
+  const auto *Array = reinterpret_cast<const T *>(BufStart + Pos);
+  Pos += NumElements * sizeof(T);
+  return Array;
+}
+
+/// Append sorted records of \p OtherData to sorted records of \p Data and
+/// coalesce records with identical locations.
+template <typename ContainerTy>
+void mergeRecords(ContainerTy &Data, const ContainerTy &OtherData) {
+  if (OtherData.empty())
+    return;
+  const auto Middle = Data.size();
+  Data.insert(Data.end(), OtherData.begin(), OtherData.end());
+  std::inplace_merge(Data.begin(), Data.begin() + Middle, Data.end());
+  auto Last = Data.begin();
+  for (auto I = std::next(Data.begin()), E = Data.end(); I != E; ++I) {
+    if (*Last == *I) {
+      Last->mergeWith(*I);
+      continue;
+    }
+    *++Last = std::move(*I);
+  }
+  Data.erase(std::next(Last), Data.end());
+}
+
+} // anonymous namespace
+
+std::error_code DataReader::parseBinary() {
+  if (auto EC = parseBinaryRecords(ParsingBuf))
+    return EC;
+
+  sortRecords();
 
   return std::error_code();
 }
 
+std::error_code DataReader::parseBinaryRecords(StringRef Buffer,
+                                               StringRef First,
+                                               StringRef Last) {
+  using namespace fdata;
+
+  auto reportMalformed = [&](const Twine &Msg) {
+    Diag << "Error reading binary bolt data input file: " << Msg << '\n';
+    return make_error_code(llvm::errc::io_error);
+  };
+
+  // Branches between functions of different blocks of a compressed profile
+  // are stored in both blocks.
+  auto isInBlock = [&](StringRef Name) {
+    return Last.empty() || (Name >= First && Name <= Last);
+  };
+
+  const auto *BufStart = Buffer.bytes_begin();
+  const uint64_t BufSize = Buffer.size();
+  uint64_t Pos = 0;
+
+  const auto *Header = getArray<BinaryFDataHeader>(BufStart, BufSize, Pos, 1);
+  if (!Header)
+    return reportMalformed("truncated header");
+  if (Header->Version != BinaryFDataVersion)
+    return reportMalformed("unsupported version " +
+                           Twine(uint32_t(Header->Version)));
+
+  const auto *Strings =
+    getArray<BinaryFDataString>(BufStart, BufSize, Pos, Header->NumStrings);
+  const auto *Events =
+    getArray<ulittle32_t>(BufStart, BufSize, Pos, Header->NumEvents);
+  const auto *StringData =
+    getArray<char>(BufStart, BufSize, Pos, Header->StringDataSize);
+  if (!Strings || !Events || !StringData)
+    return reportMalformed("truncated string table");
+  Pos = alignTo(Pos, 8);
+  if (Pos > BufSize)
+    return reportMalformed("truncated string table");
+
+  std::vector<StringRef> StringTable;
+  StringTable.reserve(Header->NumStrings);
+  for (uint32_t I = 0; I < Header->NumStrings; ++I) {
+    const uint64_t Offset = Strings[I].Offset;
+    const uint64_t Size = Strings[I].Size;
+    if (Offset + Size > Header->StringDataSize)
+      return reportMalformed("string out of bounds");
+    StringTable.emplace_back(StringData + Offset, Size);
+  }
+
+  for (uint32_t I = 0; I < Header->NumEvents; ++I) {
+    if (Events[I] >= StringTable.size())
+      return reportMalformed("invalid event name");
+    EventNames.insert(StringTable[Events[I]]);
+  }
+
+  bool IsValid = true;
+  auto getLocation = [&](const BinaryFDataLocation &Loc) {
+    if (Loc.Name >= StringTable.size()) {
+      IsValid = false;
+      return Location(0);
+    }
+    return Location(Loc.IsSymbol, StringTable[Loc.Name], Loc.Offset);
+  };
+
+  NoLBRMode = Header->Flags & BFF_NO_LBR;
+  if (NoLBRMode) {
+    const auto *Samples =
+      getArray<BinaryFDataSample>(BufStart, BufSize, Pos,
+                                   Header->NumBranches);
+    if (!Samples)
+      return reportMalformed("truncated sample records");
+    for (uint64_t I = 0; I < Header->NumBranches; ++I) {
+      const auto Loc = getLocation(Samples[I].Loc);
+      if (isInBlock(Loc.Name))
+        addSampleRecord(SampleInfo(Loc, Samples[I].Hits));
+    }
+  } else {
+    const auto *Branches =
+      getArray<BinaryFDataBranch>(BufStart, BufSize, Pos,
+                                   Header->NumBranches);
+    if (!Branches)
+      return reportMalformed("truncated branch records");
+    for (uint64_t I = 0; I < Header->NumBranches; ++I) {
+      const auto &Branch = Branches[I];
+      const auto From = getLocation(Branch.From);
+      const auto To = getLocation(Branch.To);
+      addBranchRecord(BranchInfo(From, To, Branch.Mispreds, Branch.Branches),
+                      isInBlock(From.Name), isInBlock(To.Name));
+    }
+  }
+
+  const auto *MemEvents =
+    getArray<BinaryFDataMem>(BufStart, BufSize, Pos, Header->NumMemEvents);
+  if (!MemEvents)
+    return reportMalformed("truncated memory records");
+  for (uint64_t I = 0; I < Header->NumMemEvents; ++I) {
+    const auto Offset = getLocation(MemEvents[I].Offset);
+    if (isInBlock(Offset.Name)) {
+      addMemRecord(MemInfo(Offset, getLocation(MemEvents[I].Addr),
+                           MemEvents[I].Count));
+    }
+  }
+
+  if (!IsValid)
+    return reportMalformed("invalid name index");
+
+  return std::error_code();
+}
+
+std::error_code DataReader::parseCompressed() {
+  using namespace fdata;
+
+  auto reportMalformed = [&](const Twine &Msg) {
+    Diag << "Error reading compressed bolt data input file: " << Msg << '\n';
+    return make_error_code(llvm::errc::io_error);
+  };
+
+  if (!zlib::isAvailable())
+    return reportMalformed("zlib is not available");
+
+  const auto *BufStart = ParsingBuf.bytes_begin();
+  const uint64_t BufSize = ParsingBuf.size();
+  if (BufSize < sizeof(CompressedFDataMagic) + sizeof(CompressedFDataFooter))
+    return reportMalformed("truncated footer");
+
+  uint64_t Pos = BufSize - sizeof(CompressedFDataFooter);
+  const auto *Footer =
+    getArray<CompressedFDataFooter>(BufStart, BufSize, Pos, 1);
+  if (memcmp(Footer->Magic, CompressedFDataMagic, sizeof(Footer->Magic)))
+    return reportMalformed("truncated footer");
+  if (Footer->Version != CompressedFDataVersion)
+    return reportMalformed("unsupported version " +
+                           Twine(uint32_t(Footer->Version)));
+
+  const uint64_t NameDataEnd = BufSize - sizeof(CompressedFDataFooter);
+  Pos = Footer->IndexOffset;
+  const auto *Blocks =
+    getArray<CompressedFDataBlock>(BufStart, NameDataEnd, Pos,
+                                   Footer->NumBlocks);
+  if (!Blocks)
+    return reportMalformed("truncated index");
+  const auto NameData = ParsingBuf.slice(Pos, NameDataEnd);
+
+  bool IsValid = true;
+  auto getName = [&](const BinaryFDataString &Name) {
+    if (uint64_t(Name.Offset) + Name.Size > NameData.size()) {
+      IsValid = false;
+      return StringRef();
+    }
+    return NameData.substr(Name.Offset, Name.Size);
+  };
+
+  for (uint32_t I = 0; I < Footer->NumBlocks; ++I) {
+    const auto &Block = Blocks[I];
+    const auto First = getName(Block.FirstName);
+    const auto Last = getName(Block.LastName);
+    if (!IsValid || Last.empty())
+      return reportMalformed("invalid name of block " + Twine(I));
+
+    // Skip blocks without selected functions.
+    if (!FunctionFilter.empty()) {
+      auto FI = std::lower_bound(FunctionFilter.begin(), FunctionFilter.end(),
+                                 First);
+      if (FI == FunctionFilter.end() || StringRef(*FI) > Last)
+        continue;
+    }
+
+    if (Block.Offset > BufSize || Block.Size > BufSize - Block.Offset)
+      return reportMalformed("truncated block " + Twine(I));
+
+    DecompressedBlocks.emplace_back(llvm::make_unique<SmallVector<char, 0>>());
+    auto &Data = *DecompressedBlocks.back();
+    if (auto E = zlib::uncompress(ParsingBuf.substr(Block.Offset, Block.Size),
+                                  Data, Block.UncompressedSize)) {
+      consumeError(std::move(E));
+      return reportMalformed("cannot decompress block " + Twine(I));
+    }
+
+    if (auto EC = parseBinaryRecords(StringRef(Data.data(), Data.size()),
+                                     First, Last))
+      return EC;
+  }
+
+  sortRecords();
+
+  return std::error_code();
+}
+
+namespace {
+
+/// Call \p Callback for the profile of every function in \p Map, or of the
+/// functions \p Funcs if not empty.
+template <typename MapTy, typename FuncDataTy>
+void forEachFunction(const MapTy &Map, ArrayRef<StringRef> Funcs,
+                     std::function<void(const FuncDataTy &)> Callback) {
+  if (Funcs.empty()) {
+    for (const auto &Func : Map)
+      Callback(Func.getValue());
+    return;
+  }
+  for (const auto Name : Funcs) {
+    auto I = Map.find(Name);
+    if (I != Map.end())
+      Callback(I->getValue());
+  }
+}
+
+} // anonymous namespace
+
+void DataReader::forEachBranchRecord(
+    std::function<void(const BranchInfo &)> Callback,
+    ArrayRef<StringRef> Funcs) const {
+  auto isInBlock = [&](StringRef Name) {
+    Name = getWrittenName(Name);
+    return Funcs.empty() || (Name >= getWrittenName(Funcs.front()) &&
+                             Name <= getWrittenName(Funcs.back()));
+  };
+
+  forEachFunction<FuncsToBranchesMapTy, FuncBranchData>(
+      FuncsToBranches, Funcs, [&](const FuncBranchData &Func) {
+    for (const auto &BI : Func.Data)
+      Callback(BI);
+    for (const auto &BI : Func.EntryData) {
+      // Do not output if source is a known symbol, since this was already
+      // accounted for in the source function, unless the source function is
+      // in another block of a compressed profile.
+      if (BI.From.IsSymbol && isInBlock(BI.From.Name))
+        continue;
+      Callback(BI);
+    }
+  });
+}
+
+void DataReader::forEachMemRecord(
+    std::function<void(const MemInfo &)> Callback,
+    ArrayRef<StringRef> Funcs) const {
+  forEachFunction<FuncsToMemEventsMapTy, FuncMemData>(
+      FuncsToMemEvents, Funcs, [&](const FuncMemData &Func) {
+    for (const auto &MemEvent : Func.Data)
+      Callback(MemEvent);
+  });
+}
+
+void DataReader::forEachSampleRecord(
+    std::function<void(const SampleInfo &)> Callback,
+    ArrayRef<StringRef> Funcs) const {
+  forEachFunction<FuncsToSamplesMapTy, FuncSampleData>(
+      FuncsToSamples, Funcs, [&](const FuncSampleData &Func) {
+    for (const auto &SI : Func.Data)
+      Callback(SI);
+  });
+}
+
+std::pair<uint64_t, uint64_t>
+DataReader::writeProfile(raw_ostream &OS) const {
+  bool WriteMemLocs = false;
+
+  auto writeLocation = [&OS,&WriteMemLocs](const Location &Loc) {
+    if (WriteMemLocs)
+      OS << (Loc.IsSymbol ? "4 " : "3 ");
+    else
+      OS << (Loc.IsSymbol ? "1 " : "0 ");
+    OS << (Loc.Name.empty() ? "[unknown]" : Loc.Name)  << " "
+       << Twine::utohexstr(Loc.Offset)
+       << FieldSeparator;
+  };
+
+  uint64_t BranchValues{0};
+  uint64_t MemValues{0};
+
+  if (NoLBRMode) {
+    OS << "no_lbr";
+    for (const auto &Entry : EventNames) {
+      OS << " " << Entry.getKey();
+    }
+    OS << "\n";
+
+    forEachSampleRecord([&](const SampleInfo &SI) {
+      writeLocation(SI.Loc);
+      OS << SI.Hits << "\n";
+      ++BranchValues;
+    });
+  } else {
+    forEachBranchRecord([&](const BranchInfo &BI) {
+      writeLocation(BI.From);
+      writeLocation(BI.To);
+      OS << BI.Mispreds << " " << BI.Branches << "\n";
+      ++BranchValues;
+    });
+
+    WriteMemLocs = true;
+    forEachMemRecord([&](const MemInfo &MemEvent) {
+      writeLocation(MemEvent.Offset);
+      writeLocation(MemEvent.Addr);
+      OS << MemEvent.Count << "\n";
+      ++MemValues;
+    });
+  }
+
+  writeTemporalData(OS);
+
+  return std::make_pair(BranchValues, MemValues);
+}
+
+void DataReader::writeTemporalData(raw_ostream &OS) const {
+  if (FuncsToTemporal.empty())
+    return;
+
+  // Write times relative to the first sample and buckets relative to the
+  // bucket of the first sample, to keep the numbers short.
+  uint64_t Start = -1ULL;
+  for (const auto &Func : FuncsToTemporal)
+    Start = std::min(Start, Func.getValue().FirstTime);
+  const auto StartBucket = TemporalBucketSize ? Start / TemporalBucketSize : 0;
+
+  std::vector<StringRef> Names;
+  for (const auto &Func : FuncsToTemporal)
+    Names.push_back(Func.getKey());
+  std::sort(Names.begin(), Names.end());
+
+  OS << "temporal " << TemporalBucketSize << "\n";
+  for (auto Name : Names) {
+    const auto &Data = FuncsToTemporal.find(Name)->getValue();
+    OS << "t " << Name << " " << Data.FirstTime - Start << " "
+       << Data.LastTime - Start;
+    std::vector<std::pair<uint64_t, uint64_t>> Buckets(Data.Buckets.begin(),
+                                                       Data.Buckets.end());
+    std::sort(Buckets.begin(), Buckets.end());
+    for (const auto &Bucket : Buckets)
+      OS << " " << Bucket.first - StartBucket << ":" << Bucket.second;
+    OS << "\n";
+  }
+}
+
+std::pair<uint64_t, uint64_t>
+DataReader::writeBinaryProfile(raw_ostream &OS) const {
+  return writeBinaryProfile(OS, None);
+}
+
+std::pair<uint64_t, uint64_t>
+DataReader::writeBinaryProfile(raw_ostream &OS,
+                               ArrayRef<StringRef> Funcs) const {
+  using namespace fdata;
+
+  // Collect the string table first.
+  StringMap<uint32_t> StringIndex;
+  std::vector<StringRef> Strings;
+  uint64_t StringDataSize = 0;
+  auto getStringIndex = [&](StringRef Str) {
+    Str = getWrittenName(Str);
+    auto Entry = StringIndex.insert(std::make_pair(Str, Strings.size()));
+    if (Entry.second) {
+      Strings.push_back(Entry.first->getKey());
+      StringDataSize += Str.size();
+    }
+    return Entry.first->getValue();
+  };
+
+  std::vector<uint32_t> Events;
+  for (const auto &Entry : EventNames)
+    Events.push_back(getStringIndex(Entry.getKey()));
+
+  uint64_t BranchValues{0};
+  uint64_t MemValues{0};
+  if (NoLBRMode) {
+    forEachSampleRecord([&](const SampleInfo &SI) {
+      getStringIndex(SI.Loc.Name);
+      ++BranchValues;
+    }, Funcs);
+  } else {
+    forEachBranchRecord([&](const BranchInfo &BI) {
+      getStringIndex(BI.From.Name);
+      getStringIndex(BI.To.Name);
+      ++BranchValues;
+    }, Funcs);
+    forEachMemRecord([&](const MemInfo &MI) {
+      getStringIndex(MI.Offset.Name);
+      getStringIndex(MI.Addr.Name);
+      ++MemValues;
+    }, Funcs);
+  }
+
+  auto write = [&OS](const void *Data, uint64_t Size) {
+    OS.write(reinterpret_cast<const char *>(Data), Size);
+  };
+
+  BinaryFDataHeader Header;
+  memcpy(Header.Magic, BinaryFDataMagic, sizeof(Header.Magic));
+  Header.Version = BinaryFDataVersion;
+  Header.Flags = NoLBRMode ? BFF_NO_LBR : 0;
+  Header.NumStrings = Strings.size();
+  Header.NumEvents = Events.size();
+  Header.StringDataSize = StringDataSize;
+  Header.NumBranches = BranchValues;
+  Header.NumMemEvents = MemValues;
+  write(&Header, sizeof(Header));
+
+  uint32_t Offset = 0;
+  for (const auto &Str : Strings) {
+    BinaryFDataString String;
+    String.Offset = Offset;
+    String.Size = Str.size();
+    write(&String, sizeof(String));
+    Offset += Str.size();
+  }
+  for (const auto Event : Events) {
+    ulittle32_t Index(Event);
+    write(&Index, sizeof(Index));
+  }
+  uint64_t Size = sizeof(Header) + Strings.size() * sizeof(BinaryFDataString) +
+                  Events.size() * sizeof(ulittle32_t);
+  for (const auto &Str : Strings)
+    write(Str.data(), Str.size());
+  Size += StringDataSize;
+  for (auto I = Size; I < alignTo(Size, 8); ++I)
+    OS << '\0';
+
+  auto getLocation = [&](const Location &Loc) {
+    BinaryFDataLocation Result;
+    Result.Name = getStringIndex(Loc.Name);
+    Result.IsSymbol = Loc.IsSymbol;
+    Result.Offset = Loc.Offset;
+    return Result;
+  };
+
+  if (NoLBRMode) {
+    forEachSampleRecord([&](const SampleInfo &SI) {
+      BinaryFDataSample Sample;
+      Sample.Loc = getLocation(SI.Loc);
+      Sample.Hits = SI.Hits;
+      write(&Sample, sizeof(Sample));
+    }, Funcs);
+  } else {
+    forEachBranchRecord([&](const BranchInfo &BI) {
+      BinaryFDataBranch Branch;
+      Branch.From = getLocation(BI.From);
+      Branch.To = getLocation(BI.To);
+      Branch.Mispreds = BI.Mispreds;
+      Branch.Branches = BI.Branches;
+      write(&Branch, sizeof(Branch));
+    }, Funcs);
+    forEachMemRecord([&](const MemInfo &MI) {
+      BinaryFDataMem Mem;
+      Mem.Offset = getLocation(MI.Offset);
+      Mem.Addr = getLocation(MI.Addr);
+      Mem.Count = MI.Count;
+      write(&Mem, sizeof(Mem));
+    }, Funcs);
+  }
+
+  return std::make_pair(BranchValues, MemValues);
+}
+
+std::pair<uint64_t, uint64_t>
+DataReader::writeCompressedProfile(raw_ostream &OS,
+                                   uint64_t BlockRecords) const {
+  using namespace fdata;
+
+  std::vector<StringRef> Funcs;
+  for (const auto &Func : FuncsToBranches)
+    Funcs.push_back(Func.getKey());
+  for (const auto &Func : FuncsToSamples)
+    Funcs.push_back(Func.getKey());
+  for (const auto &Func : FuncsToMemEvents)
+    Funcs.push_back(Func.getKey());
+  std::sort(Funcs.begin(), Funcs.end(), [](StringRef A, StringRef B) {
+    return getWrittenName(A) < getWrittenName(B);
+  });
+  Funcs.erase(std::unique(Funcs.begin(), Funcs.end()), Funcs.end());
+
+  auto getNumRecords = [&](StringRef Name) {
+    uint64_t NumRecords = 0;
+    auto BI = FuncsToBranches.find(Name);
+    if (BI != FuncsToBranches.end()) {
+      NumRecords += BI->getValue().Data.size() +
+                    BI->getValue().EntryData.size();
+    }
+    auto SI = FuncsToSamples.find(Name);
+    if (SI != FuncsToSamples.end())
+      NumRecords += SI->getValue().Data.size();
+    auto MI = FuncsToMemEvents.find(Name);
+    if (MI != FuncsToMemEvents.end())
+      NumRecords += MI->getValue().Data.size();
+    return NumRecords;
+  };
+
+  std::vector<CompressedFDataBlock> Index;
+  std::string NameData;
+  auto addName = [&](StringRef Name) {
+    BinaryFDataString String;
+    String.Offset = NameData.size();
+    String.Size = Name.size();
+    NameData += Name;
+    return String;
+  };
+
+  OS.write(CompressedFDataMagic, sizeof(CompressedFDataMagic));
+  uint64_t Offset = sizeof(CompressedFDataMagic);
+
+  uint64_t BranchValues{0};
+  uint64_t MemValues{0};
+  for (size_t Begin = 0, End; Begin < Funcs.size(); Begin = End) {
+    uint64_t NumRecords = 0;
+    End = Begin;
+    do {
+      NumRecords += getNumRecords(Funcs[End++]);
+    } while (End < Funcs.size() && NumRecords < BlockRecords);
+
+    std::string Block;
+    raw_string_ostream BlockOS(Block);
+    const auto Values =
+      writeBinaryProfile(BlockOS,
+                         makeArrayRef(Funcs).slice(Begin, End - Begin));
+    BlockOS.flush();
+    BranchValues += Values.first;
+    MemValues += Values.second;
+
+    SmallVector<char, 0> Compressed;
+    cantFail(zlib::compress(Block, Compressed),
+             "zlib has to be available for compressed fdata");
+    OS.write(Compressed.data(), Compressed.size());
+
+    CompressedFDataBlock Entry;
+    Entry.Offset = Offset;
+    Entry.Size = Compressed.size();
+    Entry.UncompressedSize = Block.size();
+    Entry.FirstName = addName(getWrittenName(Funcs[Begin]));
+    Entry.LastName = addName(getWrittenName(Funcs[End - 1]));
+    Index.push_back(Entry);
+    Offset += Compressed.size();
+  }
+
+  for (const auto &Entry : Index)
+    OS.write(reinterpret_cast<const char *>(&Entry), sizeof(Entry));
+  OS << NameData;
+
+  CompressedFDataFooter Footer;
+  Footer.IndexOffset = Offset;
+  Footer.NumBlocks = Index.size();
+  Footer.Version = CompressedFDataVersion;
+  memcpy(Footer.Magic, CompressedFDataMagic, sizeof(Footer.Magic));
+  OS.write(reinterpret_cast<const char *>(&Footer), sizeof(Footer));
+
+  return std::make_pair(BranchValues, MemValues);
+}
+
+void DataReader::mergeProfile(const DataReader &Other, bool CopyNames) {
+  if (FuncsToBranches.empty() && FuncsToSamples.empty() &&
+      FuncsToMemEvents.empty())
+    NoLBRMode = Other.NoLBRMode;
+
+  for (const auto &Entry : Other.EventNames)
+    EventNames.insert(Entry.getKey());
+
+  auto getName = [&](StringRef Name) {
+    return CopyNames ? OwnedNames.insert(Name).first->getKey() : Name;
+  };
+  auto getLocation = [&](const Location &Loc) {
+    return Location(Loc.IsSymbol, getName(Loc.Name), Loc.Offset);
+  };
+
+  for (const auto &Func : Other.FuncsToBranches) {
+    const auto &OtherFBD = Func.getValue();
+    auto I = FuncsToBranches.insert(
+        std::make_pair(Func.getKey(),
+                       FuncBranchData(getName(OtherFBD.Name),
+                                      FuncBranchData::ContainerTy(),
+                                      FuncBranchData::ContainerTy()))).first;
+    auto &FBD = I->getValue();
+    if (CopyNames) {
+      FuncBranchData::ContainerTy OtherData;
+      OtherData.reserve(OtherFBD.Data.size());
+      for (const auto &BI : OtherFBD.Data) {
+        OtherData.emplace_back(getLocation(BI.From), getLocation(BI.To),
+                               BI.Mispreds, BI.Branches);
+      }
+      mergeRecords(FBD.Data, OtherData);
+    } else {
+      mergeRecords(FBD.Data, OtherFBD.Data);
+    }
+    // Entry data is not sorted.
+    std::stable_sort(FBD.EntryData.begin(), FBD.EntryData.end());
+    auto OtherEntryData = OtherFBD.EntryData;
+    if (CopyNames) {
+      for (auto &BI : OtherEntryData) {
+        BI.From = getLocation(BI.From);
+        BI.To = getLocation(BI.To);
+      }
+    }
+    std::stable_sort(OtherEntryData.begin(), OtherEntryData.end());
+    mergeRecords(FBD.EntryData, OtherEntryData);
+    FBD.ExecutionCount += OtherFBD.ExecutionCount;
+  }
+
+  for (const auto &Func : Other.FuncsToMemEvents) {
+    auto I = FuncsToMemEvents.insert(
+        std::make_pair(Func.getKey(),
+                       FuncMemData(getName(Func.getValue().Name),
+                                   FuncMemData::ContainerTy()))).first;
+    if (CopyNames) {
+      FuncMemData::ContainerTy OtherData;
+      OtherData.reserve(Func.getValue().Data.size());
+      for (const auto &MI : Func.getValue().Data) {
+        OtherData.emplace_back(getLocation(MI.Offset), getLocation(MI.Addr),
+                               MI.Count);
+      }
+      mergeRecords(I->getValue().Data, OtherData);
+    } else {
+      mergeRecords(I->getValue().Data, Func.getValue().Data);
+    }
+  }
+
+  for (const auto &Func : Other.FuncsToSamples) {
+    auto I = FuncsToSamples.insert(
+        std::make_pair(Func.getKey(),
+                       FuncSampleData(getName(Func.getValue().Name),
+                                      FuncSampleData::ContainerTy()))).first;
+    if (CopyNames) {
+      FuncSampleData::ContainerTy OtherData;
+      OtherData.reserve(Func.getValue().Data.size());
+      for (const auto &SI : Func.getValue().Data)
+        OtherData.emplace_back(getLocation(SI.Loc), SI.Hits);
+      mergeRecords(I->getValue().Data, OtherData);
+    } else {
+      mergeRecords(I->getValue().Data, Func.getValue().Data);
+    }
+  }
+
+  // Times of every profile are relative to its own first sample. Histograms
+  // with different bucket sizes cannot be combined.
+  if (FuncsToTemporal.empty())
+    TemporalBucketSize = Other.TemporalBucketSize;
+  if (TemporalBucketSize == Other.TemporalBucketSize) {
+    for (const auto &Func : Other.FuncsToTemporal)
+      FuncsToTemporal[Func.getKey()].merge(Func.getValue());
+  }
+}
+
+void DataReader::scaleCounts(double Factor) {
+  auto scale = [Factor](int64_t Count) -> int64_t {
+    return std::llround(Count * Factor);
+  };
+
+  for (auto &Func : FuncsToBranches) {
+    auto &FBD = Func.getValue();
+    auto scaleBranches = [&](FuncBranchData::ContainerTy &Data) {
+      for (auto &BI : Data) {
+        BI.Branches = scale(BI.Branches);
+        BI.Mispreds = std::min(scale(BI.Mispreds), BI.Branches);
+      }
+      Data.erase(std::remove_if(Data.begin(), Data.end(),
+                                [](const BranchInfo &BI) {
+                                  return BI.Branches == 0;
+                                }),
+                 Data.end());
+    };
+    scaleBranches(FBD.Data);
+    scaleBranches(FBD.EntryData);
+    FBD.ExecutionCount = scale(FBD.ExecutionCount);
+  }
+
+  for (auto &Func : FuncsToMemEvents) {
+    auto &Data = Func.getValue().Data;
+    for (auto &MI : Data)
+      MI.Count = scale(MI.Count);
+    Data.erase(std::remove_if(Data.begin(), Data.end(),
+                              [](const MemInfo &MI) { return MI.Count == 0; }),
+               Data.end());
+  }
+
+  for (auto &Func : FuncsToSamples) {
+    auto &Data = Func.getValue().Data;
+    for (auto &SI : Data)
+      SI.Hits = scale(SI.Hits);
+    Data.erase(std::remove_if(Data.begin(), Data.end(),
+                              [](const SampleInfo &SI) {
+                                return SI.Hits == 0;
+                              }),
+               Data.end());
+  }
+}
+
+namespace {
+
+/// Remove the profiles of functions without records from \p Map. Return the
+/// number of removed functions.
+template <typename MapTy, typename PredTy>
+uint64_t removeFunctions(MapTy &Map, PredTy IsEmpty) {
+  uint64_t NumRemoved = 0;
+  for (auto I = Map.begin(), E = Map.end(); I != E; ) {
+    auto Cur = I++;
+    if (IsEmpty(Cur->getValue())) {
+      Map.erase(Cur);
+      ++NumRemoved;
+    }
+  }
+  return NumRemoved;
+}
+
+} // anonymous namespace
+
+std::pair<uint64_t, uint64_t>
+DataReader::pruneProfile(uint64_t MinCount, double MinRatio) {
+  uint64_t NumRecords = 0;
+  uint64_t NumFunctions = 0;
+
+  auto getThreshold = [&](uint64_t FuncCount) -> double {
+    if (FuncCount < MinCount)
+      return std::numeric_limits<double>::infinity();
+    return std::max(double(MinCount), MinRatio * FuncCount);
+  };
+
+  for (auto &Func : FuncsToSamples) {
+    auto &Data = Func.getValue().Data;
+    uint64_t FuncCount = 0;
+    for (const auto &SI : Data)
+      FuncCount += SI.Hits;
+    const auto Threshold = getThreshold(FuncCount);
+    const auto Size = Data.size();
+    Data.erase(std::remove_if(Data.begin(), Data.end(),
+                              [&](const SampleInfo &SI) {
+                                return SI.Hits < Threshold;
+                              }),
+               Data.end());
+    NumRecords += Size - Data.size();
+  }
+  NumFunctions += removeFunctions(FuncsToSamples,
+                                  [](const FuncSampleData &FSD) {
+                                    return FSD.Data.empty();
+                                  });
+
+  // Branches from DSOs are only recorded as entries of the functions they
+  // branch to.
+  StringMap<uint64_t> FuncCounts;
+  DenseMap<Location, uint64_t> SourceCounts;
+  for (const auto &Func : FuncsToBranches) {
+    const auto &FBD = Func.getValue();
+    auto &FuncCount = FuncCounts[Func.getKey()];
+    for (const auto &BI : FBD.Data) {
+      FuncCount += BI.Branches;
+      SourceCounts[BI.From] += BI.Branches;
+    }
+    for (const auto &BI : FBD.EntryData) {
+      if (BI.From.Name != Func.getKey())
+        FuncCount += BI.Branches;
+      if (!BI.From.IsSymbol && !FuncsToBranches.count(BI.From.Name))
+        SourceCounts[BI.From] += BI.Branches;
+    }
+  }
+
+  // The function of a branch from a DSO is the function it branches to.
+  auto isSignificant = [&](const BranchInfo &BI) {
+    auto FI = FuncCounts.find(BI.From.IsSymbol ? BI.From.Name : BI.To.Name);
+    const uint64_t FuncCount = FI != FuncCounts.end() ? FI->getValue() : 0;
+    return SourceCounts.lookup(BI.From) >= getThreshold(FuncCount);
+  };
+
+  for (auto &Func : FuncsToBranches) {
+    auto &FBD = Func.getValue();
+    const auto Size = FBD.Data.size();
+    FBD.Data.erase(std::remove_if(FBD.Data.begin(), FBD.Data.end(),
+                                  [&](const BranchInfo &BI) {
+                                    return !isSignificant(BI);
+                                  }),
+                   FBD.Data.end());
+    NumRecords += Size - FBD.Data.size();
+
+    // Entries are also recorded in the profile of the source function,
+    // except for branches from DSOs.
+    FBD.EntryData.erase(
+        std::remove_if(FBD.EntryData.begin(), FBD.EntryData.end(),
+                       [&](const BranchInfo &BI) {
+                         if (isSignificant(BI))
+                           return false;
+                         if (BI.To.Offset == 0) {
+                           FBD.ExecutionCount -=
+                             std::min<int64_t>(FBD.ExecutionCount,
+                                               BI.Branches);
+                         }
+                         if (!BI.From.IsSymbol)
+                           ++NumRecords;
+                         return true;
+                       }),
+        FBD.EntryData.end());
+  }
+  NumFunctions += removeFunctions(FuncsToBranches,
+                                  [](const FuncBranchData &FBD) {
+                                    return FBD.Data.empty() &&
+                                           FBD.EntryData.empty();
+                                  });
+
+  for (auto &Func : FuncsToMemEvents) {
+    auto &Data = Func.getValue().Data;
+    const auto Size = Data.size();
+    auto FI = FuncCounts.find(Func.getKey());
+    if ((FI != FuncCounts.end() ? FI->getValue() : 0) < MinCount)
+      Data.clear();
+    Data.erase(std::remove_if(Data.begin(), Data.end(),
+                              [&](const MemInfo &MI) {
+                                return MI.Count < MinCount;
+                              }),
+               Data.end());
+    NumRecords += Size - Data.size();
+  }
+  removeFunctions(FuncsToMemEvents, [](const FuncMemData &FMD) {
+    return FMD.Data.empty();
+  });
+
+  // Maps of LTO names reference the removed profiles.
+  if (!LTOCommonNameMap.empty() || !LTOCommonNameMemMap.empty()) {
+    LTOCommonNameMap.clear();
+    LTOCommonNameMemMap.clear();
+    buildLTONameMaps();
+  }
+
+  return std::make_pair(NumRecords, NumFunctions);
+}
+
 void DataReader::buildLTONameMaps() {
   for (auto &FuncData : FuncsToBranches) {
     const auto FuncName = FuncData.getKey();
@@ -700,6 +1678,9 @@ fetchMapEntriesRegex(
   const StringMap<std::vector<decltype(MapTy::MapEntryTy::second) *>> &LTOCommonNameMap,
   const std::vector<std::string> &FuncNames) {
   std::vector<decltype(MapTy::MapEntryTy::second) *> AllData;
+  // Names of a function often share the common LTO name. Add entries of each
+  // group only once, otherwise callers evaluate the same candidates again.
+  SmallPtrSet<const void *, 4> AddedGroups;
   // Do a reverse order iteration since the name in profile has a higher chance
   // of matching a name at the end of the list.
   for (auto FI = FuncNames.rbegin(), FE = FuncNames.rend(); FI != FE; ++FI) {
@@ -708,7 +1689,7 @@ fetchMapEntriesRegex(
     const auto LTOCommonName = getLTOCommonName(Name);
     if (LTOCommonName) {
       auto I = LTOCommonNameMap.find(*LTOCommonName);
-      if (I != LTOCommonNameMap.end()) {
+      if (I != LTOCommonNameMap.end() && AddedGroups.insert(&*I).second) {
         auto &CommonData = I->getValue();
         AllData.insert(AllData.end(), CommonData.begin(), CommonData.end());
       }
@@ -739,6 +1720,12 @@ DataReader::getFuncSampleData(const std::vector<std::string> &FuncNames) {
   return fetchMapEntry<FuncsToSamplesMapTy>(FuncsToSamples, FuncNames);
 }
 
+FuncTemporalData *
+DataReader::getFuncTemporalData(const std::vector<std::string> &FuncNames) {
+  return fetchMapEntry<StringMap<FuncTemporalData>>(FuncsToTemporal,
+                                                    FuncNames);
+}
+
 std::vector<FuncBranchData *>
 DataReader::getFuncBranchDataRegex(const std::vector<std::string> &FuncNames) {
   return fetchMapEntriesRegex(FuncsToBranches, LTOCommonNameMap, FuncNames);
@@ -15,16 +15,20 @@
 #ifndef LLVM_TOOLS_LLVM_BOLT_DATA_READER_H
 #define LLVM_TOOLS_LLVM_BOLT_DATA_READER_H
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Support/Allocator.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/ErrorOr.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
+#include <functional>
 #include <map>
 #include <vector>
 
@@ -35,6 +39,8 @@ struct LBREntry {
   uint64_t From;
   uint64_t To;
   bool Mispred;
+  /// Cycles since the previous entry, 0 if not recorded.
+  uint16_t Cycles;
 };
 
 /// LTO-generated function names take a form:
@@ -101,9 +107,15 @@ struct BranchInfo {
   int64_t Mispreds;
   int64_t Branches;
 
-  BranchInfo(Location From, Location To, int64_t Mispreds, int64_t Branches)
+  /// Sum over the recorded executions of the branch of the cycles since the
+  /// previous taken branch, from LBR timing info. Written to fdata as an
+  /// optional last field.
+  int64_t Cycles;
+
+  BranchInfo(Location From, Location To, int64_t Mispreds, int64_t Branches,
+             int64_t Cycles = 0)
       : From(std::move(From)), To(std::move(To)), Mispreds(Mispreds),
-        Branches(Branches) {}
+        Branches(Branches), Cycles(Cycles) {}
 
   bool operator==(const BranchInfo &RHS) const {
     return From == RHS.From &&
@@ -164,13 +176,16 @@ struct FuncBranchData {
   void appendFrom(const FuncBranchData &FBD, uint64_t Offset);
 
   /// Aggregation helpers
-  DenseMap<uint64_t, DenseMap<uint64_t, size_t>> IntraIndex;
-  DenseMap<uint64_t, DenseMap<Location, size_t>> InterIndex;
-  DenseMap<uint64_t, DenseMap<Location, size_t>> EntryIndex;
-
-  void bumpBranchCount(uint64_t OffsetFrom, uint64_t OffsetTo, bool Mispred);
-  void bumpCallCount(uint64_t OffsetFrom, const Location &To, bool Mispred);
-  void bumpEntryCount(const Location &From, uint64_t OffsetTo, bool Mispred);
+  DenseMap<std::pair<uint64_t, uint64_t>, size_t> IntraIndex;
+  DenseMap<std::pair<uint64_t, Location>, size_t> InterIndex;
+  DenseMap<std::pair<uint64_t, Location>, size_t> EntryIndex;
+
+  void bumpBranchCount(uint64_t OffsetFrom, uint64_t OffsetTo, uint64_t Count,
+                       uint64_t Mispreds, uint64_t Cycles = 0);
+  void bumpCallCount(uint64_t OffsetFrom, const Location &To, uint64_t Count,
+                     uint64_t Mispreds);
+  void bumpEntryCount(const Location &From, uint64_t OffsetTo, uint64_t Count,
+                      uint64_t Mispreds);
 };
 
 /// MemInfo represents a single memory load from an address \p Addr at an \p
@@ -285,6 +300,137 @@ struct FuncSampleData {
   void bumpCount(uint64_t Offset);
 };
 
+/// Times of the profile samples of a function, in nanoseconds. The samples
+/// are counted in time buckets of a fixed size, so that the size of the data
+/// does not depend on the number of samples.
+struct FuncTemporalData {
+  uint64_t FirstTime{-1ULL};
+  uint64_t LastTime{0};
+
+  /// Number of samples in each bucket that has samples, indexed by the time
+  /// divided by the bucket size.
+  DenseMap<uint64_t, uint64_t> Buckets;
+
+  /// Record \p Count samples taken at \p Time, in buckets of \p BucketSize.
+  void addSample(uint64_t Time, uint64_t Count, uint64_t BucketSize);
+
+  /// Add the samples of \p Other, which uses the same bucket size.
+  void merge(const FuncTemporalData &Other);
+};
+
+/// Binary fdata format.
+///
+/// The binary format holds the same records as the text fdata format, but
+/// every name is stored only once in a string table. A file in this format is
+/// used in place once mapped into memory: names are referenced directly from
+/// the string table and records are decoded without tokenizing the input. All
+/// fields are little-endian. The layout of the file is:
+///
+///   BinaryFDataHeader
+///   BinaryFDataString   Strings[NumStrings]
+///   ulittle32_t         EventNames[NumEvents]      (indices of strings)
+///   char                StringData[StringDataSize] (padded to 8 bytes)
+///   BinaryFDataBranch   Branches[NumBranches]      (BinaryFDataSample
+///                                                   in no-LBR mode)
+///   BinaryFDataMem      MemEvents[NumMemEvents]
+///
+/// Records are grouped by the function of their source location and sorted
+/// within each group.
+///
+/// Compressed fdata format.
+///
+/// Large profiles are written with the functions sorted by name and split
+/// into blocks of consecutive functions. Every block holds the records of its
+/// functions as a complete binary fdata file compressed with zlib. A branch
+/// between functions of different blocks is stored in both blocks, and is
+/// only added to the functions of the block it is read from, so that the
+/// profile of a function is complete once its block is read. The index at the
+/// end of the file gives the range of function names of every block, and
+/// readers decompress only the blocks of the functions they need. The layout
+/// of the file is:
+///
+///   char                  Magic[8]
+///   char                  Blocks[]               (compressed binary fdata)
+///   CompressedFDataBlock  Index[NumBlocks]
+///   char                  NameData[]             (first and last names of
+///                                                 the functions of blocks)
+///   CompressedFDataFooter Footer
+namespace fdata {
+
+using namespace support;
+
+const char BinaryFDataMagic[8] = {'B', 'O', 'L', 'T', 'F', 'D', 'A', 'T'};
+const uint32_t BinaryFDataVersion = 1;
+
+const char CompressedFDataMagic[8] = {'B', 'O', 'L', 'T', 'F', 'D', 'A', 'Z'};
+const uint32_t CompressedFDataVersion = 1;
+
+/// Default number of records of a block of a compressed profile. Blocks end
+/// at function boundaries, and hold at least one function.
+const uint64_t CompressedFDataBlockRecords = 1 << 16;
+
+enum BinaryFDataFlags : uint32_t {
+  BFF_NO_LBR = 1 << 0, /// Profile contains samples instead of branches.
+};
+
+struct BinaryFDataHeader {
+  char Magic[8];
+  ulittle32_t Version;
+  ulittle32_t Flags;
+  ulittle32_t NumStrings;
+  ulittle32_t NumEvents;
+  ulittle64_t StringDataSize;
+  ulittle64_t NumBranches;
+  ulittle64_t NumMemEvents;
+};
+
+struct BinaryFDataString {
+  ulittle32_t Offset;
+  ulittle32_t Size;
+};
+
+struct BinaryFDataLocation {
+  ulittle32_t Name;
+  ulittle32_t IsSymbol;
+  ulittle64_t Offset;
+};
+
+struct BinaryFDataBranch {
+  BinaryFDataLocation From;
+  BinaryFDataLocation To;
+  ulittle64_t Mispreds;
+  ulittle64_t Branches;
+};
+
+struct BinaryFDataSample {
+  BinaryFDataLocation Loc;
+  ulittle64_t Hits;
+};
+
+struct BinaryFDataMem {
+  BinaryFDataLocation Offset;
+  BinaryFDataLocation Addr;
+  ulittle64_t Count;
+};
+
+/// Names are offsets into NameData.
+struct CompressedFDataBlock {
+  ulittle64_t Offset;
+  ulittle64_t Size;
+  ulittle64_t UncompressedSize;
+  BinaryFDataString FirstName;
+  BinaryFDataString LastName;
+};
+
+struct CompressedFDataFooter {
+  ulittle64_t IndexOffset;
+  ulittle32_t NumBlocks;
+  ulittle32_t Version;
+  char Magic[8];
+};
+
+} // namespace fdata
+
 //===----------------------------------------------------------------------===//
 //
 /// DataReader Class
@@ -332,6 +478,14 @@ public:
   /// offset d. The rest 773 branches were preceeded by a different sequence
   /// of branches, from func, offset 18 to offset 60 and then from offset 71 to
   /// offset d.
+  ///
+  /// The records can be followed by the times of the samples of functions,
+  /// in nanoseconds from the first sample of the profile:
+  ///
+  /// temporal <bucket size>
+  /// t <function name> <first sample> <last sample> <bucket>:<count> ...
+  ///
+  /// where buckets are numbered from the one with the first sample.
   std::error_code parse();
 
   /// When no_lbr is the first line of the file, activate No LBR mode. In this
@@ -351,6 +505,69 @@ public:
   ///
   std::error_code parseInNoLBRMode();
 
+  /// Read profile in the binary fdata format described above. Names in the
+  /// resulting profile reference the input buffer.
+  std::error_code parseBinary();
+
+  /// Return true if \p Buffer starts with a binary fdata header.
+  static bool isBinaryProfile(StringRef Buffer);
+
+  /// Read profile in the compressed fdata format described above. Only the
+  /// blocks holding functions selected with setFunctionFilter() are
+  /// decompressed. Names in the resulting profile reference the decompressed
+  /// blocks owned by this object.
+  std::error_code parseCompressed();
+
+  /// Return true if \p Buffer starts with a compressed fdata header.
+  static bool isCompressedProfile(StringRef Buffer);
+
+  /// Only read the records of the functions named \p FuncNames, as they are
+  /// named in the profile. Must be called before parse().
+  void setFunctionFilter(std::vector<std::string> FuncNames);
+
+  /// Write the profile to \p OS in the text fdata format. Return the number
+  /// of branch (or sample) records and the number of memory records written.
+  std::pair<uint64_t, uint64_t> writeProfile(raw_ostream &OS) const;
+
+  /// Write the times of samples of functions to \p OS in the text fdata
+  /// format, if the profile has them.
+  void writeTemporalData(raw_ostream &OS) const;
+
+  /// Write the profile to \p OS in the binary fdata format. Return the number
+  /// of branch (or sample) records and the number of memory records written.
+  std::pair<uint64_t, uint64_t> writeBinaryProfile(raw_ostream &OS) const;
+
+  /// Write the profile to \p OS in the compressed fdata format, with about
+  /// \p BlockRecords records in every block. The output is written block by
+  /// block. zlib has to be available. Return the number of branch (or sample)
+  /// records and the number of memory records written.
+  std::pair<uint64_t, uint64_t>
+  writeCompressedProfile(raw_ostream &OS,
+                         uint64_t BlockRecords =
+                           fdata::CompressedFDataBlockRecords) const;
+
+  /// Merge all records of \p Other into this profile. Names referenced by
+  /// \p Other have to outlive this object, unless \p CopyNames is set. In the
+  /// latter case this object keeps its own copies of the names, and \p Other
+  /// can be destroyed right after the merge.
+  void mergeProfile(const DataReader &Other, bool CopyNames = false);
+
+  /// Multiply all counts of the profile by \p Factor, rounding them to the
+  /// nearest integer. Records with counts that drop to zero are removed.
+  void scaleCounts(double Factor);
+
+  /// Remove records that are insignificant for optimizations. The count of a
+  /// function is the number of branches from it and of calls into it, or the
+  /// number of its samples. Functions with a count below \p MinCount are
+  /// removed. Branches from an instruction, or its samples, are removed if
+  /// their total count is below \p MinCount or below \p MinRatio times the
+  /// count of the function. All branches from an instruction are removed
+  /// together, and from the profiles of both of their functions, so that the
+  /// flow stays consistent within every function. Return the number of
+  /// removed records and the number of removed functions.
+  std::pair<uint64_t, uint64_t> pruneProfile(uint64_t MinCount,
+                                             double MinRatio);
+
   /// Return branch data matching one of the names in \p FuncNames.
   FuncBranchData *
   getFuncBranchData(const std::vector<std::string> &FuncNames);
@@ -361,15 +578,20 @@ public:
   FuncSampleData *
   getFuncSampleData(const std::vector<std::string> &FuncNames);
 
+  /// Return the times of samples of the function with one of the names in
+  /// \p FuncNames, or null if the profile has none.
+  FuncTemporalData *
+  getFuncTemporalData(const std::vector<std::string> &FuncNames);
+
   /// Return a vector of all FuncBranchData matching the list of names.
-  /// Internally use fuzzy matching to match special names like LTO-generated
-  /// function names.
+  /// LTO-generated names are matched by their common prefix, looked up in a
+  /// map built once by buildLTONameMaps(). No regular expressions are used.
   std::vector<FuncBranchData *>
   getFuncBranchDataRegex(const std::vector<std::string> &FuncNames);
 
   /// Return a vector of all FuncMemData matching the list of names.
-  /// Internally use fuzzy matching to match special names like LTO-generated
-  /// function names.
+  /// LTO-generated names are matched by their common prefix, looked up in a
+  /// map built once by buildLTONameMaps(). No regular expressions are used.
   std::vector<FuncMemData *>
   getFuncMemDataRegex(const std::vector<std::string> &FuncNames);
 
@@ -395,6 +617,9 @@ public:
   /// Return false only if we are running with profiling data that lacks LBR.
   bool hasLBR() const { return !NoLBRMode; }
 
+  /// Return true if the profile has the times of samples of functions.
+  bool hasTemporalData() const { return !FuncsToTemporal.empty(); }
+
   /// Return true if event named \p Name was used to collect this profile data.
   bool usesEvent(StringRef Name) const {
     for (auto I = EventNames.begin(), E = EventNames.end(); I != E; ++I) {
@@ -432,6 +657,49 @@ protected:
   bool hasBranchData();
   bool hasMemData();
 
+  /// Parse the times of samples at the end of a text profile, if any.
+  std::error_code parseTemporalData();
+
+  /// Read the records of a profile in the binary fdata format from
+  /// \p Buffer without sorting them. If the buffer holds a block of a
+  /// compressed profile, \p First and \p Last are the names of its first and
+  /// last functions, and records are only added to the functions of the
+  /// block. Otherwise, they are empty.
+  std::error_code parseBinaryRecords(StringRef Buffer,
+                                     StringRef First = StringRef(),
+                                     StringRef Last = StringRef());
+
+  /// Write the records of the functions \p Funcs, or of all functions if
+  /// empty, to \p OS in the binary fdata format.
+  std::pair<uint64_t, uint64_t>
+  writeBinaryProfile(raw_ostream &OS, ArrayRef<StringRef> Funcs) const;
+
+  /// Return true if records of the function \p Name are read.
+  bool isFunctionSelected(StringRef Name) const;
+
+  /// Add a record to the profile of the corresponding function(s). A branch
+  /// is added to the profile of its source function only if \p AddToSource
+  /// is set, and to the profile of its target function only if
+  /// \p AddToTarget is set.
+  void addBranchRecord(const BranchInfo &BI, bool AddToSource = true,
+                       bool AddToTarget = true);
+  void addMemRecord(const MemInfo &MI);
+  void addSampleRecord(const SampleInfo &SI);
+
+  /// Sort records of every function once all of them were added.
+  void sortRecords();
+
+  /// Call \p Callback for every record that has to be written to a profile
+  /// file, in the order of writing. If \p Funcs is not empty, only records
+  /// of a block of a compressed profile holding the functions \p Funcs,
+  /// sorted by name, are visited.
+  void forEachBranchRecord(std::function<void(const BranchInfo &)> Callback,
+                           ArrayRef<StringRef> Funcs = None) const;
+  void forEachMemRecord(std::function<void(const MemInfo &)> Callback,
+                        ArrayRef<StringRef> Funcs = None) const;
+  void forEachSampleRecord(std::function<void(const SampleInfo &)> Callback,
+                           ArrayRef<StringRef> Funcs = None) const;
+
   /// Build suffix map once the profile data is parsed.
   void buildLTONameMaps();
 
@@ -444,10 +712,24 @@ protected:
   FuncsToBranchesMapTy FuncsToBranches;
   FuncsToSamplesMapTy FuncsToSamples;
   FuncsToMemEventsMapTy FuncsToMemEvents;
+  StringMap<FuncTemporalData> FuncsToTemporal;
   bool NoLBRMode{false};
+
+  /// Size in nanoseconds of the time buckets of FuncsToTemporal.
+  uint64_t TemporalBucketSize{0};
   StringSet<> EventNames;
   static const char FieldSeparator = ' ';
 
+  /// Names of records merged with mergeProfile(Other, /*CopyNames=*/true).
+  StringSet<> OwnedNames;
+
+  /// Sorted names of the functions to read, or empty to read all of them.
+  std::vector<std::string> FunctionFilter;
+
+  /// Decompressed blocks of a compressed profile, referenced by the names of
+  /// records.
+  std::vector<std::unique_ptr<SmallVector<char, 0>>> DecompressedBlocks;
+
   /// Maps of common LTO names to possible matching profiles.
   StringMap<std::vector<FuncBranchData *>> LTOCommonNameMap;
   StringMap<std::vector<FuncMemData *>> LTOCommonNameMemMap;
@@ -18,6 +18,7 @@
 #include "llvm/Support/LEB128.h"
 #include <algorithm>
 #include <cassert>
+#include <iterator>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-debug-info"
@@ -55,13 +56,18 @@ uint64_t writeAddressRanges(
 
 } // namespace
 
-DebugRangesSectionsWriter::DebugRangesSectionsWriter(BinaryContext *BC) {
+DebugRangesSectionsWriter::DebugRangesSectionsWriter(BinaryContext *BC,
+                                                     StringRef Prefix) {
   RangesBuffer = llvm::make_unique<SmallVector<char, 16>>();
   RangesStream = llvm::make_unique<raw_svector_ostream>(*RangesBuffer);
   Writer =
     std::unique_ptr<MCObjectWriter>(BC->createObjectWriter(*RangesStream));
 
+  Writer->writeBytes(Prefix);
+  SectionOffset += Prefix.size();
+
   // Add an empty range as the first entry;
+  EmptyRangesOffset = SectionOffset;
   SectionOffset += writeAddressRanges(Writer.get(), DWARFAddressRangesVector{});
 }
 
@@ -80,8 +86,6 @@ DebugRangesSectionsWriter::addRanges(const BinaryFunction *Function,
   if (Ranges.empty())
     return getEmptyRangesOffset();
 
-  static const BinaryFunction *CachedFunction;
-
   if (Function == CachedFunction) {
     const auto RI = CachedRanges.find(Ranges);
     if (RI != CachedRanges.end())
@@ -108,6 +112,22 @@ DebugRangesSectionsWriter::addRanges(const DWARFAddressRangesVector &Ranges) {
   return EntryOffset;
 }
 
+uint64_t DebugRangesSectionsWriter::append(DebugRangesSectionsWriter &Other) {
+  // Both writers start with the empty range list.
+  assert(Other.EmptyRangesOffset == 0 && "unexpected ranges prefix");
+  const uint64_t EmptyRangesSize = 16;
+  const auto Delta = SectionOffset - EmptyRangesSize;
+  Writer->writeBytes(StringRef(Other.RangesBuffer->data() + EmptyRangesSize,
+                               Other.SectionOffset - EmptyRangesSize));
+  SectionOffset += Other.SectionOffset - EmptyRangesSize;
+
+  for (auto &CURanges : Other.CUAddressRanges)
+    CUAddressRanges.emplace(CURanges.first, std::move(CURanges.second));
+  Other.CUAddressRanges.clear();
+
+  return Delta;
+}
+
 void
 DebugRangesSectionsWriter::writeArangesSection(MCObjectWriter *Writer) const {
   // For reference on the format of the .debug_aranges section, see the DWARF4
@@ -182,6 +202,17 @@ uint64_t DebugLocWriter::addList(const DWARFDebugLoc::LocationList &LocList) {
   return EntryOffset;
 }
 
+uint64_t DebugLocWriter::append(const DebugLocWriter &Other) {
+  // Both writers start with the empty list.
+  const uint64_t EmptyListSize = 2 * 8;
+  const auto Delta = SectionOffset - EmptyListSize;
+  Writer->writeBytes(StringRef(Other.LocBuffer->data() + EmptyListSize,
+                               Other.SectionOffset - EmptyListSize));
+  SectionOffset += Other.SectionOffset - EmptyListSize;
+
+  return Delta;
+}
+
 void SimpleBinaryPatcher::addBinaryPatch(uint32_t Offset,
                                          const std::string &NewValue) {
   Patches.emplace_back(std::make_pair(Offset, NewValue));
@@ -217,6 +248,17 @@ void SimpleBinaryPatcher::addLE32Patch(uint32_t Offset, uint32_t NewValue) {
   addLEPatch(Offset, NewValue, 4);
 }
 
+void SimpleBinaryPatcher::append(SimpleBinaryPatcher &&Other) {
+  if (Patches.empty()) {
+    Patches = std::move(Other.Patches);
+    return;
+  }
+  Patches.reserve(Patches.size() + Other.Patches.size());
+  std::move(Other.Patches.begin(), Other.Patches.end(),
+            std::back_inserter(Patches));
+  Other.Patches.clear();
+}
+
 void SimpleBinaryPatcher::patchBinary(std::string &BinaryContents) {
   for (const auto &Patch : Patches) {
     uint32_t Offset = Patch.first;
@@ -229,6 +271,33 @@ void SimpleBinaryPatcher::patchBinary(std::string &BinaryContents) {
   }
 }
 
+void SimpleBinaryPatcher::writePatched(StringRef Contents, raw_ostream &OS) {
+  // Later patches take precedence over earlier ones for the same bytes.
+  // Overlapping patches are rare and are applied to a copy of the contents.
+  std::stable_sort(Patches.begin(), Patches.end(),
+      [](const std::pair<uint32_t, std::string> &A,
+         const std::pair<uint32_t, std::string> &B) {
+        return A.first < B.first;
+      });
+  uint64_t End = 0;
+  for (const auto &Patch : Patches) {
+    if (Patch.first < End) {
+      BinaryPatcher::writePatched(Contents, OS);
+      return;
+    }
+    End = Patch.first + Patch.second.size();
+  }
+  assert(End <= Contents.size() && "Applied patch runs over binary size.");
+
+  uint64_t Offset = 0;
+  for (const auto &Patch : Patches) {
+    OS << Contents.slice(Offset, Patch.first);
+    OS << Patch.second;
+    Offset = Patch.first + Patch.second.size();
+  }
+  OS << Contents.drop_front(Offset);
+}
+
 void DebugAbbrevPatcher::addAttributePatch(const DWARFUnit *Unit,
                                            uint32_t AbbrevCode,
                                            dwarf::Attribute AttrTag,
@@ -239,6 +308,15 @@ void DebugAbbrevPatcher::addAttributePatch(const DWARFUnit *Unit,
       AbbrevAttrPatch{AbbrevCode, AttrTag, NewAttrTag, NewAttrForm});
 }
 
+void DebugAbbrevPatcher::append(DebugAbbrevPatcher &&Other) {
+  for (auto &UnitPatchesPair : Other.Patches) {
+    auto &UnitPatches = Patches[UnitPatchesPair.first];
+    UnitPatches.insert(UnitPatches.end(), UnitPatchesPair.second.begin(),
+                       UnitPatchesPair.second.end());
+  }
+  Other.Patches.clear();
+}
+
 void DebugAbbrevPatcher::patchBinary(std::string &Contents) {
   SimpleBinaryPatcher Patcher;
 
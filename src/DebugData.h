@@ -81,7 +81,9 @@ struct DebugLineTableRowRef {
 /// Serializes the .debug_ranges and .debug_aranges DWARF sections.
 class DebugRangesSectionsWriter {
 public:
-  DebugRangesSectionsWriter(BinaryContext *BC);
+  /// If \p Prefix is not empty, it is written at the start of the section
+  /// ahead of the added ranges.
+  DebugRangesSectionsWriter(BinaryContext *BC, StringRef Prefix = StringRef());
 
   /// Add ranges for CU matching \p CUOffset and return offset into section.
   uint64_t addCURanges(uint64_t CUOffset, DWARFAddressRangesVector &&Ranges);
@@ -96,6 +98,11 @@ public:
   /// Writes .debug_aranges with the added ranges to the MCObjectWriter.
   void writeArangesSection(MCObjectWriter *Writer) const;
 
+  /// Append the ranges and CU ranges added to \p Other, except for its empty
+  /// range list. Return the value to add to the offsets returned by \p Other,
+  /// other than the empty ranges offset, to get offsets in this section.
+  uint64_t append(DebugRangesSectionsWriter &Other);
+
   /// Resets the writer to a clear state.
   void reset() {
     CUAddressRanges.clear();
@@ -134,10 +141,11 @@ private:
   CUAddressRangesType CUAddressRanges;
 
   /// Offset of an empty address ranges list.
-  static constexpr uint64_t EmptyRangesOffset{0};
+  uint64_t EmptyRangesOffset{0};
 
   /// Cached used for de-duplicating entries for the same function.
   std::map<DWARFAddressRangesVector, uint64_t> CachedRanges;
+  const BinaryFunction *CachedFunction{nullptr};
 };
 
 /// Serializes the .debug_loc DWARF section with LocationLists.
@@ -149,6 +157,11 @@ public:
 
   uint64_t getEmptyListOffset() const { return EmptyListOffset; }
 
+  /// Append the lists added to \p Other, except for its empty list. Return
+  /// the value to add to the offsets returned by \p Other, other than the
+  /// empty list offset, to get offsets in this section.
+  uint64_t append(const DebugLocWriter &Other);
+
   std::unique_ptr<SmallVectorImpl<char>> finalize() {
     return std::unique_ptr<SmallVectorImpl<char>>(LocBuffer.release());
   }
@@ -174,6 +187,14 @@ public:
   virtual ~BinaryPatcher() {}
   /// Applies in-place modifications to the binary string \p BinaryContents .
   virtual void patchBinary(std::string &BinaryContents) = 0;
+
+  /// Write \p Contents with the modifications applied to \p OS. By default
+  /// a copy of the contents is patched in memory.
+  virtual void writePatched(StringRef Contents, raw_ostream &OS) {
+    std::string Data = Contents.str();
+    patchBinary(Data);
+    OS << Data;
+  }
 };
 
 /// Applies simple modifications to a binary string, such as directly replacing
@@ -211,7 +232,14 @@ public:
   /// needed to encode \p Value.
   void addUDataPatch(uint32_t Offset, uint64_t Value, uint64_t Size);
 
+  /// Add all patches of \p Other after the patches of this patcher.
+  void append(SimpleBinaryPatcher &&Other);
+
   void patchBinary(std::string &BinaryContents) override;
+
+  /// Copy \p Contents to \p OS replacing the patched ranges on the way,
+  /// without making a copy of the contents.
+  void writePatched(StringRef Contents, raw_ostream &OS) override;
 };
 
 /// Apply small modifications to the .debug_abbrev DWARF section.
@@ -242,9 +270,32 @@ public:
                          uint8_t NewAttrTag,
                          uint8_t NewAttrForm);
 
+  /// Add all patches of \p Other to this patcher.
+  void append(DebugAbbrevPatcher &&Other);
+
   void patchBinary(std::string &Contents) override;
 };
 
+/// Debug info updates for a group of compile units that are processed
+/// together. Each group gets its own writers, so that groups can be updated
+/// concurrently. Offsets into .debug_ranges and .debug_loc are relative to
+/// the writers of the group until the groups are appended to the output
+/// sections in order.
+struct DebugInfoUpdate {
+  DebugRangesSectionsWriter RangesWriter;
+  DebugLocWriter LocWriter;
+  SimpleBinaryPatcher InfoPatcher;
+  DebugAbbrevPatcher AbbrevPatcher;
+
+  /// Offsets of .debug_info attributes referring to .debug_ranges and
+  /// .debug_loc, and their values relative to RangesWriter and LocWriter.
+  std::vector<std::pair<uint32_t, uint64_t>> RangesRefs;
+  std::vector<std::pair<uint32_t, uint64_t>> LocRefs;
+
+  explicit DebugInfoUpdate(BinaryContext *BC)
+    : RangesWriter(BC), LocWriter(BC) {}
+};
+
 } // namespace bolt
 } // namespace llvm
 
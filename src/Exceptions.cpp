@@ -30,6 +30,7 @@
 #include "llvm/Support/raw_ostream.h"
 #include <functional>
 #include <map>
+#include <mutex>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-exceptions"
@@ -42,6 +43,13 @@ extern llvm::cl::OptionCategory BoltCategory;
 
 extern llvm::cl::opt<unsigned> Verbosity;
 
+static llvm::cl::opt<bool>
+CompactEHTable("compact-eh-table",
+  llvm::cl::desc("encode call site tables of functions that are not split "
+                 "with uleb128 values to shrink exception tables"),
+  llvm::cl::ZeroOrMore,
+  llvm::cl::cat(BoltCategory));
+
 static llvm::cl::opt<bool>
 PrintExceptions("print-exceptions",
   llvm::cl::desc("print exception handling data"),
@@ -56,6 +64,9 @@ namespace bolt {
 
 namespace {
 
+/// Serializes -print-exceptions output of functions parsed in parallel.
+std::mutex PrintMutex;
+
 unsigned getEncodingSize(unsigned Encoding, BinaryContext &BC) {
   switch (Encoding & 0x0f) {
   default: llvm_unreachable("unknown encoding");
@@ -148,6 +159,10 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
 
   assert(LPStart == 0 && "support for split functions not implemented");
 
+  // Functions are parsed in parallel. Collect the output and print it at once.
+  std::string PrintBuffer;
+  raw_string_ostream OS(PrintBuffer);
+
   const auto TTypeEncoding = Data.getU8(&Offset);
   size_t TTypeEncodingSize = 0;
   uintptr_t TTypeEnd = 0;
@@ -157,13 +172,13 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
   }
 
   if (opts::PrintExceptions) {
-    outs() << "[LSDA at 0x" << Twine::utohexstr(getLSDAAddress())
+    OS << "[LSDA at 0x" << Twine::utohexstr(getLSDAAddress())
            << " for function " << *this << "]:\n";
-    outs() << "LPStart Encoding = 0x"
+    OS << "LPStart Encoding = 0x"
            << Twine::utohexstr(LPStartEncoding) << '\n';
-    outs() << "LPStart = 0x" << Twine::utohexstr(LPStart) << '\n';
-    outs() << "TType Encoding = 0x" << Twine::utohexstr(TTypeEncoding) << '\n';
-    outs() << "TType End = " << TTypeEnd << '\n';
+    OS << "LPStart = 0x" << Twine::utohexstr(LPStart) << '\n';
+    OS << "TType Encoding = 0x" << Twine::utohexstr(TTypeEncoding) << '\n';
+    OS << "TType End = " << TTypeEnd << '\n';
   }
 
   // Table to store list of indices in type table. Entries are uleb128 values.
@@ -187,9 +202,9 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
   auto ActionTableStart = CallSiteTableEnd;
 
   if (opts::PrintExceptions) {
-    outs() << "CallSite Encoding = " << (unsigned)CallSiteEncoding << '\n';
-    outs() << "CallSite table length = " << CallSiteTableLength << '\n';
-    outs() << '\n';
+    OS << "CallSite Encoding = " << (unsigned)CallSiteEncoding << '\n';
+    OS << "CallSite table length = " << CallSiteTableLength << '\n';
+    OS << '\n';
   }
 
   HasEHRanges = CallSitePtr < CallSiteTableEnd;
@@ -204,11 +219,11 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
     uint64_t ActionEntry = Data.getULEB128(&CallSitePtr);
 
     if (opts::PrintExceptions) {
-      outs() << "Call Site: [0x" << Twine::utohexstr(RangeBase + Start)
+      OS << "Call Site: [0x" << Twine::utohexstr(RangeBase + Start)
              << ", 0x" << Twine::utohexstr(RangeBase + Start + Length)
              << "); landing pad: 0x" << Twine::utohexstr(LPStart + LandingPad)
              << "; action entry: 0x" << Twine::utohexstr(ActionEntry) << "\n";
-      outs() << "  current offset is " << (CallSitePtr - CallSiteTableStart)
+      OS << "  current offset is " << (CallSitePtr - CallSiteTableStart)
              << '\n';
     }
 
@@ -226,7 +241,7 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
         if (Label != Labels.end()) {
           LPSymbol = Label->second;
         } else {
-          LPSymbol = BC.Ctx->createTempSymbol("LP", true);
+          LPSymbol = createLocalTempSymbol("LP");
           Labels[LandingPad] = LPSymbol;
         }
       }
@@ -277,7 +292,7 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
         }
       };
       if (opts::PrintExceptions)
-        outs() << "    actions: ";
+        OS << "    actions: ";
       uint32_t ActionPtr = ActionTableStart + ActionEntry - 1;
       long long ActionType;
       long long ActionNext;
@@ -287,21 +302,21 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
         auto Self = ActionPtr;
         ActionNext = Data.getSLEB128(&ActionPtr);
         if (opts::PrintExceptions)
-          outs() << Sep << "(" << ActionType << ", " << ActionNext << ") ";
+          OS << Sep << "(" << ActionType << ", " << ActionNext << ") ";
         if (ActionType == 0) {
           if (opts::PrintExceptions)
-            outs() << "cleanup";
+            OS << "cleanup";
         } else if (ActionType > 0) {
           // It's an index into a type table.
           MaxTypeIndex = std::max(MaxTypeIndex,
                                   static_cast<unsigned>(ActionType));
           if (opts::PrintExceptions) {
-            outs() << "catch type ";
-            printType(ActionType, outs());
+            OS << "catch type ";
+            printType(ActionType, OS);
           }
         } else { // ActionType < 0
           if (opts::PrintExceptions)
-            outs() << "filter exception types ";
+            OS << "filter exception types ";
           auto TSep = "";
           // ActionType is a negative *byte* offset into *uleb128-encoded* table
           // of indices with base 1.
@@ -311,8 +326,8 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
           while (auto Index = Data.getULEB128(&TypeIndexTablePtr)) {
             MaxTypeIndex = std::max(MaxTypeIndex, static_cast<unsigned>(Index));
             if (opts::PrintExceptions) {
-              outs() << TSep;
-              printType(Index, outs());
+              OS << TSep;
+              printType(Index, OS);
               TSep = ", ";
             }
           }
@@ -326,11 +341,14 @@ void BinaryFunction::parseLSDA(ArrayRef<uint8_t> LSDASectionData,
         ActionPtr = Self + ActionNext;
       } while (ActionNext);
       if (opts::PrintExceptions)
-        outs() << '\n';
+        OS << '\n';
     }
   }
-  if (opts::PrintExceptions)
-    outs() << '\n';
+  if (opts::PrintExceptions) {
+    OS << '\n';
+    std::lock_guard<std::mutex> Lock(PrintMutex);
+    outs() << OS.str();
+  }
 
   assert(TypeIndexTableStart + MaxTypeIndexTableOffset <=
              Data.getData().size() &&
@@ -431,9 +449,13 @@ void BinaryFunction::updateEHRanges() {
         continue;
 
       // Same symbol is used for the beginning and the end of the range.
-      const MCSymbol *EHSymbol = BC.Ctx->createTempSymbol("EH", true);
+      const MCSymbol *EHSymbol;
       MCInst EHLabel;
-      BC.MIB->createEHLabel(EHLabel, EHSymbol, BC.Ctx.get());
+      EHSymbol = createLocalTempSymbol("EH");
+      {
+        std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+        BC.MIB->createEHLabel(EHLabel, EHSymbol, BC.Ctx.get());
+      }
       II = std::next(BB->insertPseudoInstr(II, EHLabel));
 
       // At this point we could be in one of the following states:
@@ -519,6 +541,14 @@ void BinaryFunction::emitLSDA(MCStreamer *Streamer, bool EmitColdPart) {
   // Corresponding FDE start.
   const auto *StartSymbol = EmitColdPart ? getColdSymbol() : getSymbol();
 
+  // Without splitting all ranges and landing pads follow the function start
+  // and the call site table can use uleb128 values. The sizes of the tables
+  // are then only known after layout and are emitted as label differences.
+  if (opts::CompactEHTable && !isSplit()) {
+    emitCompactLSDA(Streamer, *Sites, StartSymbol);
+    return;
+  }
+
   // Emit the LSDA header.
 
   // If LPStart is omitted, then the start of the FDE is used as a base for
@@ -611,6 +641,55 @@ void BinaryFunction::emitLSDA(MCStreamer *Streamer, bool EmitColdPart) {
     Streamer->EmitULEB128IntValue(CallSite.Action);
   }
 
+  emitLSDATables(Streamer, /*TTBaseLabel=*/nullptr);
+}
+
+void BinaryFunction::emitCompactLSDA(MCStreamer *Streamer,
+                                     const std::vector<CallSite> &Sites,
+                                     const MCSymbol *StartSymbol) {
+  auto &Ctx = *BC.Ctx;
+  auto emitDiff = [&](const MCSymbol *Hi, const MCSymbol *Lo) {
+    Streamer->EmitULEB128Value(
+        MCBinaryExpr::createSub(MCSymbolRefExpr::create(Hi, Ctx),
+                                MCSymbolRefExpr::create(Lo, Ctx), Ctx));
+  };
+
+  auto *TTBaseLabel = Ctx.createTempSymbol("TTBase", true);
+  auto *TTBaseRefLabel = Ctx.createTempSymbol("TTBaseRef", true);
+  auto *CSBeginLabel = Ctx.createTempSymbol("CSBegin", true);
+  auto *CSEndLabel = Ctx.createTempSymbol("CSEnd", true);
+
+  // The main fragment cannot start with a landing pad, so the function start
+  // is used as LPStart.
+  Streamer->EmitIntValue(dwarf::DW_EH_PE_omit, 1);        // LPStart format
+  Streamer->EmitIntValue(BC.MOFI->getTTypeEncoding(), 1); // TType format
+  emitDiff(TTBaseLabel, TTBaseRefLabel);
+  Streamer->EmitLabel(TTBaseRefLabel);
+
+  Streamer->EmitIntValue(dwarf::DW_EH_PE_uleb128, 1);
+  emitDiff(CSEndLabel, CSBeginLabel);
+  Streamer->EmitLabel(CSBeginLabel);
+  for (const auto &CallSite : Sites) {
+    assert(CallSite.Start && CallSite.End && "EH labels expected");
+    emitDiff(CallSite.Start, StartSymbol);
+    emitDiff(CallSite.End, CallSite.Start);
+    if (CallSite.LP)
+      emitDiff(CallSite.LP, StartSymbol);
+    else
+      Streamer->EmitULEB128IntValue(0);
+    Streamer->EmitULEB128IntValue(CallSite.Action);
+  }
+  Streamer->EmitLabel(CSEndLabel);
+
+  emitLSDATables(Streamer, TTBaseLabel);
+}
+
+void BinaryFunction::emitLSDATables(MCStreamer *Streamer,
+                                    const MCSymbol *TTBaseLabel) {
+  const auto TTypeEncoding = BC.MOFI->getTTypeEncoding();
+  const auto TTypeEncodingSize = getEncodingSize(TTypeEncoding, BC);
+  const auto TTypeAlignment = 4;
+
   // Write out action, type, and type index tables at the end.
   //
   // For action and type index tables there's no need to change the original
@@ -622,6 +701,8 @@ void BinaryFunction::emitLSDA(MCStreamer *Streamer, bool EmitColdPart) {
   for (auto const &Byte : LSDAActionTable) {
     Streamer->EmitIntValue(Byte, 1);
   }
+  if (TTBaseLabel)
+    Streamer->EmitValueToAlignment(TTypeAlignment);
   assert(!(TTypeEncoding & dwarf::DW_EH_PE_indirect) &&
          "indirect type info encoding is not supported yet");
   for (int Index = LSDATypeTable.size() - 1; Index >= 0; --Index) {
@@ -654,6 +735,8 @@ void BinaryFunction::emitLSDA(MCStreamer *Streamer, bool EmitColdPart) {
     }
     }
   }
+  if (TTBaseLabel)
+    Streamer->EmitLabel(TTBaseLabel);
   for (auto const &Byte : LSDATypeIndexTable) {
     Streamer->EmitIntValue(Byte, 1);
   }
@@ -866,13 +949,15 @@ std::vector<char> CFIReaderWriter::generateEHFrameHeader(
     const DWARFDebugFrame &NewEHFrame,
     uint64_t EHFrameHeaderAddress,
     std::vector<uint64_t> &FailedAddresses) const {
-  // Common PC -> FDE map to be written into .eh_frame_hdr.
-  std::map<uint64_t, uint64_t> PCToFDE;
+  // PC -> FDE entries of each frame section, sorted by PC.
+  using PCToFDEVector = std::vector<std::pair<uint64_t, uint64_t>>;
+  PCToFDEVector NewEntries;
+  PCToFDEVector OldEntries;
 
   // Presort array for binary search.
   std::sort(FailedAddresses.begin(), FailedAddresses.end());
 
-  // Initialize PCToFDE using NewEHFrame.
+  // Collect entries from NewEHFrame.
   NewEHFrame.for_each_FDE([&](const dwarf::FDE *FDE) {
     const auto FuncAddress = FDE->getInitialLocation();
     const auto FDEAddress = NewEHFrame.getEHFrameAddress() + FDE->getOffset();
@@ -881,13 +966,13 @@ std::vector<char> CFIReaderWriter::generateEHFrameHeader(
     if (FuncAddress == 0)
       return;
 
-    // Add the address to the map unless we failed to write it.
+    // Add the address to the table unless we failed to write it.
     if (!std::binary_search(FailedAddresses.begin(), FailedAddresses.end(),
                             FuncAddress)) {
       DEBUG(dbgs() << "BOLT-DEBUG: FDE for function at 0x"
                    << Twine::utohexstr(FuncAddress) << " is at 0x"
                    << Twine::utohexstr(FDEAddress) << '\n');
-      PCToFDE[FuncAddress] = FDEAddress;
+      NewEntries.emplace_back(FuncAddress, FDEAddress);
     }
   });
 
@@ -896,19 +981,12 @@ std::vector<char> CFIReaderWriter::generateEHFrameHeader(
                                 NewEHFrame.entries().end())
                << " entries\n");
 
-  // Add entries from the original .eh_frame corresponding to the functions
-  // that we did not update.
+  // Collect entries from the original .eh_frame. They are used for the
+  // functions that we did not update.
   OldEHFrame.for_each_FDE([&](const dwarf::FDE *FDE) {
     const auto FuncAddress = FDE->getInitialLocation();
     const auto FDEAddress = OldEHFrame.getEHFrameAddress() + FDE->getOffset();
-
-    // Add the address if we failed to write it.
-    if (PCToFDE.count(FuncAddress) == 0) {
-      DEBUG(dbgs() << "BOLT-DEBUG: old FDE for function at 0x"
-                   << Twine::utohexstr(FuncAddress) << " is at 0x"
-                   << Twine::utohexstr(FDEAddress) << '\n');
-      PCToFDE[FuncAddress] = FDEAddress;
-    }
+    OldEntries.emplace_back(FuncAddress, FDEAddress);
   });
 
   DEBUG(dbgs() << "BOLT-DEBUG: old .eh_frame contains "
@@ -916,7 +994,51 @@ std::vector<char> CFIReaderWriter::generateEHFrameHeader(
                                 OldEHFrame.entries().end())
                << " entries\n");
 
-  // Generate a new .eh_frame_hdr based on the new map.
+  // Both sections are normally emitted in address order, so sorting is only
+  // needed as a fallback. Among entries with the same PC, the last new one
+  // and the first old one are used.
+  auto sortEntries = [](PCToFDEVector &Entries, bool KeepLast) {
+    auto LessPC = [](const std::pair<uint64_t, uint64_t> &A,
+                     const std::pair<uint64_t, uint64_t> &B) {
+      return A.first < B.first;
+    };
+    if (!std::is_sorted(Entries.begin(), Entries.end(), LessPC))
+      std::stable_sort(Entries.begin(), Entries.end(), LessPC);
+    PCToFDEVector Unique;
+    Unique.reserve(Entries.size());
+    for (const auto &Entry : Entries) {
+      if (!Unique.empty() && Unique.back().first == Entry.first) {
+        if (KeepLast)
+          Unique.back() = Entry;
+        continue;
+      }
+      Unique.emplace_back(Entry);
+    }
+    Entries = std::move(Unique);
+  };
+  sortEntries(NewEntries, /*KeepLast=*/true);
+  sortEntries(OldEntries, /*KeepLast=*/false);
+
+  // Merge the sorted tables with new entries taking precedence.
+  PCToFDEVector PCToFDE;
+  PCToFDE.reserve(NewEntries.size() + OldEntries.size());
+  auto NI = NewEntries.begin();
+  auto OI = OldEntries.begin();
+  while (NI != NewEntries.end() || OI != OldEntries.end()) {
+    if (OI == OldEntries.end() ||
+        (NI != NewEntries.end() && NI->first <= OI->first)) {
+      if (OI != OldEntries.end() && OI->first == NI->first)
+        ++OI;
+      PCToFDE.emplace_back(*NI++);
+      continue;
+    }
+    DEBUG(dbgs() << "BOLT-DEBUG: old FDE for function at 0x"
+                 << Twine::utohexstr(OI->first) << " is at 0x"
+                 << Twine::utohexstr(OI->second) << '\n');
+    PCToFDE.emplace_back(*OI++);
+  }
+
+  // Generate a new .eh_frame_hdr based on the merged table.
 
   // Header plus table of entries of size 8 bytes.
   std::vector<char> EHFrameHeader(12 + PCToFDE.size() * 8);
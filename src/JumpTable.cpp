@@ -113,7 +113,7 @@ uint64_t JumpTable::emit(MCStreamer *Streamer,
     LabelCounts[CurrentLabel] = CurrentLabelCount;
   } else {
     Streamer->SwitchSection(Count > 0 ? HotSection : ColdSection);
-    Streamer->EmitValueToAlignment(EntrySize);
+    Streamer->EmitValueToAlignment(std::max(EntrySize, OutputEntrySize));
   }
   MCSymbol *LastLabel = nullptr;
   uint64_t Offset = 0;
@@ -132,13 +132,21 @@ uint64_t JumpTable::emit(MCStreamer *Streamer,
         } else {
           Streamer->SwitchSection(ColdSection);
         }
-        Streamer->EmitValueToAlignment(EntrySize);
+        Streamer->EmitValueToAlignment(std::max(EntrySize, OutputEntrySize));
       }
       Streamer->EmitLabel(LI->second);
       LastLabel = LI->second;
     }
     if (Type == JTT_NORMAL) {
       Streamer->EmitSymbolValue(Entry, OutputEntrySize);
+    } else if (EntryBase) {
+      auto &Ctx = Streamer->getContext();
+      auto Value = MCBinaryExpr::createAShr(
+          MCBinaryExpr::createSub(MCSymbolRefExpr::create(Entry, Ctx),
+                                  MCSymbolRefExpr::create(EntryBase, Ctx),
+                                  Ctx),
+          MCConstantExpr::create(EntryShift, Ctx), Ctx);
+      Streamer->EmitValue(Value, OutputEntrySize);
     } else { // JTT_PIC
       auto JT = MCSymbolRefExpr::create(LastLabel, Streamer->getContext());
       auto E = MCSymbolRefExpr::create(Entry, Streamer->getContext());
@@ -56,6 +56,11 @@ public:
   /// The type of this jump table.
   JumpTableType Type;
 
+  /// If set, entries of a PIC jump table are offsets from this code symbol
+  /// shifted right by EntryShift instead of offsets from the table.
+  const MCSymbol *EntryBase{nullptr};
+  unsigned EntryShift{0};
+
   /// All the entries as labels.
   std::vector<MCSymbol *> Entries;
 
@@ -12,10 +12,12 @@
 #ifndef LLVM_TOOLS_LLVM_BOLT_MCPLUS_H
 #define LLVM_TOOLS_LLVM_BOLT_MCPLUS_H
 
+#include "llvm/ADT/BitVector.h"
 #include "llvm/CodeGen/TargetOpcodes.h"
 #include "llvm/MC/MCExpr.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/Support/Casting.h"
+#include <vector>
 
 namespace llvm {
 namespace bolt {
@@ -58,6 +60,8 @@ public:
     kGnuArgsSize,         /// GNU args size.
     kJumpTable,           /// Jump Table.
     kConditionalTailCall, /// CTC.
+    kInstructionId,       /// Dense id of the instruction in its function.
+    kInputEncoding,       /// Record of the input bytes of the instruction.
     kGeneric              /// First generic annotation.
   };
 
@@ -96,6 +100,52 @@ private:
   ValueType Value;
 };
 
+/// Values of one annotation kept outside of the instructions, indexed by
+/// the dense instruction ids that BinaryFunction hands out. Values live in a
+/// contiguous array, so that lookups do not walk the annotation operands,
+/// and they are all released at once when the table is cleared.
+template <typename ValueType>
+class AnnotationTable {
+public:
+  /// Return the value for instruction \p Id, creating a default one if
+  /// there is none. References are invalidated when the table grows.
+  ValueType &getOrCreate(uint32_t Id) {
+    if (Id >= Values.size()) {
+      Values.resize(Id + 1);
+      HasValue.resize(Id + 1);
+    }
+    HasValue.set(Id);
+    return Values[Id];
+  }
+
+  /// Return the value for instruction \p Id or nullptr if it has none.
+  const ValueType *get(uint32_t Id) const {
+    if (Id >= Values.size() || !HasValue[Id])
+      return nullptr;
+    return &Values[Id];
+  }
+
+  /// Make room for instruction ids below \p Size.
+  void reserve(uint32_t Size) {
+    if (Size <= Values.size())
+      return;
+    Values.resize(Size);
+    HasValue.resize(Size);
+  }
+
+  /// Release all values.
+  void clear() {
+    std::vector<ValueType>().swap(Values);
+    HasValue.clear();
+  }
+
+  bool empty() const { return Values.empty(); }
+
+private:
+  std::vector<ValueType> Values;
+  BitVector HasValue;
+};
+
 /// Return a number of operands in \Inst excluding operands representing
 /// annotations.
 inline unsigned getNumPrimeOperands(const MCInst &Inst) {
@@ -107,6 +157,17 @@ inline unsigned getNumPrimeOperands(const MCInst &Inst) {
   return Inst.getNumOperands();
 }
 
+/// Return a copy of \p Inst with no annotations. A plain copy of an
+/// instruction would share the annotations of the original.
+inline MCInst copyWithoutAnnotations(const MCInst &Inst) {
+  MCInst Copy;
+  Copy.setOpcode(Inst.getOpcode());
+  Copy.setLoc(Inst.getLoc());
+  for (unsigned I = 0; I < getNumPrimeOperands(Inst); ++I)
+    Copy.addOperand(Inst.getOperand(I));
+  return Copy;
+}
+
 } // namespace MCPlus
 
 } // namespace bolt
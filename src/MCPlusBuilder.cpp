@@ -18,6 +18,7 @@
 #include "llvm/MC/MCInstrDesc.h"
 #include "llvm/MC/MCInstrInfo.h"
 #include "llvm/Support/Debug.h"
+#include <atomic>
 #include <cstdint>
 #include <queue>
 
@@ -197,6 +198,95 @@ bool MCPlusBuilder::unsetConditionalTailCall(MCInst &Inst) {
   return true;
 }
 
+Optional<uint32_t> MCPlusBuilder::getInstructionId(const MCInst &Inst) const {
+  auto Value = getAnnotationOpValue(Inst, MCAnnotation::kInstructionId);
+  if (!Value)
+    return NoneType();
+  return static_cast<uint32_t>(*Value);
+}
+
+void MCPlusBuilder::setInstructionId(MCInst &Inst, uint32_t Id) {
+  setAnnotationOpValue(Inst, MCAnnotation::kInstructionId, Id);
+}
+
+Optional<uint32_t> MCPlusBuilder::getInputEncoding(const MCInst &Inst) const {
+  auto Value = getAnnotationOpValue(Inst, MCAnnotation::kInputEncoding);
+  if (!Value)
+    return NoneType();
+  return static_cast<uint32_t>(*Value);
+}
+
+void MCPlusBuilder::setInputEncoding(MCInst &Inst, uint32_t Record) {
+  setAnnotationOpValue(Inst, MCAnnotation::kInputEncoding, Record);
+}
+
+namespace {
+
+/// Source of unique builder identifiers.
+std::atomic<uint64_t> NextBuilderId(1);
+
+/// Arena used by the current thread, and the builder it belongs to.
+thread_local uint64_t CachedBuilderId = 0;
+thread_local void *CachedAnnotationAllocator = nullptr;
+
+} // anonymous namespace
+
+MCPlusBuilder::MCPlusBuilder(const MCInstrAnalysis *Analysis,
+                             const MCInstrInfo *Info,
+                             const MCRegisterInfo *RegInfo)
+  : BuilderId(NextBuilderId++), Analysis(Analysis), Info(Info),
+    RegInfo(RegInfo) {}
+
+MCPlusBuilder::AnnotationAllocator &MCPlusBuilder::getAnnotationAllocator() {
+  if (CachedBuilderId == BuilderId)
+    return *static_cast<AnnotationAllocator *>(CachedAnnotationAllocator);
+
+  std::lock_guard<std::mutex> Lock(AnnotationAllocMutex);
+  auto &AnnotationAlloc = AnnotationAllocators[std::this_thread::get_id()];
+  if (!AnnotationAlloc)
+    AnnotationAlloc = llvm::make_unique<AnnotationAllocator>();
+
+  CachedBuilderId = BuilderId;
+  CachedAnnotationAllocator = AnnotationAlloc.get();
+  return *AnnotationAlloc;
+}
+
+void MCPlusBuilder::destroyAnnotation(MCAnnotation *Annotation) {
+  auto tryDestroy = [&](AnnotationAllocator &AnnotationAlloc) {
+    std::lock_guard<std::mutex> Lock(AnnotationAlloc.PoolMutex);
+    auto Itr = AnnotationAlloc.AnnotationPool.find(Annotation);
+    if (Itr == AnnotationAlloc.AnnotationPool.end())
+      return false;
+    AnnotationAlloc.AnnotationPool.erase(Itr);
+    Annotation->~MCAnnotation();
+    return true;
+  };
+
+  // Most annotations are removed by the thread that created them.
+  auto &LocalAlloc = getAnnotationAllocator();
+  if (tryDestroy(LocalAlloc))
+    return;
+
+  std::lock_guard<std::mutex> Lock(AnnotationAllocMutex);
+  for (auto &AAI : AnnotationAllocators) {
+    if (AAI.second.get() != &LocalAlloc && tryDestroy(*AAI.second))
+      return;
+  }
+}
+
+void MCPlusBuilder::freeAnnotations() {
+  std::lock_guard<std::mutex> Lock(AnnotationAllocMutex);
+  for (auto &AAI : AnnotationAllocators) {
+    auto &AnnotationAlloc = *AAI.second;
+    for (auto *Annotation : AnnotationAlloc.AnnotationPool) {
+      Annotation->~MCAnnotation();
+    }
+    AnnotationAlloc.AnnotationPool.clear();
+    AnnotationAlloc.MCInstAllocator.DestroyAll();
+    AnnotationAlloc.ValueAllocator.Reset();
+  }
+}
+
 bool MCPlusBuilder::hasAnnotation(const MCInst &Inst, unsigned Index) const {
   const auto *AnnotationInst = getAnnotationInst(Inst);
   if (!AnnotationInst)
@@ -214,13 +304,8 @@ bool MCPlusBuilder::removeAnnotation(MCInst &Inst, unsigned Index) {
     auto ImmValue = AnnotationInst->getOperand(I).getImm();
     if (extractAnnotationIndex(ImmValue) == Index) {
       AnnotationInst->erase(AnnotationInst->begin() + I);
-      auto *Annotation =
-        reinterpret_cast<MCAnnotation *>(extractAnnotationValue(ImmValue));
-      auto Itr = AnnotationPool.find(Annotation);
-      if (Itr != AnnotationPool.end()) {
-        AnnotationPool.erase(Itr);
-        Annotation->~MCAnnotation();
-      }
+      destroyAnnotation(
+        reinterpret_cast<MCAnnotation *>(extractAnnotationValue(ImmValue)));
       return true;
     }
   }
@@ -236,13 +321,8 @@ void MCPlusBuilder::removeAllAnnotations(MCInst &Inst) {
   for (int I = AnnotationInst->getNumOperands() - 1; I >= 0; --I) {
     auto ImmValue = AnnotationInst->getOperand(I).getImm();
     AnnotationInst->erase(std::prev(AnnotationInst->end()));
-    auto *Annotation =
-      reinterpret_cast<MCAnnotation *>(extractAnnotationValue(ImmValue));
-    auto Itr = AnnotationPool.find(Annotation);
-    if (Itr != AnnotationPool.end()) {
-      AnnotationPool.erase(Itr);
-      Annotation->~MCAnnotation();
-    }
+    destroyAnnotation(
+      reinterpret_cast<MCAnnotation *>(extractAnnotationValue(ImmValue)));
   }
 
   // Clear all attached MC+ info since it's no longer used.
@@ -262,6 +342,7 @@ MCPlusBuilder::printAnnotations(const MCInst &Inst, raw_ostream &OS) const {
     const auto *Annotation =
         reinterpret_cast<const MCAnnotation *>(Value);
     if (Index >= MCAnnotation::kGeneric) {
+      sys::ScopedReader Lock(AnnotationNameMutex);
       OS << " # " << AnnotationNames[Index - MCAnnotation::kGeneric]
          << ": ";
       Annotation->print(OS);
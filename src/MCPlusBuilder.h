@@ -31,13 +31,19 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/RWMutex.h"
 #include "llvm/Support/StringPool.h"
 #include <cassert>
 #include <cstdint>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <set>
 #include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 namespace llvm {
 namespace bolt {
@@ -53,16 +59,44 @@ enum class IndirectBranchType : char {
 
 class MCPlusBuilder {
 private:
-  /// Annotation instruction allocator.
-  SpecificBumpPtrAllocator<MCInst> MCInstAllocator;
+  /// Arena for annotation instructions and annotation values. Each thread
+  /// allocates from its own arena, so no lock is taken on the allocation path.
+  struct AnnotationAllocator {
+    /// Annotation instruction allocator.
+    SpecificBumpPtrAllocator<MCInst> MCInstAllocator;
+
+    /// Annotation value allocator.
+    BumpPtrAllocator ValueAllocator;
+
+    /// Record all the annotations with non-trivial type allocated in this
+    /// arena.  To prevent leaks, these will need destructors called when the
+    /// annotation is removed or when all annotations are destroyed.
+    std::unordered_set<MCPlus::MCAnnotation*> AnnotationPool;
+
+    /// Protects AnnotationPool, as an annotation could be removed by a thread
+    /// other than the one that created it.
+    std::mutex PoolMutex;
+  };
+
+  /// Arenas indexed by the thread that owns them. Arenas are only destroyed
+  /// together with the builder.
+  std::unordered_map<std::thread::id,
+                     std::unique_ptr<AnnotationAllocator>> AnnotationAllocators;
+
+  /// Protects AnnotationAllocators. Has to be acquired before PoolMutex of any
+  /// arena.
+  std::mutex AnnotationAllocMutex;
 
-  /// Annotation value allocator.
-  BumpPtrAllocator Allocator;
+  /// Unique identifier of this builder used to cache the arena of the current
+  /// thread.
+  const uint64_t BuilderId;
 
-  /// Record all the annotations with non-trivial type.  To prevent leaks, these
-  /// will need destructors called when the annotation is removed or when all
-  /// annotations are destroyed.
-  std::unordered_set<MCPlus::MCAnnotation*> AnnotationPool;
+  /// Return the arena of the calling thread, creating it on first use.
+  AnnotationAllocator &getAnnotationAllocator();
+
+  /// Destroy \p Annotation if it has a non-trivial type. Annotations with
+  /// trivial types are released together with their arena.
+  void destroyAnnotation(MCPlus::MCAnnotation *Annotation);
 
   /// We encode Index and Value into a 64-bit immediate operand value.
   static int64_t encodeAnnotationImm(unsigned Index, int64_t Value) {
@@ -102,7 +136,8 @@ private:
   void setAnnotationOpValue(MCInst &Inst, unsigned Index, int64_t Value) {
     auto *AnnotationInst = getAnnotationInst(Inst);
     if (!AnnotationInst) {
-      AnnotationInst = new (MCInstAllocator.Allocate()) MCInst();
+      AnnotationInst =
+        new (getAnnotationAllocator().MCInstAllocator.Allocate()) MCInst();
       AnnotationInst->setOpcode(TargetOpcode::ANNOTATION_LABEL);
       Inst.addOperand(MCOperand::createInst(AnnotationInst));
     }
@@ -154,6 +189,9 @@ protected:
   /// Names of non-standard annotations.
   SmallVector<std::string, 8> AnnotationNames;
 
+  /// Protects AnnotationNameIndexMap and AnnotationNames.
+  mutable sys::RWMutex AnnotationNameMutex;
+
 public:
   class InstructionIterator
     : public std::iterator<std::bidirectional_iterator_tag, MCInst> {
@@ -276,22 +314,15 @@ public:
 
 public:
   MCPlusBuilder(const MCInstrAnalysis *Analysis, const MCInstrInfo *Info,
-                const MCRegisterInfo *RegInfo)
-    : Analysis(Analysis), Info(Info), RegInfo(RegInfo) {}
+                const MCRegisterInfo *RegInfo);
 
   virtual ~MCPlusBuilder() {
     freeAnnotations();
   }
 
-  /// Free all memory allocated for annotations.
-  void freeAnnotations() {
-    for (auto *Annotation : AnnotationPool) {
-      Annotation->~MCAnnotation();
-    }
-    AnnotationPool.clear();
-    MCInstAllocator.DestroyAll();
-    Allocator.Reset();
-  }
+  /// Free all memory allocated for annotations. Must not be called while
+  /// other threads access annotations.
+  void freeAnnotations();
 
   using CompFuncTy = std::function<bool(const MCSymbol *, const MCSymbol *)>;
 
@@ -677,6 +708,29 @@ public:
     return nullptr;
   }
 
+  /// Outcome of applying a peephole pattern to an instruction.
+  enum class PeepholeAction : char {
+    NONE = 0,  /// The pattern does not apply.
+    REWRITE,   /// The instruction was rewritten in place.
+    ERASE,     /// The instruction is redundant and has to be removed.
+  };
+
+  /// A peephole rewrite provided by the target. Apply() receives all the
+  /// instructions of a basic block and the index of the one to rewrite, so
+  /// that the window ending with it can be given to the matchers above and
+  /// the instructions following it can be inspected.
+  struct PeepholePattern {
+    const char *Name;
+    std::function<PeepholeAction(MutableArrayRef<MCInst> Insts,
+                                 unsigned Index)> Apply;
+  };
+
+  /// Return the table of peephole patterns of the target. Patterns may be
+  /// applied to different functions in parallel.
+  virtual std::vector<PeepholePattern> getPeepholePatterns() {
+    return {};
+  }
+
   /// \brief Given a branch instruction try to get the address the branch
   /// targets. Return true on success, and the address in Target.
   virtual bool
@@ -704,6 +758,18 @@ public:
     return false;
   }
 
+  /// Return the size in bytes of the encoding of \p Inst if the target knows
+  /// it without running the encoder, e.g. from an earlier instruction of the
+  /// same shape. By default the size is unknown.
+  virtual Optional<uint32_t> getKnownInstructionSize(const MCInst &Inst) const {
+    return NoneType();
+  }
+
+  /// Record that \p Inst was encoded in \p Size bytes, so that
+  /// getKnownInstructionSize() can answer for instructions of the same shape.
+  virtual void recordInstructionSize(const MCInst &Inst, uint32_t Size) const {
+  }
+
   /// Return true if a pair of instructions represented by \p Insts
   /// could be fused into a single uop.
   virtual bool isMacroOpFusionPair(ArrayRef<MCInst> Insts) const {
@@ -795,12 +861,44 @@ public:
     return false;
   }
 
+  /// Determine whether conditional branch \p CondBranch is taken when the
+  /// flags it reads were set by the comparison \p FlagsInst. \p Input1 and
+  /// \p Input2 give the values of the registers \p FlagsInst reads, as in
+  /// evaluateSimple(). Return false if the outcome cannot be determined,
+  /// otherwise set \p Taken.
+  virtual bool evaluateBranchCondition(const MCInst &FlagsInst,
+                                       const MCInst &CondBranch,
+                                       std::pair<MCPhysReg, int64_t> Input1,
+                                       std::pair<MCPhysReg, int64_t> Input2,
+                                       bool &Taken) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
   virtual bool isRegToRegMove(const MCInst &Inst, MCPhysReg &From,
                               MCPhysReg &To) const {
     llvm_unreachable("not implemented");
     return false;
   }
 
+  /// Turn register-to-register move \p Inst into a conditional move that
+  /// takes place only when conditional branch \p CondBranch is taken, or
+  /// only when it is not taken if \p Invert is set. Return false and leave
+  /// \p Inst unchanged if the move or the condition is not supported.
+  virtual bool convertMoveToConditionalMove(MCInst &Inst,
+                                            const MCInst &CondBranch,
+                                            bool Invert) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
+  /// Return the register holding integer argument number \p ArgNo
+  /// (starting at 0) of a call, or 0 if it is not passed in a register.
+  virtual MCPhysReg getIntArgRegister(unsigned ArgNo) const {
+    llvm_unreachable("not implemented");
+    return 0;
+  }
+
   virtual MCPhysReg getStackPointer() const {
     llvm_unreachable("not implemented");
     return 0;
@@ -916,6 +1014,20 @@ public:
   /// branch. Return true if the instruction was converted.
   bool unsetConditionalTailCall(MCInst &Inst);
 
+  /// Return the dense id assigned to \p Inst within its function, if any.
+  Optional<uint32_t> getInstructionId(const MCInst &Inst) const;
+
+  /// Assign the dense id \p Id to \p Inst. Ids index the per-function
+  /// annotation tables, see MCPlus::AnnotationTable.
+  void setInstructionId(MCInst &Inst, uint32_t Id);
+
+  /// Return the index of the record describing the input encoding of
+  /// \p Inst in its function, if any.
+  Optional<uint32_t> getInputEncoding(const MCInst &Inst) const;
+
+  /// Attach the input encoding record \p Record to \p Inst.
+  void setInputEncoding(MCInst &Inst, uint32_t Record);
+
   /// Return MCSymbol that represents a target of this instruction at a given
   /// operand number \p OpNum. If there's no symbol associated with
   /// the operand - return nullptr.
@@ -1132,6 +1244,67 @@ public:
     return IndirectBranchType::UNKNOWN;
   }
 
+  /// Instructions of a jump through a table of offsets of the targets from
+  /// a code address, scaled down by 4. This is how AArch64 compilers lower
+  /// switch statements:
+  ///
+  ///   cmp   wI, #(NumEntries - 1)
+  ///   b.hi  default
+  ///   adrp  xT, JT                  # TablePage
+  ///   add   xT, xT, :lo12:JT        # TableLow
+  ///   ldrb  wI, [xT, wI, uxtw]      # Load
+  ///   adr   xB, base                # PCRelBase
+  ///   add   xB, xB, wI, sxtb #2     # TargetAdd
+  ///   br    xB
+  struct ScaledJumpTable {
+    MCInst *TablePage{nullptr};
+    MCInst *TableLow{nullptr};
+    MCInst *Load{nullptr};
+    MCInst *PCRelBase{nullptr};
+    MCInst *TargetAdd{nullptr};
+
+    /// Symbolic reference to the start of the table.
+    const MCExpr *TableExpr{nullptr};
+
+    /// Size of a table entry in the input.
+    unsigned EntrySize{0};
+
+    /// Number of entries established by the bounds check of the index.
+    uint64_t NumEntries{0};
+  };
+
+  /// Match the jump \p Instruction through a table described by
+  /// ScaledJumpTable, including the bounds check of its index, within
+  /// [\p Begin, \p End). Return false if any part is missing.
+  virtual bool analyzeScaledJumpTable(MCInst &Instruction,
+                                      InstructionIterator Begin,
+                                      InstructionIterator End,
+                                      ScaledJumpTable &Jump) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
+  /// Rewrite the instructions of \p Jump to read 4-byte entries from
+  /// \p Table that are relative to \p Base.
+  virtual bool rewriteScaledJumpTable(const ScaledJumpTable &Jump,
+                                      const MCSymbol *Table,
+                                      const MCSymbol *Base,
+                                      MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
+  /// Make the jump \p Instruction through a table rewritten by
+  /// rewriteScaledJumpTable() read unsigned entries of \p EntrySize bytes.
+  /// The rest of the sequence has to be in [\p Begin, \p End).
+  virtual bool setScaledJumpTableEntrySize(MCInst &Instruction,
+                                           InstructionIterator Begin,
+                                           InstructionIterator End,
+                                           unsigned EntrySize) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
   virtual bool
   analyzeVirtualMethodCall(InstructionIterator Begin,
                            InstructionIterator End,
@@ -1153,6 +1326,16 @@ public:
     llvm_unreachable("not implemented");
   }
 
+  /// Create a sequence of instructions jumping to the address stored in memory
+  /// at \p TargetLocation. The registers are set up the same way a PLT entry
+  /// does it, so the sequence could replace a PLT entry that loads its target
+  /// from \p TargetLocation.
+  virtual void createIndirectLongJmp(std::vector<MCInst> &Seq,
+                                     const MCSymbol *TargetLocation,
+                                     MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+  }
+
   /// Return true if the instruction CurInst, in combination with the recent
   /// history of disassembled instructions supplied by [Begin, End), is a linker
   /// generated veneer/stub that needs patching. This happens in AArch64 when
@@ -1253,6 +1436,16 @@ public:
     return false;
   }
 
+  /// Create a prefetch of the memory at the address given by the compound
+  /// memory operand into all levels of the cache hierarchy.
+  virtual bool createPrefetch(MCInst &Inst, const MCPhysReg &BaseReg,
+                              int64_t Scale, const MCPhysReg &IndexReg,
+                              int64_t Offset,
+                              const MCPhysReg &SegmentReg) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
   /// Create a fragment of code (sequence of instructions) that load a 32-bit
   /// address from memory, zero-extends it to 64 and jump to it (indirect jump).
   virtual bool
@@ -1263,6 +1456,26 @@ public:
     return false;
   }
 
+  /// Create a fragment of code that compares \p IndexReg with \p Imm and
+  /// jumps to \p Target if they are equal.
+  virtual bool createCmpJE(std::vector<MCInst> &Seq, const MCPhysReg &IndexReg,
+                           int64_t Imm, const MCSymbol *Target,
+                           MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
+  /// Create a fragment of code that jumps to \p Target if the bit selected by
+  /// \p IndexReg is set in \p Mask. \p IndexReg must be less than 64 and
+  /// \p TmpReg is clobbered.
+  virtual bool createBitTestJB(std::vector<MCInst> &Seq,
+                               const MCPhysReg &IndexReg, uint64_t Mask,
+                               const MCPhysReg &TmpReg, const MCSymbol *Target,
+                               MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
   /// Create a load instruction using \p StackReg as the base register
   /// and \p Offset as the displacement.
   virtual bool createRestoreFromStack(MCInst &Inst, const MCPhysReg &StackReg,
@@ -1290,6 +1503,79 @@ public:
     return {};
   }
 
+  /// Creates an inline memcpy of exactly \p Size bytes using unrolled moves.
+  /// If \p ReturnEnd is true, then return (dest + n) instead of dest.
+  virtual std::vector<MCInst> createInlineMemcpy(bool ReturnEnd,
+                                                 uint64_t Size) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
+  /// Creates an inline memset of exactly \p Size bytes using unrolled moves.
+  virtual std::vector<MCInst> createInlineMemset(uint64_t Size) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
+  /// Creates an inline memcmp of exactly \p Size bytes. Return an empty
+  /// sequence if the size is not supported.
+  virtual std::vector<MCInst> createInlineMemcmp(uint64_t Size) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
+  /// Return true if \p Inst sets register \p Reg to the constant \p Imm and
+  /// has no other effect on registers.
+  virtual bool isMoveImmToReg(const MCInst &Inst, MCPhysReg &Reg,
+                              int64_t &Imm) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
+  /// Create a startup stub that moves the code between \p Start and \p End
+  /// onto anonymous memory advised to be backed by transparent huge pages and
+  /// then jumps to \p Entry. Both bounds must be page aligned and the stub
+  /// must be placed outside of them. The stub preserves the registers that
+  /// are defined at the ELF entry point.
+  virtual std::vector<MCInst> createHugifyStub(const MCSymbol *Start,
+                                               const MCSymbol *End,
+                                               const MCSymbol *Entry,
+                                               MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
+  /// Create a sequence incrementing the 64-bit counter at \p Offset in the
+  /// current thread's shard of the counters starting at \p Counters. Shards
+  /// are \p ShardSize bytes apart and a thread uses shard number
+  /// (stack pointer >> \p ShardShift) % \p NumShards, where \p NumShards is a
+  /// power of two. The sequence preserves the registers in \p LiveRegs, or
+  /// all registers and flags if it is null, and does not write to the red
+  /// zone. Dead registers are used as temporaries to avoid spills.
+  virtual std::vector<MCInst>
+  createInstrCounterIncrement(const MCSymbol *Counters, uint64_t Offset,
+                              uint64_t ShardSize, unsigned NumShards,
+                              unsigned ShardShift, const BitVector *LiveRegs,
+                              MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
+  /// Create a startup stub that maps the file named by the NUL-terminated
+  /// string at \p FileName over the page aligned counters between
+  /// \p Counters and \p Counters + \p Size, and then jumps to \p Entry. The
+  /// file is created if needed and the counters keep accumulating in it. If
+  /// the file cannot be mapped, the counters are made writable in memory
+  /// instead. The stub preserves the registers that are defined at the ELF
+  /// entry point.
+  virtual std::vector<MCInst>
+  createInstrumentationStub(const MCSymbol *Counters, uint64_t Size,
+                            const MCSymbol *FileName, const MCSymbol *Entry,
+                            MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
   /// Returns true if instruction is a call frame pseudo instruction.
   virtual bool isCFI(const MCInst &Inst) const {
     return Inst.getOpcode() == TargetOpcode::CFI_INSTRUCTION;
@@ -1333,6 +1619,7 @@ public:
 
   /// Return annotation index matching the \p Name.
   Optional<unsigned> getAnnotationIndex(StringRef Name) const {
+    sys::ScopedReader Lock(AnnotationNameMutex);
     auto AI = AnnotationNameIndexMap.find(Name);
     if (AI != AnnotationNameIndexMap.end())
       return AI->second;
@@ -1342,6 +1629,10 @@ public:
   /// Return annotation index matching the \p Name. Create a new index if the
   /// \p Name wasn't registered previously.
   unsigned getOrCreateAnnotationIndex(StringRef Name) {
+    if (auto Index = getAnnotationIndex(Name))
+      return *Index;
+
+    sys::ScopedWriter Lock(AnnotationNameMutex);
     auto AI = AnnotationNameIndexMap.find(Name);
     if (AI != AnnotationNameIndexMap.end())
       return AI->second;
@@ -1360,9 +1651,12 @@ public:
                                  unsigned Index,
                                  const ValueType &Val) {
     assert(!hasAnnotation(Inst, Index));
-    auto *A = new (Allocator) MCPlus::MCSimpleAnnotation<ValueType>(Val);
+    auto &AnnotationAlloc = getAnnotationAllocator();
+    auto *A = new (AnnotationAlloc.ValueAllocator)
+      MCPlus::MCSimpleAnnotation<ValueType>(Val);
     if (!std::is_trivial<ValueType>::value) {
-      AnnotationPool.insert(A);
+      std::lock_guard<std::mutex> Lock(AnnotationAlloc.PoolMutex);
+      AnnotationAlloc.AnnotationPool.insert(A);
     }
     setAnnotationOpValue(Inst, Index, reinterpret_cast<int64_t>(A));
     return A->getValue();
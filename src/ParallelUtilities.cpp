@@ -0,0 +1,199 @@
+//===--- ParallelUtilities.cpp - Parallel execution of per-function work --===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "ParallelUtilities.h"
+#include "BinaryFunction.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define DEBUG_TYPE "bolt-parallel"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltCategory;
+
+cl::opt<bool>
+Deterministic("deterministic",
+  cl::desc("produce the same output regardless of the number of threads "
+           "and their scheduling"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+cl::opt<unsigned>
+ThreadCount("thread-count",
+  cl::desc("number of threads used for processing functions "
+           "(1 - process serially)"),
+  cl::init(std::max(1u, std::thread::hardware_concurrency())),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+cl::opt<unsigned>
+TimeBudget("time-budget",
+  cl::desc("limit in seconds for optimizing functions. Functions are "
+           "processed hottest first, and the ones left when the time runs "
+           "out keep their original form (0 - no limit)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+namespace ParallelUtilities {
+
+namespace {
+
+std::unique_ptr<ThreadPool> Pool;
+
+/// The time budget is counted from the start of the process.
+const auto StartTime = std::chrono::steady_clock::now();
+
+uint64_t estimateCost(const BinaryFunction &BF, SchedulingPolicy SchedPolicy) {
+  switch (SchedPolicy) {
+  case SP_TRIVIAL:
+  case SP_CONSTANT:
+    return 1;
+  case SP_INST_LINEAR:
+    return BF.getInstructionCount() + 1;
+  case SP_INST_QUADRATIC: {
+    const auto Count = BF.getInstructionCount() + 1;
+    return Count * Count;
+  }
+  case SP_BB_LINEAR:
+    return BF.size() + 1;
+  case SP_BB_QUADRATIC: {
+    const auto Count = BF.size() + 1;
+    return Count * Count;
+  }
+  }
+  llvm_unreachable("unknown scheduling policy");
+}
+
+} // anonymous namespace
+
+unsigned getThreadCount() {
+  return std::max(1u, unsigned(opts::ThreadCount));
+}
+
+bool isParallel() {
+  return getThreadCount() > 1;
+}
+
+bool isDeterministic() {
+  return opts::Deterministic;
+}
+
+bool hasTimeBudget() {
+  return opts::TimeBudget != 0;
+}
+
+bool isOverTimeBudget() {
+  if (!hasTimeBudget())
+    return false;
+  return std::chrono::steady_clock::now() - StartTime >=
+         std::chrono::seconds(opts::TimeBudget);
+}
+
+ThreadPool &getThreadPool() {
+  if (!Pool)
+    Pool = llvm::make_unique<ThreadPool>(getThreadCount());
+  return *Pool;
+}
+
+void runOnEachFunction(std::map<uint64_t, BinaryFunction> &BFs,
+                       SchedulingPolicy SchedPolicy,
+                       WorkFuncTy WorkFunction,
+                       PredicateTy SkipPredicate,
+                       StringRef LogName,
+                       unsigned TasksPerThread) {
+  if (BFs.empty())
+    return;
+
+  // Functions are processed in the order of their addresses, unless there is
+  // a time budget. Then the hottest functions go first, so that the ones
+  // that do not make it in time are the ones that matter the least.
+  std::vector<BinaryFunction *> Order;
+  Order.reserve(BFs.size());
+  for (auto &BFI : BFs)
+    Order.push_back(&BFI.second);
+  if (hasTimeBudget()) {
+    std::stable_sort(Order.begin(), Order.end(),
+                     [](const BinaryFunction *A, const BinaryFunction *B) {
+                       return A->getKnownExecutionCount() >
+                              B->getKnownExecutionCount();
+                     });
+  }
+
+  using OrderIterator = std::vector<BinaryFunction *>::iterator;
+  auto runBlock = [&](OrderIterator BlockBegin, OrderIterator BlockEnd) {
+    for (auto It = BlockBegin; It != BlockEnd; ++It) {
+      auto &BF = **It;
+      if (SkipPredicate && SkipPredicate(BF))
+        continue;
+      WorkFunction(BF);
+    }
+  };
+
+  if (SchedPolicy == SP_TRIVIAL || !isParallel()) {
+    runBlock(Order.begin(), Order.end());
+    return;
+  }
+
+  // Estimate the cost of the whole job to size the blocks. Skipped functions
+  // do not contribute to the cost.
+  uint64_t TotalCost = 0;
+  for (auto *BF : Order) {
+    if (SkipPredicate && SkipPredicate(*BF))
+      continue;
+    TotalCost += estimateCost(*BF, SchedPolicy);
+  }
+
+  const uint64_t BlockCost =
+    std::max<uint64_t>(1, TotalCost / (getThreadCount() * TasksPerThread));
+
+  DEBUG(dbgs() << "BOLT-DEBUG: running " << LogName << " on "
+               << getThreadCount() << " threads with total cost of "
+               << TotalCost << " and block cost of " << BlockCost << '\n');
+
+  // Blocks are queued in order and idle threads take the next one from the
+  // shared queue, so with a time budget the hot blocks start first.
+  auto &ThPool = getThreadPool();
+  auto BlockBegin = Order.begin();
+  uint64_t CurrentCost = 0;
+  for (auto It = Order.begin(); It != Order.end(); ++It) {
+    if (!SkipPredicate || !SkipPredicate(**It))
+      CurrentCost += estimateCost(**It, SchedPolicy);
+
+    if (CurrentCost >= BlockCost) {
+      auto BlockEnd = std::next(It);
+      ThPool.async(runBlock, BlockBegin, BlockEnd);
+      BlockBegin = BlockEnd;
+      CurrentCost = 0;
+    }
+  }
+  if (BlockBegin != Order.end())
+    ThPool.async(runBlock, BlockBegin, Order.end());
+
+  ThPool.wait();
+}
+
+} // namespace ParallelUtilities
+} // namespace bolt
+} // namespace llvm
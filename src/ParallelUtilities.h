@@ -0,0 +1,91 @@
+//===--- ParallelUtilities.h - Parallel execution of per-function work ----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Helpers for running work on BinaryFunctions concurrently using a thread pool
+// shared by all of BOLT. Functions are split into blocks of roughly similar
+// estimated cost, and each block is processed as a single task.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PARALLEL_UTILITIES_H
+#define LLVM_TOOLS_LLVM_BOLT_PARALLEL_UTILITIES_H
+
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+#include <functional>
+#include <map>
+
+namespace llvm {
+
+class ThreadPool;
+
+namespace bolt {
+
+class BinaryFunction;
+
+namespace ParallelUtilities {
+
+/// Cost model used to balance work blocks between threads.
+enum SchedulingPolicy {
+  SP_TRIVIAL,        /// Run the work serially on the calling thread.
+  SP_CONSTANT,       /// All functions have the same cost.
+  SP_INST_LINEAR,    /// Cost is linear in the number of instructions.
+  SP_INST_QUADRATIC, /// Cost is quadratic in the number of instructions.
+  SP_BB_LINEAR,      /// Cost is linear in the number of basic blocks.
+  SP_BB_QUADRATIC,   /// Cost is quadratic in the number of basic blocks.
+};
+
+using WorkFuncTy = std::function<void(BinaryFunction &BF)>;
+using PredicateTy = std::function<bool(const BinaryFunction &BF)>;
+
+/// Return the number of threads BOLT is allowed to use.
+unsigned getThreadCount();
+
+/// Return true if work may be distributed over more than one thread.
+bool isParallel();
+
+/// Return true if the output must not depend on the number of threads or on
+/// the order in which they complete their work.
+bool isDeterministic();
+
+/// Return true if optimizing functions is limited by -time-budget. Work on
+/// functions is then scheduled hottest first.
+bool hasTimeBudget();
+
+/// Return true if the time budget is set and was spent. Optional work on
+/// the functions not processed yet should be skipped.
+bool isOverTimeBudget();
+
+/// Return the thread pool shared by all parallel work. The pool is created on
+/// first use.
+ThreadPool &getThreadPool();
+
+/// Apply \p WorkFunction to every function in \p BFs for which
+/// \p SkipPredicate (if provided) returns false. Functions are grouped into
+/// blocks of consecutive functions with similar cost according to
+/// \p SchedPolicy, and blocks are executed on the shared thread pool. The call
+/// returns once all functions were processed. With a time budget, functions
+/// are processed in the order of decreasing execution count, and
+/// \p SkipPredicate is evaluated right before a function is processed.
+///
+/// \p WorkFunction must only modify state owned by the function it is given,
+/// or state explicitly protected for concurrent access.
+void runOnEachFunction(std::map<uint64_t, BinaryFunction> &BFs,
+                       SchedulingPolicy SchedPolicy,
+                       WorkFuncTy WorkFunction,
+                       PredicateTy SkipPredicate = PredicateTy(),
+                       StringRef LogName = "",
+                       unsigned TasksPerThread = 20);
+
+} // namespace ParallelUtilities
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
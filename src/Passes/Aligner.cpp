@@ -10,6 +10,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "Aligner.h"
+#include "BinaryLoop.h"
 
 #define DEBUG_TYPE "bolt-aligner"
 
@@ -41,6 +42,31 @@ AlignBlocksThreshold("align-blocks-threshold",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+cl::opt<bool>
+AlignLoops("align-loops",
+  cl::desc("align headers of hot inner loops with a high trip count so that "
+           "small loops fit in a single fetch and decoded uop cache window"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+cl::opt<unsigned>
+AlignLoopsMaxBytes("align-loops-max-bytes",
+  cl::desc("maximum number of bytes to use to align loop headers"),
+  cl::init(63),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+cl::opt<unsigned>
+AlignLoopsMinTripCount("align-loops-min-trip-count",
+  cl::desc("align only loops executing at least this many iterations per "
+           "entry on average"),
+  cl::init(4),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 cl::opt<unsigned>
 AlignFunctions("align-functions",
   cl::desc("align functions at a given value (relocation mode)"),
@@ -55,6 +81,14 @@ AlignFunctionsMaxBytes("align-functions-max-bytes",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<unsigned>
+LoopAlignment("loop-alignment",
+  cl::desc("boundary to use for alignment of loop headers with -align-loops. "
+           "0 selects 32 or 64 bytes based on the loop size on x86."),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<unsigned>
 BlockAlignment("block-alignment",
   cl::desc("boundary to use for alignment of basic blocks"),
@@ -69,6 +103,15 @@ UseCompactAligner("use-compact-aligner",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<bool>
+CompactHotText("compact-hot-text",
+  cl::desc("pack hot functions densely: do not align functions that are not "
+           "executed or cold parts, and align hot functions only as much as "
+           "needed to keep small ones within a cache line"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 } // end namespace opts
 
 namespace llvm {
@@ -112,6 +155,34 @@ void alignCompact(BinaryFunction &Function) {
       std::min(size_t(opts::AlignFunctionsMaxBytes), ColdSize));
 }
 
+// Choose the alignment of the function from its hotness and size. A hot
+// function is aligned to the smallest power of two covering its hot part, up
+// to -align-functions, which is enough for a function smaller than a cache
+// line not to cross one. Everything else is packed without padding.
+void alignHotTextCompact(BinaryFunction &Function) {
+  Function.setMaxColdAlignmentBytes(0);
+  if (!Function.hasValidIndex() || !Function.getKnownExecutionCount()) {
+    Function.setAlignment(BinaryFunction::MinAlign);
+    Function.setMaxAlignmentBytes(0);
+    return;
+  }
+
+  const auto &BC = Function.getBinaryContext();
+  uint64_t HotSize = 0;
+  for (const auto *BB : Function.layout()) {
+    if (!BB->isCold())
+      HotSize += BC.computeCodeSize(BB->begin(), BB->end());
+  }
+
+  const auto Alignment =
+    std::max<uint64_t>(std::min<uint64_t>(PowerOf2Ceil(HotSize),
+                                          opts::AlignFunctions),
+                       BinaryFunction::MinAlign);
+  Function.setAlignment(Alignment);
+  Function.setMaxAlignmentBytes(
+    std::min<uint64_t>(Alignment - 1, opts::AlignFunctionsMaxBytes));
+}
+
 } // end anonymous namespace
 
 void AlignerPass::alignBlocks(BinaryFunction &Function) {
@@ -125,7 +196,8 @@ void AlignerPass::alignBlocks(BinaryFunction &Function) {
   for (auto *BB : Function.layout()) {
     auto Count = BB->getKnownExecutionCount();
 
-    if (Count <= FuncCount * opts::AlignBlocksThreshold / 100) {
+    if (BB->isCold() ||
+        Count <= FuncCount * opts::AlignBlocksThreshold / 100) {
       PrevBB = BB;
       continue;
     }
@@ -154,6 +226,96 @@ void AlignerPass::alignBlocks(BinaryFunction &Function) {
   }
 }
 
+void AlignerPass::alignLoops(BinaryFunction &Function) {
+  if (!Function.hasValidProfile() || !Function.isSimple())
+    return;
+
+  const auto &BC = Function.getBinaryContext();
+  const auto FuncCount = std::max(1UL, Function.getKnownExecutionCount());
+
+  Function.calculateLoopInfo();
+
+  // Only inner loops, where the execution time is spent, are aligned.
+  std::vector<BinaryLoop *> Loops;
+  std::vector<BinaryLoop *> Worklist(Function.getLoopInfo().begin(),
+                                     Function.getLoopInfo().end());
+  while (!Worklist.empty()) {
+    auto *L = Worklist.back();
+    Worklist.pop_back();
+    if (L->getSubLoops().empty())
+      Loops.push_back(L);
+    else
+      Worklist.insert(Worklist.end(), L->begin(), L->end());
+  }
+
+  DenseMap<const BinaryBasicBlock *, BinaryBasicBlock *> LayoutPred;
+  BinaryBasicBlock *LastBB{nullptr};
+  for (auto *BB : Function.layout()) {
+    LayoutPred[BB] = LastBB;
+    LastBB = BB;
+  }
+
+  for (auto *L : Loops) {
+    auto *Header = L->getHeader();
+    const auto Count = Header->getKnownExecutionCount();
+
+    if (Header->isCold() ||
+        Count <= FuncCount * opts::AlignBlocksThreshold / 100)
+      continue;
+
+    // Estimate the trip count as the number of header executions per entry.
+    if (L->TotalBackEdgeCount >= Count)
+      continue;
+    const auto EntryCount = Count - L->TotalBackEdgeCount;
+    if (Count < EntryCount * opts::AlignLoopsMinTripCount)
+      continue;
+
+    // A rotated loop starts with the blocks laid out before the header, and
+    // its top block is the one to align.
+    auto *Top = Header;
+    while (auto *PrevBB = LayoutPred.lookup(Top)) {
+      if (!L->contains(PrevBB) || PrevBB->isCold())
+        break;
+      Top = PrevBB;
+    }
+
+    // Padding in front of the top of the loop is executed by the block
+    // falling through into it. That is fine for an entry into the loop, but
+    // not for a latch laid out right before it.
+    auto *PrevBB = LayoutPred.lookup(Top);
+    if (PrevBB && PrevBB->getFallthrough() == Top && L->contains(PrevBB))
+      continue;
+
+    uint64_t LoopSize = 0;
+    for (auto *BB : L->blocks()) {
+      if (!BB->isCold())
+        LoopSize += BC.computeCodeSize(BB->begin(), BB->end());
+    }
+
+    // The decoded uop cache of x86 cores maps 32-byte windows of code. A loop
+    // that fits in one window, or in one 64-byte cache line, is delivered
+    // from the fewest windows when it starts at the boundary.
+    uint64_t Alignment = opts::LoopAlignment;
+    if (!Alignment) {
+      if (BC.TheTriple->getArch() == llvm::Triple::x86_64)
+        Alignment = LoopSize <= 32 ? 32 : 64;
+      else
+        Alignment = opts::BlockAlignment;
+    }
+
+    if (Top->getAlignment() > Alignment)
+      continue;
+
+    Top->setAlignment(Alignment);
+    Top->setAlignmentMaxBytes(
+        std::min(Alignment - 1, uint64_t(opts::AlignLoopsMaxBytes)));
+
+    // Update stats.
+    ++AlignedLoops;
+    AlignedLoopsCount += Count;
+  }
+}
+
 void AlignerPass::runOnFunctions(BinaryContext &BC,
                                  std::map<uint64_t, BinaryFunction> &BFs,
                                  std::set<uint64_t> &LargeFunctions) {
@@ -165,13 +327,18 @@ void AlignerPass::runOnFunctions(BinaryContext &BC,
   for (auto &It : BFs) {
     auto &Function = It.second;
 
-    if (opts::UseCompactAligner)
+    if (opts::CompactHotText)
+      alignHotTextCompact(Function);
+    else if (opts::UseCompactAligner)
       alignCompact(Function);
     else
       alignMaxBytes(Function);
 
     if (opts::AlignBlocks && !opts::PreserveBlocksAlignment)
       alignBlocks(Function);
+
+    if (opts::AlignLoops && !opts::PreserveBlocksAlignment)
+      alignLoops(Function);
   }
 
   DEBUG(
@@ -181,6 +348,8 @@ void AlignerPass::runOnFunctions(BinaryContext &BC,
     }
     dbgs() << "BOLT-DEBUG: total execution count of aligned blocks: "
            << AlignedBlocksCount << '\n';
+    dbgs() << "BOLT-DEBUG: aligned " << AlignedLoops << " loop headers with "
+           << "total execution count " << AlignedLoopsCount << '\n';
   );
 }
 
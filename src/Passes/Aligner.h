@@ -26,9 +26,17 @@ private:
   /// Stats: execution count of blocks that were aligned.
   uint64_t AlignedBlocksCount{0};
 
+  /// Stats: number and execution count of aligned loop headers.
+  uint64_t AlignedLoops{0};
+  uint64_t AlignedLoopsCount{0};
+
   /// Assign alignment to basic blocks based on profile.
   void alignBlocks(BinaryFunction &Function);
 
+  /// Align hot inner loops based on loop info and profile. The header is
+  /// aligned, or the top block of the loop if it was rotated.
+  void alignLoops(BinaryFunction &Function);
+
 public:
   explicit AlignerPass() : BinaryFunctionPass(false) {}
 
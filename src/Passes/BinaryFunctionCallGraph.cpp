@@ -12,8 +12,10 @@
 #include "BinaryFunctionCallGraph.h"
 #include "BinaryFunction.h"
 #include "BinaryContext.h"
+#include "ParallelUtilities.h"
 #include "llvm/Support/Options.h"
 #include "llvm/Support/Timer.h"
+#include <cmath>
 
 #define DEBUG_TYPE "callgraph"
 
@@ -84,12 +86,32 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
                                        bool UseFunctionHotSize,
                                        bool UseSplitHotSize,
                                        bool UseEdgeCounts,
-                                       bool IgnoreRecursiveCalls) {
+                                       bool IgnoreRecursiveCalls,
+                                       bool WeightByCycles) {
   NamedRegionTimer T1("buildcg", "Callgraph construction", "CG breakdown",
                       "CG breakdown", opts::TimeOpts);
   BinaryFunctionCallGraph Cg;
   static constexpr auto COUNT_NO_PROFILE = BinaryBasicBlock::COUNT_NO_PROFILE;
 
+  // With cycle weighting, samples of functions with slower paths than the
+  // average over the binary, according to the cycles recorded by LBR, are
+  // scaled up, and those of faster functions are scaled down.
+  double AverageCycles = 0.0;
+  if (WeightByCycles) {
+    double TotalCycles = 0.0;
+    uint64_t TotalCount = 0;
+    for (auto &BFI : BFs) {
+      const auto &Function = BFI.second;
+      const auto Cycles = Function.getAverageCycles();
+      if (Cycles == 0.0 || !Function.hasProfile())
+        continue;
+      TotalCycles += Cycles * Function.getExecutionCount();
+      TotalCount += Function.getExecutionCount();
+    }
+    if (TotalCount)
+      AverageCycles = TotalCycles / TotalCount;
+  }
+
   // Compute function size
   auto functionSize = [&](const BinaryFunction *Function) {
     return UseFunctionHotSize && Function->isSplit()
@@ -97,45 +119,34 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
       : Function->estimateSize();
   };
 
-  // Add call graph nodes.
-  auto lookupNode = [&](BinaryFunction *Function) {
-    const auto Id = Cg.maybeGetNodeId(Function);
-    if (Id == CallGraph::InvalidId) {
-      // It's ok to use the hot size here when the function is split.  This is
-      // because emitFunctions will emit the hot part first in the order that is
-      // computed by ReorderFunctions.  The cold part will be emitted with the
-      // rest of the cold functions and code.
-      const auto Size = functionSize(Function);
-      // NOTE: for functions without a profile, we set the number of samples
-      // to zero.  This will keep these functions from appearing in the hot
-      // section.  This is a little weird because we wouldn't be trying to
-      // create a node for a function unless it was the target of a call from
-      // a hot block.  The alternative would be to set the count to one or
-      // accumulate the number of calls from the callsite into the function
-      // samples.  Results from perfomance testing seem to favor the zero
-      // count though, so I'm leaving it this way for now.
-      const auto Samples =
-        Function->hasProfile() ? Function->getExecutionCount() : 0;
-      return Cg.addNode(Function, Size, Samples);
-    } else {
-      return Id;
-    }
+  // Call sites of every function are collected in parallel, then the nodes
+  // and arcs are added in the order of functions to keep node ids
+  // deterministic.
+  struct CallInfo {
+    BinaryFunction *DstFunc;
+    uint64_t Count;
+    uint64_t Offset;
   };
-
-  // Add call graph edges.
-  uint64_t NotProcessed = 0;
-  uint64_t TotalCallsites = 0;
-  uint64_t NoProfileCallsites = 0;
-  uint64_t NumFallbacks = 0;
-  uint64_t RecursiveCallsites = 0;
+  struct FunctionCalls {
+    uint32_t Size{0};
+    std::vector<CallInfo> Calls;
+    uint64_t NotProcessed{0};
+    uint64_t TotalCallsites{0};
+    uint64_t NoProfileCallsites{0};
+    uint64_t RecursiveCallsites{0};
+    bool UsedPerfData{false};
+  };
+  DenseMap<const BinaryFunction *, FunctionCalls> CallsOf;
   for (auto &It : BFs) {
-    auto *Function = &It.second;
+    if (!Filter(It.second))
+      CallsOf[&It.second];
+  }
 
-    if (Filter(*Function)) {
-      continue;
-    }
+  auto collectCalls = [&](BinaryFunction &BF) {
+    auto *Function = &BF;
+    auto &FC = CallsOf.find(Function)->second;
+    FC.Size = functionSize(Function);
 
-    const auto SrcId = lookupNode(Function);
     // Offset of the current basic block from the beginning of the function
     uint64_t Offset = 0;
 
@@ -145,19 +156,18 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
         if (DstFunc == Function) {
           DEBUG(dbgs() << "BOLT-INFO: recursive call detected in "
                        << *DstFunc << "\n");
-          ++RecursiveCallsites;
+          ++FC.RecursiveCallsites;
           if (IgnoreRecursiveCalls)
             return false;
         }
         if (Filter(*DstFunc)) {
           return false;
         }
-        const auto DstId = lookupNode(DstFunc);
         const bool IsValidCount = Count != COUNT_NO_PROFILE;
         const auto AdjCount = UseEdgeCounts && IsValidCount ? Count : 1;
         if (!IsValidCount)
-          ++NoProfileCallsites;
-        Cg.incArcWeight(SrcId, DstId, AdjCount, Offset);
+          ++FC.NoProfileCallsites;
+        FC.Calls.push_back({DstFunc, AdjCount, Offset});
         DEBUG(
           if (opts::Verbosity > 1) {
             dbgs() << "BOLT-DEBUG: buildCallGraph: call " << *Function
@@ -202,10 +212,9 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
         !Function->getAllCallSites().empty()) {
       DEBUG(dbgs() << "BOLT-DEBUG: buildCallGraph: Falling back to perf data"
                    << " for " << *Function << "\n");
-      ++NumFallbacks;
-      const auto Size = functionSize(Function);
+      FC.UsedPerfData = true;
       for (const auto &CSI : Function->getAllCallSites()) {
-        ++TotalCallsites;
+        ++FC.TotalCallsites;
 
         if (!CSI.IsFunction)
           continue;
@@ -217,11 +226,11 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
         // The computed offset may exceed the hot part of the function; hence,
         // bound it by the size.
         Offset = CSI.Offset;
-        if (Offset > Size)
-          Offset = Size;
+        if (Offset > FC.Size)
+          Offset = FC.Size;
 
         if (!recordCall(DstBD->getSymbol(), CSI.Count)) {
-          ++NotProcessed;
+          ++FC.NotProcessed;
         }
       }
     } else {
@@ -249,13 +258,13 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
 
             if (!CallInfo.empty()) {
               for (const auto &CI : CallInfo) {
-                ++TotalCallsites;
+                ++FC.TotalCallsites;
                 if (!recordCall(CI.first, CI.second))
-                  ++NotProcessed;
+                  ++FC.NotProcessed;
               }
             } else {
-              ++TotalCallsites;
-              ++NotProcessed;
+              ++FC.TotalCallsites;
+              ++FC.NotProcessed;
             }
           }
           // Increase Offset if needed
@@ -265,7 +274,70 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
         }
       }
     }
+  };
+
+  ParallelUtilities::runOnEachFunction(
+      BFs, ParallelUtilities::SP_INST_LINEAR, collectCalls,
+      [&](const BinaryFunction &BF) { return Filter(BF); }, "buildCallGraph");
+
+  // Add call graph nodes.
+  auto lookupNode = [&](BinaryFunction *Function) {
+    const auto Id = Cg.maybeGetNodeId(Function);
+    if (Id == CallGraph::InvalidId) {
+      // It's ok to use the hot size here when the function is split.  This is
+      // because emitFunctions will emit the hot part first in the order that is
+      // computed by ReorderFunctions.  The cold part will be emitted with the
+      // rest of the cold functions and code.
+      auto FCI = CallsOf.find(Function);
+      const auto Size =
+        FCI != CallsOf.end() ? FCI->second.Size : functionSize(Function);
+      // NOTE: for functions without a profile, we set the number of samples
+      // to zero.  This will keep these functions from appearing in the hot
+      // section.  This is a little weird because we wouldn't be trying to
+      // create a node for a function unless it was the target of a call from
+      // a hot block.  The alternative would be to set the count to one or
+      // accumulate the number of calls from the callsite into the function
+      // samples.  Results from perfomance testing seem to favor the zero
+      // count though, so I'm leaving it this way for now.
+      uint64_t Samples =
+        Function->hasProfile() ? Function->getExecutionCount() : 0;
+      const auto Cycles = Function->getAverageCycles();
+      if (AverageCycles != 0.0 && Cycles != 0.0)
+        Samples = std::llround(Samples * Cycles / AverageCycles);
+      return Cg.addNode(Function, Size, Samples);
+    } else {
+      return Id;
+    }
+  };
+
+  // Add call graph edges. Calls are only recorded here, and merged into arcs
+  // all at once by finalizeArcs().
+  uint64_t NotProcessed = 0;
+  uint64_t TotalCallsites = 0;
+  uint64_t NoProfileCallsites = 0;
+  uint64_t NumFallbacks = 0;
+  uint64_t RecursiveCallsites = 0;
+  for (auto &It : BFs) {
+    auto *Function = &It.second;
+
+    if (Filter(*Function)) {
+      continue;
+    }
+
+    const auto &FC = CallsOf.find(Function)->second;
+    const auto SrcId = lookupNode(Function);
+    for (const auto &CI : FC.Calls) {
+      const auto DstId = lookupNode(CI.DstFunc);
+      Cg.incArcWeight(SrcId, DstId, CI.Count, CI.Offset);
+    }
+
+    NotProcessed += FC.NotProcessed;
+    TotalCallsites += FC.TotalCallsites;
+    NoProfileCallsites += FC.NoProfileCallsites;
+    RecursiveCallsites += FC.RecursiveCallsites;
+    NumFallbacks += FC.UsedPerfData;
   }
+  Cg.finalizeArcs();
 
 #ifndef NDEBUG
   bool PrintInfo = DebugFlag && isCurrentDebugType("callgraph");
@@ -75,7 +75,8 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
                                        bool UseFunctionHotSize = false,
                                        bool UseSplitHotSize = false,
                                        bool UseEdgeCounts = false,
-                                       bool IgnoreRecursiveCalls = false);
+                                       bool IgnoreRecursiveCalls = false,
+                                       bool WeightByCycles = false);
 
 }
 }
@@ -10,8 +10,14 @@
 //===----------------------------------------------------------------------===//
 
 #include "BinaryPasses.h"
+#include "Passes/DataflowInfoManager.h"
+#include "Passes/IndirectTargetLayout.h"
 #include "Passes/ReorderAlgorithm.h"
+#include "ProfileVariants.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Options.h"
+#include <cmath>
 #include <numeric>
 
 #define DEBUG_TYPE "bolt"
@@ -52,6 +58,7 @@ extern cl::OptionCategory BoltCategory;
 extern cl::OptionCategory BoltOptCategory;
 
 extern cl::opt<bolt::MacroFusionType> AlignMacroOpFusion;
+extern cl::opt<bool> Lite;
 extern cl::opt<unsigned> Verbosity;
 extern cl::opt<bolt::BinaryFunction::SplittingType> SplitFunctions;
 extern bool shouldProcess(const bolt::BinaryFunction &Function);
@@ -67,6 +74,33 @@ AggressiveSplitting("split-all-cold",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+SplitWarmMinSize("split-warm-min-size",
+  cl::desc("minimum size in bytes of a function for which warm blocks are "
+           "split with -split-warm-threshold"),
+  cl::init(4096),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+SplitWarmThreshold("split-warm-threshold",
+  cl::desc("in large functions also outline blocks executed less often than "
+           "this per mille of the function entry count, keeping only the hot "
+           "regions in the main fragment (0 to disable)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+cl::opt<bool>
+CycleWeightedLayout("cycle-weighted-layout",
+  cl::desc("weight profile counts with the cycles recorded by LBR when "
+           "ordering blocks and functions, favoring slow paths over plain "
+           "frequency"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<DynoStatsSortOrder>
 DynoStatsSortOrderOpt("print-sorted-by-order",
   cl::desc("use ascending or descending order when printing functions "
@@ -75,6 +109,24 @@ DynoStatsSortOrderOpt("print-sorted-by-order",
   cl::init(DynoStatsSortOrder::Descending),
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+InlineMemcpyMaxSize("inline-memcpy-max-size",
+  cl::desc("with -inline-memcpy, inline calls to memcpy and memset with a "
+           "constant size of up to this many bytes using unrolled moves, and "
+           "calls to memcmp with a constant size of 1, 2, 4 or 8 bytes "
+           "(0 - disable)"),
+  cl::init(128),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+InlineMemcpyRepMovsb("inline-memcpy-rep-movsb",
+  cl::desc("with -inline-memcpy, inline calls to memcpy of unknown size with "
+           "'rep movsb' instead of keeping the call"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 MinBranchClusters("min-branch-clusters",
   cl::desc("use a modified clustering algorithm geared towards minimizing "
@@ -89,7 +141,8 @@ enum PeepholeOpts : char {
   PEEP_DOUBLE_JUMPS     = 0x2,
   PEEP_TAILCALL_TRAPS   = 0x4,
   PEEP_USELESS_BRANCHES = 0x8,
-  PEEP_ALL              = 0xf
+  PEEP_PATTERNS         = 0x10,
+  PEEP_ALL              = 0x1f
 };
 
 static cl::list<PeepholeOpts>
@@ -105,10 +158,21 @@ Peepholes("peepholes",
     clEnumValN(PEEP_TAILCALL_TRAPS, "tailcall-traps", "insert tail call traps"),
     clEnumValN(PEEP_USELESS_BRANCHES, "useless-branches",
                "remove useless conditional branches"),
+    clEnumValN(PEEP_PATTERNS, "patterns",
+               "apply the peephole patterns of the target"),
     clEnumValN(PEEP_ALL, "all", "enable all peephole optimizations")),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::list<std::string>
+PeepholePatterns("peephole-patterns",
+  cl::CommaSeparated,
+  cl::desc("restrict -peepholes=patterns to the given target patterns"),
+  cl::value_desc("pattern1,pattern2,..."),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 PrintFuncStat("print-function-statistics",
   cl::desc("print statistics about basic block ordering"),
@@ -158,12 +222,39 @@ ReorderBlocks("reorder-blocks",
     clEnumValN(bolt::ReorderBasicBlocks::LT_OPTIMIZE_CACHE_PLUS,
       "cache+",
       "perform layout optimizing I-cache behavior"),
+    clEnumValN(bolt::ReorderBasicBlocks::LT_OPTIMIZE_EXT_TSP,
+      "ext-tsp",
+      "perform layout maximizing the ExtTSP metric"),
     clEnumValN(bolt::ReorderBasicBlocks::LT_OPTIMIZE_SHUFFLE,
       "cluster-shuffle",
       "perform random layout of clusters")),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<std::string>
+ReorderBlocksCache("reorder-blocks-cache",
+  cl::desc("reuse basic block layouts of functions with unchanged code and "
+           "profile from the given file, and save new layouts to it"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+ReorderBlocksLoops("reorder-blocks-loops",
+  cl::desc("keep hot innermost loops contiguous and rotate them to minimize "
+           "taken branches after reordering basic blocks"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+ProfileQualityReport("profile-quality-report",
+  cl::desc("write a CSV report on the quality of the profile of every "
+           "profiled function to the given file"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 ReportBadLayout("report-bad-layout",
   cl::desc("print top <uint> functions with suboptimal code layout on input"),
@@ -183,7 +274,8 @@ ReportStaleFuncs("report-stale",
 enum SctcModes : char {
   SctcAlways,
   SctcPreserveDirection,
-  SctcHeuristic
+  SctcHeuristic,
+  SctcProfile
 };
 
 static cl::opt<SctcModes>
@@ -197,10 +289,23 @@ SctcMode("sctc-mode",
       "preserved"),
     clEnumValN(SctcHeuristic,
       "heuristic",
-      "use branch prediction data to control sctc")),
+      "use branch prediction data to control sctc"),
+    clEnumValN(SctcProfile,
+      "profile",
+      "perform sctc when the profile and the layout predict fewer taken "
+      "and executed branches")),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+SimplifyRODataPropagate("simplify-rodata-loads-propagate",
+  cl::desc("track constants through registers to simplify indexed loads "
+           "from read-only data and fold the branches they decide"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 SplitEH("split-eh",
   cl::desc("split C++ exception handling code (experimental)"),
@@ -232,16 +337,32 @@ namespace llvm {
 namespace bolt {
 
 bool BinaryFunctionPass::shouldOptimize(const BinaryFunction &BF) const {
+  return canOptimize(BF) && !isFilteredOut(BF);
+}
+
+bool BinaryFunctionPass::canOptimize(const BinaryFunction &BF) const {
   return BF.isSimple() &&
          BF.getState() == BinaryFunction::State::CFG &&
          opts::shouldProcess(BF) &&
-         (BF.getSize() > 0);
+         (BF.getSize() > 0) &&
+         (!opts::Lite || BF.getKnownExecutionCount() != 0);
 }
 
 bool BinaryFunctionPass::shouldPrint(const BinaryFunction &BF) const {
   return BF.isSimple() && opts::shouldProcess(BF);
 }
 
+void BinaryFunctionPass::runOnEachFunction(
+    std::map<uint64_t, BinaryFunction> &BFs,
+    ParallelUtilities::WorkFuncTy WorkFunction,
+    ParallelUtilities::PredicateTy SkipPredicate,
+    ParallelUtilities::SchedulingPolicy SchedPolicy) {
+  ParallelUtilities::runOnEachFunction(
+      BFs,
+      isFunctionLocal() ? SchedPolicy : ParallelUtilities::SP_TRIVIAL,
+      WorkFunction, SkipPredicate, getName());
+}
+
 void OptimizeBodylessFunctions::analyze(
     BinaryFunction &BF,
     BinaryContext &BC,
@@ -381,29 +502,83 @@ void ReorderBasicBlocks::runOnFunctions(
 
   IsAArch64 = BC.isAArch64();
 
-  uint64_t ModifiedFuncCount = 0;
-  for (auto &It : BFs) {
-    auto &Function = It.second;
+  if (!opts::ReorderBlocksCache.empty())
+    readLayoutCache();
 
-    if (!shouldOptimize(Function))
-      continue;
+  if (!BC.ProfileVariants.empty()) {
+    const auto NumCandidates = ProfileVariants::getNumCandidates(BC);
+    VariantScores.assign(NumCandidates,
+                         std::vector<double>(BC.ProfileVariants.size()));
+    VariantNumChosen.assign(NumCandidates, 0);
+  }
 
-    const bool ShouldSplit =
-            (opts::SplitFunctions == BinaryFunction::ST_ALL) ||
-            (opts::SplitFunctions == BinaryFunction::ST_EH &&
-             Function.hasEHRanges()) ||
-            (LargeFunctions.find(It.first) != LargeFunctions.end());
-    modifyFunctionLayout(Function, opts::ReorderBlocks, opts::MinBranchClusters,
-                         ShouldSplit);
+  std::atomic<uint64_t> ModifiedFuncCount{0};
+  std::atomic<uint64_t> NumSkippedOverBudget{0};
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        const bool IsLarge =
+          LargeFunctions.find(Function.getAddress()) != LargeFunctions.end();
+
+        // Functions reached after the time budget is spent keep their
+        // original layout, unless they no longer fit in it.
+        if (!IsLarge && ParallelUtilities::isOverTimeBudget()) {
+          ++NumSkippedOverBudget;
+          return;
+        }
 
-    if (Function.hasLayoutChanged()) {
-      ++ModifiedFuncCount;
-    }
+        const bool ShouldSplit =
+                (opts::SplitFunctions == BinaryFunction::ST_ALL) ||
+                (opts::SplitFunctions == BinaryFunction::ST_EH &&
+                 Function.hasEHRanges()) ||
+                IsLarge;
+        modifyFunctionLayout(Function, opts::ReorderBlocks,
+                             opts::MinBranchClusters, ShouldSplit);
+
+        if (Function.hasLayoutChanged()) {
+          ++ModifiedFuncCount;
+        }
+      },
+      [&](const BinaryFunction &Function) {
+        // Functions excluded with -pass-config keep their original layout,
+        // unless they no longer fit in it.
+        return !canOptimize(Function) ||
+               (isFilteredOut(Function) &&
+                LargeFunctions.find(Function.getAddress()) ==
+                  LargeFunctions.end());
+      },
+      ParallelUtilities::SP_BB_QUADRATIC);
+
+  if (!opts::ReorderBlocksCache.empty())
+    writeLayoutCache();
+
+  if (NumSkippedOverBudget)
+    outs() << "BOLT-INFO: time budget exceeded, " << NumSkippedOverBudget
+           << " functions keep their original layout\n";
+
+  if (opts::ReorderBlocksLoops) {
+    outs() << "BOLT-INFO: loop layout made " << NumLoopsCompacted.load()
+           << " loops contiguous and rotated " << NumLoopsRotated.load()
+           << " loops\n";
+  }
+
+  if (IndirectTargetLayout::isEnabled()) {
+    outs() << "BOLT-INFO: indirect target layout moved "
+           << NumIndirectTargetsMoved << " jump table targets, changing the "
+           << "ExtTSP score of their functions from "
+           << format("%.0lf to %.0lf\n", IndirectTargetScoreBefore,
+                     IndirectTargetScoreAfter);
+  }
+
+  if (!VariantNumChosen.empty()) {
+    ProfileVariants::printCandidates(BC, "block layouts", VariantScores,
+                                     VariantNumChosen);
   }
 
   outs() << "BOLT-INFO: basic block reordering modified layout of "
          << format("%zu (%.2lf%%) functions\n",
-                   ModifiedFuncCount, 100.0 * ModifiedFuncCount / BFs.size());
+                   ModifiedFuncCount.load(),
+                   100.0 * ModifiedFuncCount / BFs.size());
 
   if (opts::PrintFuncStat > 0) {
     raw_ostream &OS = outs();
@@ -440,8 +615,136 @@ void ReorderBasicBlocks::runOnFunctions(
   }
 }
 
+ReorderBasicBlocks::LayoutCacheKey
+ReorderBasicBlocks::getLayoutCacheKey(const BinaryFunction &BF,
+                                      LayoutType Type,
+                                      bool MinBranchClusters) const {
+  // The digest covers everything block layout algorithms depend on besides
+  // the code: the CFG, its profile and the layout options.
+  std::string Data;
+  auto addValue = [&](uint64_t Value) {
+    Data.append(reinterpret_cast<const char *>(&Value), sizeof(Value));
+  };
+  addValue(Type);
+  addValue(MinBranchClusters);
+  addValue(opts::TSPThreshold);
+  addValue(opts::CycleWeightedLayout);
+  addValue(BF.getKnownExecutionCount());
+  for (const auto *BB : BF.layout()) {
+    addValue(BB->getKnownExecutionCount());
+    addValue(BB->isLandingPad());
+    auto BI = BB->branch_info_begin();
+    for (const auto *Succ : BB->successors()) {
+      addValue(Succ->getLayoutIndex());
+      addValue(BI->Count);
+      addValue(BI->MispredictedCount);
+      if (opts::CycleWeightedLayout)
+        addValue(BI->Cycles);
+      ++BI;
+    }
+  }
+
+  return std::make_pair(BF.hash(/*Recompute=*/true),
+                        std::hash<std::string>{}(Data));
+}
+
+void ReorderBasicBlocks::readLayoutCache() {
+  auto MB = MemoryBuffer::getFile(opts::ReorderBlocksCache);
+  if (!MB) {
+    if (opts::Verbosity >= 1)
+      outs() << "BOLT-INFO: block layout cache " << opts::ReorderBlocksCache
+             << " was not found\n";
+    return;
+  }
+
+  // Every line is "<hash> <digest> <index>...".
+  SmallVector<StringRef, 0> Lines;
+  (*MB)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+  for (auto Line : Lines) {
+    SmallVector<StringRef, 16> Fields;
+    Line.split(Fields, ' ', -1, /*KeepEmpty=*/false);
+    LayoutCacheKey Key;
+    if (Fields.size() < 3 ||
+        Fields[0].getAsInteger(16, Key.first) ||
+        Fields[1].getAsInteger(16, Key.second)) {
+      errs() << "BOLT-WARNING: ignoring malformed block layout cache "
+             << opts::ReorderBlocksCache << '\n';
+      LayoutCache.clear();
+      return;
+    }
+    auto &Layout = LayoutCache[Key];
+    for (auto Field : makeArrayRef(Fields).drop_front(2)) {
+      unsigned Index;
+      if (Field.getAsInteger(10, Index)) {
+        LayoutCache.erase(Key);
+        break;
+      }
+      Layout.push_back(Index);
+    }
+  }
+
+  outs() << "BOLT-INFO: read " << LayoutCache.size()
+         << " block layouts from " << opts::ReorderBlocksCache << '\n';
+}
+
+void ReorderBasicBlocks::writeLayoutCache() const {
+  std::error_code EC;
+  raw_fd_ostream OS(opts::ReorderBlocksCache, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: cannot write block layout cache "
+           << opts::ReorderBlocksCache << ": " << EC.message() << '\n';
+    return;
+  }
+
+  for (const auto &Entry : UpdatedLayoutCache) {
+    OS << Twine::utohexstr(Entry.first.first) << ' '
+       << Twine::utohexstr(Entry.first.second);
+    for (auto Index : Entry.second)
+      OS << ' ' << Index;
+    OS << '\n';
+  }
+}
+
+namespace {
+
+/// Scales the counts of the edges out of each block of a function by how slow
+/// the path ending in the block is compared to the function average, from
+/// the cycles recorded by LBR. Blocks without cycles keep their counts. The
+/// original counts are restored on destruction.
+class CycleWeightedCounts {
+  BinaryFunction &BF;
+  std::vector<uint64_t> SavedCounts;
+
+public:
+  explicit CycleWeightedCounts(BinaryFunction &BF) : BF(BF) {
+    const auto FunctionCycles = BF.getAverageCycles();
+    if (FunctionCycles == 0.0)
+      return;
+    for (auto &BB : BF) {
+      const auto Factor = BB.getAverageCycles() / FunctionCycles;
+      for (auto &BI : BB.branch_info()) {
+        SavedCounts.push_back(BI.Count);
+        if (Factor != 0.0 && BI.Count != BinaryBasicBlock::COUNT_NO_PROFILE)
+          BI.Count = std::llround(BI.Count * Factor);
+      }
+    }
+  }
+
+  ~CycleWeightedCounts() {
+    if (SavedCounts.empty())
+      return;
+    auto Count = SavedCounts.begin();
+    for (auto &BB : BF) {
+      for (auto &BI : BB.branch_info())
+        BI.Count = *Count++;
+    }
+  }
+};
+
+} // anonymous namespace
+
 void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
-    LayoutType Type, bool MinBranchClusters, bool Split) const {
+    LayoutType Type, bool MinBranchClusters, bool Split) {
   if (BF.size() == 0 || Type == LT_NONE)
     return;
 
@@ -452,7 +755,33 @@ void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
   if (Type != LT_REVERSE && !BF.hasValidProfile())
     return;
 
-  if (Type == LT_REVERSE) {
+  const bool UseCache = !opts::ReorderBlocksCache.empty();
+  LayoutCacheKey CacheKey;
+  if (UseCache) {
+    BF.updateLayoutIndices();
+    CacheKey = getLayoutCacheKey(BF, Type, MinBranchClusters);
+    auto CacheI = LayoutCache.find(CacheKey);
+    if (CacheI != LayoutCache.end()) {
+      // Make sure the cached layout is a permutation of the current one that
+      // keeps the entry block first.
+      const auto &Indices = CacheI->second;
+      std::vector<bool> Used(BF.layout_size());
+      bool IsValid = Indices.size() == BF.layout_size() && Indices[0] == 0;
+      for (auto I = Indices.begin(); IsValid && I != Indices.end(); ++I) {
+        IsValid = *I < Used.size() && !Used[*I];
+        if (IsValid)
+          Used[*I] = true;
+      }
+      if (IsValid) {
+        for (auto Index : Indices)
+          NewLayout.push_back(BF.getLayout()[Index]);
+      }
+    }
+  }
+
+  if (!NewLayout.empty()) {
+    DEBUG(dbgs() << "using cached block layout for " << BF << "\n");
+  } else if (Type == LT_REVERSE) {
     Algo.reset(new ReverseReorderAlgorithm());
   } else if (BF.size() <= opts::TSPThreshold && Type != LT_OPTIMIZE_SHUFFLE) {
     // Work on optimal solution if problem is small enough
@@ -484,6 +813,10 @@ void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
       Algo.reset(new CachePlusReorderAlgorithm());
       break;
 
+    case LT_OPTIMIZE_EXT_TSP:
+      Algo.reset(new ExtTSPReorderAlgorithm());
+      break;
+
     case LT_OPTIMIZE_SHUFFLE:
       Algo.reset(new RandomClusterReorderAlgorithm(std::move(CAlgo)));
       break;
@@ -493,7 +826,49 @@ void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
     }
   }
 
-  Algo->reorderBasicBlocks(BF, NewLayout);
+  if (NewLayout.empty()) {
+    // Layout algorithms read the edge counts from the CFG.
+    auto computeLayout = [&](BinaryFunction::BasicBlockOrderType &Layout) {
+      std::unique_ptr<CycleWeightedCounts> Weights;
+      if (opts::CycleWeightedLayout)
+        Weights = llvm::make_unique<CycleWeightedCounts>(BF);
+      Algo->reorderBasicBlocks(BF, Layout);
+    };
+    if (BF.getVariantProfiles().empty() || Type == LT_REVERSE)
+      computeLayout(NewLayout);
+    else
+      chooseVariantLayout(BF, computeLayout, NewLayout);
+  }
+
+  if (UseCache) {
+    // Reorder algorithms may reassign layout indices, so look up positions in
+    // the original layout.
+    std::unordered_map<const BinaryBasicBlock *, unsigned> OriginalIndex;
+    for (auto *BB : BF.layout())
+      OriginalIndex.emplace(BB, OriginalIndex.size());
+    std::vector<unsigned> Indices;
+    Indices.reserve(NewLayout.size());
+    for (const auto *BB : NewLayout)
+      Indices.push_back(OriginalIndex[BB]);
+    std::lock_guard<std::mutex> Lock(UpdatedLayoutCacheMutex);
+    UpdatedLayoutCache[CacheKey] = std::move(Indices);
+  }
+
+  if (opts::ReorderBlocksLoops && Type != LT_REVERSE)
+    optimizeLoopLayout(BF, NewLayout);
+
+  if (IndirectTargetLayout::isEnabled() && Type != LT_REVERSE) {
+    const auto ScoreBefore = ProfileVariants::getLayoutScore(BF, NewLayout);
+    const auto NumMoved =
+      IndirectTargetLayout::placeJumpTableTargets(BF, NewLayout);
+    if (NumMoved) {
+      const auto ScoreAfter = ProfileVariants::getLayoutScore(BF, NewLayout);
+      std::lock_guard<std::mutex> Lock(IndirectTargetStatsMutex);
+      NumIndirectTargetsMoved += NumMoved;
+      IndirectTargetScoreBefore += ScoreBefore;
+      IndirectTargetScoreAfter += ScoreAfter;
+    }
+  }
 
   BF.updateBasicBlockLayout(NewLayout, /*SavePrevLayout=*/opts::PrintFuncStat);
 
@@ -501,6 +876,151 @@ void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
     splitFunction(BF);
 }
 
+void ReorderBasicBlocks::chooseVariantLayout(
+    BinaryFunction &BF,
+    std::function<void(BinaryFunction::BasicBlockOrderType &)> ComputeLayout,
+    BinaryFunction::BasicBlockOrderType &Layout) {
+  const auto &BC = BF.getBinaryContext();
+  const auto NumCandidates = ProfileVariants::getNumCandidates(BC);
+  const auto NumVariants = BC.ProfileVariants.size();
+
+  std::vector<BinaryFunction::BasicBlockOrderType> Candidates(NumCandidates);
+  for (unsigned C = 0; C < NumCandidates; ++C) {
+    auto Counts = ProfileVariants::installCandidateCounts(BF, C);
+    ComputeLayout(Candidates[C]);
+  }
+
+  std::vector<std::vector<double>> Scores(NumCandidates,
+                                          std::vector<double>(NumVariants));
+  for (unsigned V = 0; V < NumVariants; ++V) {
+    VariantCounts Counts(BF, V);
+    for (unsigned C = 0; C < NumCandidates; ++C)
+      Scores[C][V] = ProfileVariants::getLayoutScore(BF, Candidates[C]);
+  }
+
+  const auto Chosen = ProfileVariants::chooseCandidate(BC, Scores);
+  Layout = std::move(Candidates[Chosen]);
+
+  if (opts::Verbosity >= 2) {
+    outs() << "BOLT-INFO: kept block layout candidate " << Chosen << " of "
+           << BF << '\n';
+  }
+
+  std::lock_guard<std::mutex> Lock(VariantStatsMutex);
+  for (unsigned C = 0; C < NumCandidates; ++C) {
+    for (unsigned V = 0; V < NumVariants; ++V)
+      VariantScores[C][V] += Scores[C][V];
+  }
+  ++VariantNumChosen[Chosen];
+}
+
+void ReorderBasicBlocks::optimizeLoopLayout(
+    BinaryFunction &BF,
+    BinaryFunction::BasicBlockOrderType &Layout) {
+  // Loop info is computed on the CFG, which earlier passes may have changed.
+  BF.calculateLoopInfo();
+  const auto &BLI = BF.getLoopInfo();
+
+  // Count of the edge From->To, which is saved as a taken branch when To
+  // immediately follows From.
+  auto getFallthroughCount = [](const BinaryBasicBlock *From,
+                                const BinaryBasicBlock *To) -> uint64_t {
+    if (!From || !To || From->succ_size() > 2)
+      return 0;
+    auto BI = From->branch_info_begin();
+    for (const auto *Succ : From->successors()) {
+      if (Succ == To && BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE)
+        return BI->Count;
+      ++BI;
+    }
+    return 0;
+  };
+
+  std::vector<BinaryLoop *> Loops;
+  std::vector<BinaryLoop *> Worklist(BLI.begin(), BLI.end());
+  while (!Worklist.empty()) {
+    auto *L = Worklist.back();
+    Worklist.pop_back();
+    if (L->getSubLoops().empty())
+      Loops.push_back(L);
+    else
+      Worklist.insert(Worklist.end(), L->begin(), L->end());
+  }
+
+  for (auto *L : Loops) {
+    if (L->TotalBackEdgeCount == BinaryBasicBlock::COUNT_NO_PROFILE ||
+        !L->TotalBackEdgeCount)
+      continue;
+
+    // Position of the first and last hot block of the loop in the layout.
+    auto IsHotLoopBlock = [&](const BinaryBasicBlock *BB) {
+      return L->contains(BB) && BB->getKnownExecutionCount() > 0;
+    };
+    auto First = std::find_if(Layout.begin(), Layout.end(), IsHotLoopBlock);
+    if (First == Layout.end() || First == Layout.begin())
+      continue;
+    auto Last = std::find_if(Layout.rbegin(), Layout.rend(),
+                             IsHotLoopBlock).base();
+
+    // Move never executed blocks from outside of the loop that sit between
+    // hot blocks of the loop after it. They have no profile to lose. Give up
+    // on the loop if an executed block is in the way.
+    bool HasHotInterloper = false;
+    bool HasInterloper = false;
+    for (auto I = First; I != Last; ++I) {
+      if (L->contains(*I))
+        continue;
+      HasInterloper = true;
+      if ((*I)->getKnownExecutionCount() > 0)
+        HasHotInterloper = true;
+    }
+    if (HasHotInterloper)
+      continue;
+    if (HasInterloper) {
+      Last = std::stable_partition(First, Last,
+                                   [&](const BinaryBasicBlock *BB) {
+                                     return L->contains(BB);
+                                   });
+      ++NumLoopsCompacted;
+    }
+
+    // Rotating the loop at position R breaks the pair (R - 1, R) of the
+    // cyclic order of its blocks and connects the first and last blocks
+    // with the blocks around the loop. Pick the rotation with the largest
+    // count of fall-through edges.
+    const auto Size = std::distance(First, Last);
+    if (Size < 2)
+      continue;
+    const auto *Prev = *std::prev(First);
+    const auto *Next = Last != Layout.end() ? *Last : nullptr;
+    auto blockAt = [&](long I) { return *(First + (I + Size) % Size); };
+
+    int64_t CyclicSum = 0;
+    for (long I = 0; I < Size; ++I)
+      CyclicSum += getFallthroughCount(blockAt(I), blockAt(I + 1));
+
+    long BestRotation = 0;
+    int64_t BestScore = 0;
+    for (long R = 0; R < Size; ++R) {
+      const int64_t Score = CyclicSum -
+        getFallthroughCount(blockAt(R - 1), blockAt(R)) +
+        getFallthroughCount(Prev, blockAt(R)) +
+        getFallthroughCount(blockAt(R - 1), Next);
+      if (R == 0 || Score > BestScore) {
+        BestScore = Score;
+        BestRotation = R;
+      }
+    }
+
+    if (BestRotation) {
+      std::rotate(First, First + BestRotation, Last);
+      ++NumLoopsRotated;
+      DEBUG(dbgs() << "BOLT-DEBUG: rotated loop with header "
+                   << L->getHeader()->getName() << " in " << BF << '\n');
+    }
+  }
+}
+
 void ReorderBasicBlocks::splitFunction(BinaryFunction &BF) const {
   if (!BF.size())
     return;
@@ -517,12 +1037,40 @@ void ReorderBasicBlocks::splitFunction(BinaryFunction &BF) const {
   if (AllCold)
     return;
 
+  // In large functions where only a few regions are hot, blocks that are
+  // executed but rarely compared to the function entry are outlined too.
+  // The main fragment shrinks to the hot regions, which lets function
+  // reordering pack it together with its callers.
+  uint64_t WarmLimit = 0;
+  if (opts::SplitWarmThreshold && BF.estimateSize() >= opts::SplitWarmMinSize)
+    WarmLimit = BF.getKnownExecutionCount() * opts::SplitWarmThreshold / 1000;
+
   // Never outline the first basic block.
   BF.layout_front()->setCanOutline(false);
+
+  // Entries of AArch64 jump tables are offsets from the function start that
+  // the assembler resolves, so the jumps and their targets stay in the main
+  // fragment.
+  if (IsAArch64) {
+    for (auto *BB : BF.layout()) {
+      const auto *LastInstr = BB->getLastNonPseudoInstr();
+      const auto *JT = LastInstr ? BF.getJumpTable(*LastInstr) : nullptr;
+      if (!JT || !JT->EntryBase)
+        continue;
+      BB->setCanOutline(false);
+      for (auto *Succ : BB->successors())
+        Succ->setCanOutline(false);
+    }
+  }
   for (auto *BB : BF.layout()) {
     if (!BB->canOutline())
       continue;
-    if (BB->getExecutionCount() != 0) {
+    if (BB->getExecutionCount() > WarmLimit) {
+      BB->setCanOutline(false);
+      continue;
+    }
+    // Keep executed secondary entry points with their callers.
+    if (BB->getExecutionCount() != 0 && BB->isEntryPoint()) {
       BB->setCanOutline(false);
       continue;
     }
@@ -553,10 +1101,11 @@ void ReorderBasicBlocks::splitFunction(BinaryFunction &BF) const {
     }
   }
 
-  if (opts::AggressiveSplitting) {
+  if (opts::AggressiveSplitting || WarmLimit) {
     // All blocks with 0 count that we can move go to the end of the function.
     // Even if they were natural to cluster formation and were seen in-between
-    // hot basic blocks.
+    // hot basic blocks. Warm blocks are laid out among the hot ones and are
+    // always moved.
     std::stable_sort(BF.layout_begin(), BF.layout_end(),
         [&] (BinaryBasicBlock *A, BinaryBasicBlock *B) {
           return A->canOutline() < B->canOutline();
@@ -589,55 +1138,155 @@ void FixupBranches::runOnFunctions(
   BinaryContext &BC,
   std::map<uint64_t, BinaryFunction> &BFs,
   std::set<uint64_t> &) {
-  for (auto &It : BFs) {
-    auto &Function = It.second;
-    if (BC.HasRelocations || shouldOptimize(Function)) {
-      if (BC.isAArch64() && !Function.isSimple())
-        continue;
-      Function.fixBranches();
-    }
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        Function.fixBranches();
+      },
+      [&](const BinaryFunction &Function) {
+        if (!BC.HasRelocations && !shouldOptimize(Function))
+          return true;
+        return BC.isAArch64() && !Function.isSimple();
+      });
+}
+
+bool MacroFusionFixup::fixBlock(BinaryContext &BC, BinaryBasicBlock &BB) {
+  if (BB.succ_size() != 2 || BB.getMacroOpFusionPair() != BB.end())
+    return false;
+
+  auto RI = BB.getLastNonPseudo();
+  if (RI == BB.rend())
+    return false;
+  if (BC.MIB->isUnconditionalBranch(*RI))
+    ++RI;
+  if (RI == BB.rend() || !BC.MIB->isConditionalBranch(*RI))
+    return false;
+  const auto CondBranch = std::prev(RI.base());
+
+  const auto &FlagsAliases = BC.MIB->getAliases(BC.MIB->getFlagsReg());
+
+  // Look for the flags producer, skipping instructions that can be moved.
+  auto I = CondBranch;
+  while (I != BB.begin()) {
+    --I;
+    const auto &Desc = BC.MII->get(I->getOpcode());
+    if (Desc.isPseudo() || BC.MIB->isPrefix(*I) || BC.MIB->isCall(*I) ||
+        BC.MIB->isBranch(*I) || Desc.hasUnmodeledSideEffects())
+      return false;
+
+    BitVector Touched(BC.MRI->getNumRegs(), false);
+    BC.MIB->getTouchedRegs(*I, Touched);
+    if (Touched.anyCommon(FlagsAliases))
+      break;
+  }
+
+  const MCInst Pair[] = {*I, *CondBranch};
+  if (I + 1 == CondBranch || !BC.MIB->isMacroOpFusionPair(Pair))
+    return false;
+
+  const auto &ProducerDesc = BC.MII->get(I->getOpcode());
+  BitVector ProducerWritten(BC.MRI->getNumRegs(), false);
+  BitVector ProducerTouched(BC.MRI->getNumRegs(), false);
+  BC.MIB->getWrittenRegs(*I, ProducerWritten);
+  BC.MIB->getTouchedRegs(*I, ProducerTouched);
+
+  for (auto J = I + 1; J != CondBranch; ++J) {
+    const auto &Desc = BC.MII->get(J->getOpcode());
+    if ((Desc.mayStore() &&
+         (ProducerDesc.mayLoad() || ProducerDesc.mayStore())) ||
+        (Desc.mayLoad() && ProducerDesc.mayStore()))
+      return false;
+
+    BitVector Written(BC.MRI->getNumRegs(), false);
+    BitVector Touched(BC.MRI->getNumRegs(), false);
+    BC.MIB->getWrittenRegs(*J, Written);
+    BC.MIB->getTouchedRegs(*J, Touched);
+    if (Written.anyCommon(ProducerTouched) ||
+        Touched.anyCommon(ProducerWritten))
+      return false;
   }
+
+  // Move the flags producer right before the conditional branch.
+  std::rotate(I, I + 1, CondBranch);
+  return true;
 }
 
-void FinalizeFunctions::runOnFunctions(
+void MacroFusionFixup::runOnFunctions(
   BinaryContext &BC,
   std::map<uint64_t, BinaryFunction> &BFs,
   std::set<uint64_t> &
 ) {
-  for (auto &It : BFs) {
-    auto &Function = It.second;
-    const auto ShouldOptimize = shouldOptimize(Function);
+  if (!BC.isX86() || opts::AlignMacroOpFusion == MFT_NONE)
+    return;
 
-    // Always fix functions in relocation mode.
-    if (!BC.HasRelocations && !ShouldOptimize)
-      continue;
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        for (auto *BB : Function.layout()) {
+          if (opts::AlignMacroOpFusion == MFT_HOT &&
+              !BB->getKnownExecutionCount())
+            continue;
+          if (fixBlock(BC, *BB)) {
+            ++NumPairs;
+            PairsExecCount += BB->getKnownExecutionCount();
+          }
+        }
+      },
+      [&](const BinaryFunction &Function) {
+        return !shouldOptimize(Function);
+      });
+
+  if (NumPairs) {
+    outs() << "BOLT-INFO: made " << NumPairs << " (dynamic count : "
+           << PairsExecCount << ") compare and branch pairs adjacent for "
+           << "macro-fusion\n";
+  }
+}
 
-    // Fix the CFI state.
-    if (ShouldOptimize && !Function.fixCFIState()) {
-      if (BC.HasRelocations) {
-        errs() << "BOLT-ERROR: unable to fix CFI state for function "
-               << Function << ". Exiting.\n";
-        exit(1);
-      }
-      Function.setSimple(false);
-      continue;
-    }
+void FinalizeFunctions::runOnFunctions(
+  BinaryContext &BC,
+  std::map<uint64_t, BinaryFunction> &BFs,
+  std::set<uint64_t> &
+) {
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        // Fix the CFI state.
+        if (shouldOptimize(Function) && !Function.fixCFIState()) {
+          if (BC.HasRelocations) {
+            errs() << "BOLT-ERROR: unable to fix CFI state for function "
+                   << Function << ". Exiting.\n";
+            exit(1);
+          }
+          Function.setSimple(false);
+          return;
+        }
 
-    Function.setFinalized();
+        Function.setFinalized();
 
-    // Update exception handling information.
-    Function.updateEHRanges();
-  }
+        // Update exception handling information.
+        Function.updateEHRanges();
+      },
+      [&](const BinaryFunction &Function) {
+        // Always fix functions in relocation mode.
+        return !BC.HasRelocations && !shouldOptimize(Function);
+      });
 }
 
 void LowerAnnotations::runOnFunctions(
     BinaryContext &BC,
     std::map<uint64_t, BinaryFunction> &BFs,
     std::set<uint64_t> &) {
+  // Cached dataflow results are indexed by instruction ids, which are about
+  // to go away with the rest of the annotations.
+  DataflowInfoCache::clear();
+
   for (auto &It : BFs) {
     auto &BF = It.second;
     int64_t CurrentGnuArgsSize = 0;
 
+    BF.captureInputEncodings();
+
     // Have we crossed hot/cold border for split functions?
     bool SeenCold = false;
 
@@ -662,6 +1311,7 @@ void LowerAnnotations::runOnFunctions(
         BC.MIB->removeAllAnnotations(*II);
       }
     }
+    BF.clearInstructionIds();
   }
 
   // Release all memory taken by annotations.
@@ -716,9 +1366,11 @@ uint64_t fixDoubleJumps(BinaryContext &BC,
                "Predecessor block has inconsistent number of successors");
         if (CondBranch &&
             BC.MIB->getTargetSymbol(*CondBranch) == BB.getLabel()) {
+          std::lock_guard<std::mutex> Lock(BC.CtxMutex);
           BC.MIB->replaceBranchTarget(*CondBranch, Succ->getLabel(), Ctx);
         } else if (UncondBranch &&
                    BC.MIB->getTargetSymbol(*UncondBranch) == BB.getLabel()) {
+          std::lock_guard<std::mutex> Lock(BC.CtxMutex);
           BC.MIB->replaceBranchTarget(*UncondBranch, Succ->getLabel(), Ctx);
         } else if (!UncondBranch) {
           assert(Function.getBasicBlockAfter(Pred, false) != Succ &&
@@ -796,8 +1448,11 @@ bool SimplifyConditionalTailCalls::shouldRewriteBranch(
     const BinaryBasicBlock *BB,
     const bool DirectionFlag
 ) {
-  if (BeenOptimized.count(PredBB))
-    return false;
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (BeenOptimized.count(PredBB))
+      return false;
+  }
 
   const bool IsForward = BinaryFunction::isForwardBranch(PredBB, BB);
 
@@ -812,6 +1467,38 @@ bool SimplifyConditionalTailCalls::shouldRewriteBranch(
   if (opts::SctcMode == opts::SctcPreserveDirection)
     return IsForward == DirectionFlag;
 
+  if (opts::SctcMode == opts::SctcProfile) {
+    const auto TakenCount = PredBB->getBranchInfo(true).Count;
+    const auto NotTakenCount = PredBB->getBranchInfo(false).Count;
+    if (TakenCount == BinaryBasicBlock::COUNT_NO_PROFILE ||
+        NotTakenCount == BinaryBasicBlock::COUNT_NO_PROFILE)
+      return IsForward == DirectionFlag;
+
+    // Estimate the change in taken and executed branches. The conditional
+    // branch keeps its outcomes, and so its mispredictions, whatever its
+    // target and polarity.
+    const auto *Next =
+      PredBB->getFunction()->getBasicBlockAfter(PredBB, false);
+    int64_t TakenDelta;
+    int64_t BranchDelta;
+    if (PredBB->getConditionalSuccessor(true) == BB) {
+      // The jump in BB is no longer executed.
+      TakenDelta = -TakenCount;
+      BranchDelta = -TakenCount;
+    } else {
+      // The path through BB loses its jumps, while the other successor
+      // needs a jump unless it follows PredBB.
+      const auto *CondSucc = PredBB->getConditionalSuccessor(true);
+      const bool BBIsNext = Next == BB;
+      const bool CondSuccIsNext = Next == CondSucc;
+      TakenDelta = -int64_t(BBIsNext ? 0 : NotTakenCount) -
+                   int64_t(CondSuccIsNext ? TakenCount : 0);
+      BranchDelta = -int64_t(BBIsNext ? NotTakenCount : 2 * NotTakenCount) +
+                    int64_t(CondSuccIsNext ? 0 : TakenCount);
+    }
+    return TakenDelta < 0 || (TakenDelta == 0 && BranchDelta <= 0);
+  }
+
   const auto Frequency = PredBB->getBranchStats(BB);
 
   // It's ok to rewrite the conditional branch if the new target will be
@@ -908,12 +1595,18 @@ uint64_t SimplifyConditionalTailCalls::fixTailCalls(BinaryContext &BC,
         continue;
 
       // Record this block so that we don't try to optimize it twice.
-      BeenOptimized.insert(PredBB);
+      {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        BeenOptimized.insert(PredBB);
+      }
 
       bool BranchForStats;
       if (CondSucc != BB) {
         // Patch the new target address into the conditional branch.
-        MIB->reverseBranchCondition(*CondBranch, CalleeSymbol, BC.Ctx.get());
+        {
+          std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+          MIB->reverseBranchCondition(*CondBranch, CalleeSymbol, BC.Ctx.get());
+        }
         // Since we reversed the condition on the branch we need to change
         // the target for the unconditional branch or add a unconditional
         // branch to the old target.  This has to be done manually since
@@ -922,20 +1615,28 @@ uint64_t SimplifyConditionalTailCalls::fixTailCalls(BinaryContext &BC,
         BranchForStats = false;
       } else {
         // Change destination of the conditional branch.
+        std::lock_guard<std::mutex> Lock(BC.CtxMutex);
         MIB->replaceBranchTarget(*CondBranch, CalleeSymbol, BC.Ctx.get());
         BranchForStats = true;
       }
-      const auto Count = PredBB->getBranchInfo(BranchForStats).Count;
+      const auto &BI = PredBB->getBranchInfo(BranchForStats);
       const uint64_t CTCTakenFreq =
-        Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0 : Count;
+        BI.Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0 : BI.Count;
+      const uint64_t CTCMispredFreq =
+        BI.Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0
+                                                       : BI.MispredictedCount;
 
       // Annotate it, so "isCall" returns true for this jcc
       MIB->setConditionalTailCall(*CondBranch);
-      // Add info abount the conditional tail call frequency, otherwise this
-      // info will be lost when we delete the associated BranchInfo entry
+      // Add info abount the conditional tail call frequency and mispredictions,
+      // otherwise this info will be lost when we delete the associated
+      // BranchInfo entry
       auto &CTCAnnotation = BC.MIB->getOrCreateAnnotationAs<uint64_t>(
           *CondBranch, "CTCTakenCount");
       CTCAnnotation = CTCTakenFreq;
+      auto &CTCMispredAnnotation = BC.MIB->getOrCreateAnnotationAs<uint64_t>(
+          *CondBranch, "CTCMispredCount");
+      CTCMispredAnnotation = CTCMispredFreq;
 
       // Remove the unused successor which may be eliminated later
       // if there are no other users.
@@ -982,15 +1683,20 @@ uint64_t SimplifyConditionalTailCalls::fixTailCalls(BinaryContext &BC,
     const bool HasFallthrough = (NextBlock && PredSucc == NextBlock);
 
     if (UncondBranch) {
-      if (HasFallthrough)
+      if (HasFallthrough) {
         PredBB->eraseInstruction(UncondBranch);
-      else
+      } else {
+        std::lock_guard<std::mutex> Lock(BC.CtxMutex);
         MIB->replaceBranchTarget(*UncondBranch,
                                  CondSucc->getLabel(),
                                  BC.Ctx.get());
+      }
     } else if (!HasFallthrough) {
       MCInst Branch;
-      MIB->createUncondBranch(Branch, CondSucc->getLabel(), BC.Ctx.get());
+      {
+        std::lock_guard<std::mutex> Lock(BC.CtxMutex);
+        MIB->createUncondBranch(Branch, CondSucc->getLabel(), BC.Ctx.get());
+      }
       PredBB->addInstruction(Branch);
     }
   }
@@ -1028,16 +1734,17 @@ void SimplifyConditionalTailCalls::runOnFunctions(
   if (!BC.isX86())
     return;
 
-  for (auto &It : BFs) {
-    auto &Function = It.second;
-
-    if (!shouldOptimize(Function))
-      continue;
-
-    if (fixTailCalls(BC, Function)) {
-      Modified.insert(&Function);
-    }
-  }
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        if (fixTailCalls(BC, Function)) {
+          std::lock_guard<std::mutex> Lock(Mutex);
+          Modified.insert(&Function);
+        }
+      },
+      [&](const BinaryFunction &Function) {
+        return !shouldOptimize(Function);
+      });
 
   outs() << "BOLT-INFO: SCTC: patched " << NumTailCallsPatched
          << " tail calls (" << NumOrigForwardBranches << " forward)"
@@ -1116,33 +1823,87 @@ void Peepholes::removeUselessCondBranches(BinaryContext &BC,
   }
 }
 
+void Peepholes::applyPatterns(BinaryContext &BC, BinaryFunction &Function) {
+  std::vector<uint64_t> Hits(Patterns.size(), 0);
+  std::vector<uint64_t> DynHits(Patterns.size(), 0);
+  for (auto &BB : Function) {
+    for (unsigned Index = 0; Index < BB.size(); ) {
+      MutableArrayRef<MCInst> Insts(&*BB.begin(), BB.size());
+      auto Action = MCPlusBuilder::PeepholeAction::NONE;
+      unsigned P = 0;
+      for (; P < Patterns.size(); ++P) {
+        Action = Patterns[P].Apply(Insts, Index);
+        if (Action != MCPlusBuilder::PeepholeAction::NONE)
+          break;
+      }
+      if (Action == MCPlusBuilder::PeepholeAction::NONE) {
+        ++Index;
+        continue;
+      }
+
+      ++Hits[P];
+      DynHits[P] += BB.getKnownExecutionCount();
+      if (Action == MCPlusBuilder::PeepholeAction::ERASE)
+        BB.eraseInstruction(BB.begin() + Index);
+      else
+        ++Index;
+    }
+  }
+
+  std::lock_guard<std::mutex> Lock(PatternStatsMutex);
+  for (unsigned P = 0; P < Patterns.size(); ++P) {
+    PatternHits[P] += Hits[P];
+    PatternDynHits[P] += DynHits[P];
+  }
+}
+
 void Peepholes::runOnFunctions(BinaryContext &BC,
                                std::map<uint64_t, BinaryFunction> &BFs,
                                std::set<uint64_t> &LargeFunctions) {
-  const char Opts =
+  char Opts =
     std::accumulate(opts::Peepholes.begin(),
                     opts::Peepholes.end(),
                     0,
                     [](const char A, const opts::PeepholeOpts B) {
                       return A | B;
                     });
-  if (Opts == opts::PEEP_NONE || !BC.isX86())
+  // Only the target patterns are available on other architectures.
+  if (!BC.isX86())
+    Opts &= opts::PEEP_PATTERNS;
+  if (Opts == opts::PEEP_NONE)
     return;
 
-  for (auto &It : BFs) {
-    auto &Function = It.second;
-    if (shouldOptimize(Function)) {
-      if (Opts & opts::PEEP_SHORTEN)
-        NumShortened += shortenInstructions(BC, Function);
-      if (Opts & opts::PEEP_DOUBLE_JUMPS)
-        NumDoubleJumps += fixDoubleJumps(BC, Function, false);
-      if (Opts & opts::PEEP_TAILCALL_TRAPS)
-        addTailcallTraps(BC, Function);
-      if (Opts & opts::PEEP_USELESS_BRANCHES)
-        removeUselessCondBranches(BC, Function);
-      assert(Function.validateCFG());
+  if (Opts & opts::PEEP_PATTERNS) {
+    for (auto &Pattern : BC.MIB->getPeepholePatterns()) {
+      if (!opts::PeepholePatterns.empty() &&
+          std::find(opts::PeepholePatterns.begin(),
+                    opts::PeepholePatterns.end(),
+                    Pattern.Name) == opts::PeepholePatterns.end())
+        continue;
+      Patterns.emplace_back(std::move(Pattern));
     }
+    PatternHits.assign(Patterns.size(), 0);
+    PatternDynHits.assign(Patterns.size(), 0);
   }
+
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        if (Opts & opts::PEEP_SHORTEN)
+          NumShortened += shortenInstructions(BC, Function);
+        if (Opts & opts::PEEP_DOUBLE_JUMPS)
+          NumDoubleJumps += fixDoubleJumps(BC, Function, false);
+        if (Opts & opts::PEEP_TAILCALL_TRAPS)
+          addTailcallTraps(BC, Function);
+        if (Opts & opts::PEEP_USELESS_BRANCHES)
+          removeUselessCondBranches(BC, Function);
+        if (!Patterns.empty())
+          applyPatterns(BC, Function);
+        assert(Function.validateCFG());
+      },
+      [&](const BinaryFunction &Function) {
+        return !shouldOptimize(Function);
+      });
   outs() << "BOLT-INFO: Peephole: " << NumShortened
          << " instructions shortened.\n"
          << "BOLT-INFO: Peephole: " << NumDoubleJumps
@@ -1151,6 +1912,12 @@ void Peepholes::runOnFunctions(BinaryContext &BC,
          << " tail call traps inserted.\n"
          << "BOLT-INFO: Peephole: " << NumUselessCondBranches
          << " useless conditional branches removed.\n";
+  for (unsigned P = 0; P < Patterns.size(); ++P) {
+    outs() << "BOLT-INFO: Peephole: pattern " << Patterns[P].Name
+           << " applied " << PatternHits[P] << " times (executed "
+           << PatternDynHits[P] << " times).\n";
+  }
+  Patterns.clear();
 }
 
 bool SimplifyRODataLoads::simplifyRODataLoads(
@@ -1233,6 +2000,366 @@ bool SimplifyRODataLoads::simplifyRODataLoads(
   return NumLocalLoadsSimplified > 0;
 }
 
+namespace {
+
+/// Maximum number of definitions followed back from a use of a register
+/// when looking for its constant value.
+constexpr unsigned MaxValueDepth = 4;
+
+/// Number of times the function is re-analyzed after it has been simplified.
+constexpr unsigned MaxPropagationRounds = 3;
+
+/// Return the address of the data referenced by symbolic expression \p Expr.
+ErrorOr<uint64_t> getExprAddress(const BinaryContext &BC, const MCExpr *Expr) {
+  const MCSymbol *Symbol;
+  uint64_t Offset;
+  std::tie(Symbol, Offset) = BC.MIB->getTargetSymbolInfo(Expr);
+  if (!Symbol)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  const auto *BD = BC.getBinaryDataByName(Symbol->getName());
+  if (!BD)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  return BD->getAddress() + Offset;
+}
+
+ErrorOr<int64_t> getRegValueBefore(const BinaryContext &BC,
+                                   const RegAnalysis &RA,
+                                   DataflowInfoManager &Info,
+                                   const MCInst &Point, MCPhysReg Reg,
+                                   unsigned Depth);
+
+/// Return the value that \p Def leaves in the 64-bit register \p Reg.
+ErrorOr<int64_t> getDefinedValue(const BinaryContext &BC,
+                                 const RegAnalysis &RA,
+                                 DataflowInfoManager &Info,
+                                 const MCInst &Def, MCPhysReg Reg,
+                                 unsigned Depth) {
+  auto &MIB = BC.MIB;
+
+  MCPhysReg From, To;
+  int64_t Imm;
+  if (MIB->isMoveImmToReg(Def, To, Imm)) {
+    if (To != Reg)
+      return make_error_code(llvm::errc::invalid_argument);
+    return Imm;
+  }
+
+  if (MIB->isRegToRegMove(Def, From, To)) {
+    if (To != Reg)
+      return make_error_code(llvm::errc::invalid_argument);
+    return getRegValueBefore(BC, RA, Info, Def, From, Depth + 1);
+  }
+
+  if (Def.getNumOperands() < 2 || !Def.getOperand(0).isReg())
+    return make_error_code(llvm::errc::invalid_argument);
+  const auto Dst = Def.getOperand(0).getReg();
+
+  // Only the 32- and 64-bit forms clear the whole register.
+  if (MIB->isCleanRegXOR(Def)) {
+    if (MIB->getRegSize(Dst) < 4 || MIB->getAliasSized(Dst, 8) != Reg)
+      return make_error_code(llvm::errc::invalid_argument);
+    return 0;
+  }
+
+  if (Dst != Reg)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  // Address of a symbol, such as the start of a table in read-only data.
+  if (MIB->isLEA64r(Def) && MIB->hasPCRelOperand(Def)) {
+    unsigned BaseReg, IndexReg, SegReg;
+    int64_t Scale, Disp;
+    const MCExpr *DispExpr = nullptr;
+    if (!MIB->evaluateX86MemoryOperand(Def, &BaseReg, &Scale, &IndexReg,
+                                       &Disp, &SegReg, &DispExpr) ||
+        !DispExpr || IndexReg || SegReg)
+      return make_error_code(llvm::errc::invalid_argument);
+
+    auto AddressOrErr = getExprAddress(BC, DispExpr);
+    if (!AddressOrErr)
+      return AddressOrErr.getError();
+    return static_cast<int64_t>(*AddressOrErr);
+  }
+
+  // Arithmetic on a single source register.
+  if (!Def.getOperand(1).isReg() || !Def.getOperand(1).getReg())
+    return make_error_code(llvm::errc::invalid_argument);
+  const auto Src = Def.getOperand(1).getReg();
+  auto SrcValueOrErr = getRegValueBefore(BC, RA, Info, Def, Src, Depth + 1);
+  if (!SrcValueOrErr)
+    return SrcValueOrErr.getError();
+
+  int64_t Value;
+  if (!MIB->evaluateSimple(Def, Value, std::make_pair(Src, *SrcValueOrErr),
+                           std::make_pair(0, 0)))
+    return make_error_code(llvm::errc::invalid_argument);
+  return Value;
+}
+
+/// Return the constant value of the 64-bit register \p Reg before \p Point.
+/// Every definition reaching \p Point has to produce the same value, and one
+/// of them has to dominate \p Point since reaching definitions do not account
+/// for the value the register has on entry to the function.
+ErrorOr<int64_t> getRegValueBefore(const BinaryContext &BC,
+                                   const RegAnalysis &RA,
+                                   DataflowInfoManager &Info,
+                                   const MCInst &Point, MCPhysReg Reg,
+                                   unsigned Depth) {
+  if (Depth > MaxValueDepth)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  auto &RD = Info.getReachingDefs();
+  auto &DA = Info.getDominatorAnalysis();
+  auto StateOrErr = RD.getStateBefore(Point);
+  if (!StateOrErr)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  const auto &Aliases = BC.MIB->getAliases(Reg);
+  BitVector Defs = *StateOrErr;
+  BitVector Clobbers(BC.MRI->getNumRegs(), false);
+  Optional<int64_t> Value;
+  bool Dominates = false;
+  for (auto I = RD.expr_begin(Defs), E = RD.expr_end(); I != E; ++I) {
+    const MCInst &Def = **I;
+    Clobbers.reset();
+    RA.getInstClobberList(Def, Clobbers);
+    if (!Clobbers.anyCommon(Aliases))
+      continue;
+
+    auto ValueOrErr = getDefinedValue(BC, RA, Info, Def, Reg, Depth);
+    if (!ValueOrErr || (Value && *Value != *ValueOrErr))
+      return make_error_code(llvm::errc::invalid_argument);
+    Value = *ValueOrErr;
+
+    if (DA.doesADominateB(Def, Point))
+      Dominates = true;
+  }
+
+  if (!Value || !Dominates)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  return *Value;
+}
+
+} // anonymous namespace
+
+bool SimplifyRODataLoads::propagateConstants(BinaryContext &BC,
+                                             BinaryFunction &BF,
+                                             const RegAnalysis &RA) {
+  auto &MIB = BC.MIB;
+
+  BitVector GPRegs(BC.MRI->getNumRegs(), false);
+  MIB->getGPRegs(GPRegs);
+
+  // Return the value of register \p Reg, or of its 64-bit alias if
+  // \p Reg is smaller, before instruction \p Point.
+  auto getValue = [&](DataflowInfoManager &Info, const MCInst &Point,
+                      MCPhysReg Reg) -> ErrorOr<int64_t> {
+    if (!GPRegs[Reg] || MIB->isUpper8BitReg(Reg))
+      return make_error_code(llvm::errc::invalid_argument);
+    return getRegValueBefore(BC, RA, Info, Point, MIB->getAliasSized(Reg, 8),
+                             /*Depth=*/0);
+  };
+
+  // Return true if the address of read-only data is computed by the
+  // function, possibly to index into it.
+  auto referencesROData = [&]() {
+    for (auto &BB : BF) {
+      for (auto &Inst : BB) {
+        if (!BC.MII->get(Inst.getOpcode()).mayLoad() && !MIB->isLEA64r(Inst))
+          continue;
+
+        unsigned BaseReg, IndexReg, SegReg;
+        int64_t Scale, Disp;
+        const MCExpr *DispExpr = nullptr;
+        if (!MIB->evaluateX86MemoryOperand(Inst, &BaseReg, &Scale, &IndexReg,
+                                           &Disp, &SegReg, &DispExpr) ||
+            !DispExpr)
+          continue;
+
+        auto AddressOrErr = getExprAddress(BC, DispExpr);
+        if (!AddressOrErr)
+          continue;
+        auto Section = BC.getSectionForAddress(*AddressOrErr);
+        if (Section && Section->isReadOnly())
+          return true;
+      }
+    }
+    return false;
+  };
+
+  if (!Modified.count(&BF) && !referencesROData())
+    return false;
+
+  struct LoadReplacement {
+    BinaryBasicBlock *BB;
+    MCInst *Inst;
+    StringRef ConstantData;
+    uint64_t Offset;
+  };
+
+  struct BranchFolding {
+    BinaryBasicBlock *BB;
+    MCInst *CondBranch;
+    MCInst *UncondBranch;
+    bool Taken;
+  };
+
+  bool Changed = false;
+  for (unsigned Round = 0; Round < MaxPropagationRounds; ++Round) {
+    // The cache recomputes the analyses once the function has changed.
+    auto &Info = DataflowInfoCache::get(BC, BF, &RA, nullptr);
+
+    // Replacing an instruction drops its annotations, including the
+    // dataflow state, so all changes are collected before any is made.
+    std::vector<LoadReplacement> Loads;
+    std::vector<BranchFolding> Branches;
+    for (auto *BB : BF.layout()) {
+      for (auto &Inst : *BB) {
+        if (!BC.MII->get(Inst.getOpcode()).mayLoad() || MIB->isCall(Inst) ||
+            MIB->isBranch(Inst) || MIB->hasPCRelOperand(Inst))
+          continue;
+
+        unsigned BaseReg, IndexReg, SegReg;
+        int64_t Scale, Disp;
+        const MCExpr *DispExpr = nullptr;
+        if (!MIB->evaluateX86MemoryOperand(Inst, &BaseReg, &Scale, &IndexReg,
+                                           &Disp, &SegReg, &DispExpr) ||
+            SegReg || (!BaseReg && !IndexReg))
+          continue;
+
+        uint64_t Address = Disp;
+        if (DispExpr) {
+          auto AddressOrErr = getExprAddress(BC, DispExpr);
+          if (!AddressOrErr)
+            continue;
+          Address = *AddressOrErr;
+        }
+        if (BaseReg) {
+          auto ValueOrErr = getValue(Info, Inst, BaseReg);
+          if (!ValueOrErr)
+            continue;
+          Address += *ValueOrErr;
+        }
+        if (IndexReg) {
+          auto ValueOrErr = getValue(Info, Inst, IndexReg);
+          if (!ValueOrErr)
+            continue;
+          Address += *ValueOrErr * Scale;
+        }
+
+        auto DataSection = BC.getSectionForAddress(Address);
+        if (!DataSection || !DataSection->isReadOnly())
+          continue;
+
+        // Jump table entries are rewritten when the code is emitted.
+        if (BC.getRelocationAt(Address))
+          continue;
+        const auto *BD = BC.getBinaryDataContainingAddress(Address);
+        if (BD && BD->isJumpTable())
+          continue;
+
+        const auto Offset = Address - DataSection->getAddress();
+        const auto ConstantData = DataSection->getContents();
+        if (ConstantData.size() < Offset + 8)
+          continue;
+
+        Loads.push_back({BB, &Inst, ConstantData, Offset});
+      }
+
+      if (BB->succ_size() != 2 ||
+          BB->getConditionalSuccessor(true) ==
+          BB->getConditionalSuccessor(false))
+        continue;
+
+      const MCSymbol *TBB = nullptr;
+      const MCSymbol *FBB = nullptr;
+      MCInst *CondBranch = nullptr;
+      MCInst *UncondBranch = nullptr;
+      if (!BB->analyzeBranch(TBB, FBB, CondBranch, UncondBranch) ||
+          !CondBranch)
+        continue;
+
+      // Find the instruction setting the flags read by the branch.
+      auto FlagsI = BB->rend();
+      BitVector Clobbers(BC.MRI->getNumRegs(), false);
+      for (auto I = BB->rbegin(), E = BB->rend(); I != E; ++I) {
+        if (&*I == CondBranch || &*I == UncondBranch)
+          continue;
+        Clobbers.reset();
+        MIB->getClobberedRegs(*I, Clobbers);
+        if (Clobbers[MIB->getFlagsReg()]) {
+          FlagsI = I;
+          break;
+        }
+      }
+      if (FlagsI == BB->rend())
+        continue;
+
+      const auto &FlagsInst = *FlagsI;
+      std::pair<MCPhysReg, int64_t> Inputs[2] = {{0, 0}, {0, 0}};
+      unsigned NumInputs = 0;
+      bool Known = true;
+      for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(FlagsInst);
+           I != E; ++I) {
+        const auto &Operand = FlagsInst.getOperand(I);
+        if (!Operand.isReg() || !Operand.getReg())
+          continue;
+        if (NumInputs == 2) {
+          Known = false;
+          break;
+        }
+        auto ValueOrErr = getValue(Info, FlagsInst, Operand.getReg());
+        if (!ValueOrErr) {
+          Known = false;
+          break;
+        }
+        Inputs[NumInputs++] = std::make_pair(Operand.getReg(), *ValueOrErr);
+      }
+
+      bool Taken;
+      if (!Known || !MIB->evaluateBranchCondition(FlagsInst, *CondBranch,
+                                                  Inputs[0], Inputs[1], Taken))
+        continue;
+
+      Branches.push_back({BB, CondBranch, UncondBranch, Taken});
+    }
+
+    if (Loads.empty() && Branches.empty())
+      break;
+
+    for (auto &Load : Loads) {
+      if (!MIB->replaceMemOperandWithImm(*Load.Inst, Load.ConstantData,
+                                         Load.Offset))
+        continue;
+      ++NumIndexedLoadsSimplified;
+      NumDynamicIndexedLoadsSimplified += Load.BB->getKnownExecutionCount();
+      Changed = true;
+    }
+
+    for (auto &Branch : Branches) {
+      auto *BB = Branch.BB;
+      auto *Live = BB->getConditionalSuccessor(Branch.Taken);
+      auto *Dead = BB->getConditionalSuccessor(!Branch.Taken);
+      const auto &DeadBI = BB->getBranchInfo(!Branch.Taken);
+
+      // The edge to the dead successor now leads to the live one, and
+      // FixupBranches adds a jump if the live successor does not follow.
+      BB->replaceSuccessor(Dead, Live, DeadBI.Count, DeadBI.MispredictedCount);
+      if (Branch.UncondBranch)
+        BB->eraseInstruction(Branch.UncondBranch);
+      BB->removeDuplicateConditionalSuccessor(Branch.CondBranch);
+
+      ++NumBranchesFolded;
+      NumDynamicBranchesFolded += BB->getKnownExecutionCount();
+      Changed = true;
+    }
+  }
+
+  return Changed;
+}
+
 void SimplifyRODataLoads::runOnFunctions(
   BinaryContext &BC,
   std::map<uint64_t, BinaryFunction> &BFs,
@@ -1245,13 +2372,128 @@ void SimplifyRODataLoads::runOnFunctions(
     }
   }
 
+  if (opts::SimplifyRODataPropagate && BC.isX86()) {
+    auto CG = buildCallGraph(BC, BFs);
+    RegAnalysis RA(BC, BFs, CG);
+    for (auto &It : BFs) {
+      auto &Function = It.second;
+      if (shouldOptimize(Function) && propagateConstants(BC, Function, RA))
+        Modified.insert(&Function);
+    }
+  }
+
   outs() << "BOLT-INFO: simplified " << NumLoadsSimplified << " out of "
          << NumLoadsFound << " loads from a statically computed address.\n"
          << "BOLT-INFO: dynamic loads simplified: " << NumDynamicLoadsSimplified
          << "\n"
          << "BOLT-INFO: dynamic loads found: " << NumDynamicLoadsFound << "\n";
+  if (opts::SimplifyRODataPropagate && BC.isX86()) {
+    outs() << "BOLT-INFO: simplified " << NumIndexedLoadsSimplified
+           << " indexed loads from read-only data (executed "
+           << NumDynamicIndexedLoadsSimplified << " times) and folded "
+           << NumBranchesFolded << " conditional branches (executed "
+           << NumDynamicBranchesFolded << " times).\n";
+  }
 }
 
+namespace {
+
+/// Return the relative error of flow conservation in the CFG of \p BF: the
+/// sum of differences between the count of every block and the counts of its
+/// incoming and outgoing edges, divided by twice the sum of block counts.
+/// Entry points and landing pads are not checked for incoming flow, and
+/// blocks without successors are not checked for outgoing flow.
+double getFlowConservationError(const BinaryFunction &BF) {
+  auto absDiff = [](uint64_t A, uint64_t B) { return A > B ? A - B : B - A; };
+
+  DenseMap<const BinaryBasicBlock *, uint64_t> InFlow;
+  uint64_t Mismatch{0};
+  uint64_t Total{0};
+  for (const auto &BB : BF) {
+    const auto Count = BB.getKnownExecutionCount();
+    Total += Count;
+
+    if (!BB.succ_size())
+      continue;
+
+    uint64_t OutFlow{0};
+    auto BI = BB.branch_info_begin();
+    for (const auto *Succ : BB.successors()) {
+      if (BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE) {
+        OutFlow += BI->Count;
+        InFlow[Succ] += BI->Count;
+      }
+      ++BI;
+    }
+    Mismatch += absDiff(OutFlow, Count);
+  }
+
+  for (const auto &BB : BF) {
+    if (BB.isEntryPoint() || BB.isLandingPad())
+      continue;
+    Mismatch += absDiff(InFlow.lookup(&BB), BB.getKnownExecutionCount());
+  }
+  return Total ? static_cast<double>(Mismatch) / (2 * Total) : 0.0;
+}
+
+/// Return the number of executed taken branches in the input layout of
+/// \p BF. Block reordering could turn them into fall-throughs, so the number
+/// serves as an estimate of the benefit of optimizing the function.
+uint64_t getTakenBranchCount(const BinaryFunction &BF) {
+  uint64_t Count{0};
+  for (auto BBI = BF.layout_begin(), E = BF.layout_end(); BBI != E; ++BBI) {
+    const auto *BB = *BBI;
+    const auto *NextBB = std::next(BBI) != E ? *std::next(BBI) : nullptr;
+    auto BI = BB->branch_info_begin();
+    for (const auto *Succ : BB->successors()) {
+      if (Succ != NextBB && BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE)
+        Count += BI->Count;
+      ++BI;
+    }
+  }
+  return Count;
+}
+
+/// Write the report requested with -profile-quality-report. Functions are
+/// listed by decreasing execution count.
+void writeProfileQualityReport(std::map<uint64_t, BinaryFunction> &BFs) {
+  std::error_code EC;
+  raw_fd_ostream OS(opts::ProfileQualityReport, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: " << EC.message() << " : unable to open "
+           << opts::ProfileQualityReport << " for output.\n";
+    return;
+  }
+
+  std::vector<const BinaryFunction *> Functions;
+  for (const auto &BFI : BFs) {
+    if (BFI.second.hasProfile())
+      Functions.push_back(&BFI.second);
+  }
+  std::stable_sort(Functions.begin(), Functions.end(),
+                   [](const BinaryFunction *A, const BinaryFunction *B) {
+                     return A->getKnownExecutionCount() >
+                            B->getKnownExecutionCount();
+                   });
+
+  OS << "function,exec_count,status,match_ratio,flow_error,"
+        "unattributed_ratio,taken_branches\n";
+  for (const auto *BF : Functions) {
+    const char *Status = !BF->isSimple()
+      ? "non-simple"
+      : BF->hasValidProfile() ? "valid" : "stale";
+    OS << '"' << BF->getPrintName() << "\","
+       << BF->getKnownExecutionCount() << ','
+       << Status << ','
+       << format("%.4f", BF->getProfileMatchRatio()) << ','
+       << format("%.4f", getFlowConservationError(*BF)) << ','
+       << format("%.4f", 1.0f - BF->getProfileMatchRatio()) << ','
+       << getTakenBranchCount(*BF) << '\n';
+  }
+}
+
+} // anonymous namespace
+
 void
 PrintProgramStats::runOnFunctions(BinaryContext &BC,
                                   std::map<uint64_t, BinaryFunction> &BFs,
@@ -1260,6 +2502,9 @@ PrintProgramStats::runOnFunctions(BinaryContext &BC,
   uint64_t NumStaleProfileFunctions{0};
   uint64_t NumNonSimpleProfiledFunctions{0};
   std::vector<BinaryFunction *> ProfiledFunctions;
+  if (!opts::ProfileQualityReport.empty())
+    writeProfileQualityReport(BFs);
+
   const char *StaleFuncsHeader = "BOLT-INFO: Functions with stale profile:\n";
   for (auto &BFI : BFs) {
     auto &Function = BFI.second;
@@ -1505,33 +2750,37 @@ void InstructionLowering::runOnFunctions(
     BinaryContext &BC,
     std::map<uint64_t, BinaryFunction> &BFs,
     std::set<uint64_t> &LargeFunctions) {
-  for (auto &BFI : BFs) {
-    for (auto &BB : BFI.second) {
-      for (auto &Instruction : BB) {
-        BC.MIB->lowerTailCall(Instruction);
-      }
-    }
-  }
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        for (auto &BB : Function) {
+          for (auto &Instruction : BB) {
+            BC.MIB->lowerTailCall(Instruction);
+          }
+        }
+      });
 }
 
 void StripRepRet::runOnFunctions(
     BinaryContext &BC,
     std::map<uint64_t, BinaryFunction> &BFs,
     std::set<uint64_t> &LargeFunctions) {
-  uint64_t NumPrefixesRemoved = 0;
-  uint64_t NumBytesSaved = 0;
-  for (auto &BFI : BFs) {
-    for (auto &BB : BFI.second) {
-      auto LastInstRIter = BB.getLastNonPseudo();
-      if (LastInstRIter == BB.rend() ||
-          !BC.MIB->isReturn(*LastInstRIter) ||
-          !BC.MIB->deleteREPPrefix(*LastInstRIter))
-        continue;
-
-      NumPrefixesRemoved += BB.getKnownExecutionCount();
-      ++NumBytesSaved;
-    }
-  }
+  std::atomic<uint64_t> NumPrefixesRemoved{0};
+  std::atomic<uint64_t> NumBytesSaved{0};
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        for (auto &BB : Function) {
+          auto LastInstRIter = BB.getLastNonPseudo();
+          if (LastInstRIter == BB.rend() ||
+              !BC.MIB->isReturn(*LastInstRIter) ||
+              !BC.MIB->deleteREPPrefix(*LastInstRIter))
+            continue;
+
+          NumPrefixesRemoved += BB.getKnownExecutionCount();
+          ++NumBytesSaved;
+        }
+      });
 
   if (NumBytesSaved) {
     outs() << "BOLT-INFO: removed " << NumBytesSaved << " 'repz' prefixes"
@@ -1540,14 +2789,45 @@ void StripRepRet::runOnFunctions(
   }
 }
 
+ErrorOr<uint64_t>
+InlineMemcpy::getConstantSize(BinaryContext &BC, BinaryBasicBlock &BB,
+                              BinaryBasicBlock::iterator Call) {
+  // The size is the third argument.
+  const auto &SizeAliases = BC.MIB->getAliases(BC.MIB->getIntArgRegister(2));
+  BitVector Written(BC.MRI->getNumRegs(), false);
+  while (Call != BB.begin()) {
+    --Call;
+    if (BC.MIB->isCall(*Call))
+      break;
+
+    Written.reset();
+    BC.MIB->getWrittenRegs(*Call, Written);
+    if (!Written.anyCommon(SizeAliases))
+      continue;
+
+    MCPhysReg Reg;
+    int64_t Imm;
+    if (BC.MIB->isMoveImmToReg(*Call, Reg, Imm) && SizeAliases[Reg])
+      return static_cast<uint64_t>(Imm);
+    if (BC.MIB->isCleanRegXOR(*Call))
+      return 0;
+    break;
+  }
+  return make_error_code(llvm::errc::invalid_argument);
+}
+
 void InlineMemcpy::runOnFunctions(BinaryContext &BC,
                                   std::map<uint64_t, BinaryFunction> &BFs,
                                   std::set<uint64_t> &LargeFunctions) {
   if (!BC.isX86())
     return;
 
-  uint64_t NumInlined = 0;
-  uint64_t NumInlinedDyno = 0;
+  enum StringOp { SO_MEMCPY, SO_MEMCPY8, SO_MEMSET, SO_MEMCMP, SO_NUM };
+  const char *const Names[SO_NUM] = {"memcpy", "_memcpy8", "memset", "memcmp"};
+  uint64_t NumInlined[SO_NUM] = {0};
+  uint64_t NumInlinedDyno[SO_NUM] = {0};
+  uint64_t NumSpecialized = 0;
+
   for (auto &BFI : BFs) {
     for (auto &BB : BFI.second) {
       for(auto II = BB.begin(); II != BB.end(); ++II) {
@@ -1558,15 +2838,40 @@ void InlineMemcpy::runOnFunctions(BinaryContext &BC,
           continue;
 
         const auto *CalleeSymbol = BC.MIB->getTargetSymbol(Inst);
-        if (CalleeSymbol->getName() != "memcpy" &&
-            CalleeSymbol->getName() != "memcpy@PLT" &&
-            CalleeSymbol->getName() != "_memcpy8")
+        auto CalleeName = CalleeSymbol->getName();
+        CalleeName.consume_back("@PLT");
+        const auto Op = static_cast<StringOp>(
+            std::find(Names, Names + SO_NUM, CalleeName) - Names);
+        if (Op == SO_NUM)
           continue;
 
-        const auto IsMemcpy8 = (CalleeSymbol->getName() == "_memcpy8");
         const auto IsTailCall = BC.MIB->isTailCall(Inst);
 
-        const auto NewCode = BC.MIB->createInlineMemcpy(IsMemcpy8);
+        // Sizes known at the call site get an unrolled sequence.
+        std::vector<MCInst> NewCode;
+        auto Size = getConstantSize(BC, BB, II);
+        if (Size && *Size <= opts::InlineMemcpyMaxSize) {
+          switch (Op) {
+          case SO_MEMCPY:
+          case SO_MEMCPY8:
+            NewCode = BC.MIB->createInlineMemcpy(Op == SO_MEMCPY8, *Size);
+            break;
+          case SO_MEMSET:
+            NewCode = BC.MIB->createInlineMemset(*Size);
+            break;
+          default:
+            NewCode = BC.MIB->createInlineMemcmp(*Size);
+            break;
+          }
+          if (!NewCode.empty())
+            ++NumSpecialized;
+        }
+        if (NewCode.empty() && (Op == SO_MEMCPY || Op == SO_MEMCPY8) &&
+            opts::InlineMemcpyRepMovsb)
+          NewCode = BC.MIB->createInlineMemcpy(Op == SO_MEMCPY8);
+        if (NewCode.empty())
+          continue;
+
         II = BB.replaceInstruction(II, NewCode);
         std::advance(II, NewCode.size() - 1);
         if (IsTailCall) {
@@ -1575,19 +2880,26 @@ void InlineMemcpy::runOnFunctions(BinaryContext &BC,
           II = BB.insertInstruction(std::next(II), std::move(Return));
         }
 
-        ++NumInlined;
-        NumInlinedDyno += BB.getKnownExecutionCount();
+        ++NumInlined[Op];
+        NumInlinedDyno[Op] += BB.getKnownExecutionCount();
       }
     }
   }
 
-  if (NumInlined) {
-    outs() << "BOLT-INFO: inlined " << NumInlined << " memcpy() calls";
-    if (NumInlinedDyno)
-      outs() << ". The calls were executed " << NumInlinedDyno
+  for (unsigned Op = 0; Op < SO_NUM; ++Op) {
+    if (!NumInlined[Op])
+      continue;
+    outs() << "BOLT-INFO: inlined " << NumInlined[Op] << ' ' << Names[Op]
+           << "() calls";
+    if (NumInlinedDyno[Op])
+      outs() << ". The calls were executed " << NumInlinedDyno[Op]
              << " times based on profile.";
     outs() << '\n';
   }
+  if (NumSpecialized) {
+    outs() << "BOLT-INFO: " << NumSpecialized << " of the inlined calls have "
+           << "a constant size and use unrolled moves\n";
+  }
 }
 
 } // namespace bolt
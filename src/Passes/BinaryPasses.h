@@ -17,28 +17,60 @@
 #include "BinaryContext.h"
 #include "BinaryFunction.h"
 #include "HFSort.h"
+#include "ParallelUtilities.h"
 #include "llvm/Support/CommandLine.h"
 
+#include <atomic>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 namespace llvm {
 namespace bolt {
 
+class RegAnalysis;
+
 /// An optimization/analysis pass that runs on functions.
 class BinaryFunctionPass {
 protected:
   bool PrintPass;
 
+  /// Functions the pass is restricted to with -pass-config. All functions if
+  /// not set.
+  std::function<bool(const BinaryFunction &)> FunctionFilter;
+
   explicit BinaryFunctionPass(const bool PrintPass)
     : PrintPass(PrintPass) { }
 
   /// Control whether a specific function should be skipped during
   /// optimization.
   bool shouldOptimize(const BinaryFunction &BF) const;
+
+  /// Same as shouldOptimize(), ignoring the restriction of -pass-config.
+  bool canOptimize(const BinaryFunction &BF) const;
+
+  /// Return true if \p BF is excluded from the pass with -pass-config.
+  bool isFilteredOut(const BinaryFunction &BF) const {
+    return FunctionFilter && !FunctionFilter(BF);
+  }
+
+
+  /// Apply \p WorkFunction to each function in \p BFs not rejected by
+  /// \p SkipPredicate. If the pass is function-local, the work is spread over
+  /// the thread pool. Otherwise functions are processed serially in the
+  /// order of their addresses.
+  void runOnEachFunction(
+      std::map<uint64_t, BinaryFunction> &BFs,
+      ParallelUtilities::WorkFuncTy WorkFunction,
+      ParallelUtilities::PredicateTy SkipPredicate =
+        ParallelUtilities::PredicateTy(),
+      ParallelUtilities::SchedulingPolicy SchedPolicy =
+        ParallelUtilities::SP_INST_LINEAR);
 public:
   virtual ~BinaryFunctionPass() = default;
 
@@ -48,6 +80,26 @@ public:
   /// Control whether debug info is printed after this pass is completed.
   bool printPass() const { return PrintPass; }
 
+  /// Return true if the pass processes every function independently, i.e.
+  /// the per-function work only reads and modifies the state of the function
+  /// being processed. Such passes are executed on multiple threads, while the
+  /// rest of the passes act as serial barriers.
+  virtual bool isFunctionLocal() const { return false; }
+
+  /// Return true if the pass never modifies the CFG or the instructions of
+  /// functions. Cached dataflow results are then kept after the pass without
+  /// checking every function for changes.
+  virtual bool preservesDataflowInfo() const { return false; }
+
+  /// Return true if the pass can be restricted to some of the functions with
+  /// -pass-config although it is required to emit the code.
+  virtual bool supportsFunctionFilter() const { return false; }
+
+  /// Restrict the pass to the functions accepted by \p Filter.
+  void setFunctionFilter(std::function<bool(const BinaryFunction &)> Filter) {
+    FunctionFilter = std::move(Filter);
+  }
+
   /// Control whether debug info is printed for an individual function after
   /// this pass is completed (printPass() must have returned true).
   virtual bool shouldPrint(const BinaryFunction &BF) const;
@@ -75,6 +127,8 @@ public:
     return "print dyno-stats after optimizations";
   }
 
+  bool preservesDataflowInfo() const override { return true; }
+
   bool shouldPrint(const BinaryFunction &BF) const override {
     return false;
   }
@@ -171,22 +225,79 @@ public:
     LT_OPTIMIZE_CACHE,
     /// Block reordering guided by the extended TSP metric.
     LT_OPTIMIZE_CACHE_PLUS,
+    /// Greedy chain merging maximizing the extended TSP metric with
+    /// incremental gain updates.
+    LT_OPTIMIZE_EXT_TSP,
     /// Create clusters and use random order for them.
     LT_OPTIMIZE_SHUFFLE,
   };
 
 private:
+  /// Key of a function in the layout cache: the function hash and the digest
+  /// of its profile and layout options.
+  using LayoutCacheKey = std::pair<uint64_t, uint64_t>;
+
+  /// Layouts of basic blocks stored as indices into the original layout.
+  using LayoutCacheType = std::map<LayoutCacheKey, std::vector<unsigned>>;
+
+  /// Layouts read from the cache file at the start of the pass.
+  LayoutCacheType LayoutCache;
+
+  /// Layouts used in this run that will be written back to the cache file.
+  LayoutCacheType UpdatedLayoutCache;
+  std::mutex UpdatedLayoutCacheMutex;
+
   void modifyFunctionLayout(BinaryFunction &Function,
                             LayoutType Type,
                             bool MinBranchClusters,
-                            bool Split) const;
+                            bool Split);
 
   /// Split function in two: a part with warm or hot BBs and a part with never
   /// executed BBs. The cold part is moved to a new BinaryFunction.
   void splitFunction(BinaryFunction &Function) const;
 
+  /// Make the hot blocks of innermost loops contiguous in \p Layout and
+  /// rotate each loop so that the most frequent edges become fall-throughs,
+  /// which places the exit test of a loop at its bottom.
+  void optimizeLoopLayout(BinaryFunction &Function,
+                          BinaryFunction::BasicBlockOrderType &Layout);
+
+  /// Compute a layout of \p BF with \p ComputeLayout for each candidate of
+  /// -profile-variants, and set \p Layout to the one to keep.
+  void chooseVariantLayout(
+      BinaryFunction &BF,
+      std::function<void(BinaryFunction::BasicBlockOrderType &)> ComputeLayout,
+      BinaryFunction::BasicBlockOrderType &Layout);
+
+  /// Return the cache key for the current layout of \p BF.
+  LayoutCacheKey getLayoutCacheKey(const BinaryFunction &BF, LayoutType Type,
+                                   bool MinBranchClusters) const;
+
+  /// Read/write block layouts from/to the file given with
+  /// -reorder-blocks-cache.
+  void readLayoutCache();
+  void writeLayoutCache() const;
+
   bool IsAArch64{false};
 
+  /// Statistics.
+  std::atomic<uint64_t> NumLoopsCompacted{0};
+  std::atomic<uint64_t> NumLoopsRotated{0};
+
+  /// Jump table targets moved by -indirect-target-layout, and the ExtTSP
+  /// scores of the layouts of their functions before and after the moves.
+  uint64_t NumIndirectTargetsMoved{0};
+  double IndirectTargetScoreBefore{0.0};
+  double IndirectTargetScoreAfter{0.0};
+  std::mutex IndirectTargetStatsMutex;
+
+  /// ExtTSP scores of the candidate layouts for -profile-variants under each
+  /// variant, summed over the functions, and how many times each candidate
+  /// was kept.
+  std::vector<std::vector<double>> VariantScores;
+  std::vector<uint64_t> VariantNumChosen;
+  std::mutex VariantStatsMutex;
+
 public:
   explicit ReorderBasicBlocks(const cl::opt<bool> &PrintPass)
     : BinaryFunctionPass(PrintPass) { }
@@ -194,6 +305,8 @@ public:
   const char *getName() const override {
     return "reordering";
   }
+  bool isFunctionLocal() const override { return true; }
+  bool supportsFunctionFilter() const override { return true; }
   bool shouldPrint(const BinaryFunction &BF) const override;
   void runOnFunctions(BinaryContext &BC,
                       std::map<uint64_t, BinaryFunction> &BFs,
@@ -209,6 +322,32 @@ class FixupBranches : public BinaryFunctionPass {
   const char *getName() const override {
     return "fix-branches";
   }
+  bool isFunctionLocal() const override { return true; }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+/// Make compare and conditional branch pairs adjacent for macro-op fusion.
+/// Instructions scheduled between the flags producer and the conditional
+/// branch are moved in front of the producer when they are independent of it.
+/// The emitter then keeps the fused pair from crossing a cache line boundary
+/// (see -align-macro-fusion).
+class MacroFusionFixup : public BinaryFunctionPass {
+  std::atomic<uint64_t> NumPairs{0};
+  std::atomic<uint64_t> PairsExecCount{0};
+
+  /// Return true if the pair in \p BB was made adjacent.
+  bool fixBlock(BinaryContext &BC, BinaryBasicBlock &BB);
+
+ public:
+  explicit MacroFusionFixup(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "macro-fusion-fixup";
+  }
+  bool isFunctionLocal() const override { return true; }
   void runOnFunctions(BinaryContext &BC,
                       std::map<uint64_t, BinaryFunction> &BFs,
                       std::set<uint64_t> &LargeFunctions) override;
@@ -224,6 +363,7 @@ class FinalizeFunctions : public BinaryFunctionPass {
   const char *getName() const override {
     return "finalize-functions";
   }
+  bool isFunctionLocal() const override { return true; }
   void runOnFunctions(BinaryContext &BC,
                       std::map<uint64_t, BinaryFunction> &BFs,
                       std::set<uint64_t> &LargeFunctions) override;
@@ -284,18 +424,22 @@ class LowerAnnotations : public BinaryFunctionPass {
 /// We assume that the target of the conditional branch is the
 /// first successor.
 class SimplifyConditionalTailCalls : public BinaryFunctionPass {
-  uint64_t NumCandidateTailCalls{0};
-  uint64_t NumTailCallsPatched{0};
-  uint64_t CTCExecCount{0};
-  uint64_t CTCTakenCount{0};
-  uint64_t NumOrigForwardBranches{0};
-  uint64_t NumOrigBackwardBranches{0};
-  uint64_t NumDoubleJumps{0};
-  uint64_t DeletedBlocks{0};
-  uint64_t DeletedBytes{0};
+  std::atomic<uint64_t> NumCandidateTailCalls{0};
+  std::atomic<uint64_t> NumTailCallsPatched{0};
+  std::atomic<uint64_t> CTCExecCount{0};
+  std::atomic<uint64_t> CTCTakenCount{0};
+  std::atomic<uint64_t> NumOrigForwardBranches{0};
+  std::atomic<uint64_t> NumOrigBackwardBranches{0};
+  std::atomic<uint64_t> NumDoubleJumps{0};
+  std::atomic<uint64_t> DeletedBlocks{0};
+  std::atomic<uint64_t> DeletedBytes{0};
   std::unordered_set<const BinaryFunction *> Modified;
   std::set<const BinaryBasicBlock *> BeenOptimized;
 
+  /// Protects Modified and BeenOptimized when functions are processed
+  /// concurrently.
+  std::mutex Mutex;
+
   bool shouldRewriteBranch(const BinaryBasicBlock *PredBB,
                            const MCInst &CondBranch,
                            const BinaryBasicBlock *BB,
@@ -309,6 +453,7 @@ class SimplifyConditionalTailCalls : public BinaryFunctionPass {
   const char *getName() const override {
     return "simplify-conditional-tail-calls";
   }
+  bool isFunctionLocal() const override { return true; }
   bool shouldPrint(const BinaryFunction &BF) const override {
     return BinaryFunctionPass::shouldPrint(BF) && Modified.count(&BF) > 0;
   }
@@ -319,10 +464,17 @@ class SimplifyConditionalTailCalls : public BinaryFunctionPass {
 
 /// Perform simple peephole optimizations.
 class Peepholes : public BinaryFunctionPass {
-  uint64_t NumShortened{0};
-  uint64_t NumDoubleJumps{0};
-  uint64_t TailCallTraps{0};
-  uint64_t NumUselessCondBranches{0};
+  std::atomic<uint64_t> NumShortened{0};
+  std::atomic<uint64_t> NumDoubleJumps{0};
+  std::atomic<uint64_t> TailCallTraps{0};
+  std::atomic<uint64_t> NumUselessCondBranches{0};
+
+  /// Peephole patterns of the target and the number of times each of them
+  /// was applied, statically and weighted by the profile.
+  std::vector<MCPlusBuilder::PeepholePattern> Patterns;
+  std::vector<uint64_t> PatternHits;
+  std::vector<uint64_t> PatternDynHits;
+  std::mutex PatternStatsMutex;
 
   /// Attempt to use the minimum operand width for arithmetic, branch and
   /// move instructions.
@@ -337,6 +489,9 @@ class Peepholes : public BinaryFunctionPass {
   /// successor is the same as the unconditional successor, we can
   /// remove the conditional successor and branch instruction.
   void removeUselessCondBranches(BinaryContext &BC, BinaryFunction &Function);
+
+  /// Apply the first matching target pattern to every instruction.
+  void applyPatterns(BinaryContext &BC, BinaryFunction &Function);
 public:
   explicit Peepholes(const cl::opt<bool> &PrintPass)
     : BinaryFunctionPass(PrintPass) { }
@@ -344,6 +499,7 @@ public:
   const char *getName() const override {
     return "peepholes";
   }
+  bool isFunctionLocal() const override { return true; }
   void runOnFunctions(BinaryContext &BC,
                       std::map<uint64_t, BinaryFunction> &BFs,
                       std::set<uint64_t> &LargeFunctions) override;
@@ -360,15 +516,34 @@ public:
 ///
 /// when the target address points somewhere inside a read-only section.
 ///
+/// On X86, constants are then tracked through registers with reaching
+/// definitions, so that loads from read-only tables at a known index, e.g.:
+///
+///     lea 0x2f0(%rip), %rcx
+///     mov $0x3, %eax
+///     mov (%rcx,%rax,4), %edx
+///
+/// are simplified as well, and conditional branches whose outcome follows
+/// from the constants are replaced with their only possible successor.
+///
 class SimplifyRODataLoads : public BinaryFunctionPass {
   uint64_t NumLoadsSimplified{0};
   uint64_t NumDynamicLoadsSimplified{0};
   uint64_t NumLoadsFound{0};
   uint64_t NumDynamicLoadsFound{0};
+  uint64_t NumIndexedLoadsSimplified{0};
+  uint64_t NumDynamicIndexedLoadsSimplified{0};
+  uint64_t NumBranchesFolded{0};
+  uint64_t NumDynamicBranchesFolded{0};
   std::unordered_set<const BinaryFunction *> Modified;
 
   bool simplifyRODataLoads(BinaryContext &BC, BinaryFunction &BF);
 
+  /// Simplify indexed loads from read-only data and fold conditional
+  /// branches using the constant values of registers in \p BF.
+  bool propagateConstants(BinaryContext &BC, BinaryFunction &BF,
+                          const RegAnalysis &RA);
+
 public:
   explicit SimplifyRODataLoads(const cl::opt<bool> &PrintPass)
     : BinaryFunctionPass(PrintPass) { }
@@ -394,6 +569,7 @@ class PrintProgramStats : public BinaryFunctionPass {
   const char *getName() const override {
     return "print-stats";
   }
+  bool preservesDataflowInfo() const override { return true; }
   bool shouldPrint(const BinaryFunction &) const override {
     return false;
   }
@@ -412,6 +588,7 @@ public:
   const char *getName() const override {
     return "inst-lowering";
   }
+  bool isFunctionLocal() const override { return true; }
 
   void runOnFunctions(BinaryContext &BC,
                       std::map<uint64_t, BinaryFunction> &BFs,
@@ -427,6 +604,7 @@ public:
   const char *getName() const override {
     return "strip-rep-ret";
   }
+  bool isFunctionLocal() const override { return true; }
 
   void runOnFunctions(BinaryContext &BC,
                       std::map<uint64_t, BinaryFunction> &BFs,
@@ -435,6 +613,12 @@ public:
 
 /// Pass for inlining calls to memcpy using 'rep movsb' on X86.
 class InlineMemcpy : public BinaryFunctionPass {
+  /// Return the size argument of the string function called by \p Call if
+  /// it is set to a constant in \p BB.
+  static ErrorOr<uint64_t> getConstantSize(BinaryContext &BC,
+                                           BinaryBasicBlock &BB,
+                                           BinaryBasicBlock::iterator Call);
+
 public:
   explicit InlineMemcpy(const cl::opt<bool> &PrintPass)
     : BinaryFunctionPass(PrintPass) {}
@@ -0,0 +1,297 @@
+//===--- Passes/CMOVConversion.cpp - Convert hammocks to conditional moves ===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "CMOVConversion.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/Options.h"
+
+#define DEBUG_TYPE "bolt-cmov"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool>
+CMOVConversionFlag("cmov-conversion",
+  cl::desc("convert hot, frequently mispredicted branches over register "
+           "moves into conditional moves (X86-only)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CMOVConversionMaxMoves("cmov-conversion-max-moves",
+  cl::desc("maximum number of conditional moves replacing a branch"),
+  cl::init(4),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CMOVConversionMinBalance("cmov-conversion-min-balance",
+  cl::desc("minimum percentage of executions of a branch going in its less "
+           "frequent direction"),
+  cl::init(10),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CMOVConversionMinCount("cmov-conversion-min-count",
+  cl::desc("minimum execution count of a branch to convert"),
+  cl::init(100),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CMOVConversionMinMispredict("cmov-conversion-min-mispredict",
+  cl::desc("minimum misprediction rate of a branch to convert, in percent"),
+  cl::init(20),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CMOVConversionMispredictPenalty("cmov-conversion-mispredict-penalty",
+  cl::desc("cost in cycles of a branch misprediction"),
+  cl::init(15),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+bool CMOVConversion::convertSideBlock(const BinaryContext &BC,
+                                      const BinaryBasicBlock &BB,
+                                      const MCInst &CondBranch,
+                                      bool Invert,
+                                      std::vector<MCInst> &Moves) const {
+  if (BB.isEntryPoint() || BB.isLandingPad() || BB.lp_size() ||
+      BB.throw_size())
+    return false;
+
+  const auto &SPAliases = BC.MIB->getAliases(BC.MIB->getStackPointer());
+  for (const auto &Inst : BB) {
+    if (BC.MIB->isUnconditionalBranch(Inst) && !BC.MIB->isTailCall(Inst))
+      continue;
+
+    MCPhysReg From, To;
+    if (!BC.MIB->isRegToRegMove(Inst, From, To) || SPAliases[To])
+      return false;
+
+    MCInst CMov = Inst;
+    if (!BC.MIB->convertMoveToConditionalMove(CMov, CondBranch, Invert))
+      return false;
+    Moves.emplace_back(std::move(CMov));
+  }
+
+  return true;
+}
+
+bool CMOVConversion::isProfitable(const BinaryContext &BC,
+                                  const BinaryBasicBlock &Head,
+                                  const BinaryBasicBlock *Taken,
+                                  const BinaryBasicBlock *NotTaken) const {
+  const auto &TakenBI = Head.getBranchInfo(true);
+  const auto &NotTakenBI = Head.getBranchInfo(false);
+  if (TakenBI.Count == BinaryBasicBlock::COUNT_NO_PROFILE ||
+      NotTakenBI.Count == BinaryBasicBlock::COUNT_NO_PROFILE)
+    return false;
+
+  const auto Count = TakenBI.Count + NotTakenBI.Count;
+  if (!Count || Count < opts::CMOVConversionMinCount)
+    return false;
+
+  const auto Mispreds =
+    TakenBI.MispredictedCount + NotTakenBI.MispredictedCount;
+  const auto MispredictRate = std::min(1.0, (double)Mispreds / Count);
+  if (MispredictRate * 100 < opts::CMOVConversionMinMispredict)
+    return false;
+
+  // A well-predicted direction would make the conversion a loss even if
+  // the branch is mispredicted often in the other direction.
+  const auto TakenRate = (double)TakenBI.Count / Count;
+  if (std::min(TakenRate, 1.0 - TakenRate) * 100 <
+      opts::CMOVConversionMinBalance)
+    return false;
+
+  // With the branch, only the moves of the path taken are executed, and
+  // they can start before the condition is known. Their latency is the
+  // length of the longest chain of moves depending on each other.
+  auto getPathLatency = [&](const BinaryBasicBlock *BB) {
+    unsigned Latency = 0;
+    if (!BB)
+      return Latency;
+    DenseMap<MCPhysReg, unsigned> Depth;
+    for (const auto &Inst : *BB) {
+      MCPhysReg From, To;
+      if (!BC.MIB->isRegToRegMove(Inst, From, To))
+        continue;
+      Depth[To] = Depth.lookup(From) + 1;
+      Latency = std::max(Latency, Depth[To]);
+    }
+    return Latency;
+  };
+
+  // Conditional moves of both paths are executed, each of them waits for
+  // the flags and for the previous value of its destination.
+  unsigned CMovLatency = 0;
+  DenseMap<MCPhysReg, unsigned> Depth;
+  for (const auto *BB : {Taken, NotTaken}) {
+    if (!BB)
+      continue;
+    for (const auto &Inst : *BB) {
+      MCPhysReg From, To;
+      if (!BC.MIB->isRegToRegMove(Inst, From, To))
+        continue;
+      Depth[To] = std::max(Depth.lookup(From), Depth.lookup(To)) + 1;
+      CMovLatency = std::max(CMovLatency, Depth[To]);
+    }
+  }
+  const double CMovCost = 1 + CMovLatency;
+
+  const double BranchCost =
+    MispredictRate * opts::CMOVConversionMispredictPenalty +
+    TakenRate * getPathLatency(Taken) +
+    (1.0 - TakenRate) * getPathLatency(NotTaken);
+
+  DEBUG(dbgs() << "BOLT-DEBUG: cmov candidate " << Head.getName() << " in "
+               << *Head.getFunction() << ": count " << Count
+               << ", mispredicts " << Mispreds << ", branch cost "
+               << BranchCost << ", cmov cost " << CMovCost << '\n');
+
+  return CMovCost < BranchCost;
+}
+
+bool CMOVConversion::convertHead(const BinaryContext &BC,
+                                 BinaryBasicBlock &Head) {
+  if (Head.succ_size() != 2)
+    return false;
+
+  auto *TakenSucc = Head.getConditionalSuccessor(true);
+  auto *NotTakenSucc = Head.getConditionalSuccessor(false);
+  if (TakenSucc == NotTakenSucc)
+    return false;
+
+  const MCSymbol *TBB = nullptr;
+  const MCSymbol *FBB = nullptr;
+  MCInst *CondBranch = nullptr;
+  MCInst *UncondBranch = nullptr;
+  if (!Head.analyzeBranch(TBB, FBB, CondBranch, UncondBranch) ||
+      !CondBranch || BC.MIB->getConditionalTailCall(*CondBranch))
+    return false;
+
+  auto isSide = [&](const BinaryBasicBlock *BB) {
+    return BB != &Head && BB->pred_size() == 1 && BB->succ_size() == 1;
+  };
+
+  // Find the shape of the hammock. Taken and NotTaken are the side blocks
+  // executed on each direction of the branch, if any.
+  BinaryBasicBlock *Taken = nullptr;
+  BinaryBasicBlock *NotTaken = nullptr;
+  BinaryBasicBlock *Join = nullptr;
+  if (isSide(TakenSucc) && TakenSucc->getSuccessor() == NotTakenSucc) {
+    Taken = TakenSucc;
+    Join = NotTakenSucc;
+  } else if (isSide(NotTakenSucc) &&
+             NotTakenSucc->getSuccessor() == TakenSucc) {
+    NotTaken = NotTakenSucc;
+    Join = TakenSucc;
+  } else if (isSide(TakenSucc) && isSide(NotTakenSucc) &&
+             TakenSucc->getSuccessor() == NotTakenSucc->getSuccessor()) {
+    Taken = TakenSucc;
+    NotTaken = NotTakenSucc;
+    Join = TakenSucc->getSuccessor();
+  } else {
+    return false;
+  }
+
+  if (Join == &Head)
+    return false;
+
+  std::vector<MCInst> CMovs;
+  if (Taken && !convertSideBlock(BC, *Taken, *CondBranch, false, CMovs))
+    return false;
+  if (NotTaken && !convertSideBlock(BC, *NotTaken, *CondBranch, true, CMovs))
+    return false;
+  if (CMovs.empty() || CMovs.size() > opts::CMOVConversionMaxMoves)
+    return false;
+
+  if (!isProfitable(BC, Head, Taken, NotTaken))
+    return false;
+
+  const auto &TakenBI = Head.getBranchInfo(true);
+  const auto &NotTakenBI = Head.getBranchInfo(false);
+  const auto Count = TakenBI.Count + NotTakenBI.Count;
+  const auto Mispreds =
+    TakenBI.MispredictedCount + NotTakenBI.MispredictedCount;
+
+  // A conditional move is a no-op when its condition is false, so the moves
+  // of both sides can follow each other without changing the result. The
+  // branch is the last user of the flags it reads.
+  if (UncondBranch)
+    Head.eraseInstruction(UncondBranch);
+  Head.eraseInstruction(CondBranch);
+  for (auto &CMov : CMovs)
+    Head.addInstruction(std::move(CMov));
+
+  Head.removeAllSuccessors();
+  Head.addSuccessor(Join, Count);
+  if (Taken)
+    Taken->markValid(false);
+  if (NotTaken)
+    NotTaken->markValid(false);
+
+  DEBUG(dbgs() << "BOLT-DEBUG: converted branch in " << Head.getName()
+               << " to " << CMovs.size() << " conditional moves\n");
+
+  ++NumConverted;
+  NumDynamicConverted += Count;
+  NumMispredictsRemoved += Mispreds;
+  NumCMovs += CMovs.size();
+  return true;
+}
+
+void CMOVConversion::runOnFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::set<uint64_t> &) {
+  if (!opts::CMOVConversionFlag || !BC.isX86())
+    return;
+
+  runOnEachFunction(
+      BFs,
+      [&](BinaryFunction &Function) {
+        bool Changed = false;
+        for (auto &BB : Function) {
+          if (BB.isValid())
+            Changed |= convertHead(BC, BB);
+        }
+        if (!Changed)
+          return;
+
+        Function.eraseInvalidBBs();
+        Function.fixBranches();
+      },
+      [&](const BinaryFunction &Function) {
+        return !shouldOptimize(Function) || !Function.hasValidProfile();
+      });
+
+  outs() << "BOLT-INFO: converted " << NumConverted << " branches ("
+         << NumDynamicConverted << " dynamic executions) into " << NumCMovs
+         << " conditional moves, removing " << NumMispredictsRemoved
+         << " mispredictions\n";
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,83 @@
+//===--- Passes/CMOVConversion.h - Convert hammocks to conditional moves --===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Replace hot conditional branches that the profile shows to be frequently
+// mispredicted with conditional moves. A candidate is a triangle or a diamond
+// whose side blocks only contain register moves:
+//
+//       Head                 Head
+//       /  \                /    \
+//    Side   |            Side1  Side2
+//       \  /                \    /
+//       Join                 Join
+//
+// The moves of the side blocks are turned into conditional moves at the end
+// of the head block, which then always continues to the join block. The
+// conversion is done when the expected cost of mispredictions of the branch
+// is higher than the latency added by the conditional moves.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_CMOV_CONVERSION_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_CMOV_CONVERSION_H
+
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "BinaryPasses.h"
+#include <atomic>
+
+namespace llvm {
+namespace bolt {
+
+class CMOVConversion : public BinaryFunctionPass {
+  /// Statistics.
+  std::atomic<uint64_t> NumConverted{0};
+  std::atomic<uint64_t> NumDynamicConverted{0};
+  std::atomic<uint64_t> NumMispredictsRemoved{0};
+  std::atomic<uint64_t> NumCMovs{0};
+
+  /// Return true if \p BB can be folded into the conditional moves of
+  /// its only predecessor, and append to \p Moves its moves converted to
+  /// happen on the condition of \p CondBranch, inverted if \p Invert is set.
+  bool convertSideBlock(const BinaryContext &BC,
+                        const BinaryBasicBlock &BB,
+                        const MCInst &CondBranch,
+                        bool Invert,
+                        std::vector<MCInst> &Moves) const;
+
+  /// Return true if it is profitable to replace the branch at the end of
+  /// \p Head with conditional moves, where \p Taken and \p NotTaken are
+  /// the side blocks executed on each direction of the branch, or null when
+  /// the branch goes straight to the join block.
+  bool isProfitable(const BinaryContext &BC,
+                    const BinaryBasicBlock &Head,
+                    const BinaryBasicBlock *Taken,
+                    const BinaryBasicBlock *NotTaken) const;
+
+  /// Convert the branch at the end of \p Head if it is a profitable
+  /// candidate. Return true if the CFG was changed.
+  bool convertHead(const BinaryContext &BC, BinaryBasicBlock &Head);
+
+public:
+  explicit CMOVConversion(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "cmov-conversion";
+  }
+  bool isFunctionLocal() const override { return true; }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
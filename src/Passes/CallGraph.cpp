@@ -10,6 +10,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "CallGraph.h"
+#include <algorithm>
 
 #define DEBUG_TYPE "callgraph"
 
@@ -77,31 +78,86 @@ CallGraph::NodeId CallGraph::addNode(uint32_t Size, uint64_t Samples) {
   return Id;
 }
 
-const CallGraph::Arc &CallGraph::incArcWeight(NodeId Src, NodeId Dst, double W,
-                                              double Offset) {
+void CallGraph::incArcWeight(NodeId Src, NodeId Dst, double W,
+                             double Offset) {
   assert(Offset <= size(Src) && "Call offset exceeds function size");
+  PendingArcs.push_back({Src, Dst, W, Offset});
+}
+
+void CallGraph::finalizeArcs() {
+  // Existing arcs take part in the merge like any other call. Their offset
+  // is still the weighted sum until normalizeArcWeights() is called.
+  std::vector<PendingArc> AllArcs;
+  AllArcs.reserve(Arcs.size() + PendingArcs.size());
+  for (const auto &A : Arcs)
+    AllArcs.push_back({A.Src, A.Dst, A.Weight, A.AvgCallOffset});
+  for (const auto &PA : PendingArcs)
+    AllArcs.push_back({PA.Src, PA.Dst, PA.Weight, PA.Offset * PA.Weight});
+  PendingArcs.clear();
+
+  // Keep the order of calls between the same nodes, so that the sums do not
+  // depend on the sort.
+  std::stable_sort(AllArcs.begin(), AllArcs.end(),
+                   [](const PendingArc &A, const PendingArc &B) {
+                     return A.Src < B.Src || (A.Src == B.Src && A.Dst < B.Dst);
+                   });
+
+  Arcs.clear();
+  Arcs.reserve(AllArcs.size());
+  for (const auto &PA : AllArcs) {
+    if (!Arcs.empty() && Arcs.back().Src == PA.Src &&
+        Arcs.back().Dst == PA.Dst) {
+      Arcs.back().Weight += PA.Weight;
+      Arcs.back().AvgCallOffset += PA.Offset;
+      continue;
+    }
+    Arcs.emplace_back(PA.Src, PA.Dst, PA.Weight);
+    Arcs.back().AvgCallOffset = PA.Offset;
+  }
+
+  const auto N = Nodes.size();
+  SuccBegin.assign(N + 1, 0);
+  PredBegin.assign(N + 1, 0);
+  Succs.resize(Arcs.size());
+  for (size_t I = 0; I < Arcs.size(); ++I) {
+    ++SuccBegin[Arcs[I].Src + 1];
+    ++PredBegin[Arcs[I].Dst + 1];
+    Succs[I] = Arcs[I].Dst;
+  }
+  for (size_t I = 0; I < N; ++I) {
+    SuccBegin[I + 1] += SuccBegin[I];
+    PredBegin[I + 1] += PredBegin[I];
+  }
 
-  auto Res = Arcs.emplace(Src, Dst, W);
-  if (!Res.second) {
-    Res.first->Weight += W;
-    Res.first->AvgCallOffset += Offset * W;
-    return *Res.first;
+  Preds.resize(Arcs.size());
+  PredArcs.resize(Arcs.size());
+  std::vector<size_t> Next(PredBegin.begin(), PredBegin.end() - 1);
+  for (size_t I = 0; I < Arcs.size(); ++I) {
+    const auto Pos = Next[Arcs[I].Dst]++;
+    Preds[Pos] = Arcs[I].Src;
+    PredArcs[Pos] = I;
   }
-  Res.first->AvgCallOffset = Offset * W;
-  Nodes[Src].Succs.push_back(Dst);
-  Nodes[Dst].Preds.push_back(Src);
-  return *Res.first;
+}
+
+size_t CallGraph::findArcIndex(NodeId Src, NodeId Dst) const {
+  assert(Src < Nodes.size() && isFinal());
+  const auto Begin = Succs.begin() + SuccBegin[Src];
+  const auto End = Succs.begin() + SuccBegin[Src + 1];
+  const auto Itr = std::lower_bound(Begin, End, Dst);
+  if (Itr == End || *Itr != Dst)
+    return Arcs.size();
+  return Itr - Succs.begin();
 }
 
 void CallGraph::normalizeArcWeights() {
   for (NodeId FuncId = 0; FuncId < numNodes(); ++FuncId) {
     auto& Func = getNode(FuncId);
-    for (auto Caller : Func.predecessors()) {
-      auto Arc = findArc(Caller, FuncId);
-      Arc->NormalizedWeight = Arc->weight() / Func.samples();
-      if (Arc->weight() > 0)
-        Arc->AvgCallOffset /= Arc->weight();
-      assert(Arc->AvgCallOffset <= size(Caller) &&
+    for (auto I = PredBegin[FuncId]; I < PredBegin[FuncId + 1]; ++I) {
+      auto &Arc = Arcs[PredArcs[I]];
+      Arc.NormalizedWeight = Arc.weight() / Func.samples();
+      if (Arc.weight() > 0)
+        Arc.AvgCallOffset /= Arc.weight();
+      assert(Arc.AvgCallOffset <= size(Preds[I]) &&
              "Avg call offset exceeds function size");
     }
   }
@@ -111,10 +167,8 @@ void CallGraph::adjustArcWeights() {
   for (NodeId FuncId = 0; FuncId < numNodes(); ++FuncId) {
     auto& Func = getNode(FuncId);
     uint64_t InWeight = 0;
-    for (auto Caller : Func.predecessors()) {
-      auto Arc = findArc(Caller, FuncId);
-      InWeight += (uint64_t)Arc->weight();
-    }
+    for (auto I = PredBegin[FuncId]; I < PredBegin[FuncId + 1]; ++I)
+      InWeight += (uint64_t)Arcs[PredArcs[I]].weight();
     if (Func.samples() < InWeight)
       setSamples(FuncId, InWeight);
   }
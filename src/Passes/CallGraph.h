@@ -12,6 +12,7 @@
 #ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_CALLGRAPH_H
 #define LLVM_TOOLS_LLVM_BOLT_PASSES_CALLGRAPH_H
 
+#include "llvm/ADT/ArrayRef.h"
 #include <cassert>
 #include <string>
 #include <unordered_set>
@@ -27,6 +28,13 @@ inline int64_t hashCombine(const int64_t Seed, const int64_t Val) {
 }
 
 /// A call graph class.
+///
+/// Arcs are built in two steps. incArcWeight() only records the call, and
+/// finalizeArcs() merges the calls between the same pair of nodes and stores
+/// the arcs in compressed sparse row form: the arcs out of a node are
+/// contiguous and sorted by destination, and the arcs into a node are listed
+/// by index. Arcs, successors and predecessors can only be queried once the
+/// arcs are final.
 class CallGraph {
 public:
   using NodeId = size_t;
@@ -60,6 +68,8 @@ public:
       , Weight(W)
     {}
     Arc(const Arc&) = delete;
+    Arc(Arc &&) = default;
+    Arc &operator=(Arc &&) = default;
 
     friend bool operator==(const Arc &Lhs, const Arc &Rhs) {
       return Lhs.Src == Rhs.Src && Lhs.Dst == Rhs.Dst;
@@ -80,7 +90,7 @@ public:
     mutable double AvgCallOffset{0};
   };
 
-  using ArcsType = std::unordered_set<Arc, Arc::Hash>;
+  using ArcsType = std::vector<Arc>;
   using ArcIterator = ArcsType::iterator;
   using ArcConstIterator = ArcsType::const_iterator;
 
@@ -93,21 +103,10 @@ public:
     uint32_t size() const { return Size; }
     uint64_t samples() const { return Samples; }
 
-    const std::vector<NodeId> &successors() const {
-      return Succs;
-    }
-    const std::vector<NodeId> &predecessors() const {
-      return Preds;
-    }
-
   private:
     friend class CallGraph;
     uint32_t Size;
     uint64_t Samples;
-
-    // preds and succs contain no duplicate elements and self arcs are not allowed
-    std::vector<NodeId> Preds;
-    std::vector<NodeId> Succs;
   };
 
   size_t numNodes() const {
@@ -125,24 +124,42 @@ public:
     assert(Id < Nodes.size());
     return Nodes[Id].Samples;
   }
-  const std::vector<NodeId> &successors(const NodeId Id) const {
-    assert(Id < Nodes.size());
-    return Nodes[Id].Succs;
+  /// Successors of \p Id with no duplicates, sorted by id.
+  ArrayRef<NodeId> successors(const NodeId Id) const {
+    assert(Id < Nodes.size() && isFinal());
+    return makeArrayRef(Succs.data() + SuccBegin[Id],
+                        SuccBegin[Id + 1] - SuccBegin[Id]);
   }
-  const std::vector<NodeId> &predecessors(const NodeId Id) const {
-    assert(Id < Nodes.size());
-    return Nodes[Id].Preds;
+  /// Predecessors of \p Id with no duplicates.
+  ArrayRef<NodeId> predecessors(const NodeId Id) const {
+    assert(Id < Nodes.size() && isFinal());
+    return makeArrayRef(Preds.data() + PredBegin[Id],
+                        PredBegin[Id + 1] - PredBegin[Id]);
   }
   NodeId addNode(uint32_t Size, uint64_t Samples = 0);
-  const Arc &incArcWeight(NodeId Src, NodeId Dst, double W = 1.0,
-                          double Offset = 0.0);
+
+  /// Record a call from \p Src to \p Dst with weight \p W at \p Offset
+  /// in \p Src. The call becomes part of the graph in finalizeArcs().
+  void incArcWeight(NodeId Src, NodeId Dst, double W = 1.0,
+                    double Offset = 0.0);
+
+  /// Merge the calls recorded since the last call into the arcs of the
+  /// graph and rebuild the adjacency arrays.
+  void finalizeArcs();
+
+  /// Return true if there are no recorded calls waiting for finalizeArcs().
+  bool isFinal() const {
+    return PendingArcs.empty() && SuccBegin.size() == Nodes.size() + 1;
+  }
+
   ArcIterator findArc(NodeId Src, NodeId Dst) {
-    return Arcs.find(Arc(Src, Dst));
+    return Arcs.begin() + findArcIndex(Src, Dst);
   }
   ArcConstIterator findArc(NodeId Src, NodeId Dst) const {
-    return Arcs.find(Arc(Src, Dst));
+    return Arcs.begin() + findArcIndex(Src, Dst);
   }
   iterator_range<ArcConstIterator> arcs() const {
+    assert(isFinal());
     return iterator_range<ArcConstIterator>(Arcs.begin(), Arcs.end());
   }
   iterator_range<std::vector<Node>::const_iterator> nodes() const {
@@ -168,8 +185,34 @@ private:
     Nodes[Id].Samples = Samples;
   }
 
+  /// Return the index of the arc from \p Src to \p Dst in Arcs, or the
+  /// number of arcs if there is no such arc.
+  size_t findArcIndex(NodeId Src, NodeId Dst) const;
+
+  /// A call recorded by incArcWeight().
+  struct PendingArc {
+    NodeId Src;
+    NodeId Dst;
+    double Weight;
+    double Offset;
+  };
+
   std::vector<Node> Nodes;
+
+  /// Arcs sorted by source, then by destination.
   ArcsType Arcs;
+
+  /// Arcs out of node I are Arcs[SuccBegin[I] .. SuccBegin[I + 1]), and
+  /// Succs holds their destinations.
+  std::vector<size_t> SuccBegin;
+  std::vector<NodeId> Succs;
+
+  /// Sources of the arcs into node I and the indices of these arcs.
+  std::vector<size_t> PredBegin;
+  std::vector<NodeId> Preds;
+  std::vector<size_t> PredArcs;
+
+  std::vector<PendingArc> PendingArcs;
 };
 
 template<class L>
@@ -190,7 +233,7 @@ void CallGraph::printDot(char* FileName, L GetLabel) const {
   }
   for (NodeId F = 0; F < Nodes.size(); F++) {
     if (Nodes[F].samples() == 0) continue;
-    for (auto Dst : Nodes[F].successors()) {
+    for (auto Dst : successors(F)) {
       auto Arc = findArc(F, Dst);
       fprintf(
               File,
@@ -1,6 +1,10 @@
 #include "CallGraphWalker.h"
+#include "ParallelUtilities.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
+#include <algorithm>
+#include <limits>
 
 namespace opts {
 extern llvm::cl::opt<bool> TimeOpts;
@@ -25,14 +29,116 @@ void CallGraphWalker::traverseCG() {
     Queue.pop();
     InQueue.erase(Func);
 
-    bool Changed{false};
-    for (auto Visitor : Visitors) {
-      bool CurVisit = Visitor(Func);
-      Changed = Changed || CurVisit;
+    if (visit(Func)) {
+      for (auto CallerID : CG.predecessors(CG.getNodeId(Func))) {
+        BinaryFunction *CallerFunc = CG.nodeIdToFunc(CallerID);
+        if (InQueue.count(CallerFunc))
+          continue;
+        Queue.push(CallerFunc);
+        InQueue.insert(CallerFunc);
+      }
+    }
+  }
+}
+
+void CallGraphWalker::traverseCGInParallel() {
+  NamedRegionTimer T1("CG Traversal", "CG Traversal", "CG breakdown",
+                      "CG breakdown", opts::TimeOpts);
+  using NodeId = CallGraph::NodeId;
+  const auto NumNodes = CG.numNodes();
+
+  // Find strongly connected components with Tarjan's algorithm. A component
+  // is completed only after all the components it calls, which lets us
+  // assign it a level one above the highest level of its callees.
+  const auto Unvisited = std::numeric_limits<unsigned>::max();
+  std::vector<unsigned> Index(NumNodes, Unvisited);
+  std::vector<unsigned> LowLink(NumNodes);
+  std::vector<bool> OnStack(NumNodes, false);
+  std::vector<unsigned> SCCOf(NumNodes);
+  std::vector<std::vector<NodeId>> SCCs;
+  std::vector<unsigned> SCCLevel;
+  std::vector<NodeId> Stack;
+  std::vector<std::pair<NodeId, unsigned>> DFSStack;
+  unsigned NextIndex = 0;
+  unsigned MaxLevel = 0;
+
+  auto enterNode = [&](NodeId Node) {
+    Index[Node] = LowLink[Node] = NextIndex++;
+    Stack.push_back(Node);
+    OnStack[Node] = true;
+    DFSStack.emplace_back(Node, 0);
+  };
+
+  for (NodeId Root = 0; Root < NumNodes; ++Root) {
+    if (Index[Root] != Unvisited)
+      continue;
+    enterNode(Root);
+    while (!DFSStack.empty()) {
+      const auto Node = DFSStack.back().first;
+      const auto &Succs = CG.successors(Node);
+      if (DFSStack.back().second < Succs.size()) {
+        const auto Succ = Succs[DFSStack.back().second++];
+        if (Index[Succ] == Unvisited)
+          enterNode(Succ);
+        else if (OnStack[Succ])
+          LowLink[Node] = std::min(LowLink[Node], Index[Succ]);
+        continue;
+      }
+
+      DFSStack.pop_back();
+      if (!DFSStack.empty()) {
+        const auto Parent = DFSStack.back().first;
+        LowLink[Parent] = std::min(LowLink[Parent], LowLink[Node]);
+      }
+      if (LowLink[Node] != Index[Node])
+        continue;
+
+      const unsigned SCCId = SCCs.size();
+      SCCs.emplace_back();
+      auto &SCC = SCCs.back();
+      NodeId Member;
+      do {
+        Member = Stack.back();
+        Stack.pop_back();
+        OnStack[Member] = false;
+        SCCOf[Member] = SCCId;
+        SCC.push_back(Member);
+      } while (Member != Node);
+
+      unsigned Level = 0;
+      for (const auto Member : SCC) {
+        for (const auto Succ : CG.successors(Member)) {
+          if (SCCOf[Succ] != SCCId)
+            Level = std::max(Level, SCCLevel[SCCOf[Succ]] + 1);
+        }
+      }
+      SCCLevel.push_back(Level);
+      MaxLevel = std::max(MaxLevel, Level);
+    }
+  }
+
+  // Visit the functions of a component until they converge. Callers outside
+  // of the component are on higher levels and will be visited later anyway.
+  auto processSCC = [&](unsigned SCCId) {
+    std::queue<BinaryFunction *> Queue;
+    std::set<BinaryFunction *> InQueue;
+    for (const auto Node : SCCs[SCCId]) {
+      auto *Func = CG.nodeIdToFunc(Node);
+      Queue.push(Func);
+      InQueue.insert(Func);
     }
 
-    if (Changed) {
+    while (!Queue.empty()) {
+      auto *Func = Queue.front();
+      Queue.pop();
+      InQueue.erase(Func);
+
+      if (!visit(Func))
+        continue;
+
       for (auto CallerID : CG.predecessors(CG.getNodeId(Func))) {
+        if (SCCOf[CallerID] != SCCId)
+          continue;
         BinaryFunction *CallerFunc = CG.nodeIdToFunc(CallerID);
         if (InQueue.count(CallerFunc))
           continue;
@@ -40,13 +146,75 @@ void CallGraphWalker::traverseCG() {
         InQueue.insert(CallerFunc);
       }
     }
+  };
+
+  auto getCost = [&](unsigned SCCId) {
+    uint64_t Cost = 0;
+    for (const auto Node : SCCs[SCCId])
+      Cost += CG.nodeIdToFunc(Node)->getInstructionCount() + 1;
+    return Cost;
+  };
+
+  std::vector<std::vector<unsigned>> Levels(MaxLevel + 1);
+  for (unsigned SCCId = 0; SCCId < SCCs.size(); ++SCCId)
+    Levels[SCCLevel[SCCId]].push_back(SCCId);
+
+  auto &ThPool = ParallelUtilities::getThreadPool();
+  const auto NumTasks = ParallelUtilities::getThreadCount() * 20;
+  for (const auto &Level : Levels) {
+    if (Level.size() == 1) {
+      processSCC(Level.front());
+      continue;
+    }
+
+    uint64_t TotalCost = 0;
+    for (const auto SCCId : Level)
+      TotalCost += getCost(SCCId);
+    const uint64_t BlockCost = std::max<uint64_t>(1, TotalCost / NumTasks);
+
+    auto runBlock = [&](size_t Begin, size_t End) {
+      for (auto I = Begin; I < End; ++I)
+        processSCC(Level[I]);
+    };
+
+    size_t BlockBegin = 0;
+    uint64_t CurrentCost = 0;
+    for (size_t I = 0; I < Level.size(); ++I) {
+      CurrentCost += getCost(Level[I]);
+      if (CurrentCost >= BlockCost) {
+        ThPool.async(runBlock, BlockBegin, I + 1);
+        BlockBegin = I + 1;
+        CurrentCost = 0;
+      }
+    }
+    if (BlockBegin < Level.size())
+      ThPool.async(runBlock, BlockBegin, Level.size());
+
+    ThPool.wait();
   }
 }
 
+bool CallGraphWalker::visit(BinaryFunction *Func) const {
+  bool Changed{false};
+  for (const auto &Visitor : Visitors) {
+    bool CurVisit = Visitor(Func);
+    Changed = Changed || CurVisit;
+  }
+  return Changed;
+}
+
 void CallGraphWalker::walk() {
   TopologicalCGOrder = CG.buildTraversalOrder();
   traverseCG();
 }
 
+void CallGraphWalker::walkInParallel() {
+  if (!ParallelUtilities::isParallel()) {
+    walk();
+    return;
+  }
+  traverseCGInParallel();
+}
+
 }
 }
@@ -40,6 +40,14 @@ class CallGraphWalker {
   /// Do the bottom-up traversal
   void traverseCG();
 
+  /// Do the bottom-up traversal one level of strongly connected components
+  /// at a time, processing the components of a level concurrently.
+  void traverseCGInParallel();
+
+  /// Call all visitors on \p Func. Return true if any of them reported a
+  /// change.
+  bool visit(BinaryFunction *Func) const;
+
 public:
   /// Initialize core context references but don't do anything yet
   CallGraphWalker(BinaryFunctionCallGraph &CG) : CG(CG) {}
@@ -55,6 +63,16 @@ public:
 
   /// Build the call graph, establish a traversal order and traverse it.
   void walk();
+
+  /// Traverse the call graph bottom-up using the shared thread pool. The
+  /// call graph is split into strongly connected components, and every
+  /// component is visited after all the components it calls have converged.
+  /// Components that do not call each other are visited concurrently, so
+  /// visitors must be safe to run at the same time for functions that are
+  /// not connected in the call graph. Only the callees of a function that
+  /// are part of the call graph are guaranteed to have been visited before
+  /// it. Falls back to walk() if BOLT runs on a single thread.
+  void walkInParallel();
 };
 
 }
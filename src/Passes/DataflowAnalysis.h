@@ -14,7 +14,11 @@
 
 #include "BinaryContext.h"
 #include "BinaryFunction.h"
+#include "CompactCFG.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/Support/Timer.h"
+#include <algorithm>
+#include <functional>
 #include <queue>
 
 namespace llvm {
@@ -165,8 +169,6 @@ class DataflowAnalysis {
     return *static_cast<const Derived*>(this);
   }
 
-  mutable Optional<unsigned> AnnotationIndex;
-
 protected:
   const BinaryContext &BC;
   /// Reference to the function being analysed
@@ -175,6 +177,9 @@ protected:
   /// Tracks the state at basic block start (end) if direction of the dataflow
   /// is forward (backward).
   std::unordered_map<const BinaryBasicBlock *, StateTy> StateAtBBEntry;
+  /// Tracks the state at the end (start) of each instruction, indexed by the
+  /// instruction id, if the direction of the dataflow is forward (backward).
+  MCPlus::AnnotationTable<StateTy> StateAtInst;
   /// Map a point to its previous (succeeding) point if the direction of the
   /// dataflow is forward (backward). This is used to support convenience
   /// methods to access the resulting state before (after) a given instruction,
@@ -229,22 +234,13 @@ protected:
     return StringRef("");
   }
 
-  unsigned getAnnotationIndex() const {
-    if (AnnotationIndex)
-      return *AnnotationIndex;
-    AnnotationIndex =
-      BC.MIB->getOrCreateAnnotationIndex(const_derived().getAnnotationName());
-    return *AnnotationIndex;
-  }
-
   /// Private getter methods accessing state in a read-write fashion
   StateTy &getOrCreateStateAt(const BinaryBasicBlock &BB) {
     return StateAtBBEntry[&BB];
   }
 
   StateTy &getOrCreateStateAt(MCInst &Point) {
-    return BC.MIB->getOrCreateAnnotationAs<StateTy>(
-        Point, derived().getAnnotationIndex());
+    return StateAtInst.getOrCreate(Func.getOrCreateInstructionId(Point));
   }
 
   StateTy &getOrCreateStateAt(ProgramPoint Point) {
@@ -253,6 +249,54 @@ protected:
     return getOrCreateStateAt(*Point.getInst());
   }
 
+  /// Fill \p Order with all blocks of the function in reverse post-order of
+  /// the CFG, including landing pad edges, if the direction of the dataflow is
+  /// forward, or in post-order if it is backward. Blocks unreachable from the
+  /// entry points are traversed after the reachable ones.
+  void computeTraversalOrder(std::vector<BinaryBasicBlock *> &Order) {
+    const CompactCFG CFG(Func, /*UseLayout=*/false);
+    std::vector<bool> Visited(CFG.size(), false);
+    std::vector<std::pair<uint32_t, unsigned>> Stack;
+    auto getNumSuccs = [&](uint32_t BB) -> unsigned {
+      return CFG.successors(BB).size() + CFG.landingPads(BB).size();
+    };
+    auto getSucc = [&](uint32_t BB, unsigned I) {
+      const auto Succs = CFG.successors(BB);
+      return I < Succs.size() ? Succs[I]
+                              : CFG.landingPads(BB)[I - Succs.size()];
+    };
+    auto visit = [&](uint32_t Root) {
+      if (Visited[Root])
+        return;
+      Visited[Root] = true;
+      Stack.emplace_back(Root, 0);
+      while (!Stack.empty()) {
+        const auto BB = Stack.back().first;
+        auto &NextSucc = Stack.back().second;
+        if (NextSucc == getNumSuccs(BB)) {
+          Order.push_back(CFG.getBlock(BB));
+          Stack.pop_back();
+          continue;
+        }
+        const auto Succ = getSucc(BB, NextSucc++);
+        if (!Visited[Succ]) {
+          Visited[Succ] = true;
+          Stack.emplace_back(Succ, 0);
+        }
+      }
+    };
+
+    for (uint32_t I = 0; I < CFG.size(); ++I) {
+      if (CFG.getBlock(I)->isEntryPoint())
+        visit(I);
+    }
+    for (uint32_t I = 0; I < CFG.size(); ++I)
+      visit(I);
+
+    if (!Backward)
+      std::reverse(Order.begin(), Order.end());
+  }
+
 public:
   /// If the direction of the dataflow is forward, operates on the last
   /// instruction of all predecessors when performing an iteration of the
@@ -285,8 +329,13 @@ public:
   /// Track the state at the end (start) of each MCInst in this function if
   /// the direction of the dataflow is forward (backward).
   ErrorOr<const StateTy &> getStateAt(const MCInst &Point) const {
-    return BC.MIB->tryGetAnnotationAs<StateTy>(
-        Point, const_derived().getAnnotationIndex());
+    const auto Id = BC.MIB->getInstructionId(Point);
+    if (!Id)
+      return make_error_code(errc::result_out_of_range);
+    const auto *State = StateAtInst.get(*Id);
+    if (!State)
+      return make_error_code(errc::result_out_of_range);
+    return *State;
   }
 
   /// Return the out set (in set) of a given program point if the direction of
@@ -310,13 +359,10 @@ public:
     return getStateAt(PrevPoint[Point.getInst()]);
   }
 
-  /// Remove any state annotations left by this analysis
+  /// Release the states computed by this analysis. Instruction ids stay
+  /// with the instructions for use by other analyses.
   void cleanAnnotations() {
-    for (auto &BB : Func) {
-      for (auto &Inst : BB) {
-        BC.MIB->removeAnnotation(Inst, derived().getAnnotationIndex());
-      }
-    }
+    StateAtInst.clear();
   }
 
   /// Public entry point that will perform the entire analysis form start to
@@ -324,6 +370,14 @@ public:
   void run() {
     derived().preflight();
 
+    // Number the instructions first, so that the table does not grow, and
+    // references to states stay valid, while the dataflow runs.
+    for (auto &BB : Func) {
+      for (auto &Inst : BB)
+        Func.getOrCreateInstructionId(Inst);
+    }
+    StateAtInst.reserve(Func.getNumInstructionIds());
+
     // Initialize state for all points of the function
     for (auto &BB : Func) {
       auto &St = getOrCreateStateAt(BB);
@@ -335,12 +389,30 @@ public:
     }
     assert(Func.begin() != Func.end() && "Unexpected empty function");
 
-    std::queue<BinaryBasicBlock *> Worklist;
-    // TODO: Pushing this in a DFS ordering will greatly speed up the dataflow
-    // performance.
+    // Blocks are processed in reverse post-order of the CFG if the direction
+    // of the dataflow is forward, and in post-order otherwise, so that most
+    // blocks are visited after the blocks they depend on. The worklist holds
+    // positions in this order and contains every block at most once.
+    std::vector<BinaryBasicBlock *> Order;
+    computeTraversalOrder(Order);
+    DenseMap<const BinaryBasicBlock *, unsigned> OrderIndex;
+    for (unsigned I = 0; I < Order.size(); ++I)
+      OrderIndex[Order[I]] = I;
+    std::priority_queue<unsigned, std::vector<unsigned>,
+                        std::greater<unsigned>> Worklist;
+    std::vector<bool> InWorklist(Order.size(), true);
+    for (unsigned I = 0; I < Order.size(); ++I)
+      Worklist.push(I);
+    auto addToWorklist = [&](const BinaryBasicBlock *BB) {
+      const auto I = OrderIndex[BB];
+      if (InWorklist[I])
+        return;
+      InWorklist[I] = true;
+      Worklist.push(I);
+    };
+
     if (!Backward) {
       for (auto &BB : Func) {
-        Worklist.push(&BB);
         MCInst *Prev = nullptr;
         for (auto &Inst : BB) {
           PrevPoint[&Inst] = Prev ? ProgramPoint(Prev) : ProgramPoint(&BB);
@@ -349,7 +421,6 @@ public:
       }
     } else {
       for (auto I = Func.rbegin(), E = Func.rend(); I != E; ++I) {
-        Worklist.push(&*I);
         MCInst *Prev = nullptr;
         for (auto J = (*I).rbegin(), E2 = (*I).rend(); J != E2; ++J) {
           auto &Inst = *J;
@@ -361,8 +432,10 @@ public:
 
     // Main dataflow loop
     while (!Worklist.empty()) {
-      auto *BB = Worklist.front();
+      const auto Index = Worklist.top();
       Worklist.pop();
+      InWorklist[Index] = false;
+      auto *BB = Order[Index];
 
       // Calculate state at the entry of first instruction in BB
       StateTy StateAtEntry = getOrCreateStateAt(*BB);
@@ -414,7 +487,7 @@ public:
 
         StateTy &St = getOrCreateStateAt(Inst);
         if (St != CurState) {
-          St = CurState;
+          St = std::move(CurState);
           if (&Inst == LAST)
             Changed = true;
         }
@@ -434,17 +507,17 @@ public:
       if (Changed) {
         if (!Backward) {
           for (auto Succ : BB->successors()) {
-            Worklist.push(Succ);
+            addToWorklist(Succ);
           }
           for (auto LandingPad : BB->landing_pads()) {
-            Worklist.push(LandingPad);
+            addToWorklist(LandingPad);
           }
         } else {
           for (auto Pred : BB->predecessors()) {
-            Worklist.push(Pred);
+            addToWorklist(Pred);
           }
           for (auto Thrower : BB->throwers()) {
-            Worklist.push(Thrower);
+            addToWorklist(Thrower);
           }
         }
       }
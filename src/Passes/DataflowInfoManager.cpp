@@ -10,7 +10,27 @@
 //===----------------------------------------------------------------------===//
 
 #include "DataflowInfoManager.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Support/CommandLine.h"
+#include <mutex>
+#include <unordered_map>
 
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool>
+CacheDataflowInfo("cache-dataflow-info",
+  cl::desc("reuse results of dataflow analyses across passes for functions "
+           "that did not change"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
 
 namespace llvm {
 namespace bolt {
@@ -170,5 +190,111 @@ void DataflowInfoManager::invalidateAll() {
   invalidateInsnToBBMap();
 }
 
+void DataflowInfoManager::resetRegAndFrameAnalyses(const RegAnalysis *NewRA,
+                                                   const FrameAnalysis *NewFA) {
+  if (RA == NewRA && FA == NewFA)
+    return;
+  invalidateReachingDefs();
+  invalidateReachingUses();
+  invalidateLivenessAnalysis();
+  invalidateStackReachingUses();
+  RA = NewRA;
+  FA = NewFA;
+}
+
+namespace DataflowInfoCache {
+
+namespace {
+
+struct Entry {
+  std::unique_ptr<DataflowInfoManager> Info;
+
+  /// Fingerprint of the function at the time the results were computed.
+  uint64_t Fingerprint{0};
+};
+
+std::unordered_map<const BinaryFunction *, Entry> Entries;
+
+/// Protects Entries when passes process functions in parallel. The entry of
+/// a function is only used by the thread working on that function.
+std::mutex EntriesMutex;
+
+/// Return a value that changes whenever the CFG or the instructions of \p BF
+/// do. Since analyses refer to instructions by address, moving an
+/// instruction counts as a change.
+uint64_t getFingerprint(const BinaryFunction &BF) {
+  hash_code Hash = hash_value(BF.size());
+  for (const auto &BB : BF) {
+    Hash = hash_combine(Hash, &BB, BB.size(), BB.succ_size(), BB.lp_size());
+    for (const auto *Succ : BB.successors())
+      Hash = hash_combine(Hash, Succ);
+    for (const auto *LP : BB.landing_pads())
+      Hash = hash_combine(Hash, LP);
+    for (const auto &Inst : BB) {
+      // Annotations, including the ones added by the analyses, don't count.
+      const auto NumOperands = MCPlus::getNumPrimeOperands(Inst);
+      Hash = hash_combine(Hash, &Inst, Inst.getOpcode(), NumOperands);
+      for (unsigned I = 0; I < NumOperands; ++I) {
+        const auto &Op = Inst.getOperand(I);
+        if (Op.isReg())
+          Hash = hash_combine(Hash, Op.getReg());
+        else if (Op.isImm())
+          Hash = hash_combine(Hash, Op.getImm());
+        else if (Op.isExpr())
+          Hash = hash_combine(Hash, Op.getExpr());
+      }
+    }
+  }
+  return Hash;
+}
+
+} // anonymous namespace
+
+DataflowInfoManager &get(const BinaryContext &BC, BinaryFunction &BF,
+                         const RegAnalysis *RA, const FrameAnalysis *FA) {
+  const auto Fingerprint = getFingerprint(BF);
+  std::unique_lock<std::mutex> Lock(EntriesMutex);
+  auto &E = Entries[&BF];
+  Lock.unlock();
+  if (!E.Info || E.Fingerprint != Fingerprint || !opts::CacheDataflowInfo) {
+    // Destroy the old manager first as it removes its annotations.
+    E.Info.reset();
+    E.Info = llvm::make_unique<DataflowInfoManager>(BC, BF, RA, FA);
+    E.Fingerprint = Fingerprint;
+    return *E.Info;
+  }
+
+  E.Info->resetRegAndFrameAnalyses(RA, FA);
+  return *E.Info;
+}
+
+void invalidate(const BinaryFunction &BF) {
+  std::lock_guard<std::mutex> Lock(EntriesMutex);
+  Entries.erase(&BF);
+}
+
+void finishPass(bool PreservesFunctions) {
+  if (!opts::CacheDataflowInfo) {
+    clear();
+    return;
+  }
+
+  for (auto I = Entries.begin(); I != Entries.end(); ) {
+    if (!PreservesFunctions &&
+        I->second.Fingerprint != getFingerprint(*I->first)) {
+      I = Entries.erase(I);
+      continue;
+    }
+    I->second.Info->resetRegAndFrameAnalyses();
+    ++I;
+  }
+}
+
+void clear() {
+  Entries.clear();
+}
+
+} // namespace DataflowInfoCache
+
 } // end namespace bolt
 } // end namespace llvm
@@ -81,8 +81,47 @@ public:
   std::unordered_map<const MCInst *, BinaryBasicBlock *> &getInsnToBBMap();
   void invalidateInsnToBBMap();
   void invalidateAll();
+
+  /// Use \p NewRA and \p NewFA for the analyses computed from now on,
+  /// dropping results that refer to the register or frame analysis given to
+  /// the manager before if those differ.
+  void resetRegAndFrameAnalyses(const RegAnalysis *NewRA = nullptr,
+                                const FrameAnalysis *NewFA = nullptr);
 };
 
+/// Keeps the DataflowInfoManager of every function across passes, so that a
+/// pass does not recompute dominators, stack pointer tracking and the rest
+/// of the analyses an earlier pass already computed for the same function.
+/// Results are dropped once the CFG or the instructions of the function
+/// change. Results of analyses that depend on a RegAnalysis or FrameAnalysis
+/// are dropped at the end of every pass since those are owned by the pass.
+///
+/// The cache is not thread-safe and must only be used by passes that process
+/// functions serially.
+namespace DataflowInfoCache {
+
+/// Return the manager of \p BF, reusing results computed by earlier passes
+/// if the function did not change since then. The manager stays valid until
+/// the end of the current pass. A pass that modifies \p BF while holding
+/// the manager is responsible for invalidating the affected results, as it
+/// is with a manager of its own.
+DataflowInfoManager &get(const BinaryContext &BC, BinaryFunction &BF,
+                         const RegAnalysis *RA, const FrameAnalysis *FA);
+
+/// Drop all results cached for \p BF.
+void invalidate(const BinaryFunction &BF);
+
+/// Called by the pass manager after every pass. Drop results that refer
+/// to pass-owned analyses and, unless \p PreservesFunctions is set, results
+/// of functions whose CFG or instructions were changed by the pass.
+void finishPass(bool PreservesFunctions);
+
+/// Drop all cached results.
+void clear();
+
+} // namespace DataflowInfoCache
+
+
 } // end namespace bolt
 } // end namespace llvm
 
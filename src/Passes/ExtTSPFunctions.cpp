@@ -0,0 +1,646 @@
+//===--- ExtTSPFunctions.cpp - Order functions by ExtTSP ------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Function-level version of the ExtTSP layout: hot functions are merged into
+// chains so that the calls between them and the corresponding returns are
+// short.
+//
+//===----------------------------------------------------------------------===//
+
+#include "HFSort.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Options.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <set>
+#include <vector>
+
+#undef  DEBUG_TYPE
+#define DEBUG_TYPE "hfsort"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<unsigned>
+ExtTSPFuncMaxDistance("ext-tsp-func-max-distance",
+  cl::desc("maximum distance (in bytes) of a call or a return contributing "
+           "to the score of function ordering by ext-tsp"),
+  cl::init(65536),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<double>
+ExtTSPFuncReturnWeight("ext-tsp-func-return-weight",
+  cl::desc("weight of returns relative to calls in the score of function "
+           "ordering by ext-tsp"),
+  cl::init(1.0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ExtTSPFuncSplitThreshold("ext-tsp-func-split-threshold",
+  cl::desc("maximum number of functions in a chain that ext-tsp function "
+           "ordering tries to split when merging it with another chain"),
+  cl::init(32),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+using NodeId = CallGraph::NodeId;
+
+namespace {
+
+class Func;
+class Chain;
+class ChainEdge;
+
+// A call between two hot functions with a positive weight
+struct Call {
+  Call(Func *Caller, Func *Callee, double Weight, double Offset)
+  : Caller(Caller), Callee(Callee), Weight(Weight), Offset(Offset) {}
+
+  Func *Caller;
+  Func *Callee;
+  double Weight;
+  // Average offset of the call sites from the beginning of the caller
+  double Offset;
+};
+
+using CallList = std::vector<Call *>;
+
+// A hot function participating in the layout
+class Func {
+public:
+  Func(NodeId Id, uint64_t Size, uint64_t Samples)
+  : Id(Id), Size(Size), Samples(Samples) {}
+
+  // The call graph node of the function
+  NodeId Id;
+  // Size of the function in bytes
+  uint64_t Size;
+  // Number of samples of the function
+  uint64_t Samples;
+  // The chain containing the function
+  Chain *CurChain{nullptr};
+  // Address of the function in the merged chain being evaluated
+  uint64_t EstimatedAddr{0};
+};
+
+// Ways of merging chain X with chain Y. If X is split, it is split into X1
+// and X2 at a given offset.
+enum class MergeType {
+  X_Y,
+  X1_Y_X2,
+  Y_X2_X1,
+  X2_Y_X1,
+  X2_X1_Y,
+};
+
+// The gain in ExtTSP score of merging two chains with a given merge type
+struct MergeGain {
+  MergeGain() = default;
+  MergeGain(double Score, size_t Offset, MergeType Type)
+  : Score(Score), Offset(Offset), Type(Type) {}
+
+  double Score{-1.0};
+  size_t Offset{0};
+  MergeType Type{MergeType::X_Y};
+};
+
+// A chain (ordered sequence) of functions
+class Chain {
+public:
+  Chain(size_t Id, Func *F)
+  : Id(Id),
+    Samples(F->Samples),
+    Size(F->Size),
+    Funcs(1, F) {}
+
+  double density() const {
+    return static_cast<double>(Samples) / Size;
+  }
+
+  ChainEdge *getEdge(const Chain *Other) const {
+    for (const auto &Edge : Edges) {
+      if (Edge.first == Other)
+        return Edge.second;
+    }
+    return nullptr;
+  }
+
+  void addEdge(Chain *Other, ChainEdge *Edge) {
+    Edges.emplace_back(Other, Edge);
+  }
+
+  void removeEdge(const Chain *Other) {
+    for (auto It = Edges.begin(); It != Edges.end(); ++It) {
+      if (It->first == Other) {
+        Edges.erase(It);
+        return;
+      }
+    }
+  }
+
+  /// Take the functions of \p Other and replace the order of functions with
+  /// \p MergedFuncs.
+  void merge(Chain *Other, std::vector<Func *> &&MergedFuncs) {
+    Funcs = std::move(MergedFuncs);
+    Samples += Other->Samples;
+    Size += Other->Size;
+    for (auto *F : Funcs)
+      F->CurChain = this;
+  }
+
+  /// Move the edges of \p Other to this chain.
+  void mergeEdges(Chain *Other);
+
+  void clear() {
+    Funcs.clear();
+    Funcs.shrink_to_fit();
+    Edges.clear();
+    Edges.shrink_to_fit();
+  }
+
+  // Unique id of the chain
+  size_t Id;
+  // Total number of samples of the functions in the chain
+  uint64_t Samples;
+  // Total size of the functions in the chain
+  uint64_t Size;
+  // ExtTSP score of the calls within the chain
+  double Score{0};
+  // Functions of the chain in their order
+  std::vector<Func *> Funcs;
+  // Adjacent chains and the corresponding edges. The edge to the chain itself
+  // keeps the calls within the chain.
+  std::vector<std::pair<Chain *, ChainEdge *>> Edges;
+};
+
+// An edge between two chains keeping all calls between them in either
+// direction. It also keeps the best gain of merging the chains, and the
+// chain that goes first in the corresponding merge.
+class ChainEdge {
+public:
+  explicit ChainEdge(Call *C)
+  : SrcChain(C->Caller->CurChain),
+    DstChain(C->Callee->CurChain),
+    Calls(1, C) {}
+
+  Chain *srcChain() const {
+    return SrcChain;
+  }
+
+  Chain *dstChain() const {
+    return DstChain;
+  }
+
+  const CallList &calls() const {
+    return Calls;
+  }
+
+  void changeEndpoint(Chain *From, Chain *To) {
+    if (From == SrcChain)
+      SrcChain = To;
+    if (From == DstChain)
+      DstChain = To;
+  }
+
+  void appendCall(Call *C) {
+    Calls.push_back(C);
+  }
+
+  void moveCalls(ChainEdge *Other) {
+    Calls.insert(Calls.end(), Other->Calls.begin(), Other->Calls.end());
+    Other->Calls.clear();
+    Other->Calls.shrink_to_fit();
+  }
+
+  const MergeGain &mergeGain() const {
+    return Gain;
+  }
+
+  Chain *predChain() const {
+    return PredChain;
+  }
+
+  void setMergeGain(const MergeGain &NewGain, Chain *Pred) {
+    Gain = NewGain;
+    PredChain = Pred;
+  }
+
+private:
+  Chain *SrcChain;
+  Chain *DstChain;
+  CallList Calls;
+  MergeGain Gain;
+  Chain *PredChain{nullptr};
+};
+
+void Chain::mergeEdges(Chain *Other) {
+  assert(this != Other && "cannot merge a chain with itself");
+
+  for (const auto &EdgeIt : Other->Edges) {
+    auto *DstChain = EdgeIt.first;
+    auto *DstEdge = EdgeIt.second;
+    auto *TargetChain = DstChain == Other ? this : DstChain;
+    auto *CurEdge = getEdge(TargetChain);
+    if (!CurEdge) {
+      DstEdge->changeEndpoint(Other, this);
+      addEdge(TargetChain, DstEdge);
+      if (DstChain != this && DstChain != Other)
+        DstChain->addEdge(this, DstEdge);
+    } else {
+      CurEdge->moveCalls(DstEdge);
+    }
+    if (DstChain != Other)
+      DstChain->removeEdge(Other);
+  }
+}
+
+using FuncIter = std::vector<Func *>::const_iterator;
+
+// A wrapper around three sequences of functions of the chains being merged;
+// it is used to avoid extra instantiation of the vectors.
+class MergedChain {
+public:
+  MergedChain(FuncIter Begin1, FuncIter End1,
+              FuncIter Begin2 = FuncIter(), FuncIter End2 = FuncIter(),
+              FuncIter Begin3 = FuncIter(), FuncIter End3 = FuncIter())
+  : Begin1(Begin1), End1(End1),
+    Begin2(Begin2), End2(End2),
+    Begin3(Begin3), End3(End3) {}
+
+  template<typename F>
+  void forEach(const F &Fn) const {
+    for (auto It = Begin1; It != End1; ++It)
+      Fn(*It);
+    for (auto It = Begin2; It != End2; ++It)
+      Fn(*It);
+    for (auto It = Begin3; It != End3; ++It)
+      Fn(*It);
+  }
+
+  std::vector<Func *> getFuncs() const {
+    std::vector<Func *> Result;
+    Result.reserve(std::distance(Begin1, End1) +
+                   std::distance(Begin2, End2) +
+                   std::distance(Begin3, End3));
+    Result.insert(Result.end(), Begin1, End1);
+    Result.insert(Result.end(), Begin2, End2);
+    Result.insert(Result.end(), Begin3, End3);
+    return Result;
+  }
+
+private:
+  FuncIter Begin1;
+  FuncIter End1;
+  FuncIter Begin2;
+  FuncIter End2;
+  FuncIter Begin3;
+  FuncIter End3;
+};
+
+/// Deterministically order edges by the gain of merging their chains in
+/// decreasing order.
+struct CompareEdges {
+  bool operator()(const ChainEdge *E1, const ChainEdge *E2) const {
+    const auto Score1 = E1->mergeGain().Score;
+    const auto Score2 = E2->mergeGain().Score;
+    if (Score1 != Score2)
+      return Score1 > Score2;
+
+    // Making the order deterministic
+    if (E1->srcChain()->Id != E2->srcChain()->Id)
+      return E1->srcChain()->Id < E2->srcChain()->Id;
+    return E1->dstChain()->Id < E2->dstChain()->Id;
+  }
+};
+
+/// Deterministically compare chains by their density in decreasing order
+bool compareChains(const Chain *C1, const Chain *C2) {
+  const double D1 = C1->density();
+  const double D2 = C2->density();
+  if (D1 != D2)
+    return D1 > D2;
+
+  // Making the order deterministic
+  return C1->Id < C2->Id;
+}
+
+/// The score of a control transfer of \p Weight from \p SrcAddr to
+/// \p DstAddr: it decreases linearly with the distance and it is zero for
+/// transfers longer than -ext-tsp-func-max-distance.
+double distanceScore(uint64_t SrcAddr, uint64_t DstAddr, double Weight) {
+  const auto Dist = SrcAddr > DstAddr ? SrcAddr - DstAddr : DstAddr - SrcAddr;
+  if (Dist >= opts::ExtTSPFuncMaxDistance)
+    return 0.0;
+  return Weight *
+    (1.0 - static_cast<double>(Dist) / opts::ExtTSPFuncMaxDistance);
+}
+
+/// ExtTSP for functions - ordering of hot functions that keeps the calls
+/// between them and the corresponding returns short.
+///
+/// The algorithm is the one used for ExtTSP block layout: starting with every
+/// hot function in its own chain, it repeatedly merges the pair of chains
+/// yielding the largest increase of the score, optionally splitting the first
+/// chain into two. Unlike the block layout, the best pair is kept in an
+/// ordered set of edges, and merging two chains only updates the gains of the
+/// edges adjacent to the merged chain, which scales to call graphs with tens
+/// of thousands of hot functions.
+class ExtTSPFunctions {
+public:
+  explicit ExtTSPFunctions(const CallGraph &Cg)
+  : Cg(Cg) {
+    initialize();
+  }
+
+  /// Run the algorithm and return clusters of functions in their order
+  std::vector<Cluster> run() {
+    mergeChainPairs();
+
+    // Sorting chains by density
+    std::stable_sort(Chains.begin(), Chains.end(), compareChains);
+
+    std::vector<Cluster> Clusters;
+    Clusters.reserve(Chains.size());
+    for (auto *C : Chains) {
+      const auto *Head = C->Funcs.front();
+      Clusters.emplace_back(Head->Id, Cg.getNode(Head->Id));
+      for (auto *F : C->Funcs) {
+        if (F != Head)
+          Clusters.back().merge(Cluster(F->Id, Cg.getNode(F->Id)));
+      }
+    }
+
+    return Clusters;
+  }
+
+private:
+  /// Initialize functions, calls, chains and edges between chains.
+  void initialize() {
+    // Initialize hot functions
+    std::vector<Func *> NodeToFunc(Cg.numNodes(), nullptr);
+    AllFuncs.reserve(Cg.numNodes());
+    for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+      if (Cg.samples(F) == 0)
+        continue;
+      AllFuncs.emplace_back(F, std::max(Cg.size(F), uint32_t(1)),
+                            Cg.samples(F));
+      NodeToFunc[F] = &AllFuncs.back();
+    }
+
+    // Initialize calls between the functions, ignoring recursive ones
+    for (auto &F : AllFuncs) {
+      for (const auto Dst : Cg.successors(F.Id)) {
+        auto *Callee = NodeToFunc[Dst];
+        if (!Callee || Callee == &F)
+          continue;
+        const auto &Arc = *Cg.findArc(F.Id, Dst);
+        if (Arc.weight() <= 0)
+          continue;
+        AllCalls.emplace_back(&F, Callee, Arc.weight(), Arc.avgCallOffset());
+      }
+    }
+
+    // Initialize chains
+    AllChains.reserve(AllFuncs.size());
+    Chains.reserve(AllFuncs.size());
+    for (auto &F : AllFuncs) {
+      AllChains.emplace_back(AllChains.size(), &F);
+      F.CurChain = &AllChains.back();
+      Chains.push_back(&AllChains.back());
+    }
+
+    // Initialize edges between the chains
+    AllEdges.reserve(AllCalls.size());
+    for (auto &C : AllCalls) {
+      auto *SrcChain = C.Caller->CurChain;
+      auto *DstChain = C.Callee->CurChain;
+      if (auto *Edge = SrcChain->getEdge(DstChain)) {
+        Edge->appendCall(&C);
+        continue;
+      }
+      AllEdges.emplace_back(&C);
+      SrcChain->addEdge(DstChain, &AllEdges.back());
+      DstChain->addEdge(SrcChain, &AllEdges.back());
+    }
+
+    DEBUG(dbgs() << "BOLT-DEBUG: ext-tsp function ordering: "
+                 << AllFuncs.size() << " hot functions, " << AllCalls.size()
+                 << " calls\n");
+  }
+
+  /// Merge pairs of chains while improving the ExtTSP metric
+  void mergeChainPairs() {
+    std::set<ChainEdge *, CompareEdges> Queue;
+    for (auto &Edge : AllEdges) {
+      updateMergeGain(&Edge);
+      if (Edge.mergeGain().Score > 0.0)
+        Queue.insert(&Edge);
+    }
+
+    while (!Queue.empty()) {
+      auto *BestEdge = *Queue.begin();
+      auto *Into = BestEdge->predChain();
+      auto *From = Into == BestEdge->srcChain() ? BestEdge->dstChain()
+                                                : BestEdge->srcChain();
+      const auto Gain = BestEdge->mergeGain();
+
+      // The gains of all edges adjacent to the two chains are going to change
+      for (const auto &EdgeIt : Into->Edges)
+        Queue.erase(EdgeIt.second);
+      for (const auto &EdgeIt : From->Edges)
+        Queue.erase(EdgeIt.second);
+
+      mergeChains(Into, From, Gain.Offset, Gain.Type);
+
+      for (const auto &EdgeIt : Into->Edges) {
+        if (EdgeIt.first == Into)
+          continue;
+        updateMergeGain(EdgeIt.second);
+        if (EdgeIt.second->mergeGain().Score > 0.0)
+          Queue.insert(EdgeIt.second);
+      }
+    }
+  }
+
+  /// Compute ExtTSP score of \p Calls and the corresponding returns for a
+  /// given order of functions
+  double score(const MergedChain &MergedFuncs, const CallList &Calls) const {
+    if (Calls.empty())
+      return 0.0;
+
+    uint64_t CurAddr = 0;
+    MergedFuncs.forEach([&](Func *F) {
+      F->EstimatedAddr = CurAddr;
+      CurAddr += F->Size;
+    });
+
+    double Score = 0;
+    for (const auto *C : Calls) {
+      const auto CallAddr =
+        C->Caller->EstimatedAddr + static_cast<uint64_t>(C->Offset);
+      const auto CalleeAddr = C->Callee->EstimatedAddr;
+      Score += distanceScore(CallAddr, CalleeAddr, C->Weight);
+      // Returns are assumed to be at the end of the callee
+      Score += opts::ExtTSPFuncReturnWeight *
+        distanceScore(CalleeAddr + C->Callee->Size, CallAddr, C->Weight);
+    }
+    return Score;
+  }
+
+  /// Store the best gain of merging the two chains of \p Edge in either order.
+  void updateMergeGain(ChainEdge *Edge) const {
+    auto *SrcChain = Edge->srcChain();
+    auto *DstChain = Edge->dstChain();
+    const auto ForwardGain = getBestMergeGain(SrcChain, DstChain, Edge);
+    const auto BackwardGain = getBestMergeGain(DstChain, SrcChain, Edge);
+    if (BackwardGain.Score > ForwardGain.Score)
+      Edge->setMergeGain(BackwardGain, DstChain);
+    else
+      Edge->setMergeGain(ForwardGain, SrcChain);
+  }
+
+  /// The best gain of merging \p ChainSucc into \p ChainPred, connected by
+  /// \p Edge.
+  ///
+  /// The function considers all possible ways of merging two chains and
+  /// returns the one having the largest increase in ExtTSP metric.
+  MergeGain getBestMergeGain(Chain *ChainPred, Chain *ChainSucc,
+                             ChainEdge *Edge) const {
+    // Calls that change their score when the chains are merged: the ones
+    // between the two chains and within each of them
+    auto Calls = Edge->calls();
+    if (auto *EdgePP = ChainPred->getEdge(ChainPred))
+      Calls.insert(Calls.end(), EdgePP->calls().begin(), EdgePP->calls().end());
+    if (auto *EdgeSS = ChainSucc->getEdge(ChainSucc))
+      Calls.insert(Calls.end(), EdgeSS->calls().begin(), EdgeSS->calls().end());
+
+    // The current score of two separate chains
+    const auto CurScore = ChainPred->Score + ChainSucc->Score;
+
+    MergeGain Gain;
+    auto tryMergeType = [&](size_t Offset, MergeType Type) {
+      auto MergedFuncs = mergeFuncs(ChainPred->Funcs, ChainSucc->Funcs,
+                                    Offset, Type);
+      const auto NewGain = score(MergedFuncs, Calls) - CurScore;
+      if (NewGain > Gain.Score)
+        Gain = MergeGain(NewGain, Offset, Type);
+    };
+
+    // Try to concatenate two chains w/o splitting
+    tryMergeType(0, MergeType::X_Y);
+
+    // Try to split ChainPred into two and merge with ChainSucc
+    if (ChainPred->Funcs.size() <= opts::ExtTSPFuncSplitThreshold) {
+      for (size_t Offset = 1; Offset < ChainPred->Funcs.size(); ++Offset) {
+        tryMergeType(Offset, MergeType::X1_Y_X2);
+        tryMergeType(Offset, MergeType::Y_X2_X1);
+        tryMergeType(Offset, MergeType::X2_Y_X1);
+        tryMergeType(Offset, MergeType::X2_X1_Y);
+      }
+    }
+
+    return Gain;
+  }
+
+  /// Merge two chains of functions according to a given merge type and
+  /// offset of splitting the first chain.
+  MergedChain mergeFuncs(const std::vector<Func *> &X,
+                         const std::vector<Func *> &Y,
+                         size_t Offset, MergeType Type) const {
+    // Merging w/o splitting existing chains
+    if (Type == MergeType::X_Y)
+      return MergedChain(X.begin(), X.end(), Y.begin(), Y.end());
+
+    assert(0 < Offset && Offset < X.size() &&
+           "invalid offset while merging chains");
+    // Split the first chain, X, into X1 and X2
+    FuncIter BeginX1 = X.begin();
+    FuncIter EndX1 = X.begin() + Offset;
+    FuncIter BeginX2 = X.begin() + Offset;
+    FuncIter EndX2 = X.end();
+    FuncIter BeginY = Y.begin();
+    FuncIter EndY = Y.end();
+
+    // Construct a new chain from three existing ones
+    switch (Type) {
+    case MergeType::X1_Y_X2:
+      return MergedChain(BeginX1, EndX1, BeginY, EndY, BeginX2, EndX2);
+    case MergeType::Y_X2_X1:
+      return MergedChain(BeginY, EndY, BeginX2, EndX2, BeginX1, EndX1);
+    case MergeType::X2_Y_X1:
+      return MergedChain(BeginX2, EndX2, BeginY, EndY, BeginX1, EndX1);
+    case MergeType::X2_X1_Y:
+      return MergedChain(BeginX2, EndX2, BeginX1, EndX1, BeginY, EndY);
+    default:
+      llvm_unreachable("unexpected merge type");
+    }
+  }
+
+  /// Merge chain From into chain Into, update the list of active chains and
+  /// the edges between chains.
+  void mergeChains(Chain *Into, Chain *From, size_t Offset, MergeType Type) {
+    assert(Into != From && "chain cannot be merged with itself");
+
+    // Merge the functions of chains
+    auto MergedFuncs = mergeFuncs(Into->Funcs, From->Funcs, Offset, Type);
+    Into->merge(From, MergedFuncs.getFuncs());
+    Into->mergeEdges(From);
+    From->clear();
+
+    // Update the score of the merged chain
+    if (auto *SelfEdge = Into->getEdge(Into)) {
+      Into->Score = score(MergedChain(Into->Funcs.begin(), Into->Funcs.end()),
+                          SelfEdge->calls());
+    }
+
+    // Remove chain From from the list of active chains
+    auto Iter = std::remove(Chains.begin(), Chains.end(), From);
+    Chains.erase(Iter, Chains.end());
+  }
+
+  // The call graph
+  const CallGraph &Cg;
+
+  // All hot functions
+  std::vector<Func> AllFuncs;
+
+  // All calls between the hot functions
+  std::vector<Call> AllCalls;
+
+  // All chains of functions
+  std::vector<Chain> AllChains;
+
+  // All edges between the chains
+  std::vector<ChainEdge> AllEdges;
+
+  // Active chains. The vector gets updated at runtime when chains are merged
+  std::vector<Chain *> Chains;
+};
+
+} // end namespace anonymous
+
+std::vector<Cluster> extTSPFunctions(const CallGraph &Cg) {
+  outs() << "BOLT-INFO: running ext-tsp function ordering for "
+         << Cg.numNodes() << " functions\n";
+  return ExtTSPFunctions(Cg).run();
+}
+
+} // namespace bolt
+} // namespace llvm
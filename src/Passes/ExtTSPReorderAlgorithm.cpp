@@ -0,0 +1,782 @@
+//===--- ExtTSPReorderAlgorithm.cpp - Order basic blocks ------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "BinaryBasicBlock.h"
+#include "BinaryFunction.h"
+#include "CacheMetrics.h"
+#include "ReorderAlgorithm.h"
+#include "llvm/Support/Options.h"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<unsigned>
+ExtTSPChainSplitThreshold("ext-tsp-chain-split-threshold",
+  cl::desc("maximum number of blocks in a chain that ext-tsp layout tries "
+           "to split when merging it with another chain"),
+  cl::init(128),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+class Block;
+class Chain;
+class ChainEdge;
+
+// A jump between two basic blocks with a positive execution count
+struct Jump {
+  Jump(Block *Source, Block *Target, uint64_t Count)
+  : Source(Source), Target(Target), Count(Count) {}
+
+  Block *Source;
+  Block *Target;
+  uint64_t Count;
+};
+
+using JumpList = std::vector<Jump *>;
+
+// A basic block participating in the layout
+class Block {
+public:
+  Block(BinaryBasicBlock *BB, uint64_t Size, uint64_t ExecutionCount)
+  : BB(BB),
+    Index(BB->getLayoutIndex()),
+    Size(Size),
+    ExecutionCount(ExecutionCount) {}
+
+  bool isEntry() const {
+    return Index == 0;
+  }
+
+  // The original basic block
+  BinaryBasicBlock *BB;
+  // Index of the block in the original layout
+  size_t Index;
+  // Estimated size of the block in bytes
+  uint64_t Size;
+  // Execution count of the block
+  uint64_t ExecutionCount;
+  // The chain containing the block
+  Chain *CurChain{nullptr};
+  // Address of the block in the merged chain being evaluated
+  uint64_t EstimatedAddr{0};
+  // A block that has to immediately follow this one in the final layout
+  Block *ForcedSucc{nullptr};
+  // A block that has to immediately precede this one in the final layout
+  Block *ForcedPred{nullptr};
+  // Outgoing jumps of the block
+  JumpList OutJumps;
+};
+
+// Ways of merging chain X with chain Y. If X is split, it is split into X1
+// and X2 at a given offset.
+enum class MergeType {
+  X_Y,
+  X1_Y_X2,
+  Y_X2_X1,
+  X2_Y_X1,
+  X2_X1_Y,
+};
+
+// The gain in ExtTSP score of merging two chains with a given merge type
+struct MergeGain {
+  MergeGain() = default;
+  MergeGain(double Score, size_t Offset, MergeType Type)
+  : Score(Score), Offset(Offset), Type(Type) {}
+
+  double Score{-1.0};
+  size_t Offset{0};
+  MergeType Type{MergeType::X_Y};
+};
+
+// A chain (ordered sequence) of basic blocks
+class Chain {
+public:
+  Chain(size_t Id, Block *B)
+  : Id(Id),
+    ExecutionCount(B->ExecutionCount),
+    Size(B->Size),
+    Blocks(1, B) {}
+
+  bool isEntry() const {
+    return Blocks[0]->isEntry();
+  }
+
+  double density() const {
+    return static_cast<double>(ExecutionCount) / Size;
+  }
+
+  ChainEdge *getEdge(const Chain *Other) const {
+    for (const auto &Edge : Edges) {
+      if (Edge.first == Other)
+        return Edge.second;
+    }
+    return nullptr;
+  }
+
+  void addEdge(Chain *Other, ChainEdge *Edge) {
+    Edges.emplace_back(Other, Edge);
+  }
+
+  void removeEdge(const Chain *Other) {
+    for (auto It = Edges.begin(); It != Edges.end(); ++It) {
+      if (It->first == Other) {
+        Edges.erase(It);
+        return;
+      }
+    }
+  }
+
+  /// Take the blocks of \p Other and replace the order of blocks with
+  /// \p MergedBlocks.
+  void merge(Chain *Other, std::vector<Block *> &&MergedBlocks) {
+    Blocks = std::move(MergedBlocks);
+    ExecutionCount += Other->ExecutionCount;
+    Size += Other->Size;
+    for (auto *B : Blocks)
+      B->CurChain = this;
+  }
+
+  /// Move the edges of \p Other to this chain.
+  void mergeEdges(Chain *Other);
+
+  void clear() {
+    Blocks.clear();
+    Blocks.shrink_to_fit();
+    Edges.clear();
+    Edges.shrink_to_fit();
+  }
+
+  // Unique id of the chain
+  size_t Id;
+  // Total execution count of the blocks in the chain
+  uint64_t ExecutionCount;
+  // Total size of the blocks in the chain
+  uint64_t Size;
+  // ExtTSP score of the jumps within the chain
+  double Score{0};
+  // Blocks of the chain in their order
+  std::vector<Block *> Blocks;
+  // Adjacent chains and the corresponding edges. The edge to the chain itself
+  // keeps the jumps within the chain.
+  std::vector<std::pair<Chain *, ChainEdge *>> Edges;
+};
+
+// An edge between two chains keeping all jumps between them in either
+// direction. It also caches merge gains for both orders of the chains.
+class ChainEdge {
+public:
+  explicit ChainEdge(Jump *J)
+  : SrcChain(J->Source->CurChain),
+    DstChain(J->Target->CurChain),
+    Jumps(1, J) {}
+
+  const JumpList &jumps() const {
+    return Jumps;
+  }
+
+  void changeEndpoint(Chain *From, Chain *To) {
+    if (From == SrcChain)
+      SrcChain = To;
+    if (From == DstChain)
+      DstChain = To;
+  }
+
+  void appendJump(Jump *J) {
+    Jumps.push_back(J);
+  }
+
+  void moveJumps(ChainEdge *Other) {
+    Jumps.insert(Jumps.end(), Other->Jumps.begin(), Other->Jumps.end());
+    Other->Jumps.clear();
+    Other->Jumps.shrink_to_fit();
+  }
+
+  bool hasCachedMergeGain(const Chain *Src) const {
+    return Src == SrcChain ? CacheValidForward : CacheValidBackward;
+  }
+
+  MergeGain getCachedMergeGain(const Chain *Src) const {
+    return Src == SrcChain ? CachedGainForward : CachedGainBackward;
+  }
+
+  void setCachedMergeGain(const Chain *Src, const MergeGain &Gain) {
+    if (Src == SrcChain) {
+      CachedGainForward = Gain;
+      CacheValidForward = true;
+    } else {
+      CachedGainBackward = Gain;
+      CacheValidBackward = true;
+    }
+  }
+
+  void invalidateCache() {
+    CacheValidForward = false;
+    CacheValidBackward = false;
+  }
+
+private:
+  Chain *SrcChain;
+  Chain *DstChain;
+  JumpList Jumps;
+  MergeGain CachedGainForward;
+  MergeGain CachedGainBackward;
+  bool CacheValidForward{false};
+  bool CacheValidBackward{false};
+};
+
+void Chain::mergeEdges(Chain *Other) {
+  assert(this != Other && "cannot merge a chain with itself");
+
+  for (const auto &EdgeIt : Other->Edges) {
+    auto *DstChain = EdgeIt.first;
+    auto *DstEdge = EdgeIt.second;
+    auto *TargetChain = DstChain == Other ? this : DstChain;
+    auto *CurEdge = getEdge(TargetChain);
+    if (!CurEdge) {
+      DstEdge->changeEndpoint(Other, this);
+      addEdge(TargetChain, DstEdge);
+      if (DstChain != this && DstChain != Other)
+        DstChain->addEdge(this, DstEdge);
+    } else {
+      CurEdge->moveJumps(DstEdge);
+    }
+    if (DstChain != Other)
+      DstChain->removeEdge(Other);
+  }
+}
+
+using BlockIter = std::vector<Block *>::const_iterator;
+
+// A wrapper around three sequences of blocks of the chains being merged; it
+// is used to avoid extra instantiation of the vectors.
+class MergedChain {
+public:
+  MergedChain(BlockIter Begin1, BlockIter End1,
+              BlockIter Begin2 = BlockIter(), BlockIter End2 = BlockIter(),
+              BlockIter Begin3 = BlockIter(), BlockIter End3 = BlockIter())
+  : Begin1(Begin1), End1(End1),
+    Begin2(Begin2), End2(End2),
+    Begin3(Begin3), End3(End3) {}
+
+  template<typename F>
+  void forEach(const F &Func) const {
+    for (auto It = Begin1; It != End1; ++It)
+      Func(*It);
+    for (auto It = Begin2; It != End2; ++It)
+      Func(*It);
+    for (auto It = Begin3; It != End3; ++It)
+      Func(*It);
+  }
+
+  std::vector<Block *> getBlocks() const {
+    std::vector<Block *> Result;
+    Result.reserve(std::distance(Begin1, End1) +
+                   std::distance(Begin2, End2) +
+                   std::distance(Begin3, End3));
+    Result.insert(Result.end(), Begin1, End1);
+    Result.insert(Result.end(), Begin2, End2);
+    Result.insert(Result.end(), Begin3, End3);
+    return Result;
+  }
+
+  const Block *getFirstBlock() const {
+    return *Begin1;
+  }
+
+private:
+  BlockIter Begin1;
+  BlockIter End1;
+  BlockIter Begin2;
+  BlockIter End2;
+  BlockIter Begin3;
+  BlockIter End3;
+};
+
+/// Deterministically compare chains by their density in decreasing order
+bool compareChains(const Chain *C1, const Chain *C2) {
+  // Original entry point to the front
+  if (C1->isEntry() != C2->isEntry())
+    return C1->isEntry();
+
+  const double D1 = C1->density();
+  const double D2 = C2->density();
+  if (D1 != D2)
+    return D1 > D2;
+
+  // Making the order deterministic
+  return C1->Id < C2->Id;
+}
+
+/// Deterministically compare pairs of chains
+bool compareChainPairs(const Chain *A1, const Chain *B1,
+                       const Chain *A2, const Chain *B2) {
+  const auto Samples1 = A1->ExecutionCount + B1->ExecutionCount;
+  const auto Samples2 = A2->ExecutionCount + B2->ExecutionCount;
+  if (Samples1 != Samples2)
+    return Samples1 < Samples2;
+
+  // Making the order deterministic
+  if (A1 != A2)
+    return A1->Id < A2->Id;
+  return B1->Id < B2->Id;
+}
+
+} // end namespace anonymous
+
+/// ExtTSP - layout of basic blocks maximizing the ExtTSP metric.
+///
+/// The algorithm follows the greedy scheme of CachePlus: starting with every
+/// block in its own chain, it repeatedly merges the pair of chains yielding
+/// the largest increase of ExtTSP, optionally splitting the first chain into
+/// two. The difference is in how the merge gains are maintained, so that the
+/// algorithm scales to functions with thousands of blocks:
+///
+///   * chains are connected by edges that collect all jumps between them, and
+///     the gain of merging two chains is computed only from the jumps between
+///     and within the two chains;
+///   * gains are cached on the edges, and merging two chains invalidates only
+///     the gains of the edges adjacent to the merged chain;
+///   * chain splitting is limited to chains with at most
+///     -ext-tsp-chain-split-threshold blocks.
+class ExtTSP {
+public:
+  explicit ExtTSP(const BinaryFunction &BF)
+  : BF(BF) {
+    initialize();
+  }
+
+  /// Run the algorithm and return a basic block ordering
+  std::vector<BinaryBasicBlock *> run() {
+    // Pass 1: Merge blocks with their fallthrough successors
+    mergeForcedPairs();
+
+    // Pass 2: Merge pairs of chains while improving the ExtTSP metric
+    mergeChainPairs();
+
+    // Pass 3: Merge cold blocks to reduce code size
+    mergeColdChains();
+
+    // Sorting chains by density
+    std::stable_sort(Chains.begin(), Chains.end(), compareChains);
+
+    // Collect the basic blocks in the order specified by their chains
+    std::vector<BinaryBasicBlock *> Result;
+    Result.reserve(BF.layout_size());
+    for (auto *C : Chains) {
+      for (auto *B : C->Blocks)
+        Result.push_back(B->BB);
+    }
+
+    return Result;
+  }
+
+private:
+  /// Initialize blocks, jumps, chains and edges between chains.
+  void initialize() {
+    BF.updateLayoutIndices();
+
+    // Compute total in/out weights of the blocks
+    auto InWeight = std::vector<uint64_t>(BF.layout_size(), 0);
+    auto OutWeight = std::vector<uint64_t>(BF.layout_size(), 0);
+    size_t NumJumps = 0;
+    for (auto *BB : BF.layout()) {
+      auto BI = BB->branch_info_begin();
+      for (auto *SuccBB : BB->successors()) {
+        assert(BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
+               "missing profile for a jump");
+        if (SuccBB != BB && BI->Count > 0) {
+          InWeight[SuccBB->getLayoutIndex()] += BI->Count;
+          OutWeight[BB->getLayoutIndex()] += BI->Count;
+          ++NumJumps;
+        }
+        ++BI;
+      }
+    }
+
+    // Initialize blocks. The execution count of a block is the maximum over
+    // the sums of its in and out edge weights. The execution count of the
+    // entry point is set to at least 1.
+    AllBlocks.reserve(BF.layout_size());
+    for (auto *BB : BF.layout()) {
+      const auto Index = BB->getLayoutIndex();
+      uint64_t EC = BB->getKnownExecutionCount();
+      EC = std::max(EC, InWeight[Index]);
+      EC = std::max(EC, OutWeight[Index]);
+      if (Index == 0)
+        EC = std::max(EC, uint64_t(1));
+      AllBlocks.emplace_back(BB, std::max(BB->estimateSize(), size_t(1)), EC);
+    }
+
+    // Initialize jumps between the blocks
+    AllJumps.reserve(NumJumps);
+    for (auto *BB : BF.layout()) {
+      auto &Source = AllBlocks[BB->getLayoutIndex()];
+      auto BI = BB->branch_info_begin();
+      for (auto *SuccBB : BB->successors()) {
+        if (SuccBB != BB && BI->Count > 0) {
+          AllJumps.emplace_back(&Source, &AllBlocks[SuccBB->getLayoutIndex()],
+                                BI->Count);
+          Source.OutJumps.push_back(&AllJumps.back());
+        }
+        ++BI;
+      }
+    }
+
+    // Initialize chains
+    AllChains.reserve(BF.layout_size());
+    Chains.reserve(BF.layout_size());
+    for (auto &B : AllBlocks) {
+      AllChains.emplace_back(B.Index, &B);
+      B.CurChain = &AllChains.back();
+      Chains.push_back(&AllChains.back());
+    }
+
+    // Initialize edges between the chains
+    AllEdges.reserve(AllJumps.size());
+    for (auto &J : AllJumps) {
+      auto *SrcChain = J.Source->CurChain;
+      auto *DstChain = J.Target->CurChain;
+      if (auto *Edge = SrcChain->getEdge(DstChain)) {
+        Edge->appendJump(&J);
+        continue;
+      }
+      AllEdges.emplace_back(&J);
+      SrcChain->addEdge(DstChain, &AllEdges.back());
+      DstChain->addEdge(SrcChain, &AllEdges.back());
+    }
+
+    findForcedPairs(InWeight, OutWeight);
+  }
+
+  /// For a pair of blocks, A and B, block B is the forced successor of A,
+  /// if (i) all jumps (based on profile) from A goes to B and (ii) all jumps
+  /// to B are from A. Such blocks should be adjacent in an optimal ordering.
+  void findForcedPairs(const std::vector<uint64_t> &InWeight,
+                       const std::vector<uint64_t> &OutWeight) {
+    for (auto *BB : BF.layout()) {
+      auto &B = AllBlocks[BB->getLayoutIndex()];
+      if (BB->succ_size() == 1 &&
+          BB->getSuccessor()->pred_size() == 1 &&
+          BB->getSuccessor()->getLayoutIndex() != 0) {
+        auto &SuccB = AllBlocks[BB->getSuccessor()->getLayoutIndex()];
+        B.ForcedSucc = &SuccB;
+        SuccB.ForcedPred = &B;
+        continue;
+      }
+
+      if (OutWeight[B.Index] == 0)
+        continue;
+      for (auto *J : B.OutJumps) {
+        // Successor cannot be the first block, which is pinned
+        if (OutWeight[B.Index] == J->Count &&
+            InWeight[J->Target->Index] == J->Count &&
+            !J->Target->isEntry()) {
+          B.ForcedSucc = J->Target;
+          J->Target->ForcedPred = &B;
+          break;
+        }
+      }
+    }
+
+    // There might be 'cycles' in the forced dependencies (since profile data
+    // isn't 100% accurate). Break the cycles by choosing the block with the
+    // smallest index as the tail.
+    for (auto &B : AllBlocks) {
+      if (!B.ForcedSucc || !B.ForcedPred)
+        continue;
+
+      auto *SuccB = B.ForcedSucc;
+      while (SuccB && SuccB != &B)
+        SuccB = SuccB->ForcedSucc;
+      if (!SuccB)
+        continue;
+      B.ForcedPred->ForcedSucc = nullptr;
+      B.ForcedPred = nullptr;
+    }
+  }
+
+  /// Merge blocks with their forced successors.
+  void mergeForcedPairs() {
+    for (auto &B : AllBlocks) {
+      if (B.ForcedPred || !B.ForcedSucc)
+        continue;
+
+      auto *CurB = &B;
+      while (CurB->ForcedSucc) {
+        auto *NextB = CurB->ForcedSucc;
+        mergeChains(B.CurChain, NextB->CurChain, 0, MergeType::X_Y);
+        CurB = NextB;
+      }
+    }
+  }
+
+  /// Merge pairs of chains while improving the ExtTSP metric
+  void mergeChainPairs() {
+    while (Chains.size() > 1) {
+      Chain *BestChainPred = nullptr;
+      Chain *BestChainSucc = nullptr;
+      MergeGain BestGain;
+      for (auto *ChainPred : Chains) {
+        for (const auto &EdgeIt : ChainPred->Edges) {
+          auto *ChainSucc = EdgeIt.first;
+          if (ChainSucc == ChainPred)
+            continue;
+
+          // Compute the gain of merging two chains
+          const auto Gain = getBestMergeGain(ChainPred, ChainSucc,
+                                             EdgeIt.second);
+          if (Gain.Score <= 0.0)
+            continue;
+
+          // Breaking ties by density to make the hottest chains be merged
+          // first
+          if (Gain.Score > BestGain.Score ||
+              (std::abs(Gain.Score - BestGain.Score) < 1e-8 &&
+               compareChainPairs(ChainPred, ChainSucc,
+                                 BestChainPred, BestChainSucc))) {
+            BestGain = Gain;
+            BestChainPred = ChainPred;
+            BestChainSucc = ChainSucc;
+          }
+        }
+      }
+
+      // Stop merging when there is no improvement
+      if (BestGain.Score <= 0.0)
+        break;
+
+      // Merge the best pair of chains
+      mergeChains(BestChainPred, BestChainSucc, BestGain.Offset,
+                  BestGain.Type);
+    }
+  }
+
+  /// Merge cold blocks to reduce code size
+  void mergeColdChains() {
+    for (auto *SrcBB : BF.layout()) {
+      // Iterating in reverse order to make sure original fall-trough jumps are
+      // merged first
+      auto &SrcB = AllBlocks[SrcBB->getLayoutIndex()];
+      for (auto Itr = SrcBB->succ_rbegin(); Itr != SrcBB->succ_rend(); ++Itr) {
+        auto &DstB = AllBlocks[(*Itr)->getLayoutIndex()];
+        auto *SrcChain = SrcB.CurChain;
+        auto *DstChain = DstB.CurChain;
+        if (SrcChain != DstChain && !DstChain->isEntry() &&
+            SrcChain->Blocks.back() == &SrcB &&
+            DstChain->Blocks.front() == &DstB) {
+          mergeChains(SrcChain, DstChain, 0, MergeType::X_Y);
+        }
+      }
+    }
+  }
+
+  /// Compute ExtTSP score of \p Jumps for a given order of blocks
+  double score(const MergedChain &MergedBlocks, const JumpList &Jumps) const {
+    if (Jumps.empty())
+      return 0.0;
+
+    uint64_t CurAddr = 0;
+    MergedBlocks.forEach([&](Block *B) {
+      B->EstimatedAddr = CurAddr;
+      CurAddr += B->Size;
+    });
+
+    double Score = 0;
+    for (const auto *J : Jumps) {
+      Score += CacheMetrics::extTSPScore(J->Source->EstimatedAddr,
+                                         J->Source->Size,
+                                         J->Target->EstimatedAddr,
+                                         J->Count);
+    }
+    return Score;
+  }
+
+  /// The best gain of merging \p ChainSucc into \p ChainPred, connected by
+  /// \p Edge.
+  ///
+  /// The function considers all possible ways of merging two chains and
+  /// returns the one having the largest increase in ExtTSP metric.
+  MergeGain getBestMergeGain(Chain *ChainPred, Chain *ChainSucc,
+                             ChainEdge *Edge) const {
+    if (Edge->hasCachedMergeGain(ChainPred))
+      return Edge->getCachedMergeGain(ChainPred);
+
+    // Jumps that change their score when the chains are merged: the ones
+    // between the two chains and within each of them
+    auto Jumps = Edge->jumps();
+    if (auto *EdgePP = ChainPred->getEdge(ChainPred))
+      Jumps.insert(Jumps.end(), EdgePP->jumps().begin(), EdgePP->jumps().end());
+    if (auto *EdgeSS = ChainSucc->getEdge(ChainSucc))
+      Jumps.insert(Jumps.end(), EdgeSS->jumps().begin(), EdgeSS->jumps().end());
+
+    // The current score of two separate chains
+    const auto CurScore = ChainPred->Score + ChainSucc->Score;
+
+    MergeGain Gain;
+    auto tryMergeType = [&](size_t Offset, MergeType Type) {
+      auto MergedBlocks = mergeBlocks(ChainPred->Blocks, ChainSucc->Blocks,
+                                      Offset, Type);
+      // Does the new chain preserve the original entry point?
+      if ((ChainPred->isEntry() || ChainSucc->isEntry()) &&
+          !MergedBlocks.getFirstBlock()->isEntry())
+        return;
+
+      const auto NewGain = score(MergedBlocks, Jumps) - CurScore;
+      if (NewGain > Gain.Score)
+        Gain = MergeGain(NewGain, Offset, Type);
+    };
+
+    // Try to concatenate two chains w/o splitting
+    tryMergeType(0, MergeType::X_Y);
+
+    // Try to split ChainPred into two and merge with ChainSucc
+    if (ChainPred->Blocks.size() <= opts::ExtTSPChainSplitThreshold) {
+      for (size_t Offset = 1; Offset < ChainPred->Blocks.size(); ++Offset) {
+        // Make sure the splitting does not break forced successors
+        const auto *B = ChainPred->Blocks[Offset - 1];
+        if (B->ForcedSucc) {
+          assert(B->ForcedSucc == ChainPred->Blocks[Offset] &&
+                 "forced successor is not adjacent");
+          continue;
+        }
+
+        tryMergeType(Offset, MergeType::X1_Y_X2);
+        tryMergeType(Offset, MergeType::Y_X2_X1);
+        tryMergeType(Offset, MergeType::X2_Y_X1);
+        tryMergeType(Offset, MergeType::X2_X1_Y);
+      }
+    }
+
+    Edge->setCachedMergeGain(ChainPred, Gain);
+    return Gain;
+  }
+
+  /// Merge two chains of blocks according to a given merge type and offset
+  /// of splitting the first chain.
+  MergedChain mergeBlocks(const std::vector<Block *> &X,
+                          const std::vector<Block *> &Y,
+                          size_t Offset, MergeType Type) const {
+    // Merging w/o splitting existing chains
+    if (Type == MergeType::X_Y)
+      return MergedChain(X.begin(), X.end(), Y.begin(), Y.end());
+
+    assert(0 < Offset && Offset < X.size() &&
+           "invalid offset while merging chains");
+    // Split the first chain, X, into X1 and X2
+    BlockIter BeginX1 = X.begin();
+    BlockIter EndX1 = X.begin() + Offset;
+    BlockIter BeginX2 = X.begin() + Offset;
+    BlockIter EndX2 = X.end();
+    BlockIter BeginY = Y.begin();
+    BlockIter EndY = Y.end();
+
+    // Construct a new chain from three existing ones
+    switch (Type) {
+    case MergeType::X1_Y_X2:
+      return MergedChain(BeginX1, EndX1, BeginY, EndY, BeginX2, EndX2);
+    case MergeType::Y_X2_X1:
+      return MergedChain(BeginY, EndY, BeginX2, EndX2, BeginX1, EndX1);
+    case MergeType::X2_Y_X1:
+      return MergedChain(BeginX2, EndX2, BeginY, EndY, BeginX1, EndX1);
+    case MergeType::X2_X1_Y:
+      return MergedChain(BeginX2, EndX2, BeginX1, EndX1, BeginY, EndY);
+    default:
+      llvm_unreachable("unexpected merge type");
+    }
+  }
+
+  /// Merge chain From into chain Into, update the list of active chains,
+  /// the edges between chains and invalidate cached gains of the edges
+  /// adjacent to the merged chain.
+  void mergeChains(Chain *Into, Chain *From, size_t Offset, MergeType Type) {
+    assert(Into != From && "chain cannot be merged with itself");
+
+    // Merge the blocks of chains
+    auto MergedBlocks = mergeBlocks(Into->Blocks, From->Blocks, Offset, Type);
+    Into->merge(From, MergedBlocks.getBlocks());
+    Into->mergeEdges(From);
+    From->clear();
+
+    // Update the score of the merged chain
+    if (auto *SelfEdge = Into->getEdge(Into)) {
+      Into->Score = score(MergedChain(Into->Blocks.begin(), Into->Blocks.end()),
+                          SelfEdge->jumps());
+    }
+
+    // Remove chain From from the list of active chains
+    auto Iter = std::remove(Chains.begin(), Chains.end(), From);
+    Chains.erase(Iter, Chains.end());
+
+    // Invalidate caches
+    for (const auto &EdgeIt : Into->Edges)
+      EdgeIt.second->invalidateCache();
+  }
+
+  // The binary function
+  const BinaryFunction &BF;
+
+  // All blocks of the function
+  std::vector<Block> AllBlocks;
+
+  // All jumps between the blocks
+  std::vector<Jump> AllJumps;
+
+  // All chains of blocks
+  std::vector<Chain> AllChains;
+
+  // All edges between the chains
+  std::vector<ChainEdge> AllEdges;
+
+  // Active chains. The vector gets updated at runtime when chains are merged
+  std::vector<Chain *> Chains;
+};
+
+void ExtTSPReorderAlgorithm::reorderBasicBlocks(
+      const BinaryFunction &BF, BasicBlockOrder &Order) const {
+  if (BF.layout_empty())
+    return;
+
+  // Are there jumps with positive execution count?
+  size_t NumHotBlocks = 0;
+  for (auto *BB : BF.layout()) {
+    if (BB->getKnownExecutionCount() > 0)
+      NumHotBlocks++;
+  }
+
+  // Do not change layout of functions w/o profile information
+  if (NumHotBlocks == 0 || BF.layout_size() <= 1) {
+    for (auto *BB : BF.layout()) {
+      Order.push_back(BB);
+    }
+    return;
+  }
+
+  // Apply the algorithm
+  Order = ExtTSP(BF).run();
+
+  // Verify correctness
+  assert(Order[0]->isEntryPoint() && "Original entry point is not preserved");
+  assert(Order.size() == BF.layout_size() && "Wrong size of reordered layout");
+}
+
+} // namespace bolt
+} // namespace llvm
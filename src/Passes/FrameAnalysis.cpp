@@ -10,6 +10,8 @@
 //===----------------------------------------------------------------------===//
 #include "FrameAnalysis.h"
 #include "CallGraphWalker.h"
+#include "DataflowInfoManager.h"
+#include "ParallelUtilities.h"
 #include <fstream>
 
 #define DEBUG_TYPE "fa"
@@ -85,7 +87,7 @@ namespace {
 class FrameAccessAnalysis {
   /// We depend on Stack Pointer Tracking to figure out the current SP offset
   /// value at a given program point
-  StackPointerTracking SPT;
+  StackPointerTracking &SPT;
   /// Context vars
   const BinaryContext &BC;
   const BinaryFunction &BF;
@@ -150,14 +152,9 @@ class FrameAccessAnalysis {
   }
 
 public:
-  FrameAccessAnalysis(const BinaryContext &BC, BinaryFunction &BF)
-      : SPT(BC, BF), BC(BC), BF(BF) {
-    {
-      NamedRegionTimer T1("SPT", "Stack Pointer Tracking", "Dataflow",
-                          "Dataflow", opts::TimeOpts);
-      SPT.run();
-    }
-  }
+  FrameAccessAnalysis(const BinaryContext &BC, BinaryFunction &BF,
+                      StackPointerTracking &SPT)
+      : SPT(SPT), BC(BC), BF(BF) {}
 
   void enterNewBB() { Prev = nullptr; }
   const FrameIndexEntry &getFIE() const { return FIE; }
@@ -282,6 +279,35 @@ FrameAnalysis::getFIEFor(const MCInst &Inst) const {
   return make_error_code(errc::result_out_of_range);
 }
 
+void FrameAnalysis::preComputeSPT() {
+  // Create the entries first so that threads only write to their own.
+  for (auto &I : BFs) {
+    if (I.second.isSimple() && I.second.hasCFG())
+      SPTMap[&I.second] = nullptr;
+  }
+
+  NamedRegionTimer T1("SPT", "Stack Pointer Tracking", "Dataflow",
+                      "Dataflow", opts::TimeOpts);
+  ParallelUtilities::runOnEachFunction(
+      BFs, ParallelUtilities::SP_INST_LINEAR,
+      [&](BinaryFunction &BF) {
+        auto &Info = DataflowInfoCache::get(BC, BF, nullptr, nullptr);
+        SPTMap.find(&BF)->second = &Info.getStackPointerTracking();
+      },
+      [&](const BinaryFunction &BF) {
+        return !SPTMap.count(&BF);
+      },
+      "preComputeSPT");
+}
+
+StackPointerTracking &FrameAnalysis::getSPT(BinaryFunction &BF) {
+  auto *SPT = SPTMap.lookup(&BF);
+  if (SPT)
+    return *SPT;
+  return DataflowInfoCache::get(BC, BF, nullptr, nullptr)
+      .getStackPointerTracking();
+}
+
 void FrameAnalysis::traverseCG(BinaryFunctionCallGraph &CG) {
   CallGraphWalker CGWalker(CG);
 
@@ -289,7 +315,7 @@ void FrameAnalysis::traverseCG(BinaryFunctionCallGraph &CG) {
     return computeArgsAccessed(*Func);
   });
 
-  CGWalker.walk();
+  CGWalker.walkInParallel();
 
   DEBUG_WITH_TYPE("ra",
     for (auto &MapEntry : ArgsTouchedMap) {
@@ -380,6 +406,7 @@ bool FrameAnalysis::updateArgsTouchedFor(const BinaryFunction &BF, MCInst &Inst,
 
 bool FrameAnalysis::computeArgsAccessed(BinaryFunction &BF) {
   if (!BF.isSimple() || !BF.hasCFG()) {
+    std::lock_guard<std::mutex> Lock(Mutex);
     DEBUG(dbgs() << "Treating " << BF.getPrintName() << " conservatively.\n");
     ArgsTouchedMap[&BF].emplace(std::make_pair(-1, 0));
     if (!FunctionsRequireAlignment.count(&BF)) {
@@ -393,7 +420,11 @@ bool FrameAnalysis::computeArgsAccessed(BinaryFunction &BF) {
                << "\n");
   bool UpdatedArgsTouched = false;
   bool NoInfo = false;
-  FrameAccessAnalysis FAA(BC, BF);
+  FrameAccessAnalysis FAA(BC, BF, getSPT(BF));
+
+  // Stack pointer tracking is done by now. Serialize the rest as it updates
+  // data shared with other functions.
+  std::lock_guard<std::mutex> Lock(Mutex);
 
   for (auto BB : BF.layout()) {
     FAA.enterNewBB();
@@ -452,7 +483,15 @@ bool FrameAnalysis::computeArgsAccessed(BinaryFunction &BF) {
 }
 
 bool FrameAnalysis::restoreFrameIndex(BinaryFunction &BF) {
-  FrameAccessAnalysis FAA(BC, BF);
+  FrameAccessAnalysis FAA(BC, BF, getSPT(BF));
+
+  // Entries are added to the shared vector once the function is processed.
+  std::vector<std::pair<MCInst *, FrameIndexEntry>> FIEs;
+  auto addFIEs = [&]() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &InstFIE : FIEs)
+      addFIEFor(*InstFIE.first, InstFIE.second);
+  };
 
   DEBUG(dbgs() << "Restoring frame indices for \"" << BF.getPrintName()
                << "\"\n");
@@ -461,8 +500,10 @@ bool FrameAnalysis::restoreFrameIndex(BinaryFunction &BF) {
     FAA.enterNewBB();
 
     for (auto &Inst : *BB) {
-      if (!FAA.doNext(*BB, Inst))
+      if (!FAA.doNext(*BB, Inst)) {
+        addFIEs();
         return false;
+      }
       DEBUG({
         dbgs() << "\t\tNow at ";
         Inst.dump();
@@ -474,13 +515,14 @@ bool FrameAnalysis::restoreFrameIndex(BinaryFunction &BF) {
 
       const FrameIndexEntry &FIE = FAA.getFIE();
 
-      addFIEFor(Inst, FIE);
+      FIEs.emplace_back(&Inst, FIE);
       DEBUG({
         dbgs() << "Frame index annotation " << FIE << " added to:\n";
         BC.printInstruction(dbgs(), Inst, 0, &BF, true);
       });
     }
   }
+  addFIEs();
   return true;
 }
 
@@ -503,8 +545,14 @@ FrameAnalysis::FrameAnalysis(BinaryContext &BC,
   // everything".
   ArgAccessesVector.emplace_back(ArgAccesses(/*AssumeEverything*/ true));
 
+  // Every function is visited several times while traversing the call graph,
+  // and once more to restore frame indices, so stack pointer tracking is
+  // computed upfront.
+  preComputeSPT();
+
   traverseCG(CG);
 
+  DenseSet<const BinaryFunction *> FunctionsToRestore;
   for (auto &I : BFs) {
     auto Count = I.second.getExecutionCount();
     if (Count != BinaryFunction::COUNT_NO_PROFILE)
@@ -520,19 +568,32 @@ FrameAnalysis::FrameAnalysis(BinaryContext &BC,
       continue;
     }
 
-    {
-      NamedRegionTimer T1("restorefi", "restore frame index", "FOP",
-                          "FOP breakdown", opts::TimeOpts);
-      if (!restoreFrameIndex(I.second)) {
-        ++NumFunctionsFailedRestoreFI;
-        auto Count = I.second.getExecutionCount();
-        if (Count != BinaryFunction::COUNT_NO_PROFILE)
-          CountFunctionsFailedRestoreFI += Count;
-        continue;
-      }
-    }
-    AnalyzedFunctions.insert(&I.second);
+    FunctionsToRestore.insert(&I.second);
   }
+
+  NamedRegionTimer T1("restorefi", "restore frame index", "FOP",
+                      "FOP breakdown", opts::TimeOpts);
+  ParallelUtilities::runOnEachFunction(
+      BFs, ParallelUtilities::SP_INST_LINEAR,
+      [&](BinaryFunction &BF) {
+        const bool Restored = restoreFrameIndex(BF);
+        std::lock_guard<std::mutex> Lock(Mutex);
+        if (!Restored) {
+          ++NumFunctionsFailedRestoreFI;
+          auto Count = BF.getExecutionCount();
+          if (Count != BinaryFunction::COUNT_NO_PROFILE)
+            CountFunctionsFailedRestoreFI += Count;
+          return;
+        }
+        AnalyzedFunctions.insert(&BF);
+      },
+      [&](const BinaryFunction &BF) {
+        return !FunctionsToRestore.count(&BF);
+      },
+      "restoreFrameIndex");
+
+  // The cache drops the results of functions modified from now on.
+  SPTMap.clear();
 }
 
 void FrameAnalysis::printStats() {
@@ -15,6 +15,7 @@
 #include "BinaryFunctionCallGraph.h"
 #include "BinaryPasses.h"
 #include "StackPointerTracking.h"
+#include <mutex>
 
 namespace llvm {
 namespace bolt {
@@ -133,6 +134,14 @@ class FrameAnalysis {
   /// Same for FrameIndexEntries.
   std::vector<FrameIndexEntry> FIEVector;
 
+  /// Protects the state above while functions are analyzed in parallel.
+  std::mutex Mutex;
+
+  /// Stack pointer tracking of every function, computed once before the
+  /// analysis and kept by DataflowInfoCache for the passes that run after
+  /// it. Only used while the analysis is built.
+  DenseMap<const BinaryFunction *, StackPointerTracking *> SPTMap;
+
   /// Analysis stats counters
   uint64_t NumFunctionsNotOptimized{0};
   uint64_t NumFunctionsFailedRestoreFI{0};
@@ -146,6 +155,13 @@ class FrameAnalysis {
   void addArgInStackAccessFor(MCInst &Inst, const ArgInStackAccess &Arg);
   void addFIEFor(MCInst &Inst, const FrameIndexEntry &FIE);
 
+  /// Run stack pointer tracking on all functions in parallel, populating
+  /// SPTMap.
+  void preComputeSPT();
+
+  /// Return stack pointer tracking of \p BF.
+  StackPointerTracking &getSPT(BinaryFunction &BF);
+
   /// Perform the step of building the set of registers clobbered by each
   /// function execution, populating RegsKilledMap and RegsGenMap.
   void traverseCG(BinaryFunctionCallGraph &CG);
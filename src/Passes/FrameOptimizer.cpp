@@ -10,10 +10,12 @@
 //===----------------------------------------------------------------------===//
 
 #include "FrameOptimizer.h"
+#include "ParallelUtilities.h"
 #include "ShrinkWrapping.h"
 #include "StackAvailableExpressions.h"
 #include "StackReachingUses.h"
 #include "llvm/Support/Timer.h"
+#include <mutex>
 #include <queue>
 #include <unordered_map>
 
@@ -47,6 +49,14 @@ RemoveStores("frame-opt-rm-stores",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+RemoveSpills("frame-opt-rm-spills",
+  cl::desc("remove stores whose reloads were all replaced by the value kept "
+           "in a register, typically spills around calls to functions that "
+           "do not clobber that register"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
 
 } // namespace opts
 
@@ -109,6 +119,10 @@ void FrameOptimizerPass::removeUnnecessaryLoads(const RegAnalysis &RA,
 
         ++NumRedundantLoads;
         Changed = true;
+        if (!BC.MIB->hasAnnotation(*AvailableInst, getForwardedTagName())) {
+          BC.MIB->addAnnotation(const_cast<MCInst &>(*AvailableInst),
+                                getForwardedTagName(), true);
+        }
         DEBUG(dbgs() << "Redundant load instruction: ");
         DEBUG(Inst.dump());
         DEBUG(dbgs() << "Related store instruction: ");
@@ -121,6 +135,7 @@ void FrameOptimizerPass::removeUnnecessaryLoads(const RegAnalysis &RA,
             break;
           }
           ++NumLoadsChangedToReg;
+          DynNumLoadsRemoved += BB.getKnownExecutionCount();
           BC.MIB->removeAnnotation(Inst, "FrameAccessEntry");
           DEBUG(dbgs() << "Changed operand to a reg\n");
           if (BC.MIB->isRedundantMove(Inst)) {
@@ -137,6 +152,7 @@ void FrameOptimizerPass::removeUnnecessaryLoads(const RegAnalysis &RA,
             DEBUG(dbgs() << "FAILED\n");
           } else {
             ++NumLoadsChangedToImm;
+            DynNumLoadsRemoved += BB.getKnownExecutionCount();
             BC.MIB->removeAnnotation(Inst, "FrameAccessEntry");
             DEBUG(dbgs() << "Ok\n");
           }
@@ -160,7 +176,8 @@ void FrameOptimizerPass::removeUnnecessaryLoads(const RegAnalysis &RA,
 
 void FrameOptimizerPass::removeUnusedStores(const FrameAnalysis &FA,
                                             const BinaryContext &BC,
-                                            BinaryFunction &BF) {
+                                            BinaryFunction &BF,
+                                            bool OnlyForwarded) {
   StackReachingUses SRU(FA, BC, BF);
   SRU.run();
 
@@ -190,6 +207,11 @@ void FrameOptimizerPass::removeUnusedStores(const FrameAnalysis &FA,
         Prev = &Inst;
         continue;
       }
+      if (OnlyForwarded &&
+          !BC.MIB->hasAnnotation(Inst, getForwardedTagName())) {
+        Prev = &Inst;
+        continue;
+      }
 
       if (SRU.isStoreUsed(*FIEX,
                           Prev ? SRU.expr_begin(*Prev) : SRU.expr_begin(BB))) {
@@ -201,6 +223,9 @@ void FrameOptimizerPass::removeUnusedStores(const FrameAnalysis &FA,
         continue;
 
       ++NumRedundantStores;
+      DynNumStoresRemoved += BB.getKnownExecutionCount();
+      if (OnlyForwarded)
+        ++NumSpillsRemoved;
       Changed = true;
       DEBUG(dbgs() << "Unused store instruction: ");
       DEBUG(Inst.dump());
@@ -232,8 +257,9 @@ void FrameOptimizerPass::runOnFunctions(BinaryContext &BC,
   FrameAnalysis FA(BC, BFs, CG);
   RegAnalysis RA(BC, BFs, CG);
 
-  // Our main loop: perform caller-saved register optimizations, then
-  // callee-saved register optimizations (shrink wrapping).
+  // Our main loop: perform caller-saved register optimizations, and collect
+  // functions for callee-saved register optimizations (shrink wrapping).
+  DenseSet<const BinaryFunction *> FuncsToShrinkWrap;
   for (auto &I : BFs) {
     if (!FA.hasFrameInfo(I.second))
       continue;
@@ -252,22 +278,45 @@ void FrameOptimizerPass::runOnFunctions(BinaryContext &BC,
                           opts::TimeOpts);
       removeUnnecessaryLoads(RA, FA, BC, I.second);
     }
-    if (opts::RemoveStores) {
+    if (opts::RemoveStores || opts::RemoveSpills) {
       NamedRegionTimer T1("removestores", "remove stores", "FOP",
                           "FOP breakdown", opts::TimeOpts);
-      removeUnusedStores(FA, BC, I.second);
+      removeUnusedStores(FA, BC, I.second,
+                         /*OnlyForwarded=*/!opts::RemoveStores);
+    }
+    for (auto &BB : I.second) {
+      for (auto &Inst : BB)
+        BC.MIB->removeAnnotation(Inst, getForwardedTagName());
     }
     // Don't even start shrink wrapping if no profiling info is available
     if (I.second.getKnownExecutionCount() == 0)
       continue;
-    {
-      NamedRegionTimer T1("movespills", "move spills", "FOP", "FOP breakdown",
-                          opts::TimeOpts);
-      DataflowInfoManager Info(BC, I.second, &RA, &FA);
-      ShrinkWrapping SW(FA, BC, I.second, Info);
-      if (SW.perform())
-        FuncsChanged.insert(&I.second);
-    }
+    FuncsToShrinkWrap.insert(&I.second);
+  }
+
+  // Shrink wrapping only touches the function it works on, and FA and RA are
+  // not modified anymore. Timers are not thread-safe, so stay on this thread
+  // if they were requested.
+  {
+    NamedRegionTimer T1("movespills", "move spills", "FOP", "FOP breakdown",
+                        opts::TimeOpts);
+    std::mutex FuncsChangedMutex;
+    ParallelUtilities::runOnEachFunction(
+        BFs,
+        opts::TimeOpts ? ParallelUtilities::SP_TRIVIAL
+                       : ParallelUtilities::SP_INST_QUADRATIC,
+        [&](BinaryFunction &BF) {
+          auto &Info = DataflowInfoCache::get(BC, BF, &RA, &FA);
+          ShrinkWrapping SW(FA, BC, BF, Info);
+          if (!SW.perform())
+            return;
+          std::lock_guard<std::mutex> Lock(FuncsChangedMutex);
+          FuncsChanged.insert(&BF);
+        },
+        [&](const BinaryFunction &BF) {
+          return !FuncsToShrinkWrap.count(&BF);
+        },
+        "ShrinkWrapping");
   }
 
   outs() << "BOLT-INFO: FOP optimized " << NumRedundantLoads
@@ -277,7 +326,12 @@ void FrameOptimizerPass::runOnFunctions(BinaryContext &BC,
          << " load(s) to use a register instead of a stack access, and "
          << NumLoadsChangedToImm << " to use an immediate.\n"
          << "BOLT-INFO: FOP deleted " << NumLoadsDeleted << " load(s) and "
-         << NumRedundantStores << " store(s).\n";
+         << NumRedundantStores << " store(s), including " << NumSpillsRemoved
+         << " spill(s) whose reloads were replaced by registers.\n"
+         << "BOLT-INFO: FOP removed memory accesses executed "
+         << DynNumLoadsRemoved << " time(s) for loads and "
+         << DynNumStoresRemoved << " time(s) for stores according to the "
+            "profile.\n";
   FA.printStats();
   ShrinkWrapping::printStats();
 }
@@ -83,6 +83,11 @@ class FrameOptimizerPass : public BinaryFunctionPass {
   uint64_t NumLoadsChangedToReg{0};
   uint64_t NumLoadsChangedToImm{0};
   uint64_t NumLoadsDeleted{0};
+  uint64_t NumSpillsRemoved{0};
+
+  /// Same as above, weighted by the execution count of the blocks.
+  uint64_t DynNumLoadsRemoved{0};
+  uint64_t DynNumStoresRemoved{0};
 
   DenseSet<const BinaryFunction *> FuncsChanged;
 
@@ -94,10 +99,20 @@ class FrameOptimizerPass : public BinaryFunctionPass {
                               const BinaryContext &BC,
                               BinaryFunction &BF);
 
-  /// Use information from stack frame usage to delete unused stores.
+  /// Use information from stack frame usage to delete unused stores. If
+  /// \p OnlyForwarded is true, only consider stores whose value was forwarded
+  /// to a load by removeUnnecessaryLoads(). Since RegAnalysis tells which
+  /// registers a call preserves, these are typically spills of values that
+  /// survive a call in their register.
   void removeUnusedStores(const FrameAnalysis &FA,
                           const BinaryContext &BC,
-                          BinaryFunction &BF);
+                          BinaryFunction &BF,
+                          bool OnlyForwarded = false);
+
+  /// Annotation marking stores forwarded to at least one load.
+  static StringRef getForwardedTagName() {
+    return StringRef("FOP-Forwarded");
+  }
 
 public:
   explicit FrameOptimizerPass(const cl::opt<bool> &PrintPass)
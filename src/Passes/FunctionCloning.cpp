@@ -0,0 +1,397 @@
+//===--- Passes/FunctionCloning.cpp - Clone functions for hot callers -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "FunctionCloning.h"
+#include "BinaryFunctionCallGraph.h"
+#include "llvm/Support/Options.h"
+#include <cmath>
+#include <unordered_map>
+
+#define DEBUG_TYPE "bolt-clone"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+extern cl::opt<bool> Instrument;
+
+cl::opt<bool>
+CloneFunctions("clone-functions",
+  cl::desc("clone hot functions for the callers whose calls take different "
+           "branches than the rest (requires LBR profile and relocations)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneFunctionsMaxGrowth("clone-functions-max-growth",
+  cl::desc("maximum size of the clones, in percent of the size of the "
+           "functions with profile"),
+  cl::init(5),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneFunctionsMinShare("clone-functions-min-share",
+  cl::desc("minimum percentage of the calls to a function made by a caller "
+           "to clone the function for it"),
+  cl::init(10),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneFunctionsMinCount("clone-functions-min-count",
+  cl::desc("minimum number of calls from a caller to clone a function for it"),
+  cl::init(1000),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneFunctionsMinDiff("clone-functions-min-diff",
+  cl::desc("minimum difference between the profile of a function in the "
+           "calls from a caller and its whole profile, in percent, to clone "
+           "it for the caller"),
+  cl::init(20),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneFunctionsMaxSize("clone-functions-max-size",
+  cl::desc("maximum size in bytes of a function to clone"),
+  cl::init(4096),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneFunctionsMaxClones("clone-functions-max-clones",
+  cl::desc("maximum number of clones of a function"),
+  cl::init(2),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+double FunctionCloning::getProfileDistance(
+    const BinaryFunction &BF,
+    const BinaryFunction::CallerProfile &Profile) const {
+  uint64_t Total = 0;
+  for (const auto &BB : BF) {
+    for (const auto &BI : BB.branch_info()) {
+      if (BI.Count != BinaryBasicBlock::COUNT_NO_PROFILE)
+        Total += BI.Count;
+    }
+  }
+
+  uint64_t ContextTotal = 0;
+  for (const auto &EI : Profile.Edges)
+    ContextTotal += EI.second.Count;
+
+  if (!Total || !ContextTotal)
+    return 0.0;
+
+  double Distance = 0.0;
+  for (const auto &BB : BF) {
+    auto BI = BB.branch_info_begin();
+    for (const auto *Succ : BB.successors()) {
+      const auto Count =
+        BI->Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0 : BI->Count;
+      ++BI;
+      auto EI = Profile.Edges.find(std::make_pair(&BB, Succ));
+      const auto ContextCount =
+        EI == Profile.Edges.end() ? 0 : EI->second.Count;
+      Distance += std::abs(static_cast<double>(Count) / Total -
+                           static_cast<double>(ContextCount) / ContextTotal);
+    }
+  }
+
+  return Distance / 2;
+}
+
+void FunctionCloning::splitProfile(
+    const BinaryContext &BC,
+    BinaryFunction &BF,
+    BinaryFunction &Clone,
+    const BinaryFunction::CallerProfile &Profile,
+    uint64_t CallCount) const {
+  // Only a part of the calls are recorded with the branches after them.
+  const double Scale = static_cast<double>(CallCount) / Profile.EntryCount;
+  auto scale = [&](uint64_t Count) {
+    return static_cast<uint64_t>(Count * Scale + 0.5);
+  };
+
+  // Blocks of the clone are in the same order as the blocks of the function.
+  std::vector<BinaryBasicBlock *> CloneBlocks;
+  for (auto &BB : Clone)
+    CloneBlocks.push_back(&BB);
+  assert(CloneBlocks.size() == BF.size() && "clone differs from function");
+
+  std::unordered_map<const BinaryBasicBlock *, uint64_t> InCount;
+  std::unordered_map<const BinaryBasicBlock *, uint64_t> OutCount;
+  auto CloneBBI = CloneBlocks.begin();
+  for (auto &BB : BF) {
+    auto *CloneBB = *CloneBBI++;
+    auto BI = BB.branch_info_begin();
+    auto CloneBI = CloneBB->branch_info_begin();
+    for (const auto *Succ : BB.successors()) {
+      auto &OrigBI = *BI++;
+      auto &NewBI = *CloneBI++;
+      if (OrigBI.Count == BinaryBasicBlock::COUNT_NO_PROFILE)
+        continue;
+
+      uint64_t Count = 0;
+      uint64_t Mispreds = 0;
+      auto EI = Profile.Edges.find(std::make_pair(&BB, Succ));
+      if (EI != Profile.Edges.end()) {
+        Count = std::min(OrigBI.Count, scale(EI->second.Count));
+        if (OrigBI.MispredictedCount != BinaryBasicBlock::COUNT_INFERRED)
+          Mispreds = std::min(OrigBI.MispredictedCount,
+                              scale(EI->second.MispredictedCount));
+      }
+
+      NewBI.Cycles = OrigBI.Count ? static_cast<uint64_t>(
+          static_cast<double>(OrigBI.Cycles) * Count / OrigBI.Count) : 0;
+      OrigBI.Cycles -= std::min(OrigBI.Cycles, NewBI.Cycles);
+      NewBI.Count = Count;
+      OrigBI.Count -= Count;
+      if (OrigBI.MispredictedCount != BinaryBasicBlock::COUNT_INFERRED) {
+        NewBI.MispredictedCount = Mispreds;
+        OrigBI.MispredictedCount -= Mispreds;
+      }
+
+      OutCount[&BB] += Count;
+      InCount[Succ] += Count;
+    }
+  }
+
+  auto splitCount = [](uint64_t &Count, uint64_t &CloneCount, double Ratio) {
+    CloneCount = std::min(Count, static_cast<uint64_t>(Count * Ratio + 0.5));
+    Count -= CloneCount;
+  };
+
+  CloneBBI = CloneBlocks.begin();
+  for (auto &BB : BF) {
+    auto *CloneBB = *CloneBBI++;
+    if (!BB.hasProfile())
+      continue;
+
+    const auto OrigCount = BB.getExecutionCount();
+    auto Count = std::max(InCount[&BB], OutCount[&BB]);
+    if (BB.isEntryPoint())
+      Count = std::max(InCount[&BB] + CallCount, OutCount[&BB]);
+    Count = std::min(Count, OrigCount);
+    CloneBB->setExecutionCount(Count);
+    BB.setExecutionCount(OrigCount - Count);
+
+    // Split the counts attached to the instructions of the block. The targets
+    // of indirect calls come from the calls from the caller when recorded.
+    const double Ratio =
+      OrigCount ? static_cast<double>(Count) / OrigCount : 0.0;
+    auto CloneII = CloneBB->begin();
+    unsigned Index = 0;
+    for (auto &Inst : BB) {
+      auto &CloneInst = *CloneII++;
+      for (const char *Name : {"Count", "CTCTakenCount", "CTCMispredCount"}) {
+        if (!BC.MIB->hasAnnotation(Inst, Name))
+          continue;
+        auto &Value = BC.MIB->getOrCreateAnnotationAs<uint64_t>(Inst, Name);
+        uint64_t CloneValue;
+        splitCount(Value, CloneValue, Ratio);
+        BC.MIB->addAnnotation(CloneInst, Name, CloneValue);
+      }
+
+      if (BC.MIB->hasAnnotation(Inst, "CallProfile")) {
+        auto &CSP = BC.MIB->getOrCreateAnnotationAs<IndirectCallSiteProfile>(
+            Inst, "CallProfile");
+        IndirectCallSiteProfile CloneCSP;
+        auto CI = Profile.CallSites.find(std::make_pair(&BB, Index));
+        for (auto &CSI : CSP) {
+          uint64_t CloneCSICount = 0;
+          uint64_t CloneCSIMispreds = 0;
+          if (CI == Profile.CallSites.end()) {
+            splitCount(CSI.Count, CloneCSICount, Ratio);
+            splitCount(CSI.Mispreds, CloneCSIMispreds, Ratio);
+          } else {
+            auto ContextCSI =
+              std::find_if(CI->second.begin(), CI->second.end(),
+                           [&](const IndirectCallProfile &Other) {
+                             return Other.Name == CSI.Name;
+                           });
+            if (ContextCSI != CI->second.end()) {
+              CloneCSICount = std::min(CSI.Count, scale(ContextCSI->Count));
+              CloneCSIMispreds =
+                std::min(CSI.Mispreds, scale(ContextCSI->Mispreds));
+              CSI.Count -= CloneCSICount;
+              CSI.Mispreds -= CloneCSIMispreds;
+            }
+          }
+          CloneCSP.emplace_back(CSI.IsFunction, CSI.Name, CloneCSICount,
+                                CloneCSIMispreds, CSI.Offset);
+        }
+        BC.MIB->addAnnotation(CloneInst, "CallProfile", CloneCSP);
+      }
+      ++Index;
+    }
+  }
+
+  const auto OrigCount = BF.getKnownExecutionCount();
+  CallCount = std::min(CallCount, OrigCount);
+  Clone.setExecutionCount(CallCount);
+  BF.setExecutionCount(OrigCount - CallCount);
+}
+
+uint64_t FunctionCloning::redirectCalls(const BinaryContext &BC,
+                                        BinaryFunction &Caller,
+                                        const BinaryFunction &BF,
+                                        const BinaryFunction &Clone) const {
+  uint64_t NumRedirected = 0;
+  for (auto &BB : Caller) {
+    for (auto &Inst : BB) {
+      if ((!BC.MIB->isCall(Inst) || BC.MIB->isIndirectCall(Inst)) &&
+          !BC.MIB->getConditionalTailCall(Inst))
+        continue;
+      const auto *TargetSymbol = BC.MIB->getTargetSymbol(Inst);
+      if (!TargetSymbol || BC.getFunctionForSymbol(TargetSymbol) != &BF)
+        continue;
+      BC.MIB->replaceBranchTarget(Inst, Clone.getSymbol(), BC.Ctx.get());
+      ++NumRedirected;
+    }
+  }
+  return NumRedirected;
+}
+
+void FunctionCloning::runOnFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::set<uint64_t> &) {
+  if (!opts::CloneFunctions)
+    return;
+
+  if (!BC.HasRelocations || opts::Instrument) {
+    errs() << "BOLT-WARNING: function cloning requires relocation mode and "
+              "is not supported with instrumentation\n";
+    return;
+  }
+
+  auto CG = buildCallGraph(BC, BFs,
+                           [](const BinaryFunction &BF) {
+                             return !BF.hasProfile() ||
+                                    BF.getState() != BinaryFunction::State::CFG;
+                           },
+                           /*CgFromPerfData=*/false,
+                           /*IncludeColdCalls=*/true,
+                           /*UseFunctionHotSize=*/false,
+                           /*UseSplitHotSize=*/false,
+                           /*UseEdgeCounts=*/true,
+                           /*IgnoreRecursiveCalls=*/true);
+
+  struct Candidate {
+    BinaryFunction *Function;
+    BinaryFunction *Caller;
+    const BinaryFunction::CallerProfile *Profile;
+    uint64_t CallCount;
+  };
+  std::vector<Candidate> Candidates;
+
+  uint64_t HotSize = 0;
+  for (auto &BFI : BFs) {
+    auto &Function = BFI.second;
+    if (!Function.hasValidProfile() || !Function.getKnownExecutionCount())
+      continue;
+    HotSize += Function.getSize();
+
+    if (!Function.isSimple() || !shouldOptimize(Function) ||
+        Function.getState() != BinaryFunction::State::CFG ||
+        Function.isMultiEntry() || Function.hasEHRanges() ||
+        Function.hasJumpTables() || Function.hasConstantIsland() ||
+        Function.getSize() > opts::CloneFunctionsMaxSize)
+      continue;
+
+    const auto FunctionId = CG.maybeGetNodeId(&Function);
+    if (FunctionId == CallGraph::InvalidId)
+      continue;
+
+    for (const auto &CPI : Function.getCallerProfiles()) {
+      const auto &Profile = CPI.second;
+      if (!Profile.EntryCount)
+        continue;
+
+      const auto CallerId = CG.maybeGetNodeId(CPI.first);
+      if (CallerId == CallGraph::InvalidId || CallerId == FunctionId)
+        continue;
+      auto *Caller = CG.nodeIdToFunc(CallerId);
+      if (!Caller->isSimple() || !Caller->hasCFG())
+        continue;
+
+      const auto Arc = CG.findArc(CallerId, FunctionId);
+      if (Arc == CG.arcs().end())
+        continue;
+      const auto CallCount = static_cast<uint64_t>(Arc->weight());
+      if (CallCount < opts::CloneFunctionsMinCount ||
+          CallCount * 100 <
+            Function.getKnownExecutionCount() * opts::CloneFunctionsMinShare)
+        continue;
+
+      const auto Distance = getProfileDistance(Function, Profile);
+      DEBUG(dbgs() << "BOLT-DEBUG: clone candidate " << Function << " for "
+                   << *Caller << ": " << CallCount << " calls, distance "
+                   << Distance << '\n');
+      if (Distance * 100 < opts::CloneFunctionsMinDiff)
+        continue;
+
+      Candidates.push_back({&Function, Caller, &Profile, CallCount});
+    }
+  }
+
+  std::stable_sort(Candidates.begin(), Candidates.end(),
+                   [](const Candidate &A, const Candidate &B) {
+                     if (A.CallCount != B.CallCount)
+                       return A.CallCount > B.CallCount;
+                     if (A.Function != B.Function)
+                       return A.Function->getAddress() <
+                              B.Function->getAddress();
+                     return A.Caller->getAddress() < B.Caller->getAddress();
+                   });
+
+  const auto MaxGrowth = HotSize * opts::CloneFunctionsMaxGrowth / 100;
+  for (const auto &C : Candidates) {
+    auto &Function = *C.Function;
+    if (NumClonedBytes + Function.getSize() > MaxGrowth)
+      continue;
+    if (Function.getClones().size() >= opts::CloneFunctionsMaxClones)
+      continue;
+
+    auto *Clone = BC.createFunctionClone(Function, BFs);
+    splitProfile(BC, Function, *Clone, *C.Profile, C.CallCount);
+    NumRedirectedCalls += redirectCalls(BC, *C.Caller, Function, *Clone);
+
+    DEBUG(dbgs() << "BOLT-DEBUG: cloned " << Function << " into " << *Clone
+                 << " for " << *C.Caller << '\n');
+
+    ++NumClones;
+    NumClonedBytes += Function.getSize();
+  }
+
+  for (auto &BFI : BFs)
+    BFI.second.clearCallerProfiles();
+
+  outs() << "BOLT-INFO: created " << NumClones << " function clones ("
+         << NumClonedBytes << " bytes) for hot callers, redirecting "
+         << NumRedirectedCalls << " calls\n";
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,76 @@
+//===--- Passes/FunctionCloning.h - Clone functions for hot callers -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Create copies of hot functions for the callers that call them the most, when
+// the branches taken in the calls from such a caller differ from the ones
+// taken in the rest of the calls. The profile recorded in the calls from the
+// caller is moved to the clone, and the calls from the caller are redirected
+// to the clone, so that later passes optimize the layout, the indirect calls
+// and the placement of the clone for this caller alone.
+//
+// The profile of a function per caller comes from the LBR samples that
+// recorded the call along with the branches after it, and is collected by
+// the aggregator when the pass is enabled. The total size of the clones is
+// limited to a share of the size of the hot code.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_FUNCTION_CLONING_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_FUNCTION_CLONING_H
+
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+class FunctionCloning : public BinaryFunctionPass {
+  /// Statistics.
+  uint64_t NumClones{0};
+  uint64_t NumClonedBytes{0};
+  uint64_t NumRedirectedCalls{0};
+
+  /// Return the total variation distance between the distribution of the
+  /// edge counts of \p BF and the one in the calls recorded in \p Profile.
+  double getProfileDistance(
+      const BinaryFunction &BF,
+      const BinaryFunction::CallerProfile &Profile) const;
+
+  /// Move the share of the profile of \p BF recorded in \p Profile, made of
+  /// \p CallCount calls, to its new clone \p Clone.
+  void splitProfile(const BinaryContext &BC,
+                    BinaryFunction &BF,
+                    BinaryFunction &Clone,
+                    const BinaryFunction::CallerProfile &Profile,
+                    uint64_t CallCount) const;
+
+  /// Make the calls from \p Caller to \p BF call \p Clone instead. Return the
+  /// number of calls redirected.
+  uint64_t redirectCalls(const BinaryContext &BC,
+                         BinaryFunction &Caller,
+                         const BinaryFunction &BF,
+                         const BinaryFunction &Clone) const;
+
+public:
+  explicit FunctionCloning(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "function-cloning";
+  }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
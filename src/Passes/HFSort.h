@@ -7,11 +7,12 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// Cluster functions by hotness.  There are four clustering algorithms:
+// Cluster functions by hotness.  There are five clustering algorithms:
 // 1. clusterize
 // 2. HFsort+
 // 3. pettisAndHansen
 // 4. randomClusters
+// 5. extTSPFunctions
 //
 // See original code in hphp/utils/hfsort.[h,cpp]
 //===----------------------------------------------------------------------===//
@@ -103,7 +104,7 @@ std::vector<Cluster> clusterize(const CallGraph &Cg);
 /*
  * Optimize function placement for iTLB cache and i-cache.
  */
-std::vector<Cluster> hfsortPlus(CallGraph &Cg, bool UseGainCache = true);
+std::vector<Cluster> hfsortPlus(CallGraph &Cg);
 
 /*
  * Pettis-Hansen code layout algorithm
@@ -115,6 +116,12 @@ std::vector<Cluster> pettisAndHansen(const CallGraph &Cg);
 /* Group functions into clusters randomly. */
 std::vector<Cluster> randomClusters(const CallGraph &Cg);
 
+/*
+ * Order hot functions maximizing the ExtTSP score of calls and returns
+ * between them.
+ */
+std::vector<Cluster> extTSPFunctions(const CallGraph &Cg);
+
 }
 }
 
@@ -11,9 +11,13 @@
 
 #include "BinaryFunction.h"
 #include "HFSort.h"
-#include "ReorderUtils.h"
+#include "ParallelUtilities.h"
+#include "llvm/ADT/EquivalenceClasses.h"
 #include "llvm/Support/Options.h"
+#include "llvm/Support/ThreadPool.h"
 
+#include <numeric>
+#include <queue>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
@@ -38,6 +42,22 @@ MergeProbability("merge-probability",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<unsigned>
+MaxAdjacentClusters("hfsort+-max-adjacent",
+  cl::desc("the maximum number of adjacent clusters with the heaviest calls "
+           "considered for merging with a cluster by hfsort+ (0 - no limit)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+HFSortPlusPartition("hfsort+-partition",
+  cl::desc("run hfsort+ on weakly connected components of the call graph "
+           "concurrently before ordering all clusters"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace llvm {
@@ -76,23 +96,40 @@ bool compareClusters(const Cluster *C1, const Cluster *C2) {
   return C1->target(0) < C2->target(0);
 }
 
-/// Deterministically compare pairs of clusters by density in decreasing order.
-bool compareClusterPairs(const Cluster *A1, const Cluster *B1,
-                         const Cluster *A2, const Cluster *B2) {
-  const auto D1 = density(A1, B1);
-  const auto D2 = density(A2, B2);
-  if (D1 != D2)
-    return D1 > D2;
-  const auto Size1 = A1->size() + B1->size();
-  const auto Size2 = A2->size() + B2->size();
-  if (Size1 != Size2)
-    return Size1 < Size2;
-  const auto Samples1 = A1->samples() + B1->samples();
-  const auto Samples2 = A2->samples() + B2->samples();
-  if (Samples1 != Samples2)
-    return Samples1 > Samples2;
-  return A1->target(0) < A2->target(0);
-}
+/// A candidate for merging a pair of clusters in the second pass of hfsort+.
+/// The versions of the clusters identify the state of the clusters the gain
+/// was computed for; the candidate is stale once either of them is merged.
+struct MergeCandidate {
+  Cluster *ClusterPred;
+  Cluster *ClusterSucc;
+  uint32_t PredVersion;
+  uint32_t SuccVersion;
+  double Gain;
+  double Density;
+  uint32_t Size;
+  uint64_t Samples;
+  NodeId PredTarget;
+  NodeId SuccTarget;
+};
+
+/// Deterministically order merge candidates so that the one with the largest
+/// gain is at the top of the queue. Ties are broken by density to make the
+/// hottest clusters be merged first.
+struct CompareMergeCandidates {
+  bool operator()(const MergeCandidate &A, const MergeCandidate &B) const {
+    if (A.Gain != B.Gain)
+      return A.Gain < B.Gain;
+    if (A.Density != B.Density)
+      return A.Density < B.Density;
+    if (A.Size != B.Size)
+      return A.Size > B.Size;
+    if (A.Samples != B.Samples)
+      return A.Samples < B.Samples;
+    if (A.PredTarget != B.PredTarget)
+      return A.PredTarget > B.PredTarget;
+    return A.SuccTarget > B.SuccTarget;
+  }
+};
 
 /// HFSortPlus - layout of hot functions with iTLB cache optimization
 ///
@@ -155,33 +192,58 @@ public:
   }
 
   /// The number of calls between the two clusters with both endpoints on
-  /// the same i-TLB page, assuming that a given pair of clusters gets merged
+  /// the same i-TLB page, assuming that a given pair of clusters gets merged.
+  /// Only the arcs of the cluster with fewer functions are visited.
   double shortCalls(const Cluster *ClusterPred,
                     const Cluster *ClusterSucc) const {
+    const auto PredSize = ClusterPred->size();
     double Calls = 0;
-    for (auto TargetId : ClusterPred->targets()) {
-      for (auto Succ : Cg.successors(TargetId)) {
-        if (FuncCluster[Succ] == ClusterSucc) {
-          const auto &Arc = *Cg.findArc(TargetId, Succ);
+    if (ClusterPred->numTargets() <= ClusterSucc->numTargets()) {
+      for (auto TargetId : ClusterPred->targets()) {
+        for (auto Succ : Cg.successors(TargetId)) {
+          if (FuncCluster[Succ] == ClusterSucc) {
+            const auto &Arc = *Cg.findArc(TargetId, Succ);
 
-          auto SrcAddr = Addr[TargetId] + Arc.avgCallOffset();
-          auto DstAddr = Addr[Succ] + ClusterPred->size();
+            auto SrcAddr = Addr[TargetId] + Arc.avgCallOffset();
+            auto DstAddr = Addr[Succ] + PredSize;
 
-          Calls += expectedCalls(SrcAddr, DstAddr, Arc.weight());
+            Calls += expectedCalls(SrcAddr, DstAddr, Arc.weight());
+          }
+        }
+
+        for (auto Pred : Cg.predecessors(TargetId)) {
+          if (FuncCluster[Pred] == ClusterSucc) {
+            const auto &Arc = *Cg.findArc(Pred, TargetId);
+
+            auto SrcAddr = Addr[Pred] + Arc.avgCallOffset() + PredSize;
+            auto DstAddr = Addr[TargetId];
+
+            Calls += expectedCalls(SrcAddr, DstAddr, Arc.weight());
+          }
         }
       }
-    }
+    } else {
+      for (auto TargetId : ClusterSucc->targets()) {
+        for (auto Pred : Cg.predecessors(TargetId)) {
+          if (FuncCluster[Pred] == ClusterPred) {
+            const auto &Arc = *Cg.findArc(Pred, TargetId);
 
-    for (auto TargetId : ClusterPred->targets()) {
-      for (auto Pred : Cg.predecessors(TargetId)) {
-        if (FuncCluster[Pred] == ClusterSucc) {
-          const auto &Arc = *Cg.findArc(Pred, TargetId);
+            auto SrcAddr = Addr[Pred] + Arc.avgCallOffset();
+            auto DstAddr = Addr[TargetId] + PredSize;
 
-          auto SrcAddr = Addr[Pred] + Arc.avgCallOffset() +
-            ClusterPred->size();
-          auto DstAddr = Addr[TargetId];
+            Calls += expectedCalls(SrcAddr, DstAddr, Arc.weight());
+          }
+        }
 
-          Calls += expectedCalls(SrcAddr, DstAddr, Arc.weight());
+        for (auto Succ : Cg.successors(TargetId)) {
+          if (FuncCluster[Succ] == ClusterPred) {
+            const auto &Arc = *Cg.findArc(TargetId, Succ);
+
+            auto SrcAddr = Addr[TargetId] + Arc.avgCallOffset() + PredSize;
+            auto DstAddr = Addr[Succ];
+
+            Calls += expectedCalls(SrcAddr, DstAddr, Arc.weight());
+          }
         }
       }
     }
@@ -201,17 +263,15 @@ public:
   /// the i-cache performance.
   double mergeGain(const Cluster *ClusterPred,
                    const Cluster *ClusterSucc) const {
-    if (UseGainCache && GainCache.contains(ClusterPred, ClusterSucc)) {
-      return GainCache.get(ClusterPred, ClusterSucc);
-    }
-
     // cache misses on the first cluster
-    double LongCallsPred = ClusterPred->samples() - shortCalls(ClusterPred);
+    double LongCallsPred =
+      ClusterPred->samples() - ShortCalls[ClusterPred->id()];
     double ProbPred = missProbability(ClusterPred->density() * ITLBPageSize);
     double ExpectedMissesPred = LongCallsPred * ProbPred;
 
     // cache misses on the second cluster
-    double LongCallsSucc = ClusterSucc->samples() - shortCalls(ClusterSucc);
+    double LongCallsSucc =
+      ClusterSucc->samples() - ShortCalls[ClusterSucc->id()];
     double ProbSucc = missProbability(ClusterSucc->density() * ITLBPageSize);
     double ExpectedMissesSucc = LongCallsSucc * ProbSucc;
 
@@ -226,10 +286,6 @@ public:
     // scaling the result to increase the importance of merging short clusters
     Gain /= std::min(ClusterPred->size(), ClusterSucc->size());
 
-    if (UseGainCache) {
-      GainCache.set(ClusterPred, ClusterSucc, Gain);
-    }
-
     return Gain;
   }
 
@@ -312,56 +368,53 @@ public:
       for (auto &Pair : PairsToMerge) {
         mergeClusters(Pair.first, Pair.second);
       }
+      removeMergedClusters();
     }
   }
 
   /// Run the second optimization pass of the hfsort+ algorithm:
   /// Merge pairs of clusters while there is an improvement in the
   /// expected cache miss ratio
+  ///
+  /// The profitable merges are kept in a priority queue. The gain of merging
+  /// two clusters depends only on the two clusters, so after a merge only the
+  /// candidates involving the new cluster are recomputed; the ones involving
+  /// the merged clusters become stale and are skipped.
   void runPassTwo() {
-    while (Clusters.size() > 1) {
-      Cluster *BestClusterPred = nullptr;
-      Cluster *BestClusterSucc = nullptr;
-      double BestGain = -1;
-      for (auto ClusterPred : Clusters) {
-        // get candidates for merging with the current cluster
-        Adjacent.forAllAdjacent(
-          ClusterPred,
-          // find the best candidate
-          [&](Cluster *ClusterSucc) {
-            assert(ClusterPred != ClusterSucc && "loop edges are not supported");
-            // compute the gain of merging two clusters
-            const double Gain = mergeGain(ClusterPred, ClusterSucc);
-
-            // breaking ties by density to make the hottest clusters be merged first
-            if (Gain > BestGain || (std::abs(Gain - BestGain) < 1e-8 &&
-                                    compareClusterPairs(ClusterPred,
-                                                        ClusterSucc,
-                                                        BestClusterPred,
-                                                        BestClusterSucc))) {
-              BestGain = Gain;
-              BestClusterPred = ClusterPred;
-              BestClusterSucc = ClusterSucc;
-            }
-          });
-      }
+    for (auto *ClusterPred : Clusters) {
+      for (auto *ClusterSucc : getMergeCandidates(ClusterPred))
+        addMergeCandidate(ClusterPred, ClusterSucc);
+    }
 
-      // stop merging when there is no improvement
-      if (BestGain <= 0.0)
-        break;
+    while (!Queue.empty()) {
+      const auto Candidate = Queue.top();
+      Queue.pop();
+
+      // skip candidates invalidated by the previous merges
+      if (!isValid(Candidate))
+        continue;
 
       // merge the best pair of clusters
-      mergeClusters(BestClusterPred, BestClusterSucc);
+      auto *Into = Candidate.ClusterPred;
+      mergeClusters(Into, Candidate.ClusterSucc);
+
+      // update the candidates for merging with the new cluster
+      for (auto *Other : getMergeCandidates(Into)) {
+        addMergeCandidate(Into, Other);
+        addMergeCandidate(Other, Into);
+      }
     }
+
+    removeMergedClusters();
   }
 
   /// Run hfsort+ algorithm and return ordered set of function clusters.
   std::vector<Cluster> run() {
-    DEBUG(dbgs() << "Starting hfsort+ w/"
-                 << (UseGainCache ? "gain cache" : "no cache")
-                 << " for " << Clusters.size() << " clusters "
+    DEBUG(dbgs() << "Starting hfsort+ for " << Clusters.size() << " clusters "
                  << "with ITLBPageSize = " << ITLBPageSize << ", "
                  << "ITLBEntries = " << ITLBEntries << ", "
+                 << "MaxAdjacentClusters = " << opts::MaxAdjacentClusters
+                 << ", "
                  << "and MergeProbability = " << opts::MergeProbability << "\n");
 
     // Pass 1
@@ -386,90 +439,193 @@ public:
     return Result;
   }
 
-  HFSortPlus(const CallGraph &Cg, bool UseGainCache)
+  /// Prepare clustering of functions \p Nodes of \p Cg, listed in increasing
+  /// order. Calls to or from other functions are ignored, so \p Nodes should
+  /// be a union of weakly connected components of the graph. \p TotalSamples
+  /// is the number of samples of the whole graph.
+  HFSortPlus(const CallGraph &Cg, const std::vector<NodeId> &Nodes,
+             double TotalSamples)
   : Cg(Cg),
     FuncCluster(Cg.numNodes(), nullptr),
     Addr(Cg.numNodes(), InvalidAddr),
-    TotalSamples(0.0),
-    Clusters(initializeClusters()),
-    Adjacent(Cg.numNodes()),
-    UseGainCache(UseGainCache),
-    GainCache(Clusters.size()) {
-    // Initialize adjacency matrix
-    Adjacent.initialize(Clusters);
+    TotalSamples(TotalSamples),
+    Clusters(initializeClusters(Nodes)),
+    Adjacent(Clusters.size()),
+    ShortCalls(Clusters.size(), 0.0),
+    Version(Clusters.size(), 0) {
+    // Initialize adjacency lists with the weights of the calls between clusters
     for (auto *A : Clusters) {
       for (auto TargetId : A->targets()) {
         for (auto Succ : Cg.successors(TargetId)) {
           auto *B = FuncCluster[Succ];
           if (!B || B == A) continue;
           const auto &Arc = *Cg.findArc(TargetId, Succ);
-          if (Arc.weight() > 0.0)
-            Adjacent.set(A, B);
-        }
-        for (auto Pred : Cg.predecessors(TargetId)) {
-          auto *B = FuncCluster[Pred];
-          if (!B || B == A) continue;
-          const auto &Arc = *Cg.findArc(Pred, TargetId);
-          if (Arc.weight() > 0.0)
-            Adjacent.set(A, B);
+          if (Arc.weight() > 0.0) {
+            Adjacent[A->id()][B] += Arc.weight();
+            Adjacent[B->id()][A] += Arc.weight();
+          }
         }
       }
+      ShortCalls[A->id()] = shortCalls(A);
     }
   }
 
 private:
-  /// Initialize the set of active clusters, function id to cluster mapping,
-  /// total number of samples and function addresses.
-  std::vector<Cluster *> initializeClusters() {
-    outs() << "BOLT-INFO: running hfsort+ for " << Cg.numNodes() << " functions\n";
-
-    ITLBPageSize = opts::ITLBPageSize;
-    ITLBEntries = opts::ITLBEntries;
-
-    // Initialize clusters
+  /// Initialize the set of active clusters, function id to cluster mapping
+  /// and function addresses.
+  std::vector<Cluster *> initializeClusters(const std::vector<NodeId> &Nodes) {
     std::vector<Cluster *> Clusters;
-    Clusters.reserve(Cg.numNodes());
-    AllClusters.reserve(Cg.numNodes());
-    for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+    Clusters.reserve(Nodes.size());
+    AllClusters.reserve(Nodes.size());
+    for (auto F : Nodes) {
       AllClusters.emplace_back(F, Cg.getNode(F));
-      Clusters.emplace_back(&AllClusters[F]);
+      Clusters.emplace_back(&AllClusters.back());
       Clusters.back()->setId(Clusters.size() - 1);
-      FuncCluster[F] = &AllClusters[F];
+      FuncCluster[F] = &AllClusters.back();
       Addr[F] = 0;
-      TotalSamples += Cg.samples(F);
     }
 
     return Clusters;
   }
 
-  /// Merge cluster From into cluster Into and update the list of active clusters
+  /// Return the clusters adjacent to \p C that are considered for merging with
+  /// it. With -hfsort+-max-adjacent, only the clusters with the heaviest calls
+  /// to and from \p C are returned.
+  std::vector<Cluster *> getMergeCandidates(const Cluster *C) const {
+    using AdjacentWeight = std::pair<Cluster *, double>;
+    const auto &Adj = Adjacent[C->id()];
+    std::vector<AdjacentWeight> Weights(Adj.begin(), Adj.end());
+
+    const size_t MaxCandidates = opts::MaxAdjacentClusters;
+    if (MaxCandidates > 0 && Weights.size() > MaxCandidates) {
+      std::nth_element(Weights.begin(), Weights.begin() + MaxCandidates,
+                       Weights.end(),
+                       [](const AdjacentWeight &A, const AdjacentWeight &B) {
+                         if (A.second != B.second)
+                           return A.second > B.second;
+                         return A.first->target(0) < B.first->target(0);
+                       });
+      Weights.resize(MaxCandidates);
+    }
+
+    std::vector<Cluster *> Candidates;
+    Candidates.reserve(Weights.size());
+    for (const auto &AW : Weights)
+      Candidates.push_back(AW.first);
+    return Candidates;
+  }
+
+  /// Add a candidate for merging \p ClusterSucc after \p ClusterPred to the
+  /// queue unless the merge is unprofitable.
+  void addMergeCandidate(Cluster *ClusterPred, Cluster *ClusterSucc) {
+    assert(ClusterPred != ClusterSucc && "loop edges are not supported");
+    const double Gain = mergeGain(ClusterPred, ClusterSucc);
+    if (Gain <= 0.0)
+      return;
+
+    MergeCandidate Candidate;
+    Candidate.ClusterPred = ClusterPred;
+    Candidate.ClusterSucc = ClusterSucc;
+    Candidate.PredVersion = Version[ClusterPred->id()];
+    Candidate.SuccVersion = Version[ClusterSucc->id()];
+    Candidate.Gain = Gain;
+    Candidate.Density = density(ClusterPred, ClusterSucc);
+    Candidate.Size = ClusterPred->size() + ClusterSucc->size();
+    Candidate.Samples = ClusterPred->samples() + ClusterSucc->samples();
+    Candidate.PredTarget = ClusterPred->target(0);
+    Candidate.SuccTarget = ClusterSucc->target(0);
+    Queue.push(Candidate);
+  }
+
+  /// Return true if neither of the clusters of \p Candidate has changed since
+  /// the candidate was added to the queue.
+  bool isValid(const MergeCandidate &Candidate) const {
+    const auto *Pred = Candidate.ClusterPred;
+    const auto *Succ = Candidate.ClusterSucc;
+    return Pred->hasId() && Succ->hasId() &&
+           Version[Pred->id()] == Candidate.PredVersion &&
+           Version[Succ->id()] == Candidate.SuccVersion;
+  }
+
+  /// Merge adjacency lists of cluster From into cluster Into.
+  void mergeAdjacent(Cluster *Into, Cluster *From) {
+    auto &IntoAdj = Adjacent[Into->id()];
+    auto &FromAdj = Adjacent[From->id()];
+    for (const auto &AW : FromAdj) {
+      auto *Other = AW.first;
+      if (Other == Into)
+        continue;
+      IntoAdj[Other] += AW.second;
+      auto &OtherAdj = Adjacent[Other->id()];
+      OtherAdj.erase(From);
+      OtherAdj[Into] += AW.second;
+    }
+    IntoAdj.erase(From);
+    FromAdj.clear();
+  }
+
+  /// Merge cluster From into cluster Into. The cluster From stays in the list
+  /// of active clusters until removeMergedClusters() is called.
   void mergeClusters(Cluster *Into, Cluster *From) {
     // The adjacency merge must happen before the Cluster::merge since that
     // clobbers the contents of From.
-    Adjacent.merge(Into, From);
+    mergeAdjacent(Into, From);
 
-    Into->merge(*From);
-    From->clear();
+    // Functions are aligned in the output binary,
+    // replicating the effect here using BinaryFunction::MinAlign
+    const auto Align = BinaryFunction::MinAlign;
+    auto alignAddr = [&](size_t Address) {
+      return ((Address + Align - 1) / Align) * Align;
+    };
 
-    // Update the clusters and addresses for functions merged from From.
+    // Functions merged from From are placed after the ones of Into, so only
+    // their addresses change.
     size_t CurAddr = 0;
-    for (auto TargetId : Into->targets()) {
-      FuncCluster[TargetId] = Into;
+    if (Into->numTargets() > 0) {
+      const auto LastId = Into->targets().back();
+      CurAddr = alignAddr(Addr[LastId] + Cg.size(LastId));
+    }
+    for (auto TargetId : From->targets()) {
       Addr[TargetId] = CurAddr;
-      CurAddr += Cg.size(TargetId);
-      // Functions are aligned in the output binary,
-      // replicating the effect here using BinaryFunction::MinAlign
-      const auto Align = BinaryFunction::MinAlign;
-      CurAddr = ((CurAddr + Align - 1) / Align) * Align;
+      CurAddr = alignAddr(CurAddr + Cg.size(TargetId));
     }
 
-    // Invalidate all cache entries associated with cluster Into
-    if (UseGainCache) {
-      GainCache.invalidate(Into);
+    // The short calls of the merged cluster are the ones within Into and From,
+    // which keep their relative addresses, and the ones between the two.
+    double Calls = ShortCalls[Into->id()] + ShortCalls[From->id()];
+    for (auto TargetId : From->targets()) {
+      for (auto Succ : Cg.successors(TargetId)) {
+        if (FuncCluster[Succ] == Into) {
+          const auto &Arc = *Cg.findArc(TargetId, Succ);
+          auto SrcAddr = Addr[TargetId] + Arc.avgCallOffset();
+          Calls += expectedCalls(SrcAddr, Addr[Succ], Arc.weight());
+        }
+      }
+      for (auto Pred : Cg.predecessors(TargetId)) {
+        if (FuncCluster[Pred] == Into) {
+          const auto &Arc = *Cg.findArc(Pred, TargetId);
+          auto SrcAddr = Addr[Pred] + Arc.avgCallOffset();
+          Calls += expectedCalls(SrcAddr, Addr[TargetId], Arc.weight());
+        }
+      }
     }
+    ShortCalls[Into->id()] = Calls;
+
+    for (auto TargetId : From->targets())
+      FuncCluster[TargetId] = Into;
+
+    Into->merge(*From);
+    From->clear();
 
-    // Remove cluster From from the list of active clusters
-    auto Iter = std::remove(Clusters.begin(), Clusters.end(), From);
+    // Invalidate merge candidates associated with cluster Into
+    ++Version[Into->id()];
+  }
+
+  /// Remove clusters merged into other clusters from the list of active
+  /// clusters.
+  void removeMergedClusters() {
+    auto Iter = std::remove_if(Clusters.begin(), Clusters.end(),
+                               [](const Cluster *C) { return !C->hasId(); });
     Clusters.erase(Iter, Clusters.end());
   }
 
@@ -492,27 +648,112 @@ private:
   // udpated at runtime when clusters are merged.
   std::vector<Cluster *> Clusters;
 
-  // Cluster adjacency matrix
-  AdjacencyMatrix<Cluster> Adjacent;
+  // Cluster id => adjacent clusters and the total weight of calls between them
+  std::vector<std::unordered_map<Cluster *, double>> Adjacent;
+
+  // Cluster id => the expected number of short calls within the cluster
+  std::vector<double> ShortCalls;
 
-  // Use cache for mergeGain results
-  bool UseGainCache;
+  // Cluster id => the number of merges into the cluster, used to detect stale
+  // merge candidates
+  std::vector<uint32_t> Version;
 
-  // A cache that keeps precomputed values of mergeGain for pairs of clusters;
-  // when a pair of clusters (x,y) gets merged, we need to invalidate the pairs
-  // containing both x and y and all clusters adjacent to x and y (and recompute
-  // them on the next iteration).
-  mutable ClusterPairCache<Cluster, double> GainCache;
+  // Profitable merge candidates with the largest gain at the top
+  std::priority_queue<MergeCandidate, std::vector<MergeCandidate>,
+                      CompareMergeCandidates> Queue;
 };
 
+/// Split the nodes of \p Cg into \p NumBatches sets of weakly connected
+/// components with similar numbers of functions. Nodes of every set are in
+/// increasing order.
+std::vector<std::vector<NodeId>> partitionCallGraph(const CallGraph &Cg,
+                                                    size_t NumBatches) {
+  EquivalenceClasses<NodeId> Components;
+  for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+    Components.insert(F);
+    for (auto Succ : Cg.successors(F))
+      Components.unionSets(F, Succ);
+  }
+
+  std::vector<std::vector<NodeId>> ComponentNodes;
+  for (auto I = Components.begin(), E = Components.end(); I != E; ++I) {
+    if (!I->isLeader())
+      continue;
+    ComponentNodes.emplace_back(Components.member_begin(I),
+                                Components.member_end());
+  }
+
+  // Assign the largest components first, each to the smallest batch.
+  std::stable_sort(ComponentNodes.begin(), ComponentNodes.end(),
+                   [](const std::vector<NodeId> &A,
+                      const std::vector<NodeId> &B) {
+                     if (A.size() != B.size())
+                       return A.size() > B.size();
+                     return *std::min_element(A.begin(), A.end()) <
+                            *std::min_element(B.begin(), B.end());
+                   });
+  std::vector<std::vector<NodeId>> Batches(NumBatches);
+  for (auto &Nodes : ComponentNodes) {
+    auto &Batch = *std::min_element(
+        Batches.begin(), Batches.end(),
+        [](const std::vector<NodeId> &A, const std::vector<NodeId> &B) {
+          return A.size() < B.size();
+        });
+    Batch.insert(Batch.end(), Nodes.begin(), Nodes.end());
+  }
+  for (auto &Batch : Batches)
+    std::sort(Batch.begin(), Batch.end());
+  return Batches;
+}
+
 } // end namespace anonymous
 
-std::vector<Cluster> hfsortPlus(CallGraph &Cg, bool UseGainCache) {
+std::vector<Cluster> hfsortPlus(CallGraph &Cg) {
   // It is required that the sum of incoming arc weights is not greater
   // than the number of samples for every function.
   // Ensuring the call graph obeys the property before running the algorithm.
   Cg.adjustArcWeights();
-  return HFSortPlus(Cg, UseGainCache).run();
+
+  outs() << "BOLT-INFO: running hfsort+ for " << Cg.numNodes() << " functions\n";
+
+  ITLBPageSize = opts::ITLBPageSize;
+  ITLBEntries = opts::ITLBEntries;
+
+  double TotalSamples = 0.0;
+  for (NodeId F = 0; F < Cg.numNodes(); ++F)
+    TotalSamples += Cg.samples(F);
+
+  if (!opts::HFSortPlusPartition || !ParallelUtilities::isParallel()) {
+    std::vector<NodeId> Nodes(Cg.numNodes());
+    std::iota(Nodes.begin(), Nodes.end(), 0);
+    return HFSortPlus(Cg, Nodes, TotalSamples).run();
+  }
+
+  // Clusters are only merged along arcs of the graph, and the gain of a merge
+  // only depends on the two clusters and the total number of samples. Hence
+  // clustering the components separately yields the same clusters as
+  // clustering the whole graph.
+  auto Batches = partitionCallGraph(Cg, ParallelUtilities::getThreadCount());
+  std::vector<std::vector<Cluster>> BatchClusters(Batches.size());
+  auto &ThPool = ParallelUtilities::getThreadPool();
+  for (size_t I = 0; I < Batches.size(); ++I) {
+    if (Batches[I].empty())
+      continue;
+    ThPool.async([&, I]() {
+      BatchClusters[I] = HFSortPlus(Cg, Batches[I], TotalSamples).run();
+    });
+  }
+  ThPool.wait();
+
+  std::vector<Cluster> Clusters;
+  for (auto &BC : BatchClusters) {
+    std::move(BC.begin(), BC.end(), std::back_inserter(Clusters));
+  }
+  std::stable_sort(Clusters.begin(), Clusters.end(),
+                   [](const Cluster &C1, const Cluster &C2) {
+                     return compareClusters(&C1, &C2);
+                   });
+  return Clusters;
 }
 
 }}
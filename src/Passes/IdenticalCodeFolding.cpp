@@ -11,10 +11,14 @@
 
 
 #include "Passes/IdenticalCodeFolding.h"
+#include "ParallelUtilities.h"
+#include "PhaseStats.h"
 #include "llvm/Support/Options.h"
+#include "llvm/Support/ThreadPool.h"
 #include <map>
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
 
 #define DEBUG_TYPE "bolt-icf"
 
@@ -276,6 +280,50 @@ bool isIdenticalWith(const BinaryFunction &A, const BinaryFunction &B,
 
   return true;
 }
+
+/// Return true if \p Expr references a function from \p Functions. Target
+/// expressions are conservatively assumed to reference one.
+bool referencesFunctions(
+    const BinaryContext &BC, const MCExpr &Expr,
+    const std::unordered_set<const BinaryFunction *> &Functions) {
+  switch (Expr.getKind()) {
+  case MCExpr::Constant:
+    return false;
+  case MCExpr::SymbolRef:
+    return Functions.count(BC.getFunctionForSymbol(
+        &cast<MCSymbolRefExpr>(Expr).getSymbol()));
+  case MCExpr::Unary:
+    return referencesFunctions(BC, *cast<MCUnaryExpr>(Expr).getSubExpr(),
+                               Functions);
+  case MCExpr::Binary: {
+    const auto &BinaryExpr = cast<MCBinaryExpr>(Expr);
+    return referencesFunctions(BC, *BinaryExpr.getLHS(), Functions) ||
+           referencesFunctions(BC, *BinaryExpr.getRHS(), Functions);
+  }
+  case MCExpr::Target:
+    return true;
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+/// Return true if any instruction of \p BF references a function from
+/// \p Functions.
+bool referencesFunctions(
+    const BinaryFunction &BF,
+    const std::unordered_set<const BinaryFunction *> &Functions) {
+  const auto &BC = BF.getBinaryContext();
+  for (const auto *BB : BF.layout()) {
+    for (const auto &Inst : *BB) {
+      for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I) {
+        const auto &Op = Inst.getOperand(I);
+        if (Op.isExpr() && referencesFunctions(BC, *Op.getExpr(), Functions))
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
 }
 
 namespace llvm {
@@ -308,24 +356,39 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC,
     }
   };
 
+  // Pre-compute hashes before pushing functions into the hashtable. Make sure
+  // indices are in-order as they are used for comparing functions.
+  auto HashStats = llvm::make_unique<PhaseStats::Scope>("icf-hash");
+  ParallelUtilities::runOnEachFunction(
+      BFs, ParallelUtilities::SP_INST_LINEAR,
+      [&](BinaryFunction &BF) {
+        BF.updateLayoutIndices();
+        BF.hash(/*Recompute=*/true, opts::UseDFS);
+      },
+      [&](const BinaryFunction &BF) {
+        return !shouldOptimize(BF) || BF.isFolded() || BF.isClone();
+      },
+      "ICF hashing");
+  HashStats.reset();
+
   // Create buckets with congruent functions - functions that potentially could
   // be folded.
   std::unordered_map<BinaryFunction *, std::set<BinaryFunction *>,
                      KeyHash, KeyCongruent> CongruentBuckets;
   for (auto &BFI : BFs) {
     auto &BF = BFI.second;
-    if (!shouldOptimize(BF) || BF.isFolded())
+    // Clones have the same code as the function they were made from.
+    if (!shouldOptimize(BF) || BF.isFolded() || BF.isClone())
       continue;
 
-    // Make sure indices are in-order.
-    BF.updateLayoutIndices();
-
-    // Pre-compute hash before pushing into hashtable.
-    BF.hash(/*Recompute=*/true, opts::UseDFS);
-
     CongruentBuckets[&BF].emplace(&BF);
   }
 
+  // Functions that other functions were folded into during the last
+  // iteration. Folding only changes the result of comparing functions that
+  // reference them.
+  std::unordered_set<const BinaryFunction *> FoldedIntoFunctions;
+
   // We repeat the pass until no new modifications happen.
   unsigned Iteration = 1;
   uint64_t NumFoldedLastIteration;
@@ -334,31 +397,70 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC,
 
     DEBUG(dbgs() << "BOLT-DEBUG: ICF iteration " << Iteration << "...\n");
 
+    std::vector<std::set<BinaryFunction *> *> Buckets;
     for (auto &CBI : CongruentBuckets) {
-      auto &Candidates = CBI.second;
-      if (Candidates.size() < 2)
-        continue;
-
-      // Identical functions go into the same bucket.
-      std::unordered_map<BinaryFunction *, std::vector<BinaryFunction *>,
-                         KeyHash, KeyEqual> IdenticalBuckets;
-      for (auto *BF : Candidates) {
-        IdenticalBuckets[BF].emplace_back(BF);
-      }
+      if (CBI.second.size() >= 2)
+        Buckets.push_back(&CBI.second);
+    }
 
-      for (auto &IBI : IdenticalBuckets) {
-        // Functions identified as identical.
-        auto &Twins = IBI.second;
-        if (Twins.size() < 2)
+    // Groups of identical functions in every bucket. Buckets have disjoint
+    // sets of functions and are compared independently. Folding modifies
+    // the global state and is done afterwards.
+    std::vector<std::vector<std::vector<BinaryFunction *>>>
+      BucketTwins(Buckets.size());
+    auto processBuckets = [&](size_t Begin, size_t End) {
+      for (auto I = Begin; I != End; ++I) {
+        auto &Candidates = *Buckets[I];
+        if (Iteration > 1 &&
+            std::none_of(Candidates.begin(), Candidates.end(),
+                         [&](const BinaryFunction *BF) {
+                           return referencesFunctions(*BF,
+                                                      FoldedIntoFunctions);
+                         }))
           continue;
 
-        // Fold functions. Keep the order consistent across invocations with
-        // different options.
-        std::stable_sort(Twins.begin(), Twins.end(),
-            [](const BinaryFunction *A, const BinaryFunction *B) {
-              return A->getFunctionNumber() < B->getFunctionNumber();
-            });
+        // Identical functions go into the same bucket.
+        std::unordered_map<BinaryFunction *, std::vector<BinaryFunction *>,
+                           KeyHash, KeyEqual> IdenticalBuckets;
+        for (auto *BF : Candidates) {
+          IdenticalBuckets[BF].emplace_back(BF);
+        }
 
+        for (auto &IBI : IdenticalBuckets) {
+          // Functions identified as identical.
+          auto &Twins = IBI.second;
+          if (Twins.size() < 2)
+            continue;
+
+          // Keep the order consistent across invocations with different
+          // options.
+          std::stable_sort(Twins.begin(), Twins.end(),
+              [](const BinaryFunction *A, const BinaryFunction *B) {
+                return A->getFunctionNumber() < B->getFunctionNumber();
+              });
+          BucketTwins[I].emplace_back(std::move(Twins));
+        }
+      }
+    };
+
+    if (ParallelUtilities::isParallel()) {
+      auto &ThPool = ParallelUtilities::getThreadPool();
+      const size_t BlockSize = std::max<size_t>(
+          1, Buckets.size() / (ParallelUtilities::getThreadCount() * 20));
+      for (size_t Begin = 0; Begin < Buckets.size(); Begin += BlockSize) {
+        ThPool.async(processBuckets, Begin,
+                     std::min(Buckets.size(), Begin + BlockSize));
+      }
+      ThPool.wait();
+    } else {
+      processBuckets(0, Buckets.size());
+    }
+
+    FoldedIntoFunctions.clear();
+    for (unsigned I = 0; I < Buckets.size(); ++I) {
+      auto &Candidates = *Buckets[I];
+      for (auto &Twins : BucketTwins[I]) {
+        // Fold functions.
         BinaryFunction *ParentBF = Twins[0];
         for (unsigned i = 1; i < Twins.size(); ++i) {
           auto *ChildBF = Twins[i];
@@ -382,8 +484,8 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC,
           if (ParentBF->hasJumpTables())
             ++NumJTFunctionsFolded;
         }
+        FoldedIntoFunctions.insert(ParentBF);
       }
-
     }
     NumFunctionsFolded += NumFoldedLastIteration;
     ++Iteration;
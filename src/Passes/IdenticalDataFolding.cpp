@@ -0,0 +1,236 @@
+//===--- Passes/IdenticalDataFolding.cpp - Fold identical read-only data --===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "IdenticalDataFolding.h"
+#include "llvm/MC/MCExpr.h"
+#include "llvm/Support/Options.h"
+#include <unordered_map>
+
+#define DEBUG_TYPE "bolt-icf-data"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace {
+
+using RelocationRange =
+  iterator_range<std::vector<Relocation>::const_iterator>;
+
+/// Return the relocations of the section of \p BD that are within \p BD.
+RelocationRange getRelocations(const BinaryData &BD) {
+  const auto &Section = BD.getSection();
+  const auto Relocations = Section.relocations();
+  const auto Offset = BD.getAddress() - Section.getAddress();
+  auto Begin = std::lower_bound(Relocations.begin(), Relocations.end(),
+                                Relocation{Offset, 0, 0, 0, 0});
+  auto End = std::lower_bound(Begin, Relocations.end(),
+                              Relocation{Offset + BD.getSize(), 0, 0, 0, 0});
+  return make_range(Begin, End);
+}
+
+/// Return the contents of \p BD in the input binary.
+StringRef getContents(const BinaryData &BD) {
+  const auto &Section = BD.getSection();
+  return Section.getContents().substr(BD.getAddress() - Section.getAddress(),
+                                      BD.getSize());
+}
+
+} // anonymous namespace
+
+namespace llvm {
+namespace bolt {
+
+const void *IdenticalDataFolding::getTarget(const BinaryContext &BC,
+                                            const MCSymbol *Symbol) const {
+  if (const auto *BF = BC.getFunctionForSymbol(Symbol))
+    return BF;
+  if (const auto *BD = BC.getBinaryDataByName(Symbol->getName())) {
+    auto FI = FoldedInto.find(BD);
+    return FI != FoldedInto.end() ? FI->second : BD;
+  }
+  return Symbol;
+}
+
+bool IdenticalDataFolding::isIdentical(const BinaryContext &BC,
+                                       const BinaryData &A,
+                                       const BinaryData &B) const {
+  if (A.getSize() != B.getSize())
+    return false;
+
+  const auto RelocsA = getRelocations(A);
+  const auto RelocsB = getRelocations(B);
+  if (std::distance(RelocsA.begin(), RelocsA.end()) !=
+      std::distance(RelocsB.begin(), RelocsB.end()))
+    return false;
+
+  // Bytes covered by relocations hold the resolved values, which differ
+  // between the objects even when the targets are the same.
+  const auto ContentsA = getContents(A);
+  const auto ContentsB = getContents(B);
+  const auto BaseA = A.getAddress() - A.getSection().getAddress();
+  const auto BaseB = B.getAddress() - B.getSection().getAddress();
+  uint64_t Offset = 0;
+  for (auto RA = RelocsA.begin(), RB = RelocsB.begin(); RA != RelocsA.end();
+       ++RA, ++RB) {
+    const auto RelOffset = RA->Offset - BaseA;
+    if (RelOffset != RB->Offset - BaseB ||
+        RA->Type != RB->Type ||
+        RA->Addend != RB->Addend)
+      return false;
+
+    if (RA->Symbol != RB->Symbol &&
+        getTarget(BC, RA->Symbol) != getTarget(BC, RB->Symbol))
+      return false;
+
+    if (ContentsA.substr(Offset, RelOffset - Offset) !=
+        ContentsB.substr(Offset, RelOffset - Offset))
+      return false;
+    Offset = RelOffset + RA->getSize();
+  }
+
+  return ContentsA.substr(Offset) == ContentsB.substr(Offset);
+}
+
+void IdenticalDataFolding::redirectReferences(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs) {
+  DenseMap<const MCSymbol *, MCSymbol *> SymbolMap;
+  for (const auto &FI : FoldedInto) {
+    for (const auto *Symbol : FI.first->symbols())
+      SymbolMap[Symbol] = FI.second->getSymbol();
+  }
+
+  // Only plain references are redirected. Other kinds, e.g. through the GOT,
+  // keep referencing the folded object, which stays in place.
+  for (auto &BFI : BFs) {
+    auto &Function = BFI.second;
+    if (!Function.isSimple() || !Function.hasCFG())
+      continue;
+
+    for (auto &BB : Function) {
+      for (auto &Inst : BB) {
+        for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E;
+             ++I) {
+          auto &Operand = Inst.getOperand(I);
+          if (!Operand.isExpr())
+            continue;
+
+          const MCExpr *Expr = Operand.getExpr();
+          const MCConstantExpr *Offset = nullptr;
+          if (const auto *BinExpr = dyn_cast<MCBinaryExpr>(Expr)) {
+            Offset = dyn_cast<MCConstantExpr>(BinExpr->getRHS());
+            if (BinExpr->getOpcode() != MCBinaryExpr::Add || !Offset)
+              continue;
+            Expr = BinExpr->getLHS();
+          }
+          const auto *SymExpr = dyn_cast<MCSymbolRefExpr>(Expr);
+          if (!SymExpr || SymExpr->getKind() != MCSymbolRefExpr::VK_None)
+            continue;
+          auto SI = SymbolMap.find(&SymExpr->getSymbol());
+          if (SI == SymbolMap.end())
+            continue;
+
+          const MCExpr *NewExpr =
+            MCSymbolRefExpr::create(SI->second, MCSymbolRefExpr::VK_None,
+                                    *BC.Ctx);
+          if (Offset)
+            NewExpr = MCBinaryExpr::createAdd(NewExpr, Offset, *BC.Ctx);
+          Operand = MCOperand::createExpr(NewExpr);
+          ++NumRedirectedRefs;
+        }
+      }
+    }
+  }
+
+  for (auto &Section : BC.sections()) {
+    if (!Section.isAllocatable() || Section.isText())
+      continue;
+    for (auto &Relocation : Section.relocations()) {
+      auto SI = SymbolMap.find(Relocation.Symbol);
+      if (SI == SymbolMap.end())
+        continue;
+      Relocation.Symbol = SI->second;
+      ++NumRedirectedRefs;
+    }
+  }
+}
+
+void IdenticalDataFolding::runOnFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::set<uint64_t> &) {
+  // All references to data are only known in relocation mode.
+  if (!BC.HasRelocations)
+    return;
+
+  std::unordered_map<uint64_t, std::vector<BinaryData *>> Buckets;
+  for (auto &Section : BC.sections()) {
+    if (!Section.isReadOnly() || Section.isText() || !Section.hasSectionRef())
+      continue;
+
+    for (auto &Entry : BC.getBinaryDataForSection(Section)) {
+      auto *BD = Entry.second;
+      if (BD->getParent() || !BD->isObject() || !BD->getSize() ||
+          BD->isAbsolute() || BD->nameStartsWith("HOLEat"))
+        continue;
+      Buckets[Section.hash(*BD)].push_back(BD);
+    }
+  }
+
+  // Objects referencing other objects become identical once the referenced
+  // ones are folded, so repeat until nothing changes.
+  bool Changed;
+  do {
+    Changed = false;
+    for (auto &Bucket : Buckets) {
+      auto &Objects = Bucket.second;
+      if (Objects.size() < 2)
+        continue;
+
+      std::vector<BinaryData *> Kept;
+      for (auto *BD : Objects) {
+        if (FoldedInto.count(BD))
+          continue;
+        auto KI = std::find_if(Kept.begin(), Kept.end(),
+                               [&](const BinaryData *Other) {
+                                 return isIdentical(BC, *Other, *BD);
+                               });
+        if (KI == Kept.end()) {
+          Kept.push_back(BD);
+          continue;
+        }
+
+        DEBUG(dbgs() << "BOLT-DEBUG: folding " << *BD << " into " << **KI
+                     << '\n');
+        for (auto &FI : FoldedInto) {
+          if (FI.second == BD)
+            FI.second = *KI;
+        }
+        FoldedInto[BD] = *KI;
+        ++NumFolded;
+        NumFoldedBytes += BD->getSize();
+        Changed = true;
+      }
+    }
+  } while (Changed);
+
+  if (FoldedInto.empty())
+    return;
+
+  redirectReferences(BC, BFs);
+
+  outs() << "BOLT-INFO: ICF folded " << NumFolded << " read-only objects of "
+         << NumFoldedBytes << " bytes, redirecting " << NumRedirectedRefs
+         << " references\n";
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,74 @@
+//===--- Passes/IdenticalDataFolding.h - Fold identical read-only data ----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Find objects in read-only data sections with identical contents, such as
+// string literals, lookup tables, or virtual tables of identical template
+// instances, and make the code and the data referencing them use a single
+// copy. Relocations inside the objects are compared by their targets, with
+// functions folded by ICF and objects folded by this pass considered equal.
+//
+// The folded copies stay in place, so references that cannot be updated,
+// e.g. from functions without a CFG, keep working. Only the references
+// seen by BOLT move to the kept copy, which shrinks the amount of hot data.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_IDENTICAL_DATA_FOLDING_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_IDENTICAL_DATA_FOLDING_H
+
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "Passes/BinaryPasses.h"
+#include "llvm/ADT/DenseMap.h"
+
+namespace llvm {
+namespace bolt {
+
+class IdenticalDataFolding : public BinaryFunctionPass {
+  /// Objects folded into another one, mapped to the object they were folded
+  /// into.
+  DenseMap<const BinaryData *, BinaryData *> FoldedInto;
+
+  /// Statistics.
+  uint64_t NumFolded{0};
+  uint64_t NumFoldedBytes{0};
+  uint64_t NumRedirectedRefs{0};
+
+  /// Return the object, function, or symbol that references to \p Symbol
+  /// resolve to, considering the objects and functions folded so far.
+  const void *getTarget(const BinaryContext &BC, const MCSymbol *Symbol) const;
+
+  /// Return true if \p A and \p B have the same contents, and relocations
+  /// of the same type at the same offsets with equal targets.
+  bool isIdentical(const BinaryContext &BC,
+                   const BinaryData &A,
+                   const BinaryData &B) const;
+
+  /// Make the instructions of functions in \p BFs and the relocations of
+  /// data sections reference the objects that folded objects were folded
+  /// into.
+  void redirectReferences(BinaryContext &BC,
+                          std::map<uint64_t, BinaryFunction> &BFs);
+
+public:
+  explicit IdenticalDataFolding(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "identical-data-folding";
+  }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -102,6 +102,27 @@ EliminateLoads(
     cl::ZeroOrMore,
     cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+ICPVtableProfile(
+    "icp-vtable-profile",
+    cl::desc("select the targets of virtual calls from the memory profile of "
+             "the vtable load and compare against the hot vtables instead of "
+             "the method addresses"),
+    cl::init(false),
+    cl::ZeroOrMore,
+    cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ICPVtableMissCost(
+    "icp-vtable-miss-cost",
+    cl::desc("cost of falling back to the original virtual call, in vtable "
+             "compares, used to decide how many vtables to check with "
+             "-icp-vtable-profile"),
+    cl::init(4),
+    cl::ZeroOrMore,
+    cl::Hidden,
+    cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 ICPTopCallsites(
     "icp-top-callsites",
@@ -538,25 +559,22 @@ IndirectCallPromotion::findCallTargetSymbols(
   return SymTargets;
 }
 
-IndirectCallPromotion::MethodInfoType
-IndirectCallPromotion::maybeGetVtableSyms(
+bool IndirectCallPromotion::analyzeMethodFetch(
    BinaryContext &BC,
    BinaryFunction &Function,
    BinaryBasicBlock *BB,
    MCInst &Inst,
-   const SymTargetsType &SymTargets
+   std::vector<MCInst *> &MethodFetchInsns,
+   uint64_t &MethodOffset,
+   uint64_t &DataOffset
 ) const {
-  const auto *MemData = Function.getMemData();
-  std::vector<std::pair<MCSymbol *, uint64_t>> VtableSyms;
-  std::vector<MCInst *> MethodFetchInsns;
   unsigned VtableReg, MethodReg;
-  uint64_t MethodOffset;
 
   assert(!Function.getJumpTable(Inst) &&
          "Can't get vtable addrs for jump tables.");
 
-  if (!MemData || !opts::EliminateLoads)
-    return MethodInfoType();
+  if (!Function.getMemData() || !opts::EliminateLoads)
+    return false;
 
   MutableArrayRef<MCInst> Insts(&BB->front(), &Inst + 1);
   if (!BC.MIB->analyzeVirtualMethodCall(Insts.begin(),
@@ -568,7 +586,7 @@ IndirectCallPromotion::maybeGetVtableSyms(
     DEBUG_VERBOSE(1, dbgs() << "BOLT-INFO: ICP unable to analyze method call in "
                             << Function << " at @ " << (&Inst - &BB->front())
                             << "\n");
-    return MethodInfoType();
+    return false;
   }
 
   ++TotalMethodLoadEliminationCandidates;
@@ -586,26 +604,60 @@ IndirectCallPromotion::maybeGetVtableSyms(
   );
 
   // Try to get value profiling data for the method load instruction.
-  auto DataOffset = BC.MIB->tryGetAnnotationAs<uint64_t>(*MethodFetchInsns.back(),
-                                                         "MemDataOffset");
+  auto Offset = BC.MIB->tryGetAnnotationAs<uint64_t>(*MethodFetchInsns.back(),
+                                                     "MemDataOffset");
 
-  if (!DataOffset) {
+  if (!Offset) {
     DEBUG_VERBOSE(1, dbgs() << "BOLT-INFO: ICP no memory profiling data found\n");
-    return MethodInfoType();
+    return false;
   }
+  DataOffset = Offset.get();
+
+  // Make sure the vtable reg is not clobbered by the argument passing code
+  if (VtableReg != MethodReg) {
+    for (auto *CurInst = MethodFetchInsns.front(); CurInst < &Inst; ++CurInst) {
+      const auto &InstrInfo = BC.MII->get(CurInst->getOpcode());
+      if (InstrInfo.hasDefOfPhysReg(*CurInst, VtableReg, *BC.MRI)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+uint64_t
+IndirectCallPromotion::getMethodLoadAddress(BinaryContext &BC,
+                                            const MemInfo &MI) const {
+  if (MI.Addr.IsSymbol) {
+    auto *BD = BC.getBinaryDataByName(MI.Addr.Name);
+    return BD ? BD->getAddress() + MI.Addr.Offset : 0;
+  }
+  return MI.Addr.Offset;
+}
+
+IndirectCallPromotion::MethodInfoType
+IndirectCallPromotion::maybeGetVtableSyms(
+   BinaryContext &BC,
+   BinaryFunction &Function,
+   BinaryBasicBlock *BB,
+   MCInst &Inst,
+   const SymTargetsType &SymTargets
+) const {
+  std::vector<std::pair<MCSymbol *, uint64_t>> VtableSyms;
+  std::vector<MCInst *> MethodFetchInsns;
+  uint64_t MethodOffset;
+  uint64_t DataOffset;
+
+  if (!analyzeMethodFetch(BC, Function, BB, Inst, MethodFetchInsns,
+                          MethodOffset, DataOffset))
+    return MethodInfoType();
 
   // Find the vtable that each method belongs to.
   std::map<const MCSymbol *, uint64_t> MethodToVtable;
 
-  for (auto &MI : MemData->getMemInfoRange(DataOffset.get())) {
-    uint64_t Address;
-
-    if (MI.Addr.IsSymbol) {
-      auto *BD = BC.getBinaryDataByName(MI.Addr.Name);
-      Address = BD ? BD->getAddress() + MI.Addr.Offset : 0;
-    } else {
-      Address = MI.Addr.Offset;
-    }
+  for (auto &MI : Function.getMemData()->getMemInfoRange(DataOffset)) {
+    const auto Address = getMethodLoadAddress(BC, MI);
 
     // Ignore bogus data.
     if (!Address)
@@ -649,17 +701,127 @@ IndirectCallPromotion::maybeGetVtableSyms(
     return MethodInfoType();
   }
 
-  // Make sure the vtable reg is not clobbered by the argument passing code
-  if (VtableReg != MethodReg) {
-    for (auto *CurInst = MethodFetchInsns.front(); CurInst < &Inst; ++CurInst) {
-      const auto &InstrInfo = BC.MII->get(CurInst->getOpcode());
-      if (InstrInfo.hasDefOfPhysReg(*CurInst, VtableReg, *BC.MRI)) {
-        return MethodInfoType();
-      }
+  return MethodInfoType(VtableSyms, MethodFetchInsns);
+}
+
+bool IndirectCallPromotion::maybeGetHotVtableTargets(
+   BinaryContext &BC,
+   BinaryFunction &Function,
+   BinaryBasicBlock *BB,
+   MCInst &Inst,
+   std::vector<Callsite> &Targets,
+   SymTargetsType &SymTargets,
+   MethodInfoType &MethodInfo
+) const {
+  std::vector<MCInst *> MethodFetchInsns;
+  uint64_t MethodOffset;
+  uint64_t DataOffset;
+
+  if (!analyzeMethodFetch(BC, Function, BB, Inst, MethodFetchInsns,
+                          MethodOffset, DataOffset))
+    return false;
+
+  // Sample counts and methods of the vtables loaded by the method fetch.
+  // Samples for unknown methods only contribute to the total.
+  std::map<uint64_t, std::pair<MCSymbol *, uint64_t>> VtableMap;
+  uint64_t TotalSamples = 0;
+  for (auto &MI : Function.getMemData()->getMemInfoRange(DataOffset)) {
+    const auto Address = getMethodLoadAddress(BC, MI);
+    if (!Address)
+      continue;
+
+    TotalSamples += MI.Count;
+
+    auto MethodAddr = BC.extractPointerAtAddress(Address);
+    if (!MethodAddr)
+      continue;
+    auto *MethodBD = BC.getBinaryDataAtAddress(MethodAddr.get());
+    if (!MethodBD)
+      continue;
+
+    auto &Entry = VtableMap[Address - MethodOffset];
+    Entry.first = MethodBD->getSymbol();
+    Entry.second += MI.Count;
+  }
+
+  if (!TotalSamples)
+    return false;
+
+  std::vector<std::pair<uint64_t, uint64_t>> HotVtables;
+  for (const auto &Entry : VtableMap)
+    HotVtables.emplace_back(Entry.second.second, Entry.first);
+  std::sort(HotVtables.rbegin(), HotVtables.rend());
+
+  size_t TopN = opts::IndirectCallPromotionTopN;
+  if (opts::IndirectCallPromotionCallsTopN != 0)
+    TopN = opts::IndirectCallPromotionCallsTopN;
+
+  uint64_t NumCalls = 0;
+  uint64_t NumMispreds = 0;
+  for (const auto &Target : Targets) {
+    NumCalls += Target.Branches;
+    NumMispreds += Target.Mispreds;
+  }
+
+  // Every vtable compare is an inline cache check executed by all the calls
+  // that missed the previous ones. Checking one more vtable saves the calls
+  // that hit it the cost of the original indirect call, while the calls that
+  // still miss pay for one more compare. Add vtables as long as that is a win.
+  std::vector<Callsite> NewTargets;
+  uint64_t PromotedCalls = 0;
+  uint64_t PromotedMispreds = 0;
+  double Remaining = 1.0;
+  for (const auto &HotVtable : HotVtables) {
+    if (NewTargets.size() >= TopN)
+      break;
+
+    const double Share = double(HotVtable.first) / TotalSamples;
+    if (Share * opts::ICPVtableMissCost <= Remaining)
+      break;
+
+    auto *BD = BC.getBinaryDataContainingAddress(HotVtable.second);
+    if (!BD) {
+      DEBUG_VERBOSE(1, dbgs() << "BOLT-INFO: ICP can't find vtable at 0x"
+                              << Twine::utohexstr(HotVtable.second) << "\n");
+      continue;
     }
+
+    auto *MethodSym = VtableMap[HotVtable.second].first;
+    Remaining -= Share;
+
+    Callsite Site = Targets.front();
+    Site.To = Location(MethodSym);
+    Site.Branches = uint64_t(NumCalls * Share);
+    Site.Mispreds = uint64_t(NumMispreds * Share);
+    PromotedCalls += Site.Branches;
+    PromotedMispreds += Site.Mispreds;
+    NewTargets.emplace_back(std::move(Site));
+
+    SymTargets.push_back(std::make_pair(MethodSym, 0));
+    MethodInfo.first.push_back(
+        std::make_pair(BD->getSymbol(), HotVtable.second - BD->getAddress()));
+
+    DEBUG(dbgs() << "BOLT-INFO: ICP hot vtable " << BD->getName() << "+"
+                 << (HotVtable.second - BD->getAddress()) << " -> "
+                 << MethodSym->getName() << " ("
+                 << format("%.1f", 100.0 * Share) << "% of samples)\n");
   }
 
-  return MethodInfoType(VtableSyms, MethodFetchInsns);
+  if (NewTargets.empty()) {
+    SymTargets.clear();
+    MethodInfo.first.clear();
+    return false;
+  }
+
+  // The calls left for the original indirect call.
+  Callsite Rest = Targets.front();
+  Rest.Branches = NumCalls - std::min(NumCalls, PromotedCalls);
+  Rest.Mispreds = NumMispreds - std::min(NumMispreds, PromotedMispreds);
+  NewTargets.emplace_back(std::move(Rest));
+
+  MethodInfo.second = std::move(MethodFetchInsns);
+  std::swap(Targets, NewTargets);
+  return true;
 }
 
 std::vector<std::unique_ptr<BinaryBasicBlock>>
@@ -1248,7 +1410,7 @@ void IndirectCallPromotion::runOnFunctions(
     if (BBs.empty())
       continue;
 
-    DataflowInfoManager Info(BC, Function, RA.get(), nullptr);
+    auto &Info = DataflowInfoCache::get(BC, Function, RA.get(), nullptr);
     while (!BBs.empty()) {
       auto *BB = BBs.back();
       BBs.pop_back();
@@ -1323,7 +1485,7 @@ void IndirectCallPromotion::runOnFunctions(
 
         // Find MCSymbols or absolute addresses for each call target.
         MCInst *TargetFetchInst = nullptr;
-        const auto SymTargets = findCallTargetSymbols(BC,
+        auto SymTargets = findCallTargetSymbols(BC,
                                                       Targets,
                                                       N,
                                                       Function,
@@ -1347,7 +1509,16 @@ void IndirectCallPromotion::runOnFunctions(
 
         MethodInfoType MethodInfo;
 
-        if (!IsJumpTable) {
+        if (!IsJumpTable && opts::ICPVtableProfile) {
+          // Replace the method targets with the hot vtables if the vtable
+          // load has a memory profile.
+          SymTargetsType VtableTargets;
+          if (maybeGetHotVtableTargets(BC, Function, BB, Inst, Targets,
+                                       VtableTargets, MethodInfo)) {
+            ++TotalMethodLoadsEliminated;
+            SymTargets = std::move(VtableTargets);
+          }
+        } else if (!IsJumpTable) {
           MethodInfo = maybeGetVtableSyms(BC,
                                           Function,
                                           BB,
@@ -208,12 +208,40 @@ class IndirectCallPromotion : public BinaryFunctionPass {
                                        MCInst &Inst,
                                        MCInst *&TargetFetchInst) const;
 
+  /// Analyze the method fetch of the virtual call \p Inst. On success, fill
+  /// in the fetch instructions, the offset of the method in the vtable and the
+  /// memory profile offset of the method load.
+  bool analyzeMethodFetch(BinaryContext &BC,
+                          BinaryFunction &Function,
+                          BinaryBasicBlock *BB,
+                          MCInst &Inst,
+                          std::vector<MCInst *> &MethodFetchInsns,
+                          uint64_t &MethodOffset,
+                          uint64_t &DataOffset) const;
+
+  /// Return the address read by the method load sample \p MI, or 0.
+  uint64_t getMethodLoadAddress(BinaryContext &BC, const MemInfo &MI) const;
+
   MethodInfoType maybeGetVtableSyms(BinaryContext &BC,
                                     BinaryFunction &Function,
                                     BinaryBasicBlock *BB,
                                     MCInst &Inst,
                                     const SymTargetsType &SymTargets) const;
 
+  /// Select the targets of the virtual call \p Inst from the samples of its
+  /// vtable load. Each hot vtable gets its own compare, so a method shared by
+  /// several vtables may appear more than once. On success, \p Targets is
+  /// replaced with one entry per vtable followed by the calls left for the
+  /// original indirect call, and \p SymTargets and \p MethodInfo are filled
+  /// in for code generation.
+  bool maybeGetHotVtableTargets(BinaryContext &BC,
+                                BinaryFunction &Function,
+                                BinaryBasicBlock *BB,
+                                MCInst &Inst,
+                                std::vector<Callsite> &Targets,
+                                SymTargetsType &SymTargets,
+                                MethodInfoType &MethodInfo) const;
+
   std::vector<std::unique_ptr<BinaryBasicBlock>>
   rewriteCall(BinaryContext &BC,
               BinaryFunction &Function,
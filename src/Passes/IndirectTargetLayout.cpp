@@ -0,0 +1,372 @@
+//===--- Passes/IndirectTargetLayout.cpp - Place hot indirect targets -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "IndirectTargetLayout.h"
+#include "CacheMetrics.h"
+#include "ProfileVariants.h"
+#include "llvm/Support/Options.h"
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+
+#define DEBUG_TYPE "indirect-target-layout"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool>
+IndirectTargetLayout("indirect-target-layout",
+  cl::desc("place the hot targets of jump tables and of indirect calls "
+           "right after their dispatch sites when it does not lower the "
+           "ExtTSP score of the layout"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+IndirectTargetMinShare("indirect-target-min-share",
+  cl::desc("minimum percentage of the count of an indirect branch for a "
+           "target to be placed with -indirect-target-layout"),
+  cl::init(10),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+using NodeId = CallGraph::NodeId;
+
+/// Targets of an indirect branch with their counts, hottest first.
+template <typename T>
+struct DispatchSite {
+  T Dispatch;
+  uint64_t Count;
+  std::vector<std::pair<T, uint64_t>> Targets;
+};
+
+/// Keep the targets of \p Site that take at least -indirect-target-min-share
+/// of \p TotalCount, hottest first.
+template <typename T>
+void selectHotTargets(DispatchSite<T> &Site, uint64_t TotalCount) {
+  auto &Targets = Site.Targets;
+  Targets.erase(std::remove_if(Targets.begin(), Targets.end(),
+                               [&](const std::pair<T, uint64_t> &Target) {
+                                 return !Target.second ||
+                                   Target.second * 100 <
+                                     opts::IndirectTargetMinShare * TotalCount;
+                               }),
+                Targets.end());
+  std::stable_sort(Targets.begin(), Targets.end(),
+                   [](const std::pair<T, uint64_t> &A,
+                      const std::pair<T, uint64_t> &B) {
+                     return A.second > B.second;
+                   });
+}
+
+/// Return the ExtTSP score of the calls from and to \p Nodes with the
+/// functions at \p FuncAddr. Functions not in the order have an address of
+/// -1ULL.
+double getCallsScore(const BinaryFunctionCallGraph &Cg,
+                     const std::vector<uint64_t> &FuncAddr,
+                     ArrayRef<NodeId> Nodes,
+                     std::vector<bool> &InNodes) {
+  auto getArcScore = [&](NodeId Src, NodeId Dst) -> double {
+    if (Src == Dst || FuncAddr[Src] == -1ULL || FuncAddr[Dst] == -1ULL)
+      return 0.0;
+    const auto &Arc = *Cg.findArc(Src, Dst);
+    return CacheMetrics::extTSPScore(
+        FuncAddr[Src] + std::llround(Arc.avgCallOffset()), 0,
+        FuncAddr[Dst], std::llround(Arc.weight()));
+  };
+
+  for (const auto Id : Nodes)
+    InNodes[Id] = true;
+
+  double Score = 0.0;
+  for (const auto Id : Nodes) {
+    for (const auto Dst : Cg.successors(Id))
+      Score += getArcScore(Id, Dst);
+    for (const auto Src : Cg.predecessors(Id)) {
+      if (!InNodes[Src])
+        Score += getArcScore(Src, Id);
+    }
+  }
+
+  for (const auto Id : Nodes)
+    InNodes[Id] = false;
+
+  return Score;
+}
+
+} // anonymous namespace
+
+namespace IndirectTargetLayout {
+
+bool isEnabled() {
+  return opts::IndirectTargetLayout;
+}
+
+unsigned placeJumpTableTargets(BinaryFunction &BF,
+                               BinaryFunction::BasicBlockOrderType &Layout) {
+  if (Layout.size() < 3)
+    return 0;
+
+  const auto &BC = BF.getBinaryContext();
+  std::vector<DispatchSite<BinaryBasicBlock *>> Sites;
+  for (auto *BB : Layout) {
+    const auto Count = BB->getKnownExecutionCount();
+    auto *Inst = BB->getLastNonPseudoInstr();
+    if (!Count || !Inst)
+      continue;
+    const auto *JT = BF.getJumpTable(*Inst);
+    if (!JT || JT->Counts.empty())
+      continue;
+
+    // Identical entries share their count, so every target is counted once.
+    DispatchSite<BinaryBasicBlock *> Site{BB, Count, {}};
+    const auto Range = JT->getEntriesForAddress(BC.MIB->getJumpTable(*Inst));
+    uint64_t TotalCount = 0;
+    for (auto I = Range.first; I < Range.second && I < JT->Counts.size();
+         ++I) {
+      auto *Target = BF.getBasicBlockForLabel(JT->Entries[I]);
+      if (!Target ||
+          std::find_if(Site.Targets.begin(), Site.Targets.end(),
+                       [&](const std::pair<BinaryBasicBlock *, uint64_t> &P) {
+                         return P.first == Target;
+                       }) != Site.Targets.end())
+        continue;
+      Site.Targets.emplace_back(Target, JT->Counts[I].Count);
+      TotalCount += JT->Counts[I].Count;
+    }
+    selectHotTargets(Site, TotalCount);
+    if (!Site.Targets.empty())
+      Sites.emplace_back(std::move(Site));
+  }
+
+  std::stable_sort(Sites.begin(), Sites.end(),
+                   [](const DispatchSite<BinaryBasicBlock *> &A,
+                      const DispatchSite<BinaryBasicBlock *> &B) {
+                     return A.Count > B.Count;
+                   });
+
+  // Blocks placed by a hotter site keep their place: moving a target would
+  // separate it from its dispatch block, and inserting after a target would
+  // separate it from the other targets.
+  std::unordered_set<const BinaryBasicBlock *> Placed;
+  unsigned NumMoved = 0;
+  auto Score = ProfileVariants::getLayoutScore(BF, Layout);
+  for (const auto &Site : Sites) {
+    if (Placed.count(Site.Dispatch))
+      continue;
+
+    std::vector<BinaryBasicBlock *> Group;
+    for (const auto &Target : Site.Targets) {
+      auto *BB = Target.first;
+      if (BB != Site.Dispatch && BB != Layout.front() && !Placed.count(BB))
+        Group.push_back(BB);
+    }
+    if (Group.empty())
+      continue;
+
+    auto NewLayout = Layout;
+    NewLayout.erase(std::remove_if(NewLayout.begin(), NewLayout.end(),
+                                   [&](const BinaryBasicBlock *BB) {
+                                     return std::find(Group.begin(),
+                                                      Group.end(), BB) !=
+                                       Group.end();
+                                   }),
+                    NewLayout.end());
+    auto DI = std::find(NewLayout.begin(), NewLayout.end(), Site.Dispatch);
+    NewLayout.insert(std::next(DI), Group.begin(), Group.end());
+    if (NewLayout == Layout) {
+      Placed.insert(Site.Dispatch);
+      Placed.insert(Group.begin(), Group.end());
+      continue;
+    }
+
+    const auto NewScore = ProfileVariants::getLayoutScore(BF, NewLayout);
+    if (NewScore < Score)
+      continue;
+
+    DEBUG(dbgs() << "BOLT-DEBUG: placed " << Group.size() << " targets after "
+                 << Site.Dispatch->getName() << " in " << BF << '\n');
+    Layout = std::move(NewLayout);
+    Score = NewScore;
+    NumMoved += Group.size();
+    Placed.insert(Site.Dispatch);
+    Placed.insert(Group.begin(), Group.end());
+  }
+
+  return NumMoved;
+}
+
+double getFunctionOrderScore(const BinaryFunctionCallGraph &Cg,
+                             const std::vector<Cluster> &Clusters) {
+  std::vector<uint64_t> FuncAddr(Cg.numNodes(), -1ULL);
+  std::vector<NodeId> Order;
+  uint64_t TotalSize = 0;
+  for (const auto &Cluster : Clusters) {
+    for (const auto FuncId : Cluster.targets()) {
+      FuncAddr[FuncId] = TotalSize;
+      TotalSize += Cg.size(FuncId);
+      Order.push_back(FuncId);
+    }
+  }
+
+  std::vector<bool> InNodes(Cg.numNodes());
+  return getCallsScore(Cg, FuncAddr, Order, InNodes);
+}
+
+unsigned placeIndirectCallTargets(const BinaryContext &BC,
+                                  const BinaryFunctionCallGraph &Cg,
+                                  std::vector<Cluster> &Clusters) {
+  std::vector<NodeId> Order;
+  std::vector<size_t> ClusterIndex(Cg.numNodes(), -1UL);
+  for (size_t I = 0; I < Clusters.size(); ++I) {
+    for (const auto FuncId : Clusters[I].targets()) {
+      Order.push_back(FuncId);
+      ClusterIndex[FuncId] = I;
+    }
+  }
+
+  // Indirect calls still carrying their call profile were not promoted.
+  std::vector<DispatchSite<NodeId>> Sites;
+  for (const auto Caller : Order) {
+    const auto *BF = Cg.nodeIdToFunc(Caller);
+    for (const auto *BB : BF->layout()) {
+      const auto Count = BB->getKnownExecutionCount();
+      if (!Count || BB->isCold())
+        continue;
+      for (const auto &Inst : *BB) {
+        if (!BC.MIB->isCall(Inst) || BC.MIB->getTargetSymbol(Inst) ||
+            !BC.MIB->hasAnnotation(Inst, "CallProfile"))
+          continue;
+
+        DispatchSite<NodeId> Site{Caller, 0, {}};
+        const auto &ICSP =
+          BC.MIB->getAnnotationAs<IndirectCallSiteProfile>(Inst,
+                                                           "CallProfile");
+        for (const auto &CSI : ICSP) {
+          Site.Count += CSI.Count;
+          if (!CSI.IsFunction)
+            continue;
+          const auto *BD = BC.getBinaryDataByName(CSI.Name);
+          const auto *Callee =
+            BD ? BC.getFunctionForSymbol(BD->getSymbol()) : nullptr;
+          const auto Id = Callee ? Cg.maybeGetNodeId(Callee)
+                                 : CallGraph::InvalidId;
+          if (Id != CallGraph::InvalidId && Id != Caller &&
+              ClusterIndex[Id] != -1UL)
+            Site.Targets.emplace_back(Id, CSI.Count);
+        }
+        selectHotTargets(Site, Site.Count);
+        if (!Site.Targets.empty())
+          Sites.emplace_back(std::move(Site));
+      }
+    }
+  }
+
+  std::stable_sort(Sites.begin(), Sites.end(),
+                   [](const DispatchSite<NodeId> &A,
+                      const DispatchSite<NodeId> &B) {
+                     return A.Count > B.Count;
+                   });
+
+  std::vector<uint64_t> FuncAddr(Cg.numNodes(), -1ULL);
+  std::vector<size_t> Position(Cg.numNodes());
+  uint64_t TotalSize = 0;
+  for (size_t I = 0; I < Order.size(); ++I) {
+    FuncAddr[Order[I]] = TotalSize;
+    TotalSize += Cg.size(Order[I]);
+    Position[Order[I]] = I;
+  }
+
+  auto updateAddresses = [&](size_t First, size_t Last, uint64_t Address) {
+    for (auto I = First; I <= Last; ++I) {
+      FuncAddr[Order[I]] = Address;
+      Address += Cg.size(Order[I]);
+      Position[Order[I]] = I;
+    }
+  };
+
+  // Move a function with std::rotate to a position right after another one.
+  // Only the addresses of the functions in between change, so the moves are
+  // scored with the calls of these functions.
+  std::vector<bool> InNodes(Cg.numNodes());
+  std::vector<bool> Pinned(Cg.numNodes());
+  std::unordered_map<NodeId, NodeId> LastPlaced;
+  unsigned NumMoved = 0;
+  for (const auto &Site : Sites) {
+    auto LPI = LastPlaced.emplace(Site.Dispatch, Site.Dispatch).first;
+    for (const auto &Target : Site.Targets) {
+      const auto Callee = Target.first;
+      if (Pinned[Callee])
+        continue;
+
+      const auto From = Position[Callee];
+      const auto After = Position[LPI->second];
+      if (From != After + 1) {
+        const auto First = std::min(From, After + 1);
+        const auto Last = From < After ? After : From;
+        const auto Nodes = makeArrayRef(Order).slice(First, Last - First + 1);
+        const auto Score = getCallsScore(Cg, FuncAddr, Nodes, InNodes);
+        const auto Address = FuncAddr[Order[First]];
+        auto Begin = Order.begin() + First;
+        auto End = Order.begin() + Last + 1;
+        std::rotate(Begin, From < After ? Begin + 1 : End - 1, End);
+        updateAddresses(First, Last, Address);
+        if (getCallsScore(Cg, FuncAddr, Nodes, InNodes) < Score) {
+          std::rotate(Begin, From < After ? End - 1 : Begin + 1, End);
+          updateAddresses(First, Last, Address);
+          continue;
+        }
+        ClusterIndex[Callee] = ClusterIndex[Site.Dispatch];
+        ++NumMoved;
+        DEBUG(dbgs() << "BOLT-DEBUG: placed " << *Cg.nodeIdToFunc(Callee)
+                     << " after " << *Cg.nodeIdToFunc(Site.Dispatch) << '\n');
+      }
+      Pinned[Callee] = true;
+      Pinned[Site.Dispatch] = true;
+      LPI->second = Callee;
+    }
+  }
+
+  if (!NumMoved)
+    return 0;
+
+  // The clusters are still contiguous in the order: a moved function joins
+  // the cluster of its caller.
+  std::vector<Cluster> NewClusters;
+  for (size_t I = 0; I < Order.size(); ++I) {
+    Cluster C(Order[I], Cg.getNode(Order[I]));
+    if (I && ClusterIndex[Order[I]] == ClusterIndex[Order[I - 1]])
+      NewClusters.back().merge(C);
+    else
+      NewClusters.emplace_back(std::move(C));
+  }
+  Clusters = std::move(NewClusters);
+
+  return NumMoved;
+}
+
+} // namespace IndirectTargetLayout
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,63 @@
+//===--- Passes/IndirectTargetLayout.h - Place hot indirect targets -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Layout constraints for indirect branches, applied with
+// -indirect-target-layout after the block layout of ReorderBasicBlocks and
+// the function order of ReorderFunctions are computed.
+//
+// The hot targets of a jump table, by the counts of its entries, are moved
+// right after the block with the indirect jump, hottest first. The hot
+// targets of an indirect call that stayed indirect after indirect call
+// promotion, by the counts of its call profile, are moved right after the
+// calling function. Keeping the hot targets of a dispatch site together and
+// next to it improves the prediction of the indirect branch and the
+// locality of its fall-through. A move is kept only when it does not lower
+// the ExtTSP score of the layout.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_INDIRECT_TARGET_LAYOUT_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_INDIRECT_TARGET_LAYOUT_H
+
+#include "BinaryFunction.h"
+#include "BinaryFunctionCallGraph.h"
+#include "HFSort.h"
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+namespace IndirectTargetLayout {
+
+/// Return true if the constraints are enabled with -indirect-target-layout.
+bool isEnabled();
+
+/// Move the hot targets of the jump tables of \p BF right after their
+/// dispatch blocks in \p Layout. Return the number of moved targets.
+unsigned placeJumpTableTargets(BinaryFunction &BF,
+                               BinaryFunction::BasicBlockOrderType &Layout);
+
+/// Return the ExtTSP score of the calls of \p Cg with the functions placed
+/// in the order of \p Clusters.
+double getFunctionOrderScore(const BinaryFunctionCallGraph &Cg,
+                             const std::vector<Cluster> &Clusters);
+
+/// Move the hot targets of the indirect calls of the functions in \p Cg
+/// right after their callers in \p Clusters. Return the number of moved
+/// functions.
+unsigned placeIndirectCallTargets(const BinaryContext &BC,
+                                  const BinaryFunctionCallGraph &Cg,
+                                  std::vector<Cluster> &Clusters);
+
+} // namespace IndirectTargetLayout
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -12,6 +12,7 @@
 #include "Inliner.h"
 #include "MCPlus.h"
 #include "llvm/Support/Options.h"
+#include <cmath>
 
 #define DEBUG_TYPE "bolt-inliner"
 
@@ -28,6 +29,32 @@ AggressiveInlining("aggressive-inlining",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+extern cl::opt<bool> InlineHotCalls;
+
+static cl::opt<double>
+InlineHotCallPercent("inline-hot-call-percent",
+  cl::desc("minimum share of all executed calls, in percent, for a call site "
+           "to be inlined with -inline-hot-calls"),
+  cl::init(0.1),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+InlineHotMaxSize("inline-hot-max-size",
+  cl::desc("maximum code size in bytes of a function inlined with "
+           "-inline-hot-calls"),
+  cl::init(256),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<double>
+InlineHotSizeBudget("inline-hot-size-budget",
+  cl::desc("maximum growth of the code of profiled functions, in percent, "
+           "caused by -inline-hot-calls"),
+  cl::init(2.0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::list<std::string>
 ForceInlineFunctions("force-inline",
   cl::CommaSeparated,
@@ -116,6 +143,14 @@ bool createsStackFrame(const BinaryBasicBlock &) {
   return false;
 }
 
+/// Scale a profile count by \p Scale keeping special count values intact.
+uint64_t scaleCount(uint64_t Count, double Scale) {
+  if (Count == BinaryBasicBlock::COUNT_NO_PROFILE ||
+      Count == BinaryBasicBlock::COUNT_INFERRED)
+    return Count;
+  return std::llround(Count * Scale);
+}
+
 } // namespace
 
 void InlineSmallFunctions::inlineCall(
@@ -164,11 +199,18 @@ InlineSmallFunctions::inlineCall(
     BinaryFunction &CallerFunction,
     BinaryBasicBlock *CallerBB,
     const unsigned CallInstIndex,
-    const BinaryFunction &InlinedFunction) {
+    const BinaryFunction &InlinedFunction,
+    const double ProfileScale) {
   // Get the instruction to be replaced with inlined code.
   MCInst &CallInst = CallerBB->getInstructionAtIndex(CallInstIndex);
   assert(BC.MIB->isCall(CallInst) && "Can only inline a call.");
 
+  // Calls of the inlined instance propagate exceptions to the landing pad of
+  // the inlined call.
+  const auto CallEHInfo = BC.MIB->getEHInfo(CallInst);
+  const int64_t CallGnuArgsSize =
+    CallerFunction.usesGnuArgsSize() ? BC.MIB->getGnuArgsSize(CallInst) : -1;
+
   // Point in the function after the inlined code.
   BinaryBasicBlock *AfterInlinedBB = nullptr;
   unsigned AfterInlinedIstrIndex = 0;
@@ -201,7 +243,8 @@ InlineSmallFunctions::inlineCall(
     InlinedBBMap[InlinedFunctionBB] = InlinedInstance.back().get();
     if (InlinedFunction.hasValidProfile()) {
       const auto Count = InlinedFunctionBB->getExecutionCount();
-      InlinedInstance.back()->setExecutionCount(Count);
+      InlinedInstance.back()->setExecutionCount(
+          scaleCount(Count, ProfileScale));
     }
   }
   if (ShouldSplitCallerBB) {
@@ -222,7 +265,8 @@ InlineSmallFunctions::inlineCall(
     bool IsExitingBlock = false;
 
     // Copy instructions into the inlined instance.
-    for (auto Instruction : *InlinedFunctionBB) {
+    for (const auto &OrigInstruction : *InlinedFunctionBB) {
+      auto Instruction = MCPlus::copyWithoutAnnotations(OrigInstruction);
       if (!IsTailCall &&
           BC.MIB->isReturn(Instruction) &&
           !BC.MIB->isTailCall(Instruction)) {
@@ -237,6 +281,11 @@ InlineSmallFunctions::inlineCall(
         // call.
         if (!BC.MIB->convertTailCallToCall(Instruction))
            assert(false && "unexpected tail call opcode found");
+        if (CallEHInfo) {
+          BC.MIB->addEHInfo(Instruction, *CallEHInfo);
+          if (CallGnuArgsSize >= 0)
+            BC.MIB->addGnuArgsSize(Instruction, CallGnuArgsSize);
+        }
         IsExitingBlock = true;
       }
       if (BC.MIB->isBranch(Instruction) &&
@@ -287,11 +336,16 @@ InlineSmallFunctions::inlineCall(
         });
 
     if (InlinedFunction.hasValidProfile()) {
+      std::vector<BinaryBasicBlock::BinaryBranchInfo> BranchInfo;
+      for (const auto &BI : InlinedFunctionBB->branch_info()) {
+        BranchInfo.push_back({scaleCount(BI.Count, ProfileScale),
+                              scaleCount(BI.MispredictedCount, ProfileScale)});
+      }
       InlinedInstanceBB->addSuccessors(
           Successors.begin(),
           Successors.end(),
-          InlinedFunctionBB->branch_info_begin(),
-          InlinedFunctionBB->branch_info_end());
+          BranchInfo.begin(),
+          BranchInfo.end());
     } else {
       InlinedInstanceBB->addSuccessors(
           Successors.begin(),
@@ -557,6 +611,187 @@ bool InlineSmallFunctions::inlineCallsInFunctionAggressive(
   return DidInlining;
 }
 
+void InlineSmallFunctions::findHotInliningCandidates(
+    BinaryContext &BC,
+    const std::map<uint64_t, BinaryFunction> &BFs) {
+  BitVector SPAliases = BC.MIB->getAliases(BC.MIB->getStackPointer());
+
+  auto hasStackPointerOperand = [&](const MCInst &Inst) {
+    for (unsigned I = 0; I < MCPlus::getNumPrimeOperands(Inst); ++I) {
+      const auto &Op = Inst.getOperand(I);
+      if (Op.isReg() && SPAliases[Op.getReg()])
+        return true;
+    }
+    return false;
+  };
+
+  // Check that the instruction neither reads nor writes the stack pointer,
+  // explicitly or implicitly.
+  auto touchesStackPointer = [&](const MCInst &Inst) {
+    if (hasStackPointerOperand(Inst))
+      return true;
+    const auto &Desc = BC.MII->get(Inst.getOpcode());
+    for (auto Reg = SPAliases.find_first(); Reg != -1;
+         Reg = SPAliases.find_next(Reg)) {
+      if (Desc.hasImplicitUseOfPhysReg(Reg) ||
+          Desc.hasImplicitDefOfPhysReg(Reg))
+        return true;
+    }
+    return false;
+  };
+
+  for (const auto &BFIt : BFs) {
+    const auto &Function = BFIt.second;
+    if (!shouldOptimize(Function) ||
+        !Function.hasValidProfile() ||
+        Function.getKnownExecutionCount() == 0 ||
+        Function.isMultiEntry() ||
+        Function.hasEHRanges() ||
+        Function.hasJumpTables())
+      continue;
+
+    uint64_t FunctionSize = 0;
+    bool CanInline = true;
+    for (const auto *BB : Function.layout()) {
+      for (const auto &Inst : *BB) {
+        // Returns and tail calls are replaced or converted into calls that
+        // run with the stack pointer of the caller.
+        if (BC.MIB->isReturn(Inst) && !BC.MIB->isTailCall(Inst)) {
+          if (MCPlus::getNumPrimeOperands(Inst) == 0)
+            continue;
+          CanInline = false;
+        } else if (BC.MIB->isTailCall(Inst)) {
+          if (!hasStackPointerOperand(Inst))
+            continue;
+          CanInline = false;
+        }
+
+        if (!CanInline ||
+            BC.MIB->isCFI(Inst) ||
+            BC.MIB->isEHLabel(Inst) ||
+            BC.MIB->isCall(Inst) ||
+            BC.MIB->isIndirectBranch(Inst) ||
+            touchesStackPointer(Inst)) {
+          CanInline = false;
+          break;
+        }
+      }
+      if (!CanInline)
+        break;
+      FunctionSize += BC.computeCodeSize(BB->begin(), BB->end());
+    }
+
+    if (CanInline && FunctionSize <= opts::InlineHotMaxSize)
+      HotInliningCandidates[&Function] = FunctionSize;
+  }
+
+  DEBUG(dbgs() << "BOLT-DEBUG: " << HotInliningCandidates.size()
+               << " functions can be inlined at hot call sites.\n");
+}
+
+void InlineSmallFunctions::inlineHotCallSites(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs) {
+  findHotInliningCandidates(BC, BFs);
+
+  // Collect direct calls to candidates from profiled code.
+  std::vector<HotCallSite> CallSites;
+  uint64_t TotalCalls = 0;
+  uint64_t TotalSize = 0;
+  for (auto &BFIt : BFs) {
+    auto &Function = BFIt.second;
+    if (!shouldOptimize(Function) || !Function.hasValidProfile())
+      continue;
+    TotalSize += Function.getSize();
+
+    for (auto *BB : Function.layout()) {
+      const auto Count = BB->getKnownExecutionCount();
+      for (unsigned I = 0; I < BB->size(); ++I) {
+        const auto &Inst = BB->getInstructionAtIndex(I);
+        if (!BC.MIB->isCall(Inst))
+          continue;
+        TotalCalls += Count;
+        if (Count == 0 || BB->isCold() || BC.MIB->isTailCall(Inst) ||
+            MCPlus::getNumPrimeOperands(Inst) != 1 ||
+            !Inst.getOperand(0).isExpr())
+          continue;
+
+        const auto *TargetSymbol = BC.MIB->getTargetSymbol(Inst);
+        const auto *Callee =
+          TargetSymbol ? BC.getFunctionForSymbol(TargetSymbol) : nullptr;
+        if (!Callee || Callee == &Function ||
+            !HotInliningCandidates.count(Callee))
+          continue;
+
+        CallSites.push_back(HotCallSite{&Function, BB, I, Callee, Count});
+      }
+    }
+  }
+  TotalDynamicCalls += TotalCalls;
+
+  // Pick the hottest call sites until the size budget is exhausted.
+  std::stable_sort(CallSites.begin(), CallSites.end(),
+                   [](const HotCallSite &A, const HotCallSite &B) {
+                     return A.Count > B.Count;
+                   });
+  const auto MinCount = TotalCalls * opts::InlineHotCallPercent / 100;
+  auto Budget = int64_t(TotalSize * opts::InlineHotSizeBudget / 100);
+  std::unordered_map<const BinaryFunction *, uint64_t> CallerGrowth;
+  std::map<BinaryFunction *, std::vector<HotCallSite>> SitesByCaller;
+  for (const auto &Site : CallSites) {
+    if (Site.Count < MinCount)
+      break;
+    const auto CalleeSize = HotInliningCandidates[Site.Callee];
+    if (int64_t(CalleeSize) > Budget)
+      continue;
+    // Without relocations a function has to fit into its original location.
+    auto &Growth = CallerGrowth[Site.Caller];
+    if (!BC.HasRelocations &&
+        Site.Caller->estimateHotSize() + Growth + CalleeSize >=
+          Site.Caller->getMaxSize())
+      continue;
+    Growth += CalleeSize;
+    Budget -= CalleeSize;
+    TotalInlineableCalls += Site.Count;
+    SitesByCaller[Site.Caller].push_back(Site);
+  }
+
+  uint64_t NumInlined = 0;
+  uint64_t InlinedSize = 0;
+  for (auto &CallerSites : SitesByCaller) {
+    auto &Caller = *CallerSites.first;
+    auto &Sites = CallerSites.second;
+
+    // Inlining splits the caller block after the call, which leaves
+    // instructions that precede the call in place. Inline the sites of a
+    // block from the last one backwards to keep the indices valid.
+    std::sort(Sites.begin(), Sites.end(),
+              [](const HotCallSite &A, const HotCallSite &B) {
+                if (A.BB != B.BB)
+                  return std::less<BinaryBasicBlock *>()(A.BB, B.BB);
+                return A.InstIndex > B.InstIndex;
+              });
+    for (const auto &Site : Sites) {
+      const auto Scale =
+        double(Site.Count) / Site.Callee->getKnownExecutionCount();
+      inlineCall(BC, Caller, Site.BB, Site.InstIndex, *Site.Callee,
+                 std::min(Scale, 1.0));
+      DEBUG(dbgs() << "BOLT-DEBUG: inlining hot call to " << *Site.Callee
+                   << " in " << Caller << " (" << Site.Count << " calls)\n");
+      ++NumInlined;
+      InlinedSize += HotInliningCandidates[Site.Callee];
+      InlinedDynamicCalls += Site.Count;
+    }
+    Modified.insert(&Caller);
+  }
+
+  outs() << "BOLT-INFO: inlined " << NumInlined << " hot call sites ("
+         << format("%.1f", TotalCalls ? 100.0 * InlinedDynamicCalls / TotalCalls
+                                      : 0.0)
+         << "% of executed calls) in " << SitesByCaller.size()
+         << " functions, adding " << InlinedSize << " bytes of code\n";
+}
+
 bool InlineSmallFunctions::mustConsider(const BinaryFunction &BF) {
   for (auto &Name : opts::ForceInlineFunctions) {
     if (BF.hasName(Name))
@@ -570,6 +805,11 @@ void InlineSmallFunctions::runOnFunctions(
     std::map<uint64_t, BinaryFunction> &BFs,
     std::set<uint64_t> &) {
 
+  if (opts::InlineHotCalls) {
+    inlineHotCallSites(BC, BFs);
+    return;
+  }
+
   if (opts::AggressiveInlining)
     findInliningCandidatesAggressive(BC, BFs);
   else
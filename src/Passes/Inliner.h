@@ -71,6 +71,7 @@ private:
 
   /// Inline the call in CallInst to InlinedFunction. Inlined function should not
   /// contain any landing pad or thrower edges but can have more than one blocks.
+  /// Profile counts of the inlined function are multiplied by \p ProfileScale.
   ///
   /// Return the location (basic block and instruction index) where the code of
   /// the caller function continues after the the inlined code.
@@ -79,7 +80,30 @@ private:
              BinaryFunction &CallerFunction,
              BinaryBasicBlock *CallerBB,
              const unsigned CallInstIdex,
-             const BinaryFunction &InlinedFunction);
+             const BinaryFunction &InlinedFunction,
+             const double ProfileScale = 1.0);
+
+  /// The following methods implement profile-guided inlining of hot call
+  /// sites (-inline-hot-calls). Candidates may have multiple basic blocks but
+  /// must not touch the stack pointer, so that their code behaves the same
+  /// without the return address pushed by the call.
+  struct HotCallSite {
+    BinaryFunction *Caller;
+    BinaryBasicBlock *BB;
+    unsigned InstIndex;
+    const BinaryFunction *Callee;
+    uint64_t Count;
+  };
+
+  /// Code size of functions that can be inlined at hot call sites.
+  std::unordered_map<const BinaryFunction *, uint64_t> HotInliningCandidates;
+
+  void findHotInliningCandidates(BinaryContext &BC,
+                                 const std::map<uint64_t, BinaryFunction> &BFs);
+
+  /// Inline the hottest call sites in \p BFs within the code size budget.
+  void inlineHotCallSites(BinaryContext &BC,
+                          std::map<uint64_t, BinaryFunction> &BFs);
 
 public:
   explicit InlineSmallFunctions(const cl::opt<bool> &PrintPass)
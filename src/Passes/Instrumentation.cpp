@@ -0,0 +1,437 @@
+//===--- Passes/Instrumentation.cpp - Edge count instrumentation ----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "Instrumentation.h"
+#include "BinaryFunctionCallGraph.h"
+#include "DataflowInfoManager.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Options.h"
+#include <numeric>
+
+#define DEBUG_TYPE "bolt-instrumentation"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+extern cl::opt<std::string> OutputFilename;
+
+cl::opt<bool>
+Instrument("instrument",
+  cl::desc("instrument the binary to collect an edge profile at run time "
+           "(x86-64 relocation mode only)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+cl::opt<std::string>
+InstrumentationFile("instrumentation-file",
+  cl::desc("file the instrumented binary accumulates its counters in"),
+  cl::init("/tmp/prof.raw"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+InstrumentationMap("instrumentation-map",
+  cl::desc("file describing the counters of the instrumented binary, used "
+           "by merge-fdata to produce a profile (default: <output>.instr-map)"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+InstrumentationShards("instrumentation-shards",
+  cl::desc("number of copies of the counters that threads are spread over "
+           "(must be a power of 2)"),
+  cl::init(8),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+InstrumentationShardShift("instrumentation-shard-shift",
+  cl::desc("select the counter shard of a thread using its stack pointer "
+           "shifted right by this many bits"),
+  cl::init(23),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+InstrumentationLiveness("instrumentation-liveness",
+  cl::desc("use liveness analysis to avoid saving flags and registers "
+           "around counter updates"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+/// Return true if \p BB was present in the input binary.
+bool hasInputOffset(const BinaryBasicBlock &BB) {
+  return BB.getEndOffset() != BinaryBasicBlock::INVALID_OFFSET;
+}
+
+/// Return the input offset of the branch terminating \p BB, or the offset of
+/// the block itself if the branch offset is not known.
+uint64_t getBranchOffset(const BinaryContext &BC, BinaryBasicBlock &BB) {
+  if (const auto *Inst = BB.getLastNonPseudoInstr()) {
+    if (auto Offset = BC.MIB->tryGetAnnotationAs<uint64_t>(*Inst, "Offset"))
+      return Offset.get();
+  }
+  return BB.getInputOffset();
+}
+
+/// Return true if control can enter \p BB from outside of the function.
+bool isEntry(const BinaryFunction &Function, const BinaryBasicBlock &BB) {
+  return &BB == *Function.layout_begin() || BB.isEntryPoint() ||
+         BB.isLandingPad();
+}
+
+template <typename Range>
+unsigned countUnique(Range R) {
+  SmallPtrSet<const BinaryBasicBlock *, 4> Unique(R.begin(), R.end());
+  return Unique.size();
+}
+
+unsigned getFirstNonPseudoIndex(BinaryBasicBlock &BB) {
+  return BB.getFirstNonPseudo() - BB.begin();
+}
+
+/// Return the index of the first terminator of \p BB, or the size of the
+/// block if there is none. When \p BeforeCall is set, a call ending the
+/// block also counts, as it might not return.
+unsigned getTerminatorIndex(const BinaryContext &BC, BinaryBasicBlock &BB,
+                            bool BeforeCall) {
+  for (auto II = BB.begin(); II != BB.end(); ++II) {
+    if (BC.MIB->isTerminator(*II))
+      return II - BB.begin();
+  }
+  auto RII = BB.getLastNonPseudo();
+  if (BeforeCall && RII != BB.rend() && BC.MIB->isCall(*RII))
+    return std::prev(RII.base()) - BB.begin();
+  return BB.size();
+}
+
+} // anonymous namespace
+
+void Instrumentation::assignCounters(BinaryContext &BC,
+                                     BinaryFunction &Function,
+                                     DataflowInfoManager *Info) {
+  FunctionCounters Counters;
+  Counters.Function = &Function;
+  auto &Edges = Counters.Edges;
+  const bool HasProfile = Function.hasValidProfile();
+  Function.updateLayoutIndices();
+
+  for (auto *BB : Function.layout()) {
+    if (isEntry(Function, *BB)) {
+      Edges.emplace_back(nullptr, BB);
+      Edges.back().InTree = true;
+    }
+
+    if (BB->succ_size() == 0) {
+      Edges.emplace_back(BB, nullptr, 1.0);
+      Edges.back().InsertBB = BB;
+      Edges.back().InsertIndex =
+        getTerminatorIndex(BC, *BB, /*BeforeCall=*/true);
+      continue;
+    }
+
+    const bool SingleSucc = countUnique(BB->successors()) == 1;
+    SmallPtrSet<const BinaryBasicBlock *, 4> Seen;
+    auto BI = BB->branch_info_begin();
+    for (auto *Succ : BB->successors()) {
+      const auto Count = BI->Count;
+      ++BI;
+      if (!Seen.insert(Succ).second)
+        continue;
+
+      FlowEdge Edge(BB, Succ);
+      if (SingleSucc) {
+        Edge.InsertBB = BB;
+        Edge.InsertIndex = getTerminatorIndex(BC, *BB, /*BeforeCall=*/false);
+      } else if (!isEntry(Function, *Succ) &&
+                 countUnique(Succ->predecessors()) == 1) {
+        Edge.InsertBB = Succ;
+        Edge.InsertIndex = getFirstNonPseudoIndex(*Succ);
+      }
+
+      // Prefer hot edges in the tree. Without a profile, back edges are
+      // assumed to be the hottest ones, followed by fall-throughs.
+      if (HasProfile) {
+        Edge.Weight =
+          Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0.0 : double(Count);
+      } else {
+        Edge.Weight =
+          Succ->getLayoutIndex() <= BB->getLayoutIndex() ? 8.0 : 1.0;
+        if (Succ->getLayoutIndex() == BB->getLayoutIndex() + 1)
+          Edge.Weight += 0.25;
+      }
+      // Counting an edge that needs a new block costs an extra jump.
+      if (!Edge.InsertBB)
+        Edge.Weight += 0.5;
+
+      Edges.emplace_back(std::move(Edge));
+    }
+  }
+
+  // Build a maximum spanning tree with Kruskal's algorithm. Node 0 is the
+  // virtual node.
+  DenseMap<const BinaryBasicBlock *, unsigned> NodeOf;
+  for (auto *BB : Function.layout()) {
+    const unsigned Node = NodeOf.size() + 1;
+    NodeOf[BB] = Node;
+  }
+  auto getNode = [&](const BinaryBasicBlock *BB) {
+    return BB ? NodeOf.lookup(BB) : 0;
+  };
+  std::vector<unsigned> Parent(NodeOf.size() + 1);
+  std::iota(Parent.begin(), Parent.end(), 0);
+  auto find = [&](unsigned Node) {
+    while (Parent[Node] != Node)
+      Node = Parent[Node] = Parent[Parent[Node]];
+    return Node;
+  };
+
+  std::vector<FlowEdge *> Order;
+  for (auto &Edge : Edges) {
+    if (Edge.InTree)
+      Parent[find(getNode(Edge.To))] = find(0);
+    else
+      Order.push_back(&Edge);
+  }
+  std::stable_sort(Order.begin(), Order.end(),
+                   [](const FlowEdge *A, const FlowEdge *B) {
+                     return A->Weight > B->Weight;
+                   });
+
+  auto *LA = Info ? &Info->getLivenessAnalysis() : nullptr;
+  for (auto *Edge : Order) {
+    const auto FromRoot = find(getNode(Edge->From));
+    const auto ToRoot = find(getNode(Edge->To));
+    if (FromRoot != ToRoot) {
+      Parent[FromRoot] = ToRoot;
+      Edge->InTree = true;
+      continue;
+    }
+
+    Edge->Counter = NumCounters++;
+    if (!Edge->InsertBB)
+      ++NumSplitEdges;
+
+    // A new block on the edge executes right before the target block.
+    if (LA) {
+      auto *BB = Edge->InsertBB ? Edge->InsertBB : Edge->To;
+      const auto Index = Edge->InsertBB ? Edge->InsertIndex
+                                        : getFirstNonPseudoIndex(*BB);
+      auto State = Index < BB->size() ? LA->getStateAt(*(BB->begin() + Index))
+                                      : LA->getStateAt(*BB);
+      if (State)
+        Edge->LiveRegs = llvm::make_unique<BitVector>(*State);
+    }
+    if (!Edge->LiveRegs ||
+        Edge->LiveRegs->anyCommon(BC.MIB->getAliases(BC.MIB->getFlagsReg())))
+      ++NumFlagsLive;
+  }
+
+  NumEdges += Edges.size();
+  Functions.emplace_back(std::move(Counters));
+}
+
+void Instrumentation::writeMapRecords(BinaryContext &BC,
+                                      const FunctionCounters &Counters,
+                                      raw_ostream &OS) const {
+  auto &Function = *Counters.Function;
+  const auto Name = Function.getNames()[0];
+
+  DenseMap<const BinaryBasicBlock *, unsigned> NodeOf;
+  for (auto *BB : Function.layout()) {
+    const unsigned Node = NodeOf.size() + 1;
+    NodeOf[BB] = Node;
+  }
+  auto getNode = [&](const BinaryBasicBlock *BB) {
+    return BB ? NodeOf.lookup(BB) : 0;
+  };
+
+  OS << "function " << Name << ' ' << NodeOf.size() + 1 << ' '
+     << Counters.Edges.size() << '\n';
+  for (const auto &Edge : Counters.Edges) {
+    OS << "edge " << getNode(Edge.From) << ' ' << getNode(Edge.To) << ' ';
+    if (Edge.InTree)
+      OS << '-';
+    else
+      OS << 'c' << Edge.Counter;
+
+    if (!Edge.From) {
+      OS << " 0 [unknown] 0 1 " << Name << ' '
+         << Twine::utohexstr(Edge.To->getInputOffset()) << " 0";
+    } else if (Edge.To && hasInputOffset(*Edge.From) &&
+               hasInputOffset(*Edge.To)) {
+      OS << " 1 " << Name << ' '
+         << Twine::utohexstr(getBranchOffset(BC, *Edge.From)) << " 1 "
+         << Name << ' ' << Twine::utohexstr(Edge.To->getInputOffset())
+         << " 0";
+    }
+    OS << '\n';
+  }
+}
+
+void Instrumentation::instrumentFunction(BinaryContext &BC,
+                                         FunctionCounters &Counters,
+                                         uint64_t ShardSize) {
+  auto &Function = *Counters.Function;
+  auto createIncrement = [&](const FlowEdge &Edge) {
+    return BC.MIB->createInstrCounterIncrement(
+        BC.InstrCounters, Edge.Counter * sizeof(uint64_t), ShardSize,
+        opts::InstrumentationShards, opts::InstrumentationShardShift,
+        Edge.LiveRegs.get(), BC.Ctx.get());
+  };
+
+  // Insert counters into existing blocks from the last position backwards
+  // so that the recorded positions stay valid.
+  std::vector<const FlowEdge *> InBlock;
+  for (const auto &Edge : Counters.Edges) {
+    if (!Edge.InTree && Edge.InsertBB)
+      InBlock.push_back(&Edge);
+  }
+  std::stable_sort(InBlock.begin(), InBlock.end(),
+                   [](const FlowEdge *A, const FlowEdge *B) {
+                     return A->InsertIndex > B->InsertIndex;
+                   });
+  for (const auto *Edge : InBlock) {
+    auto *BB = Edge->InsertBB;
+    auto It = BB->begin() + Edge->InsertIndex;
+    for (auto &Inst : createIncrement(*Edge)) {
+      It = BB->insertInstruction(It, std::move(Inst));
+      ++It;
+    }
+  }
+
+  // Count the remaining edges in new blocks placed at the end of the
+  // function.
+  std::vector<std::unique_ptr<BinaryBasicBlock>> NewBBs;
+  for (const auto &Edge : Counters.Edges) {
+    if (Edge.InTree || Edge.InsertBB)
+      continue;
+
+    auto *From = Edge.From;
+    auto *To = Edge.To;
+    auto NewBB = Function.createBasicBlock(
+        0, BC.Ctx->createTempSymbol("InstrEdge", true));
+    auto Increment = createIncrement(Edge);
+    NewBB->addInstructions(Increment.begin(), Increment.end());
+
+    const auto &BI = From->getBranchInfo(*To);
+    const auto Count = BI.Count;
+    const auto Mispreds = BI.MispredictedCount;
+    Function.replaceJumpTableEntryIn(From, To, NewBB.get());
+    From->replaceSuccessor(To, NewBB.get(), Count, Mispreds);
+    NewBB->addSuccessor(To, Count, Mispreds);
+    NewBB->setCFIState(From->getCFIStateAtExit());
+    NewBB->setIsCold(From->isCold());
+    NewBBs.emplace_back(std::move(NewBB));
+  }
+
+  if (!NewBBs.empty()) {
+    Function.insertBasicBlocks(Function.layout_back(), std::move(NewBBs),
+                               /*UpdateLayout=*/true,
+                               /*UpdateCFIState=*/false);
+  }
+  Function.fixBranches();
+}
+
+void Instrumentation::runOnFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::set<uint64_t> &) {
+  if (!opts::Instrument)
+    return;
+
+  if (!BC.isX86() || !BC.HasRelocations) {
+    errs() << "BOLT-ERROR: instrumentation is only supported for x86-64 in "
+              "relocation mode\n";
+    exit(1);
+  }
+  if (!isPowerOf2_32(opts::InstrumentationShards)) {
+    errs() << "BOLT-ERROR: -instrumentation-shards must be a power of 2\n";
+    exit(1);
+  }
+
+  std::unique_ptr<BinaryFunctionCallGraph> CG;
+  std::unique_ptr<RegAnalysis> RA;
+  if (opts::InstrumentationLiveness) {
+    CG.reset(new BinaryFunctionCallGraph(buildCallGraph(BC, BFs)));
+    RA.reset(new RegAnalysis(BC, BFs, *CG));
+  }
+
+  // Liveness is computed for all functions before any of them changes.
+  for (auto &It : BFs) {
+    auto &Function = It.second;
+    if (!shouldOptimize(Function) || !Function.hasCFG() ||
+        Function.isPLTFunction() || Function.layout_empty())
+      continue;
+    auto *Info = RA ? &DataflowInfoCache::get(BC, Function, RA.get(), nullptr)
+                    : nullptr;
+    assignCounters(BC, Function, Info);
+  }
+
+  if (!NumCounters)
+    return;
+
+  const uint64_t ShardSize = alignTo(NumCounters * sizeof(uint64_t), 64);
+  BC.InstrCounters = BC.Ctx->getOrCreateSymbol("__bolt_instr_counters");
+  BC.InstrCountersSize =
+    alignTo(ShardSize * opts::InstrumentationShards, 4096);
+
+  auto MapFileName = opts::InstrumentationMap.empty()
+    ? opts::OutputFilename + ".instr-map"
+    : std::string(opts::InstrumentationMap);
+  std::error_code EC;
+  raw_fd_ostream MapOS(MapFileName, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-ERROR: cannot open " << MapFileName << " for writing: "
+           << EC.message() << '\n';
+    exit(1);
+  }
+
+  // The map describes the input offsets of blocks, so write it before the
+  // new blocks are added.
+  MapOS << "counters " << NumCounters << " shards "
+        << opts::InstrumentationShards << " shard-size " << ShardSize << '\n';
+  for (auto &Counters : Functions)
+    writeMapRecords(BC, Counters, MapOS);
+
+  for (auto &Counters : Functions) {
+    instrumentFunction(BC, Counters, ShardSize);
+    DataflowInfoCache::invalidate(*Counters.Function);
+  }
+
+  outs() << "BOLT-INFO: instrumented " << Functions.size() << " functions "
+         << "with " << NumCounters << " counters for " << NumEdges
+         << " edges (" << NumSplitEdges << " in new blocks, " << NumFlagsLive
+         << " preserving flags) in " << opts::InstrumentationShards
+         << " shards of " << ShardSize << " bytes\n"
+         << "BOLT-INFO: the binary accumulates counters in "
+         << opts::InstrumentationFile << "; convert them with merge-fdata "
+         << MapFileName << " -instrumentation-counters="
+         << opts::InstrumentationFile << '\n';
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,112 @@
+//===--- Passes/Instrumentation.h - Edge count instrumentation ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Insert counters into the code so that the rewritten binary collects its own
+// edge profile. Edges of the CFG of a function, together with edges from and
+// to a virtual node standing for the callers, form a graph where every block
+// conserves flow. Only edges outside of a spanning tree of that graph get a
+// counter, and the counts of the tree edges are reconstructed from flow
+// conservation when the profile is converted by merge-fdata.
+//
+// Counters live in a page aligned area emitted after the code and are sharded
+// by stack address to reduce contention between threads. A startup stub maps
+// a file over the counters, and the map file written by the pass describes
+// the graph of every function and the fdata records of its edges.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_INSTRUMENTATION_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_INSTRUMENTATION_H
+
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "BinaryPasses.h"
+#include "llvm/ADT/BitVector.h"
+
+namespace llvm {
+namespace bolt {
+
+class DataflowInfoManager;
+
+class Instrumentation : public BinaryFunctionPass {
+  /// Edge of the flow graph of a function. A null block stands for the
+  /// virtual node outside of the function.
+  struct FlowEdge {
+    BinaryBasicBlock *From;
+    BinaryBasicBlock *To;
+
+    /// Weight used to keep likely hot edges in the spanning tree.
+    double Weight{0.0};
+
+    /// Edges from the virtual node are always part of the tree since there
+    /// is no way to count them without also counting the other incoming
+    /// edges of the block.
+    bool InTree{false};
+
+    /// Where the counter goes, if the edge is not in the tree: before
+    /// instruction number InsertIndex of InsertBB, or in a new block placed
+    /// on the edge if InsertBB is null.
+    BinaryBasicBlock *InsertBB{nullptr};
+    unsigned InsertIndex{0};
+
+    /// Registers live at the counter, or null if unknown.
+    std::unique_ptr<BitVector> LiveRegs;
+
+    uint32_t Counter{0};
+
+    FlowEdge(BinaryBasicBlock *From, BinaryBasicBlock *To,
+             double Weight = 0.0)
+      : From(From), To(To), Weight(Weight) {}
+  };
+
+  struct FunctionCounters {
+    BinaryFunction *Function;
+    std::vector<FlowEdge> Edges;
+  };
+
+  std::vector<FunctionCounters> Functions;
+  uint32_t NumCounters{0};
+
+  /// Statistics.
+  uint64_t NumEdges{0};
+  uint64_t NumSplitEdges{0};
+  uint64_t NumFlagsLive{0};
+
+  /// Build the flow graph of \p Function, choose its spanning tree and
+  /// assign counters to the remaining edges.
+  void assignCounters(BinaryContext &BC, BinaryFunction &Function,
+                      DataflowInfoManager *Info);
+
+  /// Insert counter increments into \p Counters.Function.
+  void instrumentFunction(BinaryContext &BC, FunctionCounters &Counters,
+                          uint64_t ShardSize);
+
+  /// Write the flow graph of \p Counters to the map file \p OS.
+  void writeMapRecords(BinaryContext &BC, const FunctionCounters &Counters,
+                       raw_ostream &OS) const;
+
+public:
+  explicit Instrumentation(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "instrumentation";
+  }
+  bool shouldPrint(const BinaryFunction &BF) const override {
+    return BinaryFunctionPass::shouldPrint(BF);
+  }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -261,7 +261,7 @@ void JTFootprintReduction::runOnFunctions(
     if (Function.getKnownExecutionCount() == 0)
       continue;
 
-    DataflowInfoManager Info(BC, Function, RA.get(), nullptr);
+    auto &Info = DataflowInfoCache::get(BC, Function, RA.get(), nullptr);
     BlacklistedJTs.clear();
     checkOpportunities(BC, Function, Info);
     optimizeFunction(BC, Function, Info);
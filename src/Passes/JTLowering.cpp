@@ -0,0 +1,357 @@
+//===--- JTLowering.cpp ---------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "JTLowering.h"
+#include "llvm/Support/Options.h"
+
+#define DEBUG_TYPE "JT"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+extern cl::opt<unsigned> Verbosity;
+extern bool shouldProcess(const bolt::BinaryFunction &Function);
+
+static cl::opt<unsigned>
+JTLoweringMaxTargets("jt-lowering-max-targets",
+  cl::desc("maximum number of jump table targets checked with direct "
+           "branches by jt-lowering"),
+  cl::init(2),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+JTLoweringThreshold("jt-lowering-threshold",
+  cl::desc("minimum percentage of executions of an indirect jump that the "
+           "checked targets must cover for jt-lowering"),
+  cl::init(80),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+bool JTLowering::analyzeBlock(BinaryContext &BC, BinaryFunction &Function,
+                              BinaryBasicBlock &BB, DataflowInfoManager &Info,
+                              Candidate &C) {
+  if (!BB.getNumNonPseudos())
+    return false;
+
+  MCInst &IndJmp = *BB.getLastNonPseudo();
+  const auto JTAddr = BC.MIB->getJumpTable(IndJmp);
+  if (!JTAddr)
+    return false;
+
+  auto *JT = Function.getJumpTable(IndJmp);
+  assert(JT && "jump table expected");
+
+  ++NumJTBlocks;
+
+  uint64_t TotalCount = 0;
+  for (const auto &BI : BB.branch_info())
+    TotalCount += BI.Count;
+  TotalJTCount += TotalCount;
+
+  if (!TotalCount)
+    return false;
+
+  // Find the index register of the jump and tag the instructions computing
+  // the target. We handle the same patterns as jt-footprint-reduction:
+  //
+  //    jmpq    *JUMP_TABLE(,%rdx,8)
+  //
+  //    leaq    JUMP_TABLE(%rip), %r11
+  //    movslq  (%r11,%rdx,4), %rcx
+  //    addq    %r11, %rcx
+  //    jmpq    *%rcx
+  MCPhysReg IndexReg = 0;
+  MCPhysReg BaseReg;
+  uint64_t Scale;
+  MutableArrayRef<MCInst> Insts(&*BB.begin(), &IndJmp + 1);
+  auto IndJmpMatcher = BC.MIB->matchIndJmp(
+      BC.MIB->matchAnyOperand(), BC.MIB->matchImm(Scale),
+      BC.MIB->matchReg(IndexReg), BC.MIB->matchAnyOperand());
+  auto PICIndJmpMatcher = BC.MIB->matchIndJmp(BC.MIB->matchAdd(
+      BC.MIB->matchLoadAddr(BC.MIB->matchAnyOperand()),
+      BC.MIB->matchLoad(BC.MIB->matchReg(BaseReg), BC.MIB->matchImm(Scale),
+                        BC.MIB->matchReg(IndexReg),
+                        BC.MIB->matchAnyOperand())));
+  if (IndJmpMatcher->match(*BC.MRI, *BC.MIB, Insts, -1)) {
+    IndJmpMatcher->annotate(*BC.MIB, "JTLowering");
+  } else if (PICIndJmpMatcher->match(*BC.MRI, *BC.MIB, Insts, -1)) {
+    PICIndJmpMatcher->annotate(*BC.MIB, "JTLowering");
+  } else {
+    DEBUG(dbgs() << "BOLT-DEBUG: jt-lowering: unsupported jump pattern in "
+                 << BB.getName() << " of " << Function << '\n');
+    return false;
+  }
+
+  // The checks go in front of the tagged instructions that immediately
+  // precede the jump. The index register has to be intact at that point, so
+  // the load from the jump table must be among them.
+  const MCInst *First = &*BB.begin();
+  const MCInst *Split = &IndJmp;
+  while (Split != First &&
+         BC.MIB->hasAnnotation(*(Split - 1), "JTLowering"))
+    --Split;
+
+  for (auto &Inst : BB)
+    BC.MIB->removeAnnotation(Inst, "JTLowering");
+
+  bool HasLoad = false;
+  for (auto II = BB.begin() + (Split - First); II != BB.end(); ++II) {
+    if (BC.MIB->isCFI(*II))
+      return false;
+    if (BC.MII->get(II->getOpcode()).mayLoad())
+      HasLoad = true;
+  }
+  if (!HasLoad || !IndexReg)
+    return false;
+
+  // The checks clobber flags and, for bit tests, a temporary register. Both
+  // must be dead before the jump table sequence and at the jump targets.
+  auto &LA = Info.getLivenessAnalysis();
+  auto LiveIn = LA.getStateAt(*Split);
+  auto LiveOut = LA.getStateBefore(IndJmp);
+  if (!LiveIn || !LiveOut)
+    return false;
+
+  BitVector Live = *LiveIn;
+  Live |= *LiveOut;
+  if (Live.anyCommon(BC.MIB->getAliases(BC.MIB->getFlagsReg())))
+    return false;
+
+  BitVector Avail = Live;
+  Avail.flip();
+  BitVector GPRegs(BC.MRI->getNumRegs(), false);
+  BC.MIB->getGPRegs(GPRegs, /*IncludeAlias=*/false);
+  Avail &= GPRegs;
+  Avail.reset(BC.MIB->getAliases(BC.MIB->getFramePointer()));
+  Avail.reset(BC.MIB->getAliases(IndexReg));
+  const int TmpReg = Avail.find_first();
+
+  // Collect the entries of the table for each target.
+  std::map<const BinaryBasicBlock *, std::vector<uint64_t>> Entries;
+  const auto Range = JT->getEntriesForAddress(JTAddr);
+  for (uint64_t I = 0; I < Range.second; ++I) {
+    const auto *TargetBB =
+      Function.getBasicBlockForLabel(JT->Entries[Range.first + I]);
+    if (TargetBB)
+      Entries[TargetBB].push_back(I);
+  }
+
+  std::vector<std::pair<uint64_t, BinaryBasicBlock *>> Succs;
+  auto BI = BB.branch_info_begin();
+  for (auto *Succ : BB.successors()) {
+    Succs.emplace_back(BI->Count, Succ);
+    ++BI;
+  }
+  std::stable_sort(Succs.begin(), Succs.end(),
+                   [](const std::pair<uint64_t, BinaryBasicBlock *> &A,
+                      const std::pair<uint64_t, BinaryBasicBlock *> &B) {
+                     return A.first > B.first;
+                   });
+
+  // Check the hottest targets until they cover the threshold.
+  uint64_t Covered = 0;
+  for (const auto &Succ : Succs) {
+    if (C.Targets.size() >= opts::JTLoweringMaxTargets ||
+        100.0 * Covered >= double(opts::JTLoweringThreshold) * TotalCount ||
+        !Succ.first)
+      break;
+
+    auto Itr = Entries.find(Succ.second);
+    if (Itr == Entries.end())
+      break;
+
+    HotTarget Target;
+    Target.BB = Succ.second;
+    if (Itr->second.size() == 1) {
+      Target.Index = Itr->second.front();
+    } else {
+      // Bit tests only work for tables that fit in a register.
+      if (Range.second > 64 || TmpReg == -1)
+        break;
+      for (const auto Index : Itr->second)
+        Target.Mask |= 1ULL << Index;
+    }
+
+    Covered += Succ.first;
+    C.Targets.push_back(Target);
+  }
+
+  if (C.Targets.empty() ||
+      100.0 * Covered < double(opts::JTLoweringThreshold) * TotalCount) {
+    C.Targets.clear();
+    return false;
+  }
+
+  C.BB = &BB;
+  C.SplitIndex = Split - First;
+  C.IndexReg = IndexReg;
+  C.TmpReg = TmpReg == -1 ? 0 : TmpReg;
+
+  ++NumLoweredJTBlocks;
+  LoweredJTCount += Covered;
+
+  return true;
+}
+
+void JTLowering::lowerBlock(BinaryContext &BC, BinaryFunction &Function,
+                            const Candidate &C) {
+  using BinaryBranchInfo = BinaryBasicBlock::BinaryBranchInfo;
+  auto &BB = *C.BB;
+
+  std::vector<BinaryBasicBlock *> Succs(BB.succ_begin(), BB.succ_end());
+  std::vector<BinaryBranchInfo> BranchInfo(BB.branch_info_begin(),
+                                           BB.branch_info_end());
+  auto getCount = [&](const BinaryBasicBlock *Succ) {
+    for (size_t I = 0; I < Succs.size(); ++I) {
+      if (Succs[I] == Succ)
+        return BranchInfo[I].Count;
+    }
+    llvm_unreachable("hot target must be a successor");
+  };
+
+  uint64_t Remaining = 0;
+  for (const auto &BI : BranchInfo)
+    Remaining += BI.Count;
+
+  // Move the jump table sequence to a new fallback block.
+  std::vector<MCInst> Prefix(BB.begin(), BB.begin() + C.SplitIndex);
+  std::vector<MCInst> Suffix(BB.begin() + C.SplitIndex, BB.end());
+  BB.clear();
+  BB.addInstructions(Prefix.begin(), Prefix.end());
+  BB.removeAllSuccessors();
+
+  std::vector<std::unique_ptr<BinaryBasicBlock>> NewBBs;
+  std::vector<BinaryBasicBlock *> CheckBBs{&BB};
+  for (size_t I = 1; I < C.Targets.size(); ++I) {
+    NewBBs.emplace_back(Function.createBasicBlock(0));
+    CheckBBs.push_back(NewBBs.back().get());
+  }
+  NewBBs.emplace_back(Function.createBasicBlock(0));
+  auto *FallbackBB = NewBBs.back().get();
+  FallbackBB->addInstructions(Suffix.begin(), Suffix.end());
+
+  for (size_t I = 0; I < C.Targets.size(); ++I) {
+    const auto &Target = C.Targets[I];
+    auto *CheckBB = CheckBBs[I];
+    auto *NextBB = I + 1 < CheckBBs.size() ? CheckBBs[I + 1] : FallbackBB;
+
+    std::vector<MCInst> Seq;
+    bool Success;
+    if (Target.Index >= 0) {
+      Success = BC.MIB->createCmpJE(Seq, C.IndexReg, Target.Index,
+                                    Target.BB->getLabel(), BC.Ctx.get());
+      ++NumCompares;
+    } else {
+      assert(C.TmpReg && "bit test needs a register");
+      Success = BC.MIB->createBitTestJB(Seq, C.IndexReg, Target.Mask, C.TmpReg,
+                                        Target.BB->getLabel(), BC.Ctx.get());
+      ++NumBitTests;
+    }
+    assert(Success && "cannot create jump table check");
+    (void)Success;
+    CheckBB->addInstructions(Seq.begin(), Seq.end());
+
+    const auto Count = getCount(Target.BB);
+    if (I > 0)
+      CheckBB->setExecutionCount(Remaining);
+    Remaining -= std::min(Remaining, Count);
+    CheckBB->addSuccessor(Target.BB, Count, 0); // cond branch
+    CheckBB->addSuccessor(NextBB, Remaining, 0); // fallthru branch
+    CheckBB->setCanOutline(BB.canOutline());
+    CheckBB->setIsCold(BB.isCold());
+  }
+
+  // The table still references the checked targets, keep the edges.
+  for (size_t I = 0; I < Succs.size(); ++I) {
+    bool IsChecked = false;
+    for (const auto &Target : C.Targets)
+      IsChecked |= Target.BB == Succs[I];
+    if (IsChecked)
+      FallbackBB->addSuccessor(Succs[I], 0, 0);
+    else
+      FallbackBB->addSuccessor(Succs[I], BranchInfo[I]);
+  }
+  FallbackBB->setExecutionCount(Remaining);
+  FallbackBB->setCanOutline(BB.canOutline());
+  FallbackBB->setIsCold(BB.isCold());
+
+  Function.insertBasicBlocks(&BB, std::move(NewBBs));
+  assert(Function.validateCFG());
+}
+
+void JTLowering::runOnFunctions(
+  BinaryContext &BC,
+  std::map<uint64_t, BinaryFunction> &BFs,
+  std::set<uint64_t> &LargeFunctions
+) {
+  if (!opts::JTLoweringMaxTargets)
+    return;
+
+  BinaryFunctionCallGraph CG(buildCallGraph(BC, BFs));
+  RegAnalysis RA(BC, BFs, CG);
+
+  for (auto &BFIt : BFs) {
+    auto &Function = BFIt.second;
+
+    if (!Function.isSimple() || !opts::shouldProcess(Function))
+      continue;
+
+    if (!Function.hasValidProfile() || !Function.getKnownExecutionCount() ||
+        !Function.hasJumpTables())
+      continue;
+
+    auto &Info = DataflowInfoCache::get(BC, Function, &RA, nullptr);
+
+    // Analyze all blocks before changing the CFG, which invalidates the
+    // dataflow results.
+    std::vector<Candidate> Candidates;
+    for (auto &BB : Function) {
+      Candidate C;
+      if (analyzeBlock(BC, Function, BB, Info, C))
+        Candidates.emplace_back(std::move(C));
+    }
+
+    for (const auto &C : Candidates) {
+      if (opts::Verbosity >= 1) {
+        outs() << "BOLT-INFO: jt-lowering: checking " << C.Targets.size()
+               << " hot target(s) in " << C.BB->getName() << " of "
+               << Function << '\n';
+      }
+      lowerBlock(BC, Function, C);
+    }
+
+    if (!Candidates.empty())
+      Modified.insert(&Function);
+  }
+
+  outs() << "BOLT-INFO: jt-lowering: " << NumLoweredJTBlocks << " of "
+         << NumJTBlocks << " indirect jumps to jump tables lowered using "
+         << NumCompares << " compares and " << NumBitTests << " bit tests\n";
+  if (TotalJTCount) {
+    outs() << "BOLT-INFO: jt-lowering: "
+           << format("%.2lf%%", (LoweredJTCount * 100.0 / TotalJTCount))
+           << " of dynamic indirect jumps to jump tables replaced with direct "
+           << "branches\n";
+  }
+}
+
+} // namespace bolt
+} // namespace llvm
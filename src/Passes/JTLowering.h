@@ -0,0 +1,94 @@
+//===--- JTLowering.h -----------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Profile-guided lowering of jump tables to compare chains and bit tests.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_JT_LOWERING_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_JT_LOWERING_H
+
+#include "BinaryPasses.h"
+#include "DataflowInfoManager.h"
+
+namespace llvm {
+namespace bolt {
+
+/// This pass looks for indirect jumps through jump tables where one or two
+/// targets receive most of the executions and checks for those targets with
+/// direct conditional branches, ordered by their frequency, in front of the
+/// original indirect jump. A target reached from a single entry is checked
+/// with a compare of the index register. A target reached from several
+/// entries of a table with at most 64 entries is checked with a bit test:
+///
+///   cmp   $3, %rdx             mov   $0x2c, %rax
+///   je    .LHot                bt    %rdx, %rax
+///   jmpq  *JT(,%rdx,8)         jb    .LHot
+///                              jmpq  *JT(,%rdx,8)
+///
+/// The jump table itself is kept for the remaining executions.
+class JTLowering : public BinaryFunctionPass {
+  /// A jump table target checked with a direct branch.
+  struct HotTarget {
+    BinaryBasicBlock *BB;
+    /// Mask of the table entries pointing to BB.
+    uint64_t Mask{0};
+    /// The entry index if BB has a single entry, -1 otherwise.
+    int64_t Index{-1};
+  };
+
+  /// A jump table block selected for lowering.
+  struct Candidate {
+    BinaryBasicBlock *BB;
+    /// Index of the first instruction of the jump table sequence. The checks
+    /// are placed in front of it.
+    unsigned SplitIndex;
+    MCPhysReg IndexReg;
+    /// Register available for the bit test masks, or 0.
+    MCPhysReg TmpReg;
+    std::vector<HotTarget> Targets;
+  };
+
+  uint64_t NumJTBlocks{0};
+  uint64_t NumLoweredJTBlocks{0};
+  uint64_t NumCompares{0};
+  uint64_t NumBitTests{0};
+  uint64_t TotalJTCount{0};
+  uint64_t LoweredJTCount{0};
+  DenseSet<const BinaryFunction *> Modified;
+
+  /// Check if the jump table block \p BB is worth lowering and return true
+  /// if \p C was filled in.
+  bool analyzeBlock(BinaryContext &BC, BinaryFunction &Function,
+                    BinaryBasicBlock &BB, DataflowInfoManager &Info,
+                    Candidate &C);
+
+  /// Insert the checks of \p C into the function and update the CFG.
+  void lowerBlock(BinaryContext &BC, BinaryFunction &Function,
+                  const Candidate &C);
+
+public:
+  explicit JTLowering(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "jt-lowering";
+  }
+  bool shouldPrint(const BinaryFunction &BF) const override {
+    return BinaryFunctionPass::shouldPrint(BF) && Modified.count(&BF) > 0;
+  }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -16,9 +16,54 @@
 using namespace llvm;
 
 namespace opts {
+extern cl::OptionCategory BoltOptCategory;
+
 extern cl::opt<bool> UseOldText;
-extern cl::opt<unsigned> AlignFunctions;
-extern cl::opt<unsigned> AlignFunctionsMaxBytes;
+
+static cl::opt<bool>
+LongJmpHotStubs("longjmp-hot-stubs",
+  cl::desc("place stubs of calls from hot code at the end of the hot part of "
+           "the caller, and make stubs of such calls to PLT entries load the "
+           "target from GOT instead of branching to the PLT"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ColdFragmentWindow("cold-fragment-window",
+  cl::desc("in relocation mode, keep the cold parts of split functions within "
+           "this many bytes of their hot parts by emitting them between hot "
+           "functions when the hot code is larger (0 to always place them "
+           "after the hot code)"),
+  cl::init(0x4000000),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+MoveConstantIslands("move-constant-islands",
+  cl::desc("in relocation mode, emit the constant islands of hot functions "
+           "after the hot code instead of between the functions"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ConstantIslandRange("constant-island-range",
+  cl::desc("only move the constant islands of a function if they stay within "
+           "this many bytes of its start"),
+  cl::init(0x80000),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+CompactJumpTables("compact-jump-tables",
+  cl::desc("use 1- or 2-byte entries for jump tables relative to the start "
+           "of their function when all the targets are close enough"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
 }
 
 namespace llvm {
@@ -27,14 +72,21 @@ namespace bolt {
 namespace {
 constexpr unsigned ColdFragAlign = 16;
 constexpr unsigned PageAlign = 0x200000;
+constexpr unsigned IslandAlign = 8;
 
+/// Create a stub branching to \p TgtSym. If \p PLTFunc is set, the stub
+/// replaces the PLT entry and loads the target from the GOT entry instead.
 std::pair<std::unique_ptr<BinaryBasicBlock>, MCSymbol *>
 createNewStub(const BinaryContext &BC, BinaryFunction &Func,
-              const MCSymbol *TgtSym) {
+              const MCSymbol *TgtSym,
+              const BinaryFunction *PLTFunc = nullptr) {
   auto *StubSym = BC.Ctx->createTempSymbol("Stub", true);
   auto StubBB = Func.createBasicBlock(0, StubSym);
   std::vector<MCInst> Seq;
-  BC.MIB->createLongJmp(Seq, TgtSym, BC.Ctx.get());
+  if (PLTFunc)
+    BC.MIB->createIndirectLongJmp(Seq, PLTFunc->getPLTSymbol(), BC.Ctx.get());
+  else
+    BC.MIB->createLongJmp(Seq, TgtSym, BC.Ctx.get());
   StubBB->addInstructions(Seq.begin(), Seq.end());
   StubBB->setExecutionCount(0);
   return std::make_pair(std::move(StubBB), StubSym);
@@ -97,12 +149,23 @@ LongJmpPass::replaceTargetWithStub(const BinaryContext &BC,
     BC.MIB->addAnnotation(Inst, "DoNotChangeTarget", true);
   }
 
+  // Calls from hot code to PLT entries get their own stubs
+  const BinaryFunction *PLTFunc = nullptr;
+  if (opts::LongJmpHotStubs && !TgtBB && !BB.isCold() &&
+      BB.getKnownExecutionCount() > 0) {
+    PLTFunc = BC.getFunctionForSymbol(TgtSym);
+    if (PLTFunc && !PLTFunc->isPLTFunction())
+      PLTFunc = nullptr;
+  }
+
   BinaryBasicBlock *StubBB =
-      BB.isCold() ? ColdStubs[&Func][TgtSym] : HotStubs[&Func][TgtSym];
+      PLTFunc ? HotPLTStubs[&Func][TgtSym]
+              : (BB.isCold() ? ColdStubs[&Func][TgtSym]
+                             : HotStubs[&Func][TgtSym]);
   MCSymbol *StubSymbol = StubBB ? StubBB->getLabel() : nullptr;
 
   if (!StubBB) {
-    std::tie(NewBB, StubSymbol) = createNewStub(BC, Func, TgtSym);
+    std::tie(NewBB, StubSymbol) = createNewStub(BC, Func, TgtSym, PLTFunc);
     StubBB = NewBB.get();
     Stubs[&Func].insert(StubBB);
   }
@@ -133,7 +196,10 @@ LongJmpPass::replaceTargetWithStub(const BinaryContext &BC,
   StubBits[StubBB] = BC.AsmInfo->getCodePointerSize() * 8;
 
   if (NewBB) {
-    if (BB.isCold())
+    if (PLTFunc) {
+      HotPLTStubs[&Func][TgtSym] = StubBB;
+      PLTStubs.insert(StubBB);
+    } else if (BB.isCold())
       ColdStubs[&Func][TgtSym] = StubBB;
     else
       HotStubs[&Func][TgtSym] = StubBB;
@@ -183,6 +249,25 @@ void LongJmpPass::insertStubs(const BinaryContext &BC, BinaryFunction &Func) {
     }
   }
 
+  // Executed stubs of calls from hot code are grouped at the end of the hot
+  // part of the function, hottest first, instead of being inserted after
+  // their callers where they would break fall-throughs.
+  std::vector<std::unique_ptr<BinaryBasicBlock>> HotCallStubs;
+  if (opts::LongJmpHotStubs && Func.isSimple()) {
+    for (auto &Elmt : Insertions) {
+      auto &StubBB = Elmt.second;
+      if (StubBB && StubBB->isEntryPoint() && !StubBB->isCold() &&
+          StubBB->getKnownExecutionCount() > 0)
+        HotCallStubs.emplace_back(std::move(StubBB));
+    }
+    std::stable_sort(HotCallStubs.begin(), HotCallStubs.end(),
+                     [](const std::unique_ptr<BinaryBasicBlock> &A,
+                        const std::unique_ptr<BinaryBasicBlock> &B) {
+                       return A->getKnownExecutionCount() >
+                              B->getKnownExecutionCount();
+                     });
+  }
+
   for (auto &Elmt : Insertions) {
     if (!Elmt.second)
       continue;
@@ -191,40 +276,64 @@ void LongJmpPass::insertStubs(const BinaryContext &BC, BinaryFunction &Func) {
     Func.insertBasicBlocks(Elmt.first, std::move(NewBBs), true, true);
   }
 
+  if (!HotCallStubs.empty()) {
+    auto *LastHotBB = Frontier ? Frontier : Func.layout_back();
+    Func.insertBasicBlocks(LastHotBB, std::move(HotCallStubs), true, true);
+  }
 }
 
 void LongJmpPass::tentativeBBLayout(const BinaryContext &BC,
                                     const BinaryFunction &Func) {
-  uint64_t HotDot = HotAddresses[&Func];
-  uint64_t ColdDot = ColdAddresses[&Func];
+  auto &Sizes = FunctionSizes[&Func];
+  Sizes = FragmentSizes();
+  uint64_t HotDot = 0;
+  uint64_t ColdDot = 0;
   bool Cold{false};
   for (auto *BB : Func.layout()) {
+    const auto BBSize = BC.computeCodeSize(BB->begin(), BB->end());
     if (Cold || BB->isCold()) {
       Cold = true;
-      BBAddresses[BB] = ColdDot;
-      ColdDot += BC.computeCodeSize(BB->begin(), BB->end());
+      BBOffsets[BB] = BBOffset{ColdDot, true};
+      ColdDot += BBSize;
     } else {
-      BBAddresses[BB] = HotDot;
-      HotDot += BC.computeCodeSize(BB->begin(), BB->end());
+      BBOffsets[BB] = BBOffset{HotDot, false};
+      HotDot += BBSize;
     }
+    // Match estimateHotSize() and estimateColdSize()
+    if (Func.isSplit() && BB->isCold())
+      Sizes.Cold += BBSize;
+    else
+      Sizes.Hot += BBSize;
   }
+  Sizes.ConstantIslands = Func.estimateConstantIslandSize();
+}
+
+uint64_t LongJmpPass::getBBAddress(const BinaryBasicBlock &BB) const {
+  auto Iter = BBOffsets.find(&BB);
+  assert(Iter != BBOffsets.end() && "Unrecognized local BB");
+  const auto &Addresses = Iter->second.IsCold ? ColdAddresses : HotAddresses;
+  auto FuncIter = Addresses.find(BB.getFunction());
+  assert(FuncIter != Addresses.end() && "Function has no tentative address");
+  return FuncIter->second + Iter->second.Offset;
 }
 
 uint64_t LongJmpPass::tentativeLayoutRelocColdPart(
   const BinaryContext &BC, std::vector<BinaryFunction *> &SortedFunctions,
-  uint64_t DotAddress) {
-  for (auto Func : SortedFunctions) {
+  uint32_t Begin, uint32_t End, uint64_t DotAddress) {
+  for (auto I = Begin; I < End; ++I) {
+    auto *Func = SortedFunctions[I];
     if (!Func->isSplit())
       continue;
     DotAddress = alignTo(DotAddress, BinaryFunction::MinAlign);
-    auto Pad = OffsetToAlignment(DotAddress, opts::AlignFunctions);
-    if (Pad <= opts::AlignFunctionsMaxBytes)
+    auto Pad = OffsetToAlignment(DotAddress, Func->getAlignment());
+    if (Pad <= Func->getMaxColdAlignmentBytes())
       DotAddress += Pad;
     ColdAddresses[Func] = DotAddress;
     DEBUG(dbgs() << Func->getPrintName() << " cold tentative: "
                  << Twine::utohexstr(DotAddress) << "\n");
-    DotAddress += Func->estimateColdSize();
-    DotAddress += Func->estimateConstantIslandSize();
+    const auto &Sizes = FunctionSizes[Func];
+    DotAddress += Sizes.Cold;
+    DotAddress += Sizes.ConstantIslands;
   }
   return DotAddress;
 }
@@ -243,35 +352,126 @@ uint64_t LongJmpPass::tentativeLayoutRelocMode(
     ++CurrentIndex;
   }
 
+  // Cold parts not laid out yet start at ColdBegin. They are placed at the
+  // hot cold frontier, unless that would put them out of the window from
+  // their hot parts. The placement is decided with the first, worst-case
+  // sizes, so that it cannot move in later iterations when the distances
+  // only get shorter.
+  uint32_t ColdBegin = 0;
+  bool HasPendingCold = false;
+  uint64_t PendingStart = 0;
+  uint64_t PendingColdSize = 0;
+
+  // The constant islands moved out of the hot functions are placed right
+  // after the hot code, in the order of the functions.
+  auto layoutMovedIslands = [&](uint64_t DotAddress) {
+    for (uint32_t I = 0; I < std::min<uint32_t>(LastHotIndex,
+                                                SortedFunctions.size()); ++I) {
+      auto *Func = SortedFunctions[I];
+      if (!Func->hasMovedConstantIslands())
+        continue;
+      DotAddress = alignTo(DotAddress, IslandAlign);
+      DotAddress += FunctionSizes[Func].ConstantIslands;
+    }
+    return DotAddress;
+  };
+
   // Hot
+  const auto StartAddress = DotAddress;
+  uint64_t HotEnd = 0;
   CurrentIndex = 0;
   bool ColdLayoutDone = false;
   for (auto Func : SortedFunctions) {
     if (!ColdLayoutDone && CurrentIndex >= LastHotIndex){
-      DotAddress =
-          tentativeLayoutRelocColdPart(BC, SortedFunctions, DotAddress);
+      HotEnd = DotAddress;
+      DotAddress = layoutMovedIslands(DotAddress);
+      DotAddress = tentativeLayoutRelocColdPart(BC, SortedFunctions, ColdBegin,
+                                                SortedFunctions.size(),
+                                                DotAddress);
       ColdLayoutDone = true;
     }
 
+    const auto &Sizes = FunctionSizes[Func];
+    if (!ColdLayoutDone) {
+      if (!ColdPlacementDone) {
+        const auto GroupSize = DotAddress - PendingStart + PendingColdSize +
+                               Sizes.Hot + Sizes.Cold +
+                               2 * Sizes.ConstantIslands;
+        Func->setColdFragmentsBefore(HasPendingCold &&
+                                     opts::ColdFragmentWindow &&
+                                     GroupSize > opts::ColdFragmentWindow);
+      }
+      if (Func->hasColdFragmentsBefore()) {
+        DEBUG(dbgs() << "placing cold parts before " << Func->getPrintName()
+                     << "\n");
+        DotAddress = tentativeLayoutRelocColdPart(BC, SortedFunctions,
+                                                  ColdBegin, CurrentIndex,
+                                                  DotAddress);
+        ColdBegin = CurrentIndex;
+        HasPendingCold = false;
+        PendingColdSize = 0;
+      }
+    }
+
     DotAddress = alignTo(DotAddress, BinaryFunction::MinAlign);
-    auto Pad = OffsetToAlignment(DotAddress, opts::AlignFunctions);
-    if (Pad <= opts::AlignFunctionsMaxBytes)
+    auto Pad = OffsetToAlignment(DotAddress, Func->getAlignment());
+    if (Pad <= Func->getMaxAlignmentBytes())
       DotAddress += Pad;
     HotAddresses[Func] = DotAddress;
     DEBUG(dbgs() << Func->getPrintName()
                  << " tentative: " << Twine::utohexstr(DotAddress) << "\n");
-    if (!Func->isSplit())
-      DotAddress += Func->estimateSize();
-    else
-      DotAddress += Func->estimateHotSize();
-    DotAddress += Func->estimateConstantIslandSize();
+    if (!ColdLayoutDone && Func->isSplit()) {
+      if (!HasPendingCold)
+        PendingStart = DotAddress;
+      HasPendingCold = true;
+      PendingColdSize += alignTo(Sizes.Cold + Sizes.ConstantIslands,
+                                 Func->getAlignment());
+    }
+    DotAddress += Sizes.Hot;
+    if (!Func->hasMovedConstantIslands())
+      DotAddress += Sizes.ConstantIslands;
     ++CurrentIndex;
   }
-  // BBs
-  for (auto Func : SortedFunctions)
-    tentativeBBLayout(BC, *Func);
+  if (!ColdLayoutDone) {
+    HotEnd = DotAddress;
+    DotAddress = layoutMovedIslands(DotAddress);
+  }
 
-  return DotAddress;
+  if (ColdPlacementDone)
+    return DotAddress;
+  ColdPlacementDone = true;
+
+  if (!opts::MoveConstantIslands)
+    return DotAddress;
+
+  // Literal loads reach +/-1MB. The islands are moved if they stay within
+  // reach even if all of them end up in front of the ones of the function,
+  // with a margin for the stubs inserted later.
+  uint64_t PoolSize = 0;
+  for (uint32_t I = 0; I < std::min<uint32_t>(LastHotIndex,
+                                              SortedFunctions.size()); ++I)
+    PoolSize += alignTo(FunctionSizes[SortedFunctions[I]].ConstantIslands,
+                        IslandAlign);
+  uint64_t NumMoved = 0;
+  uint64_t MovedSize = 0;
+  for (uint32_t I = 0; I < std::min<uint32_t>(LastHotIndex,
+                                              SortedFunctions.size()); ++I) {
+    auto *Func = SortedFunctions[I];
+    const auto IslandSize = FunctionSizes[Func].ConstantIslands;
+    if (!IslandSize ||
+        HotEnd - HotAddresses[Func] + PoolSize > opts::ConstantIslandRange)
+      continue;
+    Func->setMovedConstantIslands();
+    ++NumMoved;
+    MovedSize += IslandSize;
+  }
+  outs() << "BOLT-INFO: moved constant islands of " << NumMoved
+         << " hot functions (" << MovedSize << " bytes) after the hot code\n";
+  if (!NumMoved)
+    return DotAddress;
+
+  // Lay out the code again with the islands in their new place.
+  return tentativeLayoutRelocMode(BC, SortedFunctions, StartAddress);
 }
 
 void LongJmpPass::tentativeLayout(
@@ -285,8 +485,7 @@ void LongJmpPass::tentativeLayout(
       DotAddress = alignTo(DotAddress, ColdFragAlign);
       ColdAddresses[Func] = DotAddress;
       if (Func->isSplit())
-        DotAddress += Func->estimateColdSize();
-      tentativeBBLayout(BC, *Func);
+        DotAddress += FunctionSizes[Func].Cold;
     }
 
     return;
@@ -347,11 +546,8 @@ bool LongJmpPass::usesStub(const BinaryContext &BC, const BinaryFunction &Func,
 uint64_t LongJmpPass::getSymbolAddress(const BinaryContext &BC,
                                        const MCSymbol *Target,
                                        const BinaryBasicBlock *TgtBB) const {
-  if (TgtBB) {
-    auto Iter = BBAddresses.find(TgtBB);
-    assert (Iter != BBAddresses.end() && "Unrecognized local BB");
-    return Iter->second;
-  }
+  if (TgtBB)
+    return getBBAddress(*TgtBB);
   auto *TargetFunc = BC.getFunctionForSymbol(Target);
   auto Iter = HotAddresses.find(TargetFunc);
   if (Iter == HotAddresses.end()) {
@@ -368,12 +564,17 @@ bool LongJmpPass::removeOrShrinkStubs(const BinaryContext &BC,
                                       BinaryFunction &Func) {
   bool Modified{false};
 
+  // Nothing to do for functions that never had stubs
+  auto StubsIter = Stubs.find(&Func);
+  if (StubsIter == Stubs.end() || StubsIter->second.empty())
+    return false;
+
   assert(BC.isAArch64() && "Unsupported arch");
   constexpr auto InsnSize = 4; // AArch64
   // Remove unnecessary stubs for branch targets we know we can fit in the
   // instruction
   for (auto &BB : Func) {
-    uint64_t DotAddress = BBAddresses[&BB];
+    uint64_t DotAddress = getBBAddress(BB);
     for (auto &Inst : BB) {
       if (!shouldInsertStub(BC, Inst) || !usesStub(BC, Func, Inst)) {
         DotAddress += InsnSize;
@@ -406,6 +607,10 @@ bool LongJmpPass::removeOrShrinkStubs(const BinaryContext &BC,
 
       auto StubSym = BC.MIB->getTargetSymbol(Inst);
       auto *StubBB = Func.getBasicBlockForLabel(StubSym);
+      if (PLTStubs.count(StubBB)) {
+        DotAddress += InsnSize;
+        continue;
+      }
       auto *RealTargetSym = BC.MIB->getTargetSymbol(*StubBB->begin());
       auto *TgtBB = Func.getBasicBlockForLabel(RealTargetSym);
       auto BitsAvail = BC.MIB->getPCRelEncodingSize(Inst) - 1;
@@ -430,7 +635,7 @@ bool LongJmpPass::removeOrShrinkStubs(const BinaryContext &BC,
   uint64_t SingleInstrMask = ~((1ULL << (RangeSingleInstr - 1)) - 1);
   // Shrink stubs from 64 to 32 or 28 bit whenever possible
   for (auto &BB : Func) {
-    if (!Stubs[&Func].count(&BB) || !BB.isValid())
+    if (!Stubs[&Func].count(&BB) || !BB.isValid() || PLTStubs.count(&BB))
       continue;
 
     auto Bits = StubBits[&BB];
@@ -441,7 +646,7 @@ bool LongJmpPass::removeOrShrinkStubs(const BinaryContext &BC,
     // Attempt to tight to short jmp
     auto *RealTargetSym = BC.MIB->getTargetSymbol(*BB.begin());
     auto *TgtBB = Func.getBasicBlockForLabel(RealTargetSym);
-    uint64_t DotAddress = BBAddresses[&BB];
+    uint64_t DotAddress = getBBAddress(BB);
     uint64_t TgtAddress = getSymbolAddress(BC, RealTargetSym, TgtBB);
     if (TgtAddress & ShortJmpMask)
       continue;
@@ -468,6 +673,75 @@ bool LongJmpPass::removeOrShrinkStubs(const BinaryContext &BC,
   return Modified;
 }
 
+void LongJmpPass::compactJumpTables(
+    const BinaryContext &BC, std::vector<BinaryFunction *> &SortedFunctions) {
+  uint64_t NumCompacted = 0;
+  uint64_t BytesSaved = 0;
+  for (auto *Func : SortedFunctions) {
+    if (!Func->isSimple() || !Func->hasJumpTables())
+      continue;
+
+    // A table shared by several jumps keeps its entries.
+    DenseMap<const JumpTable *, BinaryBasicBlock *> Sites;
+    DenseSet<const JumpTable *> Shared;
+    for (auto &BB : *Func) {
+      const auto *Last = BB.getLastNonPseudoInstr();
+      if (!Last)
+        continue;
+      const auto *JT = Func->getJumpTable(*Last);
+      if (!JT)
+        continue;
+      if (!Sites.insert(std::make_pair(JT, &BB)).second)
+        Shared.insert(JT);
+    }
+
+    for (auto &Site : Sites) {
+      auto *JT = const_cast<JumpTable *>(Site.first);
+      if (Shared.count(JT) || !JT->EntryBase || JT->OutputEntrySize != 4 ||
+          JT->Labels.size() != 1)
+        continue;
+
+      // The entries are the word offsets of the targets from the start of
+      // the function, so all of them have to be in the hot fragment.
+      uint64_t MaxOffset = 0;
+      bool InRange = true;
+      for (const auto *Entry : JT->Entries) {
+        const auto *TgtBB = Func->getBasicBlockForLabel(Entry);
+        auto Iter = TgtBB ? BBOffsets.find(TgtBB) : BBOffsets.end();
+        if (Iter == BBOffsets.end() || Iter->second.IsCold) {
+          InRange = false;
+          break;
+        }
+        MaxOffset = std::max(MaxOffset, Iter->second.Offset);
+      }
+      if (!InRange)
+        continue;
+
+      unsigned EntrySize;
+      if ((MaxOffset >> 2) < (1ULL << 8))
+        EntrySize = 1;
+      else if ((MaxOffset >> 2) < (1ULL << 16))
+        EntrySize = 2;
+      else
+        continue;
+
+      auto &BB = *Site.second;
+      auto *Last = BB.getLastNonPseudoInstr();
+      MutableArrayRef<MCInst> Insts(&BB.front(), Last);
+      if (!BC.MIB->setScaledJumpTableEntrySize(*Last, Insts.begin(),
+                                               Insts.end(), EntrySize))
+        continue;
+
+      BytesSaved += JT->Entries.size() * (JT->OutputEntrySize - EntrySize);
+      JT->OutputEntrySize = EntrySize;
+      ++NumCompacted;
+    }
+  }
+
+  outs() << "BOLT-INFO: compacted " << NumCompacted << " jump tables, saving "
+         << BytesSaved << " bytes\n";
+}
+
 void LongJmpPass::runOnFunctions(BinaryContext &BC,
                                  std::map<uint64_t, BinaryFunction> &BFs,
                                  std::set<uint64_t> &LargeFunctions) {
@@ -484,6 +758,9 @@ void LongJmpPass::runOnFunctions(BinaryContext &BC,
       Func->fixBranches();
   }
 
+  for (auto Func : Sorted)
+    tentativeBBLayout(BC, *Func);
+
   bool Modified;
   do {
     Modified = false;
@@ -493,10 +770,19 @@ void LongJmpPass::runOnFunctions(BinaryContext &BC,
         Func->eraseInvalidBBs();
         if (Func->isSimple())
           Func->fixBranches();
+        tentativeBBLayout(BC, *Func);
         Modified = true;
       }
     }
   } while (Modified);
+
+  if (opts::CompactJumpTables)
+    compactJumpTables(BC, Sorted);
+
+  if (!PLTStubs.empty()) {
+    outs() << "BOLT-INFO: " << PLTStubs.size()
+           << " PLT stubs were placed next to their hot callers\n";
+  }
 }
 
 }
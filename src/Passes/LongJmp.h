@@ -48,11 +48,41 @@ class LongJmpPass : public BinaryFunctionPass {
   /// Used to quickly identify whether a BB is a stub, sharded by function
   DenseMap<const BinaryFunction *, std::set<const BinaryBasicBlock *>> Stubs;
 
+  /// Stubs of calls from hot code to PLT entries. These stubs load the target
+  /// from GOT instead of going through the PLT entry, and are never removed
+  /// or shrunk.
+  StubMapTy HotPLTStubs;
+  std::set<const BinaryBasicBlock *> PLTStubs;
+
   using FuncAddressesMapTy = DenseMap<const BinaryFunction *, uint64_t>;
   /// Hold tentative addresses during step 2
   FuncAddressesMapTy HotAddresses;
   FuncAddressesMapTy ColdAddresses;
-  DenseMap<const BinaryBasicBlock *, uint64_t> BBAddresses;
+
+  /// Estimated sizes of the hot and cold fragments of a function.
+  struct FragmentSizes {
+    uint64_t Hot{0};
+    uint64_t Cold{0};
+    uint64_t ConstantIslands{0};
+  };
+
+  /// Offset of a basic block within its fragment.
+  struct BBOffset {
+    uint64_t Offset{0};
+    bool IsCold{false};
+  };
+
+  /// Sizes and offsets are expensive to compute, as the instructions have to
+  /// be encoded. They are cached across the iterations of step 2, and only
+  /// updated for the functions whose stubs were changed.
+  DenseMap<const BinaryFunction *, FragmentSizes> FunctionSizes;
+
+  /// Set once the cold parts of split functions were assigned their places
+  /// among the hot functions, and the constant islands to move were picked.
+  /// See BinaryFunction::hasColdFragmentsBefore() and
+  /// BinaryFunction::hasMovedConstantIslands().
+  bool ColdPlacementDone{false};
+  DenseMap<const BinaryBasicBlock *, BBOffset> BBOffsets;
 
   /// Used to remove unused stubs
   DenseMap<const BinaryBasicBlock *, int> StubRefCount;
@@ -83,12 +113,21 @@ class LongJmpPass : public BinaryFunctionPass {
   tentativeLayoutRelocMode(const BinaryContext &BC,
                            std::vector<BinaryFunction *> &SortedFunctions,
                            uint64_t DotAddress);
+  /// Lay out the cold parts of the functions in [\p Begin, \p End) of
+  /// \p SortedFunctions starting at \p DotAddress.
   uint64_t
   tentativeLayoutRelocColdPart(const BinaryContext &BC,
                               std::vector<BinaryFunction *> &SortedFunctions,
+                              uint32_t Begin, uint32_t End,
                               uint64_t DotAddress);
+
+  /// Compute the sizes of the fragments of \p Func and the offsets of its
+  /// basic blocks within them.
   void tentativeBBLayout(const BinaryContext &BC, const BinaryFunction &Func);
 
+  /// Return tentative address of \p BB
+  uint64_t getBBAddress(const BinaryBasicBlock &BB) const;
+
    /// Helper to identify whether \p Inst is branching to a stub
   bool usesStub(const BinaryContext &BC, const BinaryFunction &Func,
                 const MCInst &Inst) const;
@@ -107,6 +146,11 @@ class LongJmpPass : public BinaryFunctionPass {
   /// or completely removing them.
   bool removeOrShrinkStubs(const BinaryContext &BC, BinaryFunction &BF);
 
+  /// Shrink the entries of the jump tables relative to the start of their
+  /// function to 1 or 2 bytes where the final layout allows it.
+  void compactJumpTables(const BinaryContext &BC,
+                         std::vector<BinaryFunction *> &SortedFunctions);
+
 public:
   /// BinaryPass public interface
 
@@ -12,6 +12,7 @@
 #include "MCF.h"
 #include "BinaryFunction.h"
 #include "BinaryPassManager.h"
+#include "ParallelUtilities.h"
 #include "Passes/DataflowInfoManager.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/Support/CommandLine.h"
@@ -59,6 +60,24 @@ UseRArcs("mcf-use-rarcs",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+MCFPivotLimit("mcf-pivot-limit",
+  cl::desc("maximum number of network simplex pivots per arc of the flow "
+           "network before giving up on a function (0 = no limit)"),
+  cl::ZeroOrMore,
+  cl::init(50),
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+NoLBRMCF("nl-mcf",
+  cl::desc("in non-LBR mode, fix flow conservation of estimated edge counts "
+           "by solving a min cost flow problem on the CFG"),
+  cl::ZeroOrMore,
+  cl::init(true),
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 } // namespace opts
 
 /// This is the network simplex algorihtm of the LEMON library adapted to run
@@ -109,6 +128,30 @@ const Invalid INVALID = Invalid();
 #define LEMON_ASSERT(x, t) assert(x && t)
 #define LEMON_DEBUG(x, t) DEBUG(assert(x && t))
 
+/// Map from nodes or arcs of the digraph \c GR to values of type \c V,
+/// stored in a vector indexed by the ids of the items. Lookups are constant
+/// time, unlike with an ordered map keyed by the items.
+template <typename GR, typename K, typename V>
+class IdMap {
+  std::vector<V> Values;
+
+public:
+  V &operator[](const K &Key) {
+    const auto Id = static_cast<size_t>(GR::id(Key));
+    if (Id >= Values.size())
+      Values.resize(Id + 1);
+    return Values[Id];
+  }
+
+  const V &operator[](const K &Key) const {
+    return Values[GR::id(Key)];
+  }
+
+  void reserve(size_t Size) { Values.reserve(Size); }
+
+  void clear() { Values.clear(); }
+};
+
 /// \tparam GR The digraph type the algorithm runs on.
 /// \tparam V The number type used for flow amounts, capacity bounds
 /// and supply values in the algorithm. By default, it is \c int.
@@ -148,7 +191,10 @@ public:
     /// The objective function of the problem is unbounded, i.e.
     /// there is a directed cycle having negative total cost and
     /// infinite upper bound.
-    UNBOUNDED
+    UNBOUNDED,
+    /// The number of pivots set with \ref pivotLimit() was exceeded before
+    /// an optimal solution was found.
+    PIVOT_LIMIT
   };
 
   /// \brief Constants for selecting the type of the supply constraints.
@@ -258,12 +304,13 @@ private:
 
   // Parameters of the problem
   bool _has_lower;
+  uint64_t _pivot_limit;
   SupplyType _stype;
   Value _sum_supply;
 
   // Data structures for storing the digraph
-  std::map<Node, int> _node_id;
-  std::map<Arc, int> _arc_id;
+  IdMap<GR, Node, int> _node_id;
+  IdMap<GR, Arc, int> _arc_id;
   IntVector _source;
   IntVector _target;
   bool _arc_mixing;
@@ -706,7 +753,7 @@ public:
   /// arc order, but it makes the algorithm more robust and in special
   /// cases, even significantly faster. Therefore, it is enabled by default.
   NetworkSimplex(const GR& graph, bool arc_mixing = true) :
-    _graph(graph), _node_id(), _arc_id(),
+    _graph(graph), _pivot_limit(0), _node_id(), _arc_id(),
     _arc_mixing(arc_mixing),
     MAX(std::numeric_limits<Value>::max()),
     INF(std::numeric_limits<Value>::has_infinity ?
@@ -787,6 +834,18 @@ public:
     return *this;
   }
 
+  /// \brief Set the maximum number of pivots.
+  ///
+  /// This function bounds the running time of \ref run(), which returns
+  /// \c PIVOT_LIMIT if no optimal solution is found within \c limit
+  /// pivots. Zero, the default, means no limit.
+  ///
+  /// \return <tt>(*this)</tt>
+  NetworkSimplex& pivotLimit(uint64_t limit) {
+    _pivot_limit = limit;
+    return *this;
+  }
+
   /// \brief Set the supply values of the nodes.
   ///
   /// This function sets the supply values of the nodes.
@@ -1652,7 +1711,9 @@ private:
     if (!initialPivots()) return UNBOUNDED;
 
     // Execute the Network Simplex algorithm
+    uint64_t num_pivots = 0;
     while (pivot.findEnteringArc()) {
+      if (_pivot_limit && ++num_pivots > _pivot_limit) return PIVOT_LIMIT;
       findJoinNode();
       bool change = findLeavingArc();
       if (delta >= MAX) return UNBOUNDED;
@@ -2359,12 +2420,26 @@ void estimateEdgeCounts(BinaryFunction &BF) {
     guessEdgeByRelHotness(BF, /*UseSuccs=*/false, PredEdgeWeights,
                           SuccEdgeWeights);
   recalculateBBCounts(BF, /*AllEdges=*/false);
+
+  if (!opts::NoLBRMCF)
+    return;
+
+  // The guessed counts only balance the incoming edges of every block. Make
+  // them obey flow conservation. Skip functions with edges that have no
+  // profile, as there is nothing to balance them against.
+  for (auto &BB : BF) {
+    for (auto &BI : BB.branch_info()) {
+      if (BI.Count == BinaryBasicBlock::COUNT_NO_PROFILE)
+        return;
+    }
+  }
+  solveMCF(BF, MCF_LINEAR);
 }
 
 void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction) {
   Digraph Graph;
-  using ArcMapTy = std::map<Digraph::ArcIt, int64_t>;
-  using NodeMapTy = std::map<Digraph::Node, int64_t>;
+  using ArcMapTy = IdMap<Digraph, Digraph::Arc, int64_t>;
+  using NodeMapTy = IdMap<Digraph, Digraph::Node, int64_t>;
   using SimplexTy = NetworkSimplex<Digraph, int64_t, int64_t>;
   using Node = Digraph::Node;
   using ArcIt = Digraph::ArcIt;
@@ -2372,8 +2447,10 @@ void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction) {
   ArcMapTy LowerCapacityMap;
   ArcMapTy UpperCapacityMap;
   NodeMapTy SupplyMap;
+  // Timers are not thread-safe, and functions could be processed in parallel.
   NamedRegionTimer T("MCF", "MCF", BinaryFunctionPassManager::TimerGroupName,
-                     BinaryFunctionPassManager::TimerGroupDesc, opts::TimeOpts);
+                     BinaryFunctionPassManager::TimerGroupDesc,
+                     opts::TimeOpts && !ParallelUtilities::isParallel());
 
   SimplexTy NS(Graph);
 
@@ -2385,13 +2462,13 @@ void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction) {
   Node Src = Graph.addNode();
   Node Sink = Graph.addNode();
 
-  std::unordered_map<const BinaryBasicBlock *, Node> BBToNode;
+  DenseMap<const BinaryBasicBlock *, Node> BBToNode;
   for (auto &BB : BF) {
     BBToNode[&BB] = Graph.addNode();
   }
 
-  std::unordered_map<const BinaryBasicBlock *, std::vector<ArcIt>> BBToArcs;
-  std::unordered_map<const BinaryBasicBlock *, std::vector<ArcIt>> BBToRArcs;
+  DenseMap<const BinaryBasicBlock *, std::vector<ArcIt>> BBToArcs;
+  DenseMap<const BinaryBasicBlock *, std::vector<ArcIt>> BBToRArcs;
   for (auto BBI = BF.layout_begin(), E = BF.layout_end(); BBI != E; ++BBI) {
     auto &BB = **BBI;
     auto &ArcsVec = BBToArcs[&BB];
@@ -2518,6 +2595,8 @@ void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction) {
   }
 
   NS.reset();
+  if (opts::MCFPivotLimit)
+    NS.pivotLimit(static_cast<uint64_t>(opts::MCFPivotLimit) * Graph.arcNum());
   NS.costMap(CostMap)
     .upperMap(UpperCapacityMap)
     .lowerMap(LowerCapacityMap)
@@ -2535,6 +2614,10 @@ void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction) {
     dbgs() << "BOLT-INTERNAL ERROR: Unbounded max-flow problem created for "
            << BF << "\n";
     return;
+  } else if (Result == SimplexTy::PIVOT_LIMIT) {
+    DEBUG(dbgs() << "BOLT-DEBUG: pivot limit exceeded while solving MCF for "
+                 << BF << " - Disabling flow fixups for this function.\n");
+    return;
   }
 
   // Fix our edge counts
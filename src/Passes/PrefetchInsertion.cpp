@@ -0,0 +1,270 @@
+//===--- Passes/PrefetchInsertion.cpp - Prefetches for hot strided loads --===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "PrefetchInsertion.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Options.h"
+#include <tuple>
+
+#define DEBUG_TYPE "bolt-prefetch"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool>
+InsertPrefetches("insert-prefetches",
+  cl::desc("insert software prefetches ahead of hot strided loads in loops "
+           "using memory event samples (x86 only)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+PrefetchMinSamples("prefetch-min-samples",
+  cl::desc("minimum number of memory event samples of a load to prefetch "
+           "for it"),
+  cl::init(20),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+PrefetchDistance("prefetch-distance",
+  cl::desc("number of loop iterations to prefetch ahead (0 - derive from "
+           "-prefetch-latency and the size of the loop)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+PrefetchLatency("prefetch-latency",
+  cl::desc("memory latency to cover by prefetches, in instructions"),
+  cl::init(200),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+/// Upper bound on the number of iterations to prefetch ahead.
+constexpr uint64_t MaxDistance = 64;
+
+/// Size of the cache line a prefetch brings in.
+constexpr int64_t CacheLineSize = 64;
+
+}
+
+bool PrefetchInsertion::getStep(const BinaryContext &BC,
+                                const BinaryLoop &Loop,
+                                unsigned Reg, int64_t &Step) const {
+  Step = 0;
+  if (!Reg)
+    return true;
+
+  // The register must be updated by a single add of a constant. Other
+  // writes, including a load of the next node of a list, give no stride.
+  const auto &Aliases = BC.MIB->getAliases(Reg);
+  BitVector Written(BC.MRI->getNumRegs());
+  const MCInst *Update = nullptr;
+  for (auto *BB : Loop.blocks()) {
+    for (const auto &Inst : *BB) {
+      Written.reset();
+      BC.MIB->getWrittenRegs(Inst, Written);
+      if (!Written.anyCommon(Aliases))
+        continue;
+      if (Update)
+        return false;
+      Update = &Inst;
+    }
+  }
+  if (!Update)
+    return true;
+
+  int64_t Output;
+  if (!BC.MIB->evaluateSimple(*Update, Output, {Reg, 0}, {0, 0}))
+    return false;
+  Step = Output;
+  return true;
+}
+
+bool PrefetchInsertion::matchesSamples(const BinaryContext &BC,
+                                       const FuncMemData &MemData,
+                                       uint64_t DataOffset, int64_t Stride,
+                                       uint64_t &Count) const {
+  Count = 0;
+  std::vector<uint64_t> Addresses;
+  for (const auto &MI : MemData.getMemInfoRange(DataOffset)) {
+    Count += MI.Count;
+    if (!MI.Addr.IsSymbol) {
+      Addresses.push_back(MI.Addr.Offset);
+    } else if (auto *BD = BC.getBinaryDataByName(MI.Addr.Name)) {
+      Addresses.push_back(BD->getAddress() + MI.Addr.Offset);
+    }
+  }
+  std::sort(Addresses.begin(), Addresses.end());
+  Addresses.erase(std::unique(Addresses.begin(), Addresses.end()),
+                  Addresses.end());
+  if (Addresses.size() < 3)
+    return true;
+
+  // Samples of a strided access land on the same lattice, so most of the
+  // gaps between neighboring addresses are multiples of the stride.
+  const uint64_t AbsStride = Stride < 0 ? -Stride : Stride;
+  uint64_t NumMatching = 0;
+  for (unsigned I = 1; I < Addresses.size(); ++I) {
+    if ((Addresses[I] - Addresses[I - 1]) % AbsStride == 0)
+      ++NumMatching;
+  }
+  return NumMatching * 2 >= Addresses.size() - 1;
+}
+
+uint64_t PrefetchInsertion::getDistance(const BinaryLoop &Loop) const {
+  if (opts::PrefetchDistance)
+    return opts::PrefetchDistance;
+
+  uint64_t NumInstructions = 0;
+  for (auto *BB : Loop.blocks())
+    NumInstructions += BB->getKnownExecutionCount() * BB->getNumNonPseudos();
+  const auto HeaderCount =
+    std::max<uint64_t>(1, Loop.getHeader()->getKnownExecutionCount());
+  const auto PerIteration =
+    std::max<uint64_t>(1, NumInstructions / HeaderCount);
+  return std::min(MaxDistance,
+                  (opts::PrefetchLatency + PerIteration - 1) / PerIteration);
+}
+
+void PrefetchInsertion::runOnLoop(BinaryContext &BC,
+                                  BinaryFunction &Function,
+                                  const BinaryLoop &Loop,
+                                  bool &Changed) {
+  const auto Distance = std::max<uint64_t>(1, getDistance(Loop));
+
+  // Loops that exit before reaching the prefetched iterations would only
+  // pay for the prefetches.
+  if (Loop.EntryCount != BinaryBasicBlock::COUNT_NO_PROFILE &&
+      Loop.EntryCount &&
+      Loop.TotalBackEdgeCount / Loop.EntryCount < Distance)
+    return;
+
+  const auto *MemData = Function.getMemData();
+  std::set<std::tuple<unsigned, int64_t, unsigned, unsigned, int64_t>>
+    Prefetched;
+  for (auto *BB : Loop.blocks()) {
+    for (auto II = BB->begin(); II != BB->end(); ++II) {
+      const auto &Inst = *II;
+      if (!BC.MIB->isLoad(Inst) || BC.MIB->isPop(Inst))
+        continue;
+      auto DataOffset =
+        BC.MIB->tryGetAnnotationAs<uint64_t>(Inst, "MemDataOffset");
+      if (!DataOffset)
+        continue;
+
+      unsigned BaseReg;
+      int64_t Scale;
+      unsigned IndexReg;
+      int64_t Disp;
+      unsigned SegmentReg;
+      const MCExpr *DispExpr{nullptr};
+      if (!BC.MIB->evaluateX86MemoryOperand(Inst, &BaseReg, &Scale,
+                                            &IndexReg, &Disp, &SegmentReg,
+                                            &DispExpr) ||
+          DispExpr)
+        continue;
+
+      int64_t BaseStep;
+      int64_t IndexStep;
+      if (!getStep(BC, Loop, BaseReg, BaseStep) ||
+          !getStep(BC, Loop, IndexReg, IndexStep))
+        continue;
+      const auto Stride = BaseStep + IndexStep * Scale;
+      if (!Stride)
+        continue;
+
+      uint64_t Count;
+      if (!matchesSamples(BC, *MemData, *DataOffset, Stride, Count) ||
+          Count < opts::PrefetchMinSamples)
+        continue;
+
+      const auto PrefetchDisp =
+        Disp + static_cast<int64_t>(Distance) * Stride;
+      if (!isInt<32>(PrefetchDisp))
+        continue;
+
+      // One prefetch per cache line is enough for loads off the same
+      // registers.
+      const auto Line = PrefetchDisp >= 0
+        ? PrefetchDisp / CacheLineSize
+        : -((CacheLineSize - 1 - PrefetchDisp) / CacheLineSize);
+      if (!Prefetched.emplace(BaseReg, Scale, IndexReg, SegmentReg, Line)
+               .second)
+        continue;
+
+      MCInst Prefetch;
+      if (!BC.MIB->createPrefetch(Prefetch, BaseReg, Scale, IndexReg,
+                                  PrefetchDisp, SegmentReg))
+        continue;
+
+      DEBUG(dbgs() << "BOLT-DEBUG: prefetching " << Distance
+                   << " iterations ahead of load with stride " << Stride
+                   << " and " << Count << " samples in " << BB->getName()
+                   << " of " << Function << '\n');
+
+      II = BB->insertInstruction(II, std::move(Prefetch));
+      ++II;
+      ++NumPrefetches;
+      NumDynamicPrefetches += BB->getKnownExecutionCount();
+      Changed = true;
+    }
+  }
+}
+
+void PrefetchInsertion::runOnFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::set<uint64_t> &) {
+  if (!opts::InsertPrefetches)
+    return;
+
+  if (!BC.isX86()) {
+    errs() << "BOLT-WARNING: -insert-prefetches is only supported on x86\n";
+    return;
+  }
+
+  for (auto &It : BFs) {
+    auto &Function = It.second;
+    if (!shouldOptimize(Function) || !Function.hasValidProfile() ||
+        !Function.getMemData())
+      continue;
+
+    Function.calculateLoopInfo();
+    bool Changed = false;
+    for (auto *Loop : Function.getLoopInfo().getLoopsInPreorder()) {
+      if (Loop->getSubLoops().empty())
+        runOnLoop(BC, Function, *Loop, Changed);
+    }
+    if (Changed)
+      ++NumFunctionsChanged;
+  }
+
+  outs() << "BOLT-INFO: inserted " << NumPrefetches << " prefetches ("
+         << NumDynamicPrefetches << " dynamic executions) for strided loads "
+         << "in " << NumFunctionsChanged << " functions\n";
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,67 @@
+//===--- Passes/PrefetchInsertion.h - Prefetches for hot strided loads ----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Insert software prefetches ahead of loads in innermost loops that miss
+// often according to memory event samples, and whose address advances by a
+// constant stride every iteration. The prefetch uses the addressing of the
+// load with the displacement moved a number of iterations ahead.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_PREFETCH_INSERTION_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_PREFETCH_INSERTION_H
+
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "BinaryLoop.h"
+#include "BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+class PrefetchInsertion : public BinaryFunctionPass {
+  /// Statistics.
+  uint64_t NumPrefetches{0};
+  uint64_t NumDynamicPrefetches{0};
+  uint64_t NumFunctionsChanged{0};
+
+  /// Return true if \p Reg changes by the same amount in every iteration of
+  /// \p Loop, and set \p Step to that amount. A register that is not
+  /// written in the loop has a step of 0.
+  bool getStep(const BinaryContext &BC, const BinaryLoop &Loop,
+               unsigned Reg, int64_t &Step) const;
+
+  /// Return true unless the sampled addresses of the load at \p DataOffset
+  /// contradict \p Stride. Set \p Count to the number of samples.
+  bool matchesSamples(const BinaryContext &BC, const FuncMemData &MemData,
+                      uint64_t DataOffset, int64_t Stride,
+                      uint64_t &Count) const;
+
+  /// Return the number of iterations of \p Loop to prefetch ahead.
+  uint64_t getDistance(const BinaryLoop &Loop) const;
+
+  void runOnLoop(BinaryContext &BC, BinaryFunction &Function,
+                 const BinaryLoop &Loop, bool &Changed);
+
+public:
+  explicit PrefetchInsertion(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "prefetch-insertion";
+  }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -25,27 +25,36 @@ RegAnalysis::RegAnalysis(BinaryContext &BC,
                          std::map<uint64_t, BinaryFunction> &BFs,
                          BinaryFunctionCallGraph &CG)
     : BC(BC) {
+  // Create the entries of all functions upfront, so that the maps are not
+  // modified while visitors of other functions read them during a parallel
+  // walk. An empty set marks a function not visited yet.
+  for (CallGraph::NodeId Id = 0; Id < CG.numNodes(); ++Id) {
+    const auto *Func = CG.nodeIdToFunc(Id);
+    RegsKilledMap[Func];
+    RegsGenMap[Func];
+  }
+
   CallGraphWalker CGWalker(CG);
 
   CGWalker.registerVisitor([&](BinaryFunction *Func) -> bool {
     BitVector RegsKilled = getFunctionClobberList(Func);
-    bool Updated = RegsKilledMap.find(Func) == RegsKilledMap.end() ||
-                   RegsKilledMap[Func] != RegsKilled;
+    auto &OldRegsKilled = RegsKilledMap.find(Func)->second;
+    bool Updated = OldRegsKilled != RegsKilled;
     if (Updated)
-      RegsKilledMap[Func] = std::move(RegsKilled);
+      OldRegsKilled = std::move(RegsKilled);
     return Updated;
   });
 
   CGWalker.registerVisitor([&](BinaryFunction *Func) -> bool {
     BitVector RegsGen = getFunctionUsedRegsList(Func);
-    bool Updated = RegsGenMap.find(Func) == RegsGenMap.end() ||
-                   RegsGenMap[Func] != RegsGen;
+    auto &OldRegsGen = RegsGenMap.find(Func)->second;
+    bool Updated = OldRegsGen != RegsGen;
     if (Updated)
-      RegsGenMap[Func] = std::move(RegsGen);
+      OldRegsGen = std::move(RegsGen);
     return Updated;
   });
 
-  CGWalker.walk();
+  CGWalker.walkInParallel();
 
   if (opts::Verbosity == 0) {
 #ifndef NDEBUG
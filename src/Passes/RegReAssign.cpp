@@ -12,6 +12,7 @@
 #include "DataflowAnalysis.h"
 #include "DataflowInfoManager.h"
 #include "MCPlus.h"
+#include "ParallelUtilities.h"
 #include "RegReAssign.h"
 #include <numeric>
 
@@ -32,13 +33,22 @@ AggressiveReAssign("use-aggr-reg-reassign",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+GlobalReAssign("reg-reassign-global",
+  cl::desc("for -reg-reassign, search each profiled function for the "
+           "permutation of registers that minimizes the number of bytes "
+           "executed, instead of swapping a single pair of registers"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace llvm {
 namespace bolt {
 
 void RegReAssign::swap(BinaryContext &BC, BinaryFunction &Function, MCPhysReg A,
-                      MCPhysReg B) {
+                      MCPhysReg B, bool UpdateStats) {
   const BitVector &AliasA = BC.MIB->getAliases(A, false);
   const BitVector &AliasB = BC.MIB->getAliases(B, false);
 
@@ -53,15 +63,19 @@ void RegReAssign::swap(BinaryContext &BC, BinaryFunction &Function, MCPhysReg A,
         auto Reg = Operand.getReg();
         if (AliasA.test(Reg)) {
           Operand.setReg(BC.MIB->getAliasSized(B, BC.MIB->getRegSize(Reg)));
-          --StaticBytesSaved;
-          DynBytesSaved -= BB.getKnownExecutionCount();
+          if (UpdateStats) {
+            --StaticBytesSaved;
+            DynBytesSaved -= BB.getKnownExecutionCount();
+          }
           continue;
         }
         if (!AliasB.test(Reg))
           continue;
         Operand.setReg(BC.MIB->getAliasSized(A, BC.MIB->getRegSize(Reg)));
-        ++StaticBytesSaved;
-        DynBytesSaved += BB.getKnownExecutionCount();
+        if (UpdateStats) {
+          ++StaticBytesSaved;
+          DynBytesSaved += BB.getKnownExecutionCount();
+        }
       }
     }
   }
@@ -230,7 +244,7 @@ void RegReAssign::aggressivePassOverFunction(BinaryContext &BC,
     return;
 
   // -- expensive pass -- determine all regs alive during func start
-  DataflowInfoManager Info(BC, Function, RA.get(), nullptr);
+  auto &Info = DataflowInfoCache::get(BC, Function, RA.get(), nullptr);
   auto AliveAtStart = *Info.getLivenessAnalysis().getStateAt(
       ProgramPoint::getFirstPointAt(*Function.begin()));
   for (auto &BB : Function) {
@@ -336,6 +350,206 @@ bool RegReAssign::conservativePassOverFunction(BinaryContext &BC,
   return true;
 }
 
+uint64_t
+RegReAssign::getPermutedSize(const BinaryContext &BC, const MCInst &Inst,
+                             const std::vector<MCPhysReg> &Perm) const {
+  MCInst Copy = Inst;
+  for (int I = 0, E = MCPlus::getNumPrimeOperands(Copy); I != E; ++I) {
+    auto &Operand = Copy.getOperand(I);
+    if (!Operand.isReg())
+      continue;
+    const auto Reg = Operand.getReg();
+    const auto Rep = RegToRep[Reg];
+    if (!Rep || Perm[Rep] == Rep)
+      continue;
+    Operand.setReg(BC.MIB->getAliasSized(Perm[Rep], BC.MIB->getRegSize(Reg)));
+  }
+  return BC.computeCodeSize(&Copy, &Copy + 1);
+}
+
+void RegReAssign::globalPassOverFunction(BinaryContext &BC,
+                                        BinaryFunction &Function) {
+  const auto NumRegs = BC.MRI->getNumRegs();
+
+  // Instructions referencing candidate registers, with their current size.
+  struct InstInfo {
+    const MCInst *Inst;
+    uint64_t Count;
+    uint64_t Size;
+  };
+  std::vector<InstInfo> Insts;
+  DenseMap<MCPhysReg, std::vector<uint32_t>> InstsByRep;
+  BitVector Blacklisted(NumRegs, false);
+  BitVector Saved(NumRegs, false);
+  bool HasCalls = false;
+
+  auto blacklist = [&](MCPhysReg Reg) {
+    if (RegToRep[Reg])
+      Blacklisted.set(RegToRep[Reg]);
+  };
+
+  for (auto &BB : Function) {
+    for (auto &Inst : BB) {
+      if (BC.MIB->isCall(Inst) || BC.MIB->isIndirectBranch(Inst))
+        HasCalls = true;
+
+      // Registers saved to the frame. A callee-saved register holding the
+      // value of the caller at the entry may only be exchanged if it is.
+      if (auto FIE = FA->getFIEFor(Inst)) {
+        if (FIE->IsStore && FIE->IsStoreFromReg && FIE->RegOrImm > 0 &&
+            uint64_t(FIE->RegOrImm) < NumRegs && RegToRep[FIE->RegOrImm])
+          Saved.set(RegToRep[FIE->RegOrImm]);
+      }
+
+      const auto &Desc = BC.MII->get(Inst.getOpcode());
+      for (auto *Use = Desc.getImplicitUses(); Use && *Use; ++Use)
+        blacklist(*Use);
+      for (auto *Def = Desc.getImplicitDefs(); Def && *Def; ++Def)
+        blacklist(*Def);
+
+      const bool CannotUseREX = BC.MIB->cannotUseREX(Inst);
+      const uint32_t Index = Insts.size();
+      bool HasCandidate = false;
+      for (int I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I) {
+        const auto &Operand = Inst.getOperand(I);
+        if (!Operand.isReg())
+          continue;
+        const auto Rep = RegToRep[Operand.getReg()];
+        if (!Rep)
+          continue;
+        // There is no extended counterpart of AH-DH.
+        if (CannotUseREX || BC.MIB->isUpper8BitReg(Operand.getReg()))
+          Blacklisted.set(Rep);
+        auto &List = InstsByRep[Rep];
+        if (List.empty() || List.back() != Index)
+          List.push_back(Index);
+        HasCandidate = true;
+      }
+      if (HasCandidate) {
+        Insts.push_back({&Inst, BB.getKnownExecutionCount(),
+                         BC.computeCodeSize(&Inst, &Inst + 1)});
+      }
+    }
+  }
+
+  auto &Info = DataflowInfoCache::get(BC, Function, RA.get(), FA.get());
+  auto &LA = Info.getLivenessAnalysis();
+  BitVector LiveIn(NumRegs, false);
+  for (auto &BB : Function) {
+    if (BB.pred_size() == 0)
+      LiveIn |= *LA.getStateAt(ProgramPoint::getFirstPointAt(BB));
+  }
+  BitVector LiveOut(NumRegs, false);
+  BC.MIB->getDefaultLiveOut(LiveOut);
+  auto anyAliasIn = [&](const BitVector &Regs, MCPhysReg Rep) {
+    BitVector Aliases = BC.MIB->getAliases(Rep, false);
+    Aliases &= Regs;
+    return Aliases.any();
+  };
+
+  // Callee-saved registers stay callee-saved. Other registers may only move
+  // when no call or tail call sees them and they carry no value in or out.
+  std::vector<MCPhysReg> CSRCandidates;
+  std::vector<MCPhysReg> ScratchCandidates;
+  for (const auto Rep : GPReps) {
+    if (Blacklisted[Rep])
+      continue;
+    if (CalleeSaved[Rep]) {
+      if (anyAliasIn(LiveIn, Rep) && !Saved[Rep])
+        continue;
+      CSRCandidates.push_back(Rep);
+      continue;
+    }
+    if (HasCalls || anyAliasIn(LiveIn, Rep) || anyAliasIn(LiveOut, Rep))
+      continue;
+    ScratchCandidates.push_back(Rep);
+  }
+
+  // Greedily apply the exchange of two candidates that saves the most
+  // executed bytes, then the most static bytes, until none saves anything.
+  std::vector<MCPhysReg> Perm(NumRegs);
+  std::iota(Perm.begin(), Perm.end(), 0);
+  std::vector<std::pair<MCPhysReg, MCPhysReg>> Swaps;
+  std::vector<uint32_t> Visited(Insts.size(), 0);
+  uint32_t Stamp = 0;
+  int64_t DynDelta = 0;
+  int64_t StaticDelta = 0;
+
+  auto forEachAffected = [&](MCPhysReg A, MCPhysReg B,
+                             std::function<void(InstInfo &)> Callback) {
+    ++Stamp;
+    for (const auto Rep : {A, B}) {
+      auto It = InstsByRep.find(Rep);
+      if (It == InstsByRep.end())
+        continue;
+      for (const auto Index : It->second) {
+        if (Visited[Index] == Stamp)
+          continue;
+        Visited[Index] = Stamp;
+        Callback(Insts[Index]);
+      }
+    }
+  };
+
+  auto improve = [&](const std::vector<MCPhysReg> &Candidates) {
+    for (unsigned Iter = 0; Iter < Candidates.size(); ++Iter) {
+      int64_t BestDyn = 0;
+      int64_t BestStatic = 0;
+      MCPhysReg BestA = 0;
+      MCPhysReg BestB = 0;
+      for (unsigned I = 0; I < Candidates.size(); ++I) {
+        for (unsigned J = I + 1; J < Candidates.size(); ++J) {
+          const auto A = Candidates[I];
+          const auto B = Candidates[J];
+          int64_t Dyn = 0;
+          int64_t Static = 0;
+          std::swap(Perm[A], Perm[B]);
+          forEachAffected(A, B, [&](InstInfo &II) {
+            const int64_t Delta =
+                int64_t(getPermutedSize(BC, *II.Inst, Perm)) - II.Size;
+            Dyn += Delta * int64_t(II.Count);
+            Static += Delta;
+          });
+          std::swap(Perm[A], Perm[B]);
+          if (Dyn < BestDyn || (Dyn == BestDyn && Static < BestStatic)) {
+            BestDyn = Dyn;
+            BestStatic = Static;
+            BestA = A;
+            BestB = B;
+          }
+        }
+      }
+      if (!BestA)
+        return;
+
+      DEBUG(dbgs() << " ** Exchanging " << BC.MRI->getName(Perm[BestA])
+                   << " with " << BC.MRI->getName(Perm[BestB]) << " saves "
+                   << -BestDyn << " executed bytes\n");
+      Swaps.emplace_back(Perm[BestA], Perm[BestB]);
+      std::swap(Perm[BestA], Perm[BestB]);
+      forEachAffected(BestA, BestB, [&](InstInfo &II) {
+        II.Size = getPermutedSize(BC, *II.Inst, Perm);
+      });
+      DynDelta += BestDyn;
+      StaticDelta += BestStatic;
+    }
+  };
+  improve(CSRCandidates);
+  improve(ScratchCandidates);
+
+  if (Swaps.empty())
+    return;
+
+  // Each exchange was chosen in terms of the registers at that point.
+  for (const auto &Swap : Swaps)
+    swap(BC, Function, Swap.first, Swap.second, /*UpdateStats=*/false);
+
+  std::lock_guard<std::mutex> Lock(StatsMutex);
+  FuncsChanged.insert(&Function);
+  StaticBytesSaved -= StaticDelta;
+  DynBytesSaved -= DynDelta;
+}
+
 void RegReAssign::setupAggressivePass(BinaryContext &BC,
                                      std::map<uint64_t, BinaryFunction> &BFs) {
   setupConservativePass(BC, BFs);
@@ -346,6 +560,29 @@ void RegReAssign::setupAggressivePass(BinaryContext &BC,
   BC.MIB->getGPRegs(GPRegs);
 }
 
+void RegReAssign::setupGlobalPass(BinaryContext &BC,
+                                  std::map<uint64_t, BinaryFunction> &BFs) {
+  setupAggressivePass(BC, BFs);
+  FA.reset(new FrameAnalysis(BC, BFs, *CG));
+
+  BitVector Excluded = BC.MIB->getAliases(BC.MIB->getStackPointer(), false);
+  Excluded |= BC.MIB->getAliases(BC.MIB->getFramePointer(), false);
+  RegToRep = std::vector<MCPhysReg>(BC.MRI->getNumRegs(), 0);
+  for (int Reg = GPRegs.find_first(); Reg != -1; Reg = GPRegs.find_next(Reg)) {
+    if (!Excluded[Reg])
+      RegToRep[Reg] = BC.MIB->getAliases(Reg, false).find_first();
+  }
+
+  BitVector BaseRegs(BC.MRI->getNumRegs(), false);
+  BC.MIB->getGPRegs(BaseRegs, /*IncludeAlias=*/false);
+  GPReps.clear();
+  for (int Reg = BaseRegs.find_first(); Reg != -1;
+       Reg = BaseRegs.find_next(Reg)) {
+    if (RegToRep[Reg])
+      GPReps.push_back(RegToRep[Reg]);
+  }
+}
+
 void RegReAssign::setupConservativePass(
     BinaryContext &BC, std::map<uint64_t, BinaryFunction> &BFs) {
   // Set up constant bitvectors used throughout this analysis
@@ -386,28 +623,43 @@ void RegReAssign::runOnFunctions(BinaryContext &BC,
   RegScore = std::vector<int64_t>(BC.MRI->getNumRegs(), 0);
   RankedRegs = std::vector<size_t>(BC.MRI->getNumRegs(), 0);
 
-  if (opts::AggressiveReAssign)
-    setupAggressivePass(BC, BFs);
-  else
-    setupConservativePass(BC, BFs);
-
-  for (auto &I : BFs) {
-    auto &Function = I.second;
-
-    if (!Function.isSimple() || !opts::shouldProcess(Function))
-      continue;
+  if (opts::GlobalReAssign) {
+    setupGlobalPass(BC, BFs);
+    ParallelUtilities::runOnEachFunction(
+        BFs, ParallelUtilities::SP_INST_QUADRATIC,
+        [&](BinaryFunction &BF) {
+          globalPassOverFunction(BC, BF);
+        },
+        [&](const BinaryFunction &BF) {
+          return !BF.isSimple() || !opts::shouldProcess(BF) ||
+                 BF.getKnownExecutionCount() == 0;
+        },
+        "RegReAssign");
+    FA.reset();
+  } else {
+    if (opts::AggressiveReAssign)
+      setupAggressivePass(BC, BFs);
+    else
+      setupConservativePass(BC, BFs);
+
+    for (auto &I : BFs) {
+      auto &Function = I.second;
+
+      if (!Function.isSimple() || !opts::shouldProcess(Function))
+        continue;
 
-    DEBUG(dbgs() << "====================================\n");
-    DEBUG(dbgs() << " - " << Function.getPrintName() << "\n");
-    if (!conservativePassOverFunction(BC, Function) &&
-        opts::AggressiveReAssign) {
-      aggressivePassOverFunction(BC, Function);
-      DEBUG({
-        if (FuncsChanged.count(&Function)) {
-          dbgs() << "Aggressive pass successful on " << Function.getPrintName()
-                 << "\n";
-        }
-      });
+      DEBUG(dbgs() << "====================================\n");
+      DEBUG(dbgs() << " - " << Function.getPrintName() << "\n");
+      if (!conservativePassOverFunction(BC, Function) &&
+          opts::AggressiveReAssign) {
+        aggressivePassOverFunction(BC, Function);
+        DEBUG({
+          if (FuncsChanged.count(&Function)) {
+            dbgs() << "Aggressive pass successful on "
+                   << Function.getPrintName() << "\n";
+          }
+        });
+      }
     }
   }
 
@@ -12,7 +12,9 @@
 #define LLVM_TOOLS_LLVM_BOLT_PASSES_REGREASSIGN_H
 
 #include "BinaryPasses.h"
+#include "FrameAnalysis.h"
 #include "RegAnalysis.h"
+#include <mutex>
 
 namespace llvm {
 namespace bolt {
@@ -26,17 +28,32 @@ class RegReAssign : public BinaryFunctionPass {
   BitVector ExtendedCSR;
   BitVector GPRegs;
 
+  /// Map every general-purpose register to the representative of its
+  /// aliases, and 0 for other registers. Used by the global pass.
+  std::vector<MCPhysReg> RegToRep;
+
+  /// Representatives of the general-purpose registers the global pass may
+  /// exchange. The stack and frame pointers are never part of them.
+  std::vector<MCPhysReg> GPReps;
+
   /// Hooks to other passes
   std::unique_ptr<RegAnalysis> RA;
   std::unique_ptr<BinaryFunctionCallGraph> CG;
+  std::unique_ptr<FrameAnalysis> FA;
 
   /// Stats
   DenseSet<const BinaryFunction *> FuncsChanged;
   int64_t StaticBytesSaved{0};
   int64_t DynBytesSaved{0};
 
+  /// Protects FuncsChanged and the stats when functions are processed in
+  /// parallel.
+  std::mutex StatsMutex;
+
+  /// Swap registers \p A and \p B in \p Function, including in its CFI.
+  /// If \p UpdateStats is false, leave the estimate of saved bytes alone.
   void swap(BinaryContext &BC, BinaryFunction &Function, MCPhysReg A,
-            MCPhysReg B);
+            MCPhysReg B, bool UpdateStats = true);
   void rankRegisters(BinaryContext &BC, BinaryFunction &Function);
   void aggressivePassOverFunction(BinaryContext &BC, BinaryFunction &Function);
   bool conservativePassOverFunction(BinaryContext &BC,
@@ -46,6 +63,20 @@ class RegReAssign : public BinaryFunctionPass {
   void setupConservativePass(BinaryContext &BC,
                              std::map<uint64_t, BinaryFunction> &BFs);
 
+  /// Return the size of \p Inst once every register in it is replaced with
+  /// the register that \p Perm assigns to its representative.
+  uint64_t getPermutedSize(const BinaryContext &BC, const MCInst &Inst,
+                           const std::vector<MCPhysReg> &Perm) const;
+
+  /// Search for the permutation of the registers of \p Function that
+  /// minimizes the number of bytes executed according to the profile, then
+  /// apply it. Callee-saved registers are only exchanged with each other,
+  /// and other registers only in functions without calls, when they carry
+  /// no value in or out of the function. Thread-safe.
+  void globalPassOverFunction(BinaryContext &BC, BinaryFunction &Function);
+  void setupGlobalPass(BinaryContext &BC,
+                       std::map<uint64_t, BinaryFunction> &BFs);
+
 public:
   /// BinaryPass public interface
 
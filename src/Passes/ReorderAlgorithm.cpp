@@ -134,20 +134,21 @@ void GreedyClusterAlgorithm::clusterBasicBlocks(const BinaryFunction &BF,
     ClusterEdges.resize(BF.layout_size());
 
   // Initialize clusters and edge queue.
-  for (auto BB : BF.layout()) {
+  CFG = CompactCFG(BF);
+  for (uint32_t I = 0; I < CFG.size(); ++I) {
     // Create a cluster for this BB.
-    uint32_t I = Clusters.size();
+    auto *BB = CFG.getBlock(I);
     Clusters.emplace_back();
     auto &Cluster = Clusters.back();
     Cluster.push_back(BB);
     BBToClusterMap[BB] = I;
     // Populate priority queue with edges.
-    auto BI = BB->branch_info_begin();
-    for (auto &I : BB->successors()) {
-      assert(BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
+    const auto Succs = CFG.successors(I);
+    const auto Counts = CFG.successorCounts(I);
+    for (unsigned K = 0; K < Succs.size(); ++K) {
+      assert(Counts[K] != BinaryBasicBlock::COUNT_NO_PROFILE &&
              "attempted reordering blocks of function with no profile data");
-      Queue.emplace_back(EdgeTy(BB, I, BI->Count));
-      ++BI;
+      Queue.emplace_back(EdgeTy(BB, CFG.getBlock(Succs[K]), Counts[K]));
     }
   }
   // Sort and adjust the edge queue.
@@ -221,6 +222,7 @@ void GreedyClusterAlgorithm::clusterBasicBlocks(const BinaryFunction &BF,
 void GreedyClusterAlgorithm::reset() {
   ClusterAlgorithm::reset();
   BBToClusterMap.clear();
+  CFG = CompactCFG();
 }
 
 void PHGreedyClusterAlgorithm::initQueue(
@@ -262,39 +264,39 @@ int64_t MinBranchGreedyClusterAlgorithm::calculateWeight(
   // Initial weight value.
   int64_t W = (int64_t)E.Count;
 
+  // Block indices in CFG follow the layout, so the entry block is 0.
+  const auto Src = CFG.getIndex(SrcBB);
+  const auto Dst = CFG.getIndex(DstBB);
+
   // Adjust the weight by taking into account other edges with the same source.
-  auto BI = SrcBB->branch_info_begin();
-  for (const BinaryBasicBlock *SuccBB : SrcBB->successors()) {
-    assert(BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
+  const auto Succs = CFG.successors(Src);
+  const auto Counts = CFG.successorCounts(Src);
+  for (unsigned K = 0; K < Succs.size(); ++K) {
+    assert(Counts[K] != BinaryBasicBlock::COUNT_NO_PROFILE &&
            "attempted reordering blocks of function with no profile data");
-    assert(BI->Count <= std::numeric_limits<int64_t>::max() &&
+    assert(Counts[K] <= std::numeric_limits<int64_t>::max() &&
            "overflow detected");
     // Ignore edges with same source and destination, edges that target the
     // entry block as well as the edge E itself.
-    if (SuccBB != SrcBB && SuccBB != *BF.layout_begin() && SuccBB != DstBB)
-      W -= (int64_t)BI->Count;
-    ++BI;
+    if (Succs[K] != Src && Succs[K] != 0 && Succs[K] != Dst)
+      W -= (int64_t)Counts[K];
   }
 
   // Adjust the weight by taking into account other edges with the same
   // destination.
-  for (const BinaryBasicBlock *PredBB : DstBB->predecessors()) {
+  const auto Preds = CFG.predecessors(Dst);
+  const auto PredEdges = CFG.predecessorEdges(Dst);
+  for (unsigned K = 0; K < Preds.size(); ++K) {
     // Ignore edges with same source and destination as well as the edge E
     // itself.
-    if (PredBB == DstBB || PredBB == SrcBB)
+    if (Preds[K] == Dst || Preds[K] == Src)
       continue;
-    auto BI = PredBB->branch_info_begin();
-    for (const BinaryBasicBlock *SuccBB : PredBB->successors()) {
-      if (SuccBB == DstBB)
-        break;
-      ++BI;
-    }
-    assert(BI != PredBB->branch_info_end() && "invalid control flow graph");
-    assert(BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
+    const auto Count = CFG.getEdgeCount(PredEdges[K]);
+    assert(Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
            "attempted reordering blocks of function with no profile data");
-    assert(BI->Count <= std::numeric_limits<int64_t>::max() &&
+    assert(Count <= std::numeric_limits<int64_t>::max() &&
            "overflow detected");
-    W -= (int64_t)BI->Count;
+    W -= (int64_t)Count;
   }
 
   return W;
@@ -405,18 +407,17 @@ void OptimalReorderAlgorithm::reorderBasicBlocks(
          "cannot use TSP solution for sizes larger than bits in uint64_t");
 
   // Populating weight map and index map
-  for (auto *BB : BF.layout()) {
-    BB->setLayoutIndex(IndexToBB.size());
-    IndexToBB.push_back(BB);
-  }
+  const CompactCFG CFG(BF);
+  for (uint32_t I = 0; I < N; ++I)
+    IndexToBB.push_back(CFG.getBlock(I));
   Weight.resize(N);
-  for (auto *BB : BF.layout()) {
-    auto BI = BB->branch_info_begin();
-    Weight[BB->getLayoutIndex()].resize(N);
-    for (auto *SuccBB : BB->successors()) {
-      if (BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE)
-        Weight[BB->getLayoutIndex()][SuccBB->getLayoutIndex()] = BI->Count;
-      ++BI;
+  for (uint32_t I = 0; I < N; ++I) {
+    Weight[I].resize(N);
+    const auto Succs = CFG.successors(I);
+    const auto Counts = CFG.successorCounts(I);
+    for (unsigned K = 0; K < Succs.size(); ++K) {
+      if (Counts[K] != BinaryBasicBlock::COUNT_NO_PROFILE)
+        Weight[I][Succs[K]] = Counts[K];
     }
   }
 
@@ -15,6 +15,7 @@
 #define LLVM_TOOLS_LLVM_BOLT_PASSES_REORDER_ALGORITHM_H
 
 #include "BinaryFunction.h"
+#include "CompactCFG.h"
 #include "llvm/Support/ErrorHandling.h"
 #include <unordered_map>
 #include <memory>
@@ -103,6 +104,9 @@ protected:
                                               unsigned>;
   BBToClusterMapTy BBToClusterMap;
 
+  // Edges of the function being clustered, in layout order.
+  CompactCFG CFG;
+
 public:
   void clusterBasicBlocks(const BinaryFunction &BF,
                           bool ComputeEdges = false) override;
@@ -250,6 +254,14 @@ public:
       const BinaryFunction &BF, BasicBlockOrder &Order) const override;
 };
 
+/// Basic block layout maximizing the ExtTSP metric by greedy merging of
+/// chains of blocks, with gains maintained incrementally.
+class ExtTSPReorderAlgorithm : public ReorderAlgorithm {
+public:
+  void reorderBasicBlocks(
+      const BinaryFunction &BF, BasicBlockOrder &Order) const override;
+};
+
 /// Toy example that simply reverses the original basic block order.
 class ReverseReorderAlgorithm : public ReorderAlgorithm {
 public:
@@ -10,12 +10,12 @@
 //===----------------------------------------------------------------------===//
 
 // TODO:
-// - make sure writeable data isn't put on same cache line unless temporally local
 // - estimate temporal locality by looking at CFG?
 
 #include "ReorderData.h"
 #include <numeric>
 #include <algorithm>
+#include <unordered_map>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "reorder-data"
@@ -44,7 +44,8 @@ ReorderData("reorder-data",
 
 enum ReorderAlgo : char {
   REORDER_COUNT         = 0,
-  REORDER_FUNCS         = 1
+  REORDER_FUNCS         = 1,
+  REORDER_AFFINITY      = 2
 };
 
 static cl::opt<ReorderAlgo>
@@ -57,7 +58,11 @@ ReorderAlgorithm("reorder-data-algo",
       "sort hot data by read counts"),
     clEnumValN(REORDER_FUNCS,
       "funcs",
-      "sort hot data by hot function usage and count")),
+      "sort hot data by hot function usage and count"),
+    clEnumValN(REORDER_AFFINITY,
+      "affinity",
+      "cluster hot data accessed by the same functions and lay out the "
+      "clusters at cache line boundaries")),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
@@ -75,6 +80,23 @@ ReorderDataMaxBytes("reorder-data-max-bytes",
   cl::init(std::numeric_limits<unsigned>::max()),
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+ReorderDataClusterSize("reorder-data-cluster-size",
+  cl::desc("maximum size in bytes of a cluster of data objects formed by "
+           "-reorder-data-algo=affinity"),
+  cl::init(4096),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ReorderDataMaxAffinityObjects("reorder-data-max-affinity-objects",
+  cl::desc("maximum number of the hottest data objects of a function "
+           "considered for affinity by -reorder-data-algo=affinity"),
+  cl::init(64),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::list<std::string>
 ReorderSymbols("reorder-symbols",
   cl::CommaSeparated,
@@ -106,6 +128,7 @@ namespace bolt {
 namespace {
 
 static constexpr uint16_t MinAlignment = 16;
+static constexpr uint16_t CacheLineSize = 64;
 
 bool isSupported(const BinarySection &BS) {
   return BS.isData() && !BS.isTLS();
@@ -269,13 +292,134 @@ std::pair<DataOrder, unsigned> ReorderData::sortedByCount(
   return std::make_pair(Order, SplitPoint);
 }
 
-// TODO
-// add option for cache-line alignment (or just use cache-line when section
-// is writeable)?
+/// Cluster hot data by co-access affinity. Two objects have an affinity
+/// proportional to the number of accesses to them from the same function.
+/// Pairs of clusters with the highest affinity are merged first as long as
+/// the merged cluster does not exceed -reorder-data-cluster-size bytes.
+/// Clusters are then ordered by density.
+std::pair<DataOrder, unsigned> ReorderData::sortedByAffinity(
+  BinaryContext &BC,
+  const BinarySection &Section,
+  std::unordered_set<const BinaryData *> &ClusterStarts
+) const {
+  auto Order = baseOrder(BC, Section);
+
+  std::vector<DataOrder::value_type> Hot;
+  DataOrder Cold;
+  for (auto &Entry : Order) {
+    if (Entry.second && filterSymbol(Entry.first))
+      Hot.push_back(Entry);
+    else
+      Cold.push_back(Entry);
+  }
+
+  // Index of every hot object and the objects accessed by each function.
+  std::unordered_map<const BinaryData *, unsigned> HotIndex;
+  for (unsigned I = 0; I < Hot.size(); ++I)
+    HotIndex[Hot[I].first] = I;
+
+  std::map<StringRef, std::map<unsigned, uint64_t>> FuncAccesses;
+  for (unsigned I = 0; I < Hot.size(); ++I) {
+    for (const auto &MI : Hot[I].first->memData()) {
+      if (MI.Offset.IsSymbol)
+        FuncAccesses[MI.Offset.Name][I] += MI.Count;
+    }
+  }
+
+  // Affinity between pairs of objects (in the order of their indices).
+  std::map<std::pair<unsigned, unsigned>, uint64_t> Affinity;
+  for (auto &FuncEntry : FuncAccesses) {
+    std::vector<std::pair<unsigned, uint64_t>> Accesses(
+        FuncEntry.second.begin(), FuncEntry.second.end());
+    std::stable_sort(Accesses.begin(), Accesses.end(),
+                     [](const std::pair<unsigned, uint64_t> &A,
+                        const std::pair<unsigned, uint64_t> &B) {
+                       return A.second > B.second;
+                     });
+    if (Accesses.size() > opts::ReorderDataMaxAffinityObjects)
+      Accesses.resize(opts::ReorderDataMaxAffinityObjects);
+
+    for (unsigned I = 0; I < Accesses.size(); ++I) {
+      for (unsigned J = I + 1; J < Accesses.size(); ++J) {
+        auto Key = std::make_pair(Accesses[I].first, Accesses[J].first);
+        if (Key.first > Key.second)
+          std::swap(Key.first, Key.second);
+        Affinity[Key] += std::min(Accesses[I].second, Accesses[J].second);
+      }
+    }
+  }
+
+  std::vector<std::pair<std::pair<unsigned, unsigned>, uint64_t>> Edges(
+      Affinity.begin(), Affinity.end());
+  std::stable_sort(Edges.begin(), Edges.end(),
+                   [](const decltype(Edges)::value_type &A,
+                      const decltype(Edges)::value_type &B) {
+                     return A.second > B.second;
+                   });
+
+  // Every object starts in a cluster of its own.
+  std::vector<unsigned> ClusterOf(Hot.size());
+  std::vector<std::vector<unsigned>> Clusters(Hot.size());
+  std::vector<uint64_t> ClusterSize(Hot.size());
+  std::vector<uint64_t> ClusterCount(Hot.size());
+  for (unsigned I = 0; I < Hot.size(); ++I) {
+    ClusterOf[I] = I;
+    Clusters[I].push_back(I);
+    ClusterSize[I] = Hot[I].first->getSize();
+    ClusterCount[I] = Hot[I].second;
+  }
+
+  for (const auto &Edge : Edges) {
+    const auto Into = ClusterOf[Edge.first.first];
+    const auto From = ClusterOf[Edge.first.second];
+    if (Into == From ||
+        ClusterSize[Into] + ClusterSize[From] > opts::ReorderDataClusterSize)
+      continue;
+
+    for (auto I : Clusters[From]) {
+      ClusterOf[I] = Into;
+      Clusters[Into].push_back(I);
+    }
+    Clusters[From].clear();
+    ClusterSize[Into] += ClusterSize[From];
+    ClusterCount[Into] += ClusterCount[From];
+  }
+
+  std::vector<unsigned> ClusterOrder;
+  for (unsigned I = 0; I < Clusters.size(); ++I) {
+    if (!Clusters[I].empty())
+      ClusterOrder.push_back(I);
+  }
+  auto density = [&](unsigned Idx) {
+    return double(ClusterCount[Idx]) / std::max<uint64_t>(1, ClusterSize[Idx]);
+  };
+  std::stable_sort(ClusterOrder.begin(), ClusterOrder.end(),
+                   [&](unsigned A, unsigned B) {
+                     return density(A) > density(B);
+                   });
+
+  DataOrder NewOrder;
+  for (auto ClusterIdx : ClusterOrder) {
+    ClusterStarts.insert(Hot[Clusters[ClusterIdx].front()].first);
+    for (auto I : Clusters[ClusterIdx])
+      NewOrder.push_back(Hot[I]);
+  }
+  const unsigned SplitPoint = NewOrder.size();
+  NewOrder.insert(NewOrder.end(), Cold.begin(), Cold.end());
+
+  DEBUG(dbgs() << "BOLT-DEBUG: formed " << ClusterOrder.size()
+               << " clusters of " << Hot.size() << " hot objects in "
+               << Section.getName() << "\n");
+
+  return std::make_pair(NewOrder, SplitPoint);
+}
+
 void ReorderData::setSectionOrder(BinaryContext &BC,
                                   BinarySection &OutputSection,
                                   DataOrder::iterator Begin,
-                                  DataOrder::iterator End) {
+                                  DataOrder::iterator End,
+                                  const std::unordered_set<const BinaryData *>
+                                    *ClusterStarts) {
   std::vector<BinaryData *> NewOrder;
   unsigned NumReordered = 0;
   uint64_t Offset = 0;
@@ -309,6 +453,16 @@ void ReorderData::setSectionOrder(BinaryContext &BC,
     auto Alignment = std::max(BD->getAlignment(), MinAlignment);
     Offset = alignTo(Offset, Alignment);
 
+    // Start every cluster at a new cache line and avoid splitting objects
+    // that fit into a single cache line.
+    if (ClusterStarts) {
+      if (ClusterStarts->count(BD) ||
+          (BD->getSize() <= CacheLineSize &&
+           Offset / CacheLineSize !=
+             (Offset + BD->getSize() - 1) / CacheLineSize))
+        Offset = alignTo(Offset, CacheLineSize);
+    }
+
     if ((Offset + BD->getSize()) > opts::ReorderDataMaxBytes) {
       if (!NewOrder.empty()) {
         dbgs() << "BOLT-DEBUG: processing ending on symbol "
@@ -385,6 +539,7 @@ void ReorderData::runOnFunctions(BinaryContext &BC,
   static const char* DefaultSections[] = {
     ".rodata",
     ".data",
+    ".data.rel.ro",
     ".bss",
     nullptr
   };
@@ -429,13 +584,20 @@ void ReorderData::runOnFunctions(BinaryContext &BC,
 
     DataOrder Order;
     unsigned SplitPointIdx;
+    std::unordered_set<const BinaryData *> ClusterStarts;
+    const std::unordered_set<const BinaryData *> *ClusterStartsPtr = nullptr;
 
     if (opts::ReorderAlgorithm == opts::ReorderAlgo::REORDER_COUNT) {
       outs() << "BOLT-INFO: reorder-sections: ordering data by count\n";
       std::tie(Order, SplitPointIdx) = sortedByCount(BC, *Section);
-    } else {
+    } else if (opts::ReorderAlgorithm == opts::ReorderAlgo::REORDER_FUNCS) {
       outs() << "BOLT-INFO: reorder-sections: ordering data by funcs\n";
       std::tie(Order, SplitPointIdx) = sortedByFunc(BC, *Section, BFs);
+    } else {
+      outs() << "BOLT-INFO: reorder-sections: ordering data by affinity\n";
+      std::tie(Order, SplitPointIdx) =
+        sortedByAffinity(BC, *Section, ClusterStarts);
+      ClusterStartsPtr = &ClusterStarts;
     }
     auto SplitPoint = Order.begin() + SplitPointIdx;
 
@@ -455,7 +617,8 @@ void ReorderData::runOnFunctions(BinaryContext &BC,
                                       *Section);
 
       // Reorder contents of original section.
-      setSectionOrder(BC, *Section, Order.begin(), SplitPoint);
+      setSectionOrder(BC, *Section, Order.begin(), SplitPoint,
+                      ClusterStartsPtr);
 
       // This keeps the original data from thinking it has been moved.
       for (auto &Entry : BC.getBinaryDataForSection(*Section)) {
@@ -466,7 +629,8 @@ void ReorderData::runOnFunctions(BinaryContext &BC,
       }
     } else {
       outs() << "BOLT-WARNING: Inplace section reordering not supported yet.\n";
-      setSectionOrder(BC, *Section, Order.begin(), Order.end());
+      setSectionOrder(BC, *Section, Order.begin(), Order.end(),
+                      ClusterStartsPtr);
     }
   }
 }
@@ -14,6 +14,7 @@
 
 #include "BinaryPasses.h"
 #include "BinarySection.h"
+#include <unordered_set>
 
 namespace llvm {
 namespace bolt {
@@ -36,17 +37,29 @@ private:
                const BinarySection &Section,
                std::map<uint64_t, BinaryFunction> &BFs) const;
 
+  /// Cluster hot symbols accessed from the same functions and order the
+  /// clusters by density. The first symbol of every cluster is added to
+  /// \p ClusterStarts.
+  std::pair<DataOrder, unsigned>
+  sortedByAffinity(BinaryContext &BC,
+                   const BinarySection &Section,
+                   std::unordered_set<const BinaryData *> &ClusterStarts) const;
+
   void printOrder(const BinarySection &Section,
                   DataOrder::const_iterator Begin,
                   DataOrder::const_iterator End) const;
 
   /// Set the ordering of the section with \p SectionName.  \p NewOrder is a
   /// vector of [old address, size] pairs.  The new symbol order is implicit
-  /// in the order of the vector.
+  /// in the order of the vector.  If \p ClusterStarts is given, the symbols
+  /// in it start at a cache line boundary and symbols that fit into a cache
+  /// line are not split across two lines.
   void setSectionOrder(BinaryContext &BC,
                        BinarySection &OutputSection,
                        DataOrder::iterator Begin,
-                       DataOrder::iterator End);
+                       DataOrder::iterator End,
+                       const std::unordered_set<const BinaryData *>
+                         *ClusterStarts = nullptr);
 
   bool markUnmoveableSymbols(BinaryContext &BC,
                              BinarySection &Section) const;
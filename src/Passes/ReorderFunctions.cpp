@@ -10,9 +10,15 @@
 //===----------------------------------------------------------------------===//
 
 #include "ReorderFunctions.h"
+#include "CacheMetrics.h"
 #include "HFSort.h"
+#include "IndirectTargetLayout.h"
+#include "PhaseStats.h"
+#include "ProfileVariants.h"
 #include "llvm/Support/Options.h"
+#include <cmath>
 #include <fstream>
+#include <unordered_map>
 
 #define DEBUG_TYPE "hfsort"
 
@@ -23,6 +29,7 @@ namespace opts {
 extern cl::OptionCategory BoltOptCategory;
 extern cl::opt<unsigned> Verbosity;
 extern cl::opt<uint32_t> RandomSeed;
+extern cl::opt<bool> CycleWeightedLayout;
 
 extern bool shouldProcess(const bolt::BinaryFunction &Function);
 extern size_t padFunction(const bolt::BinaryFunction &Function);
@@ -46,12 +53,28 @@ ReorderFunctions("reorder-functions",
     clEnumValN(bolt::ReorderFunctions::RT_PETTIS_HANSEN,
       "pettis-hansen",
       "use Pettis-Hansen algorithm"),
+    clEnumValN(bolt::ReorderFunctions::RT_EXT_TSP,
+      "ext-tsp",
+      "order functions by ExtTSP score of calls and returns"),
     clEnumValN(bolt::ReorderFunctions::RT_RANDOM,
       "random",
       "reorder functions randomly"),
     clEnumValN(bolt::ReorderFunctions::RT_USER,
       "user",
-      "use function order specified by -function-order")),
+      "use function order specified by -function-order"),
+    clEnumValN(bolt::ReorderFunctions::RT_STARTUP,
+      "startup",
+      "place functions in the order of their first execution in the "
+      "profile (requires sample times), then the rest with hfsort+")),
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+StartupDuration("startup-duration",
+  cl::desc("with -reorder-functions=startup, only functions first executed "
+           "within the given number of milliseconds from the start of the "
+           "profile are ordered by first execution (0 - all of them)"),
+  cl::init(0),
+  cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
 static cl::opt<bool>
@@ -109,14 +132,6 @@ CgUseSplitHotSize("cg-use-split-hot-size",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
-static llvm::cl::opt<bool>
-UseGainCache("hfsort+-use-cache",
-  llvm::cl::desc("Use a cache for mergeGain results when computing hfsort+."),
-  llvm::cl::ZeroOrMore,
-  llvm::cl::init(true),
-  llvm::cl::Hidden,
-  llvm::cl::cat(BoltOptCategory));
-
 } // namespace opts
 
 namespace llvm {
@@ -257,6 +272,67 @@ void ReorderFunctions::reorder(std::vector<Cluster> &&Clusters,
   }
 }
 
+std::vector<Cluster> ReorderFunctions::startupClusters() {
+  const uint64_t NoTime = -1ULL;
+  uint64_t StartTime = NoTime;
+  for (NodeId Id = 0; Id < Cg.numNodes(); ++Id) {
+    StartTime =
+      std::min(StartTime, Cg.nodeIdToFunc(Id)->getFirstExecutionTime());
+  }
+  if (StartTime == NoTime) {
+    errs() << "BOLT-WARNING: the profile has no sample times, functions "
+              "executed during startup cannot be told apart\n";
+  }
+
+  // Functions first executed after the startup are laid out for the steady
+  // state in a separate region.
+  std::vector<NodeId> StartupFuncs;
+  std::vector<bool> IsStartup(Cg.numNodes(), false);
+  for (NodeId Id = 0; Id < Cg.numNodes(); ++Id) {
+    const auto Time = Cg.nodeIdToFunc(Id)->getFirstExecutionTime();
+    if (Time == NoTime)
+      continue;
+    if (opts::StartupDuration &&
+        Time - StartTime > opts::StartupDuration * 1000000ULL)
+      continue;
+    StartupFuncs.push_back(Id);
+    IsStartup[Id] = true;
+  }
+  std::stable_sort(StartupFuncs.begin(), StartupFuncs.end(),
+                   [&](const NodeId A, const NodeId B) {
+                     return Cg.nodeIdToFunc(A)->getFirstExecutionTime() <
+                            Cg.nodeIdToFunc(B)->getFirstExecutionTime();
+                   });
+
+  std::vector<Cluster> Clusters;
+  uint64_t StartupSize = 0;
+  for (const auto Id : StartupFuncs) {
+    Clusters.emplace_back(Id, Cg.getNode(Id));
+    StartupSize += Cg.size(Id);
+  }
+
+  const auto NumStartupClusters = Clusters.size();
+  for (const auto &HotCluster : hfsortPlus(Cg)) {
+    std::vector<NodeId> Targets;
+    for (const auto Id : HotCluster.targets()) {
+      if (!IsStartup[Id])
+        Targets.push_back(Id);
+    }
+    if (Targets.empty())
+      continue;
+    Clusters.emplace_back(Targets.front(), Cg.getNode(Targets.front()));
+    for (auto I = std::next(Targets.begin()); I != Targets.end(); ++I)
+      Clusters.back().merge(Cluster(*I, Cg.getNode(*I)));
+  }
+
+  outs() << "BOLT-INFO: placing " << StartupFuncs.size() << " functions ("
+         << StartupSize << " bytes) in the order of their first execution, "
+         << "followed by " << Clusters.size() - NumStartupClusters
+         << " clusters of the rest\n";
+
+  return Clusters;
+}
+
 namespace {
 
 std::vector<std::string> readFunctionOrderFile() {
@@ -276,6 +352,114 @@ std::vector<std::string> readFunctionOrderFile() {
 
 }
 
+BinaryFunctionCallGraph
+ReorderFunctions::buildGraph(BinaryContext &BC,
+                             std::map<uint64_t, BinaryFunction> &BFs,
+                             bool UseEdgeCounts) {
+  auto Graph = buildCallGraph(BC,
+                              BFs,
+                              [](const BinaryFunction &BF) {
+                                if (!BF.hasProfile())
+                                  return true;
+                                if (BF.getState() !=
+                                    BinaryFunction::State::CFG)
+                                  return true;
+                                return false;
+                              },
+                              opts::CgFromPerfData,
+                              false, // IncludeColdCalls
+                              opts::ReorderFunctionsUseHotSize,
+                              opts::CgUseSplitHotSize,
+                              UseEdgeCounts,
+                              opts::CgIgnoreRecursiveCalls,
+                              opts::CycleWeightedLayout);
+  Graph.normalizeArcWeights();
+  return Graph;
+}
+
+void ReorderFunctions::chooseVariantClusters(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::vector<Cluster> &Clusters) {
+  const auto NumCandidates = ProfileVariants::getNumCandidates(BC);
+  const auto NumVariants = BC.ProfileVariants.size();
+
+  // Candidate 0 uses the call graph of the profile. The others are built
+  // from the block counts, since the counts of calls recorded in the
+  // instructions come from the profile.
+  std::vector<BinaryFunctionCallGraph> Graphs(NumCandidates);
+  std::vector<std::vector<Cluster>> Candidates(NumCandidates);
+  Graphs[0] = std::move(Cg);
+  Candidates[0] = std::move(Clusters);
+  for (unsigned C = 1; C < NumCandidates; ++C) {
+    {
+      std::vector<std::unique_ptr<VariantCounts>> Counts;
+      for (auto &BFI : BFs) {
+        if (BFI.second.hasProfile())
+          Counts.emplace_back(
+              ProfileVariants::installCandidateCounts(BFI.second, C));
+      }
+      Graphs[C] = buildGraph(BC, BFs, /*UseEdgeCounts=*/true);
+    }
+
+    switch (opts::ReorderFunctions) {
+    case RT_HFSORT:
+      Candidates[C] = clusterize(Graphs[C]);
+      break;
+    case RT_HFSORT_PLUS:
+      Candidates[C] = hfsortPlus(Graphs[C]);
+      break;
+    case RT_PETTIS_HANSEN:
+      Candidates[C] = pettisAndHansen(Graphs[C]);
+      break;
+    case RT_EXT_TSP:
+      Candidates[C] = extTSPFunctions(Graphs[C]);
+      break;
+    default:
+      llvm_unreachable("unexpected function reordering type");
+    }
+  }
+
+  // Score the calls of each variant with the function addresses of each
+  // candidate order, the graph of variant V being the one of candidate
+  // V + 2.
+  std::vector<std::vector<double>> Scores(NumCandidates,
+                                          std::vector<double>(NumVariants));
+  for (unsigned C = 0; C < NumCandidates; ++C) {
+    std::unordered_map<const BinaryFunction *, uint64_t> FuncAddr;
+    uint64_t TotalSize = 0;
+    for (const auto &Cluster : Candidates[C]) {
+      for (const auto FuncId : Cluster.targets()) {
+        FuncAddr[Graphs[C].nodeIdToFunc(FuncId)] = TotalSize;
+        TotalSize += Graphs[C].size(FuncId);
+      }
+    }
+
+    for (unsigned V = 0; V < NumVariants; ++V) {
+      const auto &Graph = Graphs[V + 2];
+      for (const auto &Arc : Graph.arcs()) {
+        if (Arc.src() == Arc.dst())
+          continue;
+        auto SrcI = FuncAddr.find(Graph.nodeIdToFunc(Arc.src()));
+        auto DstI = FuncAddr.find(Graph.nodeIdToFunc(Arc.dst()));
+        if (SrcI == FuncAddr.end() || DstI == FuncAddr.end())
+          continue;
+        Scores[C][V] += CacheMetrics::extTSPScore(
+            SrcI->second + std::llround(Arc.avgCallOffset()), 0,
+            DstI->second, std::llround(Arc.weight()));
+      }
+    }
+  }
+
+  const auto Chosen = ProfileVariants::chooseCandidate(BC, Scores);
+  std::vector<uint64_t> NumChosen(NumCandidates);
+  ++NumChosen[Chosen];
+  ProfileVariants::printCandidates(BC, "function orders", Scores, NumChosen);
+
+  Cg = std::move(Graphs[Chosen]);
+  Clusters = std::move(Candidates[Chosen]);
+}
+
 void ReorderFunctions::runOnFunctions(BinaryContext &BC,
                                       std::map<uint64_t, BinaryFunction> &BFs,
                                       std::set<uint64_t> &LargeFunctions) {
@@ -288,22 +472,7 @@ void ReorderFunctions::runOnFunctions(BinaryContext &BC,
   if (opts::ReorderFunctions != RT_NONE &&
       opts::ReorderFunctions != RT_EXEC_COUNT &&
       opts::ReorderFunctions != RT_USER) {
-    Cg = buildCallGraph(BC,
-                        BFs,
-                        [this](const BinaryFunction &BF) {
-                          if (!BF.hasProfile())
-                            return true;
-                          if (BF.getState() != BinaryFunction::State::CFG)
-                            return true;
-                          return false;
-                        },
-                        opts::CgFromPerfData,
-                        false, // IncludeColdCalls
-                        opts::ReorderFunctionsUseHotSize,
-                        opts::CgUseSplitHotSize,
-                        opts::UseEdgeCounts,
-                        opts::CgIgnoreRecursiveCalls);
-    Cg.normalizeArcWeights();
+    Cg = buildGraph(BC, BFs, opts::UseEdgeCounts);
   }
 
   std::vector<Cluster> Clusters;
@@ -344,13 +513,34 @@ void ReorderFunctions::runOnFunctions(BinaryContext &BC,
     }
     break;
   case RT_HFSORT:
-    Clusters = clusterize(Cg);
+    {
+      PhaseStats::Scope Stats("hfsort");
+      Clusters = clusterize(Cg);
+    }
     break;
   case RT_HFSORT_PLUS:
-    Clusters = hfsortPlus(Cg, opts::UseGainCache);
+    {
+      PhaseStats::Scope Stats("hfsort+");
+      Clusters = hfsortPlus(Cg);
+    }
     break;
   case RT_PETTIS_HANSEN:
-    Clusters = pettisAndHansen(Cg);
+    {
+      PhaseStats::Scope Stats("pettis-hansen");
+      Clusters = pettisAndHansen(Cg);
+    }
+    break;
+  case RT_EXT_TSP:
+    {
+      PhaseStats::Scope Stats("ext-tsp-functions");
+      Clusters = extTSPFunctions(Cg);
+    }
+    break;
+  case RT_STARTUP:
+    {
+      PhaseStats::Scope Stats("startup");
+      Clusters = startupClusters();
+    }
     break;
   case RT_RANDOM:
     std::srand(opts::RandomSeed);
@@ -407,6 +597,25 @@ void ReorderFunctions::runOnFunctions(BinaryContext &BC,
     break;
   }
 
+  if (!BC.ProfileVariants.empty() &&
+      (opts::ReorderFunctions == RT_HFSORT ||
+       opts::ReorderFunctions == RT_HFSORT_PLUS ||
+       opts::ReorderFunctions == RT_PETTIS_HANSEN ||
+       opts::ReorderFunctions == RT_EXT_TSP))
+    chooseVariantClusters(BC, BFs, Clusters);
+
+  if (IndirectTargetLayout::isEnabled() && !Clusters.empty()) {
+    const auto ScoreBefore =
+      IndirectTargetLayout::getFunctionOrderScore(Cg, Clusters);
+    const auto NumMoved =
+      IndirectTargetLayout::placeIndirectCallTargets(BC, Cg, Clusters);
+    const auto ScoreAfter =
+      IndirectTargetLayout::getFunctionOrderScore(Cg, Clusters);
+    outs() << "BOLT-INFO: indirect target layout moved " << NumMoved
+           << " indirect call targets, changing the ExtTSP score of the calls "
+           << format("from %.0lf to %.0lf\n", ScoreBefore, ScoreAfter);
+  }
+
   reorder(std::move(Clusters), BFs);
 
   std::unique_ptr<std::ofstream> FuncsFile;
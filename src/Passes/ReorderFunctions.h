@@ -24,6 +24,23 @@ class ReorderFunctions : public BinaryFunctionPass {
 
   void reorder(std::vector<Cluster> &&Clusters,
                std::map<uint64_t, BinaryFunction> &BFs);
+
+  /// Return clusters of the functions executed during startup, in the order
+  /// of their first execution, followed by the hfsort+ clusters of the rest.
+  std::vector<Cluster> startupClusters();
+
+  /// Build the call graph of the functions with profile from the current
+  /// counts of their CFGs.
+  static BinaryFunctionCallGraph
+  buildGraph(BinaryContext &BC, std::map<uint64_t, BinaryFunction> &BFs,
+             bool UseEdgeCounts);
+
+  /// Compute clusters with the algorithm given with -reorder-functions and
+  /// the call graph of each candidate of -profile-variants. Keep the best
+  /// clusters in \p Clusters and their call graph in Cg.
+  void chooseVariantClusters(BinaryContext &BC,
+                             std::map<uint64_t, BinaryFunction> &BFs,
+                             std::vector<Cluster> &Clusters);
 public:
   enum ReorderType : char {
     RT_NONE = 0,
@@ -31,8 +48,10 @@ public:
     RT_HFSORT,
     RT_HFSORT_PLUS,
     RT_PETTIS_HANSEN,
+    RT_EXT_TSP,
     RT_RANDOM,
-    RT_USER
+    RT_USER,
+    RT_STARTUP
   };
 
   explicit ReorderFunctions(const cl::opt<bool> &PrintPass)
@@ -11,6 +11,7 @@
 
 #include "MCPlus.h"
 #include "ShrinkWrapping.h"
+#include <chrono>
 #include <numeric>
 
 #define DEBUG_TYPE "shrinkwrapping"
@@ -28,6 +29,19 @@ static cl::opt<unsigned> ShrinkWrappingThreshold(
              " evaluating whether a block is cold enough to be profitable to"
              " move eligible spills there"),
     cl::init(30), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned> ShrinkWrappingMaxSize(
+    "shrink-wrapping-max-size",
+    cl::desc("skip shrink wrapping for functions with more than this many"
+             " instructions (0 = no limit)"),
+    cl::init(20000), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned> ShrinkWrappingTimeLimit(
+    "shrink-wrapping-time-limit",
+    cl::desc("give up shrink wrapping a function if analyzing it takes more"
+             " than this many milliseconds (0 = no limit). The output then"
+             " depends on the speed of the host"),
+    cl::init(0), cl::ZeroOrMore, cl::cat(BoltOptCategory));
 }
 
 namespace llvm {
@@ -708,8 +722,10 @@ void StackLayoutModifier::initialize() {
   IsInitialized = true;
 }
 
-uint64_t ShrinkWrapping::SpillsMovedRegularMode = 0;
-uint64_t ShrinkWrapping::SpillsMovedPushPopMode = 0;
+std::atomic<uint64_t> ShrinkWrapping::SpillsMovedRegularMode{0};
+std::atomic<uint64_t> ShrinkWrapping::SpillsMovedPushPopMode{0};
+std::atomic<uint64_t> ShrinkWrapping::FunctionsOverSizeBudget{0};
+std::atomic<uint64_t> ShrinkWrapping::FunctionsOverTimeBudget{0};
 
 using BBIterTy = BinaryBasicBlock::iterator;
 
@@ -1890,6 +1906,26 @@ void ShrinkWrapping::rebuildCFI() {
 }
 
 bool ShrinkWrapping::perform() {
+  if (opts::ShrinkWrappingMaxSize &&
+      BF.getNumNonPseudos() > opts::ShrinkWrappingMaxSize) {
+    ++FunctionsOverSizeBudget;
+    return false;
+  }
+
+  // The function is only modified starting with moveSaveRestores(), so it is
+  // safe to give up anywhere before that.
+  using Clock = std::chrono::steady_clock;
+  const auto Deadline =
+      Clock::now() + std::chrono::milliseconds(opts::ShrinkWrappingTimeLimit);
+  auto isOverTimeBudget = [&]() {
+    if (!opts::ShrinkWrappingTimeLimit || Clock::now() < Deadline)
+      return false;
+    DEBUG(dbgs() << "BOLT-DEBUG: shrink wrapping of " << BF.getPrintName()
+                 << " ran out of time\n");
+    ++FunctionsOverTimeBudget;
+    return true;
+  };
+
   HasDeletedOffsetCFIs = std::vector<bool>(BC.MRI->getNumRegs(), false);
   PushOffsetByReg = std::vector<int64_t>(BC.MRI->getNumRegs(), 0LL);
   PopOffsetByReg = std::vector<int64_t>(BC.MRI->getNumRegs(), 0LL);
@@ -1897,9 +1933,13 @@ bool ShrinkWrapping::perform() {
 
   SLM.initialize();
   CSA.compute();
+  if (isOverTimeBudget())
+    return false;
   classifyCSRUses();
   pruneUnwantedCSRs();
   computeSaveLocations();
+  if (isOverTimeBudget())
+    return false;
   computeDomOrder();
   moveSaveRestores();
   DEBUG({
@@ -1931,6 +1971,11 @@ void ShrinkWrapping::printStats() {
   outs() << "BOLT-INFO: Shrink wrapping moved " << SpillsMovedRegularMode
          << " spills inserting load/stores and " << SpillsMovedPushPopMode
          << " spills inserting push/pops\n";
+  if (FunctionsOverSizeBudget || FunctionsOverTimeBudget)
+    outs() << "BOLT-INFO: Shrink wrapping skipped " << FunctionsOverSizeBudget
+           << " function(s) over the size budget and "
+           << FunctionsOverTimeBudget
+           << " function(s) over the time budget\n";
 }
 
 // Operators necessary as a result of using MCAnnotation
@@ -15,6 +15,7 @@
 #include "BinaryPasses.h"
 #include "FrameAnalysis.h"
 #include "DataflowInfoManager.h"
+#include <atomic>
 
 namespace llvm {
 namespace bolt {
@@ -310,9 +311,11 @@ class ShrinkWrapping {
   std::vector<uint64_t> BestSaveCount;
   std::vector<MCInst *> BestSavePos;
 
-  /// Pass stats
-  static uint64_t SpillsMovedRegularMode;
-  static uint64_t SpillsMovedPushPopMode;
+  /// Pass stats. Functions are processed concurrently.
+  static std::atomic<uint64_t> SpillsMovedRegularMode;
+  static std::atomic<uint64_t> SpillsMovedPushPopMode;
+  static std::atomic<uint64_t> FunctionsOverSizeBudget;
+  static std::atomic<uint64_t> FunctionsOverTimeBudget;
 
   Optional<unsigned> AnnotationIndex;
 
@@ -529,6 +532,10 @@ public:
     }
   }
 
+  /// Move spills of callee-saved registers to colder blocks. Give up, and
+  /// leave the function untouched, if the function is larger than
+  /// -shrink-wrapping-max-size or if analyzing it takes longer than
+  /// -shrink-wrapping-time-limit. Return true if the function was modified.
   bool perform();
 
   static void printStats();
@@ -1,4 +1,6 @@
 #include "StokeInfo.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Options.h"
 
 #undef DEBUG_TYPE
@@ -15,6 +17,13 @@ StokeOutputDataFilename("stoke-out",
   cl::desc("output data (.csv) for Stoke's use"),
   cl::Optional,
   cl::cat(StokeOptCategory));
+
+static cl::opt<std::string>
+StokeInputFilename("stoke-in",
+  cl::desc("replacement code for functions, one per line as the function "
+           "hash from -stoke-out followed by the encoded instructions in hex"),
+  cl::Optional,
+  cl::cat(StokeOptCategory));
 }
 
 namespace llvm {
@@ -92,6 +101,7 @@ bool StokeInfo::checkFunction(const BinaryContext &BC, BinaryFunction &BF,
   outs() << " STOKE-INFO: analyzing function " << Name << "\n";
 
   FuncInfo.FuncName = Name;
+  FuncInfo.Hash = BF.hash(/*Recompute=*/true, /*UseDFS=*/true);
   FuncInfo.Offset = BF.getFileOffset();
   FuncInfo.Size = BF.getMaxSize();
   FuncInfo.NumInstrs = BF.getNumNonPseudos();
@@ -137,6 +147,131 @@ bool StokeInfo::checkFunction(const BinaryContext &BC, BinaryFunction &BF,
   return true;
 }
 
+bool StokeInfo::readReplacements() {
+  auto MB = MemoryBuffer::getFileOrSTDIN(opts::StokeInputFilename);
+  if (auto EC = MB.getError()) {
+    errs() << "STOKE-INFO: cannot read " << opts::StokeInputFilename << ": "
+           << EC.message() << "\n";
+    return false;
+  }
+
+  SmallVector<StringRef, 16> Lines;
+  (*MB)->getBuffer().split(Lines, '\n', -1, false);
+  for (auto Line : Lines) {
+    Line = Line.trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+
+    StringRef HashStr, Code;
+    std::tie(HashStr, Code) = Line.split(' ');
+    std::string Hex;
+    for (auto C : Code) {
+      if (!isspace(C))
+        Hex.push_back(C);
+    }
+    uint64_t Hash;
+    if (HashStr.getAsInteger(16, Hash) || Hex.empty() || Hex.size() % 2 ||
+        !std::all_of(Hex.begin(), Hex.end(), isHexDigit)) {
+      errs() << "STOKE-INFO: malformed line in " << opts::StokeInputFilename
+             << ": " << Line << "\n";
+      return false;
+    }
+    Replacements[Hash] = fromHex(Hex);
+  }
+  return true;
+}
+
+bool StokeInfo::applyReplacement(const BinaryContext &BC, BinaryFunction &BF,
+    DataflowInfoManager &DInfo, RegAnalysis &RA,
+    const StokeFuncInfo &FuncInfo, StringRef Code) {
+  auto reject = [&](const Twine &Reason) {
+    errs() << "STOKE-INFO: rejected replacement for " << FuncInfo.FuncName
+           << ": " << Reason << "\n";
+    ++NumRejected;
+    return false;
+  };
+
+  // The replacement is a single block, so there is nothing to attach the
+  // tables, data and CFI of the original code to.
+  if (FuncInfo.Omitted)
+    return reject("function has exception handling");
+  if (BF.hasJumpTables() || BF.hasConstantIsland())
+    return reject("function has jump tables or data in code");
+  for (auto &BB : BF) {
+    for (auto &Inst : BB) {
+      if (BC.MIB->isCFI(Inst))
+        return reject("function has frame information");
+    }
+  }
+
+  std::vector<MCInst> Instructions;
+  ArrayRef<uint8_t> Bytes(reinterpret_cast<const uint8_t *>(Code.data()),
+                          Code.size());
+  uint64_t Size = 0;
+  for (uint64_t Offset = 0; Offset < Bytes.size(); Offset += Size) {
+    MCInst Inst;
+    if (!BC.DisAsm->getInstruction(Inst, Size, Bytes.slice(Offset),
+                                   BF.getAddress() + Offset, nulls(),
+                                   nulls()))
+      return reject("cannot disassemble instruction at offset " +
+                    Twine(Offset));
+    Instructions.emplace_back(Inst);
+  }
+  if (!BC.MIB->isReturn(Instructions.back()))
+    return reject("code does not end with a return");
+
+  // Registers read before being written have to be live at the entry of the
+  // function, and registers written have to be clobbered by it already.
+  BitVector Defined(NumRegs, false);
+  BitVector ReadIn(NumRegs, false);
+  BitVector Clobbered(NumRegs, false);
+  for (auto &Inst : Instructions) {
+    if (&Inst != &Instructions.back() &&
+        (BC.MIB->isBranch(Inst) || BC.MIB->isReturn(Inst)))
+      return reject("code is not straight-line");
+    if (BC.MIB->isCall(Inst))
+      return reject("code has calls");
+    if (BC.MIB->hasPCRelOperand(Inst))
+      return reject("code has PC-relative operands");
+
+    const auto IsPush = BC.MIB->isPush(Inst);
+    if (IsPush && !FuncInfo.StackOut)
+      return reject("code writes to the stack");
+    if (BC.MIB->isStore(Inst) && !IsPush && !FuncInfo.HeapOut)
+      return reject("code writes to memory");
+
+    BitVector Used(NumRegs, false);
+    BC.MIB->getUsedRegs(Inst, Used);
+    Used.reset(Defined);
+    ReadIn |= Used;
+    BC.MIB->getWrittenRegs(Inst, Defined);
+    BC.MIB->getClobberedRegs(Inst, Clobbered);
+  }
+
+  auto *FirstNonPseudo = BF.front().getFirstNonPseudoInstr();
+  ReadIn.reset(*DInfo.getLivenessAnalysis().getStateAt(FirstNonPseudo));
+  if (ReadIn.any())
+    return reject("code reads registers that are not live-in");
+  Clobbered.reset(RA.getFunctionClobberList(&BF));
+  if (Clobbered.any())
+    return reject("code writes registers the function preserves");
+
+  auto &Entry = BF.front();
+  Entry.clear();
+  Entry.addInstructions(Instructions.begin(), Instructions.end());
+  Entry.removeAllSuccessors();
+  for (auto &BB : BF) {
+    if (&BB != &Entry)
+      BB.markValid(false);
+  }
+  BF.eraseInvalidBBs();
+  DataflowInfoCache::invalidate(BF);
+
+  outs() << " STOKE-INFO: replaced body of " << FuncInfo.FuncName << "\n";
+  ++NumReplaced;
+  return true;
+}
+
 void StokeInfo::runOnFunctions(
     BinaryContext &BC,
     std::map<uint64_t, BinaryFunction> &BFs,
@@ -146,11 +281,14 @@ void StokeInfo::runOnFunctions(
   std::ofstream Outfile;
   if (!opts::StokeOutputDataFilename.empty()) {
     Outfile.open(opts::StokeOutputDataFilename);
-  } else {
+  } else if (opts::StokeInputFilename.empty()) {
     errs() << "STOKE-INFO: output file is required\n";
     return;
   }
 
+  if (!opts::StokeInputFilename.empty() && !readReplacements())
+    return;
+
   // check some context meta data
   DEBUG(dbgs() << "\tTarget: " << BC.TheTarget->getName() << "\n");
   DEBUG(dbgs() << "\tTripleName " << BC.TripleName << "\n");
@@ -175,13 +313,22 @@ void StokeInfo::runOnFunctions(
   // analyze all functions
   FuncInfo.printCsvHeader(Outfile);
   for (auto &BF : BFs) {
-    DataflowInfoManager DInfo(BC, BF.second, &RA/*RA.get()*/, nullptr);
+    auto &DInfo = DataflowInfoCache::get(BC, BF.second, &RA, nullptr);
     FuncInfo.reset();
     if (checkFunction(BC, BF.second, DInfo, RA, FuncInfo)) {
       FuncInfo.printData(Outfile);
+      auto Iter = Replacements.find(FuncInfo.Hash);
+      if (Iter != Replacements.end()) {
+        applyReplacement(BC, BF.second, DInfo, RA, FuncInfo, Iter->second);
+      }
     }
   }
 
+  if (!Replacements.empty()) {
+    outs() << "STOKE-INFO: replaced " << NumReplaced << " functions, "
+           << NumRejected << " replacements rejected\n";
+  }
+
   outs() << "STOKE-INFO: end of stoke pass\n";
 }
 
@@ -21,12 +21,18 @@
 //  .csv file. Next, we use python scripts to process the file, filter
 //  out functions for optimization and automatically generate configure files.
 //  Finally, these configure files are feed to the Stoke to do the job.
+//
+//  The optimized code is fed back with -stoke-in. Each replacement is keyed
+//  by the function hash from the .csv file, and is checked against the
+//  register and memory information of the function it replaces before the
+//  body of the function is swapped for it.
 //===----------------------------------------------------------------------===//
 
 #ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_STOKEINFO_H
 #define LLVM_TOOLS_LLVM_BOLT_PASSES_STOKEINFO_H
 
 #include <fstream>
+#include <unordered_map>
 #include "BinaryPasses.h"
 #include "DataflowInfoManager.h"
 
@@ -36,6 +42,7 @@ namespace bolt {
 /// Structure to hold information needed by Stoke for a function
 struct StokeFuncInfo {
   std::string FuncName;
+  uint64_t Hash;
   uint64_t Offset;
   uint64_t Size;
   uint64_t NumInstrs;
@@ -60,7 +67,7 @@ struct StokeFuncInfo {
 
   void reset() {
     FuncName = "";
-    Offset = Size = NumInstrs = NumBlocks = 0;
+    Hash = Offset = Size = NumInstrs = NumBlocks = 0;
     NumLoops = MaxLoopDepth = 0;
     HotSize = TotalSize = 0;
     Score = 0;
@@ -78,7 +85,7 @@ struct StokeFuncInfo {
   void printCsvHeader(std::ofstream &Outfile) {
     if (Outfile.is_open()) {
       Outfile
-        << "FuncName,Offset,Size,NumInstrs,NumBlocks,"
+        << "FuncName,Hash,Offset,Size,NumInstrs,NumBlocks,"
         << "IsLoopFree,NumLoops,MaxLoopDepth,"
         << "HotSize,TotalSize,"
         << "Score,"
@@ -93,6 +100,7 @@ struct StokeFuncInfo {
     if (Outfile.is_open()) {
       Outfile
         << FuncName << ","
+        << Twine::utohexstr(Hash).str() << ","
         << Offset << "," << Size << "," << NumInstrs << "," << NumBlocks << ","
         << IsLoopFree << "," << NumLoops << "," << MaxLoopDepth << ","
         << HotSize << "," << TotalSize << ","
@@ -123,6 +131,23 @@ private:
 
   uint16_t NumRegs;
 
+  /// Replacement code read from -stoke-in, indexed by function hash.
+  std::unordered_map<uint64_t, std::string> Replacements;
+
+  /// Statistics.
+  uint64_t NumReplaced{0};
+  uint64_t NumRejected{0};
+
+  /// Read the replacements from the -stoke-in file. Return false on error.
+  bool readReplacements();
+
+  /// Replace the body of \p BF with the instructions encoded in \p Code if
+  /// they do not read registers the function does not get, write registers
+  /// it does not write, or write memory it does not write.
+  bool applyReplacement(const BinaryContext &BC, BinaryFunction &BF,
+    DataflowInfoManager &DInfo, RegAnalysis &RA,
+    const StokeFuncInfo &FuncInfo, StringRef Code);
+
 public:
   StokeInfo(const cl::opt<bool> &PrintPass) : BinaryFunctionPass(PrintPass) {}
 
@@ -130,6 +155,8 @@ public:
     return "stoke-get-stat";
   }
 
+  bool preservesDataflowInfo() const override { return true; }
+
   void checkInstr(const BinaryContext &BC, const BinaryFunction &BF,
     StokeFuncInfo &FuncInfo);
 
@@ -0,0 +1,593 @@
+//===--- Passes/StructFieldHotness.cpp - Report hot fields of structs -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "StructFieldHotness.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/DebugInfo/DWARF/DWARFUnit.h"
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/Options.h"
+
+#define DEBUG_TYPE "bolt-struct-fields"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<std::string>
+StructFieldReport("struct-field-report",
+  cl::desc("write how often the fields of structures are accessed according "
+           "to the profile and the debug info, and which fields are accessed "
+           "together, to a YAML file"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+StructFieldMaxCoAccess("struct-field-max-co-access",
+  cl::desc("maximum number of fields of a structure accessed in a basic block "
+           "for which the pairs accessed together are counted"),
+  cl::init(16),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+/// Return the type of the entity described by \p Die, following the
+/// declaration it completes or the abstract entity it is an instance of.
+DWARFDie getType(DWARFDie Die) {
+  while (Die) {
+    if (auto Type = Die.getAttributeValueAsReferencedDie(dwarf::DW_AT_type))
+      return Type;
+    auto Origin =
+      Die.getAttributeValueAsReferencedDie(dwarf::DW_AT_abstract_origin);
+    if (!Origin)
+      Origin = Die.getAttributeValueAsReferencedDie(dwarf::DW_AT_specification);
+    Die = Origin;
+  }
+  return DWARFDie();
+}
+
+/// Strip typedefs and qualifiers from \p Type.
+DWARFDie stripQualifiers(DWARFDie Type) {
+  while (Type) {
+    switch (Type.getTag()) {
+    case dwarf::DW_TAG_typedef:
+    case dwarf::DW_TAG_const_type:
+    case dwarf::DW_TAG_volatile_type:
+    case dwarf::DW_TAG_restrict_type:
+    case dwarf::DW_TAG_atomic_type:
+      Type = Type.getAttributeValueAsReferencedDie(dwarf::DW_AT_type);
+      continue;
+    default:
+      return Type;
+    }
+  }
+  return Type;
+}
+
+bool isStructure(const DWARFDie &Type) {
+  return Type && (Type.getTag() == dwarf::DW_TAG_structure_type ||
+                  Type.getTag() == dwarf::DW_TAG_class_type ||
+                  Type.getTag() == dwarf::DW_TAG_union_type);
+}
+
+/// Return the name of \p Type with the names of the enclosing namespaces and
+/// types, or an empty string for anonymous types.
+std::string getQualifiedName(const DWARFDie &Type) {
+  const char *Name = Type.getName(DINameKind::ShortName);
+  if (!Name)
+    return std::string();
+
+  std::string QualifiedName = Name;
+  for (auto Parent = Type.getParent(); Parent; Parent = Parent.getParent()) {
+    if (Parent.getTag() != dwarf::DW_TAG_namespace && !isStructure(Parent))
+      break;
+    const char *ParentName = Parent.getName(DINameKind::ShortName);
+    QualifiedName.insert(0, "::");
+    QualifiedName.insert(0, ParentName ? ParentName : "(anonymous namespace)");
+  }
+  return QualifiedName;
+}
+
+/// Return the DWARF register of a location expression \p Expr made of a
+/// single register operation.
+Optional<uint64_t> getRegister(ArrayRef<uint8_t> Expr) {
+  if (Expr.size() == 1 && Expr[0] >= dwarf::DW_OP_reg0 &&
+      Expr[0] <= dwarf::DW_OP_reg31)
+    return Expr[0] - dwarf::DW_OP_reg0;
+
+  if (Expr.size() > 1 && Expr[0] == dwarf::DW_OP_regx) {
+    unsigned Size;
+    const auto Reg = decodeULEB128(Expr.data() + 1, &Size);
+    if (Size + 1 == Expr.size())
+      return Reg;
+  }
+  return NoneType();
+}
+
+/// Return the offset of a data member from the start of its structure.
+Optional<uint64_t> getMemberOffset(const DWARFDie &Member) {
+  auto Value = Member.find(dwarf::DW_AT_data_member_location);
+  if (!Value)
+    return Member.getParent().getTag() == dwarf::DW_TAG_union_type
+      ? Optional<uint64_t>(0)
+      : NoneType();
+
+  if (auto Offset = Value->getAsUnsignedConstant())
+    return Offset;
+
+  // DWARF 2 producers describe the offset with an expression.
+  if (auto Expr = Value->getAsBlock()) {
+    if (Expr->size() > 1 && (*Expr)[0] == dwarf::DW_OP_plus_uconst) {
+      unsigned Size;
+      const auto Offset = decodeULEB128(Expr->data() + 1, &Size);
+      if (Size + 1 == Expr->size())
+        return Offset;
+    }
+  }
+  return NoneType();
+}
+
+/// Return the number of elements of the array \p Type.
+uint64_t getNumElements(const DWARFDie &Type) {
+  uint64_t NumElements = 1;
+  for (auto Child : Type.children()) {
+    if (Child.getTag() != dwarf::DW_TAG_subrange_type)
+      continue;
+    if (auto Count = dwarf::toUnsigned(Child.find(dwarf::DW_AT_count))) {
+      NumElements *= *Count;
+    } else if (auto UpperBound =
+                 dwarf::toUnsigned(Child.find(dwarf::DW_AT_upper_bound))) {
+      NumElements *= *UpperBound + 1;
+    } else {
+      return 0;
+    }
+  }
+  return NumElements;
+}
+
+} // anonymous namespace
+
+unsigned
+StructFieldHotness::TypeStats::getFieldIndex(uint64_t Offset) const {
+  if (Offset >= Size)
+    return -1U;
+  auto FI = std::upper_bound(Fields.begin(), Fields.end(), Offset,
+                             [](uint64_t Offset, const FieldStats &Field) {
+                               return Offset < Field.Offset;
+                             });
+  if (FI == Fields.begin())
+    return -1U;
+  return std::prev(FI) - Fields.begin();
+}
+
+StructFieldHotness::TypeStats *
+StructFieldHotness::getTypeStats(DWARFDie Type) {
+  if (!isStructure(Type))
+    return nullptr;
+
+  auto DI = DIEToType.find(Type.getOffset());
+  if (DI != DIEToType.end())
+    return DI->second;
+
+  TypeStats *Stats = nullptr;
+  const auto Name = getQualifiedName(Type);
+  if (!Name.empty()) {
+    auto TI = Types.find(Name);
+    if (TI != Types.end()) {
+      Stats = &TI->second;
+    } else {
+      auto Definition = Type;
+      if (Type.find(dwarf::DW_AT_declaration)) {
+        auto DefI = Definitions.find(Name);
+        Definition = DefI != Definitions.end() ? DefI->second : DWARFDie();
+      }
+      const auto Size =
+        Definition ? dwarf::toUnsigned(Definition.find(dwarf::DW_AT_byte_size))
+                   : NoneType();
+      if (Size && *Size) {
+        Stats = &Types[Name];
+        Stats->Name = Name;
+        Stats->Size = *Size;
+        for (auto Member : Definition.children()) {
+          if (Member.getTag() != dwarf::DW_TAG_member &&
+              Member.getTag() != dwarf::DW_TAG_inheritance)
+            continue;
+          // Static members have no offset.
+          const auto Offset = getMemberOffset(Member);
+          if (!Offset || *Offset >= *Size)
+            continue;
+          // Bit-fields sharing a storage unit are counted as one field.
+          if (!Stats->Fields.empty() && Stats->Fields.back().Offset == *Offset)
+            continue;
+
+          std::string FieldName;
+          if (Member.getTag() == dwarf::DW_TAG_inheritance) {
+            FieldName = "<base " +
+              getQualifiedName(stripQualifiers(getType(Member))) + ">";
+          } else if (const char *MemberName =
+                       Member.getName(DINameKind::ShortName)) {
+            FieldName = MemberName;
+          }
+          Stats->Fields.push_back(FieldStats{FieldName, *Offset, 0, 0, 0});
+        }
+        std::stable_sort(Stats->Fields.begin(), Stats->Fields.end(),
+                         [](const FieldStats &A, const FieldStats &B) {
+                           return A.Offset < B.Offset;
+                         });
+        for (unsigned I = 0; I < Stats->Fields.size(); ++I) {
+          const auto End = I + 1 < Stats->Fields.size()
+            ? Stats->Fields[I + 1].Offset
+            : *Size;
+          Stats->Fields[I].Size = End - Stats->Fields[I].Offset;
+        }
+      }
+    }
+  }
+
+  DIEToType[Type.getOffset()] = Stats;
+  return Stats;
+}
+
+void StructFieldHotness::collectTypesAndGlobals(const BinaryContext &BC) {
+  std::vector<std::pair<uint64_t, DWARFDie>> Variables;
+  for (auto &CU : BC.DwCtx->compile_units()) {
+    CU->getUnitDIE(/*ExtractUnitDIEOnly=*/false);
+    for (const auto &Entry : CU->dies()) {
+      DWARFDie Die(CU.get(), &Entry);
+      if (isStructure(Die)) {
+        if (Die.find(dwarf::DW_AT_declaration))
+          continue;
+        const auto Name = getQualifiedName(Die);
+        if (!Name.empty())
+          Definitions.insert(std::make_pair(Name, Die));
+        continue;
+      }
+
+      if (Die.getTag() != dwarf::DW_TAG_variable)
+        continue;
+      auto Location = Die.find(dwarf::DW_AT_location);
+      if (!Location)
+        continue;
+      auto Expr = Location->getAsBlock();
+      if (!Expr || Expr->empty() || (*Expr)[0] != dwarf::DW_OP_addr)
+        continue;
+      DataExtractor DE(StringRef(reinterpret_cast<const char *>(Expr->data()),
+                                 Expr->size()),
+                       BC.AsmInfo->isLittleEndian(),
+                       CU->getAddressByteSize());
+      uint32_t Offset = 1;
+      const auto Address = DE.getAddress(&Offset);
+      if (Offset != Expr->size())
+        continue;
+      Variables.emplace_back(Address, Die);
+    }
+  }
+
+  // Types are resolved once all definitions are known.
+  for (const auto &Variable : Variables) {
+    auto Type = stripQualifiers(getType(Variable.second));
+    uint64_t NumElements = 1;
+    if (Type && Type.getTag() == dwarf::DW_TAG_array_type) {
+      NumElements = getNumElements(Type);
+      Type = stripQualifiers(getType(Type));
+    }
+    auto *Stats = getTypeStats(Type);
+    if (!Stats || !NumElements)
+      continue;
+    Globals[Variable.first] = GlobalVariable{NumElements * Stats->Size, Stats};
+  }
+}
+
+std::vector<StructFieldHotness::RegisterVariable>
+StructFieldHotness::getRegisterVariables(const BinaryContext &BC,
+                                         const BinaryFunction &Function) {
+  std::vector<RegisterVariable> Variables;
+
+  auto addVariable = [&](const DWARFDie &Die,
+                         const DWARFAddressRangesVector &Scope) {
+    auto Type = stripQualifiers(getType(Die));
+    if (!Type || (Type.getTag() != dwarf::DW_TAG_pointer_type &&
+                  Type.getTag() != dwarf::DW_TAG_reference_type &&
+                  Type.getTag() != dwarf::DW_TAG_rvalue_reference_type))
+      return;
+    auto *Stats = getTypeStats(stripQualifiers(getType(Type)));
+    if (!Stats)
+      return;
+
+    auto Location = Die.find(dwarf::DW_AT_location);
+    if (!Location)
+      return;
+
+    auto addRange = [&](ArrayRef<uint8_t> Expr, uint64_t Begin, uint64_t End) {
+      const auto DwarfReg = getRegister(Expr);
+      if (!DwarfReg)
+        return;
+      const auto Reg = BC.MRI->getLLVMRegNum(*DwarfReg, /*isEH=*/false);
+      if (Reg < 0)
+        return;
+      Variables.push_back(RegisterVariable{static_cast<unsigned>(Reg), Begin,
+                                           End, Stats});
+    };
+
+    if (auto Expr = Location->getAsBlock()) {
+      for (const auto &Range : Scope)
+        addRange(*Expr, Range.LowPC, Range.HighPC);
+      return;
+    }
+
+    auto ListOffset = Location->isFormClass(DWARFFormValue::FC_Constant)
+      ? Location->getAsUnsignedConstant()
+      : Location->getAsSectionOffset();
+    if (!ListOffset)
+      return;
+    uint32_t Offset = *ListOffset;
+    auto List = Die.getDwarfUnit()->getContext().getOneDebugLocList(&Offset);
+    const auto BaseAddress = Die.getDwarfUnit()->getBaseAddress();
+    if (!List || !BaseAddress)
+      return;
+    for (const auto &Entry : List->Entries) {
+      addRange(ArrayRef<uint8_t>(
+                 reinterpret_cast<const uint8_t *>(Entry.Loc.data()),
+                 Entry.Loc.size()),
+               BaseAddress->Address + Entry.Begin,
+               BaseAddress->Address + Entry.End);
+    }
+  };
+
+  std::function<void(const DWARFDie &, const DWARFAddressRangesVector &)>
+  visitScope = [&](const DWARFDie &Scope,
+                   const DWARFAddressRangesVector &Ranges) {
+    for (auto Child : Scope.children()) {
+      switch (Child.getTag()) {
+      case dwarf::DW_TAG_formal_parameter:
+      case dwarf::DW_TAG_variable:
+        addVariable(Child, Ranges);
+        break;
+      case dwarf::DW_TAG_lexical_block:
+      case dwarf::DW_TAG_inlined_subroutine: {
+        auto ChildRanges = Child.getAddressRanges();
+        visitScope(Child, ChildRanges.empty() ? Ranges : ChildRanges);
+        break;
+      }
+      default:
+        break;
+      }
+    }
+  };
+
+  const DWARFAddressRangesVector FunctionRanges{
+    {Function.getAddress(), Function.getAddress() + Function.getSize()}};
+  for (const auto &Subprogram : Function.getSubprogramDIEs()) {
+    if (Subprogram.isValid() &&
+        Subprogram.getTag() == dwarf::DW_TAG_subprogram)
+      visitScope(Subprogram, FunctionRanges);
+  }
+
+  return Variables;
+}
+
+void StructFieldHotness::runOnFunction(const BinaryContext &BC,
+                                       const BinaryFunction &Function) {
+  const auto *MemData = Function.getMemData();
+  const auto Variables = getRegisterVariables(BC, Function);
+  if (Variables.empty() && (!MemData || Globals.empty()))
+    return;
+
+  for (const auto *BB : Function.layout()) {
+    const auto BBCount = BB->getKnownExecutionCount();
+
+    // Fields accessed in the block, for counting the pairs accessed together.
+    std::map<TypeStats *, std::vector<unsigned>> Accessed;
+    auto recordAccess = [&](TypeStats *Stats, unsigned FieldIndex,
+                            uint64_t Samples) {
+      auto &Field = Stats->Fields[FieldIndex];
+      Field.Samples += Samples;
+      Field.Accesses += BBCount;
+      Stats->Samples += Samples;
+      Stats->Accesses += BBCount;
+      Accessed[Stats].push_back(FieldIndex);
+    };
+
+    for (const auto &Inst : *BB) {
+      if (!BC.MIB->isLoad(Inst) && !BC.MIB->isStore(Inst))
+        continue;
+      const auto DataOffset =
+        BC.MIB->tryGetAnnotationAs<uint64_t>(Inst, "MemDataOffset");
+
+      uint64_t Samples = 0;
+      if (MemData && DataOffset) {
+        for (const auto &MI : MemData->getMemInfoRange(DataOffset.get()))
+          Samples += MI.Count;
+      }
+
+      // Accesses through a pointer to a structure.
+      unsigned BaseReg;
+      int64_t Scale;
+      unsigned IndexReg;
+      int64_t Disp;
+      unsigned SegmentReg;
+      const MCExpr *DispExpr{nullptr};
+      if (BC.isX86() && DataOffset &&
+          BC.MIB->evaluateX86MemoryOperand(Inst, &BaseReg, &Scale, &IndexReg,
+                                           &Disp, &SegmentReg, &DispExpr) &&
+          BaseReg && !IndexReg && !DispExpr && Disp >= 0) {
+        const auto Address = Function.getAddress() + DataOffset.get();
+        const auto &Aliases = BC.MIB->getAliases(BaseReg);
+        auto VI = std::find_if(Variables.begin(), Variables.end(),
+                               [&](const RegisterVariable &Variable) {
+                                 return Aliases.test(Variable.Reg) &&
+                                        Variable.Begin <= Address &&
+                                        Address < Variable.End;
+                               });
+        if (VI != Variables.end()) {
+          const auto FieldIndex = VI->Type->getFieldIndex(Disp);
+          if (FieldIndex != -1U)
+            recordAccess(VI->Type, FieldIndex, Samples);
+          continue;
+        }
+      }
+
+      // Sampled addresses in global objects.
+      if (!MemData || !DataOffset || Globals.empty())
+        continue;
+      for (const auto &MI : MemData->getMemInfoRange(DataOffset.get())) {
+        uint64_t Address = MI.Addr.Offset;
+        if (MI.Addr.IsSymbol) {
+          const auto *BD = BC.getBinaryDataByName(MI.Addr.Name);
+          if (!BD)
+            continue;
+          Address += BD->getAddress();
+        }
+        auto GI = Globals.upper_bound(Address);
+        if (GI == Globals.begin())
+          continue;
+        --GI;
+        const auto &Global = GI->second;
+        if (Address >= GI->first + Global.Size)
+          continue;
+        const auto FieldIndex =
+          Global.Type->getFieldIndex((Address - GI->first) %
+                                     Global.Type->Size);
+        if (FieldIndex != -1U)
+          recordAccess(Global.Type, FieldIndex, MI.Count);
+      }
+    }
+
+    if (!BBCount)
+      continue;
+    for (auto &TypeFields : Accessed) {
+      auto &Fields = TypeFields.second;
+      std::sort(Fields.begin(), Fields.end());
+      Fields.erase(std::unique(Fields.begin(), Fields.end()), Fields.end());
+      if (Fields.size() > opts::StructFieldMaxCoAccess)
+        continue;
+      for (unsigned I = 0; I < Fields.size(); ++I) {
+        for (unsigned J = I + 1; J < Fields.size(); ++J)
+          TypeFields.first->CoAccess[std::make_pair(Fields[I], Fields[J])] +=
+            BBCount;
+      }
+    }
+  }
+}
+
+void StructFieldHotness::writeReport(raw_ostream &OS) const {
+  auto quote = [](StringRef Str) {
+    std::string Quoted = "'";
+    for (const auto C : Str) {
+      if (C == '\'')
+        Quoted += '\'';
+      Quoted += C;
+    }
+    return Quoted + "'";
+  };
+
+  std::vector<const TypeStats *> SortedTypes;
+  for (const auto &Entry : Types) {
+    if (Entry.second.Samples || Entry.second.Accesses)
+      SortedTypes.push_back(&Entry.second);
+  }
+  std::sort(SortedTypes.begin(), SortedTypes.end(),
+            [](const TypeStats *A, const TypeStats *B) {
+              if (A->Samples != B->Samples)
+                return A->Samples > B->Samples;
+              if (A->Accesses != B->Accesses)
+                return A->Accesses > B->Accesses;
+              return A->Name < B->Name;
+            });
+
+  OS << "---\n"
+     << "types:\n";
+  for (const auto *Type : SortedTypes) {
+    OS << "  - name: " << quote(Type->Name) << '\n'
+       << "    size: " << Type->Size << '\n'
+       << "    samples: " << Type->Samples << '\n'
+       << "    accesses: " << Type->Accesses << '\n'
+       << "    fields:\n";
+    for (const auto &Field : Type->Fields) {
+      OS << "      - { offset: " << Field.Offset << ", size: " << Field.Size
+         << ", name: " << quote(Field.Name) << ", samples: " << Field.Samples
+         << ", accesses: " << Field.Accesses << " }\n";
+    }
+    if (Type->CoAccess.empty())
+      continue;
+
+    std::vector<std::pair<std::pair<unsigned, unsigned>, uint64_t>> Pairs(
+      Type->CoAccess.begin(), Type->CoAccess.end());
+    std::stable_sort(Pairs.begin(), Pairs.end(),
+                     [](const std::pair<std::pair<unsigned, unsigned>,
+                                        uint64_t> &A,
+                        const std::pair<std::pair<unsigned, unsigned>,
+                                        uint64_t> &B) {
+                       return A.second > B.second;
+                     });
+    OS << "    co-access:\n";
+    for (const auto &Pair : Pairs) {
+      OS << "      - { offsets: [ "
+         << Type->Fields[Pair.first.first].Offset << ", "
+         << Type->Fields[Pair.first.second].Offset << " ], count: "
+         << Pair.second << " }\n";
+    }
+  }
+  OS << "...\n";
+}
+
+void StructFieldHotness::runOnFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::set<uint64_t> &) {
+  if (opts::StructFieldReport.empty())
+    return;
+
+  if (!BC.DwCtx || BC.DwCtx->getNumCompileUnits() == 0) {
+    errs() << "BOLT-WARNING: -struct-field-report requires debug info\n";
+    return;
+  }
+
+  collectTypesAndGlobals(BC);
+
+  for (auto &BFI : BFs) {
+    auto &Function = BFI.second;
+    if (!Function.isSimple() || !Function.hasCFG() ||
+        !Function.hasValidProfile())
+      continue;
+    runOnFunction(BC, Function);
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(opts::StructFieldReport, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-ERROR: cannot open " << opts::StructFieldReport << ": "
+           << EC.message() << '\n';
+    return;
+  }
+  writeReport(OS);
+
+  uint64_t NumTypes = 0;
+  for (const auto &Entry : Types) {
+    if (Entry.second.Samples || Entry.second.Accesses)
+      ++NumTypes;
+  }
+  outs() << "BOLT-INFO: wrote the hotness of the fields of " << NumTypes
+         << " structures to " << opts::StructFieldReport << '\n';
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,136 @@
+//===--- Passes/StructFieldHotness.h - Report hot fields of structs -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Attribute memory accesses to the fields of the structures they touch, using
+// the debug info of the binary, and write how hot every field is and which
+// fields are accessed together to a file that a compiler can use to reorder
+// the fields.
+//
+// An access is attributed to a field in two ways. If the base register of
+// the memory operand holds a pointer to a structure according to the
+// location of a parameter or a variable, the displacement is the offset of
+// the field. Otherwise, the sampled data addresses that fall into a global
+// variable of a structure type, or of an array of structures, give the field.
+//
+// Fields are counted by the memory event samples of the instructions, and by
+// the execution counts of their blocks. Fields of the same structure accessed
+// in the same basic block are accessed together.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_STRUCT_FIELD_HOTNESS_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_STRUCT_FIELD_HOTNESS_H
+
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "BinaryPasses.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/DebugInfo/DWARF/DWARFDie.h"
+#include <map>
+
+namespace llvm {
+namespace bolt {
+
+class StructFieldHotness : public BinaryFunctionPass {
+  struct FieldStats {
+    std::string Name;
+    uint64_t Offset;
+    uint64_t Size;
+    uint64_t Samples;
+    uint64_t Accesses;
+  };
+
+  struct TypeStats {
+    std::string Name;
+    uint64_t Size{0};
+
+    /// Fields ordered by offset. A field extends to the next one.
+    std::vector<FieldStats> Fields;
+
+    /// Execution counts of the blocks accessing a pair of fields, indexed
+    /// by the indices of the fields.
+    std::map<std::pair<unsigned, unsigned>, uint64_t> CoAccess;
+
+    uint64_t Samples{0};
+    uint64_t Accesses{0};
+
+    /// Return the index of the field at \p Offset, or -1U.
+    unsigned getFieldIndex(uint64_t Offset) const;
+  };
+
+  /// A global variable of a structure type, or an array of such structures.
+  struct GlobalVariable {
+    uint64_t Size;
+    TypeStats *Type;
+  };
+
+  /// A parameter or a variable holding a pointer to a structure in register
+  /// \p Reg in the address range [Begin, End).
+  struct RegisterVariable {
+    unsigned Reg;
+    uint64_t Begin;
+    uint64_t End;
+    TypeStats *Type;
+  };
+
+  /// Statistics of the structures, indexed by their qualified names.
+  StringMap<TypeStats> Types;
+
+  /// Statistics of the structure defined by a DIE, indexed by the offset of
+  /// the DIE.
+  DenseMap<uint32_t, TypeStats *> DIEToType;
+
+  /// Definitions of the structures by their qualified names, for resolving
+  /// declarations.
+  StringMap<DWARFDie> Definitions;
+
+  /// Global variables by their addresses.
+  std::map<uint64_t, GlobalVariable> Globals;
+
+  /// Return the statistics of the structure \p Type, a definition or a
+  /// declaration, or nullptr if it is not a known structure.
+  TypeStats *getTypeStats(DWARFDie Type);
+
+  /// Collect the definitions of structures and global variables of all
+  /// compilation units.
+  void collectTypesAndGlobals(const BinaryContext &BC);
+
+  /// Collect the variables of \p Function held in registers that point to
+  /// structures.
+  std::vector<RegisterVariable>
+  getRegisterVariables(const BinaryContext &BC,
+                       const BinaryFunction &Function);
+
+  /// Attribute the memory accesses of \p Function to fields.
+  void runOnFunction(const BinaryContext &BC, const BinaryFunction &Function);
+
+  /// Write the report to \p OS.
+  void writeReport(raw_ostream &OS) const;
+
+public:
+  explicit StructFieldHotness(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "struct-field-hotness";
+  }
+  bool preservesDataflowInfo() const override { return true; }
+  bool shouldPrint(const BinaryFunction &BF) const override {
+    return false;
+  }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,234 @@
+//===--- Passes/TailDuplication.cpp - Profile-guided tail duplication -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "TailDuplication.h"
+#include "llvm/Support/Options.h"
+
+#define DEBUG_TYPE "bolt-tail-dup"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool>
+TailDuplicationFlag("tail-duplication",
+  cl::desc("duplicate small merge blocks into their hot predecessors"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+TailDuplicationMaxGrowth("tail-duplication-max-growth",
+  cl::desc("maximum growth of a function from tail duplication, in percent "
+           "of its size"),
+  cl::init(5),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+TailDuplicationMaxSize("tail-duplication-max-size",
+  cl::desc("maximum size in bytes of a block to duplicate"),
+  cl::init(16),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+TailDuplicationMinCount("tail-duplication-min-count",
+  cl::desc("minimum execution count of an edge to duplicate its target "
+           "into its source"),
+  cl::init(1),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+bool TailDuplication::canDuplicate(const BinaryContext &BC,
+                                   const BinaryBasicBlock &BB) const {
+  if (BB.isEntryPoint() || BB.isLandingPad() || BB.isCold() ||
+      BB.pred_size() < 2 || BB.succ_size() > 1 || BB.empty())
+    return false;
+
+  if (BB.succ_size() == 1 && BB.getSuccessor() == &BB)
+    return false;
+
+  if (BB.estimateSize() > opts::TailDuplicationMaxSize)
+    return false;
+
+  // Copies do not carry annotations, so leave out instructions whose
+  // meaning depends on them, as well as CFI which would need the CFI state
+  // to be rebuilt.
+  for (const auto &Inst : BB) {
+    if (BC.MIB->isCFI(Inst) || BC.MIB->isEHLabel(Inst) ||
+        BC.MIB->isInvoke(Inst) || BC.MIB->getJumpTable(Inst) ||
+        BC.MIB->getConditionalTailCall(Inst))
+      return false;
+    if (BC.MIB->isIndirectBranch(Inst) && !BC.MIB->isTailCall(Inst))
+      return false;
+  }
+
+  return true;
+}
+
+bool TailDuplication::duplicateInto(BinaryContext &BC,
+                                    BinaryFunction &Function,
+                                    BinaryBasicBlock &BB,
+                                    BinaryBasicBlock &Pred,
+                                    uint64_t &BytesAdded) {
+  if (&Pred == &BB || Pred.isCold() ||
+      Pred.getCFIStateAtExit() != BB.getCFIState())
+    return false;
+
+  const auto *PredLast = Pred.getLastNonPseudoInstr();
+  if (PredLast && BC.MIB->isIndirectBranch(*PredLast))
+    return false;
+
+  // A predecessor ending with a conditional branch gets a new block on the
+  // edge, which the block layout is then free to place as its fall-through.
+  BinaryBasicBlock *Target = &Pred;
+  if (Pred.succ_size() == 2) {
+    if (Pred.getConditionalSuccessor(true) ==
+        Pred.getConditionalSuccessor(false))
+      return false;
+    Target = Function.splitEdge(&Pred, &BB);
+  } else if (Pred.succ_size() != 1) {
+    return false;
+  }
+
+  const auto Count = Target->getBranchInfo(BB).Count;
+  auto *Succ = BB.getSuccessor();
+
+  // Drop the jump to BB, if any, and append the body of BB minus its own
+  // unconditional branch. fixBranches() adds the branches we need.
+  auto *Last = Target->getLastNonPseudoInstr();
+  if (Last && BC.MIB->isUnconditionalBranch(*Last) &&
+      !BC.MIB->isTailCall(*Last))
+    Target->eraseInstruction(Last);
+
+  const auto SizeBefore = Target->estimateSize();
+  for (const auto &Inst : BB) {
+    if (BC.MIB->isUnconditionalBranch(Inst) && !BC.MIB->isTailCall(Inst))
+      continue;
+    Target->addInstruction(MCPlus::copyWithoutAnnotations(Inst));
+  }
+  const auto SizeAfter = Target->estimateSize();
+
+  Target->removeSuccessor(&BB);
+  if (Succ)
+    Target->addSuccessor(Succ, Count);
+
+  // Move the profile of the duplicated path from BB to the copy.
+  const auto BBCount = BB.getKnownExecutionCount();
+  BB.setExecutionCount(BBCount > Count ? BBCount - Count : 0);
+  if (Succ) {
+    auto &BI = BB.getBranchInfo(*Succ);
+    BI.Count = BI.Count > Count ? BI.Count - Count : 0;
+  }
+
+  DEBUG(dbgs() << "BOLT-DEBUG: duplicated " << BB.getName() << " into "
+               << Pred.getName() << " in " << Function << " (count "
+               << Count << ")\n");
+
+  ++NumDuplicated;
+  NumDynamicDuplicated += Count;
+  BytesAdded = SizeAfter > SizeBefore ? SizeAfter - SizeBefore : 0;
+  return true;
+}
+
+void TailDuplication::runOnFunction(BinaryContext &BC,
+                                    BinaryFunction &Function) {
+  struct Candidate {
+    BinaryBasicBlock *BB;
+    BinaryBasicBlock *Pred;
+    uint64_t Count;
+  };
+  std::vector<Candidate> Candidates;
+
+  for (auto &BB : Function) {
+    if (!canDuplicate(BC, BB))
+      continue;
+    for (auto *Pred : BB.predecessors()) {
+      const auto Count = Pred->getBranchInfo(BB).Count;
+      if (Count == BinaryBasicBlock::COUNT_NO_PROFILE ||
+          Count < opts::TailDuplicationMinCount)
+        continue;
+      Candidates.push_back({&BB, Pred, Count});
+    }
+  }
+
+  if (Candidates.empty())
+    return;
+
+  // The hottest edges get the budget first.
+  std::stable_sort(Candidates.begin(), Candidates.end(),
+                   [](const Candidate &A, const Candidate &B) {
+                     return A.Count > B.Count;
+                   });
+
+  const uint64_t Budget =
+    std::max<uint64_t>(Function.estimateSize() *
+                         opts::TailDuplicationMaxGrowth / 100,
+                       opts::TailDuplicationMaxSize);
+  uint64_t Growth = 0;
+  bool Changed = false;
+  for (const auto &C : Candidates) {
+    // Earlier duplications may have changed the CFG. Keep at least one
+    // edge into the original block, or we would just be moving it.
+    if (C.BB->pred_size() < 2 ||
+        std::find(C.BB->pred_begin(), C.BB->pred_end(), C.Pred) ==
+          C.BB->pred_end())
+      continue;
+
+    if (Growth + C.BB->estimateSize() > Budget)
+      continue;
+
+    uint64_t BytesAdded = 0;
+    if (!duplicateInto(BC, Function, *C.BB, *C.Pred, BytesAdded))
+      continue;
+    Growth += BytesAdded;
+    Changed = true;
+  }
+
+  if (!Changed)
+    return;
+
+  Function.fixBranches();
+  NumBytesAdded += Growth;
+  ++NumFunctionsChanged;
+}
+
+void TailDuplication::runOnFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::set<uint64_t> &) {
+  if (!opts::TailDuplicationFlag)
+    return;
+
+  for (auto &It : BFs) {
+    auto &Function = It.second;
+    if (!shouldOptimize(Function) || !Function.hasValidProfile())
+      continue;
+    runOnFunction(BC, Function);
+  }
+
+  outs() << "BOLT-INFO: tail duplication copied " << NumDuplicated
+         << " blocks (" << NumDynamicDuplicated
+         << " dynamic executions) into their predecessors in "
+         << NumFunctionsChanged << " functions, adding " << NumBytesAdded
+         << " bytes\n";
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,63 @@
+//===--- Passes/TailDuplication.h - Profile-guided tail duplication -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Copy small blocks where several paths join, such as shared epilogues and
+// the targets of error checks, into their hot predecessors. A predecessor
+// that used to jump to the block then continues straight into its copy.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_TAIL_DUPLICATION_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_TAIL_DUPLICATION_H
+
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+class TailDuplication : public BinaryFunctionPass {
+  /// Statistics.
+  uint64_t NumDuplicated{0};
+  uint64_t NumDynamicDuplicated{0};
+  uint64_t NumBytesAdded{0};
+  uint64_t NumFunctionsChanged{0};
+
+  /// Return true if \p BB is small and simple enough to be copied.
+  bool canDuplicate(const BinaryContext &BC,
+                    const BinaryBasicBlock &BB) const;
+
+  /// Copy \p BB into its predecessor \p Pred. Return true on success and
+  /// set \p BytesAdded to the growth of the function.
+  bool duplicateInto(BinaryContext &BC,
+                     BinaryFunction &Function,
+                     BinaryBasicBlock &BB,
+                     BinaryBasicBlock &Pred,
+                     uint64_t &BytesAdded);
+
+  /// Duplicate merge blocks of \p Function within its size budget.
+  void runOnFunction(BinaryContext &BC, BinaryFunction &Function);
+
+public:
+  explicit TailDuplication(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "tail-duplication";
+  }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
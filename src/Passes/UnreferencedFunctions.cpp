@@ -0,0 +1,215 @@
+//===--- Passes/UnreferencedFunctions.cpp - Whole-program dead code -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Functions are reachable from the entry point, from exported symbols and
+// from data. References between functions are found in instruction operands
+// and relocations rather than in the call graph, so that functions whose
+// address is taken are kept as well.
+//
+//===----------------------------------------------------------------------===//
+
+#include "UnreferencedFunctions.h"
+#include "llvm/Support/Options.h"
+
+#define DEBUG_TYPE "bolt-unreferenced"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+extern cl::opt<unsigned> Verbosity;
+
+cl::opt<bolt::EliminateUnreferencedFunctions::UnreferencedMode>
+EliminateUnreferencedFunctions("eliminate-unreferenced-functions",
+  cl::desc("handle functions that nothing in the binary refers to"),
+  cl::init(bolt::EliminateUnreferencedFunctions::UM_NONE),
+  cl::values(clEnumValN(bolt::EliminateUnreferencedFunctions::UM_NONE,
+      "none",
+      "keep unreferenced functions in place"),
+    clEnumValN(bolt::EliminateUnreferencedFunctions::UM_MOVE,
+      "move",
+      "emit unreferenced functions after all other functions"),
+    clEnumValN(bolt::EliminateUnreferencedFunctions::UM_DROP,
+      "drop",
+      "do not emit unreferenced functions (relocation mode only)")),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+std::unordered_set<const BinaryFunction *>
+EliminateUnreferencedFunctions::findReachableFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs) {
+  std::unordered_set<const BinaryFunction *> Reachable;
+  std::vector<BinaryFunction *> Worklist;
+
+  auto markReachable = [&](BinaryFunction *BF) {
+    if (BF && Reachable.insert(BF).second)
+      Worklist.push_back(BF);
+  };
+
+  auto getFunctionForSymbol = [&](const MCSymbol *Symbol) -> BinaryFunction * {
+    if (!Symbol)
+      return nullptr;
+    if (auto *BF = BC.getFunctionForSymbol(Symbol))
+      return BF;
+    // Secondary entry points and data-in-code have their own names.
+    if (auto *BD = BC.getBinaryDataByName(Symbol->getName()))
+      return BC.getBinaryFunctionContainingAddress(BD->getAddress(),
+                                                   /*CheckPastEnd=*/false,
+                                                   /*UseMaxSize=*/true);
+    return nullptr;
+  };
+
+  markReachable(BC.getBinaryFunctionContainingAddress(BC.ProgramEntryAddress));
+
+  // Exported symbols of a dynamic object could be referenced by anyone.
+  const bool IsDynamic = !!BC.getUniqueSectionByName(".dynamic");
+
+  for (auto &BFI : BFs) {
+    auto &Function = BFI.second;
+
+    // Only functions we fully understand can be eliminated. Functions with
+    // a profile are executed, and functions with several entry points could
+    // be referenced through local labels that do not resolve to them.
+    if (!Function.isSimple() || !Function.hasCFG() ||
+        Function.hasConstantIsland() || Function.isMultiEntry() ||
+        (Function.getExecutionCount() != BinaryFunction::COUNT_NO_PROFILE &&
+         Function.getExecutionCount() > 0)) {
+      markReachable(&Function);
+      continue;
+    }
+
+    if (IsDynamic) {
+      for (const auto &Name : Function.getNames()) {
+        const auto *BD = BC.getBinaryDataByName(Name);
+        if (BD && BD->isGlobal()) {
+          markReachable(&Function);
+          break;
+        }
+      }
+    }
+  }
+
+  // References from data. Besides recorded relocations, look for function
+  // addresses stored in allocatable data. This covers dynamic relocations
+  // whose addends hold the targets, e.g. IFUNC resolvers in a PIE, and
+  // pointers we have no relocations for.
+  for (auto &Section : BC.sections()) {
+    for (const auto &Rel : Section.relocations())
+      markReachable(getFunctionForSymbol(Rel.Symbol));
+
+    if (!Section.isAllocatable() || Section.isText() || Section.isVirtual())
+      continue;
+
+    const auto Contents = Section.getContents();
+    const auto SectionAddress = Section.getAddress();
+    for (uint64_t Offset = alignTo(SectionAddress, 8) - SectionAddress;
+         Offset + 8 <= Contents.size();
+         Offset += 8) {
+      const auto Value =
+        support::endian::read64le(Contents.data() + Offset);
+      auto FI = BFs.find(Value);
+      if (FI != BFs.end())
+        markReachable(&FI->second);
+    }
+  }
+
+  // Follow references from the code of reachable functions.
+  while (!Worklist.empty()) {
+    auto *Function = Worklist.back();
+    Worklist.pop_back();
+
+    for (const auto &RelI : Function->getRelocations())
+      markReachable(getFunctionForSymbol(RelI.second.Symbol));
+    for (const auto &RelI : Function->getMoveRelocations())
+      markReachable(getFunctionForSymbol(RelI.second.Symbol));
+
+    if (!Function->hasCFG())
+      continue;
+
+    for (auto &BB : *Function) {
+      for (auto &Inst : BB) {
+        for (const auto &Op : Inst) {
+          if (!Op.isExpr())
+            continue;
+          markReachable(
+            getFunctionForSymbol(BC.MIB->getTargetSymbol(Op.getExpr())));
+        }
+      }
+    }
+  }
+
+  return Reachable;
+}
+
+void EliminateUnreferencedFunctions::runOnFunctions(
+    BinaryContext &BC,
+    std::map<uint64_t, BinaryFunction> &BFs,
+    std::set<uint64_t> &) {
+  if (opts::EliminateUnreferencedFunctions == UM_NONE)
+    return;
+
+  if (!BC.getBinaryFunctionContainingAddress(BC.ProgramEntryAddress)) {
+    errs() << "BOLT-WARNING: cannot find function at the entry point 0x"
+           << Twine::utohexstr(BC.ProgramEntryAddress)
+           << ". Skipping elimination of unreferenced functions.\n";
+    return;
+  }
+
+  const auto Reachable = findReachableFunctions(BC, BFs);
+
+  std::vector<BinaryFunction *> Unreferenced;
+  uint64_t UnreferencedBytes = 0;
+  for (auto &BFI : BFs) {
+    auto &Function = BFI.second;
+    if (Reachable.count(&Function))
+      continue;
+    Unreferenced.push_back(&Function);
+    UnreferencedBytes += Function.getSize();
+    DEBUG(dbgs() << "BOLT-DEBUG: function " << Function
+                 << " is unreferenced\n");
+    if (opts::Verbosity >= 2) {
+      outs() << "BOLT-INFO: function " << Function << " is unreferenced\n";
+    }
+  }
+
+  outs() << "BOLT-INFO: found " << Unreferenced.size()
+         << " unreferenced functions (" << UnreferencedBytes << " bytes)";
+  if (!BC.HasRelocations) {
+    outs() << ". Relocation mode is required to move or drop them.\n";
+    return;
+  }
+
+  if (opts::EliminateUnreferencedFunctions == UM_DROP) {
+    for (auto *Function : Unreferenced)
+      BC.removeFunction(*Function, BFs);
+    outs() << ", dropped\n";
+    return;
+  }
+
+  uint64_t NumMoved = 0;
+  for (auto *Function : Unreferenced) {
+    // Functions with an order from the profile or a reordering algorithm
+    // keep their place.
+    if (Function->hasValidIndex())
+      continue;
+    Function->setUnreferenced();
+    ++NumMoved;
+  }
+  outs() << ", moved " << NumMoved << " after all other functions\n";
+}
+
+} // namespace bolt
+} // namespace llvm
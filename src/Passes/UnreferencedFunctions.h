@@ -0,0 +1,56 @@
+//===--- Passes/UnreferencedFunctions.h - Whole-program dead code ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Find functions that cannot be reached from the entry point of the binary,
+// from exported symbols or from data, and move them after all other code or
+// remove them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_UNREFERENCED_FUNCTIONS_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_UNREFERENCED_FUNCTIONS_H
+
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+class EliminateUnreferencedFunctions : public BinaryFunctionPass {
+public:
+  /// What to do with functions nothing refers to.
+  enum UnreferencedMode : char {
+    UM_NONE = 0,  /// Leave them in place.
+    UM_MOVE,      /// Emit them after all other functions.
+    UM_DROP,      /// Do not emit them at all.
+  };
+
+  explicit EliminateUnreferencedFunctions(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "eliminate-unreferenced-functions";
+  }
+  void runOnFunctions(BinaryContext &BC,
+                      std::map<uint64_t, BinaryFunction> &BFs,
+                      std::set<uint64_t> &LargeFunctions) override;
+
+private:
+  /// Return the functions that are reachable from the roots of the binary
+  /// by following references from code and data.
+  std::unordered_set<const BinaryFunction *>
+  findReachableFunctions(BinaryContext &BC,
+                         std::map<uint64_t, BinaryFunction> &BFs);
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,438 @@
+//===-- PerfDataReader.cpp - Reader of perf.data files ----------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "PerfDataReader.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "aggregator"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace {
+
+/// "PERFILE2" read as a little-endian 64-bit value.
+const uint64_t PerfMagic = 0x32454c4946524550ULL;
+
+/// Size of the header of a file written to disk, as opposed to a pipe.
+const uint64_t PerfFileHeaderSize = 104;
+
+/// Size of struct perf_event_header preceding each record.
+const uint64_t RecordHeaderSize = 8;
+
+/// Offsets of the fields of struct perf_event_attr we use.
+const uint64_t AttrSizeOffset = 4;
+const uint64_t AttrSampleTypeOffset = 24;
+const uint64_t AttrBranchSampleTypeOffset = 72;
+
+/// Record types.
+enum : uint32_t {
+  PERF_RECORD_MMAP = 1,
+  PERF_RECORD_COMM = 3,
+  PERF_RECORD_SAMPLE = 9,
+  PERF_RECORD_MMAP2 = 10,
+};
+
+/// Record misc flags.
+enum : uint16_t {
+  PERF_RECORD_MISC_MMAP_DATA = 1 << 13,
+  PERF_RECORD_MISC_BUILD_ID_SIZE = 1 << 15,
+};
+
+/// Bits of perf_event_attr::sample_type, in the order the corresponding
+/// fields appear in a sample record.
+enum : uint64_t {
+  PERF_SAMPLE_IP = 1U << 0,
+  PERF_SAMPLE_TID = 1U << 1,
+  PERF_SAMPLE_TIME = 1U << 2,
+  PERF_SAMPLE_ADDR = 1U << 3,
+  PERF_SAMPLE_READ = 1U << 4,
+  PERF_SAMPLE_CALLCHAIN = 1U << 5,
+  PERF_SAMPLE_ID = 1U << 6,
+  PERF_SAMPLE_CPU = 1U << 7,
+  PERF_SAMPLE_PERIOD = 1U << 8,
+  PERF_SAMPLE_STREAM_ID = 1U << 9,
+  PERF_SAMPLE_RAW = 1U << 10,
+  PERF_SAMPLE_BRANCH_STACK = 1U << 11,
+  PERF_SAMPLE_IDENTIFIER = 1U << 16,
+};
+
+/// Bit of perf_event_attr::branch_sample_type adding hw_idx to the stack.
+const uint64_t PERF_SAMPLE_BRANCH_HW_INDEX = 1U << 17;
+
+/// Feature sections of the file header.
+enum : unsigned {
+  HEADER_BUILD_ID = 2,
+  HEADER_EVENT_DESC = 12,
+  HEADER_FEAT_BITS = 256,
+};
+
+uint16_t read16(StringRef Data, uint64_t Offset) {
+  return support::endian::read16le(Data.data() + Offset);
+}
+
+uint32_t read32(StringRef Data, uint64_t Offset) {
+  return support::endian::read32le(Data.data() + Offset);
+}
+
+uint64_t read64(StringRef Data, uint64_t Offset) {
+  return support::endian::read64le(Data.data() + Offset);
+}
+
+bool inBounds(StringRef Data, uint64_t Offset, uint64_t Size) {
+  return Offset <= Data.size() && Size <= Data.size() - Offset;
+}
+
+std::error_code malformed(const Twine &Message) {
+  errs() << "PERF2BOLT-ERROR: malformed perf.data file: " << Message << '\n';
+  return make_error_code(errc::invalid_argument);
+}
+
+/// Return the null-terminated string at the start of \p Data.
+StringRef readCString(StringRef Data) {
+  return Data.substr(0, Data.find('\0'));
+}
+
+}
+
+ErrorOr<std::unique_ptr<PerfDataReader>>
+PerfDataReader::create(StringRef FileName) {
+  auto MB = MemoryBuffer::getFile(FileName, /*FileSize=*/-1,
+                                  /*RequiresNullTerminator=*/false);
+  if (std::error_code EC = MB.getError())
+    return EC;
+
+  std::unique_ptr<PerfDataReader> Reader(new PerfDataReader(std::move(*MB)));
+  if (std::error_code EC = Reader->readHeader())
+    return EC;
+  return std::move(Reader);
+}
+
+std::error_code PerfDataReader::readHeader() {
+  if (!inBounds(Data, 0, PerfFileHeaderSize) || read64(Data, 0) != PerfMagic)
+    return malformed("unsupported file header");
+  if (read64(Data, 8) != PerfFileHeaderSize)
+    return malformed("files written by perf record -o - are not supported");
+
+  const auto AttrSize = read64(Data, 16);
+  const auto AttrsOffset = read64(Data, 24);
+  const auto AttrsSize = read64(Data, 32);
+  DataOffset = read64(Data, 40);
+  DataSize = read64(Data, 48);
+  if (AttrSize < AttrSampleTypeOffset + 8 + 16 ||
+      !inBounds(Data, AttrsOffset, AttrsSize) ||
+      !inBounds(Data, DataOffset, DataSize))
+    return malformed("invalid section bounds");
+
+  // Each perf_file_attr holds the attribute followed by the section with ids
+  // of the samples of the event.
+  const auto AttrsEnd = AttrsOffset + AttrsSize;
+  for (auto Offset = AttrsOffset; Offset + AttrSize <= AttrsEnd;
+       Offset += AttrSize) {
+    EventInfo Event;
+    Event.SampleType = read64(Data, Offset + AttrSampleTypeOffset);
+    const auto EventAttrSize = std::min<uint64_t>(
+        read32(Data, Offset + AttrSizeOffset), AttrSize - 16);
+    if (EventAttrSize >= AttrBranchSampleTypeOffset + 8)
+      Event.BranchSampleType =
+        read64(Data, Offset + AttrBranchSampleTypeOffset);
+
+    const auto IDsOffset = read64(Data, Offset + AttrSize - 16);
+    const auto IDsSize = read64(Data, Offset + AttrSize - 8);
+    if (!inBounds(Data, IDsOffset, IDsSize))
+      return malformed("invalid event id section");
+    for (uint64_t I = 0; I + 8 <= IDsSize; I += 8)
+      IDToEvent[read64(Data, IDsOffset + I)] = Events.size();
+
+    Events.emplace_back(std::move(Event));
+  }
+  if (Events.empty())
+    return malformed("no events recorded");
+
+  // The table of feature sections follows the data section and has an entry
+  // for each feature bit that is set.
+  uint64_t FeatureOffset = DataOffset + DataSize;
+  for (unsigned Feature = 0; Feature < HEADER_FEAT_BITS; ++Feature) {
+    const auto Bits = read64(Data, 72 + (Feature / 64) * 8);
+    if (!(Bits & (1ULL << (Feature % 64))))
+      continue;
+    if (!inBounds(Data, FeatureOffset, 16))
+      return malformed("invalid feature table");
+    const auto Offset = read64(Data, FeatureOffset);
+    const auto Size = read64(Data, FeatureOffset + 8);
+    FeatureOffset += 16;
+    if (!inBounds(Data, Offset, Size))
+      return malformed("invalid feature section");
+
+    std::error_code EC;
+    if (Feature == HEADER_EVENT_DESC)
+      EC = readEventDesc(Offset, Size);
+    else if (Feature == HEADER_BUILD_ID)
+      EC = readBuildIDs(Offset, Size);
+    if (EC)
+      return EC;
+  }
+
+  DEBUG(dbgs() << "PERF2BOLT: perf.data has " << Events.size()
+               << " event(s) and " << BuildIDs.size() << " build-id(s)\n");
+
+  return std::error_code();
+}
+
+std::error_code PerfDataReader::readEventDesc(uint64_t Offset, uint64_t Size) {
+  const auto Section = Data.substr(Offset, Size);
+  if (Section.size() < 8)
+    return malformed("invalid event description");
+  const auto NumEvents = read32(Section, 0);
+  const auto AttrSize = read32(Section, 4);
+
+  // Descriptions are written in the same order as event attributes.
+  uint64_t Pos = 8;
+  for (uint32_t I = 0; I < NumEvents && I < Events.size(); ++I) {
+    Pos += AttrSize;
+    if (!inBounds(Section, Pos, 8))
+      return malformed("invalid event description");
+    const auto NumIDs = read32(Section, Pos);
+    const auto NameSize = read32(Section, Pos + 4);
+    Pos += 8;
+    if (!inBounds(Section, Pos, NameSize))
+      return malformed("invalid event description");
+    Events[I].Name = readCString(Section.substr(Pos, NameSize));
+    Pos += NameSize + uint64_t(NumIDs) * 8;
+  }
+  return std::error_code();
+}
+
+std::error_code PerfDataReader::readBuildIDs(uint64_t Offset, uint64_t Size) {
+  // Records of struct build_id_event: a record header, a process id, 24 bytes
+  // of build-id and a null-terminated file name.
+  const auto Section = Data.substr(Offset, Size);
+  const uint64_t FileNameOffset = RecordHeaderSize + 4 + 24;
+  uint64_t Pos = 0;
+  while (inBounds(Section, Pos, RecordHeaderSize)) {
+    const auto Misc = read16(Section, Pos + 4);
+    const auto RecordSize = read16(Section, Pos + 6);
+    if (RecordSize < FileNameOffset || !inBounds(Section, Pos, RecordSize))
+      return malformed("invalid build-id record");
+
+    const auto Record = Section.substr(Pos, RecordSize);
+    const auto BuildID = Record.substr(RecordHeaderSize + 4, 24);
+    unsigned BuildIDSize = 20;
+    if (Misc & PERF_RECORD_MISC_BUILD_ID_SIZE)
+      BuildIDSize = std::min<unsigned>(BuildID[20], 20);
+
+    std::string Hex;
+    raw_string_ostream OS(Hex);
+    for (unsigned I = 0; I < BuildIDSize; ++I)
+      OS << format_hex_no_prefix(static_cast<uint8_t>(BuildID[I]), 2);
+    BuildIDs.emplace_back(readCString(Record.drop_front(FileNameOffset)),
+                          OS.str());
+    Pos += RecordSize;
+  }
+  return std::error_code();
+}
+
+std::error_code PerfDataReader::forEachRecord(
+    function_ref<std::error_code(uint32_t, uint16_t, StringRef)> Callback)
+  const {
+  const auto Records = Data.substr(DataOffset, DataSize);
+  uint64_t Pos = 0;
+  while (inBounds(Records, Pos, RecordHeaderSize)) {
+    const auto Type = read32(Records, Pos);
+    const auto Misc = read16(Records, Pos + 4);
+    const auto RecordSize = read16(Records, Pos + 6);
+    if (RecordSize < RecordHeaderSize || !inBounds(Records, Pos, RecordSize))
+      return malformed("invalid record at offset 0x" +
+                       Twine::utohexstr(DataOffset + Pos));
+
+    const auto Payload = Records.substr(Pos + RecordHeaderSize,
+                                        RecordSize - RecordHeaderSize);
+    if (std::error_code EC = Callback(Type, Misc, Payload))
+      return EC;
+    Pos += RecordSize;
+  }
+  return std::error_code();
+}
+
+std::error_code PerfDataReader::forEachTaskEvent(
+    function_ref<void(int64_t, int64_t, StringRef)> OnComm,
+    function_ref<void(const MMapEvent &)> OnMMap) const {
+  return forEachRecord([&](uint32_t Type, uint16_t Misc, StringRef Payload) {
+    switch (Type) {
+    case PERF_RECORD_COMM:
+      // pid, tid, comm[]
+      if (Payload.size() < 8)
+        return malformed("invalid COMM record");
+      OnComm(static_cast<int32_t>(read32(Payload, 0)),
+             static_cast<int32_t>(read32(Payload, 4)),
+             readCString(Payload.drop_front(8)));
+      break;
+    case PERF_RECORD_MMAP:
+    case PERF_RECORD_MMAP2: {
+      // pid, tid, start, len, pgoff, then for MMAP2 device and inode (or
+      // build-id) info, prot and flags, followed by filename[].
+      const uint64_t FileNameOffset = Type == PERF_RECORD_MMAP ? 32 : 64;
+      if (Payload.size() < FileNameOffset)
+        return malformed("invalid MMAP record");
+      if (Misc & PERF_RECORD_MISC_MMAP_DATA)
+        break;
+      MMapEvent Event;
+      Event.PID = static_cast<int32_t>(read32(Payload, 0));
+      Event.Start = read64(Payload, 8);
+      Event.Len = read64(Payload, 16);
+      Event.PgOff = read64(Payload, 24);
+      Event.FileName = readCString(Payload.drop_front(FileNameOffset));
+      OnMMap(Event);
+      break;
+    }
+    default:
+      break;
+    }
+    return std::error_code();
+  });
+}
+
+const PerfDataReader::EventInfo *
+PerfDataReader::getSampleEvent(StringRef Payload) const {
+  if (Events.size() == 1)
+    return &Events.front();
+
+  // With several events the sample id identifies the event. Its position
+  // only depends on sample_type bits preceding it, which perf keeps the same
+  // for all events.
+  const auto SampleType = Events.front().SampleType;
+  uint64_t Pos = 0;
+  if (!(SampleType & PERF_SAMPLE_IDENTIFIER)) {
+    if (!(SampleType & PERF_SAMPLE_ID))
+      return nullptr;
+    for (auto Bit : {PERF_SAMPLE_IP, PERF_SAMPLE_TID, PERF_SAMPLE_TIME,
+                     PERF_SAMPLE_ADDR}) {
+      if (SampleType & Bit)
+        Pos += 8;
+    }
+  }
+  if (!inBounds(Payload, Pos, 8))
+    return nullptr;
+
+  auto Itr = IDToEvent.find(read64(Payload, Pos));
+  return Itr != IDToEvent.end() ? &Events[Itr->second] : nullptr;
+}
+
+std::error_code PerfDataReader::parseSample(const EventInfo &Event,
+                                            StringRef Payload,
+                                            Sample &S) const {
+  const auto SampleType = Event.SampleType;
+  uint64_t Pos = 0;
+  auto take = [&](uint64_t Size) {
+    const auto Start = Pos;
+    Pos += Size;
+    return inBounds(Payload, Start, Size) ? Start : Payload.size();
+  };
+  auto truncated = [] { return malformed("truncated sample record"); };
+
+  S.EventName = Event.Name;
+  if (SampleType & PERF_SAMPLE_IDENTIFIER)
+    take(8);
+  if (SampleType & PERF_SAMPLE_IP) {
+    const auto Offset = take(8);
+    if (Offset == Payload.size())
+      return truncated();
+    S.IP = read64(Payload, Offset);
+  }
+  if (SampleType & PERF_SAMPLE_TID) {
+    const auto Offset = take(8);
+    if (Offset == Payload.size())
+      return truncated();
+    S.PID = static_cast<int32_t>(read32(Payload, Offset));
+    S.TID = static_cast<int32_t>(read32(Payload, Offset + 4));
+  }
+  if (SampleType & PERF_SAMPLE_TIME) {
+    const auto Offset = take(8);
+    if (Offset == Payload.size())
+      return truncated();
+    S.Time = read64(Payload, Offset);
+  }
+  if (SampleType & PERF_SAMPLE_ADDR) {
+    const auto Offset = take(8);
+    if (Offset == Payload.size())
+      return truncated();
+    S.Addr = read64(Payload, Offset);
+  }
+
+  if (!(SampleType & PERF_SAMPLE_BRANCH_STACK))
+    return std::error_code();
+
+  // Skip the fields preceding the branch stack.
+  if (SampleType & PERF_SAMPLE_ID)
+    take(8);
+  if (SampleType & PERF_SAMPLE_STREAM_ID)
+    take(8);
+  if (SampleType & PERF_SAMPLE_CPU)
+    take(8);
+  if (SampleType & PERF_SAMPLE_PERIOD)
+    take(8);
+  if (SampleType & PERF_SAMPLE_READ)
+    return malformed("samples with PERF_SAMPLE_READ are not supported");
+  if (SampleType & PERF_SAMPLE_CALLCHAIN) {
+    const auto Offset = take(8);
+    const auto NumIPs = Offset == Payload.size() ? 0 : read64(Payload, Offset);
+    if (Offset == Payload.size() || NumIPs > Payload.size() / 8)
+      return truncated();
+    take(NumIPs * 8);
+  }
+  if (SampleType & PERF_SAMPLE_RAW) {
+    const auto Offset = take(4);
+    if (Offset == Payload.size())
+      return truncated();
+    take(read32(Payload, Offset));
+  }
+
+  const auto Offset = take(8);
+  if (Offset == Payload.size())
+    return truncated();
+  const auto NumEntries = read64(Payload, Offset);
+  if (NumEntries > Payload.size() / sizeof(BranchEntry))
+    return truncated();
+  if (Event.BranchSampleType & PERF_SAMPLE_BRANCH_HW_INDEX)
+    take(8);
+  const auto EntriesOffset = take(NumEntries * sizeof(BranchEntry));
+  if (EntriesOffset == Payload.size() && NumEntries)
+    return truncated();
+
+  // Records are 8-byte aligned within the mapped file.
+  S.Branches = makeArrayRef(
+      reinterpret_cast<const BranchEntry *>(Payload.data() + EntriesOffset),
+      NumEntries);
+  return std::error_code();
+}
+
+std::error_code PerfDataReader::forEachSample(
+    function_ref<void(const Sample &)> Callback) const {
+  return forEachRecord([&](uint32_t Type, uint16_t, StringRef Payload) {
+    if (Type != PERF_RECORD_SAMPLE)
+      return std::error_code();
+
+    const auto *Event = getSampleEvent(Payload);
+    if (!Event)
+      return malformed("cannot identify the event of a sample");
+
+    Sample S;
+    if (std::error_code EC = parseSample(*Event, Payload, S))
+      return EC;
+    Callback(S);
+    return std::error_code();
+  });
+}
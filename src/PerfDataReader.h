@@ -0,0 +1,144 @@
+//===-- PerfDataReader.h - Reader of perf.data files ------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Decodes records of a perf.data file written by "perf record" directly from
+// the memory-mapped file, as an alternative to parsing "perf script" output.
+// Only the parts used for profile aggregation are supported: samples with
+// their branch stacks, COMM and MMAP/MMAP2 task events, event names and
+// build-ids from the feature sections of the file.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PERF_DATA_READER_H
+#define LLVM_TOOLS_LLVM_BOLT_PERF_DATA_READER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+class PerfDataReader {
+public:
+  /// Entry of a sampled branch stack as stored in the file.
+  struct BranchEntry {
+    uint64_t From;
+    uint64_t To;
+    uint64_t Flags;
+
+    bool isMispredicted() const { return Flags & 1; }
+
+    /// Cycles since the previous entry, 0 if not recorded.
+    uint16_t getCycles() const { return (Flags >> 4) & 0xffff; }
+  };
+
+  /// Fields of a PERF_RECORD_SAMPLE record that are of interest to us.
+  /// Branches are stored most recent first, as in "perf script -F brstack".
+  struct Sample {
+    StringRef EventName;
+    int64_t PID{-1};
+    int64_t TID{-1};
+    uint64_t IP{0};
+    uint64_t Time{0};
+    uint64_t Addr{0};
+    ArrayRef<BranchEntry> Branches;
+  };
+
+  /// Executable mapping of a file into a process.
+  struct MMapEvent {
+    int64_t PID{-1};
+    uint64_t Start{0};
+    uint64_t Len{0};
+    uint64_t PgOff{0};
+    StringRef FileName;
+  };
+
+private:
+  /// Sampling configuration of a single event recorded in the file.
+  struct EventInfo {
+    uint64_t SampleType{0};
+    uint64_t BranchSampleType{0};
+    std::string Name;
+  };
+
+  std::unique_ptr<MemoryBuffer> Buffer;
+  StringRef Data;
+
+  /// Bounds of the data section holding the records.
+  uint64_t DataOffset{0};
+  uint64_t DataSize{0};
+
+  std::vector<EventInfo> Events;
+
+  /// Event index for each sample id, when several events are recorded.
+  DenseMap<uint64_t, unsigned> IDToEvent;
+
+  /// Pairs of file names and build-ids listed in the file header.
+  std::vector<std::pair<StringRef, std::string>> BuildIDs;
+
+  explicit PerfDataReader(std::unique_ptr<MemoryBuffer> Buffer)
+    : Buffer(std::move(Buffer)), Data(this->Buffer->getBuffer()) {}
+
+  /// Read the file header, event attributes and feature sections.
+  std::error_code readHeader();
+
+  /// Read names of events from the HEADER_EVENT_DESC feature section.
+  std::error_code readEventDesc(uint64_t Offset, uint64_t Size);
+
+  /// Read the HEADER_BUILD_ID feature section.
+  std::error_code readBuildIDs(uint64_t Offset, uint64_t Size);
+
+  /// Return the event a sample record with payload \p Payload belongs to.
+  const EventInfo *getSampleEvent(StringRef Payload) const;
+
+  /// Decode the payload of a sample record of \p Event into \p S.
+  std::error_code parseSample(const EventInfo &Event, StringRef Payload,
+                              Sample &S) const;
+
+  /// Call \p Callback with type, misc field and payload of every record in
+  /// the data section.
+  std::error_code forEachRecord(
+      function_ref<std::error_code(uint32_t, uint16_t, StringRef)> Callback)
+    const;
+
+public:
+  /// Map \p FileName into memory and read its header.
+  static ErrorOr<std::unique_ptr<PerfDataReader>> create(StringRef FileName);
+
+  /// Call \p OnComm for every PERF_RECORD_COMM record with the process id,
+  /// the thread id and the command name, and \p OnMMap for every executable
+  /// mapping of a file.
+  std::error_code forEachTaskEvent(
+      function_ref<void(int64_t, int64_t, StringRef)> OnComm,
+      function_ref<void(const MMapEvent &)> OnMMap) const;
+
+  /// Call \p Callback for every sample in the file.
+  std::error_code
+  forEachSample(function_ref<void(const Sample &)> Callback) const;
+
+  /// Return file names and build-ids (as lowercase hex strings) recorded in
+  /// the file.
+  const std::vector<std::pair<StringRef, std::string>> &getBuildIDs() const {
+    return BuildIDs;
+  }
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,239 @@
+//===--- PhaseStats.cpp - Resource usage of rewrite phases and passes -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "PhaseStats.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <sys/resource.h>
+#include <vector>
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltCategory;
+
+enum PhaseStatsFormatType : char {
+  PSF_CSV,
+  PSF_JSON,
+};
+
+static cl::opt<std::string>
+PhaseStatsReport("phase-stats-report",
+  cl::desc("write wall time, CPU time, peak RSS and code changes of every "
+           "rewrite phase and optimization pass to a file"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+static cl::opt<PhaseStatsFormatType>
+PhaseStatsFormat("phase-stats-format",
+  cl::desc("format of the report written with -phase-stats-report"),
+  cl::init(PSF_CSV),
+  cl::values(clEnumValN(PSF_CSV, "csv", "comma-separated values"),
+             clEnumValN(PSF_JSON, "json", "JSON")),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+namespace PhaseStats {
+
+namespace {
+
+#define D(name, ...) #name,
+const char *DynoStatNames[] = { DYNO_STATS };
+#undef D
+
+/// Statistics of a single phase or pass.
+struct Record {
+  std::string Name;
+  double WallTime;
+  double UserTime;
+  double SystemTime;
+  int64_t PeakRSSDelta;
+
+  /// Number of functions with modified code or layout, or -1 if unknown.
+  int64_t NumModifiedFunctions{-1};
+
+  /// Change in the value of every dyno stats category. Empty if unknown.
+  std::vector<int64_t> DynoStatsDelta;
+};
+
+std::vector<Record> Records;
+
+/// Return peak resident set size of the process in kilobytes.
+int64_t getPeakRSS() {
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage) != 0)
+    return 0;
+  return Usage.ru_maxrss;
+}
+
+/// Return a value that changes whenever code or block layout of \p BF does.
+uint64_t getFingerprint(const BinaryFunction &BF) {
+  hash_code Hash = hash_value(BF.layout_size());
+  for (const auto *BB : BF.layout()) {
+    Hash = hash_combine(Hash, BB, BB->size());
+    for (const auto &Inst : *BB) {
+      Hash = hash_combine(Hash, Inst.getOpcode(), Inst.getNumOperands());
+      for (const auto &Op : Inst) {
+        if (Op.isReg())
+          Hash = hash_combine(Hash, Op.getReg());
+        else if (Op.isImm())
+          Hash = hash_combine(Hash, Op.getImm());
+        else if (Op.isExpr())
+          Hash = hash_combine(Hash, Op.getExpr());
+      }
+    }
+  }
+  return Hash;
+}
+
+void writeCSV(raw_ostream &OS) {
+  OS << "name,wall_time,user_time,system_time,peak_rss_delta_kb,"
+        "functions_modified";
+  for (auto Stat = DynoStats::FIRST_DYNO_STAT + 1;
+       Stat < DynoStats::LAST_DYNO_STAT; ++Stat)
+    OS << ',' << DynoStatNames[Stat];
+  OS << '\n';
+
+  for (const auto &R : Records) {
+    OS << R.Name << ','
+       << format("%.6f,%.6f,%.6f", R.WallTime, R.UserTime, R.SystemTime)
+       << ',' << R.PeakRSSDelta << ',';
+    if (R.NumModifiedFunctions >= 0)
+      OS << R.NumModifiedFunctions;
+    for (auto Stat = DynoStats::FIRST_DYNO_STAT + 1;
+         Stat < DynoStats::LAST_DYNO_STAT; ++Stat) {
+      OS << ',';
+      if (!R.DynoStatsDelta.empty())
+        OS << R.DynoStatsDelta[Stat];
+    }
+    OS << '\n';
+  }
+}
+
+void writeJSON(raw_ostream &OS) {
+  OS << "[\n";
+  for (unsigned I = 0; I < Records.size(); ++I) {
+    const auto &R = Records[I];
+    OS << "  {\"name\": \"" << R.Name << "\", "
+       << format("\"wall_time\": %.6f, \"user_time\": %.6f, "
+                 "\"system_time\": %.6f, ",
+                 R.WallTime, R.UserTime, R.SystemTime)
+       << "\"peak_rss_delta_kb\": " << R.PeakRSSDelta;
+    if (R.NumModifiedFunctions >= 0)
+      OS << ", \"functions_modified\": " << R.NumModifiedFunctions;
+    if (!R.DynoStatsDelta.empty()) {
+      OS << ", \"dyno_stats_delta\": {";
+      for (auto Stat = DynoStats::FIRST_DYNO_STAT + 1;
+           Stat < DynoStats::LAST_DYNO_STAT; ++Stat) {
+        if (Stat != DynoStats::FIRST_DYNO_STAT + 1)
+          OS << ", ";
+        OS << '"' << DynoStatNames[Stat] << "\": " << R.DynoStatsDelta[Stat];
+      }
+      OS << '}';
+    }
+    OS << '}' << (I + 1 < Records.size() ? "," : "") << '\n';
+  }
+  OS << "]\n";
+}
+
+} // anonymous namespace
+
+bool isEnabled() {
+  return !opts::PhaseStatsReport.empty();
+}
+
+Scope::Scope(StringRef Name, std::map<uint64_t, BinaryFunction> *BFs)
+  : Name(Name.str()), BFs(BFs) {
+  if (!isEnabled())
+    return;
+
+  if (BFs) {
+    StartDynoStats = getDynoStats(*BFs);
+    for (const auto &BFI : *BFs) {
+      if (BFI.second.hasCFG())
+        StartFingerprints[BFI.first] = getFingerprint(BFI.second);
+    }
+  }
+
+  StartPeakRSS = getPeakRSS();
+  StartTime = TimeRecord::getCurrentTime(/*Start=*/true);
+}
+
+Scope::~Scope() {
+  if (!isEnabled())
+    return;
+
+  const auto EndTime = TimeRecord::getCurrentTime(/*Start=*/false);
+
+  Record R;
+  R.Name = Name;
+  R.WallTime = EndTime.getWallTime() - StartTime.getWallTime();
+  R.UserTime = EndTime.getUserTime() - StartTime.getUserTime();
+  R.SystemTime = EndTime.getSystemTime() - StartTime.getSystemTime();
+  R.PeakRSSDelta = getPeakRSS() - StartPeakRSS;
+
+  if (BFs) {
+    R.NumModifiedFunctions = 0;
+    for (const auto &BFI : *BFs) {
+      if (!BFI.second.hasCFG())
+        continue;
+      auto FI = StartFingerprints.find(BFI.first);
+      if (FI == StartFingerprints.end() ||
+          FI->second != getFingerprint(BFI.second))
+        ++R.NumModifiedFunctions;
+    }
+
+    const auto EndDynoStats = getDynoStats(*BFs);
+    const auto &Before = StartDynoStats;
+    const auto &After = EndDynoStats;
+    R.DynoStatsDelta.resize(DynoStats::LAST_DYNO_STAT);
+    for (auto Stat = DynoStats::FIRST_DYNO_STAT + 1;
+         Stat < DynoStats::LAST_DYNO_STAT; ++Stat)
+      R.DynoStatsDelta[Stat] = int64_t(After[Stat]) - int64_t(Before[Stat]);
+  }
+
+  Records.emplace_back(std::move(R));
+}
+
+void writeReport() {
+  if (!isEnabled())
+    return;
+
+  std::error_code EC;
+  raw_fd_ostream OS(opts::PhaseStatsReport, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: cannot write phase statistics to "
+           << opts::PhaseStatsReport << ": " << EC.message() << '\n';
+    return;
+  }
+
+  if (opts::PhaseStatsFormat == opts::PSF_JSON)
+    writeJSON(OS);
+  else
+    writeCSV(OS);
+
+  outs() << "BOLT-INFO: phase statistics written to "
+         << opts::PhaseStatsReport << '\n';
+}
+
+} // namespace PhaseStats
+} // namespace bolt
+} // namespace llvm
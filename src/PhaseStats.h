@@ -0,0 +1,67 @@
+//===--- PhaseStats.h - Resource usage of rewrite phases and passes -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Collection of wall time, CPU time, peak memory and code changes for every
+// phase of the rewrite and every optimization pass. The statistics are written
+// to the file given with -phase-stats-report in CSV or JSON format.
+//
+// Hot steps inside phases and passes (profile reading and aggregation,
+// disassembly, CFG construction, ICF hashing and function clustering) get
+// their own records, so that a report from a fixed input can be used to track
+// the throughput of BOLT itself over time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PHASE_STATS_H
+#define LLVM_TOOLS_LLVM_BOLT_PHASE_STATS_H
+
+#include "BinaryFunction.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Timer.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+namespace llvm {
+namespace bolt {
+
+namespace PhaseStats {
+
+/// Return true if statistics were requested with -phase-stats-report.
+bool isEnabled();
+
+/// Collects statistics of a phase or a pass from construction of the object
+/// until its destruction. If \p BFs is given, the number of functions whose
+/// code or layout changed and the change in dyno stats are recorded too.
+class Scope {
+  std::string Name;
+  std::map<uint64_t, BinaryFunction> *BFs;
+  TimeRecord StartTime;
+  int64_t StartPeakRSS{0};
+  DynoStats StartDynoStats;
+
+  /// Fingerprints of the functions' code indexed by function address.
+  std::unordered_map<uint64_t, uint64_t> StartFingerprints;
+
+public:
+  explicit Scope(StringRef Name,
+                 std::map<uint64_t, BinaryFunction> *BFs = nullptr);
+  ~Scope();
+};
+
+/// Write all statistics collected so far to the report file.
+void writeReport();
+
+} // namespace PhaseStats
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -11,10 +11,16 @@
 
 #include "BinaryBasicBlock.h"
 #include "BinaryFunction.h"
+#include "ParallelUtilities.h"
 #include "Passes/MCF.h"
 #include "ProfileReader.h"
 #include "ProfileYAMLMapping.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/LEB128.h"
+
+#undef  DEBUG_TYPE
+#define DEBUG_TYPE "bolt-prof"
 
 using namespace llvm;
 
@@ -31,11 +37,249 @@ IgnoreHash("profile-ignore-hash",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static llvm::cl::opt<bool>
+InferStaleProfile("infer-stale-profile",
+  cl::desc("map blocks of a profile that does not match its function to "
+           "blocks with the same opcodes and similar successors"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static llvm::cl::opt<bool>
+MatchProfileByHash("match-profile-by-hash",
+  cl::desc("attach profiles that did not match any function by name to the "
+           "only function with the same hash and number of basic blocks"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace llvm {
 namespace bolt {
 
+namespace {
+
+/// Sequential reader of fields of the binary profile encoding. Once an error
+/// is encountered, all subsequent reads return zero values.
+class EncodedProfileReader {
+  const uint8_t *Cur;
+  const uint8_t *End;
+  const char *Error{nullptr};
+
+public:
+  explicit EncodedProfileReader(StringRef Data)
+    : Cur(Data.bytes_begin()), End(Data.bytes_end()) {}
+
+  uint64_t readULEB() {
+    if (Error)
+      return 0;
+    unsigned Size;
+    const auto Value = decodeULEB128(Cur, &Size, End, &Error);
+    Cur += Size;
+    return Value;
+  }
+
+  /// Read a number of elements that follow. Each element takes at least a
+  /// byte, so larger numbers mean the data is malformed.
+  uint64_t readCount() {
+    const auto Count = readULEB();
+    if (!Error && Count > static_cast<uint64_t>(End - Cur))
+      Error = "element count exceeds the remaining size";
+    return Error ? 0 : Count;
+  }
+
+  StringRef readString() {
+    const auto Size = readULEB();
+    if (!Error && Size > static_cast<uint64_t>(End - Cur))
+      Error = "string extends past end";
+    if (Error)
+      return StringRef();
+    StringRef Str(reinterpret_cast<const char *>(Cur), Size);
+    Cur += Size;
+    return Str;
+  }
+
+  bool atEnd() const { return Cur == End; }
+
+  const char *getError() const { return Error; }
+};
+
+} // end anonymous namespace
+
+std::error_code ProfileReader::parseBinaryProfile(StringRef Data) {
+  EncodedProfileReader Reader(Data);
+
+  auto &Header = YamlBP.Header;
+  Header.Version = Reader.readULEB();
+  Header.Flags = Reader.readULEB();
+  Header.FileName = Reader.readString();
+  Header.Id = Reader.readString();
+  Header.Origin = Reader.readString();
+  Header.EventNames = Reader.readString();
+
+  const auto NumFunctions = Reader.readCount();
+  YamlBP.Functions.resize(NumFunctions);
+  for (auto &YamlBF : YamlBP.Functions) {
+    YamlBF.Name = Reader.readString();
+    YamlBF.Id = Reader.readULEB();
+    YamlBF.Hash = Reader.readULEB();
+    YamlBF.NumBasicBlocks = Reader.readULEB();
+    YamlBF.ExecCount = Reader.readULEB();
+    YamlBF.EncodedBlocks = Reader.readString();
+  }
+
+  if (Reader.getError()) {
+    errs() << "BOLT-ERROR: malformed binary profile : " << Reader.getError()
+           << '\n';
+    return std::make_error_code(std::errc::illegal_byte_sequence);
+  }
+  return std::error_code();
+}
+
+bool ProfileReader::decodeBlocks(yaml::bolt::BinaryFunctionProfile &YamlBF) {
+  EncodedProfileReader Reader(YamlBF.EncodedBlocks);
+  YamlBF.EncodedBlocks = StringRef();
+
+  YamlBF.Blocks.resize(Reader.readCount());
+  for (auto &YamlBB : YamlBF.Blocks) {
+    YamlBB.Index = Reader.readULEB();
+    YamlBB.NumInstructions = Reader.readULEB();
+    YamlBB.Hash = Reader.readULEB();
+    YamlBB.ExecCount = Reader.readULEB();
+    YamlBB.EventCount = Reader.readULEB();
+    YamlBB.CallSites.resize(Reader.readCount());
+    for (auto &CSI : YamlBB.CallSites) {
+      CSI.Offset = Reader.readULEB();
+      CSI.DestId = Reader.readULEB();
+      CSI.EntryDiscriminator = Reader.readULEB();
+      CSI.Count = Reader.readULEB();
+      CSI.Mispreds = Reader.readULEB();
+    }
+    YamlBB.Successors.resize(Reader.readCount());
+    for (auto &SI : YamlBB.Successors) {
+      SI.Index = Reader.readULEB();
+      SI.Count = Reader.readULEB();
+      SI.Mispreds = Reader.readULEB();
+    }
+  }
+
+  if (Reader.getError() || !Reader.atEnd()) {
+    YamlBF.Blocks.clear();
+    return false;
+  }
+  return true;
+}
+
+bool ProfileReader::remapStaleProfile(
+    const BinaryFunction &BF, const std::vector<BinaryBasicBlock *> &DFSOrder,
+    const yaml::bolt::BinaryFunctionProfile &YamlBF,
+    yaml::bolt::BinaryFunctionProfile &RemappedBF) const {
+  // Hashes of profiled blocks by their index in the profile.
+  DenseMap<uint32_t, uint64_t> ProfileHashes;
+  for (const auto &YamlBB : YamlBF.Blocks) {
+    if (YamlBB.Hash)
+      ProfileHashes[YamlBB.Index] = YamlBB.Hash;
+  }
+  if (ProfileHashes.empty())
+    return false;
+
+  DenseMap<const BinaryBasicBlock *, uint32_t> BlockIndex;
+  std::vector<uint64_t> BlockHashes(DFSOrder.size());
+  DenseMap<uint64_t, std::vector<uint32_t>> HashToBlocks;
+  for (uint32_t I = 0; I < DFSOrder.size(); ++I) {
+    BlockIndex[DFSOrder[I]] = I;
+    BlockHashes[I] = BF.hashBlock(*DFSOrder[I]);
+    HashToBlocks[BlockHashes[I]].push_back(I);
+  }
+
+  // Number of successors of profiled block YamlBB with the same hashes as
+  // successors of the block at index Candidate.
+  auto countMatchingSuccessors =
+    [&](const yaml::bolt::BinaryBasicBlockProfile &YamlBB,
+        uint32_t Candidate) {
+      unsigned Count = 0;
+      for (const auto &YamlSI : YamlBB.Successors) {
+        const auto Hash = ProfileHashes.lookup(YamlSI.Index);
+        if (!Hash)
+          continue;
+        for (const auto *Succ : DFSOrder[Candidate]->successors()) {
+          auto SI = BlockIndex.find(Succ);
+          if (SI != BlockIndex.end() && BlockHashes[SI->second] == Hash) {
+            ++Count;
+            break;
+          }
+        }
+      }
+      return Count;
+    };
+
+  // Map each profiled block to a block with the same opcodes. Ties between
+  // blocks with identical code are broken by the number of matching
+  // successors, and then by the distance from the original position.
+  DenseMap<uint32_t, uint32_t> IndexMap;
+  std::vector<bool> IsMapped(DFSOrder.size());
+  for (const auto &YamlBB : YamlBF.Blocks) {
+    auto HI = HashToBlocks.find(YamlBB.Hash);
+    if (!YamlBB.Hash || HI == HashToBlocks.end())
+      continue;
+
+    Optional<uint32_t> Best;
+    unsigned BestScore = 0;
+    uint32_t BestDistance = 0;
+    for (const auto Candidate : HI->second) {
+      if (IsMapped[Candidate])
+        continue;
+      const auto Score = countMatchingSuccessors(YamlBB, Candidate);
+      const auto Distance = Candidate > YamlBB.Index
+        ? Candidate - YamlBB.Index
+        : YamlBB.Index - Candidate;
+      if (!Best || Score > BestScore ||
+          (Score == BestScore && Distance < BestDistance)) {
+        Best = Candidate;
+        BestScore = Score;
+        BestDistance = Distance;
+      }
+    }
+    if (!Best)
+      continue;
+    IsMapped[*Best] = true;
+    IndexMap[YamlBB.Index] = *Best;
+  }
+  if (IndexMap.empty())
+    return false;
+
+  // Rewrite the profile in terms of the new blocks, dropping blocks and
+  // edges that could not be mapped.
+  RemappedBF.Name = YamlBF.Name;
+  RemappedBF.Id = YamlBF.Id;
+  RemappedBF.Hash = YamlBF.Hash;
+  RemappedBF.NumBasicBlocks = DFSOrder.size();
+  RemappedBF.ExecCount = YamlBF.ExecCount;
+  RemappedBF.Blocks.clear();
+  for (const auto &YamlBB : YamlBF.Blocks) {
+    auto MI = IndexMap.find(YamlBB.Index);
+    if (MI == IndexMap.end())
+      continue;
+    RemappedBF.Blocks.push_back(YamlBB);
+    auto &RemappedBB = RemappedBF.Blocks.back();
+    RemappedBB.Index = MI->second;
+    RemappedBB.Successors.clear();
+    for (const auto &YamlSI : YamlBB.Successors) {
+      auto SMI = IndexMap.find(YamlSI.Index);
+      if (SMI == IndexMap.end())
+        continue;
+      RemappedBB.Successors.push_back(YamlSI);
+      RemappedBB.Successors.back().Index = SMI->second;
+    }
+  }
+
+  DEBUG(dbgs() << "BOLT-DEBUG: mapped " << IndexMap.size() << " out of "
+               << YamlBF.Blocks.size() << " profiled blocks of stale function "
+               << BF << '\n');
+  return true;
+}
+
 void
 ProfileReader::buildNameMaps(std::map<uint64_t, BinaryFunction> &Functions) {
   for (auto &YamlBF : YamlBP.Functions) {
@@ -72,7 +316,8 @@ ProfileReader::parseFunctionProfile(BinaryFunction &BF,
 
   BF.setExecutionCount(YamlBF.ExecCount);
 
-  if (!opts::IgnoreHash && YamlBF.Hash != BF.hash(true, true)) {
+  // The hash was computed for all functions before matching.
+  if (!opts::IgnoreHash && YamlBF.Hash != BF.hash(/*Recompute = */false)) {
     if (opts::Verbosity >= 1)
       errs() << "BOLT-WARNING: function hash mismatch\n";
     ProfileMatched = false;
@@ -86,7 +331,18 @@ ProfileReader::parseFunctionProfile(BinaryFunction &BF,
 
   auto DFSOrder = BF.dfs();
 
-  for (const auto &YamlBB : YamlBF.Blocks) {
+  // If the function changed since the profile was collected, attribute the
+  // profile of unchanged blocks.
+  const auto *Profile = &YamlBF;
+  yaml::bolt::BinaryFunctionProfile RemappedBF;
+  if (!ProfileMatched && opts::InferStaleProfile &&
+      remapStaleProfile(BF, DFSOrder, YamlBF, RemappedBF)) {
+    Profile = &RemappedBF;
+    ProfileMatched = true;
+    ++NumStaleFunctions;
+  }
+
+  for (const auto &YamlBB : Profile->Blocks) {
     if (YamlBB.Index >= DFSOrder.size()) {
       if (opts::Verbosity >= 2)
         errs() << "BOLT-WARNING: index " << YamlBB.Index
@@ -236,14 +492,24 @@ ProfileReader::readProfile(const std::string &FileName,
     errs() << "ERROR: cannot open " << FileName << ": " << EC.message() << "\n";
     return EC;
   }
-  yaml::Input YamlInput(MB.get()->getBuffer());
-
-  // Consume YAML file.
-  YamlInput >> YamlBP;
-  if (YamlInput.error()) {
-    errs() << "BOLT-ERROR: syntax error parsing profile in " << FileName
-           << " : " << YamlInput.error().message() << '\n';
-    return YamlInput.error();
+  Buffer = std::move(MB.get());
+
+  const StringRef Magic(yamlbin::BinaryProfileMagic,
+                        sizeof(yamlbin::BinaryProfileMagic));
+  if (Buffer->getBuffer().startswith(Magic)) {
+    if (auto EC = parseBinaryProfile(Buffer->getBuffer().drop_front(
+                                         Magic.size())))
+      return EC;
+  } else {
+    yaml::Input YamlInput(Buffer->getBuffer());
+
+    // Consume YAML file.
+    YamlInput >> YamlBP;
+    if (YamlInput.error()) {
+      errs() << "BOLT-ERROR: syntax error parsing profile in " << FileName
+             << " : " << YamlInput.error().message() << '\n';
+      return YamlInput.error();
+    }
   }
 
   // Sanity check.
@@ -276,13 +542,19 @@ ProfileReader::readProfile(const std::string &FileName,
   // We have to do 2 passes since LTO introduces an ambiguity in function
   // names. The first pass assigns profiles that match 100% by name and
   // by hash. The second pass allows name ambiguity for LTO private functions.
+  // Recompute hash once per function.
+  if (!opts::IgnoreHash) {
+    ParallelUtilities::runOnEachFunction(
+        Functions, ParallelUtilities::SP_INST_LINEAR,
+        [&](BinaryFunction &Function) {
+          Function.hash(/*Recompute = */true, true);
+        },
+        ParallelUtilities::PredicateTy(), "hashFunctions");
+  }
+
   for (auto &BFI : Functions) {
     auto &Function = BFI.second;
 
-    // Recompute hash once per function.
-    if (!opts::IgnoreHash)
-      Function.hash(/*Recompute = */true, true);
-
     for (auto &FunctionName : Function.getNames()) {
       auto PI = ProfileNameToProfile.find(FunctionName);
       if (PI == ProfileNameToProfile.end()) {
@@ -341,6 +613,31 @@ ProfileReader::readProfile(const std::string &FileName,
       }
     }
   }
+  // Profiles of functions that were renamed since the profile was collected
+  // can still be matched by the hash if it is unique.
+  if (opts::MatchProfileByHash && !opts::IgnoreHash) {
+    DenseMap<uint64_t, BinaryFunction *> HashToFunction;
+    DenseSet<uint64_t> AmbiguousHashes;
+    for (auto &BFI : Functions) {
+      auto &Function = BFI.second;
+      if (ProfiledFunctions.count(&Function))
+        continue;
+      const auto Hash = Function.hash(/*Recompute = */false);
+      if (!HashToFunction.insert(std::make_pair(Hash, &Function)).second)
+        AmbiguousHashes.insert(Hash);
+    }
+    for (auto &YamlBF : YamlBP.Functions) {
+      if (YamlBF.Used || AmbiguousHashes.count(YamlBF.Hash))
+        continue;
+      auto FI = HashToFunction.find(YamlBF.Hash);
+      if (FI == HashToFunction.end() ||
+          ProfiledFunctions.count(FI->second) ||
+          FI->second->size() != YamlBF.NumBasicBlocks)
+        continue;
+      matchProfileToFunction(YamlBF, *FI->second);
+    }
+  }
+
   for (auto &YamlBF : YamlBP.Functions) {
     if (!YamlBF.Used) {
       errs() << "BOLT-WARNING: profile ignored for function "
@@ -348,17 +645,38 @@ ProfileReader::readProfile(const std::string &FileName,
     }
   }
 
+  // Profiles are attached to functions independently of each other.
+  DenseMap<const BinaryFunction *, yaml::bolt::BinaryFunctionProfile *>
+    FunctionToProfile;
   for (auto &YamlBF : YamlBP.Functions) {
     if (YamlBF.Id >= YamlProfileToFunction.size()) {
       // Such profile was ignored.
       continue;
     }
-    if (auto *BF = YamlProfileToFunction[YamlBF.Id]) {
-      parseFunctionProfile(*BF, YamlBF);
-    }
+    if (auto *BF = YamlProfileToFunction[YamlBF.Id])
+      FunctionToProfile[BF] = &YamlBF;
+  }
+
+  ParallelUtilities::runOnEachFunction(
+      Functions, ParallelUtilities::SP_BB_LINEAR,
+      [&](BinaryFunction &BF) {
+        auto &YamlBF = *FunctionToProfile.lookup(&BF);
+        if (!YamlBF.EncodedBlocks.empty() && !decodeBlocks(YamlBF)) {
+          errs() << "BOLT-WARNING: malformed profile ignored for function "
+                 << YamlBF.Name << '\n';
+          return;
+        }
+        parseFunctionProfile(BF, YamlBF);
+      },
+      [&](const BinaryFunction &BF) { return !FunctionToProfile.count(&BF); },
+      "parseFunctionProfile");
+
+  if (NumStaleFunctions) {
+    outs() << "BOLT-INFO: inferred profile for " << NumStaleFunctions
+           << " stale functions\n";
   }
 
-  return YamlInput.error();
+  return std::error_code();
 }
 
 bool ProfileReader::usesEvent(StringRef Name) const {
@@ -14,6 +14,9 @@
 
 #include "BinaryFunction.h"
 #include "ProfileYAMLMapping.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <atomic>
+#include <memory>
 #include <unordered_set>
 
 namespace llvm {
@@ -29,6 +32,10 @@ private:
   /// Binary profile in YAML format.
   yaml::bolt::BinaryProfile YamlBP;
 
+  /// Contents of the profile file. Blocks of profiles in the binary encoding
+  /// reference it until they are decoded.
+  std::unique_ptr<MemoryBuffer> Buffer;
+
   /// Map a function ID from a YAML profile to a BinaryFunction object.
   std::vector<BinaryFunction *> YamlProfileToFunction;
 
@@ -36,6 +43,27 @@ private:
   /// is attributed.
   std::unordered_set<const BinaryFunction *> ProfiledFunctions;
 
+  /// Read the header and function descriptions of a profile in the binary
+  /// encoding from \p Data into YamlBP. Blocks of functions are left encoded.
+  std::error_code parseBinaryProfile(StringRef Data);
+
+  /// Decode blocks of \p YamlBF read from a profile in the binary encoding.
+  /// Return false if they are malformed.
+  bool decodeBlocks(yaml::bolt::BinaryFunctionProfile &YamlBF);
+
+  /// Number of functions with a profile attributed after matching their
+  /// blocks with remapStaleProfile().
+  std::atomic<uint64_t> NumStaleFunctions{0};
+
+  /// Map profiled blocks of \p YamlBF collected for an older version of
+  /// \p BF to its current blocks in \p DFSOrder, matching them by hashes of
+  /// their opcodes and of their successors. Store the profile of blocks that
+  /// were mapped in \p RemappedBF. Return false if no block could be mapped.
+  bool remapStaleProfile(const BinaryFunction &BF,
+                         const std::vector<BinaryBasicBlock *> &DFSOrder,
+                         const yaml::bolt::BinaryFunctionProfile &YamlBF,
+                         yaml::bolt::BinaryFunctionProfile &RemappedBF) const;
+
   /// Populate \p Function profile with the one supplied in YAML format.
   bool parseFunctionProfile(BinaryFunction &Function,
                             const yaml::bolt::BinaryFunctionProfile &YamlBF);
@@ -0,0 +1,210 @@
+//===--- ProfileVariants.cpp - Layouts for the profiles of many workloads -===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "ProfileVariants.h"
+#include "CacheMetrics.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Options.h"
+#include <cmath>
+#include <unordered_map>
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+cl::opt<bolt::ProfileVariantsObjective>
+ProfileVariantsObjective("profile-variants-objective",
+  cl::desc("how layouts are chosen for the profiles given with "
+           "-profile-variants:"),
+  cl::init(PVO_MEAN),
+  cl::values(clEnumValN(PVO_MEAN,
+      "mean",
+      "best weighted mean of the ExtTSP scores, relative to the best layout "
+      "for each profile"),
+    clEnumValN(PVO_WORST,
+      "worst",
+      "best weighted worst case of the ExtTSP scores, relative to the best "
+      "layout for each profile")),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+}
+
+namespace llvm {
+namespace bolt {
+
+VariantCounts::VariantCounts(BinaryFunction &BF, unsigned Variant) : BF(BF) {
+  const auto &BC = BF.getBinaryContext();
+  const auto &Variants = BC.ProfileVariants;
+
+  double TotalWeight = 0.0;
+  for (const auto &V : Variants) {
+    if (V.TotalBlockCount)
+      TotalWeight += V.Weight;
+  }
+
+  // The mean is taken over the counts of the variants normalized to the
+  // total count of the profile, so that thresholds on counts keep working.
+  auto getCount = [&](const BinaryBasicBlock &BB, const BinaryBasicBlock *Succ,
+                      uint64_t Count) -> uint64_t {
+    if (Variant != Mean)
+      return BF.getVariantCount(Variant, BB, Succ, Count);
+    if (TotalWeight == 0.0)
+      return 0;
+    double Sum = 0.0;
+    for (unsigned I = 0; I < Variants.size(); ++I) {
+      if (!Variants[I].TotalBlockCount)
+        continue;
+      Sum += Variants[I].Weight * BF.getVariantCount(I, BB, Succ, Count) *
+             BC.TotalBlockCount / Variants[I].TotalBlockCount;
+    }
+    return std::llround(Sum / TotalWeight);
+  };
+
+  SavedExecutionCount = BF.getExecutionCount();
+  uint64_t ExecutionCount = 0;
+  for (auto &BB : BF) {
+    const auto BBCount = BB.getExecutionCount();
+    SavedCounts.push_back(BBCount);
+    BB.setExecutionCount(getCount(BB, nullptr, BBCount));
+    if (BB.isEntryPoint())
+      ExecutionCount += BB.getExecutionCount();
+
+    auto BI = BB.branch_info_begin();
+    for (const auto *Succ : BB.successors()) {
+      SavedCounts.push_back(BI->Count);
+      BI->Count = getCount(BB, Succ, BI->Count);
+      ++BI;
+    }
+  }
+  if (SavedExecutionCount != BinaryFunction::COUNT_NO_PROFILE)
+    BF.setExecutionCount(ExecutionCount);
+}
+
+VariantCounts::~VariantCounts() {
+  auto Count = SavedCounts.begin();
+  for (auto &BB : BF) {
+    BB.setExecutionCount(*Count++);
+    for (auto &BI : BB.branch_info())
+      BI.Count = *Count++;
+  }
+  BF.setExecutionCount(SavedExecutionCount);
+}
+
+unsigned ProfileVariants::getNumCandidates(const BinaryContext &BC) {
+  return BC.ProfileVariants.size() + 2;
+}
+
+std::unique_ptr<VariantCounts>
+ProfileVariants::installCandidateCounts(BinaryFunction &BF,
+                                        unsigned Candidate) {
+  if (Candidate == 0)
+    return nullptr;
+  return llvm::make_unique<VariantCounts>(
+      BF, Candidate == 1 ? VariantCounts::Mean : Candidate - 2);
+}
+
+double ProfileVariants::getLayoutScore(
+    const BinaryFunction &BF,
+    const BinaryFunction::BasicBlockOrderType &Layout) {
+  std::unordered_map<const BinaryBasicBlock *, uint64_t> Address;
+  uint64_t CurAddress = 0;
+  for (const auto *BB : Layout) {
+    Address[BB] = CurAddress;
+    CurAddress += std::max(BB->estimateSize(), uint64_t(1));
+  }
+
+  double Score = 0.0;
+  for (const auto *BB : Layout) {
+    const auto Size = std::max(BB->estimateSize(), uint64_t(1));
+    auto BI = BB->branch_info_begin();
+    for (const auto *Succ : BB->successors()) {
+      const auto Count = BI->Count;
+      ++BI;
+      if (Succ == BB || !Count || Count == BinaryBasicBlock::COUNT_NO_PROFILE)
+        continue;
+      auto AI = Address.find(Succ);
+      if (AI == Address.end())
+        continue;
+      Score += CacheMetrics::extTSPScore(Address[BB], Size, AI->second, Count);
+    }
+  }
+  return Score;
+}
+
+unsigned ProfileVariants::chooseCandidate(
+    const BinaryContext &BC,
+    const std::vector<std::vector<double>> &Scores) {
+  const auto &Variants = BC.ProfileVariants;
+  std::vector<double> BestScores(Variants.size(), 0.0);
+  for (const auto &CandidateScores : Scores) {
+    for (unsigned V = 0; V < Variants.size(); ++V)
+      BestScores[V] = std::max(BestScores[V], CandidateScores[V]);
+  }
+
+  // The worst case is the largest weighted loss against the best layout for
+  // a variant, the mean is the weighted mean of the relative scores.
+  unsigned BestCandidate = 0;
+  double BestValue = 0.0;
+  for (unsigned C = 0; C < Scores.size(); ++C) {
+    double Value = 0.0;
+    double TotalWeight = 0.0;
+    for (unsigned V = 0; V < Variants.size(); ++V) {
+      const auto Ratio =
+        BestScores[V] > 0.0 ? Scores[C][V] / BestScores[V] : 1.0;
+      if (opts::ProfileVariantsObjective == PVO_WORST) {
+        Value = std::min(Value, -Variants[V].Weight * (1.0 - Ratio));
+      } else {
+        Value += Variants[V].Weight * Ratio;
+        TotalWeight += Variants[V].Weight;
+      }
+    }
+    if (TotalWeight > 0.0)
+      Value /= TotalWeight;
+
+    // Ties keep the earlier candidate, preferring the profile.
+    if (C == 0 || Value > BestValue) {
+      BestCandidate = C;
+      BestValue = Value;
+    }
+  }
+
+  return BestCandidate;
+}
+
+void ProfileVariants::printCandidates(
+    const BinaryContext &BC, StringRef What,
+    const std::vector<std::vector<double>> &Scores,
+    const std::vector<uint64_t> &NumChosen) {
+  outs() << "BOLT-INFO: ExtTSP scores of the candidate " << What
+         << " for -profile-variants:\n";
+  for (unsigned C = 0; C < Scores.size(); ++C) {
+    outs() << "BOLT-INFO:   layout for ";
+    if (C == 0)
+      outs() << "the profile";
+    else if (C == 1)
+      outs() << "the weighted mean";
+    else
+      outs() << BC.ProfileVariants[C - 2].Name;
+    outs() << " (kept " << NumChosen[C] << " times):";
+    for (unsigned V = 0; V < BC.ProfileVariants.size(); ++V) {
+      outs() << ' ' << BC.ProfileVariants[V].Name << " = "
+             << format("%.0lf", Scores[C][V]);
+    }
+    outs() << '\n';
+  }
+}
+
+} // namespace bolt
+} // namespace llvm
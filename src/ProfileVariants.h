@@ -0,0 +1,90 @@
+//===--- ProfileVariants.h - Layouts for the profiles of many workloads ---===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// With -profile-variants, the profiles of several workloads are attached to
+// the functions besides the profile used for the optimizations, see
+// BinaryFunction::VariantProfile. Layout passes compute a candidate layout
+// with the counts of the profile, of the weighted mean of the workloads, and
+// of each workload. Every candidate is scored with the ExtTSP metric under
+// every workload, and the candidate with the best weighted mean or weighted
+// worst case of the scores, relative to the best score for each workload, is
+// kept. This avoids layouts that help one workload at the expense of another.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PROFILE_VARIANTS_H
+#define LLVM_TOOLS_LLVM_BOLT_PROFILE_VARIANTS_H
+
+#include "BinaryFunction.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+/// How layouts are chosen among the candidates.
+enum ProfileVariantsObjective : char {
+  PVO_MEAN = 0,  /// Best weighted mean of the relative scores.
+  PVO_WORST,     /// Best weighted worst case of the relative scores.
+};
+
+/// Replaces the block and edge counts of a function, and its execution
+/// count, with the counts of a profile variant, or with the weighted mean of
+/// the counts of all variants scaled to the profile. The original counts are
+/// restored on destruction.
+class VariantCounts {
+  BinaryFunction &BF;
+  uint64_t SavedExecutionCount;
+  std::vector<uint64_t> SavedCounts;
+
+public:
+  /// Index of the weighted mean of all variants.
+  static constexpr unsigned Mean = -1U;
+
+  VariantCounts(BinaryFunction &BF, unsigned Variant);
+  ~VariantCounts();
+};
+
+namespace ProfileVariants {
+
+/// Return the number of candidate layouts. Candidate 0 is computed with the
+/// profile, candidate 1 with the weighted mean of the variants, and
+/// candidate I + 2 with variant I.
+unsigned getNumCandidates(const BinaryContext &BC);
+
+/// Install the counts candidate \p Candidate is computed with in \p BF.
+/// Return nullptr if the counts of the profile are used.
+std::unique_ptr<VariantCounts> installCandidateCounts(BinaryFunction &BF,
+                                                      unsigned Candidate);
+
+/// Return the ExtTSP score of \p Layout of the blocks of \p BF with the
+/// current counts, with the addresses of the blocks estimated from their
+/// sizes.
+double getLayoutScore(const BinaryFunction &BF,
+                      const BinaryFunction::BasicBlockOrderType &Layout);
+
+/// Return the candidate to keep according to -profile-variants-objective,
+/// given the score of each candidate under each variant in
+/// Scores[Candidate][Variant].
+unsigned chooseCandidate(const BinaryContext &BC,
+                         const std::vector<std::vector<double>> &Scores);
+
+/// Print the scores of the candidate layouts of \p What under each variant,
+/// summed over the functions, and how many times each candidate was kept.
+void printCandidates(const BinaryContext &BC, StringRef What,
+                     const std::vector<std::vector<double>> &Scores,
+                     const std::vector<uint64_t> &NumChosen);
+
+} // namespace ProfileVariants
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -18,12 +18,29 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/LEB128.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-prof"
 
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOutputCategory;
+
+static cl::opt<bool>
+BinaryProfileOutput("w-binary",
+  cl::desc("save the profile requested with -w in the compact binary "
+           "encoding instead of YAML"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOutputCategory));
+
+}
+
 namespace llvm {
 namespace bolt {
 
@@ -51,6 +68,7 @@ convert(const BinaryFunction &BF, yaml::bolt::BinaryFunctionProfile &YamlBF) {
     yaml::bolt::BinaryBasicBlockProfile YamlBB;
     YamlBB.Index = BB->getLayoutIndex();
     YamlBB.NumInstructions = BB->getNumNonPseudos();
+    YamlBB.Hash = BF.hashBlock(*BB);
 
     if (!LBRProfile) {
       YamlBB.EventCount =
@@ -152,6 +170,67 @@ convert(const BinaryFunction &BF, yaml::bolt::BinaryFunctionProfile &YamlBF) {
     YamlBF.Blocks.emplace_back(YamlBB);
   }
 }
+
+void writeString(raw_ostream &OS, StringRef Str) {
+  encodeULEB128(Str.size(), OS);
+  OS << Str;
+}
+
+/// Encode blocks of \p YamlBF in the binary profile format.
+void writeBlocks(raw_ostream &OS,
+                 const yaml::bolt::BinaryFunctionProfile &YamlBF) {
+  encodeULEB128(YamlBF.Blocks.size(), OS);
+  for (const auto &YamlBB : YamlBF.Blocks) {
+    encodeULEB128(YamlBB.Index, OS);
+    encodeULEB128(YamlBB.NumInstructions, OS);
+    encodeULEB128(YamlBB.Hash, OS);
+    encodeULEB128(YamlBB.ExecCount, OS);
+    encodeULEB128(YamlBB.EventCount, OS);
+    encodeULEB128(YamlBB.CallSites.size(), OS);
+    for (const auto &CSI : YamlBB.CallSites) {
+      encodeULEB128(CSI.Offset, OS);
+      encodeULEB128(CSI.DestId, OS);
+      encodeULEB128(CSI.EntryDiscriminator, OS);
+      encodeULEB128(CSI.Count, OS);
+      encodeULEB128(CSI.Mispreds, OS);
+    }
+    encodeULEB128(YamlBB.Successors.size(), OS);
+    for (const auto &SI : YamlBB.Successors) {
+      encodeULEB128(SI.Index, OS);
+      encodeULEB128(SI.Count, OS);
+      encodeULEB128(SI.Mispreds, OS);
+    }
+  }
+}
+
+/// Write \p BP to \p OS in the binary profile format described in
+/// ProfileYAMLMapping.h.
+void writeBinaryProfile(raw_ostream &OS,
+                        const yaml::bolt::BinaryProfile &BP) {
+  OS.write(yamlbin::BinaryProfileMagic, sizeof(yamlbin::BinaryProfileMagic));
+  encodeULEB128(BP.Header.Version, OS);
+  encodeULEB128(static_cast<uint16_t>(BP.Header.Flags), OS);
+  writeString(OS, BP.Header.FileName);
+  writeString(OS, BP.Header.Id);
+  writeString(OS, BP.Header.Origin);
+  writeString(OS, BP.Header.EventNames);
+
+  encodeULEB128(BP.Functions.size(), OS);
+  std::string Blocks;
+  for (const auto &YamlBF : BP.Functions) {
+    writeString(OS, YamlBF.Name);
+    encodeULEB128(YamlBF.Id, OS);
+    encodeULEB128(YamlBF.Hash, OS);
+    encodeULEB128(YamlBF.NumBasicBlocks, OS);
+    encodeULEB128(YamlBF.ExecCount, OS);
+
+    Blocks.clear();
+    raw_string_ostream BlocksOS(Blocks);
+    writeBlocks(BlocksOS, YamlBF);
+    writeString(OS, BlocksOS.str());
+  }
+}
+
 } // end anonymous namespace
 
 std::error_code
@@ -222,8 +301,12 @@ ProfileWriter::writeProfile(const RewriteInstance &RI) {
   }
 
   // Write the profile.
-  yaml::Output Out(*OS, nullptr, 0);
-  Out << BP;
+  if (opts::BinaryProfileOutput) {
+    writeBinaryProfile(*OS, BP);
+  } else {
+    yaml::Output Out(*OS, nullptr, 0);
+    Out << BP;
+  }
 
   return std::error_code();
 }
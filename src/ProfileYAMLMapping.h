@@ -112,6 +112,7 @@ template <> struct MappingTraits<bolt::BinaryBasicBlockProfile> {
   static void mapping(IO &YamlIO, bolt::BinaryBasicBlockProfile &BBP) {
     YamlIO.mapRequired("bid", BBP.Index);
     YamlIO.mapRequired("insns", BBP.NumInstructions);
+    YamlIO.mapOptional("hash", BBP.Hash, (llvm::yaml::Hex64)0);
     YamlIO.mapOptional("exec", BBP.ExecCount, (uint64_t)0);
     YamlIO.mapOptional("events", BBP.EventCount, (uint64_t)0);
     YamlIO.mapOptional("calls", BBP.CallSites,
@@ -138,6 +139,9 @@ struct BinaryFunctionProfile {
   uint64_t ExecCount{0};
   std::vector<BinaryBasicBlockProfile> Blocks;
   bool Used{false};
+
+  /// Blocks in the binary profile encoding that have not been decoded yet.
+  StringRef EncodedBlocks;
 };
 } // end namespace bolt
 
@@ -210,6 +214,35 @@ template <> struct MappingTraits<bolt::BinaryProfile> {
 };
 
 } // end namespace yaml
+
+namespace bolt {
+
+/// Binary encoding of the profile.
+///
+/// Holds the same data as the YAML representation with all integers encoded
+/// as ULEB128 and strings stored as a ULEB128 size followed by the bytes.
+/// Blocks of every function are prefixed with their size in bytes, so that
+/// they are only decoded for functions matched to the binary. The layout of
+/// the file is:
+///
+///   char     Magic[8]
+///   Version, Flags, FileName, Id, Origin, EventNames
+///   NumFunctions
+///   Functions[NumFunctions]:
+///     Name, Id, Hash, NumBasicBlocks, ExecCount, BlocksSize
+///     Blocks[BlocksSize bytes]:
+///       NumBlocks
+///       Index, NumInstructions, Hash, ExecCount, EventCount
+///       NumCallSites
+///         Offset, DestId, EntryDiscriminator, Count, Mispreds
+///       NumSuccessors
+///         Index, Count, Mispreds
+namespace yamlbin {
+
+const char BinaryProfileMagic[8] = {'B', 'O', 'L', 'T', 'Y', 'B', 'I', 'N'};
+
+} // end namespace yamlbin
+} // end namespace bolt
 } // end namespace llvm
 
 
@@ -229,6 +229,18 @@ bool Relocation::isTLS(uint64_t Type) {
   }
 }
 
+bool Relocation::isRelative(uint64_t Type) {
+  switch (Type) {
+  default:
+    return false;
+  case ELF::R_X86_64_RELATIVE:
+  case ELF::R_X86_64_IRELATIVE:
+  case ELF::R_AARCH64_RELATIVE:
+  case ELF::R_AARCH64_IRELATIVE:
+    return true;
+  }
+}
+
 bool Relocation::isPCRelative(uint64_t Type) {
   switch (Type) {
   default:
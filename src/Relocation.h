@@ -64,6 +64,11 @@ struct Relocation {
   /// Return true if relocation type is for thread local storage.
   static bool isTLS(uint64_t Type);
 
+  /// Return true if \p Type is a dynamic relocation that sets the location
+  /// to the load base plus the addend, or the result of calling an ifunc
+  /// resolver at that address.
+  static bool isRelative(uint64_t Type);
+
   /// Return true if this relocation is PC-relative. Return false otherwise.
   bool isPCRelative() const {
     return isPCRelative(Type);
@@ -14,11 +14,14 @@
 #include "BinaryContext.h"
 #include "BinaryFunction.h"
 #include "BinaryPassManager.h"
+#include "BoltAddressTranslation.h"
 #include "CacheMetrics.h"
 #include "DataAggregator.h"
 #include "DataReader.h"
 #include "Exceptions.h"
 #include "MCPlusBuilder.h"
+#include "ParallelUtilities.h"
+#include "PhaseStats.h"
 #include "ProfileReader.h"
 #include "ProfileWriter.h"
 #include "RewriteInstance.h"
@@ -53,10 +56,13 @@
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/Errc.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
@@ -66,6 +72,11 @@
 #include <stack>
 #include <system_error>
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt"
 
@@ -82,8 +93,12 @@ extern cl::OptionCategory BoltOutputCategory;
 extern cl::OptionCategory AggregatorCategory;
 
 extern cl::opt<MacroFusionType> AlignMacroOpFusion;
+extern cl::opt<bool> Instrument;
+extern cl::opt<std::string> InstrumentationFile;
 extern cl::opt<JumpTableSupportLevel> JumpTables;
+extern cl::opt<std::string> ReorderBlocksCache;
 extern cl::list<std::string> ReorderData;
+extern cl::opt<bool> TimeBuild;
 
 static cl::opt<bool>
 ForceToDataRelocations("force-data-relocations",
@@ -110,6 +125,13 @@ PrintCacheMetrics("print-cache-metrics",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<std::string>
+HotTextReport("hot-text-report",
+  cl::desc("write the number of bytes of code, constant islands and padding "
+           "in every 4KB and 2MB page of hot text to a file (relocation mode)"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOutputCategory));
+
 cl::opt<std::string>
 OutputFilename("o",
   cl::desc("<output file>"),
@@ -149,6 +171,15 @@ DumpEHFrame("dump-eh-frame",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+EnableBAT("enable-bat",
+  cl::desc("write a table translating addresses in the output binary to "
+           "the input, so that profiles of the output can be used by "
+           "perf2bolt"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<bool>
 FixDebugInfoLargeFunctions("fix-debuginfo-large-functions",
   cl::init(true),
@@ -186,6 +217,23 @@ HotText("hot-text",
   cl::ZeroOrMore,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+SeparateHotText("separate-hot-text",
+  cl::desc("place hot code into a separate segment aligned and padded at "
+           "2MB boundaries so that it can be backed by huge pages, and the "
+           "rest of the new code and data into a segment after it "
+           "(relocation mode)"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+static cl::opt<bool>
+Hugify("hugify",
+  cl::desc("add a startup stub that remaps the hot text onto anonymous memory "
+           "backed by transparent huge pages before running the original "
+           "entry point (implies -separate-hot-text)"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<bool>
 HotData("hot-data",
   cl::desc("hot data symbols support (relocation mode)"),
@@ -199,12 +247,28 @@ UpdateEnd("update-end",
   cl::ZeroOrMore,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+ReleaseFunctionState("release-function-state",
+  cl::desc("release instructions, CFG edges and profile of functions once "
+           "they are emitted to reduce memory usage"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<bool>
 KeepTmp("keep-tmp",
   cl::desc("preserve intermediate .o file"),
   cl::Hidden,
   cl::cat(BoltCategory));
 
+cl::opt<bool>
+Lite("lite",
+  cl::desc("only optimize functions with samples in the profile; in "
+           "non-relocation mode other functions are not disassembled"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<bool>
 MarkFuncs("mark-funcs",
   cl::desc("mark function boundaries with break instruction to make "
@@ -227,6 +291,15 @@ MaxDataRelocations("max-data-relocations",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+PatchInPlace("patch-in-place",
+  cl::desc("in relocation mode, leave functions that cannot be disassembled "
+           "and functions not executed in the profile at their original "
+           "addresses, and only patch their references to moved code and "
+           "data. The original .text then only has to keep these functions"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 cl::opt<bool>
 PrintAll("print-all",
   cl::desc("print functions after each stage"),
@@ -241,6 +314,12 @@ PrintCFG("print-cfg",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+ParallelDisassembly("parallel-disassembly",
+  cl::desc("disassemble functions and build CFG in parallel"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<bool>
 PrintDisasm("print-disasm",
   cl::desc("print function after disassembly"),
@@ -269,6 +348,15 @@ PrintLoopInfo("print-loops",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::list<std::string>
+ProfileVariants("profile-variants",
+  cl::CommaSeparated,
+  cl::desc("profiles of the workloads the binary runs, with optional weights, "
+           "to choose block and function layouts that suit all of them (see "
+           "-profile-variants-objective)"),
+  cl::value_desc("file1[:weight1],file2[:weight2],..."),
+  cl::cat(BoltCategory));
+
 static cl::opt<cl::boolOrDefault>
 RelocationMode("relocs",
   cl::desc("use relocations in the binary (default=autodetect)"),
@@ -280,6 +368,26 @@ SaveProfile("w",
   cl::desc("save recorded profile to a file"),
   cl::cat(BoltOutputCategory));
 
+static cl::opt<unsigned>
+ShardCount("shard-count",
+  cl::desc("split the optimization of functions between this many workers. "
+           "A worker only optimizes the functions of its shard and saves "
+           "their basic block layouts with -reorder-blocks-cache, without "
+           "writing a binary. A final run reuses the layouts from the "
+           "concatenated cache files of all workers"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
+static cl::opt<unsigned>
+ShardIndex("shard-index",
+  cl::desc("index of the shard optimized by this worker"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 static cl::list<std::string>
 SkipFunctionNames("skip-funcs",
   cl::CommaSeparated,
@@ -294,6 +402,14 @@ SkipFunctionNamesFile("skip-funcs-file",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+SortJumpTables("sort-jump-tables",
+  cl::desc("in relocation mode, emit the jump tables after all the functions "
+           "ordered by their execution count instead of with their function"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<BinaryFunction::SplittingType>
 SplitFunctions("split-functions",
   cl::desc("split functions into hot and cold regions"),
@@ -315,6 +431,16 @@ TrapOldCode("trap-old-code",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+cl::opt<bool>
+UpdateDebugLineRows("update-debug-line-rows",
+  cl::desc("with -update-debug-sections, translate the rows of the input line "
+           "tables to the output addresses of basic blocks instead of "
+           "attaching line info to every instruction. Faster, but rows in "
+           "blocks with modified instructions can be off"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 cl::opt<bool>
 UpdateDebugSections("update-debug-sections",
   cl::desc("update DWARF debug sections of the executable"),
@@ -387,6 +513,12 @@ bool shouldProcess(const BinaryFunction &Function) {
       return false;
   }
 
+  // Functions are numbered in the order of the symbol table, which is the
+  // same for all workers.
+  if (opts::ShardCount &&
+      Function.getFunctionNumber() % opts::ShardCount != opts::ShardIndex)
+    return false;
+
   auto populateFunctionNames = [](cl::opt<std::string> &FunctionNamesFile,
                                   cl::list<std::string> &FunctionNames) {
     assert(!FunctionNamesFile.empty() && "unexpected empty file name");
@@ -532,6 +664,34 @@ bool refersToReorderedSection(ErrorOr<BinarySection &> Section) {
   return Itr != opts::ReorderData.end();
 }
 
+/// Copy \p Size bytes at \p Offset of the file \p InputFilename into the
+/// file descriptor \p OutFD starting at its current position. Where
+/// supported, the kernel copies the data directly (sharing extents on
+/// reflink-capable file systems) without passing it through user-space
+/// buffers, so the pages of the mapped input are never touched. Return the
+/// number of bytes copied, which is less than \p Size if the fast path is not
+/// available. The file position of \p OutFD is advanced past the copied data.
+uint64_t copyFileRange(StringRef InputFilename, int OutFD, uint64_t Offset,
+                       uint64_t Size) {
+  uint64_t Copied = 0;
+#if defined(__linux__) && defined(SYS_copy_file_range)
+  int InFD;
+  if (sys::fs::openFileForRead(InputFilename, InFD))
+    return 0;
+
+  loff_t InOffset = Offset;
+  while (Copied < Size) {
+    const auto Res = syscall(SYS_copy_file_range, InFD, &InOffset, OutFD,
+                             nullptr, Size - Copied, 0u);
+    if (Res <= 0)
+      break;
+    Copied += Res;
+  }
+  ::close(InFD);
+#endif
+  return Copied;
+}
+
 }
 
 uint8_t *ExecutableFileMemoryManager::allocateSection(intptr_t Size,
@@ -776,6 +936,13 @@ void RewriteInstance::reset() {
   EFMM.reset();
   Out.reset(nullptr);
   EHFrame = nullptr;
+  HotTextEndSymbol = nullptr;
+  HotTextEndAddress = 0;
+  HotTextStartSymbol = nullptr;
+  HugifyStubSymbol = nullptr;
+  HugifyStubAddress = 0;
+  InstrStubSymbol = nullptr;
+  InstrStubAddress = 0;
   FailedAddresses.clear();
   RangesSectionsWriter.reset();
   LocationListWriter.reset();
@@ -799,6 +966,13 @@ void RewriteInstance::discoverStorage() {
   auto Obj = ELF64LEFile->getELFFile();
 
   EntryPoint = Obj->getHeader()->e_entry;
+  BC->ProgramEntryAddress = EntryPoint;
+
+  BC->HasFixedLoadAddress = Obj->getHeader()->e_type != ELF::ET_DYN;
+  if (!BC->HasFixedLoadAddress) {
+    outs() << "BOLT-INFO: shared object or position-independent executable "
+              "detected\n";
+  }
 
   // This is where the first segment and ELF header were allocated.
   uint64_t FirstAllocAddress = std::numeric_limits<uint64_t>::max();
@@ -961,12 +1135,15 @@ void RewriteInstance::run() {
     readSpecialSections();
     adjustCommandLineOptions();
     discoverFileObjects();
+    readDynamicRelocations();
     readDebugInfo();
     disassembleFunctions();
     processProfileData();
     if (opts::AggregateOnly)
       return;
     postProcessFunctions();
+    if (opts::PatchInPlace)
+      markColdFunctionsInPlace();
     for (uint64_t Address : NonSimpleFunctions) {
       auto FI = BinaryFunctions.find(Address);
       assert(FI != BinaryFunctions.end() && "bad non-simple function address");
@@ -975,6 +1152,8 @@ void RewriteInstance::run() {
     if (opts::DiffOnly)
       return;
     runOptimizationPasses();
+    if (opts::ShardCount)
+      return;
     emitFunctions();
   };
 
@@ -997,6 +1176,13 @@ void RewriteInstance::run() {
   if (opts::AggregateOnly || opts::DiffOnly)
     return;
 
+  if (opts::ShardCount) {
+    outs() << "BOLT-INFO: optimized shard " << opts::ShardIndex << " of "
+           << opts::ShardCount << ", block layouts were saved to "
+           << opts::ReorderBlocksCache << '\n';
+    return;
+  }
+
   if (opts::SplitFunctions == BinaryFunction::ST_LARGE &&
       checkLargeFunctions()) {
     ++PassNumber;
@@ -1023,12 +1209,20 @@ void RewriteInstance::run() {
 
   addBoltInfoSection();
 
+  addBATSection();
+
   // Copy allocatable part of the input.
-  std::error_code EC;
-  Out = llvm::make_unique<ToolOutputFile>(opts::OutputFilename, EC,
-                                          sys::fs::F_None, 0777);
+  auto EC = sys::fs::openFileForWrite(opts::OutputFilename, OutFD,
+                                      sys::fs::F_None, 0777);
   check_error(EC, "cannot create output executable file");
-  Out->os() << InputFile->getData().substr(0, FirstNonAllocatableOffset);
+  const auto CopiedSize = copyFileRange(InputFile->getFileName(), OutFD, 0,
+                                        FirstNonAllocatableOffset);
+  DEBUG(dbgs() << "BOLT-DEBUG: copied 0x" << Twine::utohexstr(CopiedSize)
+               << " bytes of the input file in kernel\n");
+  Out = llvm::make_unique<ToolOutputFile>(opts::OutputFilename, OutFD);
+  Out->os() << InputFile->getData().substr(CopiedSize,
+                                           FirstNonAllocatableOffset -
+                                             CopiedSize);
 
   // Rewrite allocatable contents and copy non-allocatable parts with mods.
   rewriteFile();
@@ -1037,9 +1231,11 @@ void RewriteInstance::run() {
 void RewriteInstance::discoverFileObjects() {
   NamedRegionTimer T("discoverFileObjects", "discover file objects",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
+  PhaseStats::Scope Stats("discoverFileObjects");
 
   FileSymRefs.clear();
   BinaryFunctions.clear();
+  BC->clearFunctionIndex();
   BC->clearBinaryData();
 
   // For local symbols we want to keep track of associated FILE symbol name for
@@ -1085,20 +1281,33 @@ void RewriteInstance::discoverFileObjects() {
     }
   }
 
-  // Sort symbols in the file by value.
-  std::vector<SymbolRef> SortedFileSymbols(InputFile->symbol_begin(),
-                                           InputFile->symbol_end());
-  std::stable_sort(SortedFileSymbols.begin(), SortedFileSymbols.end(),
-                   [](const SymbolRef &A, const SymbolRef &B) {
+  // Sort symbols in the file by value. Decode the sort keys once, as looking
+  // up address and type of an ELF symbol is not free and the comparator is
+  // invoked O(N log N) times.
+  struct SymbolSortKey {
+    uint64_t Address;
+    bool IsFunction;
+    SymbolRef Symbol;
+  };
+  std::vector<SymbolSortKey> SymbolKeys;
+  for (const auto &Symbol : InputFile->symbols()) {
+    SymbolKeys.push_back({cantFail(Symbol.getAddress()),
+                          cantFail(Symbol.getType()) == SymbolRef::ST_Function,
+                          Symbol});
+  }
+  std::stable_sort(SymbolKeys.begin(), SymbolKeys.end(),
+                   [](const SymbolSortKey &A, const SymbolSortKey &B) {
                      // FUNC symbols have higher precedence.
-                     auto AddressA = cantFail(A.getAddress());
-                     auto AddressB = cantFail(B.getAddress());
-                     if (AddressA == AddressB) {
-                       return cantFail(A.getType()) == SymbolRef::ST_Function &&
-                              cantFail(B.getType()) != SymbolRef::ST_Function;
-                     }
-                     return AddressA < AddressB;
+                     if (A.Address == B.Address)
+                       return A.IsFunction && !B.IsFunction;
+                     return A.Address < B.Address;
                    });
+  std::vector<SymbolRef> SortedFileSymbols;
+  SortedFileSymbols.reserve(SymbolKeys.size());
+  for (const auto &Key : SymbolKeys)
+    SortedFileSymbols.push_back(Key.Symbol);
+  SymbolKeys.clear();
+  SymbolKeys.shrink_to_fit();
 
   // For aarch64, the ABI defines mapping symbols so we identify data in the
   // code section (see IHI0056B). $d identifies data contents.
@@ -1431,6 +1640,10 @@ void RewriteInstance::discoverFileObjects() {
   // Now that all the functions were created - adjust their boundaries.
   adjustFunctionBoundaries();
 
+  // Containing-address lookups for markers and relocations below, and for
+  // profile data later on, go through the index.
+  BC->buildFunctionIndex(BinaryFunctions);
+
   // Annotate functions with code/data markers in AArch64
   for (auto ISym = MarkersBegin; ISym != SortedFileSymbols.end(); ++ISym) {
     const auto &Symbol = *ISym;
@@ -1679,6 +1892,7 @@ BinaryFunction *RewriteInstance::createBinaryFunction(
   auto Result = BinaryFunctions.emplace(
       Address, BinaryFunction(Name, Section, Address, Size, *BC, IsSimple));
   assert(Result.second == true && "unexpected duplicate function");
+  BC->clearFunctionIndex();
   auto *BF = &Result.first->second;
   BC->registerNameAtAddress(Name,
                             Address,
@@ -1726,6 +1940,7 @@ void RewriteInstance::readSpecialSections() {
   GOTPLTSection = BC->getUniqueSectionByName(".got.plt");
   PLTGOTSection = BC->getUniqueSectionByName(".plt.got");
   RelaPLTSection = BC->getUniqueSectionByName(".rela.plt");
+  RelaDynSection = BC->getUniqueSectionByName(".rela.dyn");
 
   if (opts::PrintSections) {
     outs() << "BOLT-INFO: Sections from original binary:\n";
@@ -1783,6 +1998,59 @@ void RewriteInstance::adjustCommandLineOptions() {
               "was specified\n";
     opts::AlignMacroOpFusion = MFT_ALL;
   }
+
+  if (opts::ShardCount) {
+    if (opts::ShardIndex >= opts::ShardCount) {
+      errs() << "BOLT-ERROR: -shard-index must be less than -shard-count\n";
+      exit(1);
+    }
+    if (opts::ReorderBlocksCache.empty()) {
+      errs() << "BOLT-ERROR: -shard-count requires -reorder-blocks-cache to "
+                "save the results of the shard\n";
+      exit(1);
+    }
+  }
+
+  if (opts::Hugify && opts::Instrument) {
+    errs() << "BOLT-WARNING: -hugify is not supported with -instrument\n";
+    opts::Hugify = false;
+  }
+
+  if (opts::Hugify)
+    opts::SeparateHotText = true;
+
+  if (opts::SeparateHotText && (!BC->HasRelocations || !BC->isX86())) {
+    errs() << "BOLT-WARNING: -separate-hot-text is only supported for x86 in "
+              "relocation mode\n";
+    opts::SeparateHotText = false;
+  }
+  if (opts::SeparateHotText && opts::UseGnuStack) {
+    errs() << "BOLT-WARNING: cannot create separate hot text segment with "
+              "-use-gnu-stack\n";
+    opts::SeparateHotText = false;
+  }
+  if (opts::Hugify && !opts::SeparateHotText) {
+    errs() << "BOLT-WARNING: -hugify requires a separate hot text segment\n";
+    opts::Hugify = false;
+  }
+
+  if (opts::PatchInPlace && (!BC->HasRelocations || !BC->isX86())) {
+    errs() << "BOLT-WARNING: -patch-in-place is only supported for x86 in "
+              "relocation mode\n";
+    opts::PatchInPlace = false;
+  }
+  if (opts::PatchInPlace && opts::UseOldText) {
+    errs() << "BOLT-WARNING: -use-old-text would overwrite the functions "
+              "patched in place, disabling it\n";
+    opts::UseOldText = false;
+  }
+
+  if (opts::Lite && !DA.started() && opts::BoltProfile.empty() &&
+      BC->DR.getAllFuncsData().empty() &&
+      BC->DR.getAllFuncsSampleData().empty()) {
+    errs() << "BOLT-WARNING: -lite requires a profile\n";
+    opts::Lite = false;
+  }
 }
 
 namespace {
@@ -2369,6 +2637,34 @@ void RewriteInstance::readRelocations(const SectionRef &Section) {
   }
 }
 
+void RewriteInstance::readDynamicRelocations() {
+  if (BC->HasFixedLoadAddress || !RelaDynSection)
+    return;
+
+  // A relative relocation stores load base + addend at run time, replacing
+  // whatever the data contains. Addresses inside of functions have to
+  // become entry points, so that patchELFRelaDyn() can find them in the
+  // output.
+  uint64_t NumCodeRelocations = 0;
+  for (const auto &Rel : RelaDynSection->getSectionRef().relocations()) {
+    const auto Type = Rel.getType();
+    if (!Relocation::isRelative(Type))
+      continue;
+    const auto *RelA = cast<ELF64LEObjectFile>(InputFile)->getRela(
+        Rel.getRawDataRefImpl());
+    const uint64_t Addend = RelA->r_addend;
+    auto *Function = getBinaryFunctionContainingAddress(Addend);
+    if (!Function)
+      continue;
+    ++NumCodeRelocations;
+    if (Function->getAddress() != Addend)
+      BC->InterproceduralReferences.insert(Addend);
+  }
+
+  outs() << "BOLT-INFO: found " << NumCodeRelocations
+         << " dynamic relocations against code\n";
+}
+
 void RewriteInstance::readDebugInfo() {
   NamedRegionTimer T("readDebugInfo", "read debug info", TimerGroupName,
                      TimerGroupDesc, opts::TimeRewrite);
@@ -2382,21 +2678,24 @@ void RewriteInstance::processProfileData() {
   if (DA.started()) {
     NamedRegionTimer T("aggregate", "aggregate data", TimerGroupName,
                        TimerGroupDesc, opts::TimeRewrite);
+    PhaseStats::Scope Stats("aggregateProfile");
     DA.aggregate(*BC.get(), BinaryFunctions);
 
-    for (auto &BFI : BinaryFunctions) {
-      auto &Function = BFI.second;
-      Function.convertBranchData();
-    }
+    ParallelUtilities::runOnEachFunction(
+        BinaryFunctions, ParallelUtilities::SP_INST_LINEAR,
+        [&](BinaryFunction &Function) { Function.convertBranchData(); },
+        ParallelUtilities::PredicateTy(), "convertBranchData");
 
     if (opts::AggregateOnly) {
       if (std::error_code EC = DA.writeAggregatedFile()) {
         check_error(EC, "cannot create output data file");
       }
+      DA.watchForPerfData();
     }
   } else {
     NamedRegionTimer T("readprofile", "read profile data", TimerGroupName,
                        TimerGroupDesc, opts::TimeRewrite);
+    PhaseStats::Scope Stats("attachProfile");
 
     if (!opts::BoltProfile.empty()) {
       ProfileReader PR;
@@ -2422,10 +2721,35 @@ void RewriteInstance::processProfileData() {
       }
     }
 
+    if (!opts::ProfileVariants.empty())
+      readProfileVariants();
+
+    // Times of the first samples order functions by their first execution.
+    if (BC->DR.hasTemporalData()) {
+      for (auto &BFI : BinaryFunctions) {
+        auto &Function = BFI.second;
+        if (auto *Data = BC->DR.getFuncTemporalData(Function.getNames()))
+          Function.recordExecutionTime(Data->FirstTime);
+      }
+    }
+
+    // Evaluating and attaching the profile of a function only touches the
+    // function itself. Matching could claim profiles of other functions, and
+    // is done serially for the result to be independent of the scheduling.
+    ParallelUtilities::runOnEachFunction(
+        BinaryFunctions, ParallelUtilities::SP_INST_LINEAR,
+        [&](BinaryFunction &Function) { Function.evaluateAssignedProfile(); },
+        ParallelUtilities::PredicateTy(), "evaluateProfile");
+
     for (auto &BFI : BinaryFunctions) {
       auto &Function = BFI.second;
-      Function.readProfile();
+      Function.matchProfileData();
     }
+
+    ParallelUtilities::runOnEachFunction(
+        BinaryFunctions, ParallelUtilities::SP_INST_LINEAR,
+        [&](BinaryFunction &Function) { Function.attachProfile(); },
+        ParallelUtilities::PredicateTy(), "attachProfile");
   }
 
   if (!opts::SaveProfile.empty()) {
@@ -2434,31 +2758,170 @@ void RewriteInstance::processProfileData() {
   }
 }
 
+void RewriteInstance::readProfileVariants() {
+  if (!BC->DR.hasLBR()) {
+    errs() << "BOLT-WARNING: -profile-variants requires a profile with LBR, "
+           << "ignoring it\n";
+    return;
+  }
+
+  for (StringRef Entry : opts::ProfileVariants) {
+    auto FileName = Entry;
+    double Weight = 1.0;
+    const auto Colon = Entry.rfind(':');
+    if (Colon != StringRef::npos) {
+      if (Entry.substr(Colon + 1).getAsDouble(Weight) || Weight < 0.0) {
+        errs() << "BOLT-ERROR: invalid weight in -profile-variants entry "
+               << Entry << '\n';
+        exit(1);
+      }
+      FileName = Entry.substr(0, Colon);
+    }
+
+    auto ReaderOrErr = DataReader::readPerfData(FileName, errs());
+    check_error(ReaderOrErr.getError(), "cannot read profile variant");
+    if (!(*ReaderOrErr)->hasLBR()) {
+      errs() << "BOLT-ERROR: profile variant " << FileName
+             << " does not have LBR data\n";
+      exit(1);
+    }
+    ProfileVariantReaders.emplace_back(std::move(*ReaderOrErr));
+
+    BinaryContext::ProfileVariant Variant;
+    Variant.Name = FileName;
+    Variant.Weight = Weight;
+    BC->ProfileVariants.emplace_back(std::move(Variant));
+  }
+
+  for (auto &BFI : BinaryFunctions) {
+    auto &Function = BFI.second;
+    std::vector<const FuncBranchData *> Data;
+    for (auto &Reader : ProfileVariantReaders)
+      Data.push_back(Reader->getFuncBranchData(Function.getNames()));
+    Function.setVariantBranchData(std::move(Data));
+  }
+
+  outs() << "BOLT-INFO: read " << BC->ProfileVariants.size()
+         << " profile variants\n";
+}
+
+void RewriteInstance::processInterproceduralReferences() {
+  for (const auto Addr : BC->InterproceduralReferences) {
+    auto *ContainingFunction = getBinaryFunctionContainingAddress(Addr);
+    if (ContainingFunction && ContainingFunction->getAddress() != Addr) {
+      ContainingFunction->addEntryPoint(Addr);
+      if (!BC->HasRelocations) {
+        if (opts::Verbosity >= 1) {
+          errs() << "BOLT-WARNING: Function " << *ContainingFunction
+                 << " has internal BBs that are target of a reference located"
+                 << " in another function. Skipping the function.\n";
+        }
+        ContainingFunction->setSimple(false);
+      }
+    } else if (!ContainingFunction && Addr) {
+      // Check if address falls in function padding space - this could be
+      // unmarked data in code. In this case adjust the padding space size.
+      auto Section = BC->getSectionForAddress(Addr);
+      assert(Section && "cannot get section for referenced address");
+
+      if (!Section->isText())
+        continue;
+
+      // PLT requires special handling and could be ignored in this context.
+      StringRef SectionName = Section->getName();
+      if (SectionName == ".plt" || SectionName == ".plt.got")
+        continue;
+
+      if (BC->HasRelocations) {
+        errs() << "BOLT-ERROR: cannot process binaries with unmarked "
+               << "object in code at address 0x"
+               << Twine::utohexstr(Addr) << " belonging to section "
+               << SectionName << " in relocation mode.\n";
+        exit(1);
+      }
+
+      ContainingFunction =
+        getBinaryFunctionContainingAddress(Addr,
+                                           /*CheckPastEnd=*/false,
+                                           /*UseMaxSize=*/true);
+      // We are not going to overwrite non-simple functions, but for simple
+      // ones - adjust the padding size.
+      if (ContainingFunction && ContainingFunction->isSimple()) {
+        errs() << "BOLT-WARNING: function " << *ContainingFunction
+               << " has an object detected in a padding region at address 0x"
+               << Twine::utohexstr(Addr) << '\n';
+        ContainingFunction->setMaxSize(Addr -
+                                       ContainingFunction->getAddress());
+      }
+    }
+  }
+  BC->InterproceduralReferences.clear();
+}
+
 void RewriteInstance::disassembleFunctions() {
   NamedRegionTimer T("disassembleFunctions", "disassemble functions",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
-  for (auto &BFI : BinaryFunctions) {
-    BinaryFunction &Function = BFI.second;
+  PhaseStats::Scope Stats("disassembleFunctions");
+
+  // Per-function build timers are not thread-safe.
+  const bool RunInParallel = opts::ParallelDisassembly && !opts::TimeBuild &&
+                             ParallelUtilities::isParallel();
 
+  auto skipFunction = [&](const BinaryFunction &Function) {
     // If we have to relocate the code we have to disassemble all functions.
     if (!BC->HasRelocations && !opts::shouldProcess(Function)) {
       DEBUG(dbgs() << "BOLT: skipping processing function "
                    << Function << " per user request.\n");
-      continue;
+      return true;
     }
+    // In lite mode non-simple functions are never disassembled and stay as
+    // stubs describing their address range.
+    if (opts::Lite && !BC->HasRelocations && !Function.isSimple())
+      return true;
+    return false;
+  };
+
+  // Functions without samples can only be left out of disassembly when the
+  // profile is known upfront. In relocation mode every function is emitted,
+  // and the passes skip cold ones instead.
+  if (opts::Lite && !BC->HasRelocations && !DA.started() &&
+      opts::BoltProfile.empty()) {
+    uint64_t NumStubs = 0;
+    for (auto &BFI : BinaryFunctions) {
+      BinaryFunction &Function = BFI.second;
+      if (BC->DR.getFuncBranchData(Function.getNames()) ||
+          BC->DR.getFuncSampleData(Function.getNames()))
+        continue;
+      Function.setSimple(false);
+      ++NumStubs;
+    }
+    outs() << "BOLT-INFO: lite mode skips " << NumStubs << " out of "
+           << BinaryFunctions.size() << " functions without profile\n";
+  }
+
+  // Memory profile is matched against the function in the address order
+  // since it may create global symbols.
+  for (auto &BFI : BinaryFunctions) {
+    BinaryFunction &Function = BFI.second;
+    if (skipFunction(Function) || Function.getSize() == 0)
+      continue;
+    Function.matchProfileMemData();
+  }
 
+  // Return true if the function was disassembled.
+  auto disassembleFunction = [&](BinaryFunction &Function) {
     auto FunctionData = BC->getFunctionData(Function);
     if (!FunctionData) {
       // When could it happen?
       errs() << "BOLT-ERROR: corresponding section is non-executable or "
              << "empty for function " << Function << '\n';
-      continue;
+      return false;
     }
 
     // Treat zero-sized functions as non-simple ones.
     if (Function.getSize() == 0) {
       Function.setSimple(false);
-      continue;
+      return false;
     }
 
     // Offset of the function in the file.
@@ -2469,81 +2932,68 @@ void RewriteInstance::disassembleFunctions() {
     Function.disassemble(*FunctionData);
 
     if (!Function.isSimple() && BC->HasRelocations) {
+      if (opts::PatchInPlace && canPatchInPlace(Function)) {
+        Function.setPatchedInPlace();
+        return true;
+      }
       errs() << "BOLT-ERROR: function " << Function << " cannot be properly "
              << "disassembled. Unable to continue in relocation mode.\n";
       exit(1);
     }
 
-    if (opts::PrintAll || opts::PrintDisasm)
-      Function.print(outs(), "after disassembly", true);
-
-    // Post-process inter-procedural references ASAP as it may affect
-    // functions we are about to disassemble next.
-    for (const auto Addr : BC->InterproceduralReferences) {
-      auto *ContainingFunction = getBinaryFunctionContainingAddress(Addr);
-      if (ContainingFunction && ContainingFunction->getAddress() != Addr) {
-        ContainingFunction->addEntryPoint(Addr);
-        if (!BC->HasRelocations) {
-          if (opts::Verbosity >= 1) {
-            errs() << "BOLT-WARNING: Function " << *ContainingFunction
-                   << " has internal BBs that are target of a reference located"
-                   << " in another function. Skipping the function.\n";
-          }
-          ContainingFunction->setSimple(false);
-        }
-      } else if (!ContainingFunction && Addr) {
-        // Check if address falls in function padding space - this could be
-        // unmarked data in code. In this case adjust the padding space size.
-        auto Section = BC->getSectionForAddress(Addr);
-        assert(Section && "cannot get section for referenced address");
+    return true;
+  };
 
-        if (!Section->isText())
-          continue;
+  auto DisassembleStats = llvm::make_unique<PhaseStats::Scope>("disassemble");
+  if (!RunInParallel) {
+    for (auto &BFI : BinaryFunctions) {
+      BinaryFunction &Function = BFI.second;
+      if (skipFunction(Function))
+        continue;
 
-        // PLT requires special handling and could be ignored in this context.
-        StringRef SectionName = Section->getName();
-        if (SectionName == ".plt" || SectionName == ".plt.got")
-          continue;
+      if (!disassembleFunction(Function))
+        continue;
 
-        if (BC->HasRelocations) {
-          errs() << "BOLT-ERROR: cannot process binaries with unmarked "
-                 << "object in code at address 0x"
-                 << Twine::utohexstr(Addr) << " belonging to section "
-                 << SectionName << " in relocation mode.\n";
-          exit(1);
-        }
+      if (opts::PrintAll || opts::PrintDisasm)
+        Function.print(outs(), "after disassembly", true);
 
-        ContainingFunction =
-          getBinaryFunctionContainingAddress(Addr,
-                                             /*CheckPastEnd=*/false,
-                                             /*UseMaxSize=*/true);
-        // We are not going to overwrite non-simple functions, but for simple
-        // ones - adjust the padding size.
-        if (ContainingFunction && ContainingFunction->isSimple()) {
-          errs() << "BOLT-WARNING: function " << *ContainingFunction
-                 << " has an object detected in a padding region at address 0x"
-                 << Twine::utohexstr(Addr) << '\n';
-          ContainingFunction->setMaxSize(Addr -
-                                         ContainingFunction->getAddress());
-        }
+      // Post-process inter-procedural references ASAP as it may affect
+      // functions we are about to disassemble next.
+      processInterproceduralReferences();
+    }
+  } else {
+    ParallelUtilities::runOnEachFunction(
+        BinaryFunctions, ParallelUtilities::SP_CONSTANT,
+        [&](BinaryFunction &Function) { disassembleFunction(Function); },
+        skipFunction, "disassembleFunctions");
+
+    // Make the order of trapped functions independent of the scheduling.
+    std::sort(BC->TrappedFunctions.begin(), BC->TrappedFunctions.end(),
+              [](const BinaryFunction *A, const BinaryFunction *B) {
+                return A->getAddress() < B->getAddress();
+              });
+
+    // References collected from all functions are processed at once, in the
+    // address order.
+    processInterproceduralReferences();
+
+    if (opts::PrintAll || opts::PrintDisasm) {
+      for (auto &BFI : BinaryFunctions) {
+        BinaryFunction &Function = BFI.second;
+        if (!skipFunction(Function) && Function.getSize() != 0 &&
+            BC->getFunctionData(Function))
+          Function.print(outs(), "after disassembly", true);
       }
     }
-    BC->InterproceduralReferences.clear();
   }
+  DisassembleStats.reset();
 
-  for (auto &BFI : BinaryFunctions) {
-    BinaryFunction &Function = BFI.second;
-
-    if (!BC->HasRelocations && !opts::shouldProcess(Function)) {
-      DEBUG(dbgs() << "BOLT: skipping processing function "
-                   << Function << " per user request.\n");
-      continue;
-    }
-
+  auto buildFunctionCFG = [&](BinaryFunction &Function) {
     if (!Function.isSimple()) {
-      assert((!BC->HasRelocations || Function.getSize() == 0) &&
+      assert((!BC->HasRelocations || Function.getSize() == 0 ||
+              Function.isPatchedInPlace()) &&
              "unexpected non-simple function in relocation mode");
-      continue;
+      return;
     }
 
     // Fill in CFI information for this function
@@ -2557,7 +3007,7 @@ void RewriteInstance::disassembleFunctions() {
           errs() << "BOLT-WARNING: unable to fill CFI for function "
                  << Function << ". Skipping.\n";
           Function.setSimple(false);
-          continue;
+          return;
         }
       }
     }
@@ -2567,12 +3017,31 @@ void RewriteInstance::disassembleFunctions() {
       Function.parseLSDA(getLSDAData(), getLSDAAddress());
 
     if (!Function.buildCFG())
-      continue;
+      return;
 
-    if (opts::PrintAll)
+    if (opts::PrintAll && !RunInParallel)
       Function.print(outs(), "while building cfg", true);
+  };
 
-  } // Iterate over all functions
+  PhaseStats::Scope BuildCFGStats("buildCFG");
+  if (!RunInParallel) {
+    for (auto &BFI : BinaryFunctions) {
+      if (!skipFunction(BFI.second))
+        buildFunctionCFG(BFI.second);
+    }
+  } else {
+    ParallelUtilities::runOnEachFunction(
+        BinaryFunctions, ParallelUtilities::SP_CONSTANT, buildFunctionCFG,
+        skipFunction, "buildCFG");
+
+    if (opts::PrintAll) {
+      for (auto &BFI : BinaryFunctions) {
+        BinaryFunction &Function = BFI.second;
+        if (!skipFunction(Function) && Function.hasCFG())
+          Function.print(outs(), "while building cfg", true);
+      }
+    }
+  }
 
   BC->postProcessSymbolTable();
 }
@@ -2583,8 +3052,12 @@ void RewriteInstance::postProcessFunctions() {
   for (auto &BFI : BinaryFunctions) {
     BinaryFunction &Function = BFI.second;
 
-    if (Function.empty())
+    if (Function.empty()) {
+      // Functions without CFG are neither optimized nor emitted. Their
+      // instructions are not needed past this point.
+      Function.clearDisasmState();
       continue;
+    }
 
     Function.postProcessCFG();
 
@@ -2601,6 +3074,18 @@ void RewriteInstance::postProcessFunctions() {
 
     BC->TotalScore += Function.getFunctionScore();
     BC->SumExecutionCount += Function.getKnownExecutionCount();
+
+    // Totals of the profile variants and of the profile, over the same
+    // functions, for comparing the counts of different profiles.
+    const auto &Variants = Function.getVariantProfiles();
+    if (!Variants.empty()) {
+      for (const auto &BB : Function)
+        BC->TotalBlockCount += BB.getKnownExecutionCount();
+      for (unsigned I = 0; I < Variants.size(); ++I) {
+        for (const auto &Entry : Variants[I].BlockCounts)
+          BC->ProfileVariants[I].TotalBlockCount += Entry.second;
+      }
+    }
   }
 
   if (opts::PrintGlobals) {
@@ -2609,9 +3094,87 @@ void RewriteInstance::postProcessFunctions() {
   }
 }
 
+bool RewriteInstance::canPatchInPlace(const BinaryFunction &Function) const {
+  // Secondary entry points, jump tables and constant islands are referenced
+  // through labels inside the function, which are not known to the linker.
+  if (Function.isMultiEntry() || Function.hasJumpTables() ||
+      Function.hasConstantIsland())
+    return false;
+
+  for (const auto &RelI : Function.getMoveRelocations()) {
+    const auto &Rel = RelI.second;
+
+    // The linker may have relaxed the load from the GOT into a direct
+    // reference, in which case the original value cannot be recomputed.
+    if (Rel.Type == ELF::R_X86_64_GOTPCRELX ||
+        Rel.Type == ELF::R_X86_64_REX_GOTPCRELX)
+      return false;
+
+    if (const auto *BF = BC->getFunctionForSymbol(Rel.Symbol)) {
+      if (BF == &Function)
+        continue;
+      // Only references to the start of other functions follow them. The
+      // addend of a PC-relative reference includes the distance from the
+      // relocated field to the end of the instruction.
+      const auto Offset = static_cast<int64_t>(Rel.Addend) +
+                          (Rel.isPCRelative() ? Rel.getSize() : 0);
+      if (!BF->hasName(Rel.Symbol->getName().str()) || Offset > 0 ||
+          Offset < -4)
+        return false;
+      continue;
+    }
+
+    const auto *BD = BC->getBinaryDataByName(Rel.Symbol->getName());
+    if (!BD || BD->getSection().isText())
+      return false;
+  }
+
+  return true;
+}
+
+void RewriteInstance::markColdFunctionsInPlace() {
+  // Without a profile all functions would be considered cold.
+  const auto HasProfile =
+    std::any_of(BinaryFunctions.begin(), BinaryFunctions.end(),
+                [](const std::pair<const uint64_t, BinaryFunction> &BFI) {
+                  return BFI.second.getKnownExecutionCount() != 0;
+                });
+
+  uint64_t NumNonSimple = 0;
+  uint64_t NumCold = 0;
+  uint64_t Bytes = 0;
+  for (auto &BFI : BinaryFunctions) {
+    auto &Function = BFI.second;
+    if (Function.isPatchedInPlace()) {
+      ++NumNonSimple;
+      Bytes += Function.getSize();
+      continue;
+    }
+
+    if (!HasProfile || !Function.isSimple() || !Function.getSize() ||
+        Function.getKnownExecutionCount() || !canPatchInPlace(Function))
+      continue;
+
+    // Functions that are not simple are not optimized and not emitted.
+    Function.setSimple(false);
+    Function.setPatchedInPlace();
+    ++NumCold;
+    Bytes += Function.getSize();
+  }
+
+  if (NumNonSimple + NumCold == 0)
+    return;
+
+  outs() << "BOLT-INFO: " << (NumNonSimple + NumCold) << " functions of "
+         << Bytes << " bytes stay at their original addresses: "
+         << NumCold << " not executed and " << NumNonSimple
+         << " not disassembled\n";
+}
+
 void RewriteInstance::runOptimizationPasses() {
   NamedRegionTimer T("runOptimizationPasses", "run optimization passes",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
+  PhaseStats::Scope Stats("runOptimizationPasses", &BinaryFunctions);
   BinaryFunctionPassManager::runAllPasses(*BC, BinaryFunctions, LargeFunctions);
 }
 
@@ -2729,7 +3292,8 @@ void RewriteInstance::emitFunction(MCStreamer &Streamer,
   // Exception handling info for the function.
   Function.emitLSDA(&Streamer, EmitColdPart);
 
-  if (!EmitColdPart && opts::JumpTables > JTS_NONE)
+  if (!EmitColdPart && opts::JumpTables > JTS_NONE &&
+      !(BC->HasRelocations && opts::SortJumpTables))
     Function.emitJumpTables(&Streamer);
 
   Function.setEmitted();
@@ -2749,6 +3313,7 @@ std::vector<T> singletonSet(T t) {
 void RewriteInstance::emitFunctions() {
   NamedRegionTimer T("emitFunctions", "emit functions", TimerGroupName,
                      TimerGroupDesc, opts::TimeRewrite);
+  PhaseStats::Scope Stats("emitFunctions");
   std::error_code EC;
 
   // This is an object file, which we keep for debugging purposes.
@@ -2780,6 +3345,10 @@ void RewriteInstance::emitFunctions() {
   // Mark beginning of "hot text".
   if (BC->HasRelocations && opts::HotText)
     Streamer->EmitLabel(BC->Ctx->getOrCreateSymbol("__hot_start"));
+  if (opts::Hugify) {
+    HotTextStartSymbol = BC->Ctx->createTempSymbol("hot_text_start", true);
+    Streamer->EmitLabel(HotTextStartSymbol);
+  }
 
   // Sort functions for the output.
   std::vector<BinaryFunction *> SortedFunctions =
@@ -2807,8 +3376,47 @@ void RewriteInstance::emitFunctions() {
   CurrentIndex = 0;
   DEBUG(dbgs() << "BOLT-DEBUG: LastHotIndex = " << LastHotIndex << "\n");
 
+  // Mark the end of hot code. With -separate-hot-text, the hot code is padded
+  // to the next huge page boundary where the cold code starts.
+  auto emitHotTextEnd = [&]() {
+    Streamer->SwitchSection(BC->MOFI->getTextSection());
+    if (opts::HotText)
+      Streamer->EmitLabel(BC->Ctx->getOrCreateSymbol("__hot_end"));
+    if (opts::SeparateHotText) {
+      Streamer->EmitCodeAlignment(PageAlign);
+      HotTextEndSymbol = BC->Ctx->createTempSymbol("hot_text_end", true);
+      Streamer->EmitLabel(HotTextEndSymbol);
+    }
+  };
+
+  // Emit the constant islands moved out of the hot functions. They go after
+  // the hot code in the order LongJmpPass laid them out.
+  auto emitMovedConstantIslands = [&]() {
+    Streamer->SwitchSection(BC->MOFI->getTextSection());
+    for (auto *BF : SortedFunctions) {
+      if (!BF->hasMovedConstantIslands())
+        continue;
+      Streamer->EmitValueToAlignment(8);
+      BF->emitMovedConstantIslands(*Streamer);
+    }
+  };
+
   bool ColdFunctionSeen = false;
 
+  // Emit the cold parts of the split functions in [ColdBegin, End).
+  uint32_t ColdBegin = 0;
+  auto emitColdParts = [&](uint32_t End) {
+    if (opts::SplitFunctions == BinaryFunction::ST_NONE)
+      return;
+    DEBUG(dbgs() << "BOLT-DEBUG: generating code for split functions\n");
+    for (; ColdBegin < End; ++ColdBegin) {
+      auto *FPtr = SortedFunctions[ColdBegin];
+      if (!FPtr->isSplit() || !FPtr->isSimple())
+        continue;
+      emitFunction(*Streamer, *FPtr, /*EmitColdPart=*/true);
+    }
+  };
+
   // Output functions one by one.
   for (auto *FunctionPtr : SortedFunctions) {
     auto &Function = *FunctionPtr;
@@ -2817,30 +3425,34 @@ void RewriteInstance::emitFunctions() {
     // cold functions.
     if (BC->HasRelocations && !ColdFunctionSeen &&
         CurrentIndex >= LastHotIndex) {
+      emitMovedConstantIslands();
+
       // Mark the end of "hot" stuff.
-      if (opts::HotText) {
-        Streamer->SwitchSection(BC->MOFI->getTextSection());
-        Streamer->EmitLabel(BC->Ctx->getOrCreateSymbol("__hot_end"));
-      }
+      if (opts::HotText || opts::SeparateHotText)
+        emitHotTextEnd();
 
       ColdFunctionSeen = true;
-      if (opts::SplitFunctions != BinaryFunction::ST_NONE) {
-        DEBUG(dbgs() << "BOLT-DEBUG: generating code for split functions\n");
-        for (auto *FPtr : SortedFunctions) {
-          if (!FPtr->isSplit() || !FPtr->isSimple())
-            continue;
-          emitFunction(*Streamer, *FPtr, /*EmitColdPart=*/true);
-        }
-      }
+      emitColdParts(SortedFunctions.size());
       DEBUG(dbgs() << "BOLT-DEBUG: first cold function: " << Function << '\n');
     }
 
+    // Hot code too large for the cold parts to be within branch range of
+    // their hot parents is interleaved with them. See LongJmpPass.
+    if (BC->HasRelocations && !ColdFunctionSeen &&
+        Function.hasColdFragmentsBefore())
+      emitColdParts(CurrentIndex);
+
     if (!BC->HasRelocations &&
         (!Function.isSimple() || !opts::shouldProcess(Function))) {
       ++CurrentIndex;
       continue;
     }
 
+    if (Function.isPatchedInPlace()) {
+      ++CurrentIndex;
+      continue;
+    }
+
     DEBUG(dbgs() << "BOLT: generating code for function \""
                  << Function << "\" : "
                  << Function.getFunctionNumber() << '\n');
@@ -2853,9 +3465,85 @@ void RewriteInstance::emitFunctions() {
     ++CurrentIndex;
   }
 
-  if (!ColdFunctionSeen && opts::HotText) {
+  if (BC->HasRelocations && !ColdFunctionSeen)
+    emitMovedConstantIslands();
+
+  if (!ColdFunctionSeen && (opts::HotText || opts::SeparateHotText))
+    emitHotTextEnd();
+
+  // The hot jump tables are packed at the start of the read-only data that
+  // follows the code, the most used ones first.
+  if (BC->HasRelocations && opts::SortJumpTables &&
+      opts::JumpTables > JTS_NONE) {
+    std::vector<std::pair<BinaryFunction *, JumpTable *>> JumpTables;
+    for (auto *BF : SortedFunctions) {
+      if (!BF->isEmitted())
+        continue;
+      for (auto &JTI : BF->JumpTables)
+        JumpTables.emplace_back(BF, JTI.second);
+    }
+    std::stable_sort(JumpTables.begin(), JumpTables.end(),
+                     [](const std::pair<BinaryFunction *, JumpTable *> &A,
+                        const std::pair<BinaryFunction *, JumpTable *> &B) {
+                       return A.second->Count > B.second->Count;
+                     });
+    for (auto &FuncJT : JumpTables)
+      FuncJT.first->emitJumpTable(Streamer.get(), *FuncJT.second);
+  }
+
+  // The stub goes after all the code so that it is not remapped by itself.
+  if (opts::Hugify) {
+    const auto *EntryFunction = getBinaryFunctionAtAddress(EntryPoint);
+    if (!EntryFunction) {
+      errs() << "BOLT-WARNING: entry point 0x" << Twine::utohexstr(EntryPoint)
+             << " is not at the start of a function. Not adding the hugify "
+                "stub.\n";
+    } else {
+      Streamer->SwitchSection(BC->MOFI->getTextSection());
+      Streamer->EmitCodeAlignment(16);
+      HugifyStubSymbol = BC->Ctx->createTempSymbol("hugify_stub", true);
+      Streamer->EmitLabel(HugifyStubSymbol);
+      for (const auto &Inst :
+           BC->MIB->createHugifyStub(HotTextStartSymbol, HotTextEndSymbol,
+                                     EntryFunction->getSymbol(),
+                                     BC->Ctx.get())) {
+        Streamer->EmitInstruction(Inst, *BC->STI);
+      }
+    }
+  }
+
+  // The counters area is made writable at startup, so it goes last and
+  // occupies whole pages.
+  if (BC->InstrCounters) {
+    const auto *EntryFunction = getBinaryFunctionAtAddress(EntryPoint);
+    if (!EntryFunction) {
+      errs() << "BOLT-ERROR: entry point 0x" << Twine::utohexstr(EntryPoint)
+             << " is not at the start of a function. Cannot add the "
+                "instrumentation stub.\n";
+      exit(1);
+    }
     Streamer->SwitchSection(BC->MOFI->getTextSection());
-    Streamer->EmitLabel(BC->Ctx->getOrCreateSymbol("__hot_end"));
+    auto *FileNameSymbol =
+      BC->Ctx->createTempSymbol("instr_file_name", true);
+    Streamer->EmitLabel(FileNameSymbol);
+    Streamer->EmitBytes(opts::InstrumentationFile);
+    Streamer->EmitIntValue(0, 1);
+
+    Streamer->EmitCodeAlignment(16);
+    InstrStubSymbol = BC->Ctx->createTempSymbol("instr_stub", true);
+    Streamer->EmitLabel(InstrStubSymbol);
+    for (const auto &Inst :
+         BC->MIB->createInstrumentationStub(BC->InstrCounters,
+                                            BC->InstrCountersSize,
+                                            FileNameSymbol,
+                                            EntryFunction->getSymbol(),
+                                            BC->Ctx.get())) {
+      Streamer->EmitInstruction(Inst, *BC->STI);
+    }
+
+    Streamer->EmitValueToAlignment(4096);
+    Streamer->EmitLabel(BC->InstrCounters);
+    Streamer->EmitZeros(BC->InstrCountersSize);
   }
 
   if (!BC->HasRelocations && opts::UpdateDebugSections)
@@ -2944,6 +3632,25 @@ void RewriteInstance::emitFunctions() {
     CacheMetrics::printAll(SortedFunctions);
   }
 
+  if (BC->HasRelocations && !opts::HotTextReport.empty()) {
+    std::error_code EC;
+    raw_fd_ostream OS(opts::HotTextReport, EC, sys::fs::F_None);
+    if (EC) {
+      errs() << "BOLT-WARNING: cannot open " << opts::HotTextReport << ": "
+             << EC.message() << '\n';
+    }
+    CacheMetrics::printPageUsage(SortedFunctions, EC ? nullptr : &OS);
+  }
+
+  if (opts::ReleaseFunctionState) {
+    // Output addresses are known at this point. The rest of the rewrite only
+    // needs block ranges to update debug info, jump tables and CFI.
+    for (auto &BFI : BinaryFunctions)
+      BFI.second.releaseEmittedState();
+    // No instruction references annotations anymore.
+    BC->MIB->freeAnnotations();
+  }
+
   if (opts::KeepTmp)
     TempOut->keep();
 }
@@ -3147,91 +3854,130 @@ void RewriteInstance::mapDataSections(orc::VModuleKey Key) {
 }
 
 void RewriteInstance::updateOutputValues(const MCAsmLayout &Layout) {
-  for (auto &BFI : BinaryFunctions) {
-    auto &Function = BFI.second;
+  // The layout computes fragment offsets lazily and cannot be queried from
+  // multiple threads until all of them are known.
+  for (const auto *Section : Layout.getSectionOrder()) {
+    if (!Section->getFragmentList().empty())
+      Layout.getFragmentOffset(&Section->getFragmentList().back());
+  }
 
-    if (!Function.isEmitted()) {
-      Function.setOutputAddress(Function.getAddress());
-      Function.setOutputSize(Function.getSize());
-      continue;
-    }
+  if (HotTextEndSymbol) {
+    HotTextEndAddress =
+      NewTextSectionStartAddress + Layout.getSymbolOffset(*HotTextEndSymbol);
+  }
 
-    if (BC->HasRelocations) {
-      const auto BaseAddress = NewTextSectionStartAddress;
-      const auto StartOffset = Layout.getSymbolOffset(*Function.getSymbol());
-      const auto EndOffset =
-        Layout.getSymbolOffset(*Function.getFunctionEndLabel());
+  if (HugifyStubSymbol) {
+    HugifyStubAddress =
+      NewTextSectionStartAddress + Layout.getSymbolOffset(*HugifyStubSymbol);
+    outs() << "BOLT-INFO: hugify stub at 0x"
+           << Twine::utohexstr(HugifyStubAddress) << " remaps 0x"
+           << Twine::utohexstr(HotTextEndAddress - NewTextSectionStartAddress)
+           << " bytes of hot text\n";
+  }
+
+  if (InstrStubSymbol) {
+    InstrStubAddress =
+      NewTextSectionStartAddress + Layout.getSymbolOffset(*InstrStubSymbol);
+    outs() << "BOLT-INFO: instrumentation stub at 0x"
+           << Twine::utohexstr(InstrStubAddress) << ", counters at 0x"
+           << Twine::utohexstr(NewTextSectionStartAddress +
+                               Layout.getSymbolOffset(*BC->InstrCounters))
+           << '\n';
+  }
+
+  ParallelUtilities::runOnEachFunction(
+      BinaryFunctions, ParallelUtilities::SP_BB_LINEAR,
+      [&](BinaryFunction &Function) {
+        updateFunctionOutputValues(Function, Layout);
+      },
+      ParallelUtilities::PredicateTy(), "updateOutputValues");
+}
+
+void RewriteInstance::updateFunctionOutputValues(BinaryFunction &Function,
+                                                 const MCAsmLayout &Layout) {
+  if (!Function.isEmitted()) {
+    Function.setOutputAddress(Function.getAddress());
+    Function.setOutputSize(Function.getSize());
+    return;
+  }
+
+  if (BC->HasRelocations) {
+    const auto BaseAddress = NewTextSectionStartAddress;
+    const auto StartOffset = Layout.getSymbolOffset(*Function.getSymbol());
+    const auto EndOffset =
+      Layout.getSymbolOffset(*Function.getFunctionEndLabel());
+    if (Function.hasConstantIsland()) {
+      const auto DataOffset =
+          Layout.getSymbolOffset(*Function.getFunctionConstantIslandLabel());
+      Function.setOutputDataAddress(BaseAddress + DataOffset);
+    }
+    Function.setOutputAddress(BaseAddress + StartOffset);
+    Function.setOutputSize(EndOffset - StartOffset);
+    if (Function.isSplit()) {
+      const auto *ColdStartSymbol = Function.getColdSymbol();
+      assert(ColdStartSymbol && ColdStartSymbol->isDefined() &&
+             "split function should have defined cold symbol");
+      const auto *ColdEndSymbol = Function.getFunctionColdEndLabel();
+      assert(ColdEndSymbol && ColdEndSymbol->isDefined() &&
+             "split function should have defined cold end symbol");
+      const auto ColdStartOffset = Layout.getSymbolOffset(*ColdStartSymbol);
+      const auto ColdEndOffset = Layout.getSymbolOffset(*ColdEndSymbol);
+      Function.cold().setAddress(BaseAddress + ColdStartOffset);
+      Function.cold().setImageSize(ColdEndOffset - ColdStartOffset);
       if (Function.hasConstantIsland()) {
-        const auto DataOffset =
-            Layout.getSymbolOffset(*Function.getFunctionConstantIslandLabel());
-        Function.setOutputDataAddress(BaseAddress + DataOffset);
-      }
-      Function.setOutputAddress(BaseAddress + StartOffset);
-      Function.setOutputSize(EndOffset - StartOffset);
-      if (Function.isSplit()) {
-        const auto *ColdStartSymbol = Function.getColdSymbol();
-        assert(ColdStartSymbol && ColdStartSymbol->isDefined() &&
-               "split function should have defined cold symbol");
-        const auto *ColdEndSymbol = Function.getFunctionColdEndLabel();
-        assert(ColdEndSymbol && ColdEndSymbol->isDefined() &&
-               "split function should have defined cold end symbol");
-        const auto ColdStartOffset = Layout.getSymbolOffset(*ColdStartSymbol);
-        const auto ColdEndOffset = Layout.getSymbolOffset(*ColdEndSymbol);
-        Function.cold().setAddress(BaseAddress + ColdStartOffset);
-        Function.cold().setImageSize(ColdEndOffset - ColdStartOffset);
-        if (Function.hasConstantIsland()) {
-          const auto DataOffset = Layout.getSymbolOffset(
-              *Function.getFunctionColdConstantIslandLabel());
-          Function.setOutputColdDataAddress(BaseAddress + DataOffset);
-        }
+        const auto DataOffset = Layout.getSymbolOffset(
+            *Function.getFunctionColdConstantIslandLabel());
+        Function.setOutputColdDataAddress(BaseAddress + DataOffset);
       }
-    } else {
-      Function.setOutputAddress(Function.getAddress());
-      Function.setOutputSize(
-          Layout.getSymbolOffset(*Function.getFunctionEndLabel()));
     }
+  } else {
+    Function.setOutputAddress(Function.getAddress());
+    Function.setOutputSize(
+        Layout.getSymbolOffset(*Function.getFunctionEndLabel()));
+  }
 
-    // Update basic block output ranges only for the debug info.
-    if (!opts::UpdateDebugSections)
-      continue;
+  // Update basic block output ranges for the debug info and for the
+  // dynamic relocations against code inside of functions.
+  if (!opts::UpdateDebugSections && !opts::EnableBAT &&
+      BC->HasFixedLoadAddress)
+    return;
 
-    // Output ranges should match the input if the body hasn't changed.
-    if (!Function.isSimple() && !BC->HasRelocations)
-      continue;
+  // Output ranges should match the input if the body hasn't changed.
+  if (!Function.isSimple() && !BC->HasRelocations)
+    return;
 
-    // AArch64 may have functions that only contains a constant island (no code)
-    if (Function.layout_begin() == Function.layout_end())
-      continue;
+  // AArch64 may have functions that only contains a constant island (no code)
+  if (Function.layout_begin() == Function.layout_end())
+    return;
 
-    BinaryBasicBlock *PrevBB = nullptr;
-    for (auto BBI = Function.layout_begin(), BBE = Function.layout_end();
-         BBI != BBE; ++BBI) {
-      auto *BB = *BBI;
-      assert(BB->getLabel()->isDefined() && "symbol should be defined");
-      uint64_t BaseAddress;
-      if (BC->HasRelocations) {
-        BaseAddress = NewTextSectionStartAddress;
-      } else {
-        BaseAddress = BB->isCold() ? Function.cold().getAddress()
-                                   : Function.getOutputAddress();
-      }
-      uint64_t Address = BaseAddress + Layout.getSymbolOffset(*BB->getLabel());
-      BB->setOutputStartAddress(Address);
-
-      if (PrevBB) {
-        auto PrevBBEndAddress = Address;
-        if (BB->isCold() != PrevBB->isCold()) {
-          PrevBBEndAddress =
-            Function.getOutputAddress() + Function.getOutputSize();
-        }
-        PrevBB->setOutputEndAddress(PrevBBEndAddress);
+  BinaryBasicBlock *PrevBB = nullptr;
+  for (auto BBI = Function.layout_begin(), BBE = Function.layout_end();
+       BBI != BBE; ++BBI) {
+    auto *BB = *BBI;
+    assert(BB->getLabel()->isDefined() && "symbol should be defined");
+    uint64_t BaseAddress;
+    if (BC->HasRelocations) {
+      BaseAddress = NewTextSectionStartAddress;
+    } else {
+      BaseAddress = BB->isCold() ? Function.cold().getAddress()
+                                 : Function.getOutputAddress();
+    }
+    uint64_t Address = BaseAddress + Layout.getSymbolOffset(*BB->getLabel());
+    BB->setOutputStartAddress(Address);
+
+    if (PrevBB) {
+      auto PrevBBEndAddress = Address;
+      if (BB->isCold() != PrevBB->isCold()) {
+        PrevBBEndAddress =
+          Function.getOutputAddress() + Function.getOutputSize();
       }
-      PrevBB = BB;
+      PrevBB->setOutputEndAddress(PrevBBEndAddress);
     }
-    PrevBB->setOutputEndAddress(PrevBB->isCold() ?
-        Function.cold().getAddress() + Function.cold().getImageSize() :
-        Function.getOutputAddress() + Function.getOutputSize());
+    PrevBB = BB;
   }
+  PrevBB->setOutputEndAddress(PrevBB->isCold() ?
+      Function.cold().getAddress() + Function.cold().getImageSize() :
+      Function.getOutputAddress() + Function.getOutputSize());
 }
 
 void RewriteInstance::emitDataSection(MCStreamer *Streamer,
@@ -3326,12 +4072,37 @@ void RewriteInstance::patchELFPHDRTable() {
   auto Obj = ELF64LEFile->getELFFile();
   auto &OS = Out->os();
 
+  // With -separate-hot-text, the new segment is split into three: the one
+  // with the program header table, the hot code starting and ending at huge
+  // page boundaries, and the rest of the new code and data.
+  std::vector<std::pair<uint64_t, uint64_t>> NewSegments;
+  if (PHDRTableOffset) {
+    if (HotTextEndAddress > NewTextSectionStartAddress &&
+        NewTextSectionStartAddress > PHDRTableAddress) {
+      NewSegments.emplace_back(PHDRTableAddress, NewTextSectionStartAddress);
+      NewSegments.emplace_back(NewTextSectionStartAddress, HotTextEndAddress);
+      if (HotTextEndAddress < NextAvailableAddress)
+        NewSegments.emplace_back(HotTextEndAddress, NextAvailableAddress);
+      outs() << "BOLT-INFO: hot text of 0x"
+             << Twine::utohexstr(HotTextEndAddress -
+                                 NewTextSectionStartAddress)
+             << " bytes is placed into a separate segment at 0x"
+             << Twine::utohexstr(NewTextSectionStartAddress) << '\n';
+    } else {
+      if (opts::SeparateHotText) {
+        errs() << "BOLT-WARNING: no hot text found in the new text section. "
+                  "Not creating a separate segment.\n";
+      }
+      // Segment size includes the size of the PHDR area.
+      NewSegments.emplace_back(PHDRTableAddress, NextAvailableAddress);
+    }
+  }
+
   // Write/re-write program headers.
   Phnum = Obj->getHeader()->e_phnum;
   if (PHDRTableOffset) {
     // Writing new pheader table.
-    Phnum += 1; // only adding one new segment
-    // Segment size includes the size of the PHDR area.
+    Phnum += NewSegments.size();
     NewTextSegmentSize = NextAvailableAddress - PHDRTableAddress;
   } else {
     assert(!PHDRTableAddress && "unexpected address for program header table");
@@ -3377,18 +4148,23 @@ void RewriteInstance::patchELFPHDRTable() {
       NewPhdr.p_align = PageAlign;
       ModdedGnuStack = true;
     } else if (!opts::UseGnuStack && Phdr.p_type == ELF::PT_DYNAMIC) {
-      // Insert new pheader
-      ELFFile<ELF64LE>::Elf_Phdr NewTextPhdr;
-      NewTextPhdr.p_type = ELF::PT_LOAD;
-      NewTextPhdr.p_offset = PHDRTableOffset;
-      NewTextPhdr.p_vaddr = PHDRTableAddress;
-      NewTextPhdr.p_paddr = PHDRTableAddress;
-      NewTextPhdr.p_filesz = NewTextSegmentSize;
-      NewTextPhdr.p_memsz = NewTextSegmentSize;
-      NewTextPhdr.p_flags = ELF::PF_X | ELF::PF_R;
-      NewTextPhdr.p_align = PageAlign;
-      OS.write(reinterpret_cast<const char *>(&NewTextPhdr),
-               sizeof(NewTextPhdr));
+      // Insert new pheaders
+      for (const auto &Segment : NewSegments) {
+        const auto SegmentSize = Segment.second - Segment.first;
+        ELFFile<ELF64LE>::Elf_Phdr NewTextPhdr;
+        NewTextPhdr.p_type = ELF::PT_LOAD;
+        NewTextPhdr.p_offset = Segment.first == PHDRTableAddress
+                                 ? PHDRTableOffset
+                                 : getFileOffsetForAddress(Segment.first);
+        NewTextPhdr.p_vaddr = Segment.first;
+        NewTextPhdr.p_paddr = Segment.first;
+        NewTextPhdr.p_filesz = SegmentSize;
+        NewTextPhdr.p_memsz = SegmentSize;
+        NewTextPhdr.p_flags = ELF::PF_X | ELF::PF_R;
+        NewTextPhdr.p_align = PageAlign;
+        OS.write(reinterpret_cast<const char *>(&NewTextPhdr),
+                 sizeof(NewTextPhdr));
+      }
       AddedSegment = true;
     }
     OS.write(reinterpret_cast<const char *>(&NewPhdr), sizeof(NewPhdr));
@@ -3456,12 +4232,21 @@ void RewriteInstance::rewriteNoteSections() {
     // Copy over section contents unless it's one of the sections we overwrite.
     if (!willOverwriteSection(SectionName)) {
       Size = Section.sh_size;
-      std::string Data = InputFile->getData().substr(Section.sh_offset, Size);
+      // Stream the contents from the input file to avoid copies of large
+      // debug sections.
+      const auto Data = InputFile->getData().substr(Section.sh_offset, Size);
       auto SectionPatchersIt = SectionPatchers.find(SectionName);
       if (SectionPatchersIt != SectionPatchers.end()) {
-        (*SectionPatchersIt->second).patchBinary(Data);
+        SectionPatchersIt->second->writePatched(Data, OS);
+      } else {
+        // Unmodified contents are copied by the kernel when possible, so
+        // that large debug sections are never read into memory.
+        OS.seek(NextAvailableOffset);
+        const auto Copied = copyFileRange(InputFile->getFileName(), OutFD,
+                                          Section.sh_offset, Size);
+        OS.seek(NextAvailableOffset + Copied);
+        OS << Data.drop_front(Copied);
       }
-      OS << Data;
 
       // Add padding as the section extension might rely on the alignment.
       Size = appendPadding(OS, Size, Section.sh_addralign);
@@ -3579,6 +4364,19 @@ void RewriteInstance::addBoltInfoSection() {
 
     DescOS << "BOLT revision: " << BoltRevision << ", " << "command line:";
     for (auto I = 0; I < Argc; ++I) {
+      // Leave out options that do not change the output, so that the note
+      // does not differ between deterministic runs either.
+      if (ParallelUtilities::isDeterministic()) {
+        StringRef Arg(Argv[I]);
+        const auto Name = Arg.ltrim('-').split('=').first;
+        if (Arg.startswith("-") &&
+            (Name == "o" || Name == "thread-count" ||
+             Name == "deterministic" || Name == "check-determinism")) {
+          if (!Arg.contains('=') && (Name == "o" || Name == "thread-count"))
+            ++I;
+          continue;
+        }
+      }
       DescOS << " " << Argv[I];
     }
     DescOS.flush();
@@ -3613,6 +4411,29 @@ void RewriteInstance::addBoltInfoSection() {
   }
 }
 
+void RewriteInstance::addBATSection() {
+  if (!opts::EnableBAT)
+    return;
+
+  BoltAddressTranslation BAT;
+  BAT.build(BinaryFunctions);
+
+  std::string Str;
+  raw_string_ostream OS(Str);
+  BAT.write(OS);
+  const auto Contents = OS.str();
+  BC->registerOrUpdateNoteSection(BoltAddressTranslation::SectionName,
+                                  copyByteArray(Contents),
+                                  Contents.size(),
+                                  /*Alignment=*/1,
+                                  /*IsReadOnly=*/true,
+                                  ELF::SHT_PROGBITS);
+
+  outs() << "BOLT-INFO: wrote address translation table for "
+         << BAT.getNumFragments() << " function fragments ("
+         << Contents.size() << " bytes)\n";
+}
+
 // Provide a mapping of the existing input binary sections to the output binary
 // section header table.
 // Return the map from the section header old index to its new index. Optionally
@@ -3881,9 +4702,14 @@ void RewriteInstance::patchELFSectionHeaderTable(ELFObjectFile<ELFT> *File) {
   // Fix ELF header.
   auto NewEhdr = *Obj->getHeader();
 
-  if (BC->HasRelocations) {
+  // Shared objects do not always have an entry point.
+  if (BC->HasRelocations && NewEhdr.e_entry) {
     NewEhdr.e_entry = getNewFunctionAddress(NewEhdr.e_entry);
     assert(NewEhdr.e_entry && "cannot find new address for entry point");
+    if (HugifyStubAddress)
+      NewEhdr.e_entry = HugifyStubAddress;
+    if (InstrStubAddress)
+      NewEhdr.e_entry = InstrStubAddress;
   }
   NewEhdr.e_phoff = PHDRTableOffset;
   NewEhdr.e_phnum = Phnum;
@@ -3912,12 +4738,26 @@ void RewriteInstance::patchELFSymTabs(ELFObjectFile<ELFT> *File) {
   auto NewSectionIndex =
     getOutputSections(File, (std::vector<Elf_Shdr> *)nullptr, &SectionNameMap);
 
+  // Functions and data are looked up from several threads below. The data
+  // is final after emission, so the lookups can use the flat index.
+  BC->buildBinaryDataIndex();
+
   DEBUG(dbgs() << "BOLT-DEBUG: SectionNameMap:\n";
         for (auto &Entry : SectionNameMap) {
           dbgs() << "BOLT-DEBUG: " << Entry.first << " -> "
                  << Entry.second << "\n";
         });
 
+  // An output symbol table entry. Entries replacing an input symbol keep its
+  // name, new entries get Name added to the string table.
+  struct SymbolEntry {
+    Elf_Sym Symbol;
+    size_t Index;
+    bool IsSpecial;
+    std::string Name;
+  };
+  const size_t NewEntry = -1;
+
   auto updateSymbolTable =
     [&](bool PatchExisting,
         const Elf_Shdr *Section,
@@ -3925,164 +4765,217 @@ void RewriteInstance::patchELFSymTabs(ELFObjectFile<ELFT> *File) {
         Write,
         std::function<size_t(StringRef)> AddToStrTab) {
     auto StringSection = cantFail(Obj->getStringTableForSymtab(*Section));
+    auto Symbols = cantFail(Obj->symbols(Section));
     unsigned IsHotTextUpdated = 0;
     unsigned IsHotDataUpdated = 0;
 
-    std::map<const BinaryFunction *, uint64_t> IslandSizes;
-    auto getConstantIslandSize = [&IslandSizes](const BinaryFunction *BF) {
-      auto Itr = IslandSizes.find(BF);
-      if (Itr != IslandSizes.end())
-        return Itr->second;
-      return IslandSizes[BF] = BF->estimateConstantIslandSize();
+    auto isSpecialSymbol = [](StringRef Name) {
+      return (opts::HotText && (Name == "__hot_start" ||
+                                Name == "__hot_end")) ||
+             (opts::HotData && (Name == "__hot_data_start" ||
+                                Name == "__hot_data_end")) ||
+             (opts::UpdateEnd && Name == "_end");
     };
 
-    for (const Elf_Sym &Symbol : cantFail(Obj->symbols(Section))) {
-      auto NewSymbol = Symbol;
-      const auto *Function = getBinaryFunctionAtAddress(Symbol.st_value);
-      // Some section symbols may be mistakenly associated with the first
-      // function emitted in the section. Dismiss if it is a section symbol.
-      if (Function &&
-          !Function->getPLTSymbol() &&
-          NewSymbol.getType() != ELF::STT_SECTION) {
-        NewSymbol.st_value = Function->getOutputAddress();
-        NewSymbol.st_size = Function->getOutputSize();
-        if (BC->HasRelocations)
-          NewSymbol.st_shndx = NewTextSectionIndex;
-        else
-          NewSymbol.st_shndx = NewSectionIndex[NewSymbol.st_shndx];
-        if (!PatchExisting && Function->isSplit()) {
-          auto NewColdSym = NewSymbol;
-          SmallVector<char, 256> Buf;
-          NewColdSym.st_name =
-              AddToStrTab(Twine(cantFail(Symbol.getName(StringSection)))
-                              .concat(".cold.0")
-                              .toStringRef(Buf));
-          NewColdSym.st_value = Function->cold().getAddress();
-          NewColdSym.st_size = Function->cold().getImageSize();
-          Write(0, reinterpret_cast<const char *>(&NewColdSym),
-                sizeof(NewColdSym));
-        }
-        if (!PatchExisting && Function->hasConstantIsland()) {
-          auto DataMark = Function->getOutputDataAddress();
-          auto CISize = getConstantIslandSize(Function);
-          auto CodeMark = DataMark + CISize;
-          auto DataMarkSym = NewSymbol;
-          DataMarkSym.st_name = AddToStrTab("$d");
-          DataMarkSym.st_value = DataMark;
-          DataMarkSym.st_size = 0;
-          DataMarkSym.setType(ELF::STT_NOTYPE);
-          DataMarkSym.setBinding(ELF::STB_LOCAL);
-          auto CodeMarkSym = DataMarkSym;
-          CodeMarkSym.st_name = AddToStrTab("$x");
-          CodeMarkSym.st_value = CodeMark;
-          Write(0, reinterpret_cast<const char *>(&DataMarkSym),
-                sizeof(DataMarkSym));
-          Write(0, reinterpret_cast<const char *>(&CodeMarkSym),
-                sizeof(CodeMarkSym));
-        }
-        if (!PatchExisting && Function->hasConstantIsland() &&
-            Function->isSplit()) {
-          auto DataMark = Function->getOutputColdDataAddress();
-          auto CISize = getConstantIslandSize(Function);
-          auto CodeMark = DataMark + CISize;
-          auto DataMarkSym = NewSymbol;
-          DataMarkSym.st_name = AddToStrTab("$d");
-          DataMarkSym.st_value = DataMark;
-          DataMarkSym.st_size = 0;
-          DataMarkSym.setType(ELF::STT_NOTYPE);
-          DataMarkSym.setBinding(ELF::STB_LOCAL);
-          auto CodeMarkSym = DataMarkSym;
-          CodeMarkSym.st_name = AddToStrTab("$x");
-          CodeMarkSym.st_value = CodeMark;
-          Write(0, reinterpret_cast<const char *>(&DataMarkSym),
-                sizeof(DataMarkSym));
-          Write(0, reinterpret_cast<const char *>(&CodeMarkSym),
-                sizeof(CodeMarkSym));
-        }
-      } else {
-        uint32_t OldSectionIndex = NewSymbol.st_shndx;
-        auto *BD = !Function ? BC->getBinaryDataAtAddress(NewSymbol.st_value)
-                             : nullptr;
-        if (BD && BD->isMoved() && !BD->isJumpTable()) {
-          assert((!BD->getSize() ||
-                  !NewSymbol.st_size ||
-                  NewSymbol.st_size == BD->getSize()) &&
-                 "sizes must match");
-
-          auto &OutputSection = BD->getOutputSection();
-
-          assert(SectionNameMap.count(OutputSection.getName()));
-          DEBUG(dbgs() << "BOLT-DEBUG: moving " << BD->getName() << " from "
-                       << *BC->getSectionNameForAddress(NewSymbol.st_value)
-                       << " (" << NewSymbol.st_shndx << ") to "
-                       << OutputSection.getName() << " ("
-                       << SectionNameMap[OutputSection.getName()] << ")\n");
-          OldSectionIndex = ELF::SHN_LORESERVE;
-          NewSymbol.st_shndx = SectionNameMap[OutputSection.getName()];
-
-          // TODO: use getNewValueForSymbol()?
-          NewSymbol.st_value = BD->getOutputAddress();
-        }
-
-        if (OldSectionIndex < ELF::SHN_LORESERVE) {
-          NewSymbol.st_shndx = NewSectionIndex[OldSectionIndex];
-        }
+    // Compute the output entries for the symbols in [Begin, End). Runs in
+    // parallel over chunks of the table, so it only reads shared state.
+    auto updateSymbols = [&](size_t Begin, size_t End,
+                             std::vector<SymbolEntry> &Entries) {
+      auto addMarkers = [&](const Elf_Sym &NewSymbol, uint64_t DataMark,
+                            uint64_t CodeMark) {
+        auto DataMarkSym = NewSymbol;
+        DataMarkSym.st_value = DataMark;
+        DataMarkSym.st_size = 0;
+        DataMarkSym.setType(ELF::STT_NOTYPE);
+        DataMarkSym.setBinding(ELF::STB_LOCAL);
+        auto CodeMarkSym = DataMarkSym;
+        CodeMarkSym.st_value = CodeMark;
+        Entries.push_back({DataMarkSym, NewEntry, false, "$d"});
+        Entries.push_back({CodeMarkSym, NewEntry, false, "$x"});
+      };
 
-        // Detect local syms in the text section that we didn't update
-        // and were preserved by the linker to support relocations against
-        // .text (t15274167). Remove then from the symtab.
-        if (NewSymbol.getType() == ELF::STT_NOTYPE &&
-            NewSymbol.getBinding() == ELF::STB_LOCAL &&
-            NewSymbol.st_size == 0) {
-          auto ExpectedSec = File->getELFFile()->getSection(NewSymbol.st_shndx);
-          if (ExpectedSec) {
-            auto Section = *ExpectedSec;
-            if (Section->sh_type == ELF::SHT_PROGBITS &&
-                Section->sh_flags & ELF::SHF_ALLOC &&
-                Section->sh_flags & ELF::SHF_EXECINSTR) {
-              // This will cause the symbol to not be emitted if we are
-              // creating a new symtab from scratch instead of patching one.
-              if (!PatchExisting)
+      for (auto I = Begin; I < End; ++I) {
+        const auto &Symbol = Symbols[I];
+        auto NewSymbol = Symbol;
+        const auto *Function = getBinaryFunctionAtAddress(Symbol.st_value);
+        // Some section symbols may be mistakenly associated with the first
+        // function emitted in the section. Dismiss if it is a section symbol.
+        if (Function &&
+            !Function->getPLTSymbol() &&
+            NewSymbol.getType() != ELF::STT_SECTION) {
+          NewSymbol.st_value = Function->getOutputAddress();
+          NewSymbol.st_size = Function->getOutputSize();
+          if (BC->HasRelocations)
+            NewSymbol.st_shndx = NewTextSectionIndex;
+          else
+            NewSymbol.st_shndx = NewSectionIndex[NewSymbol.st_shndx];
+          if (!PatchExisting && Function->isSplit()) {
+            auto NewColdSym = NewSymbol;
+            NewColdSym.st_value = Function->cold().getAddress();
+            NewColdSym.st_size = Function->cold().getImageSize();
+            Entries.push_back(
+                {NewColdSym, NewEntry, false,
+                 (cantFail(Symbol.getName(StringSection)) + ".cold.0").str()});
+          }
+          if (!PatchExisting) {
+            const auto &Clones = Function->getClones();
+            for (unsigned CloneNum = 0; CloneNum < Clones.size(); ++CloneNum) {
+              const auto *Clone = Clones[CloneNum];
+              if (!Clone->isEmitted())
                 continue;
-              // If patching an existing symtab, patch this value to zero.
-              NewSymbol.st_value = 0;
+              const auto CloneName =
+                (cantFail(Symbol.getName(StringSection)) + ".clone." +
+                 Twine(CloneNum)).str();
+              auto NewCloneSym = NewSymbol;
+              NewCloneSym.st_value = Clone->getOutputAddress();
+              NewCloneSym.st_size = Clone->getOutputSize();
+              Entries.push_back({NewCloneSym, NewEntry, false, CloneName});
+              if (Clone->isSplit()) {
+                NewCloneSym.st_value = Clone->cold().getAddress();
+                NewCloneSym.st_size = Clone->cold().getImageSize();
+                Entries.push_back(
+                    {NewCloneSym, NewEntry, false, CloneName + ".cold.0"});
+              }
+            }
+          }
+          if (!PatchExisting && Function->hasConstantIsland()) {
+            const auto CISize = Function->estimateConstantIslandSize();
+            const auto DataMark = Function->getOutputDataAddress();
+            addMarkers(NewSymbol, DataMark, DataMark + CISize);
+            if (Function->isSplit()) {
+              const auto ColdDataMark = Function->getOutputColdDataAddress();
+              addMarkers(NewSymbol, ColdDataMark, ColdDataMark + CISize);
+            }
+          }
+        } else {
+          uint32_t OldSectionIndex = NewSymbol.st_shndx;
+          auto *BD = !Function ? BC->getBinaryDataAtAddress(NewSymbol.st_value)
+                               : nullptr;
+          if (BD && BD->isMoved() && !BD->isJumpTable()) {
+            assert((!BD->getSize() ||
+                    !NewSymbol.st_size ||
+                    NewSymbol.st_size == BD->getSize()) &&
+                   "sizes must match");
+
+            auto &OutputSection = BD->getOutputSection();
+
+            assert(SectionNameMap.count(OutputSection.getName()));
+            DEBUG(dbgs() << "BOLT-DEBUG: moving " << BD->getName() << " from "
+                         << *BC->getSectionNameForAddress(NewSymbol.st_value)
+                         << " (" << NewSymbol.st_shndx << ") to "
+                         << OutputSection.getName() << " ("
+                         << SectionNameMap.at(OutputSection.getName())
+                         << ")\n");
+            OldSectionIndex = ELF::SHN_LORESERVE;
+            NewSymbol.st_shndx = SectionNameMap.at(OutputSection.getName());
+
+            // TODO: use getNewValueForSymbol()?
+            NewSymbol.st_value = BD->getOutputAddress();
+          }
+
+          if (OldSectionIndex < ELF::SHN_LORESERVE) {
+            NewSymbol.st_shndx = NewSectionIndex[OldSectionIndex];
+          }
+
+          // Detect local syms in the text section that we didn't update
+          // and were preserved by the linker to support relocations against
+          // .text (t15274167). Remove then from the symtab.
+          if (NewSymbol.getType() == ELF::STT_NOTYPE &&
+              NewSymbol.getBinding() == ELF::STB_LOCAL &&
+              NewSymbol.st_size == 0) {
+            auto ExpectedSec = Obj->getSection(NewSymbol.st_shndx);
+            if (ExpectedSec) {
+              auto Section = *ExpectedSec;
+              if (Section->sh_type == ELF::SHT_PROGBITS &&
+                  Section->sh_flags & ELF::SHF_ALLOC &&
+                  Section->sh_flags & ELF::SHF_EXECINSTR) {
+                // This will cause the symbol to not be emitted if we are
+                // creating a new symtab from scratch instead of patching one.
+                if (!PatchExisting)
+                  continue;
+                // If patching an existing symtab, patch this value to zero.
+                NewSymbol.st_value = 0;
+              }
+            } else {
+              consumeError(ExpectedSec.takeError());
             }
-          } else {
-            consumeError(ExpectedSec.takeError());
           }
         }
-      }
 
-      auto SymbolName = Symbol.getName(StringSection);
-      assert(SymbolName && "cannot get symbol name");
+        auto SymbolName = Symbol.getName(StringSection);
+        assert(SymbolName && "cannot get symbol name");
 
-      auto updateSymbolValue = [&](const StringRef Name, unsigned &IsUpdated) {
-        NewSymbol.st_value = getNewValueForSymbol(Name);
-        NewSymbol.st_shndx = ELF::SHN_ABS;
-        outs() << "BOLT-INFO: setting " << Name << " to 0x"
-               << Twine::utohexstr(NewSymbol.st_value) << '\n';
-        ++IsUpdated;
-        return true;
-      };
+        Entries.push_back({NewSymbol, I, isSpecialSymbol(*SymbolName), ""});
+      }
+    };
+
+    const size_t NumSymbols = Symbols.size();
+    size_t ChunkSize = std::max<size_t>(1, NumSymbols);
+    if (ParallelUtilities::isParallel()) {
+      ChunkSize = std::max<size_t>(
+          1024, NumSymbols / (ParallelUtilities::getThreadCount() * 20));
+    }
+    std::vector<std::vector<SymbolEntry>> Chunks(
+        (NumSymbols + ChunkSize - 1) / ChunkSize);
+    auto updateChunk = [&](size_t ChunkIndex) {
+      const auto Begin = ChunkIndex * ChunkSize;
+      updateSymbols(Begin, std::min(NumSymbols, Begin + ChunkSize),
+                    Chunks[ChunkIndex]);
+    };
+    if (Chunks.size() > 1) {
+      auto &ThPool = ParallelUtilities::getThreadPool();
+      for (size_t I = 0; I < Chunks.size(); ++I)
+        ThPool.async(updateChunk, I);
+      ThPool.wait();
+    } else if (!Chunks.empty()) {
+      updateChunk(0);
+    }
 
-      if (opts::HotText && (*SymbolName == "__hot_start" ||
-                            *SymbolName == "__hot_end"))
-        updateSymbolValue(*SymbolName, IsHotTextUpdated);
+    // Write the entries in the order of the input symbols, so that the
+    // output does not depend on the number of threads.
+    for (auto &Entries : Chunks) {
+      for (auto &Entry : Entries) {
+        auto &NewSymbol = Entry.Symbol;
+        if (Entry.Index == NewEntry) {
+          NewSymbol.st_name = AddToStrTab(Entry.Name);
+          Write(0, reinterpret_cast<const char *>(&NewSymbol),
+                sizeof(NewSymbol));
+          continue;
+        }
 
-      if (opts::HotData && (*SymbolName == "__hot_data_start" ||
-                            *SymbolName == "__hot_data_end"))
-        updateSymbolValue(*SymbolName, IsHotDataUpdated);
+        if (Entry.IsSpecial) {
+          const auto SymbolName =
+              cantFail(Symbols[Entry.Index].getName(StringSection));
+
+          auto updateSymbolValue = [&](const StringRef Name,
+                                       unsigned &IsUpdated) {
+            NewSymbol.st_value = getNewValueForSymbol(Name);
+            NewSymbol.st_shndx = ELF::SHN_ABS;
+            outs() << "BOLT-INFO: setting " << Name << " to 0x"
+                   << Twine::utohexstr(NewSymbol.st_value) << '\n';
+            ++IsUpdated;
+            return true;
+          };
+
+          if (opts::HotText && (SymbolName == "__hot_start" ||
+                                SymbolName == "__hot_end"))
+            updateSymbolValue(SymbolName, IsHotTextUpdated);
+
+          if (opts::HotData && (SymbolName == "__hot_data_start" ||
+                                SymbolName == "__hot_data_end"))
+            updateSymbolValue(SymbolName, IsHotDataUpdated);
+
+          if (opts::UpdateEnd && SymbolName == "_end") {
+            NewSymbol.st_value = getNewValueForSymbol(SymbolName);
+            NewSymbol.st_shndx = ELF::SHN_ABS;
+            outs() << "BOLT-INFO: setting " << SymbolName << " to 0x"
+                   << Twine::utohexstr(NewSymbol.st_value) << '\n';
+          }
+        }
 
-      if (opts::UpdateEnd && *SymbolName == "_end") {
-        NewSymbol.st_value = getNewValueForSymbol(*SymbolName);
-        NewSymbol.st_shndx = ELF::SHN_ABS;
-        outs() << "BOLT-INFO: setting " << *SymbolName << " to 0x"
-               << Twine::utohexstr(NewSymbol.st_value) << '\n';
+        Write(Entry.Index * sizeof(Elf_Sym),
+              reinterpret_cast<const char *>(&NewSymbol), sizeof(NewSymbol));
       }
-
-      Write((&Symbol - cantFail(Obj->symbols(Section)).begin()) *
-                sizeof(Elf_Sym),
-            reinterpret_cast<const char *>(&NewSymbol), sizeof(NewSymbol));
     }
 
     assert((!IsHotTextUpdated || IsHotTextUpdated == 2) &&
@@ -4151,6 +5044,9 @@ void RewriteInstance::patchELFSymTabs(ELFObjectFile<ELFT> *File) {
   std::string NewContents;
   std::string NewStrTab =
       File->getData().substr(StrTabSection->sh_offset, StrTabSection->sh_size);
+  // Names added to the string table, which are mostly repeated mapping
+  // symbols.
+  StringMap<size_t> NewStrings;
   auto SecName = cantFail(Obj->getSectionName(SymTabSection));
   auto StrSecName = cantFail(Obj->getSectionName(StrTabSection));
 
@@ -4160,10 +5056,13 @@ void RewriteInstance::patchELFSymTabs(ELFObjectFile<ELFT> *File) {
                       NewContents.append(Buf, Size);
                     },
                     [&](StringRef Str) {
-                      size_t Idx = NewStrTab.size();
-                      NewStrTab.append(Str.data(), Str.size());
-                      NewStrTab.append(1, '\0');
-                      return Idx;
+                      auto Iter = NewStrings.insert(
+                          std::make_pair(Str, NewStrTab.size()));
+                      if (Iter.second) {
+                        NewStrTab.append(Str.data(), Str.size());
+                        NewStrTab.append(1, '\0');
+                      }
+                      return Iter.first->second;
                     });
 
   BC->registerOrUpdateNoteSection(SecName,
@@ -4207,6 +5106,41 @@ void RewriteInstance::patchELFRelaPLT(ELFObjectFile<ELFT> *File) {
   }
 }
 
+template <typename ELFT>
+void RewriteInstance::patchELFRelaDyn(ELFObjectFile<ELFT> *File) {
+  if (BC->HasFixedLoadAddress || !RelaDynSection)
+    return;
+
+  auto &OS = Out->os();
+  for (const auto &Rel : RelaDynSection->getSectionRef().relocations()) {
+    if (!Relocation::isRelative(Rel.getType()))
+      continue;
+    DataRefImpl DRI = Rel.getRawDataRefImpl();
+    const auto *RelA = File->getRela(DRI);
+    const uint64_t Address = RelA->r_addend;
+    const auto *Function = getBinaryFunctionContainingAddress(Address);
+    if (!Function)
+      continue;
+    const auto NewAddress = Function->getAddress() == Address
+      ? Function->getOutputAddress()
+      : Function->translateInputToOutputAddress(Address);
+    if (!NewAddress) {
+      errs() << "BOLT-ERROR: cannot update dynamic relocation against 0x"
+             << Twine::utohexstr(Address) << " in " << *Function << '\n';
+      exit(1);
+    }
+    if (NewAddress == Address)
+      continue;
+    DEBUG(dbgs() << "BOLT-DEBUG: patching .rela.dyn entry 0x"
+                 << Twine::utohexstr(Address) << " with 0x"
+                 << Twine::utohexstr(NewAddress) << '\n');
+    auto NewRelA = *RelA;
+    NewRelA.r_addend = NewAddress;
+    OS.pwrite(reinterpret_cast<const char *>(&NewRelA), sizeof(NewRelA),
+      reinterpret_cast<const char *>(RelA) - File->getData().data());
+  }
+}
+
 template <typename ELFT>
 void RewriteInstance::patchELFGOT(ELFObjectFile<ELFT> *File) {
   auto &OS = Out->os();
@@ -4322,7 +5256,47 @@ uint64_t RewriteInstance::getNewFunctionAddress(uint64_t OldAddress) {
   return Function->getOutputAddress();
 }
 
+void RewriteInstance::patchFunctionsInPlace(raw_pwrite_stream &OS) {
+  uint64_t NumPatched = 0;
+  for (auto &BFI : BinaryFunctions) {
+    auto &Function = BFI.second;
+    if (!Function.isPatchedInPlace())
+      continue;
+
+    // The references were checked by canPatchInPlace(). They are rewritten
+    // even if their targets did not move, which is harmless.
+    for (const auto &RelI : Function.getMoveRelocations()) {
+      const auto &Rel = RelI.second;
+      uint64_t SymbolAddress;
+      if (const auto *BF = BC->getFunctionForSymbol(Rel.Symbol)) {
+        SymbolAddress = BF->getOutputAddress();
+      } else {
+        const auto *BD = BC->getBinaryDataByName(Rel.Symbol->getName());
+        assert(BD && "unexpected reference in function patched in place");
+        SymbolAddress = BD->isMoved() && !BD->isJumpTable()
+                        ? BD->getOutputAddress()
+                        : BD->getAddress();
+      }
+
+      uint64_t Value = SymbolAddress + Rel.Addend;
+      if (Rel.isPCRelative())
+        Value -= Function.getAddress() + Rel.Offset;
+
+      char Buffer[8];
+      support::endian::write64le(Buffer, Value);
+      OS.pwrite(Buffer, Rel.getSize(), Function.getFileOffset() + Rel.Offset);
+      ++NumPatched;
+    }
+  }
+
+  if (opts::Verbosity >= 1) {
+    outs() << "BOLT-INFO: patched " << NumPatched << " references in "
+           << "functions at their original addresses\n";
+  }
+}
+
 void RewriteInstance::rewriteFile() {
+  PhaseStats::Scope Stats("rewriteFile");
   auto &OS = Out->os();
 
   // We obtain an asm-specific writer so that we can emit nops in an
@@ -4449,7 +5423,7 @@ void RewriteInstance::rewriteFile() {
     // Overwrite function body to make sure we never execute these instructions.
     for (auto &BFI : BinaryFunctions) {
       auto &BF = BFI.second;
-      if (!BF.getFileOffset())
+      if (!BF.getFileOffset() || BF.isPatchedInPlace())
         continue;
       OS.seek(BF.getFileOffset());
       for (unsigned I = 0; I < BF.getMaxSize(); ++I)
@@ -4459,6 +5433,9 @@ void RewriteInstance::rewriteFile() {
     OS.seek(SavedPos);
   }
 
+  if (BC->HasRelocations && opts::PatchInPlace)
+    patchFunctionsInPlace(OS);
+
   // Write all non-local sections, i.e. those not emitted with the function.
   for (auto &Section : BC->allocatableSections()) {
     if (!Section.isFinalized() || Section.isLocal())
@@ -4498,6 +5475,7 @@ void RewriteInstance::rewriteFile() {
     patchELFRelaPLT();
     patchELFGOT();
   }
+  patchELFRelaDyn();
 
   // Update ELF book-keeping info.
   patchELFSectionHeaderTable();
@@ -4624,6 +5602,10 @@ BinaryFunction *
 RewriteInstance::getBinaryFunctionContainingAddress(uint64_t Address,
                                                     bool CheckPastEnd,
                                                     bool UseMaxSize) {
+  if (BC->hasFunctionIndex())
+    return BC->getBinaryFunctionContainingAddress(Address, CheckPastEnd,
+                                                  UseMaxSize);
+
   auto FI = BinaryFunctions.upper_bound(Address);
   if (FI == BinaryFunctions.begin())
     return nullptr;
@@ -4662,5 +5644,21 @@ DWARFAddressRangesVector RewriteInstance::translateModuleAddressRanges(
     }
   }
 
-  return OutputRanges;
+  // Functions are laid out in a different order in the output. Sort the
+  // ranges and merge the contiguous ones to keep the CU lists short.
+  std::sort(OutputRanges.begin(), OutputRanges.end(),
+            [](const DWARFAddressRange &A, const DWARFAddressRange &B) {
+              return A.LowPC < B.LowPC;
+            });
+  DWARFAddressRangesVector MergedRanges;
+  for (const auto &Range : OutputRanges) {
+    if (!MergedRanges.empty() && Range.LowPC <= MergedRanges.back().HighPC) {
+      MergedRanges.back().HighPC =
+          std::max(MergedRanges.back().HighPC, Range.HighPC);
+      continue;
+    }
+    MergedRanges.emplace_back(Range.LowPC, Range.HighPC);
+  }
+
+  return MergedRanges;
 }
@@ -139,19 +139,44 @@ public:
   /// Read relocations from a given section.
   void readRelocations(const object::SectionRef &Section);
 
+  /// Register code addresses set by dynamic relocations of a
+  /// position-independent binary, so that they stay valid in the output.
+  void readDynamicRelocations();
+
   /// Read information from debug sections.
   void readDebugInfo();
 
   /// Associate profile data with binary objects.
   void processProfileData();
 
+  /// Read the profiles given with -profile-variants and set them for the
+  /// functions, to be attached with their profiles.
+  void readProfileVariants();
+
   /// Disassemble each function in the binary and associate it with a
   /// BinaryFunction object, preparing all information necessary for binary
   /// optimization.
   void disassembleFunctions();
 
+  /// Update functions targeted by references collected during disassembly in
+  /// BC->InterproceduralReferences, and clear the collection.
+  void processInterproceduralReferences();
+
   void postProcessFunctions();
 
+  /// Return true if \p Function can stay at its input address in relocation
+  /// mode, with its references to other functions and to data patched in
+  /// the output file.
+  bool canPatchInPlace(const BinaryFunction &Function) const;
+
+  /// With -patch-in-place, keep the functions that were not executed according
+  /// to the profile at their input addresses.
+  void markColdFunctionsInPlace();
+
+  /// Update the references to code and data in the bodies of the functions
+  /// kept at their input addresses, writing them to \p OS.
+  void patchFunctionsInPlace(raw_pwrite_stream &OS);
+
   /// Run optimizations that operate at the binary, or post-linker, level.
   void runOptimizationPasses();
 
@@ -175,8 +200,17 @@ public:
   /// Recursively update debug info for all DIEs in \p Unit.
   /// If \p Function is not empty, it points to a function corresponding
   /// to a parent DW_TAG_subprogram node of the current \p DIE.
+  /// The updates are recorded in \p Update.
   void updateUnitDebugInfo(const DWARFDie DIE,
-                           std::vector<const BinaryFunction *> FunctionStack);
+                           std::vector<const BinaryFunction *> FunctionStack,
+                           DebugInfoUpdate &Update);
+
+  /// Update the parts of the main binary that split DWARF units in \p Units
+  /// refer to without reading their .dwo files. Addresses in .debug_addr and
+  /// in the .debug_ranges lists of the split units are translated to the
+  /// output. Return the translated contents of .debug_ranges that have to be
+  /// kept at their original offsets, or an empty string.
+  std::string updateSplitDebugInfo(const std::vector<DWARFUnit *> &Units);
 
   /// Map all sections to their final addresses.
   void mapTextSections(orc::VModuleKey ObjectsHandle);
@@ -186,6 +220,12 @@ public:
   /// Update output object's values based on the final \p Layout.
   void updateOutputValues(const MCAsmLayout &Layout);
 
+  /// Update output addresses and sizes of \p Function and its basic blocks
+  /// based on the final \p Layout. Offsets of all fragments in the layout
+  /// must have been computed already.
+  void updateFunctionOutputValues(BinaryFunction &Function,
+                                  const MCAsmLayout &Layout);
+
   /// Check which functions became larger than their original version and
   /// annotate function splitting information.
   ///
@@ -238,6 +278,7 @@ public:
   const BinaryFunction *getBinaryFunctionAtAddress(uint64_t Address) const;
 
   /// Produce output address ranges based on input ranges for some module.
+  /// The output ranges are sorted and adjacent ranges are merged.
   DWARFAddressRangesVector translateModuleAddressRanges(
       const DWARFAddressRangesVector &InputRanges) const;
 
@@ -310,6 +351,10 @@ private:
   /// Patch .rela.plt section.
   ELF_FUNCTION(patchELFRelaPLT);
 
+  /// Update code addresses in the addends of relative relocations in
+  /// .rela.dyn.
+  ELF_FUNCTION(patchELFRelaDyn);
+
   /// Finalize memory image of section header string table.
   ELF_FUNCTION(finalizeSectionStringTable);
 
@@ -326,6 +371,9 @@ private:
   /// Add a notes section containing the BOLT revision and command line options.
   void addBoltInfoSection();
 
+  /// Add a section translating addresses in the output binary to the input.
+  void addBATSection();
+
   /// Computes output .debug_line line table offsets for each compile unit,
   /// and updates stmt_list for a corresponding compile unit.
   void updateLineTableOffsets();
@@ -348,7 +396,8 @@ private:
   /// \p Unit Compile uniit the object belongs to.
   /// \p DIE is the object's DIE in the input binary.
   void updateDWARFObjectAddressRanges(const DWARFDie DIE,
-                                      uint64_t DebugRangesOffset);
+                                      uint64_t DebugRangesOffset,
+                                      DebugInfoUpdate &Update);
 
   /// Return file offset corresponding to a given virtual address.
   uint64_t getFileOffsetFor(uint64_t Address) {
@@ -419,6 +468,9 @@ private:
   /// Holds our data aggregator in case user supplied a raw perf data file.
   DataAggregator &DA;
 
+  /// Readers of the profiles given with -profile-variants.
+  std::vector<std::unique_ptr<DataReader>> ProfileVariantReaders;
+
   std::unique_ptr<BinaryContext> BC;
   std::unique_ptr<CFIReaderWriter> CFIRdWrt;
 
@@ -436,6 +488,9 @@ private:
   /// optimized code for selected functions.
   std::unique_ptr<ToolOutputFile> Out;
 
+  /// File descriptor of Out.
+  int OutFD{-1};
+
   /// Offset in the input file where non-allocatable sections start.
   uint64_t FirstNonAllocatableOffset{0};
 
@@ -473,6 +528,22 @@ private:
 
   uint64_t NewTextSectionStartAddress{0};
 
+  /// Label following the padding at the end of hot code emitted with
+  /// -separate-hot-text, and its output address.
+  MCSymbol *HotTextEndSymbol{nullptr};
+  uint64_t HotTextEndAddress{0};
+
+  /// Labels at the start of hot code and of the startup stub emitted with
+  /// -hugify, and the output address of the stub.
+  MCSymbol *HotTextStartSymbol{nullptr};
+  MCSymbol *HugifyStubSymbol{nullptr};
+  uint64_t HugifyStubAddress{0};
+
+  /// Label and output address of the startup stub mapping the counters
+  /// file of an instrumented binary.
+  MCSymbol *InstrStubSymbol{nullptr};
+  uint64_t InstrStubAddress{0};
+
   uint64_t NewTextSectionIndex{0};
 
   /// Exception handling and stack unwinding information in this binary.
@@ -499,6 +570,13 @@ private:
   /// Contains relocations against .got.plt.
   ErrorOr<BinarySection &> RelaPLTSection{std::errc::bad_address};
 
+  /// .rela.dyn section.
+  ///
+  /// Contains dynamic relocations other than those of the PLT. In a
+  /// position-independent binary these include a relative relocation for
+  /// every absolute address stored in data.
+  ErrorOr<BinarySection &> RelaDynSection{std::errc::bad_address};
+
   /// .gdb_index section.
   ErrorOr<BinarySection &> GdbIndexSection{std::errc::bad_address};
 
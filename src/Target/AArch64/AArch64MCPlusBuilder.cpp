@@ -69,6 +69,34 @@ public:
     return false;
   }
 
+  std::vector<PeepholePattern> getPeepholePatterns() override {
+    std::vector<PeepholePattern> Patterns;
+
+    // mov xN, xN, in the orr and add forms. The 32-bit forms are not
+    // redundant since they clear the upper half of the register.
+    Patterns.push_back({"redundant-mov",
+      [](MutableArrayRef<MCInst> Insts, unsigned Index) {
+        const auto &Inst = Insts[Index];
+        switch (Inst.getOpcode()) {
+        default:
+          return PeepholeAction::NONE;
+        case AArch64::ORRXrs:
+          if (Inst.getOperand(1).getReg() != AArch64::XZR ||
+              Inst.getOperand(0).getReg() != Inst.getOperand(2).getReg() ||
+              Inst.getOperand(3).getImm() != 0)
+            return PeepholeAction::NONE;
+          return PeepholeAction::ERASE;
+        case AArch64::ADDXri:
+          if (Inst.getOperand(0).getReg() != Inst.getOperand(1).getReg() ||
+              !Inst.getOperand(2).isImm() || Inst.getOperand(2).getImm() != 0)
+            return PeepholeAction::NONE;
+          return PeepholeAction::ERASE;
+        }
+      }});
+
+    return Patterns;
+  }
+
   bool isADRP(const MCInst &Inst) const override {
     return Inst.getOpcode() == AArch64::ADRP;
   }
@@ -476,16 +504,15 @@ public:
       //   BR     x2
       return false;
     }
-    assert(DefAdd->getOpcode() == AArch64::ADDXrx &&
-           "Failed to match indirect branch!");
+    if (DefAdd->getOpcode() != AArch64::ADDXrx)
+      return false;
 
     // Validate ADD operands
     auto OperandExtension = DefAdd->getOperand(3).getImm();
     auto ShiftVal = AArch64_AM::getArithShiftValue(OperandExtension);
     auto ExtendType = AArch64_AM::getArithExtendType(OperandExtension);
-    if (ShiftVal != 2) {
-      llvm_unreachable("Failed to match indirect branch! (fragment 2)");
-    }
+    if (ShiftVal != 2)
+      return false;
     if (ExtendType == AArch64_AM::SXTB) {
       ScaleValue = 1LL;
     } else if (ExtendType == AArch64_AM::SXTH) {
@@ -493,33 +520,35 @@ public:
     } else if (ExtendType == AArch64_AM::SXTW) {
       ScaleValue = 4LL;
     } else {
-      llvm_unreachable("Failed to match indirect branch! (fragment 3)");
+      return false;
     }
 
     // Match an ADR to load base address to be used when addressing JT targets
     auto &UsesAdd = UDChain[DefAdd];
-    if (UsesAdd.size() <= 1 || UsesAdd[1] == nullptr || UsesAdd[2] == nullptr) {
+    if (UsesAdd.size() < 3 || UsesAdd[1] == nullptr || UsesAdd[2] == nullptr) {
       // This happens when we don't have enough context about this jump table
       // because the jumping code sequence was split in multiple basic blocks.
       // This was observed in the wild in HHVM code (dispatchImpl).
       return false;
     }
     auto *DefBaseAddr = UsesAdd[1];
-    assert(DefBaseAddr->getOpcode() == AArch64::ADR &&
-           "Failed to match indirect branch pattern! (fragment 3)");
+    if (DefBaseAddr->getOpcode() != AArch64::ADR)
+      return false;
 
-    PCRelBase = DefBaseAddr;
     // Match LOAD to load the jump table (relative) target
     const auto *DefLoad = UsesAdd[2];
-    assert(isLoad(*DefLoad) &&
-           "Failed to match indirect branch load pattern! (1)");
-    assert((ScaleValue != 1LL || isLDRB(*DefLoad)) &&
-           "Failed to match indirect branch load pattern! (2)");
-    assert((ScaleValue != 2LL || isLDRH(*DefLoad)) &&
-           "Failed to match indirect branch load pattern! (3)");
+    if (!isLoad(*DefLoad) ||
+        (ScaleValue == 1LL && !isLDRB(*DefLoad)) ||
+        (ScaleValue == 2LL && !isLDRH(*DefLoad)))
+      return false;
+    PCRelBase = DefBaseAddr;
 
     // Match ADD that calculates the JumpTable Base Address (not the offset)
     auto &UsesLoad = UDChain[DefLoad];
+    if (UsesLoad.size() < 2) {
+      JumpTable = nullptr;
+      return true;
+    }
     const auto *DefJTBaseAdd = UsesLoad[1];
     MCPhysReg From, To;
     if (DefJTBaseAdd == nullptr || isLoadFromStack(*DefJTBaseAdd) ||
@@ -530,19 +559,21 @@ public:
       return true;
     }
 
-    assert(DefJTBaseAdd->getOpcode() == AArch64::ADDXri &&
-           "Failed to match jump table base address pattern! (1)");
+    if (DefJTBaseAdd->getOpcode() != AArch64::ADDXri) {
+      JumpTable = nullptr;
+      return true;
+    }
 
+    Offset = 0;
     if (DefJTBaseAdd->getOperand(2).isImm())
       Offset = DefJTBaseAdd->getOperand(2).getImm();
     auto &UsesJTBaseAdd = UDChain[DefJTBaseAdd];
-    const auto *DefJTBasePage = UsesJTBaseAdd[1];
-    if (DefJTBasePage == nullptr || isLoadFromStack(*DefJTBasePage)) {
+    const auto *DefJTBasePage =
+      UsesJTBaseAdd.size() > 1 ? UsesJTBaseAdd[1] : nullptr;
+    if (DefJTBasePage == nullptr || !isADRP(*DefJTBasePage)) {
       JumpTable = nullptr;
       return true;
     }
-    assert(DefJTBasePage->getOpcode() == AArch64::ADRP &&
-           "Failed to match jump table base page pattern! (2)");
     if (DefJTBasePage->getOperand(1).isExpr())
       JumpTable = DefJTBasePage->getOperand(1).getExpr();
     return true;
@@ -635,8 +666,8 @@ public:
     MCInst *MemLocInstr = nullptr;
 
     // Analyze the memory location.
-    int64_t       ScaleValue, DispValue;
-    const MCExpr *DispExpr;
+    int64_t       ScaleValue, DispValue{0};
+    const MCExpr *DispExpr{nullptr};
 
     auto UDChain = computeLocalUDChain(&Instruction, Begin, End);
     MCInst *PCRelBase;
@@ -652,6 +683,230 @@ public:
     return IndirectBranchType::POSSIBLE_PIC_JUMP_TABLE;
   }
 
+  /// Return the number of entries of the table read by \p Load from the
+  /// bounds check of its index register, which has to precede the load in
+  /// [\p Begin, \p End) with nothing changing the index in between.
+  uint64_t getScaledJumpTableBound(const MCInst &Load,
+                                   InstructionIterator Begin,
+                                   InstructionIterator End) const {
+    auto II = End;
+    bool FoundLoad = false;
+    while (II != Begin && !FoundLoad) {
+      --II;
+      FoundLoad = &*II == &Load;
+    }
+    if (!FoundLoad)
+      return 0;
+
+    const auto IndexReg = Load.getOperand(2).getReg();
+    const MCInst *CondBranch = nullptr;
+    while (II != Begin) {
+      --II;
+      const auto &Inst = *II;
+      if (Info->get(Inst.getOpcode()).isPseudo() || isNoop(Inst))
+        continue;
+
+      if (!CondBranch) {
+        if (Inst.getOpcode() == AArch64::Bcc) {
+          CondBranch = &Inst;
+          continue;
+        }
+        if (isTerminator(Inst) || isCall(Inst))
+          return 0;
+        BitVector Written(RegInfo->getNumRegs(), false);
+        getWrittenRegs(Inst, Written);
+        if (Written[IndexReg])
+          return 0;
+        continue;
+      }
+
+      // The flags for the branch have to come from comparing the index
+      // with an immediate.
+      if ((Inst.getOpcode() != AArch64::SUBSWri &&
+           Inst.getOpcode() != AArch64::SUBSXri) ||
+          (Inst.getOperand(0).getReg() != AArch64::WZR &&
+           Inst.getOperand(0).getReg() != AArch64::XZR) ||
+          !RegInfo->isSuperOrSubRegisterEq(Inst.getOperand(1).getReg(),
+                                           IndexReg) ||
+          !Inst.getOperand(2).isImm() || Inst.getOperand(3).getImm() != 0)
+        return 0;
+
+      const uint64_t Limit = Inst.getOperand(2).getImm();
+      switch (CondBranch->getOperand(0).getImm()) {
+      case AArch64CC::HI:
+        return Limit + 1;
+      case AArch64CC::HS:
+        return Limit;
+      default:
+        return 0;
+      }
+    }
+    return 0;
+  }
+
+  bool analyzeScaledJumpTable(MCInst &Instruction,
+                              InstructionIterator Begin,
+                              InstructionIterator End,
+                              ScaledJumpTable &Jump) const override {
+    if (Instruction.getOpcode() != AArch64::BR)
+      return false;
+
+    auto UDChain = computeLocalUDChain(&Instruction, Begin, End);
+    auto &UsesRoot = UDChain[&Instruction];
+    if (UsesRoot.empty() || !UsesRoot[0])
+      return false;
+
+    // add xB, xB, wI, sxt? #2
+    auto *TargetAdd = UsesRoot[0];
+    if (TargetAdd->getOpcode() != AArch64::ADDXrx)
+      return false;
+    const auto Extend = TargetAdd->getOperand(3).getImm();
+    if (AArch64_AM::getArithShiftValue(Extend) != 2)
+      return false;
+    switch (AArch64_AM::getArithExtendType(Extend)) {
+    default:
+      return false;
+    case AArch64_AM::SXTB: Jump.EntrySize = 1; break;
+    case AArch64_AM::SXTH: Jump.EntrySize = 2; break;
+    case AArch64_AM::SXTW: Jump.EntrySize = 4; break;
+    }
+
+    auto &UsesAdd = UDChain[TargetAdd];
+    if (UsesAdd.size() < 3 || !UsesAdd[1] || !UsesAdd[2] ||
+        !isADR(*UsesAdd[1]))
+      return false;
+    auto *PCRelBase = UsesAdd[1];
+
+    // The load has to index the table by entries of the size the add
+    // expects. Only forms rewriteScaledJumpTable() can widen are accepted.
+    auto *Load = UsesAdd[2];
+    unsigned LoadSize;
+    switch (Load->getOpcode()) {
+    default:
+      return false;
+    case AArch64::LDRBBroW:
+    case AArch64::LDRBBroX:
+      LoadSize = 1;
+      break;
+    case AArch64::LDRHHroW:
+    case AArch64::LDRHHroX:
+      LoadSize = 2;
+      break;
+    case AArch64::LDRWroW:
+    case AArch64::LDRWroX:
+      LoadSize = 4;
+      break;
+    }
+    if (LoadSize != Jump.EntrySize ||
+        (LoadSize > 1 && Load->getOperand(4).getImm() != 1))
+      return false;
+
+    // adrp xT, JT ; add xT, xT, :lo12:JT
+    auto &UsesLoad = UDChain[Load];
+    if (UsesLoad.size() < 3 || !UsesLoad[1])
+      return false;
+    auto *TableLow = UsesLoad[1];
+    if (TableLow->getOpcode() != AArch64::ADDXri ||
+        !TableLow->getOperand(2).isExpr())
+      return false;
+    auto &UsesLow = UDChain[TableLow];
+    if (UsesLow.size() < 2 || !UsesLow[1] || !isADRP(*UsesLow[1]))
+      return false;
+
+    const auto *TableExpr = TableLow->getOperand(2).getExpr();
+    if (const auto *AArchExpr = dyn_cast<AArch64MCExpr>(TableExpr))
+      TableExpr = AArchExpr->getSubExpr();
+
+    const auto NumEntries = getScaledJumpTableBound(*Load, Begin, End);
+    if (!NumEntries)
+      return false;
+
+    Jump.TablePage = UsesLow[1];
+    Jump.TableLow = TableLow;
+    Jump.Load = Load;
+    Jump.PCRelBase = PCRelBase;
+    Jump.TargetAdd = TargetAdd;
+    Jump.TableExpr = TableExpr;
+    Jump.NumEntries = NumEntries;
+    return true;
+  }
+
+  bool rewriteScaledJumpTable(const ScaledJumpTable &Jump,
+                              const MCSymbol *Table,
+                              const MCSymbol *Base,
+                              MCContext *Ctx) const override {
+    auto *TableSym = const_cast<MCSymbol *>(Table);
+    setOperandToSymbolRef(*Jump.TablePage, 1, TableSym, 0, Ctx,
+                          ELF::R_AARCH64_ADR_PREL_PG_HI21);
+    setOperandToSymbolRef(*Jump.TableLow, 2, TableSym, 0, Ctx,
+                          ELF::R_AARCH64_ADD_ABS_LO12_NC);
+    replaceMemOperandDisp(*Jump.PCRelBase,
+                          MCOperand::createExpr(MCSymbolRefExpr::create(
+                              Base, MCSymbolRefExpr::VK_None, *Ctx)));
+
+    switch (Jump.Load->getOpcode()) {
+    case AArch64::LDRBBroW:
+    case AArch64::LDRHHroW:
+      Jump.Load->setOpcode(AArch64::LDRWroW);
+      break;
+    case AArch64::LDRBBroX:
+    case AArch64::LDRHHroX:
+      Jump.Load->setOpcode(AArch64::LDRWroX);
+      break;
+    }
+    Jump.Load->getOperand(4).setImm(1);
+    Jump.TargetAdd->getOperand(3).setImm(
+        AArch64_AM::getArithExtendImm(AArch64_AM::SXTW, 2));
+    return true;
+  }
+
+  bool setScaledJumpTableEntrySize(MCInst &Instruction,
+                                   InstructionIterator Begin,
+                                   InstructionIterator End,
+                                   unsigned EntrySize) const override {
+    if (Instruction.getOpcode() != AArch64::BR)
+      return false;
+
+    auto UDChain = computeLocalUDChain(&Instruction, Begin, End);
+    auto &UsesRoot = UDChain[&Instruction];
+    if (UsesRoot.empty() || !UsesRoot[0])
+      return false;
+    auto *TargetAdd = UsesRoot[0];
+    if (TargetAdd->getOpcode() != AArch64::ADDXrx ||
+        TargetAdd->getOperand(3).getImm() !=
+          AArch64_AM::getArithExtendImm(AArch64_AM::SXTW, 2))
+      return false;
+
+    auto &UsesAdd = UDChain[TargetAdd];
+    if (UsesAdd.size() < 3 || !UsesAdd[2])
+      return false;
+    auto *Load = UsesAdd[2];
+    bool IsW;
+    switch (Load->getOpcode()) {
+    default:
+      return false;
+    case AArch64::LDRWroW: IsW = true; break;
+    case AArch64::LDRWroX: IsW = false; break;
+    }
+
+    // The narrow loads zero-extend the entry, which the add then treats as
+    // a positive 32-bit value.
+    switch (EntrySize) {
+    default:
+      return false;
+    case 1:
+      Load->setOpcode(IsW ? AArch64::LDRBBroW : AArch64::LDRBBroX);
+      Load->getOperand(4).setImm(0);
+      break;
+    case 2:
+      Load->setOpcode(IsW ? AArch64::LDRHHroW : AArch64::LDRHHroX);
+      break;
+    case 4:
+      break;
+    }
+    return true;
+  }
+
   unsigned getInvertedBranchOpcode(unsigned Opcode) const {
     switch (Opcode) {
     default:
@@ -763,6 +1018,10 @@ public:
     return true;
   }
 
+  Optional<uint32_t> getKnownInstructionSize(const MCInst &) const override {
+    return 4;
+  }
+
   bool isNoop(const MCInst &Inst) const override {
     return Inst.getOpcode() == AArch64::HINT &&
            Inst.getOperand(0).getImm() == 0;
@@ -921,6 +1180,34 @@ public:
     Seq.emplace_back(Inst);
   }
 
+  void createIndirectLongJmp(std::vector<MCInst> &Seq,
+                             const MCSymbol *TargetLocation,
+                             MCContext *Ctx) const override {
+    // Same as a PLT entry, ip0 (r16) keeps the address of the GOT entry and
+    // ip1 (r17) the target loaded from it, as expected by the lazy binding
+    // resolver:
+    //  movz ip0, #:abs_g3:<addr>
+    //  movk ip0, #:abs_g2_nc:<addr>
+    //  movk ip0, #:abs_g1_nc:<addr>
+    //  movk ip0, #:abs_g0_nc:<addr>
+    //  ldr ip1, [ip0]
+    //  br ip1
+    createLongJmp(Seq, TargetLocation, Ctx);
+    Seq.pop_back();
+
+    MCInst Inst;
+    Inst.setOpcode(AArch64::LDRXui);
+    Inst.addOperand(MCOperand::createReg(AArch64::X17));
+    Inst.addOperand(MCOperand::createReg(AArch64::X16));
+    Inst.addOperand(MCOperand::createImm(0));
+    Seq.emplace_back(Inst);
+
+    Inst.clear();
+    Inst.setOpcode(AArch64::BR);
+    Inst.addOperand(MCOperand::createReg(AArch64::X17));
+    Seq.emplace_back(Inst);
+  }
+
   /// Matching pattern here is
   ///
   ///    ADRP  x16, imm
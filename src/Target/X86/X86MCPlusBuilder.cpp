@@ -12,6 +12,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "MCPlusBuilder.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/DebugInfo/CodeView/CodeView.h"
 #include "llvm/MC/MCContext.h"
@@ -216,6 +217,79 @@ unsigned getInvertedBranchOpcode(unsigned Opcode) {
   }
 }
 
+/// Return the opcode of the 64-bit conditional move that takes place under
+/// the condition on which branch \p Opcode is taken, or 0 if there is none.
+unsigned getCMov64Opcode(unsigned Opcode) {
+  switch (Opcode) {
+  default:
+    return 0;
+  case X86::JE_1:
+  case X86::JE_2:
+  case X86::JE_4:
+    return X86::CMOVE64rr;
+  case X86::JNE_1:
+  case X86::JNE_2:
+  case X86::JNE_4:
+    return X86::CMOVNE64rr;
+  case X86::JL_1:
+  case X86::JL_2:
+  case X86::JL_4:
+    return X86::CMOVL64rr;
+  case X86::JLE_1:
+  case X86::JLE_2:
+  case X86::JLE_4:
+    return X86::CMOVLE64rr;
+  case X86::JG_1:
+  case X86::JG_2:
+  case X86::JG_4:
+    return X86::CMOVG64rr;
+  case X86::JGE_1:
+  case X86::JGE_2:
+  case X86::JGE_4:
+    return X86::CMOVGE64rr;
+  case X86::JB_1:
+  case X86::JB_2:
+  case X86::JB_4:
+    return X86::CMOVB64rr;
+  case X86::JBE_1:
+  case X86::JBE_2:
+  case X86::JBE_4:
+    return X86::CMOVBE64rr;
+  case X86::JA_1:
+  case X86::JA_2:
+  case X86::JA_4:
+    return X86::CMOVA64rr;
+  case X86::JAE_1:
+  case X86::JAE_2:
+  case X86::JAE_4:
+    return X86::CMOVAE64rr;
+  case X86::JS_1:
+  case X86::JS_2:
+  case X86::JS_4:
+    return X86::CMOVS64rr;
+  case X86::JNS_1:
+  case X86::JNS_2:
+  case X86::JNS_4:
+    return X86::CMOVNS64rr;
+  case X86::JP_1:
+  case X86::JP_2:
+  case X86::JP_4:
+    return X86::CMOVP64rr;
+  case X86::JNP_1:
+  case X86::JNP_2:
+  case X86::JNP_4:
+    return X86::CMOVNP64rr;
+  case X86::JO_1:
+  case X86::JO_2:
+  case X86::JO_4:
+    return X86::CMOVO64rr;
+  case X86::JNO_1:
+  case X86::JNO_2:
+  case X86::JNO_4:
+    return X86::CMOVNO64rr;
+  }
+}
+
 bool isADD(unsigned Opcode) {
   switch (Opcode) {
   default:
@@ -466,11 +540,87 @@ bool isTEST(unsigned Opcode) {
 }
 
 class X86MCPlusBuilder : public MCPlusBuilder {
+  /// Sizes of encoded instructions keyed by the shape of the instruction,
+  /// see getSizeKey().
+  mutable StringMap<uint32_t> SizeCache;
+  mutable sys::RWMutex SizeCacheMutex;
+
+  /// Fill \p Key with everything that determines the size of the encoding
+  /// of \p Inst: the opcode, the prefix flags and, for each operand, the
+  /// register or the range of the immediate. The width of an immediate is
+  /// fixed by the opcode, and a displacement is sized by its range. Return
+  /// false if the size could depend on anything else.
+  bool getSizeKey(const MCInst &Inst, SmallVectorImpl<char> &Key) const {
+    // EVEX compresses 8-bit displacements depending on the operand size.
+    if (hasEVEXEncoding(Inst))
+      return false;
+
+    auto append = [&](uint64_t Value, unsigned Bytes) {
+      for (unsigned I = 0; I < Bytes; ++I)
+        Key.push_back(static_cast<char>(Value >> (I * 8)));
+    };
+    auto immRange = [](int64_t Imm) -> char {
+      if (Imm == 0)
+        return 0;
+      if (isInt<8>(Imm))
+        return 1;
+      if (isInt<32>(Imm))
+        return 2;
+      return 3;
+    };
+
+    append(Inst.getOpcode(), 4);
+    append(Inst.getFlags(), 4);
+    for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I < E; ++I) {
+      const auto &Op = Inst.getOperand(I);
+      if (Op.isReg()) {
+        Key.push_back('r');
+        append(Op.getReg(), 2);
+      } else if (Op.isImm()) {
+        Key.push_back('i');
+        Key.push_back(immRange(Op.getImm()));
+      } else if (Op.isExpr()) {
+        int64_t Value;
+        if (Op.getExpr()->evaluateAsAbsolute(Value)) {
+          Key.push_back('c');
+          Key.push_back(immRange(Value));
+        } else if (Op.getExpr()->getKind() != MCExpr::Target) {
+          Key.push_back('e');
+        } else {
+          return false;
+        }
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
 public:
   X86MCPlusBuilder(const MCInstrAnalysis *Analysis, const MCInstrInfo *Info,
                        const MCRegisterInfo *RegInfo)
     : MCPlusBuilder(Analysis, Info, RegInfo) {}
 
+  Optional<uint32_t>
+  getKnownInstructionSize(const MCInst &Inst) const override {
+    SmallString<32> Key;
+    if (!getSizeKey(Inst, Key))
+      return NoneType();
+    sys::ScopedReader Lock(SizeCacheMutex);
+    auto Itr = SizeCache.find(Key);
+    if (Itr == SizeCache.end())
+      return NoneType();
+    return Itr->second;
+  }
+
+  void recordInstructionSize(const MCInst &Inst, uint32_t Size) const override {
+    SmallString<32> Key;
+    if (!getSizeKey(Inst, Key))
+      return;
+    sys::ScopedWriter Lock(SizeCacheMutex);
+    SizeCache[Key] = Size;
+  }
+
   bool isNoop(const MCInst &Inst) const override {
     switch (Inst.getOpcode()) {
     case X86::NOOP:
@@ -1641,6 +1791,90 @@ public:
     return true;
   }
 
+  bool evaluateBranchCondition(const MCInst &FlagsInst,
+                               const MCInst &CondBranch,
+                               std::pair<MCPhysReg, int64_t> Input1,
+                               std::pair<MCPhysReg, int64_t> Input2,
+                               bool &Taken) const override {
+    auto getOperandVal = [&] (const MCOperand &Op) -> ErrorOr<int64_t> {
+      if (Op.isImm())
+        return Op.getImm();
+      if (Op.isReg() && Op.getReg() == Input1.first)
+        return Input1.second;
+      if (Op.isReg() && Op.getReg() == Input2.first)
+        return Input2.second;
+      return make_error_code(errc::result_out_of_range);
+    };
+
+    unsigned Size;
+    bool IsTest = false;
+    switch (FlagsInst.getOpcode()) {
+    default:
+      return false;
+    case X86::TEST8ri: case X86::TEST8rr:
+      IsTest = true;
+      // Fall-through
+    case X86::CMP8ri: case X86::CMP8rr:
+      Size = 1;
+      break;
+    case X86::TEST16ri: case X86::TEST16rr:
+      IsTest = true;
+      // Fall-through
+    case X86::CMP16ri: case X86::CMP16ri8: case X86::CMP16rr:
+      Size = 2;
+      break;
+    case X86::TEST32ri: case X86::TEST32rr:
+      IsTest = true;
+      // Fall-through
+    case X86::CMP32ri: case X86::CMP32ri8: case X86::CMP32rr:
+      Size = 4;
+      break;
+    case X86::TEST64ri32: case X86::TEST64rr:
+      IsTest = true;
+      // Fall-through
+    case X86::CMP64ri32: case X86::CMP64ri8: case X86::CMP64rr:
+      Size = 8;
+      break;
+    }
+
+    auto LHSOrErr = getOperandVal(FlagsInst.getOperand(0));
+    auto RHSOrErr = getOperandVal(FlagsInst.getOperand(1));
+    if (!LHSOrErr || !RHSOrErr)
+      return false;
+
+    // Compute the flags on the operand size.
+    const unsigned Bits = Size * 8;
+    const uint64_t Mask = Bits == 64 ? ~0ULL : (1ULL << Bits) - 1;
+    const uint64_t SignBit = 1ULL << (Bits - 1);
+    const uint64_t LHS = static_cast<uint64_t>(*LHSOrErr) & Mask;
+    const uint64_t RHS = static_cast<uint64_t>(*RHSOrErr) & Mask;
+    const uint64_t Result = (IsTest ? LHS & RHS : LHS - RHS) & Mask;
+    const bool ZF = Result == 0;
+    const bool SF = Result & SignBit;
+    const bool CF = !IsTest && LHS < RHS;
+    const bool OF = !IsTest && ((LHS ^ RHS) & (LHS ^ Result) & SignBit);
+
+    switch (getShortBranchOpcode(CondBranch.getOpcode())) {
+    default:
+      return false;
+    case X86::JE_1:  Taken = ZF;                break;
+    case X86::JNE_1: Taken = !ZF;               break;
+    case X86::JB_1:  Taken = CF;                break;
+    case X86::JAE_1: Taken = !CF;               break;
+    case X86::JBE_1: Taken = CF || ZF;          break;
+    case X86::JA_1:  Taken = !CF && !ZF;        break;
+    case X86::JL_1:  Taken = SF != OF;          break;
+    case X86::JGE_1: Taken = SF == OF;          break;
+    case X86::JLE_1: Taken = ZF || SF != OF;    break;
+    case X86::JG_1:  Taken = !ZF && SF == OF;   break;
+    case X86::JS_1:  Taken = SF;                break;
+    case X86::JNS_1: Taken = !SF;               break;
+    case X86::JO_1:  Taken = OF;                break;
+    case X86::JNO_1: Taken = !OF;               break;
+    }
+    return true;
+  }
+
   bool isRegToRegMove(const MCInst &Inst, MCPhysReg &From,
                       MCPhysReg &To) const override {
     switch (Inst.getOpcode()) {
@@ -1658,6 +1892,34 @@ public:
     }
   }
 
+  bool convertMoveToConditionalMove(MCInst &Inst, const MCInst &CondBranch,
+                                    bool Invert) const override {
+    // The 32-bit form clears the upper half of the destination even when
+    // the condition is false, so only full-width moves are converted.
+    if (Inst.getOpcode() != X86::MOV64rr ||
+        !getCMov64Opcode(CondBranch.getOpcode()))
+      return false;
+
+    auto BranchOpcode = CondBranch.getOpcode();
+    if (Invert)
+      BranchOpcode = getInvertedBranchOpcode(BranchOpcode);
+
+    const auto To = Inst.getOperand(0).getReg();
+    const auto From = Inst.getOperand(1).getReg();
+    Inst.clear();
+    Inst.setOpcode(getCMov64Opcode(BranchOpcode));
+    Inst.addOperand(MCOperand::createReg(To));
+    Inst.addOperand(MCOperand::createReg(To));
+    Inst.addOperand(MCOperand::createReg(From));
+    return true;
+  }
+
+  MCPhysReg getIntArgRegister(unsigned ArgNo) const override {
+    const MCPhysReg ArgRegs[] = {X86::RDI, X86::RSI, X86::RDX,
+                                 X86::RCX, X86::R8,  X86::R9};
+    return ArgNo < array_lengthof(ArgRegs) ? ArgRegs[ArgNo] : 0;
+  }
+
   MCPhysReg getStackPointer() const override { return X86::RSP; }
   MCPhysReg getFramePointer() const override { return X86::RBP; }
   MCPhysReg getFlagsReg() const override { return X86::EFLAGS; }
@@ -1884,6 +2146,15 @@ public:
            "invalid offset for given constant data");
     int64_t ImmVal =
       DataExtractor(ConstantData, true, 64).getSigned(&Offset, I.DataSize);
+    switch (Inst.getOpcode()) {
+    case X86::MOVZX16rm8:
+    case X86::MOVZX32rm8:
+      ImmVal &= 0xff;
+      break;
+    case X86::MOVZX32rm16:
+      ImmVal &= 0xffff;
+      break;
+    }
 
     // Compute the new opcode.
     unsigned NewOpcode = 0;
@@ -2083,6 +2354,170 @@ public:
     return true;
   }
 
+  /// Return the operand size of AND, OR and XOR instructions writing a
+  /// register, or 0 for other instructions. These set ZF and SF from the
+  /// result and clear CF and OF, exactly like TEST.
+  static unsigned getLogicOpSize(unsigned Opcode) {
+    switch (Opcode) {
+    default:
+      return 0;
+    case X86::AND8rr: case X86::AND8ri:
+    case X86::OR8rr:  case X86::OR8ri:
+    case X86::XOR8rr: case X86::XOR8ri:
+      return 1;
+    case X86::AND16rr: case X86::AND16ri: case X86::AND16ri8:
+    case X86::OR16rr:  case X86::OR16ri:  case X86::OR16ri8:
+    case X86::XOR16rr: case X86::XOR16ri: case X86::XOR16ri8:
+      return 2;
+    case X86::AND32rr: case X86::AND32ri: case X86::AND32ri8:
+    case X86::OR32rr:  case X86::OR32ri:  case X86::OR32ri8:
+    case X86::XOR32rr: case X86::XOR32ri: case X86::XOR32ri8:
+      return 4;
+    case X86::AND64rr: case X86::AND64ri32: case X86::AND64ri8:
+    case X86::OR64rr:  case X86::OR64ri32:  case X86::OR64ri8:
+    case X86::XOR64rr: case X86::XOR64ri32: case X86::XOR64ri8:
+      return 8;
+    }
+  }
+
+  /// Return true if the flags are written before they are read by the
+  /// instructions following \p Insts[Index] in the basic block.
+  bool areFlagsDeadAfter(ArrayRef<MCInst> Insts, unsigned Index) const {
+    BitVector Regs(RegInfo->getNumRegs(), false);
+    for (unsigned I = Index + 1; I < Insts.size(); ++I) {
+      const auto &Inst = Insts[I];
+      if (isCFI(Inst))
+        continue;
+      // The flags are neither passed to nor preserved across calls.
+      if (isCall(Inst))
+        return true;
+      Regs.reset();
+      getUsedRegs(Inst, Regs);
+      if (Regs[X86::EFLAGS])
+        return false;
+      Regs.reset();
+      getWrittenRegs(Inst, Regs);
+      if (Regs[X86::EFLAGS])
+        return true;
+    }
+    // The flags could be live on entry to a successor.
+    return false;
+  }
+
+  std::vector<PeepholePattern> getPeepholePatterns() override {
+    std::vector<PeepholePattern> Patterns;
+
+    // mov %reg, %reg. The 32-bit form is not redundant since it clears the
+    // upper half of the register.
+    Patterns.push_back({"redundant-mov",
+      [](MutableArrayRef<MCInst> Insts, unsigned Index) {
+        const auto &Inst = Insts[Index];
+        switch (Inst.getOpcode()) {
+        default:
+          return PeepholeAction::NONE;
+        case X86::MOV8rr:
+        case X86::MOV16rr:
+        case X86::MOV64rr:
+          break;
+        }
+        if (Inst.getOperand(0).getReg() != Inst.getOperand(1).getReg())
+          return PeepholeAction::NONE;
+        return PeepholeAction::ERASE;
+      }});
+
+    // test %reg, %reg right after a logic instruction of the same size
+    // writing %reg.
+    Patterns.push_back({"redundant-test",
+      [this](MutableArrayRef<MCInst> Insts, unsigned Index) {
+        const auto &Test = Insts[Index];
+        unsigned Size;
+        switch (Test.getOpcode()) {
+        default:
+          return PeepholeAction::NONE;
+        case X86::TEST8rr:  Size = 1; break;
+        case X86::TEST16rr: Size = 2; break;
+        case X86::TEST32rr: Size = 4; break;
+        case X86::TEST64rr: Size = 8; break;
+        }
+        const auto Reg = Test.getOperand(0).getReg();
+        if (Test.getOperand(1).getReg() != Reg)
+          return PeepholeAction::NONE;
+
+        unsigned Prev = Index;
+        while (Prev > 0 && isCFI(Insts[Prev - 1]))
+          --Prev;
+        if (Prev == 0)
+          return PeepholeAction::NONE;
+        const auto &Def = Insts[Prev - 1];
+        if (getLogicOpSize(Def.getOpcode()) != Size ||
+            Def.getOperand(0).getReg() != Reg)
+          return PeepholeAction::NONE;
+        return PeepholeAction::ERASE;
+      }});
+
+    // lea (%reg), %reg does nothing, and when the flags are dead,
+    // lea disp(%reg), %reg and lea (%reg,%idx), %reg are the add of the
+    // displacement or of the index register, which is never longer.
+    Patterns.push_back({"lea-to-add",
+      [this](MutableArrayRef<MCInst> Insts, unsigned Index) {
+        auto &Inst = Insts[Index];
+        if (Inst.getOpcode() != X86::LEA64r)
+          return PeepholeAction::NONE;
+
+        unsigned BaseReg, IndexReg, SegReg;
+        int64_t Scale, Disp;
+        const MCExpr *DispExpr = nullptr;
+        if (!evaluateX86MemoryOperand(Inst, &BaseReg, &Scale, &IndexReg,
+                                      &Disp, &SegReg, &DispExpr) ||
+            DispExpr || SegReg != X86::NoRegister)
+          return PeepholeAction::NONE;
+
+        // Leave stack pointer updates alone, frame analyses look for them.
+        const MCPhysReg Reg = Inst.getOperand(0).getReg();
+        if (Reg == getStackPointer())
+          return PeepholeAction::NONE;
+
+        MCPhysReg Other = X86::NoRegister;
+        if (BaseReg == Reg && IndexReg == X86::NoRegister) {
+          if (Disp == 0)
+            return PeepholeAction::ERASE;
+          if (!isInt<32>(Disp))
+            return PeepholeAction::NONE;
+        } else if (Disp == 0 && Scale == 1 && BaseReg != X86::NoRegister &&
+                   (BaseReg == Reg || IndexReg == Reg)) {
+          Other = BaseReg == Reg ? IndexReg : BaseReg;
+        } else {
+          return PeepholeAction::NONE;
+        }
+
+        if (!areFlagsDeadAfter(Insts, Index))
+          return PeepholeAction::NONE;
+
+        // Keep the annotations of the instruction.
+        const bool HasAnnotations =
+          MCPlus::getNumPrimeOperands(Inst) != Inst.getNumOperands();
+        MCOperand Annotations;
+        if (HasAnnotations)
+          Annotations = Inst.getOperand(Inst.getNumOperands() - 1);
+
+        Inst.clear();
+        Inst.addOperand(MCOperand::createReg(Reg));
+        Inst.addOperand(MCOperand::createReg(Reg));
+        if (Other != X86::NoRegister) {
+          Inst.setOpcode(X86::ADD64rr);
+          Inst.addOperand(MCOperand::createReg(Other));
+        } else {
+          Inst.setOpcode(isInt<8>(Disp) ? X86::ADD64ri8 : X86::ADD64ri32);
+          Inst.addOperand(MCOperand::createImm(Disp));
+        }
+        if (HasAnnotations)
+          Inst.addOperand(Annotations);
+        return PeepholeAction::REWRITE;
+      }});
+
+    return Patterns;
+  }
+
   bool shortenInstruction(MCInst &Inst) const override {
     unsigned OldOpcode = Inst.getOpcode();
     unsigned NewOpcode = OldOpcode;
@@ -2677,6 +3112,19 @@ public:
     return true;
   }
 
+  bool createPrefetch(MCInst &Inst, const MCPhysReg &BaseReg, int64_t Scale,
+                      const MCPhysReg &IndexReg, int64_t Offset,
+                      const MCPhysReg &SegmentReg) const override {
+    Inst.setOpcode(X86::PREFETCHT0);
+    Inst.clear();
+    Inst.addOperand(MCOperand::createReg(BaseReg));
+    Inst.addOperand(MCOperand::createImm(Scale));
+    Inst.addOperand(MCOperand::createReg(IndexReg));
+    Inst.addOperand(MCOperand::createImm(Offset)); // Displacement
+    Inst.addOperand(MCOperand::createReg(SegmentReg)); // AddrSegmentReg
+    return true;
+  }
+
   bool createIJmp32Frag(SmallVectorImpl<MCInst> &Insts,
                         const MCOperand &BaseReg, const MCOperand &Scale,
                         const MCOperand &IndexReg, const MCOperand &Offset,
@@ -2704,6 +3152,60 @@ public:
     return true;
   }
 
+  bool createCmpJE(std::vector<MCInst> &Seq, const MCPhysReg &IndexReg,
+                   int64_t Imm, const MCSymbol *Target,
+                   MCContext *Ctx) const override {
+    // Immediate is out of sign extended 32 bit range.
+    if (int64_t(Imm) != int64_t(int32_t(Imm)))
+      return false;
+
+    MCInst Cmp;
+    Cmp.setOpcode(X86::CMP64ri32);
+    Cmp.addOperand(MCOperand::createReg(IndexReg));
+    Cmp.addOperand(MCOperand::createImm(Imm));
+    shortenInstruction(Cmp);
+
+    MCInst Je;
+    Je.setOpcode(X86::JE_1);
+    Je.addOperand(MCOperand::createExpr(
+        MCSymbolRefExpr::create(Target, MCSymbolRefExpr::VK_None, *Ctx)));
+
+    Seq.push_back(Cmp);
+    Seq.push_back(Je);
+    return true;
+  }
+
+  bool createBitTestJB(std::vector<MCInst> &Seq, const MCPhysReg &IndexReg,
+                       uint64_t Mask, const MCPhysReg &TmpReg,
+                       const MCSymbol *Target, MCContext *Ctx) const override {
+    // The code fragment we emit here is:
+    //
+    //  mov $mask, %tmpreg
+    //  bt  %index, %tmpreg
+    //  jb  target
+    //
+    MCInst Mov;
+    Mov.setOpcode(X86::MOV64ri);
+    Mov.addOperand(MCOperand::createReg(TmpReg));
+    Mov.addOperand(MCOperand::createImm(Mask));
+    shortenInstruction(Mov);
+
+    MCInst Bt;
+    Bt.setOpcode(X86::BT64rr);
+    Bt.addOperand(MCOperand::createReg(TmpReg));
+    Bt.addOperand(MCOperand::createReg(IndexReg));
+
+    MCInst Jb;
+    Jb.setOpcode(X86::JB_1);
+    Jb.addOperand(MCOperand::createExpr(
+        MCSymbolRefExpr::create(Target, MCSymbolRefExpr::VK_None, *Ctx)));
+
+    Seq.push_back(Mov);
+    Seq.push_back(Bt);
+    Seq.push_back(Jb);
+    return true;
+  }
+
   bool createNoop(MCInst &Inst) const override {
     Inst.setOpcode(X86::NOOP);
     return true;
@@ -2737,6 +3239,507 @@ public:
     return Code;
   }
 
+  /// Append moves of \p Size bytes from \p Src to \p Dst starting at
+  /// offset \p Offset, using %xmm0 for 16-byte chunks and %rcx for the
+  /// rest. With no \p Src, store the pattern already in %xmm0 and %rcx.
+  void addUnrolledMoves(std::vector<MCInst> &Code, MCPhysReg Dst,
+                        MCPhysReg Src, uint64_t Offset, uint64_t Size) const {
+    auto addMove = [&](unsigned LoadOpcode, unsigned StoreOpcode,
+                       MCPhysReg Reg, uint64_t Off) {
+      if (Src) {
+        Code.emplace_back(MCInstBuilder(LoadOpcode)
+                              .addReg(Reg)
+                              .addReg(Src)
+                              .addImm(1)
+                              .addReg(X86::NoRegister)
+                              .addImm(Off)
+                              .addReg(X86::NoRegister));
+      }
+      Code.emplace_back(MCInstBuilder(StoreOpcode)
+                            .addReg(Dst)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addImm(Off)
+                            .addReg(X86::NoRegister)
+                            .addReg(Reg));
+    };
+
+    const uint64_t End = Offset + Size;
+    for (; End - Offset >= 16; Offset += 16)
+      addMove(X86::MOVUPSrm, X86::MOVUPSmr, X86::XMM0, Offset);
+    for (; End - Offset >= 8; Offset += 8)
+      addMove(X86::MOV64rm, X86::MOV64mr, X86::RCX, Offset);
+    for (; End - Offset >= 4; Offset += 4)
+      addMove(X86::MOV32rm, X86::MOV32mr, X86::ECX, Offset);
+    for (; End - Offset >= 2; Offset += 2)
+      addMove(X86::MOV16rm, X86::MOV16mr, X86::CX, Offset);
+    for (; End - Offset >= 1; Offset += 1)
+      addMove(X86::MOV8rm, X86::MOV8mr, X86::CL, Offset);
+  }
+
+  std::vector<MCInst> createInlineMemcpy(bool ReturnEnd,
+                                         uint64_t Size) const override {
+    std::vector<MCInst> Code;
+    Code.emplace_back(MCInstBuilder(X86::LEA64r)
+                          .addReg(X86::RAX)
+                          .addReg(X86::RDI)
+                          .addImm(1)
+                          .addReg(X86::NoRegister)
+                          .addImm(ReturnEnd ? Size : 0)
+                          .addReg(X86::NoRegister));
+    addUnrolledMoves(Code, X86::RDI, X86::RSI, 0, Size);
+    return Code;
+  }
+
+  std::vector<MCInst> createInlineMemset(uint64_t Size) const override {
+    std::vector<MCInst> Code;
+    if (Size) {
+      //  movzbl %sil, %ecx
+      //  movabsq $0x0101010101010101, %rdx
+      //  imulq %rdx, %rcx
+      Code.emplace_back(
+          MCInstBuilder(X86::MOVZX32rr8).addReg(X86::ECX).addReg(X86::SIL));
+      Code.emplace_back(MCInstBuilder(X86::MOV64ri)
+                            .addReg(X86::RDX)
+                            .addImm(0x0101010101010101LL));
+      Code.emplace_back(MCInstBuilder(X86::IMUL64rr)
+                            .addReg(X86::RCX)
+                            .addReg(X86::RCX)
+                            .addReg(X86::RDX));
+    }
+    if (Size >= 16) {
+      //  movq %rcx, %xmm0
+      //  punpcklqdq %xmm0, %xmm0
+      Code.emplace_back(
+          MCInstBuilder(X86::MOV64toPQIrr).addReg(X86::XMM0).addReg(X86::RCX));
+      Code.emplace_back(MCInstBuilder(X86::PUNPCKLQDQrr)
+                            .addReg(X86::XMM0)
+                            .addReg(X86::XMM0)
+                            .addReg(X86::XMM0));
+    }
+    addUnrolledMoves(Code, X86::RDI, X86::NoRegister, 0, Size);
+    Code.emplace_back(
+        MCInstBuilder(X86::MOV64rr).addReg(X86::RAX).addReg(X86::RDI));
+    return Code;
+  }
+
+  std::vector<MCInst> createInlineMemcmp(uint64_t Size) const override {
+    std::vector<MCInst> Code;
+    auto load = [&](unsigned Opcode, MCPhysReg Reg, MCPhysReg Base) {
+      Code.emplace_back(MCInstBuilder(Opcode)
+                            .addReg(Reg)
+                            .addReg(Base)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addImm(0)
+                            .addReg(X86::NoRegister));
+    };
+
+    switch (Size) {
+    default:
+      return Code;
+    case 0:
+      Code.emplace_back(MCInstBuilder(X86::MOV32ri).addReg(X86::EAX).addImm(0));
+      return Code;
+    case 1:
+      //  movzbl (%rdi), %eax
+      //  movzbl (%rsi), %ecx
+      //  subl %ecx, %eax
+      load(X86::MOVZX32rm8, X86::EAX, X86::RDI);
+      load(X86::MOVZX32rm8, X86::ECX, X86::RSI);
+      Code.emplace_back(MCInstBuilder(X86::SUB32rr)
+                            .addReg(X86::EAX)
+                            .addReg(X86::EAX)
+                            .addReg(X86::ECX));
+      return Code;
+    case 2:
+    case 4:
+    case 8:
+      break;
+    }
+
+    // Compare the bytes as big-endian numbers:
+    //  mov (%rdi), %rcx
+    //  mov (%rsi), %rdx
+    //  bswap %rcx
+    //  bswap %rdx
+    //  xorl %eax, %eax
+    //  cmp %rdx, %rcx
+    //  seta %al
+    //  sbbl $0, %eax
+    // A zero-extended 2-byte value ends up in the upper half after bswap,
+    // which keeps the order.
+    const bool Is64 = Size == 8;
+    const MCPhysReg LHS = Is64 ? X86::RCX : X86::ECX;
+    const MCPhysReg RHS = Is64 ? X86::RDX : X86::EDX;
+    const unsigned LoadOpcode = Size == 2 ? X86::MOVZX32rm16
+                              : Is64      ? X86::MOV64rm
+                                          : X86::MOV32rm;
+    const unsigned BSwapOpcode = Is64 ? X86::BSWAP64r : X86::BSWAP32r;
+    load(LoadOpcode, LHS, X86::RDI);
+    load(LoadOpcode, RHS, X86::RSI);
+    Code.emplace_back(MCInstBuilder(BSwapOpcode).addReg(LHS).addReg(LHS));
+    Code.emplace_back(MCInstBuilder(BSwapOpcode).addReg(RHS).addReg(RHS));
+    Code.emplace_back(MCInstBuilder(X86::XOR32rr)
+                          .addReg(X86::EAX)
+                          .addReg(X86::EAX)
+                          .addReg(X86::EAX));
+    Code.emplace_back(MCInstBuilder(Is64 ? X86::CMP64rr : X86::CMP32rr)
+                          .addReg(LHS)
+                          .addReg(RHS));
+    Code.emplace_back(MCInstBuilder(X86::SETAr).addReg(X86::AL));
+    Code.emplace_back(MCInstBuilder(X86::SBB32ri8)
+                          .addReg(X86::EAX)
+                          .addReg(X86::EAX)
+                          .addImm(0));
+    return Code;
+  }
+
+  bool isMoveImmToReg(const MCInst &Inst, MCPhysReg &Reg,
+                      int64_t &Imm) const override {
+    switch (Inst.getOpcode()) {
+    default:
+      return false;
+    case X86::MOV32ri:
+      // Writes to 32-bit registers zero the upper half.
+      Reg = getAliasSized(Inst.getOperand(0).getReg(), 8);
+      Imm = static_cast<uint32_t>(Inst.getOperand(1).getImm());
+      return true;
+    case X86::MOV64ri:
+    case X86::MOV64ri32:
+      Reg = Inst.getOperand(0).getReg();
+      Imm = Inst.getOperand(1).getImm();
+      return true;
+    }
+  }
+
+  std::vector<MCInst> createHugifyStub(const MCSymbol *Start,
+                                       const MCSymbol *End,
+                                       const MCSymbol *Entry,
+                                       MCContext *Ctx) const override {
+    // Linux x86-64 system calls and flags.
+    enum : int64_t {
+      SYS_MMAP = 9,
+      SYS_MPROTECT = 10,
+      SYS_MUNMAP = 11,
+      SYS_MADVISE = 28,
+      PROT_READ_WRITE = 0x3,
+      PROT_READ_EXEC = 0x5,
+      MAP_PRIVATE_ANON = 0x22,
+      MAP_FIXED = 0x10,
+      MADV_HUGEPAGE = 14,
+    };
+
+    std::vector<MCInst> Code;
+    auto movRR = [&](MCPhysReg Dst, MCPhysReg Src) {
+      Code.emplace_back(MCInstBuilder(X86::MOV64rr).addReg(Dst).addReg(Src));
+    };
+    auto movRI = [&](MCPhysReg Dst, int64_t Imm) {
+      Code.emplace_back(MCInstBuilder(X86::MOV64ri32).addReg(Dst).addImm(Imm));
+    };
+    auto leaSym = [&](MCPhysReg Dst, const MCSymbol *Sym) {
+      Code.emplace_back(MCInstBuilder(X86::LEA64r)
+                            .addReg(Dst)
+                            .addReg(X86::RIP)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addExpr(MCSymbolRefExpr::create(
+                                Sym, MCSymbolRefExpr::VK_None, *Ctx))
+                            .addReg(X86::NoRegister));
+    };
+    auto syscall = [&](int64_t Number) {
+      movRI(X86::RAX, Number);
+      Code.emplace_back(MCInstBuilder(X86::SYSCALL));
+    };
+    // The address is expected in %rdi.
+    auto mmapAnon = [&](int64_t Flags) {
+      movRR(X86::RSI, X86::R13);
+      movRI(X86::RDX, PROT_READ_WRITE);
+      movRI(X86::R10, Flags);
+      movRI(X86::R8, -1);
+      movRI(X86::R9, 0);
+      syscall(SYS_MMAP);
+    };
+    auto copy = [&](MCPhysReg Dst, MCPhysReg Src) {
+      movRR(X86::RDI, Dst);
+      movRR(X86::RSI, Src);
+      movRR(X86::RCX, X86::R13);
+      Code.emplace_back(MCInstBuilder(X86::REP_MOVSB_64));
+    };
+    auto jumpToEntry = [&](unsigned Opcode) {
+      Code.emplace_back(MCInstBuilder(Opcode).addExpr(
+          MCSymbolRefExpr::create(Entry, MCSymbolRefExpr::VK_None, *Ctx)));
+    };
+
+    // Only %rsp and %rdx are defined at the entry point, the rest of the
+    // registers are free to use. %r12 holds the start of the code, %r13 its
+    // size and %r14 the temporary copy.
+    movRR(X86::R15, X86::RDX);
+    leaSym(X86::R12, Start);
+    leaSym(X86::R13, End);
+    Code.emplace_back(MCInstBuilder(X86::SUB64rr)
+                          .addReg(X86::R13)
+                          .addReg(X86::R13)
+                          .addReg(X86::R12));
+
+    // Leave the code in place if the temporary copy cannot be allocated.
+    movRI(X86::RDI, 0);
+    mmapAnon(MAP_PRIVATE_ANON);
+    movRR(X86::RDX, X86::R15);
+    Code.emplace_back(MCInstBuilder(X86::CMP64ri32)
+                          .addReg(X86::RAX)
+                          .addImm(-4095));
+    jumpToEntry(X86::JAE_1);
+    movRR(X86::R14, X86::RAX);
+    copy(X86::R14, X86::R12);
+
+    // Replace the code mapping and copy the code back.
+    movRR(X86::RDI, X86::R12);
+    mmapAnon(MAP_PRIVATE_ANON | MAP_FIXED);
+    movRR(X86::RDI, X86::R12);
+    movRR(X86::RSI, X86::R13);
+    movRI(X86::RDX, MADV_HUGEPAGE);
+    syscall(SYS_MADVISE);
+    copy(X86::R12, X86::R14);
+
+    movRR(X86::RDI, X86::R12);
+    movRR(X86::RSI, X86::R13);
+    movRI(X86::RDX, PROT_READ_EXEC);
+    syscall(SYS_MPROTECT);
+
+    movRR(X86::RDI, X86::R14);
+    movRR(X86::RSI, X86::R13);
+    syscall(SYS_MUNMAP);
+
+    movRR(X86::RDX, X86::R15);
+    jumpToEntry(X86::JMP_1);
+    return Code;
+  }
+
+  std::vector<MCInst>
+  createInstrCounterIncrement(const MCSymbol *Counters, uint64_t Offset,
+                              uint64_t ShardSize, unsigned NumShards,
+                              unsigned ShardShift, const BitVector *LiveRegs,
+                              MCContext *Ctx) const override {
+    assert(isPowerOf2_32(NumShards) && "number of shards is not a power of 2");
+    assert(isInt<32>(Offset) && isInt<32>(ShardSize) &&
+           "counters do not fit in 32-bit displacement");
+
+    auto isLive = [&](MCPhysReg Reg) {
+      return !LiveRegs || LiveRegs->anyCommon(getAliases(Reg));
+    };
+    const bool SaveFlags = isLive(X86::EFLAGS);
+
+    // Use dead registers as temporaries and save live ones on the stack.
+    const MCPhysReg Candidates[] = {X86::RAX, X86::RCX, X86::RDX, X86::RSI,
+                                    X86::RDI, X86::R8,  X86::R9,  X86::R10,
+                                    X86::R11};
+    SmallVector<MCPhysReg, 2> Temps;
+    for (auto Reg : Candidates) {
+      if (Temps.size() < 2 && !isLive(Reg))
+        Temps.push_back(Reg);
+    }
+    const unsigned NumTemps = NumShards == 1 ? 0 : 2;
+    SmallVector<MCPhysReg, 2> Saved;
+    for (auto Reg : Candidates) {
+      if (Temps.size() >= NumTemps)
+        break;
+      if (!is_contained(Temps, Reg)) {
+        Temps.push_back(Reg);
+        Saved.push_back(Reg);
+      }
+    }
+
+    std::vector<MCInst> Code;
+    auto leaRSP = [&](int64_t Disp) {
+      Code.emplace_back(MCInstBuilder(X86::LEA64r)
+                            .addReg(X86::RSP)
+                            .addReg(X86::RSP)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addImm(Disp)
+                            .addReg(X86::NoRegister));
+    };
+    const auto *CountersExpr =
+      MCSymbolRefExpr::create(Counters, MCSymbolRefExpr::VK_None, *Ctx);
+    const auto *CounterExpr = MCBinaryExpr::createAdd(
+        CountersExpr, MCConstantExpr::create(Offset, *Ctx), *Ctx);
+
+    // With a single shard and live flags, a dead register is enough to
+    // increment without touching the flags:
+    //  movq Counters+Offset(%rip), %tmp
+    //  leaq 1(%tmp), %tmp
+    //  movq %tmp, Counters+Offset(%rip)
+    const bool UseLEA = NumShards == 1 && SaveFlags && !Temps.empty();
+    const bool UseStack = !UseLEA && (SaveFlags || !Saved.empty());
+
+    // Step over the red zone before using the stack.
+    if (UseStack) {
+      leaRSP(-128);
+      if (SaveFlags)
+        Code.emplace_back(MCInstBuilder(X86::PUSHF64));
+      for (auto Reg : Saved)
+        Code.emplace_back(MCInstBuilder(X86::PUSH64r).addReg(Reg));
+    }
+
+    if (UseLEA) {
+      const auto Tmp = Temps.front();
+      Code.emplace_back(MCInstBuilder(X86::MOV64rm)
+                            .addReg(Tmp)
+                            .addReg(X86::RIP)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addExpr(CounterExpr)
+                            .addReg(X86::NoRegister));
+      Code.emplace_back(MCInstBuilder(X86::LEA64r)
+                            .addReg(Tmp)
+                            .addReg(Tmp)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addImm(1)
+                            .addReg(X86::NoRegister));
+      Code.emplace_back(MCInstBuilder(X86::MOV64mr)
+                            .addReg(X86::RIP)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addExpr(CounterExpr)
+                            .addReg(X86::NoRegister)
+                            .addReg(Tmp));
+    } else if (NumShards == 1) {
+      //  incq Counters+Offset(%rip)
+      Code.emplace_back(MCInstBuilder(X86::INC64m)
+                            .addReg(X86::RIP)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addExpr(CounterExpr)
+                            .addReg(X86::NoRegister));
+    } else {
+      //  movq %rsp, %idx
+      //  shrq $ShardShift, %idx
+      //  andq $(NumShards - 1), %idx
+      //  imulq $ShardSize, %idx, %idx
+      //  leaq Counters(%rip), %base
+      //  incq Offset(%base,%idx)
+      const auto Idx = Temps[0];
+      const auto Base = Temps[1];
+      Code.emplace_back(
+          MCInstBuilder(X86::MOV64rr).addReg(Idx).addReg(X86::RSP));
+      Code.emplace_back(MCInstBuilder(X86::SHR64ri)
+                            .addReg(Idx)
+                            .addReg(Idx)
+                            .addImm(ShardShift));
+      Code.emplace_back(MCInstBuilder(X86::AND64ri32)
+                            .addReg(Idx)
+                            .addReg(Idx)
+                            .addImm(NumShards - 1));
+      Code.emplace_back(MCInstBuilder(X86::IMUL64rri32)
+                            .addReg(Idx)
+                            .addReg(Idx)
+                            .addImm(ShardSize));
+      Code.emplace_back(MCInstBuilder(X86::LEA64r)
+                            .addReg(Base)
+                            .addReg(X86::RIP)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addExpr(CountersExpr)
+                            .addReg(X86::NoRegister));
+      Code.emplace_back(MCInstBuilder(X86::INC64m)
+                            .addReg(Base)
+                            .addImm(1)
+                            .addReg(Idx)
+                            .addImm(Offset)
+                            .addReg(X86::NoRegister));
+    }
+
+    if (UseStack) {
+      for (auto Reg : reverse(Saved))
+        Code.emplace_back(MCInstBuilder(X86::POP64r).addReg(Reg));
+      if (SaveFlags)
+        Code.emplace_back(MCInstBuilder(X86::POPF64));
+      leaRSP(128);
+    }
+    return Code;
+  }
+
+  std::vector<MCInst>
+  createInstrumentationStub(const MCSymbol *Counters, uint64_t Size,
+                            const MCSymbol *FileName, const MCSymbol *Entry,
+                            MCContext *Ctx) const override {
+    // Linux x86-64 system calls and flags.
+    enum : int64_t {
+      SYS_CLOSE = 3,
+      SYS_OPEN = 2,
+      SYS_MMAP = 9,
+      SYS_MPROTECT = 10,
+      SYS_FTRUNCATE = 77,
+      O_RDWR_CREAT = 0x42,
+      FILE_MODE = 0644,
+      PROT_READ_WRITE = 0x3,
+      MAP_SHARED_FIXED = 0x11,
+    };
+
+    std::vector<MCInst> Code;
+    auto movRR = [&](MCPhysReg Dst, MCPhysReg Src) {
+      Code.emplace_back(MCInstBuilder(X86::MOV64rr).addReg(Dst).addReg(Src));
+    };
+    auto movRI = [&](MCPhysReg Dst, int64_t Imm) {
+      Code.emplace_back(MCInstBuilder(X86::MOV64ri32).addReg(Dst).addImm(Imm));
+    };
+    auto leaSym = [&](MCPhysReg Dst, const MCSymbol *Sym) {
+      Code.emplace_back(MCInstBuilder(X86::LEA64r)
+                            .addReg(Dst)
+                            .addReg(X86::RIP)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addExpr(MCSymbolRefExpr::create(
+                                Sym, MCSymbolRefExpr::VK_None, *Ctx))
+                            .addReg(X86::NoRegister));
+    };
+    auto syscall = [&](int64_t Number) {
+      movRI(X86::RAX, Number);
+      Code.emplace_back(MCInstBuilder(X86::SYSCALL));
+    };
+
+    // Only %rsp and %rdx are defined at the entry point. %r12 holds the
+    // counters and %r13 the file descriptor. No branches are needed: with an
+    // invalid descriptor ftruncate, mmap and close fail without side effects,
+    // and mprotect makes the counters writable whether they were mapped from
+    // the file or not.
+    movRR(X86::R15, X86::RDX);
+    leaSym(X86::R12, Counters);
+
+    leaSym(X86::RDI, FileName);
+    movRI(X86::RSI, O_RDWR_CREAT);
+    movRI(X86::RDX, FILE_MODE);
+    syscall(SYS_OPEN);
+    movRR(X86::R13, X86::RAX);
+
+    movRR(X86::RDI, X86::R13);
+    movRI(X86::RSI, Size);
+    syscall(SYS_FTRUNCATE);
+
+    movRR(X86::RDI, X86::R12);
+    movRI(X86::RSI, Size);
+    movRI(X86::RDX, PROT_READ_WRITE);
+    movRI(X86::R10, MAP_SHARED_FIXED);
+    movRR(X86::R8, X86::R13);
+    movRI(X86::R9, 0);
+    syscall(SYS_MMAP);
+
+    movRR(X86::RDI, X86::R13);
+    syscall(SYS_CLOSE);
+
+    movRR(X86::RDI, X86::R12);
+    movRI(X86::RSI, Size);
+    movRI(X86::RDX, PROT_READ_WRITE);
+    syscall(SYS_MPROTECT);
+
+    movRR(X86::RDX, X86::R15);
+    Code.emplace_back(MCInstBuilder(X86::JMP_1).addExpr(
+        MCSymbolRefExpr::create(Entry, MCSymbolRefExpr::VK_None, *Ctx)));
+    return Code;
+  }
+
   bool replaceImmWithSymbol(MCInst &Inst, MCSymbol *Symbol, int64_t Addend,
                             MCContext *Ctx, int64_t &Value,
                             uint64_t RelType) const override {
@@ -0,0 +1,149 @@
+//===--- TextScanner.h - Fast scanning of text profile fields -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Helpers for splitting fdata and "perf script" text into fields. Separators
+// are searched for 16 or 32 bytes at a time with SSE2/AVX2 or NEON, and
+// numbers are parsed without the generality of StringRef::getAsInteger(),
+// which dominated the time to read multi-gigabyte text profiles.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_TEXT_SCANNER_H
+#define LLVM_TOOLS_LLVM_BOLT_TEXT_SCANNER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MathExtras.h"
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace llvm {
+namespace bolt {
+namespace TextScanner {
+
+/// Return the position of the first occurrence of \p A or \p B in
+/// \p Str, or StringRef::npos if there is none. Pass the same character
+/// twice to look for a single one.
+inline size_t findFirstOf(StringRef Str, char A, char B) {
+  const char *Data = Str.data();
+  const size_t Size = Str.size();
+  size_t I = 0;
+
+#if defined(__AVX2__)
+  const __m256i A32 = _mm256_set1_epi8(A);
+  const __m256i B32 = _mm256_set1_epi8(B);
+  for (; I + 32 <= Size; I += 32) {
+    const __m256i V =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(Data + I));
+    const uint32_t Mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(V, A32), _mm256_cmpeq_epi8(V, B32)));
+    if (Mask)
+      return I + countTrailingZeros(Mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i A16 = _mm_set1_epi8(A);
+  const __m128i B16 = _mm_set1_epi8(B);
+  for (; I + 16 <= Size; I += 16) {
+    const __m128i V =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(Data + I));
+    const uint32_t Mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(V, A16), _mm_cmpeq_epi8(V, B16)));
+    if (Mask)
+      return I + countTrailingZeros(Mask);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t A16 = vdupq_n_u8(A);
+  const uint8x16_t B16 = vdupq_n_u8(B);
+  for (; I + 16 <= Size; I += 16) {
+    const uint8x16_t V = vld1q_u8(reinterpret_cast<const uint8_t *>(Data + I));
+    const uint8x16_t Eq = vorrq_u8(vceqq_u8(V, A16), vceqq_u8(V, B16));
+    // Narrow every byte of the comparison to a nibble of a 64-bit mask.
+    const uint64_t Mask = vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(Eq), 4)), 0);
+    if (Mask)
+      return I + countTrailingZeros(Mask) / 4;
+  }
+#endif
+
+  for (; I < Size; ++I) {
+    if (Data[I] == A || Data[I] == B)
+      return I;
+  }
+  return StringRef::npos;
+}
+
+/// Parse \p Str as an unsigned hexadecimal number without a prefix. Return
+/// true on error, like StringRef::getAsInteger().
+inline bool parseHex(StringRef Str, uint64_t &Value) {
+  // Leading zeros could make a valid number longer than 16 digits.
+  if (Str.size() > 16)
+    return Str.getAsInteger(16, Value);
+  if (Str.empty())
+    return true;
+
+  uint64_t Result = 0;
+  for (const char C : Str) {
+    unsigned Digit = static_cast<unsigned char>(C) - '0';
+    if (Digit > 9) {
+      Digit = (static_cast<unsigned char>(C) | 0x20) - 'a';
+      if (Digit > 5)
+        return true;
+      Digit += 10;
+    }
+    Result = (Result << 4) | Digit;
+  }
+  Value = Result;
+  return false;
+}
+
+/// Parse \p Str as a signed decimal number. Return true on error, like
+/// StringRef::getAsInteger().
+inline bool parseDecimal(StringRef Str, int64_t &Value) {
+  const bool Negative = !Str.empty() && Str.front() == '-';
+  StringRef Digits = Negative ? Str.drop_front(1) : Str;
+  // Up to 18 digits cannot overflow.
+  if (Digits.size() > 18)
+    return Str.getAsInteger(10, Value);
+  if (Digits.empty())
+    return true;
+
+  int64_t Result = 0;
+  for (const char C : Digits) {
+    const unsigned Digit = static_cast<unsigned char>(C) - '0';
+    if (Digit > 9)
+      return true;
+    Result = Result * 10 + Digit;
+  }
+  Value = Negative ? -Result : Result;
+  return false;
+}
+
+/// Parse \p Str as an address printed by perf, which is hexadecimal with a
+/// "0x" prefix, falling back to StringRef::getAsInteger() with radix
+/// detection otherwise. Return true on error.
+inline bool parseAddress(StringRef Str, uint64_t &Value) {
+  if (Str.size() > 2 && Str[0] == '0' && (Str[1] == 'x' || Str[1] == 'X'))
+    return parseHex(Str.drop_front(2), Value);
+  return Str.getAsInteger(0, Value);
+}
+
+} // namespace TextScanner
+} // namespace bolt
+} // namespace llvm
+
+#endif
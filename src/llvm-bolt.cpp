@@ -15,14 +15,22 @@
 
 #include "DataAggregator.h"
 #include "DataReader.h"
+#include "PhaseStats.h"
 #include "RewriteInstance.h"
 #include "llvm/Object/Binary.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileUtilities.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Program.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/TargetRegistry.h"
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt"
@@ -52,8 +60,18 @@ static cl::OptionCategory *Perf2BoltCategories[] = {&AggregatorCategory,
 
 extern cl::opt<std::string> OutputFilename;
 extern cl::opt<bool> AggregateOnly;
+extern cl::opt<bool> Deterministic;
 extern cl::opt<bool> DiffOnly;
 
+static cl::opt<bool>
+CheckDeterminism("check-determinism",
+  cl::desc("rewrite the binary again on a single thread and check that the "
+           "output is identical (implies -deterministic)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 static cl::opt<bool>
 DumpData("dump-data",
   cl::desc("dump parsed bolt data and exit (debugging)"),
@@ -86,6 +104,16 @@ InputFilename2(
   cl::Optional,
   cl::cat(BoltDiffCategory));
 
+static cl::list<std::string>
+BatchBinaries("batch",
+  cl::CommaSeparated,
+  cl::desc("aggregate the profiles of these binaries, e.g. shared libraries "
+           "of <executable>, in the same pass over the perf data, writing "
+           "<name>.fdata for each binary into the -o directory"),
+  cl::value_desc("binary1,binary2,..."),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<std::string>
 PerfData("perfdata",
   cl::desc("<data file>"),
@@ -127,6 +155,74 @@ static void printBoltRevision(llvm::raw_ostream &OS) {
   OS << "BOLT revision " << BoltRevision << "\n";
 }
 
+/// Run the tool again with the arguments of this run on a single thread,
+/// writing to a temporary file, and compare the result with the output of
+/// this run. Exit with an error if they differ.
+static void checkDeterminism(int argc, char **argv) {
+  SmallString<128> SerialOutput;
+  if (auto EC = sys::fs::createTemporaryFile("bolt-serial", "out",
+                                             SerialOutput))
+    report_error("cannot create temporary file", EC);
+  FileRemover Remover(SerialOutput);
+
+  std::vector<std::string> Args;
+  for (int I = 1; I < argc; ++I) {
+    StringRef Arg(argv[I]);
+    const auto Name = Arg.ltrim('-').split('=').first;
+    if (Arg.startswith("-") && Name == "o" && !Arg.contains('=')) {
+      ++I;
+      continue;
+    }
+    if (Arg.startswith("-") && (Name == "o" || Name == "check-determinism"))
+      continue;
+    Args.push_back(Arg.str());
+  }
+  Args.push_back(("-o=" + SerialOutput).str());
+  Args.push_back("-thread-count=1");
+  Args.push_back("-deterministic");
+
+  const auto Executable =
+    sys::fs::getMainExecutable(argv[0], (void *)&checkDeterminism);
+  std::vector<const char *> Argv;
+  Argv.push_back(argv[0]);
+  for (const auto &Arg : Args)
+    Argv.push_back(Arg.c_str());
+  Argv.push_back(nullptr);
+
+  outs() << "BOLT-INFO: rewriting on a single thread to check determinism\n";
+  Optional<StringRef> Redirects[] = {llvm::None, StringRef(""), llvm::None};
+  std::string ErrMsg;
+  const auto RC = sys::ExecuteAndWait(Executable, Argv.data(),
+                                      /*envp*/ nullptr, Redirects, 0, 0,
+                                      &ErrMsg);
+  if (RC != 0) {
+    errs() << "BOLT-ERROR: single-threaded rewrite failed";
+    if (!ErrMsg.empty())
+      errs() << ": " << ErrMsg;
+    errs() << '\n';
+    exit(1);
+  }
+
+  auto Parallel = MemoryBuffer::getFile(opts::OutputFilename);
+  if (auto EC = Parallel.getError())
+    report_error(opts::OutputFilename, EC);
+  auto Serial = MemoryBuffer::getFile(SerialOutput);
+  if (auto EC = Serial.getError())
+    report_error(SerialOutput, EC);
+
+  const auto A = (*Parallel)->getBuffer();
+  const auto B = (*Serial)->getBuffer();
+  if (A != B) {
+    size_t Offset = 0;
+    while (Offset < A.size() && Offset < B.size() && A[Offset] == B[Offset])
+      ++Offset;
+    errs() << "BOLT-ERROR: output differs from a rewrite on a single thread "
+              "at file offset 0x" << Twine::utohexstr(Offset) << '\n';
+    exit(1);
+  }
+  outs() << "BOLT-INFO: output is identical to a rewrite on a single thread\n";
+}
+
 void perf2boltMode(int argc, char **argv) {
   cl::HideUnrelatedOptions(makeArrayRef(opts::Perf2BoltCategories));
   cl::ParseCommandLineOptions(
@@ -193,6 +289,313 @@ void boltMode(int argc, char **argv) {
     errs() << ToolName << ": expected -o=<output file> option.\n";
     exit(1);
   }
+
+  if (opts::CheckDeterminism)
+    opts::Deterministic = true;
+}
+
+namespace {
+
+/// Profile parsed by the server ahead of the jobs that use it.
+struct CachedProfile {
+  sys::TimePoint<> ModificationTime;
+  uint64_t Size{0};
+  std::unique_ptr<DataReader> Reader;
+};
+
+} // anonymous namespace
+
+/// Profiles parsed by the server, keyed by absolute path. Workers inherit
+/// them when they are forked.
+static StringMap<CachedProfile> ProfileCache;
+static constexpr unsigned MaxCachedProfiles = 16;
+
+/// In a worker, the profile of the job parsed by the server, and the -data
+/// argument it was read for.
+static std::unique_ptr<DataReader> PreloadedProfile;
+static std::string PreloadedProfileName;
+
+/// Read a job from \p FD: the working directory of the client and the
+/// command line of the job, each terminated by a NUL character, followed by
+/// an empty string.
+static bool readServerJob(int FD, std::vector<std::string> &Job) {
+  std::string Current;
+  char Buffer[4096];
+  while (true) {
+    auto Size = read(FD, Buffer, sizeof(Buffer));
+    if (Size < 0 && errno == EINTR)
+      continue;
+    if (Size <= 0)
+      return false;
+    for (ssize_t I = 0; I < Size; ++I) {
+      if (Buffer[I]) {
+        Current += Buffer[I];
+        continue;
+      }
+      if (Current.empty())
+        return Job.size() >= 2;
+      Job.emplace_back(std::move(Current));
+      Current.clear();
+    }
+  }
+}
+
+static bool writeAll(int FD, StringRef Data) {
+  while (!Data.empty()) {
+    auto Size = write(FD, Data.data(), Data.size());
+    if (Size < 0 && errno == EINTR)
+      continue;
+    if (Size <= 0)
+      return false;
+    Data = Data.drop_front(Size);
+  }
+  return true;
+}
+
+/// Return the value of the -data option in the command line of \p Job.
+static StringRef getJobProfileName(ArrayRef<std::string> Job) {
+  for (unsigned I = 2; I < Job.size(); ++I) {
+    StringRef Arg = Job[I];
+    if (!Arg.consume_front("--"))
+      Arg.consume_front("-");
+    if (Arg.consume_front("data="))
+      return Arg;
+    if (Arg == "data" && I + 1 < Job.size())
+      return Job[I + 1];
+  }
+  return StringRef();
+}
+
+/// Parse the profile of \p Job unless an up-to-date copy is cached. Return
+/// the cache entry, or nullptr if the job has no readable profile.
+static CachedProfile *cacheJobProfile(ArrayRef<std::string> Job) {
+  auto ProfileName = getJobProfileName(Job);
+  if (ProfileName.empty())
+    return nullptr;
+
+  SmallString<128> Path(ProfileName);
+  sys::fs::make_absolute(Job[0], Path);
+  sys::fs::file_status Status;
+  if (sys::fs::status(Path, Status) || !sys::fs::is_regular_file(Status))
+    return nullptr;
+
+  auto Itr = ProfileCache.find(Path);
+  if (Itr != ProfileCache.end() &&
+      Itr->second.ModificationTime == Status.getLastModificationTime() &&
+      Itr->second.Size == Status.getSize())
+    return &Itr->second;
+
+  auto ReaderOrErr = DataReader::readPerfData(Path, errs());
+  if (ReaderOrErr.getError())
+    return nullptr;
+  if (Itr == ProfileCache.end() && ProfileCache.size() >= MaxCachedProfiles)
+    ProfileCache.clear();
+  auto &Entry = ProfileCache[Path];
+  Entry.ModificationTime = Status.getLastModificationTime();
+  Entry.Size = Status.getSize();
+  Entry.Reader = std::move(*ReaderOrErr);
+  return &Entry;
+}
+
+static int connectToServer(StringRef SocketPath, bool Listen) {
+  sockaddr_un Addr;
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+    errs() << ToolName << ": socket path is too long: " << SocketPath << '\n';
+    exit(1);
+  }
+  memcpy(Addr.sun_path, SocketPath.data(), SocketPath.size());
+
+  auto FD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (FD < 0)
+    report_error(SocketPath, std::error_code(errno, std::generic_category()));
+  if (Listen) {
+    unlink(Addr.sun_path);
+    if (bind(FD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) ||
+        listen(FD, SOMAXCONN))
+      report_error(SocketPath,
+                   std::error_code(errno, std::generic_category()));
+  } else if (connect(FD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr))) {
+    report_error(SocketPath, std::error_code(errno, std::generic_category()));
+  }
+  return FD;
+}
+
+/// Send the command line \p Args to the server and print the output of the
+/// job. Return the exit code of the job.
+static int runServerClient(StringRef SocketPath, ArrayRef<const char *> Args) {
+  auto FD = connectToServer(SocketPath, /*Listen=*/false);
+
+  SmallString<128> CurrentPath;
+  if (auto EC = sys::fs::current_path(CurrentPath))
+    report_error("current directory", EC);
+  std::string Job(CurrentPath.str());
+  Job += '\0';
+  for (const auto *Arg : Args) {
+    Job += Arg;
+    Job += '\0';
+  }
+  Job += '\0';
+  if (!writeAll(FD, Job))
+    report_error(SocketPath, std::error_code(errno, std::generic_category()));
+
+  // The output ends with a NUL character and the exit code of the job.
+  std::string Pending;
+  char Buffer[4096];
+  while (true) {
+    auto Size = read(FD, Buffer, sizeof(Buffer));
+    if (Size < 0 && errno == EINTR)
+      continue;
+    if (Size <= 0)
+      break;
+    Pending.append(Buffer, Size);
+    if (Pending.size() > 2) {
+      outs() << StringRef(Pending).drop_back(2);
+      Pending.erase(0, Pending.size() - 2);
+    }
+  }
+  outs().flush();
+  close(FD);
+
+  if (Pending.size() != 2 || Pending[0]) {
+    errs() << ToolName << ": lost connection to the server\n";
+    return 1;
+  }
+  return static_cast<unsigned char>(Pending[1]);
+}
+
+/// Run the server, or submit a job to it. Target initialization is done once
+/// by the server and every job runs in a process forked from it, starting
+/// with the options in their initial state. Profiles named by -data are
+/// parsed by the server and reused by later jobs while the file is
+/// unchanged.
+///
+/// Only returns in a worker, with the command line of its job in \p argc
+/// and \p argv.
+static void boltServerMode(int &argc, char **&argv) {
+  if (argc < 2 || (argc > 2 && (argc < 4 || StringRef(argv[2]) != "--"))) {
+    errs() << "USAGE: " << ToolName << " <socket>\n"
+           << "       " << ToolName << " <socket> -- llvm-bolt <options>\n";
+    exit(1);
+  }
+  StringRef SocketPath = argv[1];
+  if (argc > 2)
+    exit(runServerClient(SocketPath, makeArrayRef(argv + 3, argc - 3)));
+
+  auto ServerFD = connectToServer(SocketPath, /*Listen=*/true);
+  // Job processes are reaped automatically.
+  signal(SIGCHLD, SIG_IGN);
+  outs() << "BOLT-SERVER: listening on " << SocketPath << '\n';
+  outs().flush();
+
+  while (true) {
+    auto FD = accept(ServerFD, nullptr, nullptr);
+    if (FD < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      report_error(SocketPath,
+                   std::error_code(errno, std::generic_category()));
+    }
+
+    std::vector<std::string> Job;
+    if (!readServerJob(FD, Job)) {
+      close(FD);
+      continue;
+    }
+    auto *Profile = cacheJobProfile(Job);
+
+    // The job process waits for the worker and reports its exit code, so
+    // that crashes are reported too.
+    auto JobPID = fork();
+    if (JobPID != 0) {
+      if (JobPID < 0)
+        errs() << "BOLT-SERVER: cannot start a job: " << strerror(errno)
+               << '\n';
+      close(FD);
+      continue;
+    }
+    close(ServerFD);
+    signal(SIGCHLD, SIG_DFL);
+
+    auto WorkerPID = fork();
+    if (WorkerPID == 0) {
+      dup2(FD, STDOUT_FILENO);
+      dup2(FD, STDERR_FILENO);
+      close(FD);
+      if (chdir(Job[0].c_str())) {
+        errs() << Job[1] << ": cannot change directory to " << Job[0]
+               << '\n';
+        exit(1);
+      }
+      if (Profile) {
+        PreloadedProfile = std::move(Profile->Reader);
+        PreloadedProfileName = getJobProfileName(Job);
+      }
+      ProfileCache.clear();
+
+      static std::vector<std::string> Args;
+      static std::vector<char *> ArgPtrs;
+      Args.assign(Job.begin() + 1, Job.end());
+      for (auto &Arg : Args)
+        ArgPtrs.push_back(&Arg[0]);
+      ArgPtrs.push_back(nullptr);
+      argc = Args.size();
+      argv = ArgPtrs.data();
+      return;
+    }
+
+    int Status = 1;
+    if (WorkerPID < 0 || waitpid(WorkerPID, &Status, 0) < 0)
+      Status = 1;
+    const char Trailer[2] = {
+        0, static_cast<char>(WIFEXITED(Status) ? WEXITSTATUS(Status) : 1)};
+    writeAll(FD, StringRef(Trailer, 2));
+    _exit(0);
+  }
+}
+
+/// Aggregate the profiles of <executable> and -batch binaries from a single
+/// read of the perf data.
+static void perf2boltBatch(int argc, char **argv) {
+  std::vector<std::string> Binaries{opts::InputFilename};
+  Binaries.insert(Binaries.end(), opts::BatchBinaries.begin(),
+                  opts::BatchBinaries.end());
+  for (const auto &Filename : Binaries) {
+    if (!sys::fs::exists(Filename))
+      report_error(Filename, errc::no_such_file_or_directory);
+  }
+
+  if (auto EC = sys::fs::create_directories(opts::OutputFilename))
+    report_error(opts::OutputFilename, EC);
+
+  auto BatchOrErr = PerfBatch::create(opts::PerfData, Binaries);
+  if (std::error_code EC = BatchOrErr.getError())
+    report_error(opts::PerfData, EC);
+  const auto &Batch = **BatchOrErr;
+
+  for (unsigned I = 0; I < Binaries.size(); ++I) {
+    SmallString<128> FDataName(opts::OutputFilename);
+    sys::path::append(FDataName, sys::path::filename(Binaries[I]) + ".fdata");
+    outs() << "PERF2BOLT: writing profile of " << Binaries[I] << " to "
+           << FDataName << '\n';
+
+    DataReader DR(errs());
+    DataAggregator DA(errs(), Binaries[I]);
+    DA.setOutputFDataName(FDataName);
+    DA.startBatch(opts::PerfData, Batch, I);
+
+    Expected<OwningBinary<Binary>> BinaryOrErr = createBinary(Binaries[I]);
+    if (auto E = BinaryOrErr.takeError())
+      report_error(Binaries[I], std::move(E));
+    auto *ELFObj = dyn_cast<ELFObjectFileBase>(BinaryOrErr->getBinary());
+    if (!ELFObj)
+      report_error(Binaries[I], object_error::invalid_file_type);
+
+    RewriteInstance RI(ELFObj, DR, DA, argc, argv);
+    RI.run();
+  }
+  PhaseStats::writeReport();
 }
 
 int main(int argc, char **argv) {
@@ -213,6 +616,11 @@ int main(int argc, char **argv) {
 
   ToolName = argv[0];
 
+  if (llvm::sys::path::filename(ToolName) == "llvm-bolt-server") {
+    boltServerMode(argc, argv);
+    ToolName = argv[0];
+  }
+
   if (llvm::sys::path::filename(ToolName) == "perf2bolt")
     perf2boltMode(argc, argv);
   else if (llvm::sys::path::filename(ToolName) == "llvm-boltdiff")
@@ -224,6 +632,15 @@ int main(int argc, char **argv) {
   if (!sys::fs::exists(opts::InputFilename))
     report_error(opts::InputFilename, errc::no_such_file_or_directory);
 
+  if (!opts::BatchBinaries.empty()) {
+    if (!opts::AggregateOnly || opts::PerfData.empty()) {
+      errs() << ToolName << ": -batch requires perf2bolt and -perfdata.\n";
+      exit(1);
+    }
+    perf2boltBatch(argc, argv);
+    return EXIT_SUCCESS;
+  }
+
   std::unique_ptr<bolt::DataReader> DR(new DataReader(errs()));
   std::unique_ptr<bolt::DataAggregator> DA(
       new DataAggregator(errs(), opts::InputFilename));
@@ -242,10 +659,18 @@ int main(int argc, char **argv) {
         "-aggregate-only or perf2bolt.\n!!! Proceed on your own risk. !!!\n";
     }
     DA->start(opts::PerfData);
+  } else if (PreloadedProfile &&
+             PreloadedProfileName == opts::InputDataFilename) {
+    DR = std::move(PreloadedProfile);
+    if (opts::DumpData) {
+      DR->dump();
+      return EXIT_SUCCESS;
+    }
   } else if (!opts::InputDataFilename.empty()) {
     if (!sys::fs::exists(opts::InputDataFilename))
       report_error(opts::InputDataFilename, errc::no_such_file_or_directory);
 
+    PhaseStats::Scope Stats("readProfile");
     auto ReaderOrErr =
         bolt::DataReader::readPerfData(opts::InputDataFilename, errs());
     if (std::error_code EC = ReaderOrErr.getError())
@@ -268,6 +693,9 @@ int main(int argc, char **argv) {
     if (auto *e = dyn_cast<ELFObjectFileBase>(&Binary)) {
       RewriteInstance RI(e, *DR.get(), *DA.get(), argc, argv);
       RI.run();
+      PhaseStats::writeReport();
+      if (opts::CheckDeterminism && !opts::AggregateOnly)
+        checkDeterminism(argc, argv);
     } else {
       report_error(opts::InputFilename, object_error::invalid_file_type);
     }
@@ -312,6 +740,7 @@ int main(int argc, char **argv) {
              << opts::InputDataFilename2 << "\n";
       RI2.run();
       RI1.compare(RI2);
+      PhaseStats::writeReport();
     } else {
       report_error(opts::InputFilename2, object_error::invalid_file_type);
     }
@@ -9,16 +9,46 @@
 //
 // merge-fdata 1.fdata 2.fdata 3.fdata > merged.fdata
 //
+// Inputs are either YAML profiles or fdata profiles in text, binary or
+// compressed format.
+//
+// The profile of a few functions is extracted with -funcs. Only the blocks
+// holding these functions are decompressed from compressed inputs:
+//
+// merge-fdata -funcs=main,foo large.fdata > main-foo.fdata
+//
+// Counts of every input can be scaled with -weights, and decayed with
+// -half-life according to the age of the input file. Since a merged profile
+// is written with decayed counts, a rolling profile is maintained by merging
+// new inputs into the previous merged profile with the same -half-life:
+//
+// merge-fdata -half-life=24 rolling.fdata new.fdata > rolling.new.fdata
+//
+// Counters collected by a binary instrumented with "llvm-bolt -instrument" are
+// converted into fdata using the map file written by llvm-bolt:
+//
+// merge-fdata a.out.bolt.instr-map -instrumentation-counters=/tmp/prof.raw
+//
 //===----------------------------------------------------------------------===//
 
+#include "../DataReader.h"
 #include "../ProfileYAMLMapping.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/Object/Binary.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/Signals.h"
+#include "llvm/Support/ThreadPool.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <tuple>
 #include <unordered_map>
 
 using namespace llvm;
@@ -42,6 +72,71 @@ InputDataFilenames(
   cl::OneOrMore,
   cl::cat(MergeFdataCategory));
 
+static cl::opt<bool>
+BinaryFData("binary-fdata",
+  cl::desc("write merged fdata profile in binary format"),
+  cl::init(false),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<bool>
+CompressedFData("compressed-fdata",
+  cl::desc("write merged fdata profile in binary format, sorted by function "
+           "and compressed in blocks that are read separately"),
+  cl::init(false),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
+static cl::list<std::string>
+FunctionNames("funcs",
+  cl::CommaSeparated,
+  cl::desc("only merge the profile of the given functions, as named in fdata"),
+  cl::value_desc("func1,func2,func3,..."),
+  cl::ZeroOrMore,
+  cl::cat(MergeFdataCategory));
+
+static cl::list<double>
+Weights("weights",
+  cl::CommaSeparated,
+  cl::desc("factors to multiply counts of the inputs by, one per input in the "
+           "order of inputs"),
+  cl::value_desc("w1,w2,..."),
+  cl::ZeroOrMore,
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<double>
+HalfLife("half-life",
+  cl::desc("decay counts of every input exponentially with the age of the "
+           "input file, halving them every given number of hours "
+           "(0 - no decay)"),
+  cl::init(0),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<unsigned>
+PruneMinCount("prune-min-count",
+  cl::desc("remove functions, and branches from instructions, with a total "
+           "count below the given value from the merged profile"),
+  cl::init(0),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<double>
+PruneRatio("prune-ratio",
+  cl::desc("remove branches from instructions with a total count below the "
+           "given fraction of the count of their function from the merged "
+           "profile"),
+  cl::init(0),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<unsigned>
+NumThreads("j",
+  cl::desc("number of threads parsing and merging fdata profiles"),
+  cl::init(1),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
 static cl::opt<SortType>
 PrintFunctionList("print",
   cl::desc("print the list of objects with count to stderr"),
@@ -57,6 +152,15 @@ PrintFunctionList("print",
       "print functions sorted by total branch count")),
   cl::cat(MergeFdataCategory));
 
+static cl::opt<std::string>
+InstrumentationCounters("instrumentation-counters",
+  cl::desc("convert counters accumulated by a binary instrumented with "
+           "-instrument into fdata, given the map written by BOLT as the "
+           "only input"),
+  cl::value_desc("raw counters file"),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
 static cl::opt<bool>
 SuppressMergedDataOutput("q",
   cl::desc("do not print merged data to stdout"),
@@ -81,6 +185,47 @@ static void report_error(Twine Message, StringRef CustomError) {
   exit(1);
 }
 
+/// Return the factor to multiply the counts of the input \p I by, based on
+/// -weights and -half-life.
+double getInputWeight(unsigned I) {
+  StringRef Filename = opts::InputDataFilenames[I];
+  double Weight = opts::Weights.empty() ? 1.0 : opts::Weights[I];
+  if (opts::HalfLife <= 0 || Filename == "-")
+    return Weight;
+
+  sys::fs::file_status Status;
+  if (std::error_code EC = sys::fs::status(Filename, Status))
+    report_error(Filename, EC);
+  const auto Age = std::chrono::system_clock::now() -
+                   Status.getLastModificationTime();
+  const double AgeInHours =
+    std::chrono::duration_cast<std::chrono::seconds>(Age).count() / 3600.0;
+  if (AgeInHours > 0)
+    Weight *= std::exp2(-AgeInHours / opts::HalfLife);
+  return Weight;
+}
+
+/// Multiply all counts of \p BF by \p Factor, rounding them to the nearest
+/// integer.
+void scaleFunctionProfile(BinaryFunctionProfile &BF, double Factor) {
+  auto scale = [Factor](uint64_t Count) -> uint64_t {
+    return std::llround(Count * Factor);
+  };
+  BF.ExecCount = scale(BF.ExecCount);
+  for (auto &BB : BF.Blocks) {
+    BB.ExecCount = scale(BB.ExecCount);
+    BB.EventCount = scale(BB.EventCount);
+    for (auto &CS : BB.CallSites) {
+      CS.Count = scale(CS.Count);
+      CS.Mispreds = scale(CS.Mispreds);
+    }
+    for (auto &SI : BB.Successors) {
+      SI.Count = scale(SI.Count);
+      SI.Mispreds = scale(SI.Mispreds);
+    }
+  }
+}
+
 void mergeProfileHeaders(BinaryProfileHeader &MergedHeader,
                          const BinaryProfileHeader &Header) {
   if (MergedHeader.FileName.empty()) {
@@ -233,6 +378,287 @@ void mergeFunctionProfile(BinaryFunctionProfile &MergedBF,
   }
 }
 
+/// Merge profiles in fdata format (text or binary) and write the result to
+/// stdout. Inputs that are not in \p Buffers are read when they are merged.
+/// Every thread folds inputs into its own profile as soon as they are parsed,
+/// and only then are the per-thread profiles merged. Memory use thus depends
+/// on the number of threads and functions, and not on the number of inputs.
+/// Return the list of merged functions with their execution and total branch
+/// counts.
+std::vector<std::tuple<StringRef, uint64_t, uint64_t>>
+mergeFData(std::vector<std::unique_ptr<MemoryBuffer>> &&Buffers,
+           std::vector<std::unique_ptr<llvm::bolt::DataReader>> &Readers) {
+  using llvm::bolt::DataReader;
+
+  const unsigned NumInputs = Buffers.size();
+  const unsigned NumThreads =
+    std::max(1u, std::min<unsigned>(opts::NumThreads, NumInputs));
+
+  // Per-thread profiles. They own the names of the records.
+  std::vector<std::unique_ptr<DataReader>> ThreadReaders;
+  for (unsigned T = 0; T < NumThreads; ++T)
+    ThreadReaders.emplace_back(llvm::make_unique<DataReader>(errs()));
+
+  std::vector<double> InputWeights(NumInputs);
+  for (unsigned I = 0; I < NumInputs; ++I)
+    InputWeights[I] = getInputWeight(I);
+
+  std::vector<std::error_code> Errors(NumInputs);
+  std::vector<char> HasLBR(NumInputs);
+  std::atomic<unsigned> NextInput{0};
+  std::mutex DiagMutex;
+
+  auto mergeInputs = [&](DataReader &ThreadReader) {
+    for (unsigned I = NextInput++; I < NumInputs; I = NextInput++) {
+      const auto &Filename = opts::InputDataFilenames[I];
+      auto Buffer = std::move(Buffers[I]);
+      if (!Buffer) {
+        auto MB = MemoryBuffer::getFileOrSTDIN(Filename);
+        if ((Errors[I] = MB.getError()))
+          return;
+        Buffer = std::move(MB.get());
+      }
+
+      {
+        std::lock_guard<std::mutex> Lock(DiagMutex);
+        errs() << "Merging data from " << Filename;
+        if (InputWeights[I] != 1.0)
+          errs() << " with weight " << format("%.4f", InputWeights[I]);
+        errs() << "...\n";
+      }
+
+      DataReader Reader(std::move(Buffer), errs());
+      if (!opts::FunctionNames.empty()) {
+        Reader.setFunctionFilter(
+            std::vector<std::string>(opts::FunctionNames.begin(),
+                                     opts::FunctionNames.end()));
+      }
+      if ((Errors[I] = Reader.parse()))
+        return;
+      HasLBR[I] = Reader.hasLBR();
+      if (InputWeights[I] != 1.0)
+        Reader.scaleCounts(InputWeights[I]);
+
+      ThreadReader.mergeProfile(Reader, /*CopyNames=*/true);
+    }
+  };
+
+  if (NumThreads == 1) {
+    mergeInputs(*ThreadReaders.front());
+  } else {
+    ThreadPool Pool(NumThreads);
+    for (auto &ThreadReader : ThreadReaders)
+      Pool.async(mergeInputs, std::ref(*ThreadReader));
+    Pool.wait();
+  }
+
+  for (unsigned I = 0; I < NumInputs; ++I) {
+    if (Errors[I])
+      report_error(opts::InputDataFilenames[I], Errors[I]);
+    if (HasLBR[I] != HasLBR.front()) {
+      errs() << "ERROR: cannot merge LBR profile with non-LBR profile\n";
+      exit(1);
+    }
+  }
+
+  std::unique_ptr<DataReader> MergedReader;
+  if (NumThreads == 1) {
+    MergedReader = std::move(ThreadReaders.front());
+  } else {
+    MergedReader = llvm::make_unique<DataReader>(errs());
+    for (auto &ThreadReader : ThreadReaders) {
+      MergedReader->mergeProfile(*ThreadReader);
+      // Names in the merged profile reference the per-thread profiles.
+      Readers.emplace_back(std::move(ThreadReader));
+    }
+  }
+
+  if (opts::PruneMinCount || opts::PruneRatio > 0) {
+    uint64_t NumRecords;
+    uint64_t NumFunctions;
+    std::tie(NumRecords, NumFunctions) =
+      MergedReader->pruneProfile(opts::PruneMinCount, opts::PruneRatio);
+    errs() << "Pruned " << NumRecords << " records and " << NumFunctions
+           << " functions\n";
+  }
+
+  if (!opts::SuppressMergedDataOutput) {
+    if (opts::CompressedFData)
+      MergedReader->writeCompressedProfile(outs());
+    else if (opts::BinaryFData)
+      MergedReader->writeBinaryProfile(outs());
+    else
+      MergedReader->writeProfile(outs());
+  }
+
+  std::vector<std::tuple<StringRef, uint64_t, uint64_t>> FunctionList;
+  for (const auto &Func : MergedReader->getAllFuncsBranchData()) {
+    uint64_t BranchCount = 0;
+    for (const auto &BI : Func.getValue().Data)
+      BranchCount += BI.Branches;
+    FunctionList.emplace_back(Func.getKey(), Func.getValue().ExecutionCount,
+                              BranchCount);
+  }
+  for (const auto &Func : MergedReader->getAllFuncsSampleData()) {
+    uint64_t SampleCount = 0;
+    for (const auto &SI : Func.getValue().Data)
+      SampleCount += SI.Hits;
+    FunctionList.emplace_back(Func.getKey(), SampleCount, SampleCount);
+  }
+
+  Readers.emplace_back(std::move(MergedReader));
+  return FunctionList;
+}
+
+/// Print fdata records of the instrumentation map \p MapFilename with counts
+/// from the counters file \p CountersFilename. The map lists the flow graph
+/// of every function, where counted edges refer to counters summed over all
+/// shards. Counts of the remaining edges, which form a spanning tree, follow
+/// from flow conservation: a node with a single edge of unknown count
+/// determines that count, and the leaves of the tree always have one.
+void convertInstrumentationCounters(StringRef MapFilename,
+                                    StringRef CountersFilename) {
+  auto MapMB = MemoryBuffer::getFile(MapFilename);
+  if (std::error_code EC = MapMB.getError())
+    report_error(MapFilename, EC);
+  auto CountersMB = MemoryBuffer::getFile(CountersFilename, -1,
+                                          /*RequiresNullTerminator=*/false);
+  if (std::error_code EC = CountersMB.getError())
+    report_error(CountersFilename, EC);
+
+  StringRef Map = MapMB.get()->getBuffer();
+  auto nextLine = [&]() {
+    StringRef Line;
+    std::tie(Line, Map) = Map.split('\n');
+    return Line;
+  };
+  auto invalidLine = [&](StringRef Line) {
+    report_error(MapFilename, "invalid line \"" + Line.str() + "\"");
+  };
+
+  StringRef Header = nextLine();
+  SmallVector<StringRef, 6> Fields;
+  Header.split(Fields, ' ');
+  uint64_t NumCounters, NumShards, ShardSize;
+  if (Fields.size() != 6 || Fields[0] != "counters" ||
+      Fields[2] != "shards" || Fields[4] != "shard-size" ||
+      Fields[1].getAsInteger(10, NumCounters) ||
+      Fields[3].getAsInteger(10, NumShards) ||
+      Fields[5].getAsInteger(10, ShardSize))
+    invalidLine(Header);
+
+  StringRef Raw = CountersMB.get()->getBuffer();
+  if (Raw.size() < NumShards * ShardSize ||
+      ShardSize < NumCounters * sizeof(uint64_t))
+    report_error(CountersFilename, "counters file does not match the map");
+
+  std::vector<uint64_t> Counters(NumCounters, 0);
+  for (uint64_t Shard = 0; Shard < NumShards; ++Shard) {
+    const char *Data = Raw.data() + Shard * ShardSize;
+    for (uint64_t I = 0; I < NumCounters; ++I)
+      Counters[I] += support::endian::read64le(Data + I * sizeof(uint64_t));
+  }
+
+  struct FlowEdge {
+    unsigned From;
+    unsigned To;
+    bool Known;
+    int64_t Count;
+    StringRef Record;
+  };
+
+  while (!Map.empty()) {
+    StringRef Line = nextLine();
+    if (Line.empty())
+      continue;
+
+    Fields.clear();
+    Line.split(Fields, ' ');
+    unsigned NumNodes, NumEdges;
+    if (Fields.size() != 4 || Fields[0] != "function" ||
+        Fields[2].getAsInteger(10, NumNodes) ||
+        Fields[3].getAsInteger(10, NumEdges))
+      invalidLine(Line);
+
+    std::vector<FlowEdge> Edges;
+    std::vector<std::vector<unsigned>> Incident(NumNodes);
+    std::vector<unsigned> NumUnknown(NumNodes, 0);
+    for (unsigned I = 0; I < NumEdges; ++I) {
+      Line = nextLine();
+      Fields.clear();
+      Line.split(Fields, ' ', /*MaxSplit=*/4);
+      FlowEdge Edge;
+      if (Fields.size() < 4 || Fields[0] != "edge" ||
+          Fields[1].getAsInteger(10, Edge.From) ||
+          Fields[2].getAsInteger(10, Edge.To) || Edge.From >= NumNodes ||
+          Edge.To >= NumNodes)
+        invalidLine(Line);
+
+      StringRef Counter = Fields[3];
+      Edge.Known = Counter != "-";
+      Edge.Count = 0;
+      if (Edge.Known) {
+        uint64_t Index;
+        if (!Counter.consume_front("c") || Counter.getAsInteger(10, Index) ||
+            Index >= NumCounters)
+          invalidLine(Line);
+        Edge.Count = Counters[Index];
+      }
+      if (Fields.size() == 5)
+        Edge.Record = Fields[4];
+
+      // Self-loops do not affect the balance of a node.
+      if (Edge.From != Edge.To) {
+        Incident[Edge.From].push_back(Edges.size());
+        Incident[Edge.To].push_back(Edges.size());
+        if (!Edge.Known) {
+          ++NumUnknown[Edge.From];
+          ++NumUnknown[Edge.To];
+        }
+      }
+      Edges.emplace_back(Edge);
+    }
+
+    std::vector<unsigned> Worklist;
+    for (unsigned Node = 0; Node < NumNodes; ++Node) {
+      if (NumUnknown[Node] == 1)
+        Worklist.push_back(Node);
+    }
+    while (!Worklist.empty()) {
+      const auto Node = Worklist.back();
+      Worklist.pop_back();
+      if (NumUnknown[Node] != 1)
+        continue;
+
+      int64_t Balance = 0;
+      FlowEdge *Unknown = nullptr;
+      for (auto I : Incident[Node]) {
+        auto &Edge = Edges[I];
+        if (!Edge.Known) {
+          Unknown = &Edge;
+          continue;
+        }
+        Balance += Edge.To == Node ? Edge.Count : -Edge.Count;
+      }
+      // The unknown edge restores the balance of the node.
+      Unknown->Count = Unknown->To == Node ? -Balance : Balance;
+      Unknown->Known = true;
+      for (auto End : {Unknown->From, Unknown->To}) {
+        if (--NumUnknown[End] == 1)
+          Worklist.push_back(End);
+      }
+    }
+
+    for (const auto &Edge : Edges) {
+      // Counters are updated without synchronization with a running program,
+      // so a derived count could come out negative.
+      if (Edge.Known && Edge.Count > 0 && !Edge.Record.empty() &&
+          !opts::SuppressMergedDataOutput)
+        outs() << Edge.Record << ' ' << Edge.Count << '\n';
+    }
+  }
+}
+
 } // anonymous namespace
 
 int main(int argc, char **argv) {
@@ -249,112 +675,163 @@ int main(int argc, char **argv) {
 
   ToolName = argv[0];
 
-  // Merged header.
-  BinaryProfileHeader MergedHeader;
-  MergedHeader.Version = 1;
-
-  // Merged information for all functions.
-  StringMap<BinaryFunctionProfile> MergedBFs;
+  if (!opts::InstrumentationCounters.empty()) {
+    if (opts::InputDataFilenames.size() != 1) {
+      errs() << "ERROR: -instrumentation-counters expects a single "
+                "instrumentation map as the input\n";
+      exit(1);
+    }
+    convertInstrumentationCounters(opts::InputDataFilenames.front(),
+                                   opts::InstrumentationCounters);
+    return 0;
+  }
 
+  // Inputs in fdata format are read again when merged, unless they come from
+  // stdin, so that only the inputs being merged are kept in memory.
+  std::vector<std::unique_ptr<MemoryBuffer>> Buffers;
+  unsigned NumYAMLInputs = 0;
   for (auto &InputDataFilename : opts::InputDataFilenames) {
     auto MB = MemoryBuffer::getFileOrSTDIN(InputDataFilename);
     if (std::error_code EC = MB.getError())
       report_error(InputDataFilename, EC);
-    yaml::Input YamlInput(MB.get()->getBuffer());
+    if (MB.get()->getBuffer().startswith("---"))
+      ++NumYAMLInputs;
+    else if (InputDataFilename != "-")
+      MB.get().reset();
+    Buffers.emplace_back(std::move(MB.get()));
+  }
 
-    errs() << "Merging data from " << InputDataFilename << "...\n";
+  if (!opts::Weights.empty() &&
+      opts::Weights.size() != opts::InputDataFilenames.size()) {
+    errs() << "ERROR: -weights expects one weight per input\n";
+    exit(1);
+  }
 
-    BinaryProfile BP;
-    YamlInput >> BP;
-    if (YamlInput.error())
-      report_error(InputDataFilename, YamlInput.error());
+  if (NumYAMLInputs && NumYAMLInputs != Buffers.size()) {
+    errs() << "ERROR: cannot merge YAML profile with fdata profile\n";
+    exit(1);
+  }
 
-    // Sanity check.
-    if (BP.Header.Version != 1) {
-      errs() << "Unable to merge data from profile using version "
-             << BP.Header.Version << '\n';
-      exit(1);
-    }
+  if (NumYAMLInputs && !opts::FunctionNames.empty()) {
+    errs() << "ERROR: -funcs is only supported for fdata profiles\n";
+    exit(1);
+  }
 
-    // Merge the header.
-    mergeProfileHeaders(MergedHeader, BP.Header);
+  if (opts::CompressedFData && !zlib::isAvailable()) {
+    errs() << "ERROR: zlib is required for -compressed-fdata\n";
+    exit(1);
+  }
 
-    // Do the function merge.
-    for (auto &BF : BP.Functions) {
-      if (!MergedBFs.count(BF.Name)) {
-        MergedBFs.insert(std::make_pair(BF.Name, BF));
-        continue;
-      }
+  // List of function names with execution and total branch counts.
+  std::vector<std::tuple<StringRef, uint64_t, uint64_t>> FunctionList;
 
-      auto &MergedBF = MergedBFs.find(BF.Name)->second;
-      mergeFunctionProfile(MergedBF, std::move(BF));
-    }
-  }
+  // Merged information for all functions in YAML format.
+  StringMap<BinaryFunctionProfile> MergedBFs;
 
-  if (!opts::SuppressMergedDataOutput) {
-    yaml::Output YamlOut(outs());
+  // Readers own the strings referenced by the merged fdata profile.
+  std::vector<std::unique_ptr<llvm::bolt::DataReader>> Readers;
 
-    BinaryProfile MergedProfile;
-    MergedProfile.Header = MergedHeader;
-    MergedProfile.Functions.resize(MergedBFs.size());
-    std::transform(MergedBFs.begin(),
-                   MergedBFs.end(),
-                   MergedProfile.Functions.begin(),
-                   [] (StringMapEntry<BinaryFunctionProfile> &V) {
-                     return V.second;
-                   });
+  if (!NumYAMLInputs) {
+    FunctionList = mergeFData(std::move(Buffers), Readers);
+  } else {
+    // Merged header.
+    BinaryProfileHeader MergedHeader;
+    MergedHeader.Version = 1;
 
-    // For consistency, sort functions by their IDs.
-    std::sort(MergedProfile.Functions.begin(), MergedProfile.Functions.end(),
-              [] (const BinaryFunctionProfile &A,
-                  const BinaryFunctionProfile &B) {
-                return A.Id < B.Id;
-              });
+    for (unsigned I = 0; I < Buffers.size(); ++I) {
+      StringRef InputDataFilename = opts::InputDataFilenames[I];
+      yaml::Input YamlInput(Buffers[I]->getBuffer());
 
-    YamlOut << MergedProfile;
-  }
+      errs() << "Merging data from " << InputDataFilename << "...\n";
 
-  errs() << "Data for " << MergedBFs.size()
-         << " unique objects successfully merged.\n";
+      BinaryProfile BP;
+      YamlInput >> BP;
+      if (YamlInput.error())
+        report_error(InputDataFilename, YamlInput.error());
 
-  if (opts::PrintFunctionList != opts::ST_NONE) {
-    // List of function names with execution count.
-    std::vector<std::pair<uint64_t, StringRef>> FunctionList(MergedBFs.size());
-    using CountFuncType =
-      std::function<std::pair<uint64_t, StringRef>(
-          const StringMapEntry<BinaryFunctionProfile> &)>;
-    CountFuncType ExecCountFunc =
-        [](const StringMapEntry<BinaryFunctionProfile> &V) {
-      return std::make_pair(V.second.ExecCount,
-                            StringRef(V.second.Name));
-    };
-    CountFuncType BranchCountFunc =
-        [](const StringMapEntry<BinaryFunctionProfile> &V) {
-      // Return total branch count.
+      // Sanity check.
+      if (BP.Header.Version != 1) {
+        errs() << "Unable to merge data from profile using version "
+               << BP.Header.Version << '\n';
+        exit(1);
+      }
+
+      // Merge the header.
+      mergeProfileHeaders(MergedHeader, BP.Header);
+
+      const double Weight = getInputWeight(I);
+      if (Weight != 1.0) {
+        for (auto &BF : BP.Functions)
+          scaleFunctionProfile(BF, Weight);
+      }
+
+      // Do the function merge.
+      for (auto &BF : BP.Functions) {
+        if (!MergedBFs.count(BF.Name)) {
+          MergedBFs.insert(std::make_pair(BF.Name, BF));
+          continue;
+        }
+
+        auto &MergedBF = MergedBFs.find(BF.Name)->second;
+        mergeFunctionProfile(MergedBF, std::move(BF));
+      }
+    }
+
+    if (!opts::SuppressMergedDataOutput) {
+      yaml::Output YamlOut(outs());
+
+      BinaryProfile MergedProfile;
+      MergedProfile.Header = MergedHeader;
+      MergedProfile.Functions.resize(MergedBFs.size());
+      std::transform(MergedBFs.begin(),
+                     MergedBFs.end(),
+                     MergedProfile.Functions.begin(),
+                     [] (StringMapEntry<BinaryFunctionProfile> &V) {
+                       return V.second;
+                     });
+
+      // For consistency, sort functions by their IDs.
+      std::sort(MergedProfile.Functions.begin(),
+                MergedProfile.Functions.end(),
+                [] (const BinaryFunctionProfile &A,
+                    const BinaryFunctionProfile &B) {
+                  return A.Id < B.Id;
+                });
+
+      YamlOut << MergedProfile;
+    }
+
+    for (const auto &V : MergedBFs) {
+      // Total branch count.
       uint64_t BranchCount = 0;
       for (const auto &BI : V.second.Blocks) {
         for (const auto &SI : BI.Successors) {
           BranchCount += SI.Count;
         }
       }
-      return std::make_pair(BranchCount,
-                            StringRef(V.second.Name));
-    };
-
-    CountFuncType CountFunc = (opts::PrintFunctionList == opts::ST_EXEC_COUNT)
-       ? ExecCountFunc
-       : BranchCountFunc;
-    std::transform(MergedBFs.begin(),
-                   MergedBFs.end(),
-                   FunctionList.begin(),
-                   CountFunc);
-    std::stable_sort(FunctionList.rbegin(), FunctionList.rend());
+      FunctionList.emplace_back(StringRef(V.second.Name), V.second.ExecCount,
+                                BranchCount);
+    }
+  }
+
+  errs() << "Data for " << FunctionList.size()
+         << " unique objects successfully merged.\n";
+
+  if (opts::PrintFunctionList != opts::ST_NONE) {
+    std::vector<std::pair<uint64_t, StringRef>> SortedList;
+    for (const auto &FI : FunctionList) {
+      SortedList.emplace_back(opts::PrintFunctionList == opts::ST_EXEC_COUNT
+                                ? std::get<1>(FI)
+                                : std::get<2>(FI),
+                              std::get<0>(FI));
+    }
+    std::stable_sort(SortedList.rbegin(), SortedList.rend());
     errs() << "Functions sorted by "
            << (opts::PrintFunctionList == opts::ST_EXEC_COUNT
                 ? "execution"
                 : "total branch")
            << " count:\n";
-    for (auto &FI : FunctionList) {
+    for (auto &FI : SortedList) {
       errs() << FI.second << " : " << FI.first << '\n';
     }
   }